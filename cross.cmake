@@ -43,29 +43,72 @@ add_assets(assets
 add_executable(pkgj
   ${assets}
   src/aes128.cpp
+  src/asyncreader.cpp
+  src/asyncwriter.cpp
   src/bgdl.cpp
+  src/cardhttp.cpp
+  src/chunkhashes.cpp
   src/comppackdb.cpp
   src/config.cpp
   src/db.cpp
   src/dialog.cpp
   src/download.cpp
   src/downloader.cpp
-  src/extractzip.cpp
+  src/downloadhistory.cpp
+  src/downloadschedule.cpp
   src/filedownload.cpp
+  src/fileserver.cpp
   src/gameview.cpp
+  src/httpoptions.cpp
+  src/httptrace.cpp
+  src/iconcache.cpp
   src/patchinfo.cpp
+  src/patchinfocache.cpp
+  src/packagemanifest.cpp
+  src/packagepeekfetcher.cpp
   src/patchinfofetcher.cpp
+  src/peercache.cpp
   src/imgui.cpp
+  src/inflater.cpp
   src/install.cpp
+  src/isoblockdecoder.cpp
+  src/isocompressor.cpp
+  src/log.cpp
+  src/lzrc.cpp
+  src/manifest.cpp
+  src/memstats.cpp
+  src/memorybudget.cpp
+  src/offload.cpp
   src/menu.cpp
+  src/mirrorrace.cpp
+  src/packageverifier.cpp
   src/pkgi.cpp
+  src/presencescanner.cpp
+  src/titlemetadata.cpp
+  src/updatechecker.cpp
   src/puff.c
+  src/pacedhttp.cpp
+  src/ratelimiter.cpp
+  src/readaheadhttp.cpp
+  src/recordinghttp.cpp
+  src/resumejournal.cpp
+  src/segmentedhttp.cpp
   src/sfo.cpp
   src/sha256.cpp
+  src/stagestats.cpp
+  src/storageprobe.cpp
+  src/suspendgate.cpp
+  src/taskpool.cpp
+  src/textwidths.cpp
+  src/trace.cpp
+  src/trash.cpp
+  src/uievents.cpp
   src/update.cpp
   src/vita.cpp
   src/vitafile.cpp
   src/vitahttp.cpp
+  src/vitasocket.cpp
+  src/zipstream.cpp
   src/zrif.cpp
 )
 
@@ -75,7 +118,6 @@ target_link_libraries(pkgj
   CONAN_PKG::boost_scope_exit
   CONAN_PKG::vitasqlite
   CONAN_PKG::cereal
-  CONAN_PKG::libzip
   CONAN_PKG::imgui
   CONAN_PKG::taihen
   png
@@ -1,17 +1,47 @@
+find_package(Threads REQUIRED)
+
 add_executable(pkgj_cli
+  src/allocationcounter.cpp
+  src/cardhttp.cpp
+  src/chunkhashes.cpp
   src/comppackdb.cpp
   src/db.cpp
   src/download.cpp
   src/extractzip.cpp
   src/filedownload.cpp
+  src/fileserver.cpp
+  src/isoblockdecoder.cpp
+  src/isocompressor.cpp
+  src/log.cpp
+  src/lzrc.cpp
+  src/manifest.cpp
+  src/memstats.cpp
+  src/offload.cpp
+  src/packagemanifest.cpp
   src/patchinfo.cpp
+  src/posixsocket.cpp
   src/simulator.cpp
   src/aes128.cpp
   src/sfo.cpp
   src/sha256.cpp
+  src/stagestats.cpp
+  src/suspendgate.cpp
   src/filehttp.cpp
+  src/httpoptions.cpp
+  src/httptrace.cpp
+  src/inflater.cpp
+  src/readaheadhttp.cpp
+  src/resumejournal.cpp
+  src/asyncwriter.cpp
+  src/asyncreader.cpp
+  src/zipstream.cpp
   src/zrif.cpp
   src/puff.c
+  src/taskpool.cpp
+  src/pacedhttp.cpp
+  src/throttledhttp.cpp
+  src/trace.cpp
+  src/trash.cpp
   src/cli.cpp
 )
 
@@ -22,4 +52,30 @@ target_link_libraries(pkgj_cli
   CONAN_PKG::sqlite3
   CONAN_PKG::cereal
   CONAN_PKG::libzip
+  Threads::Threads
+)
+
+add_executable(pkgj_bench
+  src/aes128.cpp
+  src/allocationcounter.cpp
+  src/asyncreader.cpp
+  src/db.cpp
+  src/inflater.cpp
+  src/log.cpp
+  src/lzrc.cpp
+  src/memstats.cpp
+  src/puff.c
+  src/sha256.cpp
+  src/simulator.cpp
+  src/textwidths.cpp
+  src/trace.cpp
+  src/zrif.cpp
+  src/bench.cpp
+)
+
+target_link_libraries(pkgj_bench
+  CONAN_PKG::fmt
+  CONAN_PKG::boost_scope_exit
+  CONAN_PKG::libzip
+  Threads::Threads
 )
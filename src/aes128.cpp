@@ -289,6 +289,40 @@ void aes128_init_dec(aes128_ctx* ctx, const uint8_t* key)
     *dkey++ = ekey[1];
     *dkey++ = ekey[2];
     *dkey++ = ekey[3];
+
+#if __ARM_NEON__
+    // the middle round keys of aes128_psp_decrypt_neon, in the byte order
+    // of a block and with the 0x63 of the next inverse S-box in them
+    ASSERT_ALIGNED(ctx->key, 16);
+    ASSERT_ALIGNED(ctx->bskey, 16);
+    const uint8_t* rk8 =
+            static_cast<uint8_t*>(__builtin_assume_aligned(ctx->key, 16));
+    uint8_t* bskey =
+            static_cast<uint8_t*>(__builtin_assume_aligned(ctx->bskey, 16));
+
+    for (int i = 0; i < 9; i++)
+    {
+        uint8x16_t x0 = vrev32q_u8(vld1q_u8(rk8 + 16 * (i + 1)));
+        uint8x16_t x1 = x0;
+        uint8x16_t x2 = x0;
+        uint8x16_t x3 = x0;
+        uint8x16_t x4 = x0;
+        uint8x16_t x5 = x0;
+        uint8x16_t x6 = x0;
+        uint8x16_t x7 = x0;
+
+        BITSLICE(x7, x6, x5, x4, x3, x2, x1, x0);
+
+        vst1q_u8(bskey + 8 * 16 * i + 0 * 16, vmvnq_u8(x0));
+        vst1q_u8(bskey + 8 * 16 * i + 1 * 16, vmvnq_u8(x1));
+        vst1q_u8(bskey + 8 * 16 * i + 2 * 16, x2);
+        vst1q_u8(bskey + 8 * 16 * i + 3 * 16, x3);
+        vst1q_u8(bskey + 8 * 16 * i + 4 * 16, x4);
+        vst1q_u8(bskey + 8 * 16 * i + 5 * 16, vmvnq_u8(x5));
+        vst1q_u8(bskey + 8 * 16 * i + 6 * 16, vmvnq_u8(x6));
+        vst1q_u8(bskey + 8 * 16 * i + 7 * 16, x7);
+    }
+#endif
 }
 
 void aes128_ctr_init(aes128_ctx* ctx, const uint8_t* key)
@@ -1173,6 +1207,350 @@ static void aes128_ctr_neon(
     vst1q_u8(iv, vrev32q_u8(vreinterpretq_u8_u32(ctr)));
 }
 
+// The inverse cipher below uses the same SBOX circuit, between the inverse of
+// the affine transform of the S-box on its way in and on its way out, and
+// keeps the state in the natural byte order of a block, bit i of every byte
+// in xi. The 0x63 of the affine transform is folded in the round keys, see
+// aes128_init_dec.
+
+// inverse affine transform of the input of SBOX, b0..b7 in x0..x7
+#define INVSBOX_IN(                                                     \
+        x0, x1, x2, x3, x4, x5, x6, x7, t0, t1, t2, t3, t4, t5, t6, t7) \
+    do                                                                  \
+    {                                                                   \
+        t0 = veorq_u8(x2, x5);                                          \
+        t1 = veorq_u8(x3, x6);                                          \
+        t2 = veorq_u8(x4, x7);                                          \
+        t3 = veorq_u8(t0, x7);                                          \
+        t4 = veorq_u8(t0, x0);                                          \
+        t5 = veorq_u8(t1, x0);                                          \
+        t6 = veorq_u8(t1, x1);                                          \
+        t7 = veorq_u8(t2, x1);                                          \
+        t0 = veorq_u8(t2, x2);                                          \
+        x7 = veorq_u8(veorq_u8(x1, x4), x6);                            \
+        x6 = veorq_u8(veorq_u8(x0, x3), x5);                            \
+        x0 = t3;                                                        \
+        x1 = t5;                                                        \
+        x2 = t7;                                                        \
+        x3 = t4;                                                        \
+        x4 = t6;                                                        \
+        x5 = t0;                                                        \
+    } while (0)
+
+// inverse affine transform of the output of SBOX, back to bit i in xi
+#define INVSBOX_OUT(                                                    \
+        x0, x1, x2, x3, x4, x5, x6, x7, t0, t1, t2, t3, t4, t5, t6, t7) \
+    do                                                                  \
+    {                                                                   \
+        t0 = veorq_u8(x4, x7);                                          \
+        t1 = veorq_u8(x2, x6);                                          \
+        t2 = veorq_u8(x3, x5);                                          \
+        t3 = veorq_u8(t0, x5);                                          \
+        t4 = veorq_u8(t1, x0);                                          \
+        t5 = veorq_u8(t2, x1);                                          \
+        t6 = veorq_u8(t0, x0);                                          \
+        t7 = veorq_u8(t1, x1);                                          \
+        t0 = veorq_u8(t2, x4);                                          \
+        x6 = veorq_u8(veorq_u8(x0, x6), x7);                            \
+        x7 = veorq_u8(veorq_u8(x1, x3), x2);                            \
+        x0 = t3;                                                        \
+        x1 = t4;                                                        \
+        x2 = t5;                                                        \
+        x3 = t6;                                                        \
+        x4 = t7;                                                        \
+        x5 = t0;                                                        \
+    } while (0)
+
+#define INVSBOX(                                                        \
+        x0, x1, x2, x3, x4, x5, x6, x7, t0, t1, t2, t3, t4, t5, t6, t7) \
+    do                                                                  \
+    {                                                                   \
+        INVSBOX_IN(x0, x1, x2, x3, x4, x5, x6, x7, t0, t1, t2, t3, t4,  \
+                   t5, t6, t7);                                         \
+        SBOX(x0, x1, x2, x3, x4, x5, x6, x7, t0, t1, t2, t3, t4, t5, t6, \
+             t7);                                                       \
+        INVSBOX_OUT(x0, x1, x2, x3, x4, x5, x6, x7, t0, t1, t2, t3, t4, \
+                    t5, t6, t7);                                        \
+    } while (0)
+
+#define INVSHIFTROWS(x0, x1, x2, x3, x4, x5, x6, x7, shuffle) \
+    do                                                       \
+    {                                                        \
+        x0 = vtbl1q_u8(x0, shuffle);                         \
+        x1 = vtbl1q_u8(x1, shuffle);                         \
+        x2 = vtbl1q_u8(x2, shuffle);                         \
+        x3 = vtbl1q_u8(x3, shuffle);                         \
+        x4 = vtbl1q_u8(x4, shuffle);                         \
+        x5 = vtbl1q_u8(x5, shuffle);                         \
+        x6 = vtbl1q_u8(x6, shuffle);                         \
+        x7 = vtbl1q_u8(x7, shuffle);                         \
+    } while (0)
+
+// [a0, a1, a2, a3] => [a1, a2, a3, a0] in every column
+static inline uint8x16_t column_rot1(uint8x16_t x)
+{
+    uint32x4_t w = vreinterpretq_u32_u8(x);
+    return vreinterpretq_u8_u32(vsliq_n_u32(vshrq_n_u32(w, 8), w, 24));
+}
+
+// [a0, a1, a2, a3] => [a2, a3, a0, a1] in every column
+static inline uint8x16_t column_rot2(uint8x16_t x)
+{
+    return vreinterpretq_u8_u16(vrev32q_u16(vreinterpretq_u16_u8(x)));
+}
+
+// InvMixColumns is MixColumns after multiplying the columns by
+// [05, 00, 04, 00]: a[i] ^= 04 * (a[i] ^ a[i + 2]), then
+// out[i] = 02 * (a[i] ^ a[i + 1]) ^ a[i + 1] ^ a[i + 2] ^ a[i + 3]
+#define INVMIXCOLUMNS(                                                  \
+        x0, x1, x2, x3, x4, x5, x6, x7, t0, t1, t2, t3, t4, t5, t6, t7) \
+    do                                                                  \
+    {                                                                   \
+        t0 = veorq_u8(x0, column_rot2(x0));                             \
+        t1 = veorq_u8(x1, column_rot2(x1));                             \
+        t2 = veorq_u8(x2, column_rot2(x2));                             \
+        t3 = veorq_u8(x3, column_rot2(x3));                             \
+        t4 = veorq_u8(x4, column_rot2(x4));                             \
+        t5 = veorq_u8(x5, column_rot2(x5));                             \
+        t6 = veorq_u8(x6, column_rot2(x6));                             \
+        t7 = veorq_u8(x7, column_rot2(x7));                             \
+        x0 = veorq_u8(x0, t6);                                          \
+        x1 = veorq_u8(x1, veorq_u8(t7, t6));                            \
+        x2 = veorq_u8(x2, veorq_u8(t0, t7));                            \
+        x3 = veorq_u8(x3, veorq_u8(t1, t6));                            \
+        x4 = veorq_u8(x4, veorq_u8(veorq_u8(t2, t7), t6));              \
+        x5 = veorq_u8(x5, veorq_u8(t3, t7));                            \
+        x6 = veorq_u8(x6, t4);                                          \
+        x7 = veorq_u8(x7, t5);                                          \
+        t0 = column_rot1(x0);                                           \
+        t1 = column_rot1(x1);                                           \
+        t2 = column_rot1(x2);                                           \
+        t3 = column_rot1(x3);                                           \
+        t4 = column_rot1(x4);                                           \
+        t5 = column_rot1(x5);                                           \
+        t6 = column_rot1(x6);                                           \
+        t7 = column_rot1(x7);                                           \
+        x0 = veorq_u8(x0, t0);                                          \
+        x1 = veorq_u8(x1, t1);                                          \
+        x2 = veorq_u8(x2, t2);                                          \
+        x3 = veorq_u8(x3, t3);                                          \
+        x4 = veorq_u8(x4, t4);                                          \
+        x5 = veorq_u8(x5, t5);                                          \
+        x6 = veorq_u8(x6, t6);                                          \
+        x7 = veorq_u8(x7, t7);                                          \
+        t0 = veorq_u8(t0, column_rot2(x0));                             \
+        t1 = veorq_u8(t1, column_rot2(x1));                             \
+        t2 = veorq_u8(t2, column_rot2(x2));                             \
+        t3 = veorq_u8(t3, column_rot2(x3));                             \
+        t4 = veorq_u8(t4, column_rot2(x4));                             \
+        t5 = veorq_u8(t5, column_rot2(x5));                             \
+        t6 = veorq_u8(t6, column_rot2(x6));                             \
+        t7 = veorq_u8(t7, column_rot2(x7));                             \
+        t0 = veorq_u8(t0, x7);                                          \
+        t1 = veorq_u8(t1, veorq_u8(x0, x7));                            \
+        t2 = veorq_u8(t2, x1);                                          \
+        t3 = veorq_u8(t3, veorq_u8(x2, x7));                            \
+        t4 = veorq_u8(t4, veorq_u8(x3, x7));                            \
+        t5 = veorq_u8(t5, x4);                                          \
+        t6 = veorq_u8(t6, x5);                                          \
+        t7 = veorq_u8(t7, x6);                                          \
+        x0 = t0;                                                        \
+        x1 = t1;                                                        \
+        x2 = t2;                                                        \
+        x3 = t3;                                                        \
+        x4 = t4;                                                        \
+        x5 = t5;                                                        \
+        x6 = t6;                                                        \
+        x7 = t7;                                                        \
+    } while (0)
+
+#define ADDKEY(x0, x1, x2, x3, x4, x5, x6, x7, bskey) \
+    do                                               \
+    {                                                \
+        x0 = veorq_u8(x0, vld1q_u8(bskey + 0 * 16)); \
+        x1 = veorq_u8(x1, vld1q_u8(bskey + 1 * 16)); \
+        x2 = veorq_u8(x2, vld1q_u8(bskey + 2 * 16)); \
+        x3 = veorq_u8(x3, vld1q_u8(bskey + 3 * 16)); \
+        x4 = veorq_u8(x4, vld1q_u8(bskey + 4 * 16)); \
+        x5 = veorq_u8(x5, vld1q_u8(bskey + 5 * 16)); \
+        x6 = veorq_u8(x6, vld1q_u8(bskey + 6 * 16)); \
+        x7 = veorq_u8(x7, vld1q_u8(bskey + 7 * 16)); \
+    } while (0)
+
+// blocks must be a multiple of 8, the PGD blocks from index on
+static void aes128_psp_decrypt_neon(
+        const aes128_ctx* ctx,
+        const uint8_t* iv,
+        uint32_t index,
+        uint8_t* buffer,
+        uint32_t blocks)
+{
+    static const uint32_t one_bytes[] GCC_ALIGN(16) = {0, 0, 0, 1};
+    static const uint8_t ISR_bytes[] GCC_ALIGN(16) = {0x0,
+                                                      0xd,
+                                                      0xa,
+                                                      0x7,
+                                                      0x4,
+                                                      0x1,
+                                                      0xe,
+                                                      0xb,
+                                                      0x8,
+                                                      0x5,
+                                                      0x2,
+                                                      0xf,
+                                                      0xc,
+                                                      0x9,
+                                                      0x6,
+                                                      0x3};
+    const uint8x16_t shuffle = vld1q_u8(ISR_bytes);
+    const uint32x4_t one = vld1q_u32(one_bytes);
+
+    ASSERT_ALIGNED(ctx->key, 16);
+    ASSERT_ALIGNED(ctx->bskey, 16);
+    const uint8_t* key8 =
+            static_cast<uint8_t*>(__builtin_assume_aligned(ctx->key, 16));
+    const uint8x16_t first =
+            veorq_u8(vrev32q_u8(vld1q_u8(key8)), vdupq_n_u8(0x63));
+    const uint8x16_t last = vrev32q_u8(vld1q_u8(key8 + 16 * 10));
+
+    // the counter is little endian in the last word of the block
+    uint32x4_t ctr = vsetq_lane_u32(
+            index, vreinterpretq_u32_u8(vld1q_u8(iv)), 3);
+    // the first block of the data is xored with zeros instead of the counter
+    uint8x16_t prev =
+            index == 0 ? vdupq_n_u8(0) : vreinterpretq_u8_u32(ctr);
+
+    while (blocks != 0)
+    {
+        uint32x4_t c = ctr;
+        c = vaddq_u32(c, one);
+        uint8x16_t x0 = veorq_u8(vreinterpretq_u8_u32(c), first);
+        c = vaddq_u32(c, one);
+        uint8x16_t x1 = veorq_u8(vreinterpretq_u8_u32(c), first);
+        c = vaddq_u32(c, one);
+        uint8x16_t x2 = veorq_u8(vreinterpretq_u8_u32(c), first);
+        c = vaddq_u32(c, one);
+        uint8x16_t x3 = veorq_u8(vreinterpretq_u8_u32(c), first);
+        c = vaddq_u32(c, one);
+        uint8x16_t x4 = veorq_u8(vreinterpretq_u8_u32(c), first);
+        c = vaddq_u32(c, one);
+        uint8x16_t x5 = veorq_u8(vreinterpretq_u8_u32(c), first);
+        c = vaddq_u32(c, one);
+        uint8x16_t x6 = veorq_u8(vreinterpretq_u8_u32(c), first);
+        c = vaddq_u32(c, one);
+        uint8x16_t x7 = veorq_u8(vreinterpretq_u8_u32(c), first);
+
+        BITSLICE(x7, x6, x5, x4, x3, x2, x1, x0);
+
+        const uint8_t* bskey =
+                static_cast<uint8_t*>(__builtin_assume_aligned(ctx->bskey, 16));
+        uint8x16_t t0, t1, t2, t3, t4, t5, t6, t7;
+
+        // rounds [1..9]
+        for (int round = 0; round < 9; round++)
+        {
+            INVSBOX(x0,
+                    x1,
+                    x2,
+                    x3,
+                    x4,
+                    x5,
+                    x6,
+                    x7,
+                    t0,
+                    t1,
+                    t2,
+                    t3,
+                    t4,
+                    t5,
+                    t6,
+                    t7);
+            INVSHIFTROWS(x0, x1, x2, x3, x4, x5, x6, x7, shuffle);
+            INVMIXCOLUMNS(
+                    x0,
+                    x1,
+                    x2,
+                    x3,
+                    x4,
+                    x5,
+                    x6,
+                    x7,
+                    t0,
+                    t1,
+                    t2,
+                    t3,
+                    t4,
+                    t5,
+                    t6,
+                    t7);
+            ADDKEY(x0, x1, x2, x3, x4, x5, x6, x7, bskey);
+            bskey += 8 * 16;
+        }
+
+        // round 10 skips invmixcolumns
+        INVSBOX(x0,
+                x1,
+                x2,
+                x3,
+                x4,
+                x5,
+                x6,
+                x7,
+                t0,
+                t1,
+                t2,
+                t3,
+                t4,
+                t5,
+                t6,
+                t7);
+        INVSHIFTROWS(x0, x1, x2, x3, x4, x5, x6, x7, shuffle);
+
+        BITSLICE(x7, x6, x5, x4, x3, x2, x1, x0);
+
+        c = ctr;
+        x0 = veorq_u8(x0, prev);
+        c = vaddq_u32(c, one);
+        x1 = veorq_u8(x1, vreinterpretq_u8_u32(c));
+        c = vaddq_u32(c, one);
+        x2 = veorq_u8(x2, vreinterpretq_u8_u32(c));
+        c = vaddq_u32(c, one);
+        x3 = veorq_u8(x3, vreinterpretq_u8_u32(c));
+        c = vaddq_u32(c, one);
+        x4 = veorq_u8(x4, vreinterpretq_u8_u32(c));
+        c = vaddq_u32(c, one);
+        x5 = veorq_u8(x5, vreinterpretq_u8_u32(c));
+        c = vaddq_u32(c, one);
+        x6 = veorq_u8(x6, vreinterpretq_u8_u32(c));
+        c = vaddq_u32(c, one);
+        x7 = veorq_u8(x7, vreinterpretq_u8_u32(c));
+        c = vaddq_u32(c, one);
+        ctr = c;
+        prev = vreinterpretq_u8_u32(c);
+
+        x0 = veorq_u8(x0, veorq_u8(last, vld1q_u8(buffer + 16 * 0)));
+        x1 = veorq_u8(x1, veorq_u8(last, vld1q_u8(buffer + 16 * 1)));
+        x2 = veorq_u8(x2, veorq_u8(last, vld1q_u8(buffer + 16 * 2)));
+        x3 = veorq_u8(x3, veorq_u8(last, vld1q_u8(buffer + 16 * 3)));
+        x4 = veorq_u8(x4, veorq_u8(last, vld1q_u8(buffer + 16 * 4)));
+        x5 = veorq_u8(x5, veorq_u8(last, vld1q_u8(buffer + 16 * 5)));
+        x6 = veorq_u8(x6, veorq_u8(last, vld1q_u8(buffer + 16 * 6)));
+        x7 = veorq_u8(x7, veorq_u8(last, vld1q_u8(buffer + 16 * 7)));
+
+        vst1q_u8(buffer + 16 * 0, x0);
+        vst1q_u8(buffer + 16 * 1, x1);
+        vst1q_u8(buffer + 16 * 2, x2);
+        vst1q_u8(buffer + 16 * 3, x3);
+        vst1q_u8(buffer + 16 * 4, x4);
+        vst1q_u8(buffer + 16 * 5, x5);
+        vst1q_u8(buffer + 16 * 6, x6);
+        vst1q_u8(buffer + 16 * 7, x7);
+
+        blocks -= 8;
+        buffer += 16 * 8;
+    }
+}
+
 #endif
 
 void aes128_ctr(
@@ -1235,6 +1613,35 @@ void aes128_ctr(
     }
 }
 
+// Tiles are small enough to still be in L1 when they get decrypted right
+// after being hashed, and a multiple of both the SHA-256 block and the 8 AES
+// blocks the NEON path works on
+#define AES128_CTR_SHA256_TILE 2048
+
+void aes128_ctr_sha256(
+        const aes128_ctx* ctx,
+        const uint8_t* iv,
+        uint64_t offset,
+        sha256_ctx* sha,
+        uint8_t* buffer,
+        uint32_t size)
+{
+    while (size != 0)
+    {
+        // the first tile realigns offset on a tile boundary
+        uint32_t tile = min32(
+                size,
+                AES128_CTR_SHA256_TILE - offset % AES128_CTR_SHA256_TILE);
+
+        sha256_update(sha, buffer, tile);
+        aes128_ctr(ctx, iv, offset, buffer, tile);
+
+        buffer += tile;
+        offset += tile;
+        size -= tile;
+    }
+}
+
 // https://tools.ietf.org/rfc/rfc4493.txt
 
 typedef struct
@@ -1356,6 +1763,18 @@ void aes128_psp_decrypt(
 {
     assert(size % 16 == 0);
 
+#if __ARM_NEON__
+    uint32_t blocks = size / 16;
+    if (blocks >= 8)
+    {
+        uint32_t full = blocks & ~7;
+        aes128_psp_decrypt_neon(ctx, iv, index, buffer, full);
+        index += full;
+        buffer += full * 16;
+        size -= full * 16;
+    }
+#endif
+
     uint8_t GCC_ALIGN(16) prev[16];
     uint8_t GCC_ALIGN(16) block[16];
 
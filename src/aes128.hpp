@@ -1,11 +1,21 @@
 #pragma once
 
+#include "sha256.hpp"
 #include "utils.hpp"
 
+// Everything here runs on the ARM cores, with NEON where it pays off. The
+// console's AES/SHA engine is only reachable through the kernel
+// (SceSblSsMgrForDriver), which a user application can't call without
+// shipping a kernel plugin, so there is no hardware backend. Download keeps
+// these routines on its own thread instead, next to the reader and writer
+// stages.
+
 typedef struct
 {
     uint32_t key[4 * 11] GCC_ALIGN(16);
 #if __ARM_NEON__
+    // bitsliced middle round keys, laid out for aes128_ctr by
+    // aes128_ctr_init and for aes128_psp_decrypt by aes128_init_dec
     uint8_t bskey[16 * 8 * 9] GCC_ALIGN(16);
 #endif
 } aes128_ctx;
@@ -27,9 +37,21 @@ void aes128_ctr(
         uint8_t* buffer,
         uint32_t size);
 
+// same as sha256_update over the ciphertext followed by aes128_ctr, but
+// walks the buffer once
+void aes128_ctr_sha256(
+        const aes128_ctx* ctx,
+        const uint8_t* iv,
+        uint64_t offset,
+        sha256_ctx* sha,
+        uint8_t* buffer,
+        uint32_t size);
+
 void aes128_cmac(
         const uint8_t* key, const uint8_t* buffer, uint32_t size, uint8_t* mac);
 
+// decrypts size / 16 consecutive PGD blocks, index being the number of the
+// first one, so a buffer can be split anywhere on a block boundary
 void aes128_psp_decrypt(
         const aes128_ctx* ctx,
         const uint8_t* iv,
@@ -0,0 +1,34 @@
+#include "allocationcounter.hpp"
+
+#include <atomic>
+#include <new>
+
+#include <stdlib.h>
+
+static std::atomic<uint64_t> g_allocations{0};
+static std::atomic<uint64_t> g_allocated_bytes{0};
+
+AllocationCount pkgi_allocation_count()
+{
+    return {g_allocations.load(std::memory_order_relaxed),
+            g_allocated_bytes.load(std::memory_order_relaxed)};
+}
+
+void* operator new(size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (const auto ptr = malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
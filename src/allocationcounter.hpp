@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+// Counts the allocations of the host tools, their benchmarks tell a change by
+// the allocations it saves. Linking allocationcounter.cpp replaces the global
+// operator new, which only pkgj_cli and pkgj_bench do.
+struct AllocationCount
+{
+    uint64_t allocations;
+    uint64_t bytes;
+};
+
+// since the start of the process
+AllocationCount pkgi_allocation_count();
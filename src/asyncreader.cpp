@@ -0,0 +1,128 @@
+#include "asyncreader.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+
+static void* open_or_throw(const std::string& path)
+{
+    const auto file = pkgi_open(path.c_str());
+    if (!file)
+        throw formatEx<std::runtime_error>("无法打开 {}", path);
+    return file;
+}
+
+static uint64_t size_or_throw(const std::string& path)
+{
+    const auto size = pkgi_get_size(path.c_str());
+    if (size < 0)
+        throw formatEx<std::runtime_error>("无法获取 {} 的大小", path);
+    return size;
+}
+
+AsyncReader::AsyncReader(const std::string& path)
+    : _path(path)
+    , _size(size_or_throw(path))
+    , _file(open_or_throw(path))
+    , _chunks(WINDOW_CHUNKS)
+    , _chunk_sizes(WINDOW_CHUNKS)
+    , _cond("async_reader_cond")
+    , _thread("async_reader", [this] { run(); }, ThreadRole::Worker)
+{
+}
+
+AsyncReader::~AsyncReader()
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+    }
+    _cond.notify_all();
+    _thread.join();
+}
+
+void AsyncReader::run()
+{
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        pkgi_close(_file);
+    };
+
+    try
+    {
+        uint64_t pos = 0;
+        for (uint64_t chunk = 0; pos < _size; ++chunk)
+        {
+            {
+                ScopeLock _(_cond.get_mutex());
+                while (chunk - _consumed_chunks == WINDOW_CHUNKS && !_dying)
+                    _cond.wait();
+                if (_dying)
+                    return;
+            }
+
+            // the caller only touches the chunks before _read_chunks, and
+            // gave this one back
+            auto& data = _chunks[chunk % WINDOW_CHUNKS];
+            const auto size = min64(_size - pos, CHUNK_SIZE);
+            data.resize(size);
+            size_t filled = 0;
+            while (filled < size)
+            {
+                const auto read = pkgi_read(
+                        _file, data.data() + filled, size - filled);
+                if (read < 0)
+                    throw formatEx<std::runtime_error>("读取 {} 失败", _path);
+                if (read == 0)
+                    throw formatEx<std::runtime_error>(
+                            "读取 {} 失败: 文件被截断", _path);
+                filled += read;
+            }
+            pos += size;
+
+            {
+                ScopeLock _(_cond.get_mutex());
+                _chunk_sizes[chunk % WINDOW_CHUNKS] = size;
+                _read_chunks = chunk + 1;
+            }
+            _cond.notify_all();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("async read failed: {}", e.what());
+        {
+            ScopeLock _(_cond.get_mutex());
+            _error = std::current_exception();
+        }
+        _cond.notify_all();
+    }
+}
+
+size_t AsyncReader::next(const uint8_t*& data)
+{
+    const auto chunk_count = (_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    ScopeLock _(_cond.get_mutex());
+    if (_handed_out)
+    {
+        ++_consumed_chunks;
+        _handed_out = false;
+        _cond.notify_all();
+    }
+    if (_consumed_chunks == chunk_count)
+        return 0;
+
+    while (_read_chunks == _consumed_chunks && !_error)
+        _cond.wait();
+    if (_read_chunks == _consumed_chunks)
+        std::rethrow_exception(_error);
+
+    _handed_out = true;
+    data = _chunks[_consumed_chunks % WINDOW_CHUNKS].data();
+    return _chunk_sizes[_consumed_chunks % WINDOW_CHUNKS];
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "thread.hpp"
+
+#include <exception>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+// Reads a file in chunks on its own thread, at most WINDOW_CHUNKS ahead of
+// the caller, who goes through them in order with next(). Card latency
+// overlaps with parsing, and the memory stays at the window whatever the size
+// of the file.
+class AsyncReader
+{
+public:
+    static constexpr uint32_t CHUNK_SIZE = 256 * 1024;
+    static constexpr size_t WINDOW_CHUNKS = 4;
+
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader(AsyncReader&&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+    AsyncReader& operator=(AsyncReader&&) = delete;
+
+    // throws if the file can't be opened
+    AsyncReader(const std::string& path);
+    ~AsyncReader();
+
+    // blocks until the next chunk is read and points data at it, it stays
+    // valid until the following call. Returns its size, 0 at the end of the
+    // file, rethrows read errors
+    size_t next(const uint8_t*& data);
+
+    uint64_t size() const
+    {
+        return _size;
+    }
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    std::string _path;
+    uint64_t _size;
+    void* _file;
+
+    // the ring of chunks, chunk n is in _chunks[n % WINDOW_CHUNKS]
+    std::vector<std::vector<uint8_t>> _chunks;
+    std::vector<size_t> _chunk_sizes;
+
+    Cond _cond;
+    uint64_t _read_chunks = 0;
+    uint64_t _consumed_chunks = 0;
+    // the caller has the chunk _consumed_chunks
+    bool _handed_out = false;
+    bool _dying = false;
+    std::exception_ptr _error;
+
+    Thread _thread;
+
+    void run();
+};
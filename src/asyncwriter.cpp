@@ -0,0 +1,200 @@
+#include "asyncwriter.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+AsyncWriter::AsyncWriter()
+    : _cond("async_writer_cond")
+    , _jobs(BUFFER_COUNT)
+    , _thread("async_writer", [this] { run(); }, ThreadRole::Worker)
+{
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    wait();
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+    }
+    _cond.notify_all();
+    _thread.join();
+}
+
+void AsyncWriter::set_buffer_size(uint32_t size)
+{
+    wait();
+    // buffers are resized lazily when they get reused
+    _buffer_size = std::max(size / SECTOR_SIZE * SECTOR_SIZE, SECTOR_SIZE);
+}
+
+void AsyncWriter::set_stats(StageStats* stats)
+{
+    ScopeLock _(_cond.get_mutex());
+    _stats = stats;
+}
+
+void AsyncWriter::begin(void* file, uint64_t position)
+{
+    if (_filling)
+        queue_buffer();
+    _file = file;
+    _position = position;
+}
+
+void AsyncWriter::acquire_buffer()
+{
+    size_t index;
+    {
+        ScopeLock _(_cond.get_mutex());
+        while (_queued == _jobs.size() && _error.empty())
+            _cond.wait();
+        if (!_error.empty())
+            throw std::runtime_error(_error);
+        index = _next_fill;
+    }
+
+    // the slot isn't queued yet, the writer thread won't look at it
+    auto& job = _jobs[index];
+    job.file = _file;
+    job.size = 0;
+    job.close = false;
+    job.buffer.resize(_buffer_size);
+    _filling = true;
+
+    // the writer thread doesn't resize the buffers, their capacity can be
+    // read from here
+    size_t allocated = 0;
+    for (const auto& j : _jobs)
+        allocated += j.buffer.capacity();
+    _memory.set(allocated);
+}
+
+void AsyncWriter::queue_buffer()
+{
+    _filling = false;
+    if (_jobs[_next_fill].size == 0 && !_jobs[_next_fill].close)
+        return;
+
+    {
+        ScopeLock _(_cond.get_mutex());
+        _next_fill = (_next_fill + 1) % _jobs.size();
+        ++_queued;
+    }
+    _cond.notify_all();
+}
+
+void AsyncWriter::write(const void* data, uint32_t size)
+{
+    auto data8 = static_cast<const uint8_t*>(data);
+    while (size != 0)
+    {
+        if (!_filling)
+            acquire_buffer();
+
+        // cut buffers on multiples of the buffer size in the file, when
+        // resuming in the middle of a file the first one is shorter so that
+        // the following ones are aligned
+        auto& job = _jobs[_next_fill];
+        const auto room = _buffer_size - _position % _buffer_size;
+        const auto count = min32(size, room);
+        memcpy(job.buffer.data() + job.size, data8, count);
+
+        job.size += count;
+        _position += count;
+        data8 += count;
+        size -= count;
+
+        if (_position % _buffer_size == 0)
+            queue_buffer();
+    }
+}
+
+void AsyncWriter::end_file()
+{
+    // an empty file still needs a job to be closed
+    if (!_filling)
+        acquire_buffer();
+    _jobs[_next_fill].close = true;
+    queue_buffer();
+    _file = nullptr;
+}
+
+void AsyncWriter::flush()
+{
+    if (_filling)
+        queue_buffer();
+
+    ScopeLock _(_cond.get_mutex());
+    while (_queued != 0)
+        _cond.wait();
+    if (!_error.empty())
+        throw std::runtime_error(_error);
+}
+
+void AsyncWriter::wait()
+{
+    if (_filling)
+        queue_buffer();
+
+    ScopeLock _(_cond.get_mutex());
+    while (_queued != 0)
+        _cond.wait();
+}
+
+void AsyncWriter::run()
+{
+    while (true)
+    {
+        size_t index;
+        bool failed;
+        StageStats* stats;
+        {
+            ScopeLock _(_cond.get_mutex());
+            while (_queued == 0 && !_dying)
+                _cond.wait();
+            if (_queued == 0)
+                return;
+            index = _next_write;
+            failed = !_error.empty();
+            stats = _stats;
+        }
+
+        // after a failure, queued jobs are dropped so that waiters get
+        // released and see the error, their files are still closed
+        std::string error;
+        const auto& job = _jobs[index];
+        if (!failed)
+        {
+            try
+            {
+                StageTimer timer(stats, Stage::Write, job.size);
+                if (pkgi_write(job.file, job.buffer.data(), job.size) !=
+                    static_cast<int>(job.size))
+                    error = "写入数据不完整";
+            }
+            catch (const std::exception& e)
+            {
+                error = e.what();
+            }
+        }
+        if (job.close)
+            pkgi_close(job.file);
+
+        {
+            ScopeLock _(_cond.get_mutex());
+            if (!error.empty())
+            {
+                LOGF("async write failed: {}", error);
+                _error = error;
+            }
+            _next_write = (_next_write + 1) % _jobs.size();
+            --_queued;
+        }
+        _cond.notify_all();
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "memstats.hpp"
+#include "stagestats.hpp"
+#include "thread.hpp"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+// Write-behind buffer for one file at a time. Small writes are coalesced into
+// large buffers cut on multiples of the buffer size in the file, so the card
+// only sees big aligned writes, and the buffers are written on their own
+// thread so that the caller can go on downloading and decrypting.
+class AsyncWriter
+{
+public:
+    static constexpr uint32_t DEFAULT_BUFFER_SIZE = 1024 * 1024;
+    static constexpr uint32_t SECTOR_SIZE = 4096;
+    static constexpr size_t BUFFER_COUNT = 4;
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter(AsyncWriter&&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(AsyncWriter&&) = delete;
+
+    AsyncWriter();
+    ~AsyncWriter();
+
+    // rounded down to a multiple of SECTOR_SIZE, waits for pending writes
+    void set_buffer_size(uint32_t size);
+    // the writes are timed into stats from now on, null stops it
+    void set_stats(StageStats* stats);
+
+    // following writes go to file, whose current position is position
+    void begin(void* file, uint64_t position = 0);
+    // copies data and queues it for writing, throws if a previous write failed
+    void write(const void* data, uint32_t size);
+    // queues what's buffered and the closing of the file, which the writer
+    // thread does once it's written. The caller doesn't wait for the card,
+    // a write error only shows at the next flush. begin() must come before
+    // the next write
+    void end_file();
+    // writes out what's buffered, waits for it and throws if a write failed
+    void flush();
+    // same as flush but ignores errors, use this before closing a file on
+    // error paths
+    void wait();
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    struct Job
+    {
+        void* file;
+        std::vector<uint8_t> buffer;
+        uint32_t size;
+        // file is closed after the buffer is written
+        bool close;
+    };
+
+    Cond _cond;
+    std::vector<Job> _jobs;
+    size_t _next_write = 0;
+    size_t _next_fill = 0;
+    size_t _queued = 0;
+    std::string _error;
+    bool _dying = false;
+    StageStats* _stats = nullptr;
+
+    // only touched by the caller's thread
+    uint32_t _buffer_size = DEFAULT_BUFFER_SIZE;
+    void* _file = nullptr;
+    MemoryCharge _memory{MemPool::Download};
+    uint64_t _position = 0;
+    bool _filling = false;
+
+    Thread _thread;
+
+    void acquire_buffer();
+    void queue_buffer();
+    void run();
+};
@@ -0,0 +1,603 @@
+#include "aes128.hpp"
+#include "allocationcounter.hpp"
+#include "db.hpp"
+#include "file.hpp"
+#include "lzrc.hpp"
+#include "pkgi.hpp"
+#include "sha256.hpp"
+#include "style.h"
+#include "textwidths.hpp"
+#include "zrif.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+
+namespace
+{
+constexpr auto MIN_DURATION = std::chrono::milliseconds(500);
+
+constexpr uint32_t SIZES[] = {64, 1024, 16 * 1024, 64 * 1024, 1024 * 1024};
+
+constexpr uint32_t DB_ROWS = 20000;
+constexpr auto DB_FOLDER = "bench_db";
+
+constexpr uint32_t UI_ROWS = 50000;
+// what the fixed advance font of the host stand-ins measures
+constexpr int FONT_HEIGHT = 20;
+
+// only the benchmarks whose name contains it run
+std::string filter;
+
+bool selected(const char* name)
+{
+    return std::string(name).find(filter) != std::string::npos;
+}
+
+// one line per result, "name param value unit", the columns never change so
+// that runs can be diffed
+void print(const char* name, uint64_t param, double value, const char* unit)
+{
+    fmt::print("{:<28} {:>8} {:>12.1f} {}\n", name, param, value, unit);
+}
+
+// calls fn until MIN_DURATION has passed, returns the calls per second
+template <typename F>
+double rate(F&& fn)
+{
+    using clock = std::chrono::steady_clock;
+    const auto start = clock::now();
+    uint64_t calls = 0;
+    clock::duration elapsed;
+    do
+    {
+        fn();
+        ++calls;
+        elapsed = clock::now() - start;
+    } while (elapsed < MIN_DURATION);
+
+    return calls / std::chrono::duration<double>(elapsed).count();
+}
+
+std::vector<uint8_t> random_bytes(size_t size)
+{
+    std::vector<uint8_t> buffer(size);
+    for (auto& b : buffer)
+        b = rand();
+    return buffer;
+}
+
+// calls fn on a buffer of the given size and prints one "name size MB/s"
+// line
+template <typename F>
+void bench(const char* name, uint32_t size, F&& fn)
+{
+    if (!selected(name))
+        return;
+
+    auto buffer = random_bytes(size);
+    const auto calls = rate([&] { fn(buffer.data(), size); });
+    print(name, size, calls * size / (1024 * 1024), "MB/s");
+}
+
+// prints one "name param ops/s" line
+template <typename F>
+void bench_ops(const char* name, uint64_t param, F&& fn)
+{
+    if (!selected(name))
+        return;
+
+    print(name, param, rate(fn), "ops/s");
+}
+
+void bench_sha256()
+{
+    for (const auto size : SIZES)
+    {
+        sha256_ctx sha;
+        sha256_init(&sha);
+        bench("sha256_update", size, [&](const uint8_t* data, uint32_t len) {
+            sha256_update(&sha, data, len);
+        });
+    }
+
+    for (const auto size : SIZES)
+    {
+        sha256_ctx sha;
+        sha256_init(&sha);
+        bench("sha256_update_scalar",
+              size,
+              [&](const uint8_t* data, uint32_t len) {
+                  sha256_update_scalar(&sha, data, len);
+              });
+    }
+}
+
+void bench_aes128()
+{
+    const auto key = random_bytes(AES_BLOCK_SIZE);
+    const auto iv = random_bytes(AES_BLOCK_SIZE);
+
+    aes128_ctx ctr;
+    aes128_ctr_init(&ctr, key.data());
+    for (const auto size : SIZES)
+    {
+        uint64_t offset = 0;
+        bench("aes128_ctr", size, [&](uint8_t* data, uint32_t len) {
+            aes128_ctr(&ctr, iv.data(), offset, data, len);
+            offset += len;
+        });
+    }
+
+    for (const auto size : SIZES)
+    {
+        uint64_t offset = 0;
+        sha256_ctx sha;
+        sha256_init(&sha);
+        bench("aes128_ctr_sha256", size, [&](uint8_t* data, uint32_t len) {
+            aes128_ctr_sha256(&ctr, iv.data(), offset, &sha, data, len);
+            offset += len;
+        });
+    }
+
+    aes128_ctx psp;
+    aes128_init_dec(&psp, key.data());
+    for (const auto size : SIZES)
+        bench("aes128_psp_decrypt", size, [&](uint8_t* data, uint32_t len) {
+            aes128_psp_decrypt(&psp, iv.data(), 0, data, len);
+        });
+
+    for (const auto size : SIZES)
+    {
+        uint8_t mac[AES_BLOCK_SIZE];
+        bench("aes128_cmac", size, [&](const uint8_t* data, uint32_t len) {
+            aes128_cmac(key.data(), data, len, mac);
+        });
+    }
+}
+
+// each file is one decrypted, compressed NPUMDIMG block, there is no
+// compressor to make them up
+void bench_lzrc(const std::vector<std::string>& files)
+{
+    if (files.empty() || !selected("lzrc_decompress"))
+        return;
+
+    std::vector<std::vector<uint8_t>> blocks;
+    for (const auto& file : files)
+        blocks.push_back(pkgi_load(file));
+
+    std::vector<uint8_t> output(16 * 2048);
+    uint64_t total = 0;
+    for (const auto& block : blocks)
+        total += lzrc_decompress(
+                output.data(), output.size(), block.data(), block.size());
+
+    const auto calls = rate([&] {
+        for (const auto& block : blocks)
+            lzrc_decompress(
+                    output.data(), output.size(), block.data(), block.size());
+    });
+    print("lzrc_decompress",
+          blocks.size(),
+          calls * total / (1024 * 1024),
+          "MB/s");
+}
+
+std::string base64_encode(const std::vector<uint8_t>& data)
+{
+    static constexpr auto alphabet =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string result;
+    for (size_t i = 0; i < data.size(); i += 3)
+    {
+        const uint32_t n = data[i] << 16 |
+                           (i + 1 < data.size() ? data[i + 1] << 8 : 0) |
+                           (i + 2 < data.size() ? data[i + 2] : 0);
+        result += alphabet[n >> 18 & 63];
+        result += alphabet[n >> 12 & 63];
+        result += i + 1 < data.size() ? alphabet[n >> 6 & 63] : '=';
+        result += i + 2 < data.size() ? alphabet[n & 63] : '=';
+    }
+    return result;
+}
+
+// a zRIF of a random license in a stored deflate block, so that no zlib is
+// needed to make it. Real ones are compressed against a dictionary, puff
+// has a little more work to do on them
+std::string make_zrif()
+{
+    const auto rif = random_bytes(512);
+
+    std::vector<uint8_t> zlib = {0x78, 0x01, 0x01, 0x00, 0x02, 0xff, 0xfd};
+    zlib.insert(zlib.end(), rif.begin(), rif.end());
+
+    uint32_t a = 1;
+    uint32_t b = 0;
+    for (const auto byte : rif)
+    {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    const uint32_t adler = b << 16 | a;
+    for (int shift = 24; shift >= 0; shift -= 8)
+        zlib.push_back(adler >> shift);
+
+    return base64_encode(zlib);
+}
+
+void bench_zrif()
+{
+    const auto zrif = make_zrif();
+    uint8_t rif[1024];
+    char error[256];
+    if (!pkgi_zrif_decode(zrif.c_str(), rif, error, sizeof(error)))
+        throw std::runtime_error(fmt::format("bad zRIF: {}", error));
+
+    bench_ops("pkgi_zrif_decode", zrif.size(), [&] {
+        pkgi_zrif_decode(zrif.c_str(), rif, error, sizeof(error));
+    });
+}
+
+// a list in the format of the PSV games, with names to search in
+std::string make_tsv(uint32_t rows)
+{
+    static const char* const words[] = {
+            "the",    "legend", "of",    "dragon", "war",   "racing",
+            "puzzle", "night",  "ninja", "hero",   "space", "quest",
+            "soul",   "island", "dark",  "tales",  "world", "zero",
+    };
+    static const char* const regions[] = {"US", "EU", "JP", "ASIA"};
+
+    std::string tsv =
+            "Title ID\tRegion\tName\tPKG direct link\tzRIF\tContent ID\t"
+            "Last Modification Date\tOriginal Name\tFile Size\tSHA256\t"
+            "Required FW\n";
+    for (uint32_t i = 0; i < rows; ++i)
+    {
+        const auto titleid = fmt::format("PCSE{:05}", i);
+        std::string name;
+        for (int w = 0; w < 4; ++w)
+            name += fmt::format(
+                    "{}{}", w ? " " : "", words[rand() % std::size(words)]);
+        tsv += fmt::format(
+                "{}\t{}\t{}\thttp://example.com/{}.pkg\t"
+                "KO5ifR1dQ+eHBlOi1Wyw\tUP0000-{}_00-{:016}\t"
+                "2018-01-01 00:00:00\t{}\t{}\t{:064}\t3.60\n",
+                titleid,
+                regions[i % std::size(regions)],
+                name,
+                titleid,
+                titleid,
+                i,
+                name,
+                (rand() % 4096 + 1) * 1024 * 1024ull,
+                i);
+    }
+    return tsv;
+}
+
+void bench_split_row(const std::string& tsv)
+{
+    if (!selected("pkgi_split_row"))
+        return;
+
+    // the rows are split in place, each pass needs a fresh copy, which is
+    // counted in
+    std::string copy;
+    std::vector<const char*> fields;
+    const auto calls = rate([&] {
+        copy = tsv;
+        auto ptr = &copy[0];
+        const auto end = ptr + copy.size();
+        while (ptr != end)
+            pkgi_split_row(&ptr, end, fields);
+    });
+    print("pkgi_split_row",
+          DB_ROWS,
+          calls * tsv.size() / (1024 * 1024),
+          "MB/s");
+}
+
+void bench_reload(const std::string& tsv)
+{
+    pkgi_delete_dir(DB_FOLDER);
+    pkgi_mkdirs(DB_FOLDER);
+    pkgi_save(
+            fmt::format("{}/{}", DB_FOLDER, pkgi_mode_to_file_name(ModeGames)),
+            tsv.data(),
+            tsv.size());
+
+    const auto reload = [](TitleDatabase& db, DbSort sort, const char* search) {
+        db.reload(
+                ModeGames,
+                DbFilterAllRegions,
+                sort,
+                SortAscending,
+                search,
+                {},
+                {});
+    };
+
+    // the first one builds the index, the other ones read it back
+    bench_ops("TitleDatabase::reload_cold", DB_ROWS, [&] {
+        TitleDatabase db(DB_FOLDER);
+        reload(db, SortByName, "");
+    });
+
+    TitleDatabase db(DB_FOLDER);
+    reload(db, SortByName, "");
+    bool by_size = false;
+    bench_ops("TitleDatabase::reload_sort", DB_ROWS, [&] {
+        by_size = !by_size;
+        reload(db, by_size ? SortBySize : SortByName, "");
+    });
+
+    bench_ops("TitleDatabase::reload_search", DB_ROWS, [&] {
+        reload(db, SortByName, "dragon");
+    });
+
+    pkgi_delete_dir(DB_FOLDER);
+}
+
+// the rows of the list pkgi_do_main shows, and the one selected
+struct ListState
+{
+    uint32_t first_item = 0;
+    uint32_t selected_item = 0;
+};
+
+enum class ListKey
+{
+    Up,
+    Down,
+    PageUp,
+    PageDown,
+};
+
+uint32_t page_items()
+{
+    const int avail_height =
+            VITA_HEIGHT - 3 * (FONT_HEIGHT + PKGI_MAIN_HLINE_EXTRA);
+    return avail_height / (FONT_HEIGHT + PKGI_MAIN_ROW_PADDING) - 1;
+}
+
+// as pkgi_do_main moves through the list
+void press(ListState& list, ListKey key, uint32_t count)
+{
+    const auto max_items = page_items();
+    switch (key)
+    {
+    case ListKey::Up:
+        if (list.selected_item == list.first_item && list.first_item > 0)
+            list.selected_item = --list.first_item;
+        else if (list.selected_item > 0)
+            --list.selected_item;
+        else
+        {
+            list.selected_item = count - 1;
+            list.first_item = count > max_items ? count - max_items - 1 : 0;
+        }
+        break;
+    case ListKey::Down:
+        if (list.selected_item == count - 1)
+            list.selected_item = list.first_item = 0;
+        else if (list.selected_item == list.first_item + max_items)
+        {
+            ++list.first_item;
+            ++list.selected_item;
+        }
+        else
+            ++list.selected_item;
+        break;
+    case ListKey::PageUp:
+        list.first_item -= std::min(list.first_item, max_items);
+        list.selected_item -= std::min(list.selected_item, max_items);
+        break;
+    case ListKey::PageDown:
+        if (list.first_item + max_items < count - 1)
+        {
+            list.first_item += max_items;
+            list.selected_item =
+                    std::min(list.selected_item + max_items, count - 1);
+        }
+        break;
+    }
+}
+
+// the rows as pkgi_do_main draws them, without the icons and with the
+// presence left unknown, there is no scanner on the host
+void draw_list(TitleDatabase& db, TextWidthCache& widths, const ListState& list)
+{
+    static const char* const regions[] = {"ASA", "EUR", "JPN", "USA", "???"};
+
+    const int col_region =
+            widths.width("PCSE00000") + PKGI_MAIN_COLUMN_PADDING;
+    const int col_installed =
+            col_region + widths.width("USA") + PKGI_MAIN_COLUMN_PADDING;
+    const int col_name = col_installed +
+                         widths.width(PKGI_UTF8_INSTALLED) +
+                         PKGI_MAIN_COLUMN_PADDING;
+    const int list_bottom =
+            VITA_HEIGHT - (2 * FONT_HEIGHT + PKGI_MAIN_HLINE_EXTRA);
+
+    const auto count = db.count();
+    int y = FONT_HEIGHT + PKGI_MAIN_HLINE_EXTRA;
+    pkgi_clip_set(0, y, VITA_WIDTH, list_bottom - 1 - y);
+    for (uint32_t i = list.first_item; i < count && y <= list_bottom; ++i)
+    {
+        const auto item = db.get(i);
+        const auto& size = widths.size(item->size);
+        if (i == list.selected_item)
+            pkgi_draw_rect(
+                    0,
+                    y,
+                    VITA_WIDTH,
+                    FONT_HEIGHT + PKGI_MAIN_ROW_PADDING - 1,
+                    PKGI_COLOR_SELECTED_BACKGROUND);
+        pkgi_draw_text(0, y, PKGI_COLOR_TEXT, item->titleid.c_str());
+        pkgi_draw_text(
+                col_region,
+                y,
+                PKGI_COLOR_TEXT,
+                regions[pkgi_get_region(item->titleid)]);
+        const int size_x = VITA_WIDTH - PKGI_MAIN_SCROLL_WIDTH -
+                           PKGI_MAIN_SCROLL_PADDING - size.width;
+        pkgi_draw_text(size_x, y, PKGI_COLOR_TEXT, size.text);
+        const auto& name = widths.fit(
+                item->name, size_x - PKGI_MAIN_COLUMN_PADDING - col_name);
+        pkgi_draw_text(col_name, y, PKGI_COLOR_TEXT, name.c_str());
+        y += FONT_HEIGHT + PKGI_MAIN_ROW_PADDING;
+    }
+    pkgi_clip_remove();
+
+    // the scroll bar
+    if (count > page_items())
+        pkgi_draw_rect(
+                VITA_WIDTH - PKGI_MAIN_SCROLL_WIDTH - 1,
+                FONT_HEIGHT + PKGI_MAIN_HLINE_EXTRA +
+                        list.first_item * list_bottom / count,
+                PKGI_MAIN_SCROLL_WIDTH,
+                PKGI_MAIN_SCROLL_MIN_HEIGHT,
+                PKGI_COLOR_SCROLL_BAR);
+}
+
+// Plays a script of key presses on a list of UI_ROWS, a frame per press,
+// then the reloads of a change of sort and of a search typed a letter at a
+// time. Prints the CPU time of the frames, and what they draw, measure and
+// allocate on average
+void bench_ui_list()
+{
+    if (!selected("ui_list"))
+        return;
+
+    const auto tsv = make_tsv(UI_ROWS);
+    pkgi_delete_dir(DB_FOLDER);
+    pkgi_mkdirs(DB_FOLDER);
+    pkgi_save(
+            fmt::format("{}/{}", DB_FOLDER, pkgi_mode_to_file_name(ModeGames)),
+            tsv.data(),
+            tsv.size());
+
+    using clock = std::chrono::steady_clock;
+    const auto usec = [](clock::duration duration) {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    };
+
+    TitleDatabase db(DB_FOLDER);
+    const auto reload = [&](DbSort sort, const std::string& search) {
+        db.reload(
+                ModeGames,
+                DbFilterAllRegions,
+                sort,
+                SortAscending,
+                search,
+                {},
+                {});
+    };
+    reload(SortByName, "");
+
+    static const std::pair<ListKey, uint32_t> script[] = {
+            {ListKey::Down, 300},
+            {ListKey::PageDown, 1000},
+            {ListKey::PageUp, 200},
+            {ListKey::Up, 300},
+    };
+
+    TextWidthCache widths;
+    ListState list;
+    pkgi_take_draw_counters();
+    const auto first_allocation = pkgi_allocation_count().allocations;
+    uint32_t frames = 0;
+    double total = 0;
+    double slowest = 0;
+    for (const auto& step : script)
+        for (uint32_t i = 0; i < step.second; ++i)
+        {
+            const auto start = clock::now();
+            press(list, step.first, db.count());
+            draw_list(db, widths, list);
+            const auto elapsed = usec(clock::now() - start);
+            total += elapsed;
+            slowest = std::max(slowest, elapsed);
+            ++frames;
+        }
+    const auto counters = pkgi_take_draw_counters();
+    const auto allocations =
+            pkgi_allocation_count().allocations - first_allocation;
+    print("ui_list_frame", UI_ROWS, total / frames, "us");
+    print("ui_list_frame_max", UI_ROWS, slowest, "us");
+    print("ui_list_draws", UI_ROWS, double(counters.draws) / frames, "calls");
+    print("ui_list_text_widths",
+          UI_ROWS,
+          double(counters.text_measures) / frames,
+          "calls");
+    print("ui_list_allocations",
+          UI_ROWS,
+          double(allocations) / frames,
+          "allocs");
+
+    static const char* const searches[] = {
+            "d", "dr", "dra", "drag", "drago", "dragon", ""};
+    static const DbSort sorts[] = {SortBySize, SortByTitle, SortByName};
+    uint32_t reloads = 0;
+    total = 0;
+    const auto timed_reload = [&](DbSort sort, const std::string& search) {
+        const auto start = clock::now();
+        reload(sort, search);
+        list = {};
+        draw_list(db, widths, list);
+        total += usec(clock::now() - start);
+        ++reloads;
+    };
+    for (const auto sort : sorts)
+        timed_reload(sort, "");
+    for (const auto search : searches)
+        timed_reload(SortByName, search);
+    print("ui_list_reload", UI_ROWS, total / reloads, "us");
+
+    pkgi_delete_dir(DB_FOLDER);
+}
+}
+
+// pkgj_bench [-f filter] [lzrc block...]
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> lzrc_blocks;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::string(argv[i]) == "-f" && i + 1 < argc)
+            filter = argv[++i];
+        else
+            lzrc_blocks.push_back(argv[i]);
+    }
+
+    // the inputs are the same from one run to the next
+    srand(0);
+
+#if __ARM_NEON__
+    fmt::print("# NEON enabled\n");
+#else
+    fmt::print("# NEON disabled, sha256_update is the scalar path\n");
+#endif
+    fmt::print("# name param value unit\n");
+
+    bench_sha256();
+    bench_aes128();
+    bench_lzrc(lzrc_blocks);
+    bench_zrif();
+
+    const auto tsv = make_tsv(DB_ROWS);
+    bench_split_row(tsv);
+    bench_reload(tsv);
+    bench_ui_list();
+
+    return 0;
+}
@@ -300,29 +300,131 @@ std::unique_ptr<scedownload_class> new_scedownload()
     init_download_class(example_class.get());
     return example_class;
 }
-}
 
-void pkgi_start_bgdl(
-        const int type,
-        const std::string& title,
-        const std::string& url,
-        const std::vector<uint8_t>& rif)
+size_t count_free_slots()
 {
-    if (pkgi_list_dir_contents("ux0:bgdl/t").size() >= 32)
-        throw std::runtime_error(
-                "已有太多的下载进程待处理, "
-                "请通过LiveArea的通知中安装或删除它们, "
-                "以便下载更多内容");
+    const auto used = pkgi_list_dir_contents("ux0:bgdl/t").size();
+    return used >= BgdlQueue::MAX_SLOTS ? 0 : BgdlQueue::MAX_SLOTS - used;
+}
 
+void submit(const BgdlItem& item)
+{
     static auto example_class = new_scedownload();
 
+    // LiveArea copies it into the folder of the download
     const std::string license_path = "ux0:bgdl/temp.dat";
-    pkgi_save(license_path, rif.data(), rif.size());
+    pkgi_save(license_path, item.rif.data(), item.rif.size());
 
     scedownload_start_with_rif(
             example_class.get(),
-            title.c_str(),
-            url.c_str(),
+            item.title.c_str(),
+            item.url.c_str(),
             license_path.c_str(),
-            type);
+            item.type);
+}
+}
+
+BgdlQueue::BgdlQueue() : _cond("bgdl_cond")
+{
+    _thread = std::make_unique<Thread>(
+            "bgdl_queue", [this] { run(); }, ThreadRole::Background);
+}
+
+BgdlQueue::~BgdlQueue()
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+    }
+    _cond.notify_all();
+    _thread->join();
+}
+
+void BgdlQueue::add(std::vector<BgdlItem> items)
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        for (auto& item : items)
+            _queue.push_back(std::move(item));
+    }
+    _cond.notify_all();
+}
+
+size_t BgdlQueue::pending()
+{
+    ScopeLock _(_cond.get_mutex());
+    return _queue.size();
+}
+
+bool BgdlQueue::wait_for_slots()
+{
+    LOGF("all {} LiveArea download slots are taken, {} items wait",
+         MAX_SLOTS,
+         pending());
+    const uint32_t until = pkgi_time_msec() + SLOT_POLL_MS;
+    while (pkgi_time_msec() < until)
+    {
+        {
+            ScopeLock _(_cond.get_mutex());
+            if (_dying)
+                return false;
+        }
+        pkgi_sleep(100);
+    }
+    return true;
+}
+
+void BgdlQueue::run()
+{
+    // what LiveArea has left, counted again once it runs out
+    size_t free_slots = 0;
+    while (true)
+    {
+        BgdlItem item;
+        {
+            ScopeLock _(_cond.get_mutex());
+            while (_queue.empty() && !_dying)
+                _cond.wait();
+            if (_dying)
+                return;
+            // stays queued until it's handed over, for pending()
+            item = _queue.front();
+        }
+
+        if (free_slots == 0)
+            free_slots = count_free_slots();
+        if (free_slots == 0)
+        {
+            if (!wait_for_slots())
+                return;
+            continue;
+        }
+
+        std::string failure;
+        try
+        {
+            LOGF("handing {} to LiveArea, {} slots left",
+                 item.title,
+                 free_slots);
+            submit(item);
+            --free_slots;
+        }
+        catch (const std::exception& e)
+        {
+            failure = e.what();
+            // the slots may have been taken by another application
+            free_slots = 0;
+        }
+
+        {
+            ScopeLock _(_cond.get_mutex());
+            _queue.pop_front();
+        }
+        if (!failure.empty())
+        {
+            LOGF("failed to hand {} to LiveArea: {}", item.title, failure);
+            if (error)
+                error(item.title, failure);
+        }
+    }
 }
@@ -1,6 +1,12 @@
 #pragma once
 
+#include "thread.hpp"
+
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -11,8 +17,53 @@ enum BgdlType
     BgdlTypeTheme = 0xC,
 };
 
-void pkgi_start_bgdl(
-        const int type,
-        const std::string& title,
-        const std::string& url,
-        const std::vector<uint8_t>& rif);
+struct BgdlItem
+{
+    BgdlType type;
+    std::string title;
+    std::string url;
+    // empty for the free items
+    std::vector<uint8_t> rif;
+};
+
+// Hands the downloads to LiveArea from a thread of its own, the IPMI calls
+// and the writes of the license don't stall the UI. LiveArea holds at most
+// MAX_SLOTS of them, the others wait here and go as the slots free up, when
+// the finished ones are installed or deleted from the notifications. The free
+// slots are counted once and then kept track of, they are only counted again
+// when they run out.
+class BgdlQueue
+{
+public:
+    static constexpr size_t MAX_SLOTS = 32;
+    // how often the slots are counted again while they are all taken
+    static constexpr uint32_t SLOT_POLL_MS = 5000;
+
+    BgdlQueue(const BgdlQueue&) = delete;
+    BgdlQueue(BgdlQueue&&) = delete;
+    BgdlQueue& operator=(const BgdlQueue&) = delete;
+    BgdlQueue& operator=(BgdlQueue&&) = delete;
+
+    BgdlQueue();
+    ~BgdlQueue();
+
+    void add(std::vector<BgdlItem> items);
+    // the items not handed to LiveArea yet
+    size_t pending();
+
+    // called on the thread of the queue, the item is dropped
+    std::function<void(const std::string& title, const std::string& error)>
+            error;
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    Cond _cond;
+    bool _dying = false;
+    std::deque<BgdlItem> _queue;
+    std::unique_ptr<Thread> _thread;
+
+    void run();
+    // false when the queue is dying
+    bool wait_for_slots();
+};
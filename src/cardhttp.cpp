@@ -0,0 +1,92 @@
+#include "cardhttp.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <fmt/format.h>
+
+namespace
+{
+constexpr char CARD_SCHEME[] = "file://";
+}
+
+std::string pkgi_card_url(const std::string& path)
+{
+    return CARD_SCHEME + path;
+}
+
+bool pkgi_is_card_url(const std::string& url)
+{
+    return url.compare(0, sizeof(CARD_SCHEME) - 1, CARD_SCHEME) == 0;
+}
+
+CardHttp::~CardHttp()
+{
+    close();
+}
+
+void CardHttp::close()
+{
+    if (_file)
+    {
+        pkgi_close(_file);
+        _file = nullptr;
+    }
+}
+
+void CardHttp::start(const std::string& url, uint64_t offset)
+{
+    close();
+    const auto path = url.substr(sizeof(CARD_SCHEME) - 1);
+    LOGF("reading {} from {}", path, offset);
+
+    const auto size = pkgi_get_size(path.c_str());
+    if (size < 0)
+        throw formatEx<HttpError>("无法打开 {}", path);
+    if (static_cast<uint64_t>(size) < offset)
+        throw formatEx<HttpError>(
+                "{} 只有 {} 字节, 无法从 {} 读取", path, size, offset);
+    _file = pkgi_open(path.c_str());
+    if (!_file)
+        throw formatEx<HttpError>("无法打开 {}", path);
+    pkgi_seek(_file, offset);
+
+    _size = size;
+    _start = offset;
+    _offset = offset;
+}
+
+int64_t CardHttp::read(uint8_t* buffer, uint64_t size)
+{
+    if (!_file)
+        throw HttpError("read before start");
+
+    // the card is quickest with reads that start on its blocks
+    if (_offset % ALIGNMENT != 0)
+        size = min64(size, ALIGNMENT - _offset % ALIGNMENT);
+    const auto read = pkgi_read(
+            _file, buffer, static_cast<uint32_t>(min64(size, 0x40000000)));
+    _offset += read;
+    return read;
+}
+
+void CardHttp::abort()
+{
+}
+
+int CardHttp::get_status()
+{
+    return _start ? 206 : 200;
+}
+
+int64_t CardHttp::get_length()
+{
+    // like a Range response, the length is what's left from the offset
+    return _size - _start;
+}
+
+CardHttp::operator bool() const
+{
+    return _file != nullptr;
+}
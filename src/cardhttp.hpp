@@ -0,0 +1,41 @@
+#pragma once
+
+#include "http.hpp"
+
+#include <string>
+
+// the url of a package on the memory card, read by CardHttp
+std::string pkgi_card_url(const std::string& path);
+bool pkgi_is_card_url(const std::string& url);
+
+// Http over a package copied to the memory card, so that it installs at the
+// speed of the card without the network. The reads start on ALIGNMENT
+// boundaries, the first one after a start() only goes up to the next one.
+// Its HttpOptions make ReadAheadHttp read it a megabyte at a time on its own
+// thread
+class CardHttp : public Http
+{
+public:
+    static constexpr uint32_t ALIGNMENT = 64 * 1024;
+
+    CardHttp() = default;
+    ~CardHttp();
+
+    // throws HttpError when the file can't be opened
+    void start(const std::string& url, uint64_t offset) override;
+    int64_t read(uint8_t* buffer, uint64_t size) override;
+    void abort() override;
+
+    int get_status() override;
+    int64_t get_length() override;
+
+    explicit operator bool() const override;
+
+private:
+    void* _file = nullptr;
+    uint64_t _size = 0;
+    uint64_t _start = 0;
+    uint64_t _offset = 0;
+
+    void close();
+};
@@ -0,0 +1,128 @@
+#include "chunkhashes.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <fmt/format.h>
+
+#include <stdexcept>
+
+namespace
+{
+// CHUNKS_MAGIC, CHUNKS_VERSION, the chunk size and the package size, then
+// the eight words of each state, all little endian
+constexpr uint32_t CHUNKS_MAGIC = 0x48434b50; // "PKCH"
+constexpr uint32_t CHUNKS_VERSION = 1;
+constexpr size_t CHUNKS_HEADER_SIZE = 20;
+constexpr size_t CHUNKS_STATE_SIZE = 32;
+
+// a 4 GiB package in chunks of 64 KiB, more is not a list of chunk hashes
+constexpr size_t MAX_CHUNKS_BYTES =
+        CHUNKS_HEADER_SIZE + 64 * 1024 * CHUNKS_STATE_SIZE;
+}
+
+std::string pkgi_chunk_hashes_path(
+        const std::string& partition, const std::string& content)
+{
+    return fmt::format("{}pkgj/.manifest/{}.chunks", partition, content);
+}
+
+std::optional<ChunkHashes> pkgi_parse_chunk_hashes(
+        const std::vector<uint8_t>& data)
+{
+    if (data.size() < CHUNKS_HEADER_SIZE ||
+        get32le(data.data()) != CHUNKS_MAGIC ||
+        get32le(data.data() + 4) != CHUNKS_VERSION)
+        return std::nullopt;
+
+    ChunkHashes hashes;
+    hashes.chunk_size = get32le(data.data() + 8);
+    hashes.size = get64le(data.data() + 12);
+    if (hashes.chunk_size == 0 || hashes.chunk_size % 64 != 0)
+        return std::nullopt;
+    const auto count = hashes.size / hashes.chunk_size;
+    if ((data.size() - CHUNKS_HEADER_SIZE) / CHUNKS_STATE_SIZE != count)
+        return std::nullopt;
+
+    hashes.states.resize(count);
+    auto state = data.data() + CHUNKS_HEADER_SIZE;
+    for (auto& words : hashes.states)
+        for (auto& word : words)
+        {
+            word = get32le(state);
+            state += 4;
+        }
+    return hashes;
+}
+
+std::vector<uint8_t> pkgi_format_chunk_hashes(const ChunkHashes& hashes)
+{
+    std::vector<uint8_t> data(
+            CHUNKS_HEADER_SIZE + hashes.states.size() * CHUNKS_STATE_SIZE);
+    set32le(data.data(), CHUNKS_MAGIC);
+    set32le(data.data() + 4, CHUNKS_VERSION);
+    set32le(data.data() + 8, hashes.chunk_size);
+    set64le(data.data() + 12, hashes.size);
+
+    auto state = data.data() + CHUNKS_HEADER_SIZE;
+    for (const auto& words : hashes.states)
+        for (const auto word : words)
+        {
+            set32le(state, word);
+            state += 4;
+        }
+    return data;
+}
+
+std::optional<ChunkHashes> pkgi_load_chunk_hashes(const std::string& path)
+{
+    if (!pkgi_file_exists(path))
+        return std::nullopt;
+
+    try
+    {
+        auto hashes = pkgi_parse_chunk_hashes(pkgi_load(path));
+        if (!hashes)
+            LOGF("ignoring chunk hashes {}: bad format", path);
+        return hashes;
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("ignoring chunk hashes {}: {}", path, e.what());
+        return std::nullopt;
+    }
+}
+
+void pkgi_save_chunk_hashes(const std::string& path, const ChunkHashes& hashes)
+{
+    try
+    {
+        const auto data = pkgi_format_chunk_hashes(hashes);
+        pkgi_mkdirs(path.substr(0, path.rfind('/')).c_str());
+        pkgi_save(path, data.data(), data.size());
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to save chunk hashes {}: {}", path, e.what());
+    }
+}
+
+std::optional<ChunkHashes> pkgi_fetch_chunk_hashes(
+        Http& http, const std::string& url)
+{
+    http.start(url, 0);
+    if (http.get_status() == 404)
+        return std::nullopt;
+
+    std::vector<uint8_t> data;
+    pkgi_http_consume(http, [&](const uint8_t* slice, uint32_t size) {
+        if (data.size() + size > MAX_CHUNKS_BYTES)
+            throw HttpError(fmt::format("{} is too large", url));
+        data.insert(data.end(), slice, slice + size);
+    });
+    auto hashes = pkgi_parse_chunk_hashes(data);
+    if (!hashes)
+        LOGF("ignoring chunk hashes {}: bad format", url);
+    return hashes;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <array>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "http.hpp"
+
+// The SHA-256 of a package cut into chunks of chunk_size bytes. SHA-256
+// chains its state from block to block, so the state after each whole chunk
+// is all it takes to check that chunk alone: the hash is started again from
+// the state of the previous chunk and must end on the state of this one. The
+// last state finished with the bytes after it still gives the digest of the
+// whole package, so the chunks a download skips don't cost it its check.
+struct ChunkHashes
+{
+    static constexpr uint32_t DEFAULT_CHUNK_SIZE = 4 * 1024 * 1024;
+
+    // a multiple of the SHA-256 block size
+    uint32_t chunk_size = DEFAULT_CHUNK_SIZE;
+    // of the package
+    uint64_t size = 0;
+    // after each whole chunk, size / chunk_size of them
+    std::vector<std::array<uint32_t, 8>> states;
+};
+
+// <partition>pkgj/.manifest/<content>.chunks, next to the manifest of the
+// package
+std::string pkgi_chunk_hashes_path(
+        const std::string& partition, const std::string& content);
+
+// nullopt when data isn't a list of chunk hashes or doesn't describe a
+// package of its size
+std::optional<ChunkHashes> pkgi_parse_chunk_hashes(
+        const std::vector<uint8_t>& data);
+std::vector<uint8_t> pkgi_format_chunk_hashes(const ChunkHashes& hashes);
+
+// nullopt when there is none at path or it is damaged
+std::optional<ChunkHashes> pkgi_load_chunk_hashes(const std::string& path);
+// a failure is only logged, the next download builds them again
+void pkgi_save_chunk_hashes(const std::string& path, const ChunkHashes& hashes);
+
+// fetches the chunk hashes the repository publishes at url, nullopt when it
+// has none. Throws HttpError when they can't be read
+std::optional<ChunkHashes> pkgi_fetch_chunk_hashes(
+        Http& http, const std::string& url);
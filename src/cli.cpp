@@ -1,22 +1,65 @@
+#include "allocationcounter.hpp"
 #include "comppackdb.hpp"
 #include "db.hpp"
 #include "download.hpp"
 #include "extractzip.hpp"
 #include "filedownload.hpp"
+#include "file.hpp"
 #include "filehttp.hpp"
+#include "fileserver.hpp"
+#include "httpoptions.hpp"
+#include "lzrc.hpp"
+#include "memstats.hpp"
+#include "offload.hpp"
 #include "patchinfo.hpp"
+#include "sha256.hpp"
+#include "stagestats.hpp"
+#include "throttledhttp.hpp"
+#include "trace.hpp"
+#include "zipstream.hpp"
 #include "zrif.hpp"
 
 #include <boost/algorithm/hex.hpp>
 
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+
+#include <sys/resource.h>
 
 static constexpr auto USAGE =
-        "Usage: %s [extract <filename> <zrif> <sha256>] [refreshlist PSV "
-        "path] [refreshcomppack path] [filedownload path] [extractzip path] "
-        "[patchinfo xmlfile titleid]\n";
+        "Usage: %s [--network profile.json] [extract <filename> <zrif> "
+        "<sha256>] [refreshlist PSV path] [buildindex PSV tsv index] "
+        "[refreshcomppack path] "
+        "[filedownload path] [extractzip path] [streamzip path] [patchinfo "
+        "xmlfile titleid] [lzrcbench block...] "
+        "[searchall dbdir text] [query dbdir [--mode m,...] "
+        "[--region ASA,EUR,JPN,USA] [--min-size n] [--max-size n] "
+        "[--since date] [--until date] [--name text] [--titleid id,...|@file] "
+        "[--sort title|region|name|size|date] [--desc] [--limit n] "
+        "[--fields f,...] [--format csv|json]] "
+        "[bench <filename> [--runs n] [--zrif zrif] "
+        "[--sha256 sha256] [--iso] [--iso-format iso|cso|zso] "
+        "[--read-ahead-kb n] [--read-ahead-blocks n] [--no-write]] "
+        "[serve pkgdir [--port n]]\n";
+
+// set by --network, every connection goes through it
+static std::optional<NetworkProfile> g_network;
+
+static std::unique_ptr<Http> make_http(const std::string& path = {})
+{
+    auto http = std::make_unique<FileHttp>(path);
+    if (!g_network)
+        return http;
+    return std::make_unique<ThrottledHttp>(std::move(http), *g_network);
+}
 
 int extract(int argc, char* argv[])
 {
@@ -34,8 +77,10 @@ int extract(int argc, char* argv[])
     if (argv[3][0] && !pkgi_zrif_decode(argv[3], rif, message, sizeof(message)))
         throw std::runtime_error(fmt::format("can't decode zrif: {}", message));
 
-    Download d(std::make_unique<FileHttp>());
+    Download d(make_http());
 
+    // simulated disconnects are resumed like real ones
+    d.http_factory = [] { return make_http(); };
     d.save_as_iso = false;
     d.update_progress_cb = [](uint64_t, uint64_t) {};
     d.update_status = [](auto&&) {};
@@ -47,12 +92,24 @@ int extract(int argc, char* argv[])
     return 0;
 }
 
+// the modes as named on the command line, in Mode order
+static constexpr const char* MODE_ARGS[ModeCount] = {
+        "PSVGAMES",
+        "PSVDLCS",
+        "PSVDEMOS",
+        "PSVTHEMES",
+        "PSMGAMES",
+        "PSXGAMES",
+        "PSPGAMES",
+        "PSPDLCS",
+};
+
 Mode arg_to_mode(std::string const& arg)
 {
-    if (arg == "PSVGAMES")
-        return ModeGames;
-    else
-        throw std::runtime_error("unsupported arg: " + arg);
+    for (int i = 0; i < ModeCount; ++i)
+        if (arg == MODE_ARGS[i])
+            return static_cast<Mode>(i);
+    throw std::runtime_error("unsupported arg: " + arg);
 }
 
 int refreshlist(int argc, char* argv[])
@@ -63,13 +120,18 @@ int refreshlist(int argc, char* argv[])
         return 1;
     }
 
-    const auto http = std::make_unique<FileHttp>();
-
     const auto mode = arg_to_mode(argv[2]);
 
     const auto db = std::make_unique<TitleDatabase>(".");
-    db->update(mode, http.get(), argv[3]);
-    db->reload(mode, DbFilterAllRegions, SortBySize, SortDescending, "the", {});
+    db->update(mode, [] { return make_http(); }, argv[3]);
+    db->reload(
+            mode,
+            DbFilterAllRegions,
+            SortBySize,
+            SortDescending,
+            "the",
+            {},
+            {});
     for (unsigned int i = 0; i < db->count(); ++i)
         fmt::print("{}: {}\n", db->get(i)->name, db->get(i)->size);
     fmt::print("{}/{}\n", db->count(), db->total());
@@ -77,6 +139,323 @@ int refreshlist(int argc, char* argv[])
     return 0;
 }
 
+// what a list server ships next to the TSV, see TitleDatabase::update. The
+// checksum goes in the X-PKGj-Sha256 header
+int buildindex(int argc, char* argv[])
+{
+    if (argc != 5)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    TitleDatabase::write_index(arg_to_mode(argv[2]), argv[3], argv[4]);
+
+    const auto data = pkgi_load(argv[4]);
+    sha256_ctx sha;
+    sha256_init(&sha);
+    sha256_update(&sha, data.data(), data.size());
+    std::vector<uint8_t> digest(SHA256_DIGEST_SIZE);
+    sha256_finish(&sha, digest.data());
+    fmt::print("{} bytes, sha256 {}\n", data.size(), pkgi_tohex(digest));
+
+    return 0;
+}
+
+int searchall(int argc, char* argv[])
+{
+    if (argc != 4)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const auto db = std::make_unique<TitleDatabase>(argv[2]);
+    const auto hits = db->search_all(argv[3], 100);
+    for (const auto& hit : hits)
+        fmt::print(
+                "{}: {} {}\n",
+                pkgi_mode_to_string(hit.mode),
+                hit.item.titleid,
+                hit.item.name);
+    fmt::print("{} hits\n", hits.size());
+
+    return 0;
+}
+
+namespace
+{
+std::vector<std::string> split_list(const std::string& list)
+{
+    std::vector<std::string> values;
+    size_t pos = 0;
+    while (pos <= list.size())
+    {
+        auto end = list.find(',', pos);
+        if (end == std::string::npos)
+            end = list.size();
+        if (end > pos)
+            values.push_back(list.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return values;
+}
+
+// a comma separated list, or @file for one value per line
+std::vector<std::string> read_list(const std::string& arg)
+{
+    if (arg.empty() || arg[0] != '@')
+        return split_list(arg);
+    const auto data = pkgi_load(arg.substr(1));
+    std::vector<std::string> values;
+    size_t pos = 0;
+    while (pos < data.size())
+    {
+        auto end = std::find(data.begin() + pos, data.end(), '\n');
+        std::string value(data.begin() + pos, end);
+        pos = end - data.begin() + 1;
+        while (!value.empty() && (value.back() == '\r' || value.back() == ' '))
+            value.pop_back();
+        if (!value.empty())
+            values.push_back(std::move(value));
+    }
+    return values;
+}
+
+uint32_t arg_to_region(const std::string& arg)
+{
+    if (arg == "ASA")
+        return DbFilterRegionASA;
+    if (arg == "EUR")
+        return DbFilterRegionEUR;
+    if (arg == "JPN")
+        return DbFilterRegionJPN;
+    if (arg == "USA")
+        return DbFilterRegionUSA;
+    throw std::runtime_error("unsupported region: " + arg);
+}
+
+DbSort arg_to_sort(const std::string& arg)
+{
+    if (arg == "title")
+        return SortByTitle;
+    if (arg == "region")
+        return SortByRegion;
+    if (arg == "name")
+        return SortByName;
+    if (arg == "size")
+        return SortBySize;
+    if (arg == "date")
+        return SortByDate;
+    throw std::runtime_error("unsupported sort: " + arg);
+}
+
+static constexpr const char* QUERY_FIELDS[] = {
+        "mode",
+        "titleid",
+        "content",
+        "region",
+        "name",
+        "name_org",
+        "size",
+        "date",
+        "app_version",
+        "fw_version",
+        "url",
+        "zrif",
+        "sha256",
+};
+
+std::string query_field(
+        const TitleDatabase::QueryHit& hit, const std::string& field)
+{
+    const auto& item = hit.item;
+    if (field == "mode")
+        return MODE_ARGS[hit.mode];
+    if (field == "titleid")
+        return item.titleid;
+    if (field == "content")
+        return item.content;
+    if (field == "region")
+        return hit.region;
+    if (field == "name")
+        return item.name;
+    if (field == "name_org")
+        return item.name_org;
+    if (field == "size")
+        return std::to_string(item.size);
+    if (field == "date")
+        return item.date;
+    if (field == "app_version")
+        return item.app_version;
+    if (field == "fw_version")
+        return item.fw_version;
+    if (field == "url")
+        return item.url;
+    if (field == "zrif")
+        return item.zrif;
+    if (field == "sha256")
+        return item.has_digest ? pkgi_tohex(std::vector<uint8_t>(
+                                         item.digest.begin(),
+                                         item.digest.end()))
+                               : std::string();
+    throw std::runtime_error("unsupported field: " + field);
+}
+
+std::string csv_value(const std::string& value)
+{
+    if (value.find_first_of(",\"\r\n") == std::string::npos)
+        return value;
+    std::string quoted = "\"";
+    for (const auto c : value)
+    {
+        if (c == '"')
+            quoted += '"';
+        quoted += c;
+    }
+    return quoted + '"';
+}
+
+std::string json_value(const std::string& value)
+{
+    std::string quoted = "\"";
+    for (const auto c : value)
+    {
+        switch (c)
+        {
+        case '"':
+            quoted += "\\\"";
+            break;
+        case '\\':
+            quoted += "\\\\";
+            break;
+        case '\n':
+            quoted += "\\n";
+            break;
+        case '\r':
+            quoted += "\\r";
+            break;
+        case '\t':
+            quoted += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+                quoted += fmt::format("\\u{:04x}", static_cast<int>(c));
+            else
+                quoted += c;
+        }
+    }
+    return quoted + '"';
+}
+}
+
+// answers a query over the indexes of the lists in dbdir, as the Vita keeps
+// them, without parsing the TSVs again and streams the titles as CSV with a
+// header or as JSON, one object per line.
+// --mode and --region take comma separated lists, --titleid too or @file for
+// one title id per line, --since and --until a date or a start of one
+int query(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    TitleDatabase::Query query;
+    std::vector<std::string> fields = {
+            "mode", "titleid", "content", "region", "name", "size", "date"};
+    bool json = false;
+    for (int i = 3; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--mode" && i + 1 < argc)
+        {
+            for (const auto& mode : split_list(argv[++i]))
+                query.modes.push_back(arg_to_mode(mode));
+        }
+        else if (arg == "--region" && i + 1 < argc)
+        {
+            query.region_filter = 0;
+            for (const auto& region : split_list(argv[++i]))
+                query.region_filter |= arg_to_region(region);
+        }
+        else if (arg == "--min-size" && i + 1 < argc)
+            query.min_size = std::strtoll(argv[++i], nullptr, 10);
+        else if (arg == "--max-size" && i + 1 < argc)
+            query.max_size = std::strtoll(argv[++i], nullptr, 10);
+        else if (arg == "--since" && i + 1 < argc)
+            query.since = argv[++i];
+        else if (arg == "--until" && i + 1 < argc)
+            query.until = argv[++i];
+        else if (arg == "--name" && i + 1 < argc)
+            query.name = argv[++i];
+        else if (arg == "--titleid" && i + 1 < argc)
+        {
+            for (auto& titleid : read_list(argv[++i]))
+                query.titleids.insert(std::move(titleid));
+        }
+        else if (arg == "--sort" && i + 1 < argc)
+            query.sort_by = arg_to_sort(argv[++i]);
+        else if (arg == "--desc")
+            query.sort_order = SortDescending;
+        else if (arg == "--limit" && i + 1 < argc)
+            query.limit = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--fields" && i + 1 < argc)
+        {
+            fields = split_list(argv[++i]);
+            for (const auto& field : fields)
+                if (std::find(
+                            std::begin(QUERY_FIELDS),
+                            std::end(QUERY_FIELDS),
+                            field) == std::end(QUERY_FIELDS))
+                    throw std::runtime_error("unsupported field: " + field);
+        }
+        else if (arg == "--format" && i + 1 < argc)
+        {
+            const std::string format = argv[++i];
+            if (format != "csv" && format != "json")
+                throw std::runtime_error("unsupported format: " + format);
+            json = format == "json";
+        }
+        else
+        {
+            printf(USAGE, argv[0]);
+            return 1;
+        }
+    }
+
+    if (!json)
+    {
+        std::string header;
+        for (const auto& field : fields)
+            header += (header.empty() ? "" : ",") + field;
+        fmt::print("{}\n", header);
+    }
+
+    const auto db = std::make_unique<TitleDatabase>(argv[2]);
+    std::string line;
+    db->query(query, [&](const TitleDatabase::QueryHit& hit) {
+        line.clear();
+        for (size_t i = 0; i < fields.size(); ++i)
+        {
+            const auto value = query_field(hit, fields[i]);
+            if (json)
+                line += fmt::format(
+                        "{}\"{}\": {}",
+                        i ? ", " : "{",
+                        fields[i],
+                        fields[i] == "size" ? value : json_value(value));
+            else
+                line += (i ? "," : "") + csv_value(value);
+        }
+        line += json ? "}\n" : "\n";
+        fwrite(line.data(), 1, line.size(), stdout);
+    });
+
+    return 0;
+}
+
 int refreshcomppack(int argc, char* argv[])
 {
     if (argc != 3)
@@ -85,7 +464,7 @@ int refreshcomppack(int argc, char* argv[])
         return 1;
     }
 
-    const auto http = std::make_unique<FileHttp>();
+    const auto http = make_http();
 
     const auto db = std::make_unique<CompPackDatabase>("comppack.db");
     db->update(http.get(), argv[2]);
@@ -103,7 +482,8 @@ int filedownload(int argc, char* argv[])
         return 1;
     }
 
-    FileDownload d(std::make_unique<FileHttp>());
+    FileDownload d(make_http());
+    d.http_factory = [] { return make_http(); };
 
     d.download("tmp", "id", argv[2]);
 
@@ -123,6 +503,29 @@ int extractzip(int argc, char* argv[])
     return 0;
 }
 
+// the way the comppacks are installed
+int streamzip(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    FileDownload d(make_http());
+    d.update_progress_cb = [](uint64_t, uint64_t) {};
+    d.is_canceled = [] { return false; };
+
+    pkgi_mkdirs("tmp");
+    ZipStreamExtractor extractor("tmp");
+    d.stream(argv[2], [&](const uint8_t* data, uint32_t size) {
+        extractor.write(data, size);
+    });
+    extractor.finish();
+
+    return 0;
+}
+
 int patchinfo(int argc, char* argv[])
 {
     if (argc != 4)
@@ -132,7 +535,7 @@ int patchinfo(int argc, char* argv[])
     }
 
     const auto patch_info = pkgi_download_patch_info(
-            std::make_unique<FileHttp>(argv[2]).get(), argv[3]);
+            make_http(argv[2]).get(), argv[3]);
 
     if (!patch_info)
         puts("No patch found");
@@ -143,8 +546,505 @@ int patchinfo(int argc, char* argv[])
     return 0;
 }
 
+// each file is one decrypted, compressed NPUMDIMG block
+int lzrcbench(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    std::vector<std::vector<uint8_t>> blocks;
+    for (int i = 2; i < argc; ++i)
+        blocks.push_back(pkgi_load(argv[i]));
+
+    std::vector<uint8_t> expected(16 * 2048);
+    std::vector<uint8_t> output(16 * 2048);
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        const auto& block = blocks[i];
+        const auto expected_size = lzrc_decompress_reference(
+                expected.data(), expected.size(), block.data(), block.size());
+        const auto size = lzrc_decompress(
+                output.data(), output.size(), block.data(), block.size());
+        if (size != expected_size ||
+            memcmp(output.data(), expected.data(), size) != 0)
+        {
+            fmt::print("{}: output differs from the reference\n", argv[i + 2]);
+            return 1;
+        }
+    }
+
+    using clock = std::chrono::steady_clock;
+    const auto bench = [&](const char* name, auto&& decompress) {
+        const auto start = clock::now();
+        uint64_t total = 0;
+        clock::duration elapsed;
+        do
+        {
+            for (const auto& block : blocks)
+                total += decompress(
+                        output.data(),
+                        output.size(),
+                        block.data(),
+                        block.size());
+            elapsed = clock::now() - start;
+        } while (elapsed < std::chrono::seconds(1));
+
+        const auto seconds = std::chrono::duration<double>(elapsed).count();
+        fmt::print(
+                "{:<28} {:>10.1f} MB/s\n",
+                name,
+                total / seconds / (1024 * 1024));
+    };
+
+    fmt::print("{} blocks, outputs match the reference\n", blocks.size());
+    bench("lzrc_decompress_reference", lzrc_decompress_reference);
+    bench("lzrc_decompress", lzrc_decompress);
+
+    return 0;
+}
+
+// replays a local package through the whole pipeline runs times and prints
+// the throughput, the stages, the peak RSS, the peak of each memory pool and
+// the allocations as JSON.
+// --iso saves PSP games as ISO, recompressed with --iso-format, --no-write
+// hashes the files without writing them to tell the pipeline from the disk.
+// --read-ahead-kb and --read-ahead-blocks set the HttpOptions to compare them
+// under a --network profile
+int bench(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const std::string package = argv[2];
+    uint32_t runs = 5;
+    std::string zrif;
+    std::vector<uint8_t> digest;
+    bool save_as_iso = false;
+    auto iso_format = IsoFormat::Iso;
+    bool discard_writes = false;
+    HttpOptions http_options;
+    for (int i = 3; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--runs" && i + 1 < argc)
+            runs = std::max(1, atoi(argv[++i]));
+        else if (arg == "--zrif" && i + 1 < argc)
+            zrif = argv[++i];
+        else if (arg == "--sha256" && i + 1 < argc)
+            boost::algorithm::unhex(
+                    std::string(argv[++i]), std::back_inserter(digest));
+        else if (arg == "--iso")
+            save_as_iso = true;
+        else if (arg == "--iso-format" && i + 1 < argc)
+        {
+            save_as_iso = true;
+            iso_format = pkgi_parse_iso_format(argv[++i]);
+        }
+        else if (arg == "--read-ahead-kb" && i + 1 < argc)
+            http_options.read_ahead_kb = atoi(argv[++i]);
+        else if (arg == "--read-ahead-blocks" && i + 1 < argc)
+            http_options.read_ahead_blocks = atoi(argv[++i]);
+        else if (arg == "--no-write")
+            discard_writes = true;
+        else
+        {
+            printf(USAGE, argv[0]);
+            return 1;
+        }
+    }
+
+    pkgi_set_http_options({{"*", http_options}});
+    // as clamped
+    http_options = pkgi_http_options("");
+
+    uint8_t rif[PKGI_PSM_RIF_SIZE];
+    char message[256];
+    if (!zrif.empty() &&
+        !pkgi_zrif_decode(zrif.c_str(), rif, message, sizeof(message)))
+        throw std::runtime_error(fmt::format("can't decode zrif: {}", message));
+
+    // each run starts from scratch, a resume file would skip the work
+    static constexpr auto partition = "bench_tmp/";
+    pkgi_delete_dir(partition);
+
+    using clock = std::chrono::steady_clock;
+    std::vector<double> seconds;
+    StageStats stats;
+    uint64_t size = 0;
+    const auto allocated = pkgi_allocation_count();
+    for (uint32_t run = 0; run < runs; ++run)
+    {
+        Download d(make_http());
+        d.http_factory = [] { return make_http(); };
+        d.save_as_iso = save_as_iso;
+        d.iso_format = iso_format;
+        d.discard_writes = discard_writes;
+        d.stats = &stats;
+        d.update_progress_cb = [](uint64_t, uint64_t) {};
+        d.update_status = [](auto&&) {};
+        d.is_canceled = [] { return false; };
+
+        const auto start = clock::now();
+        if (!d.pkgi_download(
+                    partition,
+                    "bench",
+                    package.c_str(),
+                    zrif.empty() ? nullptr : rif,
+                    digest.empty() ? nullptr : digest.data()))
+            throw std::runtime_error("download failed");
+        seconds.push_back(
+                std::chrono::duration<double>(clock::now() - start).count());
+        size = d.download_size;
+
+        pkgi_delete_dir(partition);
+    }
+    const auto allocated_end = pkgi_allocation_count();
+
+    std::sort(seconds.begin(), seconds.end());
+    const auto mbps = [&](double s) { return size / s / (1024 * 1024); };
+
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+
+    const auto totals = stats.totals();
+    std::string stages;
+    for (size_t i = 0; i < STAGE_COUNT; ++i)
+        stages += fmt::format(
+                "{}\n    \"{}\": {{\"seconds\": {:.6f}, \"bytes\": {}}}",
+                i ? "," : "",
+                stage_id(static_cast<Stage>(i)),
+                totals.usec[i] / 1e6 / runs,
+                totals.bytes[i] / runs);
+
+    pkgi_poll_memory_pools();
+    const auto mem = pkgi_mem_totals();
+    std::string memory;
+    for (size_t i = 0; i < MEM_POOL_COUNT; ++i)
+        memory += fmt::format(
+                "{}\n    \"{}\": {{\"current\": {}, \"peak\": {}}}",
+                i ? "," : "",
+                mem_pool_id(static_cast<MemPool>(i)),
+                mem.current[i],
+                mem.peak[i]);
+
+    fmt::print(
+            "{{\n"
+            "  \"package\": \"{}\",\n"
+            "  \"runs\": {},\n"
+            "  \"iso\": {},\n"
+            "  \"iso_format\": \"{}\",\n"
+            "  \"read_ahead_kb\": {},\n"
+            "  \"read_ahead_blocks\": {},\n"
+            "  \"writes\": {},\n"
+            "  \"size\": {},\n"
+            "  \"mb_per_s\": {{\"min\": {:.2f}, \"median\": {:.2f}, "
+            "\"max\": {:.2f}}},\n"
+            "  \"stages_per_run\": {{{}\n  }},\n"
+            "  \"peak_rss_kb\": {},\n"
+            "  \"memory_bytes\": {{{}\n  }},\n"
+            "  \"allocations_per_run\": {},\n"
+            "  \"allocated_bytes_per_run\": {}\n"
+            "}}\n",
+            package,
+            runs,
+            save_as_iso,
+            pkgi_iso_format_name(iso_format),
+            http_options.read_ahead_kb,
+            http_options.read_ahead_blocks,
+            !discard_writes,
+            size,
+            mbps(seconds.back()),
+            mbps(seconds[seconds.size() / 2]),
+            mbps(seconds.front()),
+            stages,
+            usage.ru_maxrss,
+            memory,
+            (allocated_end.allocations - allocated.allocations) / runs,
+            (allocated_end.bytes - allocated.bytes) / runs);
+
+    return 0;
+}
+
+namespace
+{
+// the value of name in the query of target, empty when it's missing
+std::string query_value(const std::string& target, const std::string& name)
+{
+    const auto query = target.find('?');
+    if (query == std::string::npos)
+        return {};
+    auto pos = query;
+    while (pos != std::string::npos)
+    {
+        ++pos;
+        if (target.compare(pos, name.size() + 1, name + "=") == 0)
+        {
+            const auto start = pos + name.size() + 1;
+            return target.substr(start, target.find('&', start) - start);
+        }
+        pos = target.find('&', pos);
+    }
+    return {};
+}
+
+// prepares the packages the Vitas ask for, one at a time each, and tells
+// which file of their trees a request is for
+class OffloadPreparer
+{
+public:
+    OffloadPreparer(std::string packages) : _packages(std::move(packages))
+    {
+    }
+
+    ~OffloadPreparer()
+    {
+        for (auto& prepared : _prepared)
+            if (prepared.second.thread)
+                prepared.second.thread->join();
+    }
+
+    FileServer::Reply resolve(const std::string& target)
+    {
+        try
+        {
+            return do_resolve(target);
+        }
+        catch (const std::exception& e)
+        {
+            return {{}, 400, e.what()};
+        }
+    }
+
+private:
+    enum class State
+    {
+        Preparing,
+        Ready,
+        Failed,
+    };
+
+    struct Prepared
+    {
+        State state = State::Preparing;
+        std::string error;
+        std::unique_ptr<Thread> thread;
+    };
+
+    std::string _packages;
+    std::mutex _mutex;
+    // by content and variant
+    std::map<std::string, Prepared> _prepared;
+
+    static std::string partition(
+            const std::string& content, const std::string& variant)
+    {
+        return fmt::format("serve_tmp/{}/{}/", content, variant);
+    }
+
+    FileServer::Reply do_resolve(const std::string& target)
+    {
+        // /<content>/<variant>/index?... or /<content>/<variant>/files/<path>
+        const auto path = target.substr(1, target.find('?') - 1);
+        const auto content_end = path.find('/');
+        const auto variant_end = path.find('/', content_end + 1);
+        if (content_end == std::string::npos ||
+            variant_end == std::string::npos)
+            return {};
+        const auto content = path.substr(0, content_end);
+        const auto variant =
+                path.substr(content_end + 1, variant_end - content_end - 1);
+        const auto rest = path.substr(variant_end + 1);
+        if (!pkgi_is_offload_path(content) ||
+            !pkgi_is_offload_path(variant))
+            return {};
+
+        const auto key = content + "/" + variant;
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto prepared = _prepared.find(key);
+        if (rest == "index")
+        {
+            if (prepared == _prepared.end())
+            {
+                start(content, variant, target);
+                return {{}, 503, "preparing"};
+            }
+            switch (prepared->second.state)
+            {
+            case State::Preparing:
+                return {{}, 503, "preparing"};
+            case State::Failed:
+            {
+                // asked again, it's tried again
+                FileServer::Reply reply{{}, 500, prepared->second.error};
+                prepared->second.thread->join();
+                _prepared.erase(prepared);
+                return reply;
+            }
+            case State::Ready:
+                return {partition(content, variant) + "index"};
+            }
+        }
+
+        static const std::string FILES = "files/";
+        if (prepared == _prepared.end() ||
+            prepared->second.state != State::Ready ||
+            rest.compare(0, FILES.size(), FILES) != 0 ||
+            !pkgi_is_offload_path(rest.substr(FILES.size())))
+            return {};
+        return {fmt::format(
+                "{}pkgj/{}/{}",
+                partition(content, variant),
+                content,
+                rest.substr(FILES.size()))};
+    }
+
+    void start(
+            const std::string& content,
+            const std::string& variant,
+            const std::string& target)
+    {
+        const auto package = fmt::format("{}/{}.pkg", _packages, content);
+        if (!pkgi_file_exists(package))
+            throw std::runtime_error(
+                    fmt::format("no package {}", package));
+
+        std::vector<uint8_t> digest;
+        boost::algorithm::unhex(
+                query_value(target, "sha256"), std::back_inserter(digest));
+        std::vector<uint8_t> rif;
+        boost::algorithm::unhex(
+                query_value(target, "rif"), std::back_inserter(rif));
+        // pkgi_download reads a whole digest and rif from them
+        if (!digest.empty() && digest.size() != SHA256_DIGEST_SIZE)
+            throw std::runtime_error(fmt::format(
+                    "sha256 must be {} bytes", SHA256_DIGEST_SIZE));
+        if (!rif.empty() && rif.size() != PKGI_RIF_SIZE)
+            throw std::runtime_error(
+                    fmt::format("rif must be {} bytes", PKGI_RIF_SIZE));
+
+        auto& prepared = _prepared[content + "/" + variant];
+        prepared.thread = std::make_unique<Thread>(
+                "offload_prepare",
+                [=, &prepared] {
+                    std::string error;
+                    try
+                    {
+                        prepare(package, content, variant, digest, rif);
+                    }
+                    catch (const std::exception& e)
+                    {
+                        error = e.what();
+                    }
+                    fmt::print(
+                            "{} {}: {}\n",
+                            content,
+                            variant,
+                            error.empty() ? "ready" : error);
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    prepared.state =
+                            error.empty() ? State::Ready : State::Failed;
+                    prepared.error = error;
+                },
+                ThreadRole::Background);
+    }
+
+    static void prepare(
+            const std::string& package,
+            const std::string& content,
+            const std::string& variant,
+            const std::vector<uint8_t>& digest,
+            const std::vector<uint8_t>& rif)
+    {
+        const auto root = partition(content, variant);
+        pkgi_delete_dir(root);
+
+        Download d(make_http(package));
+        d.http_factory = [package] { return make_http(package); };
+        d.save_as_iso = variant != "pkg";
+        d.iso_format = pkgi_parse_iso_format(variant);
+        d.update_progress_cb = [](uint64_t, uint64_t) {};
+        d.update_status = [](auto&&) {};
+        d.is_canceled = [] { return false; };
+        if (!d.pkgi_download(
+                    root.c_str(),
+                    content.c_str(),
+                    package.c_str(),
+                    rif.empty() ? nullptr : rif.data(),
+                    digest.empty() ? nullptr : digest.data()))
+            throw std::runtime_error("download failed");
+
+        const auto index = pkgi_format_offload_index(pkgi_list_offload_tree(
+                fmt::format("{}pkgj/{}", root, content)));
+        pkgi_save(root + "index", index.data(), index.size());
+    }
+};
+}
+
+// prepares the packages of pkgdir, named <content>.pkg as in pkgj/pkg, for
+// the Vitas that ask for them and serves the trees they turn into until
+// interrupted, see OffloadDownload
+int serve(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    uint16_t port = OFFLOAD_PORT;
+    for (int i = 3; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc)
+            port = static_cast<uint16_t>(atoi(argv[++i]));
+        else
+        {
+            printf(USAGE, argv[0]);
+            return 1;
+        }
+    }
+
+    OffloadPreparer preparer(argv[2]);
+    FileServer server(
+            "offload_serve", port, [&](const std::string& target) {
+                return preparer.resolve(target);
+            });
+    if (!server.listening())
+    {
+        fmt::print("can't listen on port {}\n", port);
+        return 1;
+    }
+    fmt::print("serving the packages of {} on port {}\n", argv[2], port);
+    while (true)
+        pkgi_sleep(1000);
+}
+
 int main(int argc, char* argv[])
 {
+#ifdef PKGI_ENABLE_LOGGING
+    pkgi_log_start();
+    std::atexit(pkgi_log_stop);
+#endif
+#ifdef PKGI_ENABLE_TRACING
+    // the whole run goes to the working directory
+    std::atexit([] { pkgi_trace_dump("trace.json"); });
+#endif
+
+    if (argc >= 3 && std::string(argv[1]) == "--network")
+    {
+        g_network = pkgi_load_network_profile(argv[2]);
+        // the commands see their arguments where they always were
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
     if (argc < 2)
     {
         printf(USAGE, argv[0]);
@@ -155,14 +1055,28 @@ int main(int argc, char* argv[])
         return extract(argc, argv);
     if (std::string(argv[1]) == "refreshlist")
         return refreshlist(argc, argv);
+    if (std::string(argv[1]) == "buildindex")
+        return buildindex(argc, argv);
     if (std::string(argv[1]) == "refreshcomppack")
         return refreshcomppack(argc, argv);
     if (std::string(argv[1]) == "filedownload")
         return filedownload(argc, argv);
     if (std::string(argv[1]) == "extractzip")
         return extractzip(argc, argv);
+    if (std::string(argv[1]) == "streamzip")
+        return streamzip(argc, argv);
     if (std::string(argv[1]) == "patchinfo")
         return patchinfo(argc, argv);
+    if (std::string(argv[1]) == "lzrcbench")
+        return lzrcbench(argc, argv);
+    if (std::string(argv[1]) == "searchall")
+        return searchall(argc, argv);
+    if (std::string(argv[1]) == "query")
+        return query(argc, argv);
+    if (std::string(argv[1]) == "bench")
+        return bench(argc, argv);
+    if (std::string(argv[1]) == "serve")
+        return serve(argc, argv);
 
     printf(USAGE, argv[0]);
     return 1;
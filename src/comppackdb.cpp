@@ -1,5 +1,7 @@
 #include "comppackdb.hpp"
 
+#include "inflater.hpp"
+#include "memstats.hpp"
 #include "pkgi.hpp"
 #include "sqlite.hpp"
 #include "utils.hpp"
@@ -10,13 +12,14 @@
 
 #include <algorithm>
 #include <cstring>
-#include <regex>
+#include <memory>
 #include <stdexcept>
 #include <string>
 
 #include <stddef.h>
 
-CompPackDatabase::CompPackDatabase(std::string const& dbPath) : _dbPath(dbPath)
+CompPackDatabase::CompPackDatabase(std::string const& dbPath)
+    : _dbPath(dbPath), _mutex("comppack_db_mutex")
 {
     reopen();
 }
@@ -24,6 +27,9 @@ CompPackDatabase::CompPackDatabase(std::string const& dbPath) : _dbPath(dbPath)
 void CompPackDatabase::reopen()
 {
     LOG("opening database %s", _dbPath.c_str());
+    // the old connection can't be closed with statements left
+    _get_stmt.reset();
+    _search_stmt.reset();
     sqlite3* db;
     SQLITE_CHECK(sqlite3_open(_dbPath.c_str(), &db), "can't open database");
     _sqliteDb.reset(db);
@@ -63,45 +69,116 @@ void CompPackDatabase::reopen()
             PRIMARY KEY (titleid, app_version)
         ))",
             "can't create comp pack table");
+
+    // the database is only a cache of the lists, rebuilt on each refresh,
+    // there is no point in syncing it to the card
+    SQLITE_EXEC(
+            _sqliteDb,
+            "PRAGMA journal_mode = MEMORY",
+            "can't set journal mode");
+    SQLITE_EXEC(
+            _sqliteDb, "PRAGMA synchronous = OFF", "can't set synchronous");
 }
 
-namespace
-{
-std::vector<const char*> pkgi_split_row(char** pptr, const char* end)
+sqlite3_stmt* CompPackDatabase::prepare(SqliteStmtPtr& stmt, const char* sql)
 {
-    auto& ptr = *pptr;
+    if (!stmt)
+    {
+        sqlite3_stmt* raw;
+        SQLITE_CHECK(
+                sqlite3_prepare_v2(_sqliteDb.get(), sql, -1, &raw, nullptr),
+                "can't prepare SQL statement");
+        stmt.reset(raw);
+    }
+    return stmt.get();
+}
 
-    std::vector<const char*> result;
-    while (ptr != end)
+// after the app is suspended, all further queries return disk I/O errors
+// until the database is opened again
+template <typename F>
+auto CompPackDatabase::retry_on_ioerr(F&& query) -> decltype(query())
+{
+    try
     {
-        const char* field = ptr;
-        while (ptr != end && *ptr != '=' && *ptr != '\n')
-            ++ptr;
-        if (ptr == end)
-        {
-            result.push_back(field);
-            break;
-        }
-        if (*ptr == '\n')
-        {
-            *ptr++ = 0;
-            break;
-        }
-        *ptr++ = 0;
-        result.push_back(field);
+        return query();
+    }
+    catch (const std::exception& e)
+    {
+        if ((sqlite3_errcode(_sqliteDb.get()) & 0xff) != SQLITE_IOERR)
+            throw;
+        LOGF("{}, reopening database", e.what());
+    }
+    reopen();
+    return query();
+}
 
-        if (ptr == end)
+namespace
+{
+// A and 9 stand for an upper case letter and a digit, ? for any character but
+// a new line, like the . of a regex
+constexpr char PPK_PATTERN[] = "AAAA99999-99_999-99_99-99_99?ppk";
+constexpr size_t PPK_PATTERN_SIZE = sizeof(PPK_PATTERN) - 1;
+constexpr size_t PPK_APP_VERSION_OFFSET = 17;
+
+// offset of the first TITLEID-xx_xxx-xx_xx-xx_xx.ppk in str, or npos
+size_t find_ppk(const std::string& str)
+{
+    for (size_t pos = 0; pos + PPK_PATTERN_SIZE <= str.size(); ++pos)
+    {
+        size_t i = 0;
+        for (; i < PPK_PATTERN_SIZE; ++i)
         {
-            result.push_back(field);
-            break;
+            const auto c = str[pos + i];
+            const auto p = PPK_PATTERN[i];
+            const bool match = p == 'A'   ? c >= 'A' && c <= 'Z'
+                               : p == '9' ? c >= '0' && c <= '9'
+                               : p == '?' ? c != '\n'
+                                          : c == p;
+            if (!match)
+                break;
         }
+        if (i == PPK_PATTERN_SIZE)
+            return pos;
     }
-    return result;
+    return std::string::npos;
+}
+
+// rows per INSERT, 3 parameters each
+constexpr size_t INSERT_BATCH = 64;
+
+std::string insert_sql(size_t rows)
+{
+    std::string sql =
+            "INSERT INTO entries (titleid, path, app_version) VALUES ";
+    for (size_t i = 0; i < rows; ++i)
+        sql += i == 0 ? "(?, ?, ?)" : ", (?, ?, ?)";
+    return sql;
+}
 }
+
+void CompPackDatabase::parse_line(
+        const std::string& line, std::vector<Entry>& entries)
+{
+    // the path is the first field
+    const auto path = line.substr(0, line.find('='));
+    if (path.empty())
+        throw formatEx<std::runtime_error>("无法解析行\n{}", line);
+
+    const auto pos = find_ppk(path);
+    if (pos == std::string::npos)
+        throw formatEx<std::runtime_error>(
+                "无法解析行\n{}\n正则表达式不正确", line);
+
+    entries.push_back(Entry{
+            path.substr(pos, 9),
+            path,
+            path.substr(pos + PPK_APP_VERSION_OFFSET, 5)});
 }
 
-void CompPackDatabase::parse_entries(std::string& db_data)
+void CompPackDatabase::insert_entries(const std::vector<Entry>& entries)
 {
+    ScopeLock lock(_mutex);
+
     SQLITE_EXEC(_sqliteDb, "BEGIN", "can't begin transaction");
 
     BOOST_SCOPE_EXIT_ALL(&)
@@ -120,103 +197,121 @@ void CompPackDatabase::parse_entries(std::string& db_data)
 
     SQLITE_EXEC(_sqliteDb, "DELETE FROM entries", "can't truncate table");
 
-    sqlite3_stmt* stmt;
-    SQLITE_CHECK(
-            sqlite3_prepare_v2(
-                    _sqliteDb.get(),
-                    R"(INSERT INTO entries
-                    (titleid, path, app_version)
-                    VALUES (?, ?, ?))",
-                    -1,
-                    &stmt,
-                    nullptr),
-            "can't prepare SQL statement");
-    BOOST_SCOPE_EXIT_ALL(&)
-    {
-        sqlite3_finalize(stmt);
-    };
-
-    char* ptr = db_data.data();
-    char* end = db_data.data() + db_data.size();
-
-    const auto regex = std::regex(
-            R"(([A-Z]{4}\d{5})-(\d{2}_\d{3})-(\d{2}_\d{2})-(\d{2}_\d{2}).ppk)");
-
-    const char* current_line = ptr;
-    while (ptr < end && *ptr)
+    SqliteStmtPtr batch;
+    SqliteStmtPtr rest;
+    for (size_t first = 0; first < entries.size(); first += INSERT_BATCH)
     {
-        try
+        const auto rows = std::min(INSERT_BATCH, entries.size() - first);
+        // only the last batch is shorter
+        const auto stmt = prepare(
+                rows == INSERT_BATCH ? batch : rest,
+                insert_sql(rows).c_str());
+
+        sqlite3_reset(stmt);
+        for (size_t i = 0; i < rows; ++i)
         {
-            current_line = ptr;
-            const auto fields = pkgi_split_row(&ptr, end);
-            if (fields.size() < 1)
-                throw std::runtime_error("无法解析行");
-
-            const auto path = std::string(fields[0]);
-
-            std::smatch matches;
-            if (!std::regex_search(path, matches, regex))
-                throw formatEx<std::runtime_error>("正则表达式不正确");
-            const auto titleid = matches.str(1);
-            const auto app_version = matches.str(3);
-
-            sqlite3_reset(stmt);
-            sqlite3_bind_text(stmt, 1, titleid.data(), titleid.size(), nullptr);
-            sqlite3_bind_text(stmt, 2, path.data(), path.size(), nullptr);
+            const auto& entry = entries[first + i];
             sqlite3_bind_text(
-                    stmt, 3, app_version.data(), app_version.size(), nullptr);
-
-            auto err = sqlite3_step(stmt);
-            if (err != SQLITE_DONE)
-                throw std::runtime_error(fmt::format(
-                        "无法执行SQL语句:\n{}",
-                        sqlite3_errmsg(_sqliteDb.get())));
-        }
-        catch (const std::exception& e)
-        {
-            throw formatEx<std::runtime_error>(
-                    "无法解析行\n{}\n{}", current_line, e.what());
+                    stmt,
+                    i * 3 + 1,
+                    entry.titleid.data(),
+                    entry.titleid.size(),
+                    nullptr);
+            sqlite3_bind_text(
+                    stmt,
+                    i * 3 + 2,
+                    entry.path.data(),
+                    entry.path.size(),
+                    nullptr);
+            sqlite3_bind_text(
+                    stmt,
+                    i * 3 + 3,
+                    entry.app_version.data(),
+                    entry.app_version.size(),
+                    nullptr);
         }
+
+        auto err = sqlite3_step(stmt);
+        if (err != SQLITE_DONE)
+            throw std::runtime_error(fmt::format(
+                    "无法执行SQL语句:\n{}",
+                    sqlite3_errmsg(_sqliteDb.get())));
     }
 }
 
 void CompPackDatabase::update(Http* http, const std::string& update_url)
 {
-    std::string db_data;
-    db_data.resize(MAX_DB_SIZE);
-    uint64_t db_size = 0;
-
     if (update_url.empty())
         throw std::runtime_error("没有兼容包链接");
 
     LOGF("loading comp pack list from {}", update_url);
 
+    http->add_request_header("Accept-Encoding", "gzip, deflate");
     http->start(update_url, 0);
 
     const auto length = http->get_length();
 
-    if (length > (int64_t)db_data.size())
+    if (length > (int64_t)MAX_DB_SIZE)
         throw std::runtime_error(
                 "兼容包列表过大... 请更新PKGj版本");
 
-    for (;;)
-    {
-        uint32_t want = (uint32_t)min64(64 * 1024, db_data.size() - db_size);
-        int read = http->read(
-                reinterpret_cast<uint8_t*>(db_data.data()) + db_size, want);
-        if (read == 0)
-            break;
-        db_size += read;
-    }
+    std::unique_ptr<Inflater> inflater;
+    if (Inflater::handles(http->get_response_header("Content-Encoding")))
+        inflater = std::make_unique<Inflater>();
+
+    // lines are parsed as they come in, only the entries are kept
+    std::vector<Entry> entries;
+    std::string line;
+    uint64_t total = 0;
+    bool ended = false;
+    const auto append = [&](const uint8_t* data, uint32_t size) {
+        total += size;
+        if (total > MAX_DB_SIZE)
+            throw std::runtime_error(
+                    "兼容包列表过大... 请更新PKGj版本");
+
+        const auto text = reinterpret_cast<const char*>(data);
+        for (uint32_t i = 0; i < size && !ended; ++i)
+        {
+            // like a C string, the list ends at the first NUL
+            if (text[i] == '\0' && line.empty())
+                ended = true;
+            else if (text[i] == '\n')
+            {
+                parse_line(line, entries);
+                line.clear();
+            }
+            else
+                line += text[i];
+        }
+    };
+
+    pkgi_http_consume(*http, [&](const uint8_t* data, uint32_t size) {
+        if (inflater)
+            inflater->write(data, size, append);
+        else
+            append(data, size);
+    });
+    if (inflater)
+        inflater->finish();
 
-    if (db_size == 0)
+    if (!line.empty() && !ended)
+        parse_line(line, entries);
+
+    if (total == 0)
         throw std::runtime_error(
                 "兼容包列表为空... 请更新PKGj版本");
 
-    LOG("parsing items");
+    LOGF("inserting {} items", entries.size());
+
+    MemoryCharge memory(MemPool::CompPack);
+    size_t allocated = entries.capacity() * sizeof(Entry);
+    for (const auto& entry : entries)
+        allocated += entry.titleid.capacity() + entry.path.capacity() +
+                     entry.app_version.capacity();
+    memory.set(allocated);
 
-    db_data.resize(db_size);
-    parse_entries(db_data);
+    insert_entries(entries);
 
     LOG("finished parsing");
 }
@@ -224,45 +319,98 @@ void CompPackDatabase::update(Http* http, const std::string& update_url)
 std::optional<CompPackDatabase::Item> CompPackDatabase::get(
         const std::string& titleid)
 {
-    // we need to reopen the db before every query because for some reason,
-    // after the app is suspended, all further query will return disk I/O error
-    reopen();
+    ScopeLock lock(_mutex);
+    return retry_on_ioerr([&]() -> std::optional<Item> {
+        const auto stmt = prepare(
+                _get_stmt,
+                "SELECT path, app_version "
+                "FROM entries "
+                "WHERE titleid = ? ");
+        BOOST_SCOPE_EXIT_ALL(&)
+        {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        };
+
+        sqlite3_bind_text(stmt, 1, titleid.data(), titleid.size(), nullptr);
+
+        auto const err = sqlite3_step(stmt);
+        if (err == SQLITE_DONE)
+            return std::nullopt;
+        if (err != SQLITE_ROW)
+            throw std::runtime_error(fmt::format(
+                    "无法执行SQL语句:\n{}",
+                    sqlite3_errmsg(_sqliteDb.get())));
+
+        std::string app_version =
+                reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+        // replace _ by .
+        app_version[2] = '.';
+
+        return Item{
+                reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+                app_version,
+        };
+    });
+}
 
-    LOG("reloading database");
-
-    sqlite3_stmt* stmt;
-    SQLITE_CHECK(
-            sqlite3_prepare_v2(
-                    _sqliteDb.get(),
-                    "SELECT path, app_version "
-                    "FROM entries "
-                    "WHERE titleid = ? ",
-                    -1,
-                    &stmt,
-                    nullptr),
-            "can't prepare SQL statement");
-    BOOST_SCOPE_EXIT_ALL(&)
+std::vector<CompPackDatabase::SearchHit> CompPackDatabase::search(
+        const std::string& query, size_t max_hits)
+{
+    std::string pattern = "%";
+    for (const auto c : query)
     {
-        sqlite3_finalize(stmt);
-    };
-
-    sqlite3_bind_text(stmt, 1, titleid.data(), titleid.size(), nullptr);
+        if (c == '%' || c == '_' || c == '\\')
+            pattern += '\\';
+        pattern += c;
+    }
+    pattern += '%';
+
+    ScopeLock lock(_mutex);
+    return retry_on_ioerr([&] {
+        const auto stmt = prepare(
+                _search_stmt,
+                "SELECT titleid, path, app_version "
+                "FROM entries "
+                "WHERE titleid LIKE ? ESCAPE '\\' "
+                "ORDER BY titleid, app_version "
+                "LIMIT ? ");
+        BOOST_SCOPE_EXIT_ALL(&)
+        {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        };
 
-    auto const err = sqlite3_step(stmt);
-    if (err == SQLITE_DONE)
-        return std::nullopt;
-    if (err != SQLITE_ROW)
-        throw std::runtime_error(fmt::format(
-                "无法执行SQL语句:\n{}",
-                sqlite3_errmsg(_sqliteDb.get())));
+        sqlite3_bind_text(stmt, 1, pattern.data(), pattern.size(), nullptr);
+        sqlite3_bind_int64(stmt, 2, max_hits);
 
-    std::string app_version =
-            reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-    // replace _ by .
-    app_version[2] = '.';
+        std::vector<SearchHit> hits;
+        while (true)
+        {
+            auto const err = sqlite3_step(stmt);
+            if (err == SQLITE_DONE)
+                break;
+            if (err != SQLITE_ROW)
+                throw std::runtime_error(fmt::format(
+                        "无法执行SQL语句:\n{}",
+                        sqlite3_errmsg(_sqliteDb.get())));
 
-    return Item{
-            reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
-            app_version,
-    };
+            std::string app_version = reinterpret_cast<const char*>(
+                    sqlite3_column_text(stmt, 2));
+            // replace _ by .
+            if (app_version.size() > 2)
+                app_version[2] = '.';
+
+            hits.push_back(SearchHit{
+                    reinterpret_cast<const char*>(
+                            sqlite3_column_text(stmt, 0)),
+                    Item{
+                            reinterpret_cast<const char*>(
+                                    sqlite3_column_text(stmt, 1)),
+                            app_version,
+                    },
+            });
+        }
+        return hits;
+    });
 }
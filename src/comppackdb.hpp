@@ -2,9 +2,11 @@
 
 #include "http.hpp"
 #include "sqlite.hpp"
+#include "thread.hpp"
 
 #include <array>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <vector>
@@ -26,14 +28,43 @@ public:
 
     std::optional<Item> get(const std::string& titleid);
 
+    struct SearchHit
+    {
+        std::string titleid;
+        Item item;
+    };
+
+    // entries whose title id contains query, ignoring case
+    std::vector<SearchHit> search(const std::string& query, size_t max_hits);
+
 private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
     static constexpr auto MAX_DB_SIZE = 4 * 1024 * 1024;
 
     std::string _dbPath;
 
+    // update() runs on the refresh thread while the queries run on the main
+    // one
+    Mutex _mutex;
     SqlitePtr _sqliteDb = nullptr;
+    // prepared once per connection
+    SqliteStmtPtr _get_stmt;
+    SqliteStmtPtr _search_stmt;
+
+    struct Entry
+    {
+        std::string titleid;
+        std::string path;
+        std::string app_version;
+    };
 
-    void parse_entries(std::string& db_data);
+    static void parse_line(
+            const std::string& line, std::vector<Entry>& entries);
+    void insert_entries(const std::vector<Entry>& entries);
 
     void reopen();
+    sqlite3_stmt* prepare(SqliteStmtPtr& stmt, const char* sql);
+    template <typename F>
+    auto retry_on_ioerr(F&& query) -> decltype(query());
 };
@@ -139,14 +139,38 @@ void repo_to_address(Config &config, int isRefresh){
         config.repo = 0;
     }
     const std::string repo_address = config.repo_list[config.repo];
-    config.games_url = repo_address + PSV_GAMES_POSTFIX;
-    config.dlcs_url = repo_address + PSV_DLCS_POSTFIX;
-    config.demos_url = repo_address + PSV_DEMOS_POSTFIX;
-    config.themes_url = repo_address + PSV_THEMES_POSTFIX;
-    config.psm_games_url = repo_address + PSM_GAMES_POSTFIX;
-    config.psx_games_url = repo_address + PSX_GAMES_POSTFIX;
-    config.psp_games_url = repo_address + PSP_GAMES_POSTFIX;
-    config.psp_dlcs_url = repo_address + PSP_DLCS_POSTFIX;
+    config.games_url = pkgi_repo_list_url(repo_address, ModeGames);
+    config.dlcs_url = pkgi_repo_list_url(repo_address, ModeDlcs);
+    config.demos_url = pkgi_repo_list_url(repo_address, ModeDemos);
+    config.themes_url = pkgi_repo_list_url(repo_address, ModeThemes);
+    config.psm_games_url = pkgi_repo_list_url(repo_address, ModePsmGames);
+    config.psx_games_url = pkgi_repo_list_url(repo_address, ModePsxGames);
+    config.psp_games_url = pkgi_repo_list_url(repo_address, ModePspGames);
+    config.psp_dlcs_url = pkgi_repo_list_url(repo_address, ModePspDlcs);
+}
+
+std::string pkgi_repo_list_url(const std::string& repo, Mode mode)
+{
+    switch (mode)
+    {
+    case ModeGames:
+        return repo + PSV_GAMES_POSTFIX;
+    case ModeDlcs:
+        return repo + PSV_DLCS_POSTFIX;
+    case ModeDemos:
+        return repo + PSV_DEMOS_POSTFIX;
+    case ModeThemes:
+        return repo + PSV_THEMES_POSTFIX;
+    case ModePsmGames:
+        return repo + PSM_GAMES_POSTFIX;
+    case ModePsxGames:
+        return repo + PSX_GAMES_POSTFIX;
+    case ModePspGames:
+        return repo + PSP_GAMES_POSTFIX;
+    case ModePspDlcs:
+        return repo + PSP_DLCS_POSTFIX;
+    }
+    return "";
 }
 
 
@@ -162,6 +186,34 @@ Config pkgi_load_config(int isRefresh)
         config.order = SortAscending;
         config.filter = DbFilterAll;
         config.install_psp_psx_location = "ux0:";
+        config.psp_iso_format = IsoFormat::Iso;
+        config.download_connections = 1;
+        config.download_jobs = 2;
+        config.download_limit_kb = 0;
+        config.job_limit_kb = 0;
+        config.download_when_charging = false;
+        config.wifi_keep_awake = false;
+        config.multi_repo = false;
+        config.write_buffer_kb = 0;
+        config.list_cache_kb = 16384;
+        config.memory_budget_kb = 32768;
+        config.patch_info_ttl_hours = 24;
+        config.refresh_interval_minutes = 0;
+        config.refresh_on_launch = false;
+        config.cpu_ui = 0;
+        config.cpu_network = 1;
+        config.cpu_worker = 2;
+        config.show_stage_stats = false;
+        config.show_memory_stats = false;
+        config.skip_idle_frames = true;
+        config.cpu_governor = true;
+        config.icon_cache_kb = 2048;
+        config.lan_peers = false;
+        config.record_http = false;
+        config.net_pool_kb = 0;
+        config.ssl_pool_kb = 0;
+        config.http_pool_kb = 0;
+        config.vita2d_pool_kb = 0;
         config.comppack_url = default_comppack_url;
         if(isRefresh){
             repo_to_address(config,1);
@@ -209,9 +261,123 @@ Config pkgi_load_config(int isRefresh)
         if(json_data.HasMember("install_psp_psx_location")&&json_data["install_psp_psx_location"].IsString()){
             config.install_psp_psx_location = json_data["install_psp_psx_location"].GetString();
         }
+        if(json_data.HasMember("psp_iso_format")&&json_data["psp_iso_format"].IsString()){
+            config.psp_iso_format = pkgi_parse_iso_format(json_data["psp_iso_format"].GetString());
+        }
         if(json_data.HasMember("enablePSM")&&json_data["enablePSM"].IsString()){
             config.psm_readme_disclaimer = json_data["enablePSM"].GetBool();
         }
+        if(json_data.HasMember("download_connections")&&json_data["download_connections"].IsInt()){
+            config.download_connections = json_data["download_connections"].GetInt();
+        }
+        if(json_data.HasMember("download_jobs")&&json_data["download_jobs"].IsInt()){
+            config.download_jobs = json_data["download_jobs"].GetInt();
+        }
+        if(json_data.HasMember("download_limit_kb")&&json_data["download_limit_kb"].IsInt()){
+            config.download_limit_kb = json_data["download_limit_kb"].GetInt();
+        }
+        if(json_data.HasMember("job_limit_kb")&&json_data["job_limit_kb"].IsInt()){
+            config.job_limit_kb = json_data["job_limit_kb"].GetInt();
+        }
+        if(json_data.HasMember("download_hours")&&json_data["download_hours"].IsString()){
+            config.download_hours = json_data["download_hours"].GetString();
+        }
+        if(json_data.HasMember("download_when_charging")&&json_data["download_when_charging"].IsBool()){
+            config.download_when_charging = json_data["download_when_charging"].GetBool();
+        }
+        if(json_data.HasMember("wifi_keep_awake")&&json_data["wifi_keep_awake"].IsBool()){
+            config.wifi_keep_awake = json_data["wifi_keep_awake"].GetBool();
+        }
+        if(json_data.HasMember("write_buffer_kb")&&json_data["write_buffer_kb"].IsInt()){
+            config.write_buffer_kb = json_data["write_buffer_kb"].GetInt();
+        }
+        if(json_data.HasMember("list_cache_kb")&&json_data["list_cache_kb"].IsInt()){
+            config.list_cache_kb = json_data["list_cache_kb"].GetInt();
+        }
+        if(json_data.HasMember("memory_budget_kb")&&json_data["memory_budget_kb"].IsInt()){
+            config.memory_budget_kb = json_data["memory_budget_kb"].GetInt();
+        }
+        if(json_data.HasMember("patch_info_ttl_hours")&&json_data["patch_info_ttl_hours"].IsInt()){
+            config.patch_info_ttl_hours = json_data["patch_info_ttl_hours"].GetInt();
+        }
+        if(json_data.HasMember("refresh_interval_minutes")&&json_data["refresh_interval_minutes"].IsInt()){
+            config.refresh_interval_minutes = json_data["refresh_interval_minutes"].GetInt();
+        }
+        if(json_data.HasMember("refresh_on_launch")&&json_data["refresh_on_launch"].IsBool()){
+            config.refresh_on_launch = json_data["refresh_on_launch"].GetBool();
+        }
+        if(json_data.HasMember("cpu_ui")&&json_data["cpu_ui"].IsInt()){
+            config.cpu_ui = json_data["cpu_ui"].GetInt();
+        }
+        if(json_data.HasMember("cpu_network")&&json_data["cpu_network"].IsInt()){
+            config.cpu_network = json_data["cpu_network"].GetInt();
+        }
+        if(json_data.HasMember("cpu_worker")&&json_data["cpu_worker"].IsInt()){
+            config.cpu_worker = json_data["cpu_worker"].GetInt();
+        }
+        if(json_data.HasMember("show_stage_stats")&&json_data["show_stage_stats"].IsBool()){
+            config.show_stage_stats = json_data["show_stage_stats"].GetBool();
+        }
+        if(json_data.HasMember("show_memory_stats")&&json_data["show_memory_stats"].IsBool()){
+            config.show_memory_stats = json_data["show_memory_stats"].GetBool();
+        }
+        if(json_data.HasMember("skip_idle_frames")&&json_data["skip_idle_frames"].IsBool()){
+            config.skip_idle_frames = json_data["skip_idle_frames"].GetBool();
+        }
+        if(json_data.HasMember("cpu_governor")&&json_data["cpu_governor"].IsBool()){
+            config.cpu_governor = json_data["cpu_governor"].GetBool();
+        }
+        if(json_data.HasMember("icon_cache_kb")&&json_data["icon_cache_kb"].IsInt()){
+            config.icon_cache_kb = json_data["icon_cache_kb"].GetInt();
+        }
+        if(json_data.HasMember("icon_url")&&json_data["icon_url"].IsString()){
+            config.icon_url = json_data["icon_url"].GetString();
+        }
+        if(json_data.HasMember("chunks_url")&&json_data["chunks_url"].IsString()){
+            config.chunks_url = json_data["chunks_url"].GetString();
+        }
+        if(json_data.HasMember("lan_peers")&&json_data["lan_peers"].IsBool()){
+            config.lan_peers = json_data["lan_peers"].GetBool();
+        }
+        if(json_data.HasMember("record_http")&&json_data["record_http"].IsBool()){
+            config.record_http = json_data["record_http"].GetBool();
+        }
+        if(json_data.HasMember("offload_url")&&json_data["offload_url"].IsString()){
+            config.offload_url = json_data["offload_url"].GetString();
+        }
+        if(json_data.HasMember("net_pool_kb")&&json_data["net_pool_kb"].IsInt()){
+            config.net_pool_kb = json_data["net_pool_kb"].GetInt();
+        }
+        if(json_data.HasMember("ssl_pool_kb")&&json_data["ssl_pool_kb"].IsInt()){
+            config.ssl_pool_kb = json_data["ssl_pool_kb"].GetInt();
+        }
+        if(json_data.HasMember("http_pool_kb")&&json_data["http_pool_kb"].IsInt()){
+            config.http_pool_kb = json_data["http_pool_kb"].GetInt();
+        }
+        if(json_data.HasMember("vita2d_pool_kb")&&json_data["vita2d_pool_kb"].IsInt()){
+            config.vita2d_pool_kb = json_data["vita2d_pool_kb"].GetInt();
+        }
+        if(json_data.HasMember("http_hosts")&&json_data["http_hosts"].IsObject()){
+            for (const auto& host : json_data["http_hosts"].GetObject()){
+                if(!host.value.IsObject()){
+                    continue;
+                }
+                HttpOptions options;
+                const auto read = [&](const char* name, uint32_t& value){
+                    if(host.value.HasMember(name)&&host.value[name].IsUint()){
+                        value = host.value[name].GetUint();
+                    }
+                };
+                read("connect_timeout_ms", options.connect_timeout_ms);
+                read("recv_timeout_ms", options.recv_timeout_ms);
+                read("read_ahead_kb", options.read_ahead_kb);
+                read("read_ahead_blocks", options.read_ahead_blocks);
+                config.http_hosts.emplace_back(host.name.GetString(), options);
+            }
+        }
+        if(json_data.HasMember("multi_repo")&&json_data["multi_repo"].IsBool()){
+            config.multi_repo = json_data["multi_repo"].GetBool();
+        }
         if(json_data.HasMember("repoID")&&json_data["repoID"].IsInt()){
             config.repo = json_data["repoID"].GetInt();
         }
@@ -335,8 +501,88 @@ void pkgi_save_config(const Config& config)
     writer.Bool(config.install_psp_as_pbp);
     writer.Key("install_psp_psx_location");
     writer.String(config.install_psp_psx_location.c_str());
+    writer.Key("psp_iso_format");
+    writer.String(pkgi_iso_format_name(config.psp_iso_format));
     writer.Key("enablePSM");
     writer.Bool(config.psm_readme_disclaimer);
+    writer.Key("download_connections");
+    writer.Int(config.download_connections);
+    writer.Key("download_jobs");
+    writer.Int(config.download_jobs);
+    writer.Key("download_limit_kb");
+    writer.Int(config.download_limit_kb);
+    writer.Key("job_limit_kb");
+    writer.Int(config.job_limit_kb);
+    writer.Key("download_hours");
+    writer.String(config.download_hours.c_str());
+    writer.Key("download_when_charging");
+    writer.Bool(config.download_when_charging);
+    writer.Key("wifi_keep_awake");
+    writer.Bool(config.wifi_keep_awake);
+    writer.Key("write_buffer_kb");
+    writer.Int(config.write_buffer_kb);
+    writer.Key("list_cache_kb");
+    writer.Int(config.list_cache_kb);
+    writer.Key("memory_budget_kb");
+    writer.Int(config.memory_budget_kb);
+    writer.Key("patch_info_ttl_hours");
+    writer.Int(config.patch_info_ttl_hours);
+    writer.Key("refresh_interval_minutes");
+    writer.Int(config.refresh_interval_minutes);
+    writer.Key("refresh_on_launch");
+    writer.Bool(config.refresh_on_launch);
+    writer.Key("cpu_ui");
+    writer.Int(config.cpu_ui);
+    writer.Key("cpu_network");
+    writer.Int(config.cpu_network);
+    writer.Key("cpu_worker");
+    writer.Int(config.cpu_worker);
+    writer.Key("show_stage_stats");
+    writer.Bool(config.show_stage_stats);
+    writer.Key("show_memory_stats");
+    writer.Bool(config.show_memory_stats);
+    writer.Key("skip_idle_frames");
+    writer.Bool(config.skip_idle_frames);
+    writer.Key("cpu_governor");
+    writer.Bool(config.cpu_governor);
+    writer.Key("icon_cache_kb");
+    writer.Int(config.icon_cache_kb);
+    writer.Key("icon_url");
+    writer.String(config.icon_url.c_str());
+    writer.Key("chunks_url");
+    writer.String(config.chunks_url.c_str());
+    writer.Key("lan_peers");
+    writer.Bool(config.lan_peers);
+    writer.Key("record_http");
+    writer.Bool(config.record_http);
+    writer.Key("offload_url");
+    writer.String(config.offload_url.c_str());
+    writer.Key("net_pool_kb");
+    writer.Int(config.net_pool_kb);
+    writer.Key("ssl_pool_kb");
+    writer.Int(config.ssl_pool_kb);
+    writer.Key("http_pool_kb");
+    writer.Int(config.http_pool_kb);
+    writer.Key("vita2d_pool_kb");
+    writer.Int(config.vita2d_pool_kb);
+    writer.Key("http_hosts");
+    writer.StartObject();
+    for(const auto& host : config.http_hosts){
+        writer.Key(host.first.c_str());
+        writer.StartObject();
+        writer.Key("connect_timeout_ms");
+        writer.Uint(host.second.connect_timeout_ms);
+        writer.Key("recv_timeout_ms");
+        writer.Uint(host.second.recv_timeout_ms);
+        writer.Key("read_ahead_kb");
+        writer.Uint(host.second.read_ahead_kb);
+        writer.Key("read_ahead_blocks");
+        writer.Uint(host.second.read_ahead_blocks);
+        writer.EndObject();
+    }
+    writer.EndObject();
+    writer.Key("multi_repo");
+    writer.Bool(config.multi_repo);
     writer.Key("repoID");
     writer.Int(config.repo);
     writer.Key("url_comppack");
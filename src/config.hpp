@@ -1,6 +1,8 @@
 #pragma once
 
 #include "db.hpp"
+#include "httpoptions.hpp"
+#include "isocompressor.hpp"
 
 #include <string>
 #include <vector>
@@ -14,9 +16,90 @@ typedef struct Config
     int install_psp_as_pbp;
     int repo;
     std::string install_psp_psx_location;
+    // the PSP games that aren't installed as EBOOT.PBP are recompressed to it
+    // while they are written
+    IsoFormat psp_iso_format;
     bool psm_readme_disclaimer;
+    // parallel Range connections per package download, 1 disables it
+    int download_connections;
+    // downloads run at once, as many as the connections of each allow
+    int download_jobs;
+    // KiB per second of all the downloads and of each of them, 0 is
+    // unlimited
+    int download_limit_kb;
+    int job_limit_kb;
+    // the hours the queue runs, see pkgi_parse_download_schedule, empty for
+    // all day
+    std::string download_hours;
+    // the queue also runs while charging, outside of download_hours
+    bool download_when_charging;
+    // keeps the Wi-Fi out of its power save while downloading, the screen
+    // doesn't dim nor turn off meanwhile
+    bool wifi_keep_awake;
+    // size of the write-behind buffers in KiB, writes reach the card in
+    // chunks of this size
+    int write_buffer_kb;
+    // memory for the lists of the last shown modes in KiB, switching back to
+    // one of them doesn't read it again
+    int list_cache_kb;
+    // memory in KiB shared by the list, icon and text width caches and the
+    // buffers of the downloads, the caches give theirs back while the
+    // downloads run.
+    // 0 for the caches to keep their own sizes
+    int memory_budget_kb;
+    // how long the update info of a title is used before it is fetched
+    // again, 0 to always fetch it
+    int patch_info_ttl_hours;
+    // the lists are fetched again in the background this often while no
+    // download runs, 0 to only refresh them from the menu
+    int refresh_interval_minutes;
+    // also fetches them in the background once at start
+    bool refresh_on_launch;
+    // user cores the render loop, the network threads and the decryption
+    // and write threads are pinned to, -1 to let the scheduler pick
+    int cpu_ui;
+    int cpu_network;
+    int cpu_worker;
+    // draws the time each stage of the running downloads took over the list
+    bool show_stage_stats;
+    // draws the current and peak memory of each subsystem over the list
+    bool show_memory_stats;
+    // only draws the frames that may have changed, see pkgi_frame_needed
+    bool skip_idle_frames;
+    // lowers the CPU clock when the work allows it, see pkgi_govern_clock,
+    // else it stays at the highest
+    bool cpu_governor;
+    // memory for the textures of the title icons in KiB, 0 hides the icons
+    int icon_cache_kb;
+    // where the icons of the titles that aren't installed are fetched from,
+    // {titleid} is replaced, empty to only show the installed ones
+    std::string icon_url;
+    // where the chunk hashes of the packages are fetched from, {content} is
+    // replaced, empty to only use the ones saved by earlier downloads
+    std::string chunks_url;
+    // fetches the packages from the other PKGj on the LAN that have them and
+    // keeps a copy of each download in pkgj/pkg to share it, see PeerCache
+    bool lan_peers;
+    // http://host:port of a PC running pkgj_cli serve, empty to download and
+    // decrypt the packages here
+    std::string offload_url;
+    // KiB given to the network libraries and vita2d at start, 0 sizes them
+    // from the connections, see pkgi_pool_sizes_for
+    int net_pool_kb;
+    int ssl_pool_kb;
+    int http_pool_kb;
+    int vita2d_pool_kb;
+    // the tuning of the connections to each host, see HttpOptions
+    HttpHostOptions http_hosts;
+    // the timing of the requests of the downloads goes to http_trace.tsv in
+    // the config folder, to replay them with pkgj_cli, see HttpTrace
+    bool record_http;
 
     std::vector<std::string> repo_list;
+    // the lists of every repository of repo_list are fetched and merged
+    // instead of the ones of repo alone, the urls of a title in the other
+    // repositories become mirrors that the download races
+    bool multi_repo;
 
     std::string games_url;
     std::string dlcs_url;
@@ -31,4 +114,6 @@ typedef struct Config
 } Config;
 
 Config pkgi_load_config(int isRefresh);
+// the url of the list of mode in the repository repo
+std::string pkgi_repo_list_url(const std::string& repo, Mode mode);
 void pkgi_save_config(const Config& config);
@@ -1,8 +1,11 @@
 #include "db.hpp"
 
+#include "asyncreader.hpp"
 #include "file.hpp"
+#include "inflater.hpp"
 #include "pkgi.hpp"
 #include "sha256.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 #include <fmt/format.h>
@@ -10,11 +13,24 @@
 #include <boost/scope_exit.hpp>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstring>
+#include <optional>
+#include <memory>
+#include <numeric>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 
 #include <stddef.h>
+#include <strings.h>
+
+#if __ARM_NEON__
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 std::string pkgi_mode_to_string(Mode mode)
 {
@@ -40,7 +56,7 @@ TitleDatabase::TitleDatabase(const std::string& dbPath) : _dbPath(dbPath)
 {
 }
 
-static const char* pkgi_mode_to_file_name(Mode mode)
+const char* pkgi_mode_to_file_name(Mode mode)
 {
     switch (mode)
     {
@@ -67,35 +83,84 @@ static const char* pkgi_mode_to_file_name(Mode mode)
 
 namespace
 {
-std::vector<const char*> pkgi_split_row(char** pptr, const char* end)
+// the first tab, \r or \n from ptr, end when there's none. The rows of the
+// lists are mostly short fields, 16 bytes are compared at once
+const char* find_delimiter(const char* ptr, const char* end)
+{
+#if __ARM_NEON__
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    while (end - ptr >= 16)
+    {
+        const uint8x16_t x = vld1q_u8(reinterpret_cast<const uint8_t*>(ptr));
+        const uint8x16_t hit = vorrq_u8(
+                vorrq_u8(vceqq_u8(x, tab), vceqq_u8(x, cr)), vceqq_u8(x, lf));
+        // a nibble per byte, there's no movemask on ARM
+        const uint64_t mask = vget_lane_u64(
+                vreinterpret_u64_u8(
+                        vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)),
+                0);
+        if (mask != 0)
+            return ptr + __builtin_ctzll(mask) / 4;
+        ptr += 16;
+    }
+#elif defined(__SSE2__)
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    while (end - ptr >= 16)
+    {
+        const __m128i x =
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+        const __m128i hit = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(x, tab), _mm_cmpeq_epi8(x, cr)),
+                _mm_cmpeq_epi8(x, lf));
+        const int mask = _mm_movemask_epi8(hit);
+        if (mask != 0)
+            return ptr + __builtin_ctz(mask);
+        ptr += 16;
+    }
+#endif
+    while (ptr != end && *ptr != '\t' && *ptr != '\r' && *ptr != '\n')
+        ++ptr;
+    return ptr;
+}
+}
+
+void pkgi_split_row(
+        char** pptr, const char* end, std::vector<const char*>& fields)
 {
     auto& ptr = *pptr;
 
-    std::vector<const char*> result;
+    fields.clear();
     while (ptr != end && *ptr != '\n')
     {
         const char* field = ptr;
-        while (ptr != end && *ptr != '\t' && *ptr != '\r')
-            ++ptr;
+        ptr += find_delimiter(ptr, end) - ptr;
+        fields.push_back(field);
         if (ptr == end)
-        {
-            result.push_back(field);
             break;
-        }
+
+        const auto delimiter = *ptr;
         *ptr++ = 0;
-        result.push_back(field);
+        if (delimiter == '\n')
+            return;
+        if (delimiter == '\r')
+            break;
 
         if (ptr == end)
         {
-            result.push_back(field);
+            fields.push_back(field);
             break;
         }
     }
     while (ptr != end && *ptr++ != '\n')
         ;
-    return result;
 }
 
+namespace
+{
 enum class Column
 {
     Region,
@@ -111,6 +176,11 @@ enum class Column
     LastModification,
 };
 
+static constexpr auto ColumnCount = 11;
+
+// position of each Column in the rows, -1 for those a list doesn't have
+using ColumnMap = std::array<int, ColumnCount>;
+
 int pkgi_get_column_number(Mode mode, Column column)
 {
 #define MAP_COL(name, i) \
@@ -261,63 +331,318 @@ int pkgi_get_column_number(Mode mode, Column column)
 #undef MAP_COL
 }
 
+// the name of column in the header of the lists
+const char* column_title(Column column)
+{
+    switch (column)
+    {
+    case Column::Region:
+        return "Region";
+    case Column::Content:
+        return "Content ID";
+    case Column::Name:
+        return "Name";
+    case Column::NameOrg:
+        return "Original Name";
+    case Column::AppVersion:
+        return "App Version";
+    case Column::Zrif:
+        return "zRIF";
+    case Column::Url:
+        return "PKG direct link";
+    case Column::Digest:
+        return "SHA256";
+    case Column::Size:
+        return "File Size";
+    case Column::FwVersion:
+        return "Required FW";
+    case Column::LastModification:
+        return "Last Modification Date";
+    }
+    throw std::runtime_error("无效列");
+}
+
+// the columns of mode where NoPayStation puts them
+ColumnMap default_columns(Mode mode)
+{
+    ColumnMap columns;
+    for (int i = 0; i < ColumnCount; ++i)
+        columns[i] = pkgi_get_column_number(mode, static_cast<Column>(i));
+    return columns;
+}
+
+// the columns of mode found by their title in header, so that a column
+// added upstream doesn't shift the others. A column the header doesn't name
+// stays where NoPayStation puts it, and those mode doesn't use stay unused.
+ColumnMap map_columns(Mode mode, const std::vector<const char*>& header)
+{
+    auto columns = default_columns(mode);
+    for (int i = 0; i < ColumnCount; ++i)
+    {
+        if (columns[i] < 0)
+            continue;
+        const auto title = column_title(static_cast<Column>(i));
+        for (size_t pos = 0; pos < header.size(); ++pos)
+            if (strcasecmp(header[pos], title) == 0)
+            {
+                columns[i] = pos;
+                break;
+            }
+    }
+    return columns;
+}
+
 const char* get_or_empty(
-        Mode mode, std::vector<const char*> const& v, Column column)
+        const ColumnMap& columns,
+        std::vector<const char*> const& v,
+        Column column)
 {
-    const auto pos = pkgi_get_column_number(mode, column);
+    const auto pos = columns[static_cast<int>(column)];
     if (pos < 0)
         return "";
     return v.at(pos);
 }
 }
 
-void TitleDatabase::update(Mode mode, Http* http, const std::string& update_url)
+static constexpr uint32_t MAX_DELTA_SIZE = 4 * 1024 * 1024;
+// the index of the biggest lists is a few MiB
+static constexpr uint32_t MAX_SNAPSHOT_SIZE = 32 * 1024 * 1024;
+
+namespace
+{
+std::string sha256_hex(const std::string& data)
+{
+    sha256_ctx sha;
+    sha256_init(&sha);
+    sha256_update(
+            &sha, reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    std::vector<uint8_t> digest(SHA256_DIGEST_SIZE);
+    sha256_finish(&sha, digest.data());
+    return pkgi_tohex(digest);
+}
+
+// what we know about the list we have, see TitleDatabase::update
+struct ListMeta
+{
+    std::string url;
+    std::string etag;
+    std::string last_modified;
+    std::string sha256;
+    std::string delta_url;
+    // the index the server built from the list, and the ETag of the one we
+    // have when it came from there
+    std::string index_url;
+    std::string index_etag;
+};
+
+ListMeta load_meta(const std::string& path)
+{
+    ListMeta meta;
+    const auto data = pkgi_load(path);
+    auto lines = pkgi_split(std::string(data.begin(), data.end()), '\n');
+    lines.resize(7);
+    meta.url = lines[0];
+    meta.etag = lines[1];
+    meta.last_modified = lines[2];
+    meta.sha256 = lines[3];
+    meta.delta_url = lines[4];
+    meta.index_url = lines[5];
+    meta.index_etag = lines[6];
+    return meta;
+}
+
+void save_meta(const std::string& path, const ListMeta& meta)
 {
-    const auto tmppath = _dbPath + "/dbtmp.tsv";
-    auto item_file = pkgi_create(tmppath);
-    BOOST_SCOPE_EXIT_ALL(&)
-    {
-        if (item_file)
-            pkgi_close(item_file);
+    const auto data = fmt::format(
+            "{}\n{}\n{}\n{}\n{}\n{}\n{}",
+            meta.url,
+            meta.etag,
+            meta.last_modified,
+            meta.sha256,
+            meta.delta_url,
+            meta.index_url,
+            meta.index_etag);
+    pkgi_save(path, data.data(), data.size());
+}
+
+// reads a whole response, decompressing it if needed, and adds it to the
+// update progress
+std::string read_body(
+        Http* http, std::atomic<uint32_t>& db_size, uint32_t max_size)
+{
+    std::unique_ptr<Inflater> inflater;
+    if (Inflater::handles(http->get_response_header("Content-Encoding")))
+        inflater = std::make_unique<Inflater>();
+
+    std::string body;
+    const auto append = [&](const uint8_t* data, uint32_t size) {
+        if (body.size() + size > max_size)
+            throw std::runtime_error("服务器返回的文件过大");
+        body.append(reinterpret_cast<const char*>(data), size);
     };
 
-    std::vector<uint8_t> db_data(64 * 1024);
-    db_total = 0;
-    db_size = 0;
+    pkgi_http_consume(*http, [&](const uint8_t* data, uint32_t size) {
+        db_size += size;
+        if (inflater)
+            inflater->write(data, size, append);
+        else
+            append(data, size);
+    });
+    if (inflater)
+        inflater->finish();
+    return body;
+}
 
-    LOGF("loading update from {}", update_url);
+// returns whether the list changed, or nothing when there is no usable delta
+std::optional<bool> update_delta(
+        Http* http,
+        const std::string& filepath,
+        const std::string& tmppath,
+        ListMeta& meta,
+        std::atomic<uint32_t>& db_total,
+        std::atomic<uint32_t>& db_size)
+{
+    LOGF("loading delta from {}", meta.delta_url);
 
-    http->start(update_url, 0);
+    http->add_request_header("Accept-Encoding", "gzip, deflate");
+    http->start(meta.delta_url, 0);
+    if (http->get_status() != 200)
+    {
+        LOGF("no delta available, status {}", http->get_status());
+        return std::nullopt;
+    }
 
-    db_total = http->get_length();
+    db_total += http->get_length();
+    const auto lines = pkgi_split(
+            read_body(http, db_size, MAX_DELTA_SIZE), '\n');
+    if (lines.empty() || lines[0] != "PKGJDELTA 1")
+        throw std::runtime_error("无效的增量更新文件");
 
-    for (;;)
+    // find the patch that starts from our list
+    size_t pos = 1;
+    std::string target;
+    for (; pos < lines.size(); ++pos)
     {
-        int read = http->read(db_data.data(), db_data.size());
-        if (read == 0)
+        const auto& line = lines[pos];
+        if (line == "current " + meta.sha256)
+        {
+            LOG("list is up to date");
+            return false;
+        }
+        if (line.compare(0, 5, "from ") == 0 &&
+            line.compare(5, meta.sha256.size(), meta.sha256) == 0 &&
+            line.compare(5 + meta.sha256.size(), 4, " to ") == 0)
+        {
+            target = line.substr(5 + meta.sha256.size() + 4);
+            ++pos;
             break;
-        db_size += read;
-
-        pkgi_write(item_file, db_data.data(), read);
+        }
+    }
+    if (target.empty())
+    {
+        LOG("no delta from our list");
+        return std::nullopt;
     }
 
-    if (db_size == 0)
-        throw std::runtime_error(
-                "列表为空... 请更新PKGj版本");
-    if (db_size != db_total)
-        throw std::runtime_error(
-                "TSV文件不完整, 请检查网络连接是否异常, 然后"
-                "重试");
+    const auto data = pkgi_load(filepath);
+    const auto rows = pkgi_split(std::string(data.begin(), data.end()), '\n');
 
-    pkgi_close(item_file);
-    item_file = nullptr;
+    std::unordered_map<std::string, uint32_t> removed;
+    std::vector<const std::string*> added;
+    for (; pos < lines.size() && lines[pos].compare(0, 5, "from ") != 0 &&
+           lines[pos].compare(0, 8, "current ") != 0;
+         ++pos)
+    {
+        const auto& line = lines[pos];
+        if (line.empty())
+            continue;
+        if (line[0] == '-')
+            ++removed[line.substr(1)];
+        else if (line[0] == '+')
+            added.push_back(&line);
+        else
+            throw std::runtime_error("无效的增量更新文件");
+    }
 
-    const auto filepath =
-            fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
+    std::string result;
+    result.reserve(data.size());
+    size_t removed_count = 0;
+    for (const auto& row : rows)
+    {
+        const auto it = removed.find(row);
+        if (it != removed.end() && it->second != 0)
+        {
+            --it->second;
+            ++removed_count;
+            continue;
+        }
+        result += row;
+        result += '\n';
+    }
+    for (const auto line : added)
+    {
+        result.append(*line, 1, std::string::npos);
+        result += '\n';
+    }
+
+    const auto sha256 = sha256_hex(result);
+    if (sha256 != target)
+    {
+        LOGF("delta result {} doesn't match {}", sha256, target);
+        return std::nullopt;
+    }
 
+    pkgi_save(tmppath, result.data(), result.size());
     pkgi_rename(tmppath, filepath);
+    meta.sha256 = sha256;
 
-    LOG("finished downloading");
+    LOGF("applied delta, {} rows removed, {} added",
+         removed_count,
+         added.size());
+    return true;
+}
+
+// fetches the index the server built from the list into arena, see
+// TitleDatabase::update. Returns whether it changed, or nothing when there is
+// none
+std::optional<bool> fetch_snapshot(
+        Http* http,
+        ListMeta& meta,
+        std::vector<uint8_t>& arena,
+        std::atomic<uint32_t>& db_total,
+        std::atomic<uint32_t>& db_size)
+{
+    LOGF("loading index snapshot from {}", meta.index_url);
+
+    if (!meta.index_etag.empty())
+        http->add_request_header("If-None-Match", meta.index_etag);
+    http->add_request_header("Accept-Encoding", "gzip, deflate");
+    http->start(meta.index_url, 0);
+    if (http->get_status() == 304)
+    {
+        LOG("index snapshot not modified");
+        return false;
+    }
+    if (http->get_status() != 200)
+    {
+        LOGF("no index snapshot available, status {}", http->get_status());
+        return std::nullopt;
+    }
+    const auto sha256 = http->get_response_header("X-PKGj-Sha256");
+    if (sha256.empty())
+    {
+        LOG("index snapshot without a checksum, ignored");
+        return std::nullopt;
+    }
+
+    db_total += http->get_length();
+    const auto body = read_body(http, db_size, MAX_SNAPSHOT_SIZE);
+    if (strcasecmp(sha256_hex(body).c_str(), sha256.c_str()) != 0)
+        throw std::runtime_error("列表索引校验失败");
+    arena.assign(body.begin(), body.end());
+    meta.index_etag = http->get_response_header("ETag");
+    return true;
+}
 }
 
 namespace
@@ -339,130 +664,383 @@ const char* region_to_string(GameRegion region)
     }
 }
 
-std::set<std::string> filter_to_vector(uint32_t filter)
+uint8_t region_to_filter(const char* region)
 {
-    std::set<std::string> ret;
-#define HANDLE_REGION(reg)            \
-    if (filter & DbFilterRegion##reg) \
-    ret.insert(region_to_string(Region##reg))
+#define HANDLE_REGION(reg)                                  \
+    if (strcmp(region, region_to_string(Region##reg)) == 0) \
+    return DbFilterRegion##reg
     HANDLE_REGION(ASA);
     HANDLE_REGION(EUR);
     HANDLE_REGION(JPN);
     HANDLE_REGION(USA);
 #undef HANDLE_REGION
-    return ret;
+    return 0;
 }
 
-bool lower(const DbItem& a, const DbItem& b, DbSort sort, DbSortOrder order)
+// only the digits of the date, which is enough to order dates in the same
+// format
+uint64_t date_key(const std::string& date)
 {
-    GameRegion reg_a = pkgi_get_region(a.titleid);
-    GameRegion reg_b = pkgi_get_region(b.titleid);
+    uint64_t key = 0;
+    unsigned digits = 0;
+    for (const auto c : date)
+        if (c >= '0' && c <= '9' && digits++ < 19)
+            key = key * 10 + (c - '0');
+    return key;
+}
 
-    int64_t cmp;
-    if (sort == SortByTitle)
-        cmp = a.titleid.compare(b.titleid);
-    else if (sort == SortByRegion)
-        cmp = reg_a - reg_b;
-    else if (sort == SortByName)
-        cmp = pkgi_stricmp(a.name.c_str(), b.name.c_str());
-    else if (sort == SortBySize)
-        cmp = a.size - b.size;
-    else if (sort == SortByDate)
-        cmp = a.date.compare(b.date);
-    else
-        throw std::runtime_error(fmt::format("未知排序顺序 {}", sort));
+std::string name_key(const std::string& name)
+{
+    // same order as pkgi_stricmp
+    std::string key = name;
+    for (auto& c : key)
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    return key;
+}
+}
+
+namespace
+{
+// The index is built from the TSV once per update and holds the rows that
+// reload would keep, already tokenized and decoded: a header, fixed size
+// records, a pool of NUL terminated strings the records point into (padded
+// to 4 bytes), a trigram index of the names used by the search: the sorted
+// trigrams, each with a range of the postings, which are ascending row
+// numbers, and a title table: the title ids in pool order, each with a range
+// of the rows sorted by title id, for the lookups across the lists.
+static constexpr uint32_t INDEX_MAGIC = 0x494a4b50; // "PKJI"
+static constexpr uint32_t INDEX_VERSION = 4;
+
+// starts each list of a merged TSV, the header of the list comes next, see
+// TitleDatabase::merge
+static constexpr char REPO_SEPARATOR[] = "\x01PKGJ REPO";
+
+struct IndexHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    // size of the TSV it was built from, a different one means it's stale
+    uint64_t tsv_size;
+    uint32_t count;
+    uint32_t pool_size;
+    uint32_t trigram_count;
+    uint32_t posting_count;
+    uint32_t title_count;
+    // keeps the records 8 bytes aligned
+    uint32_t reserved;
+};
 
-    if (cmp == 0)
-        cmp = a.titleid.compare(b.titleid);
+struct IndexRecord
+{
+    // offsets in the string pool
+    uint32_t titleid;
+    uint32_t content;
+    uint32_t region;
+    uint32_t name;
+    uint32_t full_name;
+    uint32_t name_org;
+    uint32_t zrif;
+    uint32_t url;
+    uint32_t date;
+    uint32_t app_version;
+    uint32_t fw_version;
+    uint32_t has_digest;
+    // the urls of the other repositories, separated by \n
+    uint32_t mirrors;
+    uint32_t mirror_count;
+    int64_t size;
+    uint8_t digest[32];
+};
 
-    if (order == SortDescending)
-        cmp = -cmp;
+static_assert(sizeof(IndexHeader) == 40, "index header must be packed");
+static_assert(sizeof(IndexRecord) == 96, "index records must be packed");
 
-    return cmp < 0;
+std::string index_path(const std::string& dbpath)
+{
+    return dbpath + ".idx";
 }
+
+// a list installed from a snapshot only has its index
+bool list_exists(const std::string& dbpath)
+{
+    return pkgi_file_exists(dbpath) || pkgi_file_exists(index_path(dbpath));
 }
 
-void TitleDatabase::reload(
-        Mode mode,
-        uint32_t region_filter,
-        DbSort sort_by,
-        DbSortOrder sort_order,
-        const std::string& search,
-        const std::set<std::string>& installed_games)
+// same folding as pkgi_stricontains
+char fold(char c)
 {
-    const auto filter_by_region =
-            (region_filter & DbFilterAllRegions) != DbFilterAllRegions;
-    const auto regions = filter_to_vector(region_filter);
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
 
-    db.clear();
-    _title_count = 0;
+uint32_t trigram_at(const char* str)
+{
+    return static_cast<uint8_t>(fold(str[0])) << 16 |
+           static_cast<uint8_t>(fold(str[1])) << 8 |
+           static_cast<uint8_t>(fold(str[2]));
+}
+}
 
-    const auto dbpath =
-            fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
+// Parses a TSV fed in pieces of any size into an index. The first line is
+// the header, the others are parsed as soon as they're complete. A merged TSV
+// starts with REPO_SEPARATOR and has one before each of its lists.
+class TitleDatabase::IndexBuilder
+{
+public:
+    IndexBuilder(Mode mode) : _mode(mode), _columns(default_columns(mode))
+    {
+    }
+
+    void feed(const uint8_t* data, size_t size)
+    {
+        const auto begin = reinterpret_cast<const char*>(data);
+        const auto end = begin + size;
+        auto pos = begin;
+        while (pos != end)
+        {
+            const auto newline =
+                    static_cast<const char*>(memchr(pos, '\n', end - pos));
+            if (!newline)
+            {
+                _line.append(pos, end);
+                break;
+            }
+            _line.append(pos, newline + 1);
+            add_line();
+            pos = newline + 1;
+        }
+    }
+
+    // saves the index, tsv_size is the size of the whole TSV
+    void save(const std::string& path, uint64_t tsv_size)
+    {
+        if (!_line.empty())
+            add_line();
+
+        for (const auto& mirrors : _mirrors)
+        {
+            std::string urls;
+            for (const auto& url : mirrors.second)
+                urls += (urls.empty() ? "" : "\n") + url;
+            _records[mirrors.first].mirrors = add_string(urls.c_str());
+            _records[mirrors.first].mirror_count = mirrors.second.size();
+        }
+
+        // keeps the trigram table aligned
+        _pool.resize((_pool.size() + 3) & ~3);
+
+        std::vector<std::pair<uint32_t, uint32_t>> row_trigrams;
+        for (uint32_t row = 0; row < _records.size(); ++row)
+        {
+            const char* name = _pool.data() + _records[row].name;
+            for (size_t i = 0; name[i] && name[i + 1] && name[i + 2]; ++i)
+                row_trigrams.emplace_back(trigram_at(name + i), row);
+        }
+        std::sort(row_trigrams.begin(), row_trigrams.end());
+        row_trigrams.erase(
+                std::unique(row_trigrams.begin(), row_trigrams.end()),
+                row_trigrams.end());
+
+        std::vector<IndexTrigram> trigrams;
+        std::vector<uint32_t> postings;
+        postings.reserve(row_trigrams.size());
+        for (const auto& row_trigram : row_trigrams)
+        {
+            if (trigrams.empty() ||
+                trigrams.back().trigram != row_trigram.first)
+                trigrams.push_back(
+                        {row_trigram.first,
+                         static_cast<uint32_t>(postings.size()),
+                         0});
+            ++trigrams.back().posting_count;
+            postings.push_back(row_trigram.second);
+        }
+
+        // the rows of a title id are found with a binary search instead of a
+        // pass over every row of the list
+        std::vector<uint32_t> title_rows(_records.size());
+        for (uint32_t row = 0; row < title_rows.size(); ++row)
+            title_rows[row] = row;
+        const auto titleid = [&](uint32_t row) {
+            return _pool.data() + _records[row].titleid;
+        };
+        std::stable_sort(
+                title_rows.begin(),
+                title_rows.end(),
+                [&](const auto a, const auto b) {
+                    return strcmp(titleid(a), titleid(b)) < 0;
+                });
+        std::vector<IndexTitle> titles;
+        for (uint32_t i = 0; i < title_rows.size(); ++i)
+        {
+            if (titles.empty() ||
+                strcmp(_pool.data() + titles.back().titleid,
+                       titleid(title_rows[i])) != 0)
+                titles.push_back({_records[title_rows[i]].titleid, i, 0});
+            ++titles.back().row_count;
+        }
 
-    if (!pkgi_file_exists(dbpath))
-        return;
+        IndexHeader header{};
+        header.magic = INDEX_MAGIC;
+        header.version = INDEX_VERSION;
+        header.tsv_size = tsv_size;
+        header.count = _records.size();
+        header.pool_size = _pool.size();
+        header.trigram_count = trigrams.size();
+        header.posting_count = postings.size();
+        header.title_count = titles.size();
+
+        std::vector<uint8_t> data(
+                sizeof(header) + _records.size() * sizeof(IndexRecord) +
+                _pool.size() + trigrams.size() * sizeof(IndexTrigram) +
+                postings.size() * sizeof(uint32_t) +
+                titles.size() * sizeof(IndexTitle) +
+                title_rows.size() * sizeof(uint32_t));
+        auto out = data.data();
+        memcpy(out, &header, sizeof(header));
+        out += sizeof(header);
+        memcpy(out, _records.data(), _records.size() * sizeof(IndexRecord));
+        out += _records.size() * sizeof(IndexRecord);
+        memcpy(out, _pool.data(), _pool.size());
+        out += _pool.size();
+        memcpy(out, trigrams.data(), trigrams.size() * sizeof(IndexTrigram));
+        out += trigrams.size() * sizeof(IndexTrigram);
+        memcpy(out, postings.data(), postings.size() * sizeof(uint32_t));
+        out += postings.size() * sizeof(uint32_t);
+        memcpy(out, titles.data(), titles.size() * sizeof(IndexTitle));
+        out += titles.size() * sizeof(IndexTitle);
+        memcpy(out, title_rows.data(), title_rows.size() * sizeof(uint32_t));
+
+        pkgi_save(path + ".tmp", data.data(), data.size());
+        pkgi_rename(path + ".tmp", path);
+
+        LOGF("built index of {} items in {}", _records.size(), path);
+    }
 
-    auto db_data = pkgi_load(dbpath);
+private:
+    Mode _mode;
+    // from the header of the list being parsed
+    ColumnMap _columns;
+    // the fields of the row being parsed, kept to reuse their storage
+    std::vector<const char*> _fields;
+    std::vector<IndexRecord> _records;
+    std::string _pool;
+    // the line being received, with its \n
+    std::string _line;
+    // in the list being parsed
+    unsigned _line_number = 0;
+    // a row starting with a NUL ends the list
+    bool _done = false;
+    // lists of a merged TSV seen so far
+    unsigned _repo = 0;
+    // row of each content of the lists before the current one, and of the
+    // current one
+    std::unordered_map<std::string, uint32_t> _earlier_rows;
+    std::unordered_map<std::string, uint32_t> _repo_rows;
+    std::unordered_map<uint32_t, std::vector<std::string>> _mirrors;
+
+    uint32_t add_string(const char* str)
+    {
+        const uint32_t offset = _pool.size();
+        _pool.append(str);
+        _pool += '\0';
+        return offset;
+    }
 
-    auto ptr = reinterpret_cast<char*>(db_data.data());
-    const auto end = reinterpret_cast<char*>(db_data.data() + db_data.size());
+    void add_line()
+    {
+        if (_line.compare(0, sizeof(REPO_SEPARATOR) - 1, REPO_SEPARATOR) == 0)
+        {
+            _earlier_rows.insert(_repo_rows.begin(), _repo_rows.end());
+            _repo_rows.clear();
+            ++_repo;
+            _line_number = 0;
+            _done = false;
+        }
+        // the string keeps the last field NUL terminated
+        else if (++_line_number == 1)
+        {
+            auto ptr = &_line[0];
+            pkgi_split_row(&ptr, ptr + _line.size(), _fields);
+            _columns = map_columns(_mode, _fields);
+        }
+        else if (!_done)
+        {
+            if (_line[0] == '\0')
+                _done = true;
+            else
+                parse_row(&_line[0], &_line[0] + _line.size());
+        }
+        _line.clear();
+    }
 
-    // skip header
-    while (ptr < end && *ptr != '\n')
-        ptr++;
-    if (ptr == end)
-        return;
-    ptr++; // \n
+    void add_mirror(uint32_t row, const char* url)
+    {
+        if (strcmp(_pool.c_str() + _records[row].url, url) == 0)
+            return;
+        auto& mirrors = _mirrors[row];
+        if (std::find(mirrors.begin(), mirrors.end(), url) == mirrors.end())
+            mirrors.push_back(url);
+    }
 
-    unsigned line = 1;
-    while (ptr < end && *ptr)
+    void parse_row(char* ptr, const char* end)
     {
-        ++line;
         try
         {
-            const auto fields = pkgi_split_row(&ptr, end);
+            pkgi_split_row(&ptr, end, _fields);
 
             const std::string content =
-                    get_or_empty(mode, fields, Column::Content);
+                    get_or_empty(_columns, _fields, Column::Content);
             const std::string titleid =
                     content.size() >= 7 + 9 ? content.substr(7, 9) : "";
-            const auto region = get_or_empty(mode, fields, Column::Region);
-            const std::string name = get_or_empty(mode, fields, Column::Name);
-            const auto name_org = get_or_empty(mode, fields, Column::NameOrg);
-            const auto url = get_or_empty(mode, fields, Column::Url);
-            const auto zrif = get_or_empty(mode, fields, Column::Zrif);
-            const auto digest = get_or_empty(mode, fields, Column::Digest);
-            const std::string size = get_or_empty(mode, fields, Column::Size);
+            const auto region =
+                    get_or_empty(_columns, _fields, Column::Region);
+            const std::string name =
+                    get_or_empty(_columns, _fields, Column::Name);
+            const auto name_org =
+                    get_or_empty(_columns, _fields, Column::NameOrg);
+            const auto url = get_or_empty(_columns, _fields, Column::Url);
+            const auto zrif = get_or_empty(_columns, _fields, Column::Zrif);
+            const auto digest = get_or_empty(_columns, _fields, Column::Digest);
+            const std::string size =
+                    get_or_empty(_columns, _fields, Column::Size);
             const std::string fw_version =
-                    get_or_empty(mode, fields, Column::FwVersion);
+                    get_or_empty(_columns, _fields, Column::FwVersion);
             const auto last_modification =
-                    get_or_empty(mode, fields, Column::LastModification);
+                    get_or_empty(_columns, _fields, Column::LastModification);
             const std::string app_version =
-                    get_or_empty(mode, fields, Column::AppVersion);
+                    get_or_empty(_columns, _fields, Column::AppVersion);
 
             if (*url == '\0' || std::string(url) == "MISSING" ||
                 std::string(url) == "CART ONLY" ||
                 std::string(zrif) == "MISSING")
-                continue;
-
-            ++_title_count;
-
-            if (filter_by_region && !regions.count(region))
-                continue;
-
-            if (!search.empty() &&
-                !pkgi_stricontains(name.c_str(), search.c_str()))
-                continue;
-
-            bool bdigest = true;
-            std::array<uint8_t, 32> digest_array{};
+                return;
+
+            // the lists after the first of a merged TSV only add mirrors to
+            // the contents the earlier ones have
+            if (_repo > 1)
+            {
+                const auto earlier = _earlier_rows.find(content);
+                if (earlier != _earlier_rows.end())
+                {
+                    add_mirror(earlier->second, url);
+                    return;
+                }
+            }
+            if (_repo > 0)
+                _repo_rows.emplace(content, _records.size());
+
+            IndexRecord record{};
             if (std::all_of(digest, digest + 64, [](const auto c) {
                     return c != 0;
                 }))
-                digest_array = pkgi_hexbytes(digest, SHA256_DIGEST_SIZE);
-            else
-                bdigest = false;
+            {
+                const auto digest_array =
+                        pkgi_hexbytes(digest, SHA256_DIGEST_SIZE);
+                memcpy(record.digest,
+                       digest_array.data(),
+                       sizeof(record.digest));
+                record.has_digest = 1;
+            }
 
             std::string full_name = name;
             if (!app_version.empty())
@@ -470,66 +1048,1255 @@ void TitleDatabase::reload(
             if (!name.empty() && name.back() != ']' && fw_version > "3.60")
                 full_name = fmt::format("{} [{}]", full_name, fw_version);
 
-            if (!(region_filter & DbFilterInstalled) ||
-                installed_games.find(titleid) != installed_games.end())
-                db.push_back(DbItem{
-                        PresenceUnknown,
-                        titleid,
-                        content,
-                        0,
-                        full_name,
-                        name_org ? name_org : "",
-                        zrif ? zrif : "",
-                        url,
-                        static_cast<bool>(bdigest),
-                        digest_array,
-                        size.empty() ? 0 : std::stoll(size),
-                        last_modification,
-                        app_version,
-                        fw_version,
-                });
+            record.titleid = add_string(titleid.c_str());
+            record.content = add_string(content.c_str());
+            record.region = add_string(region);
+            record.name = add_string(name.c_str());
+            record.full_name = add_string(full_name.c_str());
+            record.name_org = add_string(name_org ? name_org : "");
+            record.zrif = add_string(zrif ? zrif : "");
+            record.url = add_string(url);
+            record.date = add_string(last_modification);
+            record.app_version = add_string(app_version.c_str());
+            record.fw_version = add_string(fw_version.c_str());
+            record.size = size.empty() ? 0 : std::stoll(size);
+            _records.push_back(record);
         }
         catch (const std::exception& e)
         {
             throw formatEx<std::runtime_error>(
-                    "无法解析行 {}: {}", line, e.what());
+                    "无法解析行 {}: {}", _line_number, e.what());
         }
     }
+};
 
-    std::sort(db.begin(), db.end(), [&](const auto& a, const auto& b) {
-        return lower(a, b, sort_by, sort_order);
-    });
-
-    LOGF("reloaded {}/{} items", db.size(), _title_count);
-}
-
-void TitleDatabase::get_update_status(uint32_t* updated, uint32_t* total)
+void TitleDatabase::build_index(Mode mode)
 {
-    *updated = db_size;
-    *total = db_total;
+    TRACE_SCOPE("TitleDatabase::build_index");
+    const auto dbpath =
+            fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
+    write_index(mode, dbpath, index_path(dbpath));
+    ++_index_generation;
 }
 
-uint32_t TitleDatabase::count()
+void TitleDatabase::write_index(
+        Mode mode, const std::string& tsv_path, const std::string& path)
 {
-    return db.size();
+    IndexBuilder builder(mode);
+
+    // parsing overlaps with the reads, and the list is never in memory whole
+    AsyncReader reader(tsv_path);
+    const uint8_t* data;
+    while (const auto size = reader.next(data))
+        builder.feed(data, size);
+
+    builder.save(path, reader.size());
 }
 
-uint32_t TitleDatabase::total()
+std::string TitleDatabase::list_path(Mode mode, int repo) const
 {
-    return _title_count;
+    if (repo < 0)
+        return fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
+    return fmt::format(
+            "{}/{}.repo{}", _dbPath, pkgi_mode_to_file_name(mode), repo);
 }
 
-DbItem* TitleDatabase::get(uint32_t index)
+bool TitleDatabase::update(
+        Mode mode,
+        const HttpFactory& make_http,
+        const std::string& update_url,
+        int repo)
 {
-    return index < db.size() ? &db[index] : NULL;
+    const auto filepath = list_path(mode, repo);
+    const auto metapath = filepath + ".meta";
+    // several lists are updated at once
+    const auto tmppath = filepath + ".tmp";
+
+    ListMeta meta;
+    if (list_exists(filepath) && pkgi_file_exists(metapath))
+    {
+        meta = load_meta(metapath);
+        if (meta.url != update_url)
+            meta = ListMeta{};
+    }
+
+    // servers that publish deltas say so in the headers of the full list, a
+    // failed delta falls back to the full list
+    if (!meta.delta_url.empty() && !meta.sha256.empty())
+    {
+        try
+        {
+            const auto http = make_http();
+            const auto changed = update_delta(
+                    http.get(), filepath, tmppath, meta, db_total, db_size);
+            if (changed)
+            {
+                if (*changed)
+                {
+                    if (repo < 0)
+                        build_index(mode);
+                    meta.index_etag.clear();
+                    save_meta(metapath, meta);
+                }
+                return *changed;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("delta update failed: {}", e.what());
+        }
+    }
+
+    // a server that ships the index it built from the list saves the parse,
+    // see pkgj_cli buildindex. It replaces the TSV, so the next updates
+    // can't take deltas. The list of a repository is only indexed once merged
+    if (repo < 0 && !meta.index_url.empty())
+    {
+        try
+        {
+            const auto http = make_http();
+            std::vector<uint8_t> arena;
+            const auto changed =
+                    fetch_snapshot(http.get(), meta, arena, db_total, db_size);
+            if (changed)
+            {
+                if (*changed)
+                {
+                    if (!valid_index(arena, -1))
+                        throw std::runtime_error("无效的列表索引");
+                    pkgi_save(tmppath, arena.data(), arena.size());
+                    pkgi_rename(tmppath, index_path(filepath));
+                    // it would make the index look stale
+                    if (pkgi_file_exists(filepath))
+                        pkgi_rm(filepath.c_str());
+                    meta.etag.clear();
+                    meta.last_modified.clear();
+                    meta.sha256.clear();
+                    ++_index_generation;
+                    save_meta(metapath, meta);
+                }
+                return *changed;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("index snapshot update failed: {}", e.what());
+        }
+    }
+
+    const auto http = make_http();
+
+    if (!meta.etag.empty())
+        http->add_request_header("If-None-Match", meta.etag);
+    if (!meta.last_modified.empty())
+        http->add_request_header("If-Modified-Since", meta.last_modified);
+
+    LOGF("loading update from {}", update_url);
+
+    http->add_request_header("Accept-Encoding", "gzip, deflate");
+    http->start(update_url, 0);
+
+    if (http->get_status() == 304)
+    {
+        LOGF("{} not modified", update_url);
+        return false;
+    }
+
+    meta.url = update_url;
+    meta.etag = http->get_response_header("ETag");
+    meta.last_modified = http->get_response_header("Last-Modified");
+    meta.delta_url = http->get_response_header("X-PKGj-Delta");
+    if (!meta.delta_url.empty() &&
+        meta.delta_url.find("://") == std::string::npos)
+        meta.delta_url = update_url.substr(0, update_url.rfind('/') + 1) +
+                         meta.delta_url;
+    meta.index_url = http->get_response_header("X-PKGj-Index");
+    if (!meta.index_url.empty() &&
+        meta.index_url.find("://") == std::string::npos)
+        meta.index_url = update_url.substr(0, update_url.rfind('/') + 1) +
+                         meta.index_url;
+    meta.index_etag.clear();
+
+    auto item_file = pkgi_create(tmppath);
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        if (item_file)
+            pkgi_close(item_file);
+    };
+
+    uint32_t size = 0;
+
+    // progress and the length check are on the bytes as sent
+    const uint32_t length = http->get_length();
+    db_total += length;
+
+    std::unique_ptr<Inflater> inflater;
+    if (Inflater::handles(http->get_response_header("Content-Encoding")))
+        inflater = std::make_unique<Inflater>();
+
+    // the index is built from the rows as they arrive, the TSV is still
+    // saved since deltas apply to it. The list of a repository is only
+    // indexed once merged
+    std::optional<IndexBuilder> builder;
+    if (repo < 0)
+        builder.emplace(mode);
+    uint64_t tsv_size = 0;
+
+    sha256_ctx sha;
+    sha256_init(&sha);
+    const auto write = [&](const uint8_t* data, uint32_t data_size) {
+        sha256_update(&sha, data, data_size);
+        pkgi_write(item_file, data, data_size);
+        if (builder)
+            builder->feed(data, data_size);
+        tsv_size += data_size;
+    };
+
+    pkgi_http_consume(*http, [&](const uint8_t* data, uint32_t data_size) {
+        size += data_size;
+        db_size += data_size;
+
+        if (inflater)
+            inflater->write(data, data_size, write);
+        else
+            write(data, data_size);
+    });
+    if (inflater)
+        inflater->finish();
+
+    if (size == 0)
+        throw std::runtime_error(
+                "列表为空... 请更新PKGj版本");
+    if (size != length)
+        throw std::runtime_error(
+                "TSV文件不完整, 请检查网络连接是否异常, 然后"
+                "重试");
+
+    pkgi_close(item_file);
+    item_file = nullptr;
+
+    std::vector<uint8_t> digest(SHA256_DIGEST_SIZE);
+    sha256_finish(&sha, digest.data());
+    meta.sha256 = pkgi_tohex(digest);
+
+    pkgi_rename(tmppath, filepath);
+    if (builder)
+    {
+        builder->save(index_path(filepath), tsv_size);
+        ++_index_generation;
+    }
+    save_meta(metapath, meta);
+
+    LOG("finished downloading");
+    return true;
 }
 
-DbItem* TitleDatabase::get_by_content(const char* content)
+bool TitleDatabase::merge(Mode mode, int repo_count, bool changed)
 {
-    for (size_t i = 0; i < db.size(); ++i)
-        if (db[i].content == content)
-            return &db[i];
-    return NULL;
+    const auto filepath = list_path(mode, -1);
+    const auto metapath = filepath + ".meta";
+    const auto tmppath = filepath + ".tmp";
+
+    // the meta of a merged list names the merge instead of a url, so that
+    // update() fetches the whole list again after going back to a single
+    // repository
+    ListMeta meta;
+    meta.url = fmt::format("merge of {} repositories", repo_count);
+    if (!changed && pkgi_file_exists(filepath) && pkgi_file_exists(metapath) &&
+        load_meta(metapath).url == meta.url)
+        return false;
+
+    auto file = pkgi_create(tmppath);
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        if (file)
+            pkgi_close(file);
+    };
+
+    int merged = 0;
+    for (int repo = 0; repo < repo_count; ++repo)
+    {
+        const auto path = list_path(mode, repo);
+        if (!pkgi_file_exists(path))
+            continue;
+        pkgi_write(file, REPO_SEPARATOR, sizeof(REPO_SEPARATOR) - 1);
+        pkgi_write(file, "\n", 1);
+        AsyncReader reader(path);
+        const uint8_t* data;
+        uint8_t last = '\n';
+        while (const auto size = reader.next(data))
+        {
+            pkgi_write(file, data, size);
+            last = data[size - 1];
+        }
+        if (last != '\n')
+            pkgi_write(file, "\n", 1);
+        ++merged;
+    }
+    if (merged == 0)
+        throw formatEx<std::runtime_error>(
+                "没有可用的列表: {}", pkgi_mode_to_string(mode));
+
+    pkgi_close(file);
+    file = nullptr;
+
+    pkgi_rename(tmppath, filepath);
+    build_index(mode);
+    save_meta(metapath, meta);
+
+    LOGF("merged {} lists of {} repositories into {}",
+         merged,
+         repo_count,
+         filepath);
+    return true;
+}
+
+namespace
+{
+IndexRecord read_record(const uint8_t* records, uint32_t index)
+{
+    IndexRecord record;
+    memcpy(&record, records + index * sizeof(IndexRecord), sizeof(record));
+    return record;
+}
+}
+
+bool TitleDatabase::valid_index(
+        const std::vector<uint8_t>& data, int64_t tsv_size)
+{
+    IndexHeader header;
+    if (data.size() < sizeof(header))
+        return false;
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != INDEX_MAGIC || header.version != INDEX_VERSION ||
+        (tsv_size >= 0 && header.tsv_size != static_cast<uint64_t>(tsv_size)) ||
+        header.pool_size % 4 != 0 ||
+        data.size() != sizeof(header) +
+                               uint64_t(header.count) * sizeof(IndexRecord) +
+                               header.pool_size +
+                               uint64_t(header.trigram_count) *
+                                       sizeof(IndexTrigram) +
+                               uint64_t(header.posting_count) *
+                                       sizeof(uint32_t) +
+                               uint64_t(header.title_count) *
+                                       sizeof(IndexTitle) +
+                               uint64_t(header.count) * sizeof(uint32_t) ||
+        (header.pool_size != 0 &&
+         data[sizeof(header) + header.count * sizeof(IndexRecord) +
+              header.pool_size - 1] != '\0'))
+        return false;
+
+    // a snapshot comes from a server, nothing may point out of the arena
+    const auto records = data.data() + sizeof(header);
+    for (uint32_t i = 0; i < header.count; ++i)
+    {
+        const auto record = read_record(records, i);
+        for (const auto offset :
+             {record.titleid,
+              record.content,
+              record.region,
+              record.name,
+              record.full_name,
+              record.name_org,
+              record.zrif,
+              record.url,
+              record.date,
+              record.app_version,
+              record.fw_version,
+              record.mirrors})
+            if (offset >= header.pool_size)
+                return false;
+    }
+    const auto trigrams =
+            records + header.count * sizeof(IndexRecord) + header.pool_size;
+    for (uint32_t i = 0; i < header.trigram_count; ++i)
+    {
+        IndexTrigram trigram;
+        memcpy(&trigram, trigrams + i * sizeof(trigram), sizeof(trigram));
+        if (uint64_t(trigram.first_posting) + trigram.posting_count >
+            header.posting_count)
+            return false;
+    }
+    const auto postings =
+            trigrams + header.trigram_count * sizeof(IndexTrigram);
+    for (uint32_t i = 0; i < header.posting_count; ++i)
+    {
+        uint32_t row;
+        memcpy(&row, postings + i * sizeof(row), sizeof(row));
+        if (row >= header.count)
+            return false;
+    }
+    const auto titles = postings + header.posting_count * sizeof(uint32_t);
+    for (uint32_t i = 0; i < header.title_count; ++i)
+    {
+        IndexTitle title;
+        memcpy(&title, titles + i * sizeof(title), sizeof(title));
+        if (title.titleid >= header.pool_size ||
+            uint64_t(title.first_row) + title.row_count > header.count)
+            return false;
+    }
+    const auto title_rows = titles + header.title_count * sizeof(IndexTitle);
+    for (uint32_t i = 0; i < header.count; ++i)
+    {
+        uint32_t row;
+        memcpy(&row, title_rows + i * sizeof(row), sizeof(row));
+        if (row >= header.count)
+            return false;
+    }
+    return true;
+}
+
+void TitleDatabase::open_index(
+        Mode mode, const std::string& dbpath, ListIndex& index)
+{
+    const auto generation = _index_generation.load();
+
+    const auto path = index_path(dbpath);
+
+    // without its TSV it's a snapshot, it can't be stale
+    index = ListIndex{};
+    if (pkgi_file_exists(path))
+        index.arena = pkgi_load(path);
+    if (!valid_index(index.arena, pkgi_get_size(dbpath.c_str())))
+    {
+        LOGF("index of {} missing or stale, rebuilding it", dbpath);
+        build_index(mode);
+        index.arena = pkgi_load(path);
+        if (!valid_index(index.arena, pkgi_get_size(dbpath.c_str())))
+            throw formatEx<std::runtime_error>("无法读取 {}", path);
+    }
+
+    IndexHeader header;
+    memcpy(&header, index.arena.data(), sizeof(header));
+    index.records = index.arena.data() + sizeof(header);
+    index.count = header.count;
+    index.pool = reinterpret_cast<const char*>(
+            index.records + header.count * sizeof(IndexRecord));
+    index.pool_size = header.pool_size;
+    // aligned since the arena is and every section before is a multiple of 4
+    index.trigrams =
+            reinterpret_cast<const IndexTrigram*>(index.pool + index.pool_size);
+    index.trigram_count = header.trigram_count;
+    index.postings = reinterpret_cast<const uint32_t*>(
+            index.trigrams + index.trigram_count);
+    index.posting_count = header.posting_count;
+    index.titles = reinterpret_cast<const IndexTitle*>(
+            index.postings + index.posting_count);
+    index.title_count = header.title_count;
+    index.title_rows =
+            reinterpret_cast<const uint32_t*>(index.titles + index.title_count);
+    index.generation = generation;
+}
+
+std::shared_ptr<TitleDatabase::Master> TitleDatabase::load_master(
+        Mode mode, const std::string& dbpath)
+{
+    auto master = std::make_shared<Master>();
+    master->mode = mode;
+    auto& index = master->index;
+    open_index(mode, dbpath, index);
+
+    // the columns read by every filter pass are copied out of the records,
+    // the others are read from the arena when a row is materialized
+    auto& hot = master->hot;
+    hot.resize(index.count);
+    for (auto& rows : master->regions)
+        rows = RowBits(index.count);
+    for (uint32_t i = 0; i < index.count; ++i)
+    {
+        const auto record = read_record(index.records, i);
+        index.string(record.titleid);
+        index.string(record.name);
+        index.string(record.content);
+        hot[i].titleid = record.titleid;
+        hot[i].name = record.name;
+        hot[i].content = record.content;
+        const auto region = region_to_filter(index.string(record.region));
+        for (size_t bit = 0; bit < master->regions.size(); ++bit)
+            if (region & (1 << bit))
+                master->regions[bit].set(i);
+    }
+    master->materialized.resize(index.count);
+
+    LOGF("loaded {} items from {}", index.count, index_path(dbpath));
+    return master;
+}
+
+const char* TitleDatabase::ListIndex::string(uint32_t offset) const
+{
+    if (offset >= pool_size)
+        throw std::runtime_error("列表索引已损坏");
+    return pool + offset;
+}
+
+DbItem TitleDatabase::ListIndex::item(uint32_t row) const
+{
+    const auto record = read_record(records, row);
+    std::array<uint8_t, 32> digest;
+    memcpy(digest.data(), record.digest, digest.size());
+
+    std::vector<std::string> mirrors;
+    if (record.mirror_count)
+    {
+        mirrors.reserve(record.mirror_count);
+        const std::string urls = string(record.mirrors);
+        for (size_t pos = 0; pos <= urls.size();)
+        {
+            auto end = urls.find('\n', pos);
+            if (end == std::string::npos)
+                end = urls.size();
+            mirrors.push_back(urls.substr(pos, end - pos));
+            pos = end + 1;
+        }
+    }
+
+    return DbItem{
+            PresenceUnknown,
+            string(record.titleid),
+            string(record.content),
+            0,
+            string(record.full_name),
+            string(record.name_org),
+            string(record.zrif),
+            string(record.url),
+            record.has_digest != 0,
+            digest,
+            record.size,
+            string(record.date),
+            string(record.app_version),
+            string(record.fw_version),
+            std::move(mirrors),
+    };
+}
+
+std::vector<uint32_t> TitleDatabase::ListIndex::rows_of(
+        const std::string& titleid) const
+{
+    const auto it = std::lower_bound(
+            titles,
+            titles + title_count,
+            titleid,
+            [this](const auto& entry, const auto& value) {
+                return strcmp(string(entry.titleid), value.c_str()) < 0;
+            });
+    if (it == titles + title_count || string(it->titleid) != titleid)
+        return {};
+    std::vector<uint32_t> rows(
+            title_rows + it->first_row,
+            title_rows + it->first_row + it->row_count);
+    std::sort(rows.begin(), rows.end());
+    return rows;
+}
+
+std::vector<uint32_t> TitleDatabase::ListIndex::trigram_rows(
+        const std::string& search) const
+{
+    // rows that have every trigram of the search, the rarest first
+    std::vector<const IndexTrigram*> needed;
+    for (size_t i = 0; i + 3 <= search.size(); ++i)
+    {
+        const auto trigram = trigram_at(search.c_str() + i);
+        const auto it = std::lower_bound(
+                trigrams,
+                trigrams + trigram_count,
+                trigram,
+                [](const auto& entry, const auto value) {
+                    return entry.trigram < value;
+                });
+        if (it == trigrams + trigram_count || it->trigram != trigram ||
+            it->first_posting + it->posting_count > posting_count)
+            return {};
+        needed.push_back(it);
+    }
+    if (needed.empty())
+        return {};
+
+    std::sort(needed.begin(), needed.end(), [](const auto a, const auto b) {
+        return a->posting_count < b->posting_count;
+    });
+    std::vector<uint32_t> rows(
+            postings + needed[0]->first_posting,
+            postings + needed[0]->first_posting + needed[0]->posting_count);
+    for (size_t i = 1; i < needed.size() && !rows.empty(); ++i)
+    {
+        const auto begin = postings + needed[i]->first_posting;
+        const auto end = begin + needed[i]->posting_count;
+        rows.erase(
+                std::remove_if(
+                        rows.begin(),
+                        rows.end(),
+                        [&](const auto row) {
+                            return !std::binary_search(begin, end, row);
+                        }),
+                rows.end());
+    }
+    return rows;
+}
+
+DbItem* TitleDatabase::item(uint32_t index)
+{
+    auto& master = *_shown->_master;
+    auto& item = master.materialized[index];
+    if (!item)
+        item = std::make_unique<DbItem>(master.index.item(index));
+    return item.get();
+}
+
+const std::vector<uint32_t>& TitleDatabase::sorted(
+        Master& master, DbSort sort_by)
+{
+    const auto& list = master.index;
+    const auto& hot = master.hot;
+
+    if (static_cast<size_t>(sort_by) >= master.sorted.size())
+        throw formatEx<std::runtime_error>("未知排序顺序 {}", sort_by);
+
+    auto& order = master.sorted[sort_by];
+    if (master.sorted_valid[sort_by])
+        return order;
+
+    order.resize(hot.size());
+    for (uint32_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+
+    const auto titleid = [&](uint32_t index) {
+        return list.pool + hot[index].titleid;
+    };
+
+    // the keys are computed once per row and thrown away once sorted, ties
+    // are ordered by title id
+    const auto sort_by_key = [&](const auto& keys) {
+        std::sort(order.begin(), order.end(), [&](const auto a, const auto b) {
+            if (keys[a] != keys[b])
+                return keys[a] < keys[b];
+            return strcmp(titleid(a), titleid(b)) < 0;
+        });
+    };
+
+    switch (sort_by)
+    {
+    case SortByTitle:
+        std::sort(order.begin(), order.end(), [&](const auto a, const auto b) {
+            return strcmp(titleid(a), titleid(b)) < 0;
+        });
+        break;
+    case SortByRegion:
+    {
+        std::vector<uint8_t> keys(hot.size());
+        for (uint32_t i = 0; i < keys.size(); ++i)
+            keys[i] = pkgi_get_region(titleid(i));
+        sort_by_key(keys);
+        break;
+    }
+    case SortByName:
+    {
+        std::vector<std::string> keys(hot.size());
+        for (uint32_t i = 0; i < keys.size(); ++i)
+            keys[i] = name_key(
+                    list.string(read_record(list.records, i).full_name));
+        sort_by_key(keys);
+        break;
+    }
+    case SortBySize:
+    {
+        std::vector<int64_t> keys(hot.size());
+        for (uint32_t i = 0; i < keys.size(); ++i)
+            keys[i] = read_record(list.records, i).size;
+        sort_by_key(keys);
+        break;
+    }
+    case SortByDate:
+    {
+        std::vector<uint64_t> keys(hot.size());
+        for (uint32_t i = 0; i < keys.size(); ++i)
+            keys[i] = date_key(list.string(read_record(list.records, i).date));
+        sort_by_key(keys);
+        break;
+    }
+    }
+
+    master.sorted_valid[sort_by] = true;
+    return order;
+}
+
+const std::vector<uint32_t>& TitleDatabase::search_rows(
+        Master& master, const std::string& search)
+{
+    const auto& list = master.index;
+    const auto& hot = master.hot;
+
+    if (search == master.search)
+        return master.search_rows;
+
+    std::vector<uint32_t> candidates;
+    if (!master.search.empty() && search.size() > master.search.size() &&
+        pkgi_stricontains(search.c_str(), master.search.c_str()))
+    {
+        // typing one more character only narrows the previous results
+        candidates = std::move(master.search_rows);
+    }
+    else if (search.size() >= 3)
+    {
+        candidates = list.trigram_rows(search);
+    }
+    else
+    {
+        candidates.resize(hot.size());
+        for (uint32_t i = 0; i < candidates.size(); ++i)
+            candidates[i] = i;
+    }
+
+    // trigrams don't check the order, the actual match does
+    candidates.erase(
+            std::remove_if(
+                    candidates.begin(),
+                    candidates.end(),
+                    [&](const auto row) {
+                        return !pkgi_stricontains(
+                                list.pool + hot[row].name, search.c_str());
+                    }),
+            candidates.end());
+
+    master.search = search;
+    master.search_rows = std::move(candidates);
+    return master.search_rows;
+}
+
+const RowBits& TitleDatabase::game_rows(
+        const Master& master,
+        const std::set<std::string>& games,
+        GameRows& cache)
+{
+    // the sets only change with a scan of the card or a check of the
+    // updates, the filters that follow reuse the rows
+    if (cache.valid && cache.games == games)
+        return cache.rows;
+
+    cache.rows = RowBits(master.hot.size());
+    for (uint32_t i = 0; i < master.hot.size(); ++i)
+        if (games.count(master.index.pool + master.hot[i].titleid))
+            cache.rows.set(i);
+    cache.games = games;
+    cache.valid = true;
+    return cache.rows;
+}
+
+std::shared_ptr<TitleDatabase::View> TitleDatabase::prepare(
+        Mode mode,
+        uint32_t region_filter,
+        DbSort sort_by,
+        DbSortOrder sort_order,
+        const std::string& search,
+        const std::set<std::string>& installed_games,
+        const std::set<std::string>& updatable_games,
+        const std::function<bool()>& is_stale)
+{
+    TRACE_SCOPE("TitleDatabase::prepare");
+    ScopeLock _(_prepare_mutex);
+
+    const auto stale = [&] { return is_stale && is_stale(); };
+
+    const auto filter_by_region =
+            (region_filter & DbFilterAllRegions) != DbFilterAllRegions;
+
+    auto view = std::make_shared<View>();
+
+    const auto dbpath =
+            fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
+
+    if (!list_exists(dbpath))
+        return view;
+
+    // changing filters and sorting only works on the table in memory, it's
+    // read again only when it's no longer cached or after an update
+    const auto master = cached_master(mode, dbpath);
+    view->_master = master;
+
+    const auto& hot = master->hot;
+
+    if (stale())
+        return nullptr;
+
+    // every filter is a set of rows, they're intersected a word at a time
+    auto& shown = view->_shown;
+    if (filter_by_region)
+    {
+        shown = RowBits(hot.size());
+        for (size_t bit = 0; bit < master->regions.size(); ++bit)
+            if (region_filter & (1 << bit))
+                shown |= master->regions[bit];
+    }
+    else
+        shown = RowBits(hot.size(), true);
+
+    if (region_filter & DbFilterInstalled)
+        shown &= game_rows(*master, installed_games, master->installed);
+    if (region_filter & DbFilterUpdates)
+        shown &= game_rows(*master, updatable_games, master->updatable);
+
+    if (!search.empty())
+    {
+        RowBits found(hot.size());
+        for (const auto i : search_rows(*master, search))
+            found.set(i);
+        shown &= found;
+    }
+
+    if (stale())
+        return nullptr;
+
+    // the view is the shown rows in the order of the sorted permutation
+    auto& rows = view->_rows;
+    const auto& order = sorted(*master, sort_by);
+    if (sort_order == SortDescending)
+    {
+        for (auto it = order.rbegin(); it != order.rend(); ++it)
+            if (shown.test(*it))
+                rows.push_back(*it);
+    }
+    else
+    {
+        for (const auto index : order)
+            if (shown.test(index))
+                rows.push_back(index);
+    }
+
+    LOGF("prepared {}/{} items", rows.size(), hot.size());
+    return view;
+}
+
+std::shared_ptr<TitleDatabase::Master> TitleDatabase::cached_master(
+        Mode mode, const std::string& dbpath)
+{
+    // lists from before an update are never used again
+    const auto generation = _index_generation.load();
+    _masters.erase(
+            std::remove_if(
+                    _masters.begin(),
+                    _masters.end(),
+                    [&](const auto& master) {
+                        return master->index.generation != generation;
+                    }),
+            _masters.end());
+
+    const auto it = std::find_if(
+            _masters.begin(), _masters.end(), [&](const auto& master) {
+                return master->mode == mode;
+            });
+    if (it != _masters.end())
+        std::rotate(_masters.begin(), it, it + 1);
+    else
+        _masters.insert(_masters.begin(), load_master(mode, dbpath));
+    evict_masters();
+
+    return _masters.front();
+}
+
+void TitleDatabase::evict_masters()
+{
+    // the least recently used lists go first, views still showing them keep
+    // them alive until they're replaced
+    size_t used = 0;
+    for (size_t i = 0; i < _masters.size(); ++i)
+    {
+        used += _masters[i]->memory_size();
+        if (i > 0 && used > _cache_budget)
+        {
+            LOGF("evicting {} lists from the cache", _masters.size() - i);
+            used -= _masters[i]->memory_size();
+            _masters.resize(i);
+            break;
+        }
+    }
+    _memory.set(used);
+    _masters_used = used;
+
+    ScopeLock _(_search_all_mutex);
+    evict_search_all_indexes();
+}
+
+void TitleDatabase::evict_search_all_indexes(int keep)
+{
+    const auto index_size = [](const ListIndex& index) {
+        return sizeof(index) + index.arena.capacity();
+    };
+
+    size_t used = keep >= 0 && _search_all_indexes[keep]
+                          ? index_size(*_search_all_indexes[keep])
+                          : 0;
+    for (int i = 0; i < ModeCount; ++i)
+    {
+        auto& index = _search_all_indexes[i];
+        if (!index || i == keep)
+            continue;
+        const auto size = index_size(*index);
+        if (_masters_used + used + size > _cache_budget)
+        {
+            LOGF("evicting the index of {} from the cache", i);
+            index = nullptr;
+            continue;
+        }
+        used += size;
+    }
+    _search_all_memory.set(used);
+}
+
+size_t TitleDatabase::Master::memory_size() const
+{
+    auto size = sizeof(*this) + index.arena.capacity() +
+                hot.capacity() * sizeof(HotColumns) +
+                materialized.capacity() * sizeof(materialized[0]) +
+                search.capacity() + search_rows.capacity() * sizeof(uint32_t);
+    for (const auto& order : sorted)
+        size += order.capacity() * sizeof(uint32_t);
+    for (const auto& rows : regions)
+        size += rows.memory_size();
+    size += installed.rows.memory_size() + updatable.rows.memory_size();
+    return size;
+}
+
+void TitleDatabase::set_cache_budget(size_t bytes)
+{
+    // called by MemoryBudget from any thread with its lock held, waiting for
+    // a prepare() would hold a download start behind a whole reload
+    _cache_budget = bytes;
+}
+
+void TitleDatabase::show(std::shared_ptr<View> view)
+{
+    // like a fresh reload, the presence is looked up again
+    if (view->_master)
+        for (const auto index : view->_rows)
+            if (const auto& item = view->_master->materialized[index])
+                item->presence = PresenceUnknown;
+    _shown = std::move(view);
+}
+
+void TitleDatabase::reload(
+        Mode mode,
+        uint32_t region_filter,
+        DbSort sort_by,
+        DbSortOrder sort_order,
+        const std::string& search,
+        const std::set<std::string>& installed_games,
+        const std::set<std::string>& updatable_games)
+{
+    TRACE_SCOPE("TitleDatabase::reload");
+    show(prepare(
+            mode,
+            region_filter,
+            sort_by,
+            sort_order,
+            search,
+            installed_games,
+            updatable_games));
+}
+
+std::vector<TitleDatabase::SearchHit> TitleDatabase::search_all(
+        const std::string& search, size_t max_hits)
+{
+    std::vector<SearchHit> hits;
+    if (search.empty())
+        return hits;
+
+    for (int i = 0; i < ModeCount && hits.size() < max_hits; ++i)
+    {
+        const auto mode = static_cast<Mode>(i);
+        const auto index = other_index(mode);
+        if (!index)
+            continue;
+
+        // names are only compared on the rows having all the trigrams, title
+        // ids are short enough to be compared on every row
+        const auto candidates = search.size() >= 3
+                                        ? index->trigram_rows(search)
+                                        : std::vector<uint32_t>{};
+        auto candidate = candidates.begin();
+        for (uint32_t row = 0; row < index->count && hits.size() < max_hits;
+             ++row)
+        {
+            while (candidate != candidates.end() && *candidate < row)
+                ++candidate;
+            const auto name_candidate =
+                    search.size() < 3 ||
+                    (candidate != candidates.end() && *candidate == row);
+
+            const auto record = read_record(index->records, row);
+            if (pkgi_stricontains(
+                        index->string(record.titleid), search.c_str()) ||
+                (name_candidate &&
+                 pkgi_stricontains(
+                         index->string(record.name), search.c_str())))
+                hits.push_back({mode, index->item(row)});
+        }
+    }
+
+    LOGF("found {} items in all lists for {}", hits.size(), search);
+    return hits;
+}
+
+std::vector<TitleDatabase::SearchHit> TitleDatabase::related(
+        const std::string& titleid, const std::vector<Mode>& modes)
+{
+    std::vector<SearchHit> hits;
+    for (const auto mode : modes)
+    {
+        const auto index = other_index(mode);
+        if (!index)
+            continue;
+        for (const auto row : index->rows_of(titleid))
+            hits.push_back({mode, index->item(row)});
+    }
+    return hits;
+}
+
+size_t TitleDatabase::query(
+        const Query& query, const std::function<void(const QueryHit&)>& emit)
+{
+    TRACE_SCOPE("TitleDatabase::query");
+
+    struct Match
+    {
+        Mode mode;
+        const ListIndex* index;
+        uint32_t row;
+        IndexRecord record;
+    };
+
+    const auto digits = [](const char* date) {
+        std::string key;
+        for (; *date; ++date)
+            if (*date >= '0' && *date <= '9')
+                key += *date;
+        return key;
+    };
+    const auto since = digits(query.since.c_str());
+    const auto until = digits(query.until.c_str());
+    const auto filter_by_region = (query.region_filter & DbFilterAllRegions) !=
+                                  DbFilterAllRegions;
+
+    auto modes = query.modes;
+    if (modes.empty())
+        for (int i = 0; i < ModeCount; ++i)
+            modes.push_back(static_cast<Mode>(i));
+
+    std::vector<Match> matches;
+    // the matches point into them
+    std::vector<std::shared_ptr<const ListIndex>> indexes;
+    for (const auto mode : modes)
+    {
+        const auto index = other_index(mode);
+        if (!index)
+            continue;
+        indexes.push_back(index);
+
+        // the title table and the trigrams give the few rows to look at, the
+        // whole list is only read when neither narrows it
+        std::vector<uint32_t> rows;
+        if (!query.titleids.empty())
+        {
+            for (const auto& titleid : query.titleids)
+            {
+                const auto title_rows = index->rows_of(titleid);
+                rows.insert(rows.end(), title_rows.begin(), title_rows.end());
+            }
+            std::sort(rows.begin(), rows.end());
+        }
+        else if (query.name.size() >= 3)
+            rows = index->trigram_rows(query.name);
+        else
+        {
+            rows.resize(index->count);
+            std::iota(rows.begin(), rows.end(), 0);
+        }
+
+        for (const auto row : rows)
+        {
+            const auto record = read_record(index->records, row);
+            if (record.size < query.min_size || record.size > query.max_size)
+                continue;
+            if (filter_by_region &&
+                !(region_to_filter(index->string(record.region)) &
+                  query.region_filter))
+                continue;
+            if (!query.name.empty() &&
+                !pkgi_stricontains(
+                        index->string(record.name), query.name.c_str()))
+                continue;
+            if (!since.empty() || !until.empty())
+            {
+                const auto date = digits(index->string(record.date));
+                if (date.empty() ||
+                    (!since.empty() &&
+                     date.compare(0, since.size(), since) < 0) ||
+                    (!until.empty() &&
+                     date.compare(0, until.size(), until) > 0))
+                    continue;
+            }
+            matches.push_back({mode, index.get(), row, record});
+        }
+    }
+
+    // same orders as sorted(), the lists are merged so ties are ordered by
+    // title id and then kept in list order
+    std::vector<uint32_t> order(matches.size());
+    std::iota(order.begin(), order.end(), 0);
+    const auto titleid = [&](uint32_t i) {
+        return matches[i].index->string(matches[i].record.titleid);
+    };
+    const auto sort_by_key = [&](const auto& keys) {
+        std::stable_sort(
+                order.begin(), order.end(), [&](const auto a, const auto b) {
+                    if (keys[a] != keys[b])
+                        return keys[a] < keys[b];
+                    return strcmp(titleid(a), titleid(b)) < 0;
+                });
+    };
+    switch (query.sort_by)
+    {
+    case SortByTitle:
+        std::stable_sort(
+                order.begin(), order.end(), [&](const auto a, const auto b) {
+                    return strcmp(titleid(a), titleid(b)) < 0;
+                });
+        break;
+    case SortByRegion:
+    {
+        std::vector<uint8_t> keys(matches.size());
+        for (uint32_t i = 0; i < keys.size(); ++i)
+            keys[i] = pkgi_get_region(titleid(i));
+        sort_by_key(keys);
+        break;
+    }
+    case SortByName:
+    {
+        std::vector<std::string> keys(matches.size());
+        for (uint32_t i = 0; i < keys.size(); ++i)
+            keys[i] = name_key(
+                    matches[i].index->string(matches[i].record.full_name));
+        sort_by_key(keys);
+        break;
+    }
+    case SortBySize:
+    {
+        std::vector<int64_t> keys(matches.size());
+        for (uint32_t i = 0; i < keys.size(); ++i)
+            keys[i] = matches[i].record.size;
+        sort_by_key(keys);
+        break;
+    }
+    case SortByDate:
+    {
+        std::vector<uint64_t> keys(matches.size());
+        for (uint32_t i = 0; i < keys.size(); ++i)
+            keys[i] = date_key(
+                    matches[i].index->string(matches[i].record.date));
+        sort_by_key(keys);
+        break;
+    }
+    default:
+        throw formatEx<std::runtime_error>("未知排序顺序 {}", query.sort_by);
+    }
+    if (query.sort_order == SortDescending)
+        std::reverse(order.begin(), order.end());
+
+    const auto emitted = std::min(order.size(), query.limit);
+    for (size_t i = 0; i < emitted; ++i)
+    {
+        const auto& match = matches[order[i]];
+        emit({match.mode,
+              match.index->string(match.record.region),
+              match.index->item(match.row)});
+    }
+
+    LOGF("query matched {} items, emitted {}", matches.size(), emitted);
+    return emitted;
+}
+
+std::shared_ptr<const TitleDatabase::ListIndex> TitleDatabase::other_index(
+        Mode mode)
+{
+    const auto dbpath =
+            fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
+    {
+        ScopeLock _(_search_all_mutex);
+        auto& cached = _search_all_indexes[mode];
+        if (!list_exists(dbpath))
+        {
+            cached = nullptr;
+            evict_search_all_indexes();
+            return nullptr;
+        }
+
+        // the loaded list is already in memory, the others stay there once
+        // read so that the next lookup is as fast
+        const auto shown = _shown ? _shown->_master : nullptr;
+        if (shown && shown->mode == mode &&
+            shown->index.generation == _index_generation)
+        {
+            cached = nullptr;
+            evict_search_all_indexes();
+            return std::shared_ptr<const ListIndex>(shown, &shown->index);
+        }
+        if (cached && cached->generation == _index_generation)
+            return cached;
+    }
+
+    // read without the lock, evict_masters doesn't wait for it
+    auto index = std::make_shared<ListIndex>();
+    open_index(mode, dbpath, *index);
+
+    ScopeLock _(_search_all_mutex);
+    _search_all_indexes[mode] = index;
+    evict_search_all_indexes(mode);
+    return index;
+}
+
+void TitleDatabase::reset_update_status()
+{
+    db_size = 0;
+    db_total = 0;
+}
+
+void TitleDatabase::get_update_status(uint32_t* updated, uint32_t* total)
+{
+    *updated = db_size;
+    *total = db_total;
+}
+
+uint32_t TitleDatabase::count()
+{
+    return _shown ? _shown->_rows.size() : 0;
+}
+
+uint32_t TitleDatabase::total()
+{
+    return _shown && _shown->_master ? _shown->_master->hot.size() : 0;
+}
+
+DbItem* TitleDatabase::get(uint32_t index)
+{
+    return index < count() ? item(_shown->_rows[index]) : NULL;
+}
+
+DbItem* TitleDatabase::get_by_content(const char* content)
+{
+    if (!_shown || !_shown->_master)
+        return NULL;
+
+    auto& master = *_shown->_master;
+    if (master.content_rows.empty())
+    {
+        master.content_rows.reserve(master.hot.size());
+        for (uint32_t i = 0; i < master.hot.size(); ++i)
+            master.content_rows.emplace(
+                    master.index.pool + master.hot[i].content, i);
+    }
+
+    const auto it = master.content_rows.find(content);
+    if (it == master.content_rows.end() || !_shown->_shown.test(it->second))
+        return NULL;
+    return item(it->second);
 }
 
 GameRegion pkgi_get_region(const std::string& titleid)
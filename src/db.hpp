@@ -1,11 +1,19 @@
 #pragma once
 
 #include "http.hpp"
+#include "memstats.hpp"
+#include "rowbits.hpp"
+#include "thread.hpp"
 
 #include <array>
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include <cstdint>
@@ -43,6 +51,8 @@ enum DbFilter
     DbFilterRegionUSA = 0x08,
 
     DbFilterInstalled = 0x10,
+    // installed games with a newer patch on the update server
+    DbFilterUpdates = 0x20,
 
     DbFilterAllRegions = DbFilterRegionUSA | DbFilterRegionEUR |
                          DbFilterRegionJPN | DbFilterRegionASA,
@@ -65,6 +75,9 @@ struct DbItem
     std::string date;
     std::string app_version;
     std::string fw_version;
+    // the urls of the same content in the other repositories, see
+    // TitleDatabase::merge
+    std::vector<std::string> mirrors;
 };
 
 enum GameRegion
@@ -91,21 +104,73 @@ enum Mode
 static constexpr auto ModeCount = 8;
 
 std::string pkgi_mode_to_string(Mode mode);
+// the name of the list of mode in the database folder
+const char* pkgi_mode_to_file_name(Mode mode);
+
+// puts the fields of the row at *pptr in fields, NUL terminating them in
+// place, and moves *pptr to the next row. fields is cleared first, a caller
+// reusing it for every row keeps its storage
+void pkgi_split_row(
+        char** pptr, const char* end, std::vector<const char*>& fields);
 
 class TitleDatabase
 {
 public:
     TitleDatabase(const std::string& dbPath);
 
+    // the list count() and get() show, made by prepare()
+    class View;
+
+    // computes the list to show, it can run on another thread than the
+    // one showing the list but only one prepare() runs at a time. Returns
+    // nullptr when is_stale returns true before it's done.
+    std::shared_ptr<View> prepare(
+            Mode mode,
+            uint32_t region_filter,
+            DbSort sort_by,
+            DbSortOrder sort_order,
+            const std::string& search,
+            const std::set<std::string>& installed_games,
+            const std::set<std::string>& updatable_games,
+            const std::function<bool()>& is_stale = nullptr);
+    void show(std::shared_ptr<View> view);
+
+    // the loaded lists of the last modes are kept as long as they fit in
+    // this many bytes, the last one is always kept. From any thread, the
+    // lists over it are dropped by the next prepare()
+    void set_cache_budget(size_t bytes);
+
+    // prepare() and show() at once
     void reload(
             Mode mode,
             uint32_t region_filter,
             DbSort sort_by,
             DbSortOrder sort_order,
             const std::string& search,
-            const std::set<std::string>& installed_games);
+            const std::set<std::string>& installed_games,
+            const std::set<std::string>& updatable_games);
+
+    using HttpFactory = std::function<std::unique_ptr<Http>()>;
 
-    void update(Mode mode, Http* http, const std::string& update_url);
+    // returns false when the list didn't change since the last update. The
+    // list of the repository repo of several is kept aside for merge()
+    bool update(
+            Mode mode,
+            const HttpFactory& make_http,
+            const std::string& update_url,
+            int repo = -1);
+    // makes the list of mode from the lists update() got of repositories 0
+    // to repo_count - 1, the ones never fetched are left out. The rows of a
+    // content already in an earlier repository only add their url to its
+    // mirrors. Only merges again when changed or the list isn't this merge,
+    // returns whether it did. Throws when there is no list to merge
+    bool merge(Mode mode, int repo_count, bool changed);
+    // parses the TSV of mode at tsv_path into the index at path, the one
+    // build_index makes and a server may ship, see update()
+    static void write_index(
+            Mode mode, const std::string& tsv_path, const std::string& path);
+    // the counters add up all the updates running since the last reset
+    void reset_update_status();
     void get_update_status(uint32_t* updated, uint32_t* total);
 
     uint32_t count();
@@ -113,15 +178,223 @@ public:
     DbItem* get(uint32_t index);
     DbItem* get_by_content(const char* content);
 
+    struct SearchHit
+    {
+        Mode mode;
+        DbItem item;
+    };
+
+    // finds the titles of every mode whose title id or name contains search,
+    // in mode order, without touching the shown list
+    std::vector<SearchHit> search_all(
+            const std::string& search, size_t max_hits);
+    // the titles of the lists of modes whose title id is titleid, like the
+    // DLCs and themes of a game, looked up in the title table of their
+    // index without loading the lists
+    std::vector<SearchHit> related(
+            const std::string& titleid, const std::vector<Mode>& modes);
+
+    // the titles query() keeps have every field of it, the ones left at
+    // their default match every title
+    struct Query
+    {
+        // every mode when empty
+        std::vector<Mode> modes;
+        uint32_t region_filter = DbFilterAllRegions;
+        int64_t min_size = INT64_MIN;
+        int64_t max_size = INT64_MAX;
+        // compared on the digits, "2018" or "2018-06" are the whole year or
+        // month, the titles without a date are left out when one is set
+        std::string since;
+        std::string until;
+        // in the name, case insensitively
+        std::string name;
+        std::set<std::string> titleids;
+        DbSort sort_by = SortByTitle;
+        DbSortOrder sort_order = SortAscending;
+        size_t limit = SIZE_MAX;
+    };
+
+    struct QueryHit
+    {
+        Mode mode;
+        // as written in the list
+        const char* region;
+        DbItem item;
+    };
+
+    // passes the titles of every list matching query to emit in order, read
+    // from the indexes of the lists, which are only built from the TSVs when
+    // stale, without touching the shown list. A row is only turned into a
+    // DbItem when it's emitted. Returns the number of titles emitted
+    size_t query(
+            const Query& query,
+            const std::function<void(const QueryHit&)>& emit);
+
 private:
-    static constexpr auto MAX_DB_ITEMS = 8192;
+    using ScopeLock = std::lock_guard<Mutex>;
 
     std::string _dbPath;
-    uint32_t db_total;
-    uint32_t db_size;
-    uint32_t _title_count;
+    std::atomic<uint32_t> db_total{0};
+    std::atomic<uint32_t> db_size{0};
+
+    // entry of the trigram table of the index
+    struct IndexTrigram
+    {
+        uint32_t trigram;
+        uint32_t first_posting;
+        uint32_t posting_count;
+    };
+    static_assert(sizeof(IndexTrigram) == 12, "index trigrams must be packed");
+
+    // entry of the title table of the index
+    struct IndexTitle
+    {
+        // offset in the string pool
+        uint32_t titleid;
+        uint32_t first_row;
+        uint32_t row_count;
+    };
+    static_assert(sizeof(IndexTitle) == 12, "index titles must be packed");
+
+    // an index file read in memory, the sections point into the arena
+    struct ListIndex
+    {
+        std::vector<uint8_t> arena;
+        const uint8_t* records = nullptr;
+        uint32_t count = 0;
+        const char* pool = nullptr;
+        uint32_t pool_size = 0;
+        const IndexTrigram* trigrams = nullptr;
+        uint32_t trigram_count = 0;
+        const uint32_t* postings = nullptr;
+        uint32_t posting_count = 0;
+        const IndexTitle* titles = nullptr;
+        uint32_t title_count = 0;
+        // the rows sorted by title id, the titles are ranges of it
+        const uint32_t* title_rows = nullptr;
+        // value of _index_generation when it was read
+        uint32_t generation = 0;
+
+        const char* string(uint32_t offset) const;
+        DbItem item(uint32_t row) const;
+        // rows whose name has every trigram of search, which must be at
+        // least 3 bytes long
+        std::vector<uint32_t> trigram_rows(const std::string& search) const;
+        // rows of titleid, in ascending order
+        std::vector<uint32_t> rows_of(const std::string& titleid) const;
+    };
+
+    // the index of a list is kept in memory as is and rows are only turned
+    // into DbItems when they're asked for, the columns used by every filter
+    // pass are next to it
+    struct HotColumns
+    {
+        uint32_t titleid;
+        uint32_t name;
+        uint32_t content;
+    };
+
+    // the rows of the title ids of a set of games, kept until the set
+    // changes
+    struct GameRows
+    {
+        bool valid = false;
+        std::set<std::string> games;
+        RowBits rows;
+    };
+
+    // a loaded list, shared by the views made from it. The index and the
+    // columns don't change once loaded, the materialized rows belong to the
+    // thread showing the list and the caches to prepare()
+    struct Master
+    {
+        Mode mode;
+        ListIndex index;
+        std::vector<HotColumns> hot;
+        // rows of each region, in the order of the DbFilterRegion bits
+        std::array<RowBits, 4> regions;
+        std::vector<std::unique_ptr<DbItem>> materialized;
+        // first row of each content id, also built by the thread showing the
+        // list, on first use
+        std::unordered_map<std::string_view, uint32_t> content_rows;
+        // rows matching the last search, longer searches start from them
+        std::string search;
+        std::vector<uint32_t> search_rows;
+        // ascending permutations of the list for each DbSort, built on first
+        // use
+        std::array<std::vector<uint32_t>, 5> sorted;
+        std::array<bool, 5> sorted_valid{};
+        // for DbFilterInstalled and DbFilterUpdates
+        GameRows installed;
+        GameRows updatable;
+
+        // bytes allocated for it, the parts owned by the thread showing the
+        // list aside
+        size_t memory_size() const;
+    };
+
+    // serializes prepare(), and guards _masters
+    Mutex _prepare_mutex{"db_prepare_mutex"};
+    // the most recently used first
+    std::vector<std::shared_ptr<Master>> _masters;
+    std::atomic<size_t> _cache_budget{16 * 1024 * 1024};
+    // what the lists of _masters hold
+    MemoryCharge _memory{MemPool::TitleDb};
+    std::shared_ptr<View> _shown;
+    // guards _search_all_indexes, taken after _prepare_mutex
+    Mutex _search_all_mutex{"db_search_all_mutex"};
+    // indexes of the other modes, read by the first search_all, related or
+    // query. They only keep what the lists of _masters leave of the cache
+    // budget, a lookup holds on to the ones it uses
+    std::array<std::shared_ptr<ListIndex>, ModeCount> _search_all_indexes;
+    // what _search_all_indexes hold
+    MemoryCharge _search_all_memory{MemPool::TitleDb};
+    // what the lists of _masters hold, set by evict_masters
+    std::atomic<size_t> _masters_used{0};
+    // bumped by every build_index, which may run on the refresh threads
+    std::atomic<uint32_t> _index_generation{0};
+
+    class IndexBuilder;
+
+    // the TSV of mode, of the repository repo when repo isn't negative
+    std::string list_path(Mode mode, int repo) const;
+    // parses the TSV of mode into its binary index, which reload reads
+    void build_index(Mode mode);
+    // whether data is a whole index, made from a TSV of tsv_size bytes
+    // unless it's negative
+    static bool valid_index(const std::vector<uint8_t>& data, int64_t tsv_size);
+    void open_index(Mode mode, const std::string& dbpath, ListIndex& index);
+    // the index of mode, the shown one or one read for search_all, null
+    // when there is no list
+    std::shared_ptr<const ListIndex> other_index(Mode mode);
+    // drops the indexes of _search_all_indexes over the cache budget but
+    // the one of keep, must be called with _search_all_mutex locked
+    void evict_search_all_indexes(int keep = -1);
+    std::shared_ptr<Master> load_master(Mode mode, const std::string& dbpath);
+    // must be called with _prepare_mutex locked
+    std::shared_ptr<Master> cached_master(
+            Mode mode, const std::string& dbpath);
+    // must be called with _prepare_mutex locked
+    void evict_masters();
+    static const std::vector<uint32_t>& sorted(Master& master, DbSort sort_by);
+    static const RowBits& game_rows(
+            const Master& master,
+            const std::set<std::string>& games,
+            GameRows& cache);
+    static const std::vector<uint32_t>& search_rows(
+            Master& master, const std::string& search);
+    DbItem* item(uint32_t index);
+};
+
+class TitleDatabase::View
+{
+    friend class TitleDatabase;
 
-    std::vector<DbItem> db;
+    std::shared_ptr<Master> _master;
+    // shown rows, as indexes in the list, and whether each row is shown
+    std::vector<uint32_t> _rows;
+    RowBits _shown;
 };
 
 GameRegion pkgi_get_region(const std::string& titleid);
@@ -1,35 +1,42 @@
 #include "download.hpp"
 
 #include "file.hpp"
+#include "isoblockdecoder.hpp"
 #include "log.hpp"
+#include "manifest.hpp"
+#include "packagemanifest.hpp"
 #include "pkgi.hpp"
+#include "readaheadhttp.hpp"
+#include "sfo.hpp"
+#include "trace.hpp"
+#include "trash.hpp"
 #include "utils.hpp"
 
 #include <fmt/format.h>
 
 #include <boost/scope_exit.hpp>
 
-#include <cereal/archives/binary.hpp>
-
-#include <fstream>
-
+#include <algorithm>
 #include <cstddef>
+#include <cstring>
 
-static constexpr auto SAVE_PERIOD = 10 * 1024 * 1024;
+#include <zlib.h>
+
+// checkpoints only append a small record to the journal
+static constexpr auto SAVE_PERIOD = 2 * 1024 * 1024;
 
 static constexpr auto ISO_SECTOR_SIZE = 2048;
+static constexpr uint32_t HEAD_WINDOW_SIZE = 16 * 1024;
 
-enum ContentType
-{
-    CONTENT_TYPE_PSX_GAME = 6,
-    CONTENT_TYPE_PSP_GAME = 7,
-    CONTENT_TYPE_PSP_GAME_ALT = 14,
-    CONTENT_TYPE_PSP_MINI_GAME = 15,
-    CONTENT_TYPE_PSV_GAME = 21, // or update
-    CONTENT_TYPE_PSV_DLC = 22,
-    CONTENT_TYPE_PSM_GAME = 24,
-    CONTENT_TYPE_PSM_GAME_ALT = 29, // also sometimes 29
-};
+// below this, reading through the gap is cheaper than a new request
+static constexpr auto SEEK_THRESHOLD = 4 * 1024 * 1024;
+
+// the files below this take a single write, they're closed by the writer
+// thread so that a package of thousands of them doesn't wait on each
+static constexpr uint64_t SMALL_FILE_SIZE = 256 * 1024;
+
+// the kept package only gets a slice of the memory the item writer has
+static constexpr uint32_t KEEP_BUFFER_SIZE = 256 * 1024;
 
 // clang-format off
 static const uint8_t pkg_psp_key[] = { 0x07, 0xf2, 0xc6, 0x82, 0x90, 0xb5, 0x0d, 0x2c, 0x33, 0x81, 0x8d, 0x70, 0x9b, 0x60, 0xe6, 0x2b };
@@ -44,299 +51,150 @@ static const uint8_t amctl_hashkey_4[] = { 0x13, 0x5f, 0xa4, 0x7c, 0xab, 0x39, 0
 static const uint8_t amctl_hashkey_5[] = { 0x67, 0x8d, 0x7f, 0xa3, 0x2a, 0x9c, 0xa0, 0xd1, 0x50, 0x8a, 0xd8, 0x38, 0x5e, 0x4b, 0x01, 0x7e };
 // clang-format on
 
-Download::Download(std::unique_ptr<Http> http) : _http(std::move(http))
-{
-}
+// the most of a package pkgi_inspect_package reads before its encrypted
+// part, and of its item table
+static constexpr uint64_t MAX_INSPECTED_HEAD = 1024 * 1024;
+static constexpr uint64_t MAX_INSPECTED_ITEMS = 4 * 1024 * 1024;
+// and of the names of its items and its param.sfo when peeked at
+static constexpr uint64_t MAX_PEEKED_NAMES = 4 * 1024 * 1024;
+static constexpr uint64_t MAX_PEEKED_SFO = 64 * 1024;
 
-void Download::download_start(void)
+namespace
 {
-    LOGF("resuming pkg download from {} offset", download_offset);
-    info_update = pkgi_time_msec() + 1000;
-    update_status("Downloading");
-}
-
-void Download::update_progress()
+// checks the magics of the header and the extended header, and that the
+// zRIF is the one of the package
+void check_head(const uint8_t* head, const uint8_t* rif)
 {
-    uint32_t info_now = pkgi_time_msec();
-    if (info_now >= info_update)
+    if (get32be(head) != 0x7f504b47 ||
+        get32be(head + PKG_HEADER_SIZE) != 0x7F657874)
     {
-        update_progress_cb(download_offset, download_size);
-        info_update = info_now + 100;
+        throw DownloadError("错误的PKG文件头");
     }
-}
 
-// lzrc decompression code from libkirk by tpu
-typedef struct
-{
-    // input stream
-    const uint8_t* input;
-    uint32_t in_ptr;
-    uint32_t in_len;
-
-    // output stream
-    uint8_t* output;
-    uint32_t out_ptr;
-    uint32_t out_len;
-
-    // range decode
-    uint32_t range;
-    uint32_t code;
-    uint32_t out_code;
-    uint8_t lc;
-
-    uint8_t bm_literal[8][256];
-    uint8_t bm_dist_bits[8][39];
-    uint8_t bm_dist[18][8];
-    uint8_t bm_match[8][8];
-    uint8_t bm_len[8][31];
-} lzrc_decode;
-
-static void rc_init(
-        lzrc_decode* rc, void* out, int out_len, const void* in, int in_len)
-{
-    if (in_len < 5)
+    // contentid is at 0x50 for psm games
+    if (rif && !(pkgi_memequ(rif + 0x10, head + 0x30, 0x30) ||
+                 pkgi_memequ(rif + 0x50, head + 0x30, 0x30)))
     {
-        throw DownloadError(
-                "internal error - lzrc input underflow! pkg may be corrupted");
+        throw DownloadError("zRIF所包含的数据与PKG文件不匹配");
     }
-
-    rc->input = static_cast<const uint8_t*>(in);
-    rc->in_len = in_len;
-    rc->in_ptr = 5;
-
-    rc->output = static_cast<uint8_t*>(out);
-    rc->out_len = out_len;
-    rc->out_ptr = 0;
-
-    rc->range = 0xffffffff;
-    rc->lc = rc->input[0];
-    rc->code = get32be(rc->input + 1);
-    rc->out_code = 0xffffffff;
-
-    memset(rc->bm_literal, 0x80, sizeof(rc->bm_literal));
-    memset(rc->bm_dist_bits, 0x80, sizeof(rc->bm_dist_bits));
-    memset(rc->bm_dist, 0x80, sizeof(rc->bm_dist));
-    memset(rc->bm_match, 0x80, sizeof(rc->bm_match));
-    memset(rc->bm_len, 0x80, sizeof(rc->bm_len));
 }
 
-static void normalize(lzrc_decode* rc)
+// the key of the encrypted part, iv is the one of the header
+void init_package_key(const uint8_t* head, const uint8_t* iv, aes128_ctx* aes)
 {
-    if (rc->range < 0x01000000)
+    uint8_t key[AES_BLOCK_SIZE];
+    int key_type = head[0xe7] & 7;
+    if (key_type == 1)
     {
-        rc->range <<= 8;
-        rc->code = (rc->code << 8) + rc->input[rc->in_ptr];
-        rc->in_ptr++;
+        pkgi_memcpy(key, pkg_psp_key, sizeof(key));
     }
-}
-
-static int rc_bit(lzrc_decode* rc, uint8_t* prob)
-{
-    uint32_t bound;
-
-    normalize(rc);
-
-    bound = (rc->range >> 8) * (*prob);
-    *prob -= *prob >> 3;
-
-    if (rc->code < bound)
+    else if (key_type == 2)
     {
-        rc->range = bound;
-        *prob += 31;
-        return 1;
+        aes128_ctx ctx;
+        aes128_init(&ctx, pkg_vita_2);
+        aes128_encrypt(&ctx, iv, key);
     }
-    else
+    else if (key_type == 3)
     {
-        rc->code -= bound;
-        rc->range -= bound;
-        return 0;
+        aes128_ctx ctx;
+        aes128_init(&ctx, pkg_vita_3);
+        aes128_encrypt(&ctx, iv, key);
     }
-}
-
-static int rc_bittree(lzrc_decode* rc, uint8_t* probs, int limit)
-{
-    int number = 1;
-
-    do
+    else if (key_type == 4)
     {
-        number = (number << 1) + rc_bit(rc, probs + number);
-    } while (number < limit);
+        aes128_ctx ctx;
+        aes128_init(&ctx, pkg_vita_4);
+        aes128_encrypt(&ctx, iv, key);
+    }
+    else
+        throw DownloadError("无效的密钥类型" + std::to_string(key_type));
 
-    return number;
+    aes128_ctr_init(aes, key);
 }
 
-static int rc_number(lzrc_decode* rc, uint8_t* prob, uint32_t n)
+struct PackageMeta
 {
-    int number = 1;
+    uint32_t content_type = 0;
+    uint32_t index_size = 0;
+};
 
-    if (n > 3)
+// reads the metadata of the head, which is head_size bytes long, and throws
+// when the content type isn't supported
+PackageMeta parse_meta(
+        const uint8_t* head,
+        uint64_t head_size,
+        uint32_t meta_offset,
+        uint32_t meta_count)
+{
+    PackageMeta meta;
+    uint32_t offset = meta_offset;
+    for (uint32_t i = 0; i < meta_count; i++)
     {
-        number = (number << 1) + rc_bit(rc, prob + 3);
-        if (n > 4)
+        if (offset + 16 >= head_size)
         {
-            number = (number << 1) + rc_bit(rc, prob + 3);
-            if (n > 5)
-            {
-                // direct bits
-                normalize(rc);
-
-                for (uint32_t i = 0; i < n - 5; i++)
-                {
-                    rc->range >>= 1;
-                    number <<= 1;
-                    if (rc->code < rc->range)
-                    {
-                        number += 1;
-                    }
-                    else
-                    {
-                        rc->code -= rc->range;
-                    }
-                }
-            }
+            throw DownloadError("PKG文件不完整或已损坏");
         }
-    }
 
-    if (n > 0)
-    {
-        number = (number << 1) + rc_bit(rc, prob);
-        if (n > 1)
+        uint32_t type = get32be(head + offset + 0);
+        uint32_t size = get32be(head + offset + 4);
+
+        if (type == 2)
         {
-            number = (number << 1) + rc_bit(rc, prob + 1);
-            if (n > 2)
+            meta.content_type = get32be(head + offset + 8);
+            if (meta.content_type != CONTENT_TYPE_PSX_GAME &&
+                meta.content_type != CONTENT_TYPE_PSP_GAME &&
+                meta.content_type != CONTENT_TYPE_PSP_MINI_GAME &&
+                meta.content_type != CONTENT_TYPE_PSP_GAME_ALT &&
+                meta.content_type != CONTENT_TYPE_PSM_GAME &&
+                meta.content_type != CONTENT_TYPE_PSM_GAME_ALT &&
+                meta.content_type != CONTENT_TYPE_PSV_GAME &&
+                meta.content_type != CONTENT_TYPE_PSV_DLC)
             {
-                number = (number << 1) + rc_bit(rc, prob + 2);
+                throw DownloadError(
+                        "不支持的PKG类型: " +
+                        std::to_string(meta.content_type));
             }
         }
+        else if (type == 13)
+        {
+            // index_offset = get32be(head + offset + 8);
+            meta.index_size = get32be(head + offset + 12);
+        }
+        offset += 8 + size;
     }
-
-    return number;
+    return meta;
 }
 
-static int lzrc_decompress(void* out, int out_len, const void* in, int in_len)
+// PSP and PSX packages are only partially extracted, their footprint can't
+// be told from the item table
+bool is_partially_extracted(uint32_t content_type)
 {
-    lzrc_decode rc;
-    rc_init(&rc, out, out_len, in, in_len);
+    return content_type == CONTENT_TYPE_PSX_GAME ||
+           content_type == CONTENT_TYPE_PSP_GAME ||
+           content_type == CONTENT_TYPE_PSP_GAME_ALT ||
+           content_type == CONTENT_TYPE_PSP_MINI_GAME;
+}
+}
 
-    if (rc.lc & 0x80)
-    {
-        // plain text
-        memcpy(rc.output, rc.input + 5, rc.code);
-        return rc.code;
-    }
+Download::Download(std::unique_ptr<Http> http)
+    : _http(std::make_unique<ReadAheadHttp>(std::move(http)))
+{
+}
 
-    int rc_state = 0;
-    uint8_t last_byte = 0;
+void Download::download_start(void)
+{
+    LOGF("resuming pkg download from {} offset", download_offset);
+    info_update = pkgi_time_msec() + 1000;
+    update_status("Downloading");
+}
 
-    for (;;)
+void Download::update_progress()
+{
+    uint32_t info_now = pkgi_time_msec();
+    if (info_now >= info_update)
     {
-        uint32_t match_step = 0;
-
-        int bit = rc_bit(&rc, &rc.bm_match[rc_state][match_step]);
-        if (bit == 0) // literal
-        {
-            if (rc_state > 0)
-            {
-                rc_state -= 1;
-            }
-
-            int byte = rc_bittree(
-                    &rc,
-                    &rc.bm_literal[((last_byte >> rc.lc) & 0x07)][0],
-                    0x100);
-            byte -= 0x100;
-
-            if (rc.out_ptr == rc.out_len)
-            {
-                throw DownloadError(
-                        "内部错误 - PKG文件不完整或已损坏 ! 请重新"
-                        "下载");
-            }
-            rc.output[rc.out_ptr++] = (uint8_t)byte;
-            last_byte = (uint8_t)byte;
-        }
-        else // match
-        {
-            // find bits of match length
-            uint32_t len_bits = 0;
-            for (int i = 0; i < 7; i++)
-            {
-                match_step += 1;
-                bit = rc_bit(&rc, &rc.bm_match[rc_state][match_step]);
-                if (bit == 0)
-                {
-                    break;
-                }
-                len_bits += 1;
-            }
-
-            // find match length
-            uint32_t match_len;
-            if (len_bits == 0)
-            {
-                match_len = 1;
-            }
-            else
-            {
-                uint32_t len_state = ((len_bits - 1) << 2) +
-                                     ((rc.out_ptr << (len_bits - 1)) & 0x03);
-                match_len = rc_number(
-                        &rc, &rc.bm_len[rc_state][len_state], len_bits);
-                if (match_len == 0xFF)
-                {
-                    // end of stream
-                    return rc.out_ptr;
-                }
-            }
-
-            // find number of bits of match distance
-            uint32_t dist_state = 0;
-            uint32_t limit = 8;
-            if (match_len > 2)
-            {
-                dist_state += 7;
-                limit = 44;
-            }
-            int dist_bits = rc_bittree(
-                    &rc, &rc.bm_dist_bits[len_bits][dist_state], limit);
-            dist_bits -= limit;
-
-            // find match distance
-            uint32_t match_dist;
-            if (dist_bits > 0)
-            {
-                match_dist =
-                        rc_number(&rc, &rc.bm_dist[dist_bits][0], dist_bits);
-            }
-            else
-            {
-                match_dist = 1;
-            }
-
-            // copy match bytes
-            if (match_dist > rc.out_ptr)
-            {
-                throw DownloadError(
-                        "内部错误 - PKG文件不完整或已损坏! "
-                        "请重新下载");
-            }
-
-            if (rc.out_ptr + match_len + 1 > rc.out_len)
-            {
-                throw DownloadError(
-                        "内部错误 - PKG文件不完整或已损坏! 请重新"
-                        "下载");
-            }
-
-            const uint8_t* match_src = rc.output + rc.out_ptr - match_dist;
-            for (uint32_t i = 0; i <= match_len; i++)
-            {
-                rc.output[rc.out_ptr++] = *match_src++;
-            }
-            last_byte = match_src[-1];
-
-            rc_state = 6 + ((rc.out_ptr + 1) & 1);
-        }
+        update_progress_cb(download_offset, download_size);
+        info_update = info_now + 100;
     }
 }
 
@@ -378,57 +236,221 @@ static void init_psp_decrypt(
     }
 }
 
-void Download::download_data(
-        uint8_t* buffer, uint32_t size, int encrypted, int save)
+void Download::start_http(uint64_t offset)
 {
-    if (is_canceled())
-        throw std::runtime_error("下载已被取消");
+    LOGF_DEBUG("requesting {} @ {}", download_url, offset);
+    _http->start(download_url, offset);
 
-    if (size == 0)
-        return;
+    const int64_t http_length = _http->get_length();
+    if (http_length < 0)
+    {
+        throw DownloadError("HTTP响应长度未知");
+    }
 
-    update_progress();
+    // a server that ignores the range or a file replaced in the meantime
+    // would silently corrupt the package
+    if (http_started && http_length != 0 &&
+        http_length + offset != download_size)
+        throw formatEx<DownloadError>(
+                "服务器上的文件已改变 ({} != {})",
+                http_length + offset,
+                download_size);
+
+    if (!http_started || http_length != 0)
+        download_size = http_length + offset;
+    http_started = true;
+
+    LOGF_DEBUG("http response length = {}, total pkg size = {}",
+               http_length,
+               download_size);
+    info_start = pkgi_time_msec();
+    info_update = pkgi_time_msec() + 500;
+}
 
-    if (!*_http)
+void pkgi_wait_reconnect(
+        uint32_t attempt, const std::function<bool()>& is_canceled)
+{
+    const uint32_t delay = std::min(
+            RECONNECT_BASE_DELAY << (attempt - 1), RECONNECT_MAX_DELAY);
+    const uint32_t until = pkgi_time_msec() + delay;
+    while (pkgi_time_msec() < until)
     {
-        LOGF("requesting {} @ {}", download_url, download_offset);
-        _http->start(download_url, download_offset);
+        if (is_canceled())
+            throw std::runtime_error("下载已被取消");
+        pkgi_sleep(100);
+    }
+}
 
-        const int64_t http_length = _http->get_length();
-        if (http_length < 0)
+// lends at most size bytes at http_offset, the connection is reopened there
+// when it fails. The slice goes back to _http with give_back()
+HttpSlice Download::borrow_http(uint32_t size)
+{
+    uint32_t attempt = 0;
+    while (true)
+    {
+        try
         {
-            throw DownloadError("HTTP响应长度未知");
+            if (!*_http)
+                start_http(http_offset);
+
+            StageTimer timer(stats, Stage::Http);
+            const auto slice = _http->borrow(size);
+            timer.set_bytes(slice.size);
+            if (slice.size == 0)
+                throw HttpError("HTTP连接意外断开");
+            http_offset += slice.size;
+            return slice;
         }
+        catch (const HttpError& e)
+        {
+            // a connection lost to a sleep of the system isn't the server's
+            // fault, the attempts start over once it woke up
+            if (suspend_gate)
+            {
+                if (suspend_gate->raised())
+                    suspend_gate->park(is_canceled);
+                if (suspend_gate->resumes() != resumes_seen)
+                {
+                    resumes_seen = suspend_gate->resumes();
+                    attempt = 0;
+                }
+            }
+
+            // abort() cut the read short for a pause, which waits here, in
+            // the middle of whatever was being read
+            if (http_factory && http_started && is_paused && is_paused())
+            {
+                LOGF("download paused at {}", http_offset);
+                if (state_saveable)
+                    save_state();
+                reopen_http();
+                wait_unpaused();
+                attempt = 0;
+                continue;
+            }
 
-        download_size = http_length + download_offset;
+            // errors on the very first request (bad url, 404...) are not
+            // going to go away by retrying
+            if (!http_factory || !http_started || is_canceled() ||
+                ++attempt > RECONNECT_ATTEMPTS)
+                throw;
+
+            LOGF("http failed at {}, reconnecting ({}/{}): {}",
+                 http_offset,
+                 attempt,
+                 RECONNECT_ATTEMPTS,
+                 e.what());
+            reopen_http();
+            ++reconnects;
+            pkgi_wait_reconnect(attempt, is_canceled);
+        }
+    }
+}
 
-        LOGF("http response length = {}, total pkg size = {}",
-             http_length,
-             download_size);
-        info_start = pkgi_time_msec();
-        info_update = pkgi_time_msec() + 500;
+// the next read starts a new request at http_offset
+void Download::reopen_http()
+{
+    std::unique_ptr<Http> http =
+            std::make_unique<ReadAheadHttp>(http_factory());
+    // the old one is destroyed out of the lock, which waits for its reader
+    ScopeLock _(_http_mutex);
+    _http.swap(http);
+}
+
+void Download::abort()
+{
+    ScopeLock _(_http_mutex);
+    _http->abort();
+}
+
+// reads size bytes at http_offset
+void Download::read_http(uint8_t* buffer, uint32_t size)
+{
+    for (uint32_t pos = 0; pos < size;)
+    {
+        const auto slice = borrow_http(size - pos);
+        memcpy(buffer + pos, slice.data, slice.size);
+        _http->give_back(slice);
+        pos += slice.size;
     }
+}
 
+// brings the stream to download_offset after skips, the consecutive ones are
+// taken as one so that a run of small intact files costs a single request
+void Download::seek_http()
+{
+    if (!*_http)
     {
-        size_t pos = 0;
-        while (pos < size)
+        http_offset = download_offset;
+        return;
+    }
+
+    const auto gap = download_offset - http_offset;
+    if (download_offset > http_offset && gap < SEEK_THRESHOLD)
+    {
+        // cheaper than a new request
+        while (http_offset != download_offset)
         {
-            const int read = _http->read(buffer + pos, size - pos);
-            if (read == 0)
-                throw DownloadError("HTTP连接意外断开");
-            pos += read;
+            const auto left = download_offset - http_offset;
+            _http->give_back(borrow_http(
+                    (uint32_t)min64(ReadAheadHttp::MAX_CHUNK_SIZE, left)));
         }
+        return;
     }
 
-    download_offset += size;
+    LOGF_DEBUG("seeking from {} to {}", http_offset, download_offset);
+    // restarted lazily at http_offset by read_http
+    reopen_http();
+    http_offset = download_offset;
+}
+
+void Download::download_data(
+        uint8_t* buffer, uint32_t size, int encrypted, int save)
+{
+    TRACE_SCOPE("download_data");
+    if (is_canceled())
+        throw std::runtime_error("下载已被取消");
+
+    if (size == 0)
+        return;
 
-    sha256_update(&sha, buffer, size);
+    update_progress();
+
+    if (http_offset != download_offset)
+        seek_http();
+    read_http(buffer, size);
+
+    consume_data(buffer, size, encrypted, save);
+}
 
-    if (encrypted)
+void Download::download_stream(uint64_t size, int encrypted, int save)
+{
+    TRACE_SCOPE("download_stream");
+    while (size != 0)
     {
-        aes128_ctr(&aes, iv, encrypted_base + encrypted_offset, buffer, size);
-        encrypted_offset += size;
+        if (is_canceled())
+            throw std::runtime_error("下载已被取消");
+
+        update_progress();
+
+        if (http_offset != download_offset)
+            seek_http();
+        // decrypted and hashed right in the buffer of the read ahead
+        const auto slice = borrow_http(
+                (uint32_t)min64(ReadAheadHttp::MAX_CHUNK_SIZE, size));
+        consume_data(slice.data, slice.size, encrypted, save);
+        _http->give_back(slice);
+        size -= slice.size;
     }
+}
+
+void Download::consume_data(
+        uint8_t* buffer, uint32_t size, int encrypted, int save)
+{
+    keep_data(buffer, size);
+    download_offset += size;
+
+    hash_data(buffer, size, encrypted);
 
     if (save)
     {
@@ -443,54 +465,386 @@ void Download::download_data(
             write = size;
         }
 
-        if (!pkgi_write(item_file, buffer, write))
-            throw formatEx<DownloadError>("写入至 {} 失败", item_path);
+        write_file(buffer, write);
+    }
+}
+
+void Download::begin_keep()
+{
+    const auto part = keep_path + ".part";
+    try
+    {
+        pkgi_mkdirs(part.substr(0, part.rfind('/')).c_str());
+        keep_file = pkgi_create(part);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("can't keep the pkg at {}: {}", part, e.what());
+    }
+    if (!keep_file)
+        return;
+
+    LOGF("keeping the pkg at {}", keep_path);
+    keep_writer = std::make_unique<AsyncWriter>();
+    keep_writer->set_buffer_size(KEEP_BUFFER_SIZE);
+    keep_writer->begin(keep_file);
+    keep_offset = 0;
+}
+
+void Download::keep_data(const uint8_t* buffer, uint32_t size)
+{
+    if (!keep_file)
+        return;
+    if (download_offset != keep_offset)
+    {
+        LOG("bytes of the pkg were skipped, not keeping it");
+        end_keep(false);
+        return;
+    }
+    try
+    {
+        keep_writer->write(buffer, size);
+        keep_offset += size;
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to keep the pkg: {}", e.what());
+        end_keep(false);
+    }
+}
+
+void Download::end_keep(bool complete)
+{
+    if (!keep_file)
+        return;
+
+    const auto part = keep_path + ".part";
+    try
+    {
+        if (complete)
+        {
+            keep_writer->flush();
+            kept = keep_offset == total_size;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to keep the pkg: {}", e.what());
+    }
+    keep_writer->wait();
+    pkgi_close(keep_file);
+    keep_file = nullptr;
+    keep_writer.reset();
+
+    try
+    {
+        if (kept)
+            pkgi_rename(part, keep_path);
+        else
+            pkgi_rm(part.c_str());
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to keep the pkg: {}", e.what());
+        kept = false;
+    }
+}
+
+void Download::hash_data(uint8_t* buffer, uint32_t size, int encrypted)
+{
+    const uint32_t chunk_size = chunk_hashes ? chunk_hashes->chunk_size
+                                             : built_chunk_hashes.chunk_size;
+    // pkg offset of buffer, download_offset is already past it
+    uint64_t offset = download_offset - size;
+    while (size != 0)
+    {
+        const auto part =
+                (uint32_t)min64(size, chunk_size - offset % chunk_size);
+        if (encrypted)
+        {
+            StageTimer timer(stats, Stage::AesCtr, part);
+            aes128_ctr_sha256(
+                    &aes,
+                    iv,
+                    encrypted_base + encrypted_offset,
+                    &sha,
+                    buffer,
+                    part);
+            encrypted_offset += part;
+        }
+        else
+        {
+            StageTimer timer(stats, Stage::Sha256, part);
+            sha256_update(&sha, buffer, part);
+        }
+        buffer += part;
+        size -= part;
+        offset += part;
+
+        if (offset % chunk_size == 0)
+            chunk_done(offset);
     }
 }
 
+void Download::chunk_done(uint64_t end)
+{
+    // bytes were skipped without chunk hashes, the state isn't the one of
+    // the package
+    if (sha.count != end)
+        return;
+
+    if (chunk_hashes)
+    {
+        const auto index = end / chunk_hashes->chunk_size - 1;
+        if (index < chunk_hashes->states.size() &&
+            !std::equal(
+                    chunk_hashes->states[index].begin(),
+                    chunk_hashes->states[index].end(),
+                    sha.state))
+        {
+            LOGF("chunk {} of the pkg is wrong, removing head.bin & resume "
+                 "data",
+                 index);
+
+            pkgi_rm(fmt::format("{}/sce_sys/package/head.bin", root).c_str());
+
+            throw formatEx<DownloadError>(
+                    "PKG文件第 {} 块已损坏, 请尝试重新下载", index);
+        }
+        return;
+    }
+
+    // a resumed download misses the states before it stopped
+    if (end / built_chunk_hashes.chunk_size ==
+        built_chunk_hashes.states.size() + 1)
+    {
+        auto& state = built_chunk_hashes.states.emplace_back();
+        std::copy(sha.state, sha.state + state.size(), state.begin());
+    }
+}
+
+void Download::restore_chunk_state(uint64_t offset)
+{
+    const auto& state =
+            chunk_hashes->states[offset / chunk_hashes->chunk_size - 1];
+    std::copy(state.begin(), state.end(), sha.state);
+    sha.count = offset;
+}
+
+void Download::check_chunk_hashes()
+{
+    if (!chunk_hashes)
+        return;
+    if (chunk_hashes->size != total_size)
+    {
+        LOGF("ignoring chunk hashes made for {} bytes, the pkg has {}",
+             chunk_hashes->size,
+             total_size);
+        chunk_hashes.reset();
+        return;
+    }
+    LOGF("checking the pkg in {} chunks of {} bytes",
+         chunk_hashes->states.size(),
+         chunk_hashes->chunk_size);
+}
+
 void Download::skip_to_file_offset(uint64_t to_offset)
 {
     if (to_offset < encrypted_offset)
         throw DownloadError(
                 fmt::format("无法向后寻找至 {}", to_offset));
 
-    std::vector<uint8_t> down(64 * 1024);
-    while (encrypted_offset != to_offset)
+    // the skipped bytes are only needed for the package digest, so without
+    // one there is no point in downloading them at all, the next
+    // download_data decides how to get past them
+    if (can_seek && !chunk_hashes)
     {
-        const uint32_t read =
-                (uint32_t)min64(down.size(), to_offset - encrypted_offset);
-        download_data(down.data(), read, 1, 0);
+        download_offset += to_offset - encrypted_offset;
+        encrypted_offset = to_offset;
+        return;
+    }
 
-        if ((encrypted_base + encrypted_offset - last_state_save) /
-                    SAVE_PERIOD >=
-            1)
-            serialize_state();
+    const auto stream_to = [&](uint64_t offset) {
+        while (encrypted_offset != offset)
+        {
+            const uint32_t read = (uint32_t)min64(
+                    ReadAheadHttp::MAX_CHUNK_SIZE, offset - encrypted_offset);
+            // only hashed, CTR mode doesn't need the skipped blocks decrypted
+            download_stream(read, 0, 0);
+            encrypted_offset += read;
+
+            if ((encrypted_base + encrypted_offset - last_state_save) /
+                        SAVE_PERIOD >=
+                1)
+                save_state();
+            check_suspend();
+            check_pause();
+        }
+    };
+
+    // with chunk hashes only the whole chunks can go, the hash of the
+    // package goes on from the state of the last one skipped
+    if (can_seek)
+    {
+        const uint64_t chunk_size = chunk_hashes->chunk_size;
+        const auto to = encrypted_base + to_offset;
+        const auto first =
+                (download_offset + chunk_size - 1) / chunk_size * chunk_size;
+        const auto last = to / chunk_size * chunk_size;
+        if (last > first)
+        {
+            stream_to(first - encrypted_base);
+            download_offset = last;
+            encrypted_offset = last - encrypted_base;
+            restore_chunk_state(last);
+        }
     }
+
+    stream_to(to_offset);
+}
+
+// the state is saved before the system sleeps, the connection dies with the
+// suspend anyway and is reopened at http_offset once it's over, so that the
+// sleep costs neither progress nor a reconnect attempt
+void Download::check_suspend()
+{
+    if (!suspend_gate || !suspend_gate->raised())
+        return;
+
+    LOGF("parking the download at {} for the suspend", download_offset);
+    save_state();
+    suspend_gate->park(is_canceled);
+    resumes_seen = suspend_gate->resumes();
+    if (http_factory)
+        reopen_http();
+    LOGF("resuming the download at {}", download_offset);
+}
+
+// a paused download keeps its state in memory and only gives its connection
+// up, for the other downloads. The state is saved anyway in case the app is
+// closed meanwhile
+void Download::check_pause(bool save)
+{
+    if (!is_paused || !is_paused())
+        return;
+
+    LOGF("download paused at {}", download_offset);
+    if (save)
+        save_state();
+    if (http_factory)
+        reopen_http();
+    wait_unpaused();
+}
+
+void Download::wait_unpaused()
+{
+    update_status("Paused");
+    while (is_paused())
+    {
+        if (is_canceled())
+            throw std::runtime_error("已取消下载");
+        pkgi_sleep(100);
+    }
+    update_status("Downloading");
+    LOGF("download unpaused at {}", download_offset);
+}
+
+// pkgi_mkdirs that remembers what it made, a package has an entry for each
+// of its folders and often thousands of files in a few of them
+void Download::make_folder(const std::string& folder)
+{
+    if (made_folders.count(folder))
+        return;
+
+    const auto slash = folder.rfind('/');
+    if (slash != std::string::npos)
+        make_folder(folder.substr(0, slash));
+    pkgi_mkdir(folder.c_str());
+    made_folders.insert(folder);
 }
 
 // this includes creating of all the parent folders necessary to actually
 // create file
 void Download::create_file()
 {
-    std::string folder = item_path;
-    folder.erase(folder.rfind('/'));
+    make_folder(item_path.substr(0, item_path.rfind('/')));
 
-    pkgi_mkdirs(folder.c_str());
-
-    LOGF("creating {} file", item_name);
+    LOGF_DEBUG("creating {} file", item_name);
     item_file = pkgi_create(item_path.c_str());
     if (!item_file)
         throw formatEx<DownloadError>("无法创建 {} 文件", item_name);
+    writer.begin(item_file);
+    item_written = 0;
+    item_crc = crc32(0, nullptr, 0);
 }
 
 void Download::open_file()
 {
-    LOGF("opening {} file for resume", item_name);
+    LOGF_DEBUG("opening {} file for resume", item_name);
     item_file = pkgi_openrw(item_path.c_str());
     if (!item_file)
         throw formatEx<DownloadError>("无法创建 {} 文件", item_name);
 }
 
+void Download::write_file(const void* data, uint32_t size)
+{
+    item_crc = crc32(item_crc, static_cast<const Bytef*>(data), size);
+    item_written += size;
+    if (discard_writes)
+        return;
+    try
+    {
+        writer.write(data, size);
+    }
+    catch (const std::exception& e)
+    {
+        throw formatEx<DownloadError>(
+                "写入至 {} 失败:\n{}", item_path, e.what());
+    }
+}
+
+void Download::flush_file()
+{
+    try
+    {
+        writer.flush();
+    }
+    catch (const std::exception& e)
+    {
+        throw formatEx<DownloadError>(
+                "写入至 {} 失败:\n{}", item_path, e.what());
+    }
+}
+
+// doesn't throw so that it can be used in scope exits, call flush_file()
+// first to get write errors
+void Download::close_file()
+{
+    // the small files left to the writer get closed too
+    writer.wait();
+    if (item_file)
+    {
+        pkgi_close(item_file);
+        item_file = NULL;
+    }
+}
+
+// a write error shows at the next flush_file(), which every checkpoint does
+// before the journal moves past the file
+void Download::end_small_file()
+{
+    try
+    {
+        writer.end_file();
+    }
+    catch (const std::exception& e)
+    {
+        throw formatEx<DownloadError>(
+                "写入至 {} 失败:\n{}", item_path, e.what());
+    }
+    item_file = NULL;
+}
+
 int Download::download_head(const uint8_t* rif)
 {
     LOG("downloading pkg head");
@@ -500,30 +854,16 @@ int Download::download_head(const uint8_t* rif)
 
     BOOST_SCOPE_EXIT_ALL(&)
     {
-        if (item_file)
-        {
-            pkgi_close(item_file);
-            item_file = NULL;
-        }
+        close_file();
     };
 
     create_file();
 
-    head.resize(PKG_HEADER_SIZE + PKG_HEADER_EXT_SIZE);
+    std::vector<uint8_t> head(PKG_HEADER_SIZE + PKG_HEADER_EXT_SIZE);
+    MemoryCharge memory(MemPool::Download);
     download_data(head.data(), head.size(), 0, 1);
 
-    if (get32be(head.data()) != 0x7f504b47 ||
-        get32be(head.data() + PKG_HEADER_SIZE) != 0x7F657874)
-    {
-        throw DownloadError("错误的PKG文件头");
-    }
-
-    // contentid is at 0x50 for psm games
-    if (rif && !(pkgi_memequ(rif + 0x10, head.data() + 0x30, 0x30) ||
-                 pkgi_memequ(rif + 0x50, head.data() + 0x30, 0x30)))
-    {
-        throw DownloadError("zRIF所包含的数据与PKG文件不匹配");
-    }
+    check_head(head.data(), rif);
 
     const auto meta_offset = get32be(head.data() + 8);
     const auto meta_count = get32be(head.data() + 12);
@@ -541,88 +881,30 @@ int Download::download_head(const uint8_t* rif)
          enc_size);
 
     pkgi_memcpy(iv, head.data() + 0x70, sizeof(iv));
+    init_package_key(head.data(), iv, &aes);
 
-    uint8_t key[AES_BLOCK_SIZE];
-    int key_type = head[0xe7] & 7;
-    if (key_type == 1)
-    {
-        pkgi_memcpy(key, pkg_psp_key, sizeof(key));
-    }
-    else if (key_type == 2)
-    {
-        aes128_ctx ctx;
-        aes128_init(&ctx, pkg_vita_2);
-        aes128_encrypt(&ctx, iv, key);
-    }
-    else if (key_type == 3)
-    {
-        aes128_ctx ctx;
-        aes128_init(&ctx, pkg_vita_3);
-        aes128_encrypt(&ctx, iv, key);
-    }
-    else if (key_type == 4)
-    {
-        aes128_ctx ctx;
-        aes128_init(&ctx, pkg_vita_4);
-        aes128_encrypt(&ctx, iv, key);
-    }
-    else
-        throw DownloadError("无效的密钥类型" + std::to_string(key_type));
-
-    aes128_ctr_init(&aes, key);
-
-    head.resize(enc_offset);
-    download_data(
-            head.data() + PKG_HEADER_SIZE + PKG_HEADER_EXT_SIZE,
-            enc_offset - (PKG_HEADER_SIZE + PKG_HEADER_EXT_SIZE),
-            0,
-            1);
-
-    uint32_t index_size = 0;
-
-    uint32_t offset = meta_offset;
-    for (uint32_t i = 0; i < meta_count; i++)
-    {
-        if (offset + 16 >= enc_offset)
-        {
-            throw DownloadError("PKG文件不完整或已损坏");
-        }
-
-        uint32_t type = get32be(head.data() + offset + 0);
-        uint32_t size = get32be(head.data() + offset + 4);
-
-        if (type == 2)
-        {
-            content_type = get32be(head.data() + offset + 8);
-            if (content_type != CONTENT_TYPE_PSX_GAME &&
-                content_type != CONTENT_TYPE_PSP_GAME &&
-                content_type != CONTENT_TYPE_PSP_MINI_GAME &&
-                content_type != CONTENT_TYPE_PSP_GAME_ALT &&
-                content_type != CONTENT_TYPE_PSM_GAME &&
-                content_type != CONTENT_TYPE_PSM_GAME_ALT &&
-                content_type != CONTENT_TYPE_PSV_GAME &&
-                content_type != CONTENT_TYPE_PSV_DLC)
-            {
-                throw DownloadError(
-                        "不支持的PKG类型: " +
-                        std::to_string(content_type));
-            }
-        }
-        else if (type == 13)
-        {
-            // index_offset = get32be(head.data() + offset + 8);
-            index_size = get32be(head.data() + offset + 12);
-        }
-        offset += 8 + size;
-    }
-
-    head.resize(head.size() + index_count * 32);
-    download_data(head.data() + enc_offset, index_count * 32, 0, 1);
+    head.resize(enc_offset);
+    memory.set(head.capacity());
+    download_data(
+            head.data() + PKG_HEADER_SIZE + PKG_HEADER_EXT_SIZE,
+            enc_offset - (PKG_HEADER_SIZE + PKG_HEADER_EXT_SIZE),
+            0,
+            1);
+
+    const auto meta =
+            parse_meta(head.data(), enc_offset, meta_offset, meta_count);
+    content_type = meta.content_type;
+    const auto index_size = meta.index_size;
+
+    if (index_count == 0)
+        throw DownloadError("PKG文件不完整或已损坏");
 
+    // the item table and the names are only written to head.bin,
+    // download_files() reads them back from there
     uint64_t item_offset;
     {
         uint8_t item[32];
-        pkgi_memcpy(item, head.data() + enc_offset, sizeof(item));
+        download_data(item, sizeof(item), 0, 1);
         aes128_ctr(&aes, iv, 0, item, sizeof(item));
 
         item_offset = get64be(item + 8);
@@ -636,31 +918,234 @@ int Download::download_head(const uint8_t* rif)
                 ", 实际: " + std::to_string(item_offset));
     }
 
-    const auto target_size = (uint32_t)(enc_offset + item_offset);
-    head.resize(target_size);
-    download_data(
-            head.data() + enc_offset + index_count * 32,
-            target_size - (enc_offset + index_count * 32),
-            0,
-            1);
+    if (item_offset < index_count * 32)
+        throw DownloadError("PKG文件不完整或已损坏");
+
+    const auto target_size = enc_offset + item_offset;
+    head.resize(HEAD_WINDOW_SIZE);
+    while (download_offset < target_size)
+    {
+        const auto size =
+                (uint32_t)min64(head.size(), target_size - download_offset);
+        download_data(head.data(), size, 0, 1);
+    }
+    flush_file();
 
     LOG("head.bin downloaded");
     return 1;
 }
 
+namespace
+{
+// see pkgi_inspect_package and pkgi_peek_package
+PackageInfo inspect_package(
+        const std::function<std::unique_ptr<Http>()>& make_http,
+        const std::string& url,
+        const uint8_t* rif,
+        bool peek)
+{
+    const auto fetch = [&](uint64_t offset, uint64_t size) {
+        std::vector<uint8_t> data(size);
+        auto http = make_http();
+        http->start_range(url, offset, offset + size);
+        const auto status = http->get_status();
+        if (status != 206 && !(status == 200 && offset == 0))
+            throw formatEx<HttpError>("HTTP状态: {}", status);
+        // a 200 goes on past size, the rest is left unread
+        uint64_t received = 0;
+        while (received < size)
+        {
+            const auto read =
+                    http->read(data.data() + received, size - received);
+            if (read <= 0)
+                throw HttpError("HTTP连接意外断开");
+            received += read;
+        }
+        return data;
+    };
+
+    auto head = fetch(0, PKG_HEADER_SIZE + PKG_HEADER_EXT_SIZE);
+    check_head(head.data(), rif);
+
+    const auto meta_offset = get32be(head.data() + 8);
+    const auto meta_count = get32be(head.data() + 12);
+    const auto index_count = get32be(head.data() + 20);
+    const auto total_size = get64be(head.data() + 24);
+    const auto enc_offset = get64be(head.data() + 32);
+    if (enc_offset < head.size() || enc_offset > MAX_INSPECTED_HEAD ||
+        index_count == 0 ||
+        uint64_t(index_count) * 32 > MAX_INSPECTED_ITEMS)
+        throw DownloadError("PKG文件不完整或已损坏");
+
+    if (enc_offset > head.size())
+    {
+        const auto rest = fetch(head.size(), enc_offset - head.size());
+        head.insert(head.end(), rest.begin(), rest.end());
+    }
+    const auto meta =
+            parse_meta(head.data(), enc_offset, meta_offset, meta_count);
+
+    PackageInfo info;
+    info.content_type = meta.content_type;
+    info.total_size = total_size;
+    if (is_partially_extracted(meta.content_type))
+        return info;
+
+    uint8_t iv[AES_BLOCK_SIZE];
+    pkgi_memcpy(iv, head.data() + 0x70, sizeof(iv));
+    aes128_ctx aes;
+    init_package_key(head.data(), iv, &aes);
+
+    PackageManifest package;
+    auto items = fetch(enc_offset, uint64_t(index_count) * 32);
+    package.decode_items(&aes, iv, items.data(), index_count);
+    info.footprint = package.footprint();
+    if (!peek)
+        return info;
+
+    // the names are together after the item table, they are fetched at once
+    const auto names_begin = package.names_begin();
+    const auto names_end = package.names_end();
+    if (names_end - names_begin > MAX_PEEKED_NAMES ||
+        enc_offset + names_end > total_size)
+        throw DownloadError("PKG文件不完整或已损坏");
+    auto names = fetch(enc_offset + names_begin, names_end - names_begin);
+    package.decode_names(&aes, iv, names.data(), meta.content_type, false);
+
+    const PackageItem* sfo_item = nullptr;
+    for (const auto& item : package.items)
+    {
+        if (item.action != PackageAction::File)
+            continue;
+        const std::string name = package.name(item);
+        if (name == "sce_sys/param.sfo")
+            sfo_item = &item;
+        info.files.push_back(name);
+    }
+
+    if (!sfo_item)
+        return info;
+    const auto sfo_offset = sfo_item->offset;
+    const auto sfo_size = sfo_item->size;
+    const auto sfo_encrypted_size = sfo_item->encrypted_size();
+    if (sfo_size > MAX_PEEKED_SFO ||
+        enc_offset + sfo_offset + sfo_encrypted_size > total_size)
+        throw DownloadError("PKG文件不完整或已损坏");
+    auto sfo = fetch(enc_offset + sfo_offset, sfo_encrypted_size);
+    aes128_ctr(&aes, iv, sfo_offset, sfo.data(), sfo.size());
+
+    try
+    {
+        info.app_version = pkgi_sfo_get_string(sfo.data(), sfo_size, "APP_VER");
+        const auto system_version =
+                pkgi_sfo_get_int(sfo.data(), sfo_size, "PSP2_SYSTEM_VER");
+        if (system_version)
+            info.system_version = fmt::format(
+                    "{:x}.{:02x}",
+                    system_version >> 24,
+                    (system_version >> 16) & 0xff);
+    }
+    catch (const std::runtime_error& e)
+    {
+        throw DownloadError(e.what());
+    }
+    return info;
+}
+}
+
+PackageInfo pkgi_inspect_package(
+        const std::function<std::unique_ptr<Http>()>& make_http,
+        const std::string& url,
+        const uint8_t* rif)
+{
+    return inspect_package(make_http, url, rif, false);
+}
+
+PackageInfo pkgi_peek_package(
+        const std::function<std::unique_ptr<Http>()>& make_http,
+        const std::string& url)
+{
+    return inspect_package(make_http, url, nullptr, true);
+}
+
+// the item table and the names are read back from head.bin at once and
+// decoded, the raw bytes aren't kept
+void Download::load_package()
+{
+    const auto path = fmt::format("{}/sce_sys/package/head.bin", root);
+    const auto head_size = pkgi_get_size(path.c_str());
+    const auto f = head_size < 0 ? nullptr : pkgi_open(path.c_str());
+    if (!f)
+        throw formatEx<DownloadError>("无法打开 {}", path);
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        pkgi_close(f);
+    };
+
+    MemoryCharge memory(MemPool::Download);
+    const auto read = [&](uint64_t offset, uint64_t size) {
+        if (offset + size > static_cast<uint64_t>(head_size))
+            throw DownloadError("head.bin文件不完整或已损坏");
+        std::vector<uint8_t> data(size);
+        memory.set(data.capacity());
+        pkgi_seek(f, offset);
+        uint32_t pos = 0;
+        while (pos < size)
+        {
+            const auto read = pkgi_read(f, data.data() + pos, size - pos);
+            if (read <= 0)
+                throw DownloadError("head.bin文件不完整或已损坏");
+            pos += read;
+        }
+        return data;
+    };
+
+    {
+        auto items = read(enc_offset, uint64_t(index_count) * 32);
+        package.decode_items(&aes, iv, items.data(), index_count);
+    }
+
+    const auto names_begin = package.names_begin();
+    const auto names_end = package.names_end();
+    if (enc_offset + names_end > total_size)
+        throw DownloadError("PKG文件不完整或已损坏");
+    auto names = read(enc_offset + names_begin, names_end - names_begin);
+    package.decode_names(&aes, iv, names.data(), content_type, save_as_iso);
+    package_memory.set(package.memory_size());
+}
+
+void Download::free_package()
+{
+    package = PackageManifest{};
+    package_memory.set(0);
+}
+
 void Download::download_file_content(uint64_t encrypted_size)
 {
-    std::vector<uint8_t> down(64 * 1024);
+    // the output is exactly item_size bytes, allocate it in one go instead of
+    // growing the file at every write
+    if (encrypted_offset == 0)
+        pkgi_preallocate(item_file, decrypted_size);
+
+    state_saveable = true;
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        state_saveable = false;
+    };
+
     while (encrypted_offset != encrypted_size)
     {
-        const uint32_t read =
-                (uint32_t)min64(down.size(), encrypted_size - encrypted_offset);
-        download_data(down.data(), read, 1, 1);
+        const uint32_t read = (uint32_t)min64(
+                ReadAheadHttp::MAX_CHUNK_SIZE,
+                encrypted_size - encrypted_offset);
+        download_stream(read, 1, 1);
 
         if ((encrypted_base + encrypted_offset - last_state_save) /
                     SAVE_PERIOD >=
             1)
-            serialize_state();
+            save_state();
+        check_suspend();
+        check_pause();
     }
 }
 
@@ -717,21 +1202,72 @@ void Download::download_file_content_to_iso(uint64_t item_size)
     uint64_t const table_offset = psar_offset + iso_table;
     skip_to_file_offset(table_offset);
 
-    std::vector<std::array<uint8_t, 32>> tables(block_count);
-    for (auto& table : tables)
-        download_data(table.data(), table.size(), 1, 0);
+    // the table comes before the blocks in the stream so it has to be read
+    // first, but only the decoded fields are kept, not the 32-byte entries
+    struct IsoBlock
+    {
+        uint32_t offset;
+        uint32_t size;
+        uint32_t flags;
+    };
+    std::vector<IsoBlock> blocks(block_count);
+    MemoryCharge memory(MemPool::Download);
+    memory.set(block_count * sizeof(IsoBlock) + HEAD_WINDOW_SIZE);
+    {
+        std::vector<uint8_t> table(HEAD_WINDOW_SIZE);
+        for (uint32_t i = 0; i < block_count;)
+        {
+            const auto count = std::min<uint32_t>(
+                    table.size() / 32, block_count - i);
+            download_data(table.data(), count * 32, 1, 0);
+            for (uint32_t j = 0; j < count; ++j, ++i)
+            {
+                uint32_t t[8];
+                for (size_t k = 0; k < 8; k++)
+                    t[k] = get32le(table.data() + j * 32 + k * 4);
 
-    for (uint32_t i = 0; i < block_count; i++)
+                blocks[i].offset = t[4] ^ t[2] ^ t[3];
+                blocks[i].size = t[5] ^ t[1] ^ t[2];
+                blocks[i].flags = t[6] ^ t[0] ^ t[3];
+            }
+        }
+    }
+    memory.set(block_count * sizeof(IsoBlock));
+
+    // the header and the index of a compressed image are only known at the
+    // end, their room is kept at the start of the file
+    std::unique_ptr<IsoCompressor> compressor;
+    if (iso_format != IsoFormat::Iso)
     {
-        auto const& table = tables[i];
+        try
+        {
+            compressor = std::make_unique<IsoCompressor>(
+                    iso_format,
+                    uint64_t(block_count) * iso_block * ISO_SECTOR_SIZE);
+        }
+        catch (const std::exception& e)
+        {
+            throw DownloadError(e.what());
+        }
+        const std::vector<uint8_t> header(compressor->header_size());
+        write_file(header.data(), header.size());
+    }
 
-        uint32_t t[8];
-        for (size_t k = 0; k < 8; k++)
-            t[k] = get32le(table.data() + k * 4);
+    IsoBlockDecoder decoder(
+            &psp_key,
+            psp_iv,
+            iso_block * ISO_SECTOR_SIZE,
+            stats,
+            compressor.get());
+    const auto write = [this](const uint8_t* data, uint32_t size) {
+        write_file(data, size);
+    };
 
-        uint32_t block_offset = t[4] ^ t[2] ^ t[3];
-        uint32_t block_size = t[5] ^ t[1] ^ t[2];
-        uint32_t block_flags = t[6] ^ t[0] ^ t[3];
+    for (uint32_t i = 0; i < block_count; i++)
+    {
+        const uint32_t block_offset = blocks[i].offset;
+        const uint32_t block_size = blocks[i].size;
+        const uint32_t block_flags = blocks[i].flags;
 
         if (psar_offset + block_size > item_size)
             throw DownloadError(fmt::format(
@@ -739,45 +1275,35 @@ void Download::download_file_content_to_iso(uint64_t item_size)
                     psar_offset + block_size,
                     item_size));
 
-        std::vector<uint8_t> data(16 * ISO_SECTOR_SIZE);
+        if (block_size > IsoBlockDecoder::MAX_BLOCK_SIZE)
+            throw formatEx<DownloadError>("ISO数据块过大: {}", block_size);
 
+        // decrypting and decompressing happen on the decoder's threads while
+        // the next blocks are downloaded
+        const auto data = decoder.next_input(write);
         uint64_t abs_offset = psar_offset + block_offset;
         skip_to_file_offset(abs_offset);
-        download_data(data.data(), block_size, 1, 0);
-
-        if ((block_flags & 4) == 0)
-        {
-            aes128_psp_decrypt(
-                    &psp_key,
-                    psp_iv,
-                    block_offset / 16,
-                    data.data(),
-                    block_size);
-        }
+        download_data(data, block_size, 1, 0);
+        decoder.submit(block_size, block_offset, block_flags);
+        check_pause(false);
+    }
+    decoder.finish(write);
 
-        if (block_size == iso_block * ISO_SECTOR_SIZE)
+    if (compressor && !discard_writes)
+    {
+        flush_file();
+        const auto header = compressor->header();
+        if (pkgi_seek(item_file, 0) < 0)
+            throw formatEx<DownloadError>("无法写入 {} 的索引", item_path);
+        try
         {
-            if (!pkgi_write(item_file, data.data(), block_size))
-                throw DownloadError(
-                        fmt::format("无法写入至 %s", item_path));
+            writer.begin(item_file);
+            writer.write(header.data(), header.size());
         }
-        else
+        catch (const std::exception& e)
         {
-            std::vector<uint8_t> uncompressed(16 * ISO_SECTOR_SIZE);
-            auto const out_size = lzrc_decompress(
-                    uncompressed.data(),
-                    uncompressed.size(),
-                    data.data(),
-                    block_size);
-            if (out_size != int(iso_block) * ISO_SECTOR_SIZE)
-            {
-                throw DownloadError(
-                        "内部错误 - PKG文件可能已损坏! "
-                        "请重新下载");
-            }
-            if (!pkgi_write(item_file, uncompressed.data(), out_size))
-                throw DownloadError(
-                        fmt::format("无法写入至 %s", item_path));
+            throw formatEx<DownloadError>(
+                    "写入至 {} 失败:\n{}", item_path, e.what());
         }
     }
 
@@ -821,91 +1347,163 @@ void Download::download_file_content_to_edat(uint64_t item_size)
         throw DownloadError("不支持的EDAT文件, 数据/偏移量错误");
 
     init_psp_decrypt(&psp_key, psp_iv, 0, mac, key_header, 0x70, 0x30);
-    static constexpr uint32_t block_size = 0x10;
-    uint32_t block_count = ((data_size + (block_size - 1)) / block_size);
 
-    static constexpr auto flush_size = 64 * 1024;
-    std::vector<uint8_t> data;
-    data.reserve(flush_size);
+    // whole chunks go through download_data and the PGD layer at once,
+    // aes128_psp_decrypt handles any run of blocks from a given block index
+    static constexpr uint32_t chunk_size = 64 * 1024;
+    std::vector<uint8_t> data(chunk_size);
     skip_to_file_offset(key_header_offset + data_offset);
-    for (uint32_t i = 0; i < block_count; i++)
+    for (uint32_t offset = 0; offset < data_size; offset += chunk_size)
     {
-        uint8_t block[block_size];
-        uint32_t current_block_size =
-                std::min(block_size, data_size - (i * block_size));
-
-        download_data(block, current_block_size, 1, 0);
-        aes128_psp_decrypt(
-                &psp_key, psp_iv, i * block_size / 16, block, block_size);
+        const uint32_t size = std::min(chunk_size, data_size - offset);
+        // a partial last block is still decrypted as a full one, only the
+        // data part of it gets written
+        const uint32_t padded_size =
+                (size + AES_BLOCK_SIZE - 1) & ~(AES_BLOCK_SIZE - 1);
 
-        data.insert(data.end(), block, block + current_block_size);
-        if (data.size() >= flush_size)
+        download_data(data.data(), size, 1, 0);
         {
-            if (!pkgi_write(item_file, data.data(), data.size()))
-                throw DownloadError(
-                        fmt::format("failed to write to %s", item_path));
-            data.clear();
-            data.reserve(flush_size);
+            StageTimer timer(stats, Stage::PspDecrypt, size);
+            aes128_psp_decrypt(
+                    &psp_key, psp_iv, offset / 16, data.data(), padded_size);
         }
+        write_file(data.data(), size);
+        check_pause(false);
     }
 
-    if (!pkgi_write(item_file, data.data(), data.size()))
-        throw DownloadError(fmt::format("无法写入至 %s", item_path));
-
     skip_to_file_offset(item_size);
 }
 
+// fail early instead of filling the card and failing half way
+void Download::check_free_space()
+{
+    if (is_partially_extracted(content_type))
+        return;
+
+    const auto needed = package.footprint();
+    if (on_footprint)
+        on_footprint(needed);
+    const auto free_space = pkgi_get_free_space(partition.c_str());
+    const auto available =
+            free_space > reserved_space ? free_space - reserved_space : 0;
+    LOGF("package needs {} bytes, {} available on {}, {} reserved by the "
+         "other downloads",
+         needed,
+         available,
+         partition,
+         reserved_space);
+    if (needed > available)
+        throw formatEx<DownloadError>(
+                "{} 存储空间不足, 需要 {} MB, 可用 {} MB",
+                partition,
+                needed / (1024 * 1024) + 1,
+                available / (1024 * 1024));
+    // the copy kept for the peers only goes when there is room for both
+    if (keep_file && needed + total_size > available)
+    {
+        LOG("not enough room to keep the pkg");
+        end_keep(false);
+    }
+}
+
+std::string Download::files_root() const
+{
+    return content_root.empty() ? root : content_root;
+}
+
+void Download::load_manifest()
+{
+    auto loaded = pkgi_load_manifest(
+            pkgi_manifest_path(partition, download_content), download_url);
+    manifest_valid = loaded.has_value();
+    manifest = loaded ? std::move(*loaded) : Manifest{};
+}
+
+void Download::append_manifest()
+{
+    auto& entry = manifest[item_index];
+    entry = ManifestEntry{
+            package.path(package.items[item_index]), item_written, item_crc};
+    manifest_pending[item_index] = entry;
+}
+
+void Download::write_manifest()
+{
+    pkgi_append_manifest(
+            pkgi_manifest_path(partition, download_content), manifest_pending);
+    manifest_pending.clear();
+}
+
+// the crc of a resumed file goes on from what the previous run wrote of it,
+// when that can't be read back the file only gets a record that a repair
+// won't trust
+void Download::rehash_file(uint64_t item_size)
+{
+    item_written = std::min(encrypted_offset, item_size);
+    item_crc = crc32(0, nullptr, 0);
+    if (pkgi_seek(item_file, 0) < 0 ||
+        !pkgi_crc_file(item_file, item_written, item_crc, is_canceled))
+        LOGF("failed to read back {}", item_name);
+}
+
+// without a manifest made from this package, a file of the right size is
+// taken as intact, which leaves out the damage that doesn't change sizes
+bool Download::is_item_intact(uint64_t item_size)
+{
+    const auto size = pkgi_get_size(item_path.c_str());
+    if (size < 0)
+        return false;
+
+    if (!manifest_valid)
+        return static_cast<uint64_t>(size) == item_size;
+
+    const auto entry = manifest.find(item_index);
+    if (entry == manifest.end() ||
+        static_cast<uint64_t>(size) != entry->second.size)
+        return false;
+
+    const auto f = pkgi_open(item_path.c_str());
+    if (!f)
+        return false;
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        pkgi_close(f);
+    };
+
+    uint32_t crc = crc32(0, nullptr, 0);
+    return pkgi_crc_file(f, entry->second.size, crc, is_canceled) &&
+           crc == entry->second.crc;
+}
+
 int Download::download_files(void)
 {
     LOG("downloading encrypted files");
 
     BOOST_SCOPE_EXIT_ALL(&)
     {
-        if (item_file)
-        {
-            pkgi_close(item_file);
-            item_file = NULL;
-        }
+        close_file();
+        free_package();
     };
 
+    load_package();
+
+    // a repair mostly finds the files already there
+    if (!resuming && !repair)
+        check_free_space();
+
+    const auto folder = files_root();
     for (; item_index < index_count; ++item_index)
     {
         if (is_canceled())
             throw std::runtime_error("已取消下载");
 
-        uint8_t item[32];
-        pkgi_memcpy(
-                item,
-                head.data() + enc_offset + sizeof(item) * item_index,
-                sizeof(item));
-        aes128_ctr(&aes, iv, sizeof(item) * item_index, item, sizeof(item));
-
-        const uint32_t name_offset = get32be(item + 0);
-        const uint32_t name_size = get32be(item + 4);
-        const uint64_t item_offset = get64be(item + 8);
-        const uint64_t item_size = get64be(item + 16);
-        const uint8_t type = item[27];
-
-        if (enc_offset + name_offset + name_size > total_size)
-            throw DownloadError("PKG文件不完整或已损坏");
-
-        {
-            std::vector<uint8_t> item_name_v(
-                    head.begin() + enc_offset + name_offset,
-                    head.begin() + enc_offset + name_offset + name_size);
-            aes128_ctr(
-                    &aes,
-                    iv,
-                    name_offset,
-                    item_name_v.data(),
-                    item_name_v.size());
-            item_name = std::string(
-                    reinterpret_cast<const char*>(item_name_v.data()),
-                    item_name_v.size());
-        }
-
-        const uint64_t encrypted_size = (item_size + AES_BLOCK_SIZE - 1) &
-                                        ~((uint64_t)AES_BLOCK_SIZE - 1);
+        // item_name and item_path keep their storage from one item to the
+        // next
+        const auto& item = package.items[item_index];
+        const uint64_t item_offset = item.offset;
+        const uint64_t item_size = item.size;
+        const uint64_t encrypted_size = item.encrypted_size();
+        item_name.assign(package.name(item));
 
         if (!resuming)
         {
@@ -914,61 +1512,50 @@ int Download::download_files(void)
             encrypted_offset = 0;
         }
 
-        LOGF("[{}/{}] {} item_offset={} item_size={} type={}",
-             item_index + 1,
-             index_count,
-             item_name,
-             item_offset,
-             item_size,
-             type);
+        LOGF_DEBUG("[{}/{}] {} item_offset={} item_size={} type={}",
+                   item_index + 1,
+                   index_count,
+                   item_name,
+                   item_offset,
+                   item_size,
+                   item.type);
 
-        if (content_type == CONTENT_TYPE_PSX_GAME ||
-            content_type == CONTENT_TYPE_PSP_GAME ||
-            content_type == CONTENT_TYPE_PSP_GAME_ALT ||
-            content_type == CONTENT_TYPE_PSP_MINI_GAME)
-        {
-            const std::string prefix = "USRDIR/CONTENT";
-            if (item_name.substr(0, prefix.size()) == prefix)
-            {
-                const auto rest = item_name.substr(prefix.size());
-                if (rest.empty())
-                {
-                    skip_to_file_offset(encrypted_size);
-                    continue;
-                }
-                item_path = fmt::format("{}/{}", root, rest.substr(1));
-            }
-            else
-            {
-                skip_to_file_offset(encrypted_size);
-                continue;
-            }
-        }
-        else if (
-                content_type == CONTENT_TYPE_PSM_GAME ||
-                content_type == CONTENT_TYPE_PSM_GAME_ALT)
+        if (item.action == PackageAction::Skip)
         {
-            // skip "content/" prefix
-            item_path = fmt::format("{}/RO/{}", root, item_name.c_str() + 8);
+            skip_to_file_offset(encrypted_size);
+            continue;
         }
-        else
-            item_path = fmt::format("{}/{}", root, item_name);
 
-        if (type == 4)
+        item_path.assign(folder).append("/").append(package.path(item));
+
+        if (item.action == PackageAction::Folder)
         {
-            pkgi_mkdirs(item_path.c_str());
+            make_folder(item_path);
             continue;
         }
-        else if (type == 18)
+        else if (item.action == PackageAction::Ignore)
         {
             continue;
         }
 
+        if (repair && !resuming)
+        {
+            if (is_item_intact(item_size))
+            {
+                LOGF_DEBUG("{} is intact", item_name);
+                skip_to_file_offset(encrypted_size);
+                continue;
+            }
+            LOGF("{} is missing or damaged", item_name);
+        }
+
         if (resuming)
         {
             open_file();
+            rehash_file(item_size);
             if (pkgi_seek(item_file, encrypted_offset) < 0)
                 throw ResumeError("无法恢复下载");
+            writer.begin(item_file, encrypted_offset);
         }
         else
             create_file();
@@ -983,34 +1570,37 @@ int Download::download_files(void)
         if (enc_offset + item_offset + item_size > total_size)
             throw DownloadError("PKG文件不完整或已损坏");
 
-        if (content_type == CONTENT_TYPE_PSP_GAME ||
-            content_type == CONTENT_TYPE_PSP_GAME_ALT ||
-            content_type == CONTENT_TYPE_PSP_MINI_GAME)
+        switch (item.action)
         {
-            if (save_as_iso)
-            {
-                if (item_name == "USRDIR/CONTENT/EBOOT.PBP")
-                    download_file_content_to_iso(item_size);
-                else
-                    skip_to_file_offset(encrypted_size);
-            }
-            else if (item_name != "USRDIR/CONTENT/DOCUMENT.DAT" &&
-                    item_name != "USRDIR/CONTENT/DOCINFO.EDAT" &&
-                    (ends_with(item_name, ".EDAT") ||
-                     ends_with(item_name, ".edat")))
-                download_file_content_to_edat(item_size);
-            else
-                download_file_content(encrypted_size);
-        }
-        else
+        case PackageAction::Empty:
+            skip_to_file_offset(encrypted_size);
+            break;
+        case PackageAction::Iso:
+            download_file_content_to_iso(item_size);
+            break;
+        case PackageAction::Edat:
+            download_file_content_to_edat(item_size);
+            break;
+        default:
             download_file_content(encrypted_size);
+            break;
+        }
 
-        pkgi_close(item_file);
-        item_file = NULL;
+        if (item_size < SMALL_FILE_SIZE)
+            end_small_file();
+        else
+        {
+            flush_file();
+            close_file();
+        }
+        append_manifest();
 
         resuming = false;
     }
 
+    flush_file();
+    write_manifest();
+
     LOG("all files decrypted");
     return 1;
 }
@@ -1021,11 +1611,7 @@ int Download::download_tail(void)
 
     BOOST_SCOPE_EXIT_ALL(&)
     {
-        if (item_file)
-        {
-            pkgi_close(item_file);
-            item_file = NULL;
-        }
+        close_file();
     };
 
     item_name = "Finishing...";
@@ -1033,22 +1619,14 @@ int Download::download_tail(void)
 
     create_file();
 
-    std::vector<uint8_t> down(1 * 1024 * 1024);
     uint64_t tail_offset = enc_offset + enc_size;
-    while (download_offset < tail_offset)
-    {
-        const auto read =
-                (uint32_t)min64(down.size(), tail_offset - download_offset);
-        download_data(down.data(), read, 0, 0);
-    }
-
-    while (download_offset != total_size)
-    {
-        const auto read =
-                (uint32_t)min64(down.size(), total_size - download_offset);
-        download_data(
-                down.data(), read, 0, content_type != CONTENT_TYPE_PSX_GAME);
-    }
+    if (download_offset < tail_offset)
+        download_stream(tail_offset - download_offset, 0, 0);
+    download_stream(
+            total_size - download_offset,
+            0,
+            content_type != CONTENT_TYPE_PSX_GAME);
+    flush_file();
 
     LOG("tail.bin downloaded");
     return 1;
@@ -1079,6 +1657,20 @@ int Download::check_integrity(const uint8_t* digest)
     return 1;
 }
 
+void Download::save_chunk_hashes()
+{
+    if (!chunk_hashes)
+    {
+        if (built_chunk_hashes.states.size() !=
+            total_size / built_chunk_hashes.chunk_size)
+            return;
+        built_chunk_hashes.size = total_size;
+    }
+    pkgi_save_chunk_hashes(
+            pkgi_chunk_hashes_path(partition, download_content),
+            chunk_hashes ? *chunk_hashes : built_chunk_hashes);
+}
+
 int Download::create_stat()
 {
     LOG("creating stat.bin");
@@ -1129,7 +1721,7 @@ int Download::adjust_psm_files(void)
     update_status("Creating additional psm files");
     LOG("Removing sce_sys");
     const auto sce_sys = fmt::format("{}/sce_sys", root);
-    pkgi_delete_dir(sce_sys);
+    pkgi_trash_dir(sce_sys);
 
     const auto documents = fmt::format("{}/RW/Documents", root);
     pkgi_mkdirs(documents.c_str());
@@ -1163,9 +1755,26 @@ int Download::pkgi_download(
         const uint8_t* rif,
         const uint8_t* digest)
 {
+    this->partition = partition;
     root = fmt::format("{}pkgj/{}", partition, content);
     LOGF("temp installation folder: {}", root);
 
+    journal.open(root + ".resume");
+    writer.set_stats(stats);
+    if (suspend_gate)
+    {
+        suspend_gate->enter();
+        resumes_seen = suspend_gate->resumes();
+    }
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        if (suspend_gate)
+            suspend_gate->leave();
+        end_keep(false);
+        journal.close();
+        writer.set_stats(nullptr);
+    };
+
     try
     {
         update_status("Downloading");
@@ -1174,23 +1783,53 @@ int Download::pkgi_download(
         resuming = false;
         item_file = NULL;
         item_index = 0;
+        manifest_pending.clear();
+        made_folders.clear();
         last_state_save = 0;
         download_size = 0;
         download_offset = 0;
+        http_offset = 0;
         download_content = content;
         download_url = url;
 
         info_start = pkgi_time_msec();
         info_update = info_start + 1000;
 
-        deserialize_state();
+        // a repair checks every file anyway, what a journal left says of the
+        // last one written doesn't matter
+        if (!repair)
+            deserialize_state();
 
-        if (!resuming)
-            pkgi_delete_dir(root);
+        // a tree left without its journal, by a crash before the first save,
+        // is repaired from its manifest instead of being downloaded again
+        if (!resuming && !repair && pkgi_file_exists(root) &&
+            pkgi_file_exists(pkgi_manifest_path(partition, content)))
+        {
+            load_manifest();
+            repair = manifest_valid;
+        }
+        else if (resuming || repair)
+            load_manifest();
+
+        if (repair)
+            LOGF("repairing {}", content_root.empty() ? root : content_root);
+
+        if (!resuming && !repair)
+            pkgi_trash_dir(root);
+        if (!manifest_valid)
+            pkgi_create_manifest(pkgi_manifest_path(partition, content), url);
 
+        if (!keep_path.empty() && !resuming && !repair)
+            begin_keep();
         if (!resuming)
             if (!download_head(rif))
                 return 0;
+        check_chunk_hashes();
+        // the skipped files would be needed to check it, unless the chunks
+        // they are in can be skipped as a whole
+        if (repair && !chunk_hashes)
+            digest = nullptr;
+        can_seek = http_factory && (!digest || chunk_hashes);
         if (!download_files())
             return 0;
         if (!download_tail())
@@ -1208,6 +1847,11 @@ int Download::pkgi_download(
         }
         if (!check_integrity(digest))
             return 0;
+        if (digest)
+        {
+            save_chunk_hashes();
+            end_keep(true);
+        }
         if (content_type == CONTENT_TYPE_PSM_GAME ||
             content_type == CONTENT_TYPE_PSM_GAME_ALT)
         {
@@ -1234,10 +1878,13 @@ int Download::pkgi_download(
         {
             // we can leave them, but they're useless and they conflict when
             // installing DLCs
-            pkgi_delete_dir(fmt::format("{}/sce_sys", root));
+            pkgi_trash_dir(fmt::format("{}/sce_sys", root));
             // if we remove sce_sys, we can't resume the download anymore
-            pkgi_rm(fmt::format("{}.resume", root).c_str());
+            journal.close();
+            ResumeJournal::remove(root + ".resume");
         }
+        else
+            journal.compact();
         return 1;
     }
     catch (const ResumeError& e)
@@ -1245,8 +1892,9 @@ int Download::pkgi_download(
         LOGF("deleting resume file");
         try
         {
-            pkgi_rm(fmt::format("{}.resume", root).c_str());
-            pkgi_delete_dir(root);
+            journal.close();
+            ResumeJournal::remove(root + ".resume");
+            pkgi_trash_dir(root);
         }
         catch (const std::exception& e)
         {
@@ -1256,76 +1904,165 @@ int Download::pkgi_download(
     }
 }
 
-void Download::serialize_state() const
+void Download::save_state()
+{
+    StageTimer timer(stats, Stage::Checkpoint);
+    // the resume data must never get ahead of what is on the card
+    flush_file();
+    write_manifest();
+    serialize_state();
+    last_state_save = encrypted_base + encrypted_offset;
+}
+
+namespace
+{
+// the format of the journal records, they must stay fixed size
+constexpr uint32_t RESUME_VERSION = 2;
+constexpr uint32_t RESUME_PAYLOAD_SIZE = 4 + 1 + 8 + 8 + AES_BLOCK_SIZE +
+                                         sizeof(aes128_ctx) +
+                                         sizeof(sha256_ctx) + 4 + 4 + 8 + 8 +
+                                         8 + 4 + 8 + 8 + 8;
+
+class PayloadWriter
+{
+public:
+    PayloadWriter(std::vector<uint8_t>& out) : _out(out)
+    {
+    }
+
+    void bytes(const void* data, size_t size)
+    {
+        const auto data8 = static_cast<const uint8_t*>(data);
+        _out.insert(_out.end(), data8, data8 + size);
+    }
+    void u32(uint32_t value)
+    {
+        uint8_t bytes[4];
+        set32le(bytes, value);
+        this->bytes(bytes, sizeof(bytes));
+    }
+    void u64(uint64_t value)
+    {
+        uint8_t bytes[8];
+        set64le(bytes, value);
+        this->bytes(bytes, sizeof(bytes));
+    }
+
+private:
+    std::vector<uint8_t>& _out;
+};
+
+class PayloadReader
+{
+public:
+    PayloadReader(const uint8_t* data) : _data(data)
+    {
+    }
+
+    void bytes(void* data, size_t size)
+    {
+        memcpy(data, _data, size);
+        _data += size;
+    }
+    uint32_t u32()
+    {
+        const auto value = get32le(_data);
+        _data += 4;
+        return value;
+    }
+    uint64_t u64()
+    {
+        const auto value = get64le(_data);
+        _data += 8;
+        return value;
+    }
+
+private:
+    const uint8_t* _data;
+};
+}
+
+void Download::serialize_state()
 {
-    std::ofstream ss(
-            fmt::format("{}.resume", root), std::ios::out | std::ios::trunc);
-    cereal::BinaryOutputArchive oarchive(ss);
+    std::vector<uint8_t> payload;
+    payload.reserve(RESUME_PAYLOAD_SIZE);
+    PayloadWriter out(payload);
 
-    oarchive(static_cast<uint8_t>(1));
+    out.u32(RESUME_VERSION);
 
-    oarchive(save_as_iso);
-    oarchive(download_offset, download_size);
+    const uint8_t iso = save_as_iso;
+    out.bytes(&iso, 1);
+    out.u64(download_offset);
+    out.u64(download_size);
 
-    oarchive(iv);
-    oarchive.saveBinary(&aes, sizeof(aes));
-    oarchive.saveBinary(&sha, sizeof(sha));
+    out.bytes(iv, sizeof(iv));
+    out.bytes(&aes, sizeof(aes));
+    out.bytes(&sha, sizeof(sha));
 
-    oarchive(item_index);
+    out.u32(item_index);
 
-    oarchive(index_count);
-    oarchive(total_size);
-    oarchive(enc_offset);
-    oarchive(enc_size);
+    out.u32(index_count);
+    out.u64(total_size);
+    out.u64(enc_offset);
+    out.u64(enc_size);
 
-    oarchive(content_type);
+    out.u32(content_type);
 
-    oarchive(encrypted_base);
-    oarchive(encrypted_offset);
-    oarchive(decrypted_size);
+    out.u64(encrypted_base);
+    out.u64(encrypted_offset);
+    out.u64(decrypted_size);
+
+    journal.append(payload);
 }
 
 void Download::deserialize_state()
 {
     const auto state_file = fmt::format("{}.resume", root);
 
-    if (!pkgi_file_exists(state_file.c_str()))
+    if (!ResumeJournal::exists(state_file))
         return;
 
     try
     {
         LOG("download resume file found");
 
-        const auto head_path = fmt::format("{}/sce_sys/package/head.bin", root);
-        head = pkgi_load(head_path);
+        // the item table is read back from it
+        if (!pkgi_file_exists(
+                    fmt::format("{}/sce_sys/package/head.bin", root)))
+            throw std::runtime_error("head.bin 文件不存在");
+
+        const auto payload =
+                ResumeJournal::load(state_file, RESUME_PAYLOAD_SIZE);
+        if (!payload)
+            throw std::runtime_error("恢复数据已损坏或版本无效");
 
-        std::ifstream ss(state_file);
-        cereal::BinaryInputArchive iarchive(ss);
+        PayloadReader in(payload->data());
 
-        uint8_t version;
-        iarchive(version);
-        if (version != 1)
+        if (in.u32() != RESUME_VERSION)
             throw std::runtime_error("无效的恢复数据版本");
 
-        iarchive(save_as_iso);
-        iarchive(download_offset, download_size);
+        uint8_t iso;
+        in.bytes(&iso, 1);
+        save_as_iso = iso;
+        download_offset = in.u64();
+        download_size = in.u64();
 
-        iarchive(iv);
-        iarchive.loadBinary(&aes, sizeof(aes));
-        iarchive.loadBinary(&sha, sizeof(sha));
+        in.bytes(iv, sizeof(iv));
+        in.bytes(&aes, sizeof(aes));
+        in.bytes(&sha, sizeof(sha));
 
-        iarchive(item_index);
+        item_index = in.u32();
 
-        iarchive(index_count);
-        iarchive(total_size);
-        iarchive(enc_offset);
-        iarchive(enc_size);
+        index_count = in.u32();
+        total_size = in.u64();
+        enc_offset = in.u64();
+        enc_size = in.u64();
 
-        iarchive(content_type);
+        content_type = in.u32();
 
-        iarchive(encrypted_base);
-        iarchive(encrypted_offset);
-        iarchive(decrypted_size);
+        encrypted_base = in.u64();
+        encrypted_offset = in.u64();
+        decrypted_size = in.u64();
 
         resuming = true;
 
@@ -2,15 +2,28 @@
 
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include <stdint.h>
 
 #include "aes128.hpp"
+#include "asyncwriter.hpp"
+#include "chunkhashes.hpp"
+#include "resumejournal.hpp"
 #include "http.hpp"
+#include "isocompressor.hpp"
+#include "manifest.hpp"
+#include "memstats.hpp"
+#include "packagemanifest.hpp"
 #include "sha256.hpp"
+#include "stagestats.hpp"
+#include "suspendgate.hpp"
+#include "thread.hpp"
 
 #define PKGI_RIF_SIZE 512
 #define PKGI_PSM_RIF_SIZE 1024
@@ -18,6 +31,16 @@
 #define PKG_HEADER_EXT_SIZE 64
 #define PKG_TAIL_SIZE 480
 
+// stalled or dropped connections are reopened where they stopped, waiting
+// twice as long each time
+static constexpr uint32_t RECONNECT_ATTEMPTS = 8;
+static constexpr uint32_t RECONNECT_BASE_DELAY = 1000;
+static constexpr uint32_t RECONNECT_MAX_DELAY = 30 * 1000;
+
+// waits before the attempt-th reconnection, throws as soon as is_canceled
+void pkgi_wait_reconnect(
+        uint32_t attempt, const std::function<bool()>& is_canceled);
+
 class ResumeError : public std::exception
 {
 public:
@@ -50,6 +73,38 @@ private:
     std::string _msg;
 };
 
+// what the head of a package tells before it is downloaded
+struct PackageInfo
+{
+    uint32_t content_type = 0;
+    uint64_t total_size = 0;
+    // bytes the installed files take, 0 for the PSP and PSX packages which
+    // are only partially extracted
+    uint64_t footprint = 0;
+
+    // only filled by pkgi_peek_package
+    // the files of the package, folders left out
+    std::vector<std::string> files;
+    // PSP2_SYSTEM_VER of its param.sfo as "3.60", empty when there is none
+    std::string system_version;
+    std::string app_version;
+};
+
+// reads the header, the metadata and the item table of the package at url
+// with a few Range requests of their own and checks them like the download
+// does, so that a package that can't be installed is told before its turn.
+// Throws DownloadError for such a package, HttpError when it can't be read
+PackageInfo pkgi_inspect_package(
+        const std::function<std::unique_ptr<Http>()>& make_http,
+        const std::string& url,
+        const uint8_t* rif);
+// pkgi_inspect_package, which also reads the names of the items and the
+// param.sfo of the package, a few KB more. It needs no zRIF, the PSP and PSX
+// packages get no more than what pkgi_inspect_package tells
+PackageInfo pkgi_peek_package(
+        const std::function<std::unique_ptr<Http>()>& make_http,
+        const std::string& url);
+
 class Download
 {
 public:
@@ -61,13 +116,79 @@ public:
             const char* url,
             const uint8_t* rif,
             const uint8_t* digest);
+    // may be called from any thread, cuts the request under way short so that
+    // a cancel or a pause is seen right away instead of once the read ends
+    void abort();
 
     // private:
     bool save_as_iso{false};
+    // the ISO is recompressed to CSO or ZSO while it is written
+    IsoFormat iso_format{IsoFormat::Iso};
 
     std::string root;
+    std::string partition;
+    // where the files of the package are written, root when empty, only the
+    // USRDIR/CONTENT ones for a PSP or PSX package. A PSP DLC goes right into
+    // the folder of its game instead of being merged into it file by file
+    // once downloaded
+    std::string content_root;
+    // the files already there are checked against the manifest and only the
+    // missing or damaged ones are downloaded again, the others are skipped
+    // with Range requests. The package digest can't be checked then, unless
+    // there are chunk_hashes
+    bool repair{false};
+    // when set, each chunk of the package is checked as soon as it is in and
+    // a skip can jump over whole chunks while the digest is still checked at
+    // the end. Dropped when they don't match the size of the package
+    std::optional<ChunkHashes> chunk_hashes;
+    // the states seen at the chunk boundaries by a download that hashed the
+    // whole package from its start, saved once its digest is checked so that
+    // the next repair of it can use them
+    ChunkHashes built_chunk_hashes;
+    // when set, the package is also kept there as it comes in, still
+    // encrypted, and kept is set once its digest is checked. A download that
+    // resumes, skips bytes or lacks the room for it doesn't keep it. See
+    // PeerCache
+    std::string keep_path;
+    bool kept{false};
+    // when set, the time spent in each stage is added to it, it must outlive
+    // the download
+    StageStats* stats{nullptr};
+    // for benchmarks, the contents of the files are hashed but not written,
+    // the files stay empty
+    bool discard_writes{false};
+    // bytes of the partition the other downloads are still to write, left
+    // out of its free space
+    uint64_t reserved_space{0};
+    // when set, told the bytes the files of the package take once the item
+    // table is known, before they are checked against the free space
+    std::function<void(uint64_t footprint)> on_footprint;
+
+    // when set, the download saves its state and waits when the system goes
+    // to sleep, and reopens its connection once it woke up
+    SuspendGate* suspend_gate{nullptr};
 
+    // replaced by the download thread only, under the mutex so that abort()
+    // can reach it
+    using ScopeLock = std::lock_guard<Mutex>;
+    Mutex _http_mutex{"download_http_mutex"};
     std::unique_ptr<Http> _http;
+    // when set, large skips restart the stream past the skipped bytes instead
+    // of downloading them
+    std::function<std::unique_ptr<Http>()> http_factory;
+    bool can_seek{false};
+    // pkg offset of the next byte _http returns, download_offset is ahead of
+    // it after a skip
+    uint64_t http_offset{0};
+    // set once a request went through, after that failures are retried
+    bool http_started{false};
+    // the connections that were lost and opened again
+    uint32_t reconnects{0};
+    // suspend_gate->resumes() when the last reconnect attempts started
+    uint32_t resumes_seen{0};
+    // the content of a plain file is streaming, encrypted_offset follows
+    // every byte so the state can be saved in the middle of a read
+    bool state_saveable{false};
     const char* download_content;
     const char* download_url;
 
@@ -79,12 +200,27 @@ public:
     sha256_ctx sha;
 
     void* item_file; // current file handle
+    AsyncWriter writer; // writes to item_file happen on this thread
     std::string item_name; // current file name
     std::string item_path; // current file path
     uint32_t item_index; // current item
+    uint64_t item_written; // bytes written to the current file
+    uint32_t item_crc; // crc32 of them
+
+    // of the files written, so that a repair can tell the damaged ones after
+    // the install. Valid when the one loaded was made from download_url
+    Manifest manifest;
+    bool manifest_valid{false};
+    // the records of the files written since the last checkpoint, added to
+    // the manifest once the writer flushed them
+    Manifest manifest_pending;
 
-    // head.bin contents, kept in memory while downloading
-    std::vector<uint8_t> head;
+    // the folders made by this download, with their parents
+    std::unordered_set<std::string> made_folders;
+
+    // the item table of head.bin, decoded by download_files
+    PackageManifest package;
+    MemoryCharge package_memory{MemPool::Download};
 
     // pkg header
     uint32_t index_count;
@@ -99,7 +235,13 @@ public:
     uint64_t encrypted_offset; // offset from beginning of file
     uint64_t decrypted_size; // size that's left to write into decrypted file
 
+    // of the package kept at keep_path, written on its own thread
+    void* keep_file{nullptr};
+    std::unique_ptr<AsyncWriter> keep_writer;
+    uint64_t keep_offset{0};
+
     uint64_t last_state_save;
+    ResumeJournal journal;
 
     bool resuming;
 
@@ -110,17 +252,62 @@ public:
             update_progress_cb;
     std::function<void(const std::string& status)> update_status;
     std::function<bool()> is_canceled;
+    // polled between the chunks of a file, the download waits in place
+    // while it's true, see check_pause(). update_status is told "Paused" and
+    // "Downloading" again
+    std::function<bool()> is_paused;
 
     void update_progress();
     void download_start(void);
+    void start_http(uint64_t offset);
+    HttpSlice borrow_http(uint32_t size);
+    void read_http(uint8_t* buffer, uint32_t size);
+    void seek_http();
     void download_data(uint8_t* buffer, uint32_t size, int encrypted, int save);
+    // like download_data but works on the buffers of _http, for the bytes
+    // that aren't needed afterwards
+    void download_stream(uint64_t size, int encrypted, int save);
+    void consume_data(uint8_t* buffer, uint32_t size, int encrypted, int save);
+    void begin_keep();
+    void keep_data(const uint8_t* buffer, uint32_t size);
+    // doesn't throw, a package that can't be kept is only logged
+    void end_keep(bool complete);
+    // the hashing part of consume_data, cut at the chunk boundaries
+    void hash_data(uint8_t* buffer, uint32_t size, int encrypted);
+    void chunk_done(uint64_t end);
+    // the hash goes on from the state of the chunk that ends at offset
+    void restore_chunk_state(uint64_t offset);
+    void check_chunk_hashes();
+    void save_chunk_hashes();
     void skip_to_file_offset(uint64_t to_offset);
+    // between two chunks of a file, parks the download at suspend_gate
+    void check_suspend();
+    // save is false where the state can't be resumed, in the middle of an
+    // ISO or an EDAT
+    void check_pause(bool save = true);
+    void wait_unpaused();
+    void reopen_http();
+    void make_folder(const std::string& folder);
     void create_file(void);
     void open_file();
+    void write_file(const void* data, uint32_t size);
+    void flush_file();
+    void close_file();
+    // leaves the flush and the close to the writer thread
+    void end_small_file();
     int download_head(const uint8_t* rif);
+    void load_package();
+    void free_package();
     void download_file_content(uint64_t encrypted_size);
     void download_file_content_to_iso(uint64_t item_size);
     void download_file_content_to_edat(uint64_t item_size);
+    void check_free_space();
+    std::string files_root() const;
+    void load_manifest();
+    void append_manifest();
+    void write_manifest();
+    void rehash_file(uint64_t item_size);
+    bool is_item_intact(uint64_t item_size);
     int download_files(void);
     int download_tail(void);
     int create_stat();
@@ -129,6 +316,7 @@ public:
     int create_psm_rif(const uint8_t* rif);
     int adjust_psm_files();
 
-    void serialize_state() const;
+    void save_state();
+    void serialize_state();
     void deserialize_state();
 };
@@ -1,16 +1,34 @@
 #include "downloader.hpp"
 
+#include "cardhttp.hpp"
 #include "download.hpp"
 #include "file.hpp"
 #include "filedownload.hpp"
+#include "httpoptions.hpp"
 #include "install.hpp"
+#include "isoblockdecoder.hpp"
+#include "log.hpp"
+#include "memstats.hpp"
+#include "mirrorrace.hpp"
+#include "offload.hpp"
+#include "pkgi.hpp"
+#include "recordinghttp.hpp"
+#include "segmentedhttp.hpp"
+#include "trash.hpp"
+#include "utils.hpp"
 #include "vitahttp.hpp"
+#include "zipstream.hpp"
 
 #include <fmt/format.h>
 
 #include <boost/scope_exit.hpp>
 
-std::string type_to_string(Type type)
+#include <algorithm>
+#include <ctime>
+#include <stdexcept>
+#include <unordered_set>
+
+const char* type_to_string(Type type)
 {
     switch (type)
     {
@@ -36,64 +54,544 @@ std::string type_to_string(Type type)
     return "未知";
 }
 
+std::string pkgi_installed_folder(const DownloadItem& item)
+{
+    const auto content = item.content.c_str();
+    switch (item.type)
+    {
+    case Game:
+        return fmt::format("ux0:app/{:.9}", content + 7);
+    case Dlc:
+        return fmt::format(
+                "ux0:addcont/{:.9}/{:.16}", content + 7, content + 20);
+    case Patch:
+        return fmt::format("ux0:patch/{}", item.content);
+    case PsmGame:
+        return fmt::format("ux0:psm/{:.9}", content + 7);
+    case PspGame:
+        if (item.save_as_iso)
+            return "";
+        // fallthrough
+    case PsxGame:
+    case PspDlc:
+        return fmt::format(
+                "{}pspemu/PSP/GAME/{:.9}", item.partition, content + 7);
+    case CompPackBase:
+    case CompPackPatch:
+        return "";
+    }
+    return "";
+}
+
+namespace
+{
+// the title of a content id, patches and compatibility packs are queued by
+// title id already
+std::string title_of(const DownloadItem& item)
+{
+    if (item.content.size() >= 16 && item.content[6] == '-')
+        return item.content.substr(7, 9);
+    return item.content;
+}
+
+// bytes per second assumed for a host with no history, to order the queue
+constexpr uint64_t UNKNOWN_HOST_SPEED = 1024 * 1024;
+
+// the saved queue is QUEUE_MAGIC, QUEUE_VERSION and the item count, then per
+// item its type, its flags, priority and size followed by its strings, each
+// one as a length and its bytes, then since version 2 the count of its
+// mirrors and the mirrors, all little endian
+constexpr uint32_t QUEUE_MAGIC = 0x51474b50; // "PKGQ"
+constexpr uint32_t QUEUE_VERSION = 2;
+constexpr uint8_t FLAG_SAVE_AS_ISO = 0x1;
+constexpr uint8_t FLAG_REPAIR = 0x2;
+// the IsoFormat of the item, in two bits
+constexpr uint8_t ISO_FORMAT_SHIFT = 2;
+constexpr uint8_t ISO_FORMAT_MASK = 0x3;
+
+template <typename Bytes>
+void put_bytes(std::vector<uint8_t>& out, const Bytes& bytes)
+{
+    const auto pos = out.size();
+    out.resize(pos + 4 + bytes.size());
+    set32le(out.data() + pos, bytes.size());
+    std::copy(bytes.begin(), bytes.end(), out.begin() + pos + 4);
+}
+
+void put_item(std::vector<uint8_t>& out, const DownloadItem& item)
+{
+    const auto pos = out.size();
+    out.resize(pos + 14);
+    out[pos] = item.type;
+    out[pos + 1] = (item.save_as_iso ? FLAG_SAVE_AS_ISO : 0) |
+                   (item.repair ? FLAG_REPAIR : 0) |
+                   (static_cast<uint8_t>(item.iso_format) << ISO_FORMAT_SHIFT);
+    set32le(out.data() + pos + 2, item.priority);
+    set64le(out.data() + pos + 6, item.size);
+    put_bytes(out, item.name);
+    put_bytes(out, item.content);
+    put_bytes(out, item.url);
+    put_bytes(out, item.rif);
+    put_bytes(out, item.digest);
+    put_bytes(out, item.partition);
+    put_bytes(out, item.version);
+    const auto pos_mirrors = out.size();
+    out.resize(pos_mirrors + 4);
+    set32le(out.data() + pos_mirrors, item.mirrors.size());
+    for (const auto& mirror : item.mirrors)
+        put_bytes(out, mirror);
+}
+
+// throws on a truncated or bad file
+class QueueReader
+{
+public:
+    QueueReader(const std::vector<uint8_t>& data) : _data(data)
+    {
+    }
+
+    // of the file, checked by the caller
+    uint32_t version = QUEUE_VERSION;
+
+    const uint8_t* take(size_t size)
+    {
+        if (_data.size() - _pos < size)
+            throw std::runtime_error("truncated queue");
+        _pos += size;
+        return _data.data() + _pos - size;
+    }
+
+    uint32_t get32()
+    {
+        return get32le(take(4));
+    }
+
+    template <typename Bytes>
+    void get_bytes(Bytes& bytes)
+    {
+        const auto size = get32();
+        const auto data = take(size);
+        bytes.assign(data, data + size);
+    }
+
+    DownloadItem get_item()
+    {
+        DownloadItem item{};
+        const auto header = take(14);
+        if (header[0] > CompPackPatch)
+            throw std::runtime_error("bad item type");
+        item.type = static_cast<Type>(header[0]);
+        item.save_as_iso = header[1] & FLAG_SAVE_AS_ISO;
+        item.repair = header[1] & FLAG_REPAIR;
+        const auto iso_format =
+                (header[1] >> ISO_FORMAT_SHIFT) & ISO_FORMAT_MASK;
+        if (iso_format > static_cast<uint8_t>(IsoFormat::Zso))
+            throw std::runtime_error("bad iso format");
+        item.iso_format = static_cast<IsoFormat>(iso_format);
+        item.priority = static_cast<int32_t>(get32le(header + 2));
+        item.size = get64le(header + 6);
+        get_bytes(item.name);
+        get_bytes(item.content);
+        get_bytes(item.url);
+        get_bytes(item.rif);
+        get_bytes(item.digest);
+        get_bytes(item.partition);
+        get_bytes(item.version);
+        if (version >= 2)
+        {
+            item.mirrors.resize(get32());
+            for (auto& mirror : item.mirrors)
+                get_bytes(mirror);
+        }
+        return item;
+    }
+
+private:
+    const std::vector<uint8_t>& _data;
+    size_t _pos = 0;
+};
+
+bool is_repaired_in_place(const DownloadItem& item)
+{
+    if (!item.repair)
+        return false;
+    const auto folder = pkgi_installed_folder(item);
+    return !folder.empty() && pkgi_file_exists(folder);
+}
+
+// a copy of the package put in pkgj/pkg on one of the cards, by USB or FTP,
+// installs without the network. Empty when there is none
+std::string card_package_url(const DownloadItem& item)
+{
+    if (item.type == CompPackBase || item.type == CompPackPatch)
+        return "";
+    for (const auto& partition : {item.partition, std::string("ux0:"),
+                                  std::string("uma0:")})
+    {
+        const auto path =
+                fmt::format("{}pkgj/pkg/{}.pkg", partition, item.content);
+        if (pkgi_file_exists(path))
+            return pkgi_card_url(path);
+    }
+    return "";
+}
+
+UiEvent ui_event(UiEventType type, const DownloadItem& item)
+{
+    UiEvent event;
+    event.type = type;
+    event.content = item.content;
+    // the patches and the compatibility packs are queued by title id
+    event.titleid = item.content.size() >= 16 ? item.content.substr(7, 9)
+                                              : item.content;
+    // and have no row to look up again
+    event.changes_presence = item.type != Patch &&
+                             item.type != CompPackBase &&
+                             item.type != CompPackPatch;
+    return event;
+}
+}
+
 Downloader::Downloader()
-    : _cond("downloader_cond"), _thread("downloader_thread", [this] { run(); })
+    : _cond("downloader_cond"), _save_mutex("downloader_save_mutex")
 {
     LOG("new downloader");
+    for (size_t i = 0; i < MAX_JOBS; ++i)
+    {
+        auto& job = _jobs[i];
+        job.thread = std::make_unique<Thread>(
+                fmt::format("downloader_thread_{}", i),
+                [this, &job] { run(job); },
+                ThreadRole::Network);
+    }
+    _install_thread = std::make_unique<Thread>(
+            "downloader_install",
+            [this] { run_installs(); },
+            ThreadRole::Worker);
+    _lookahead_thread = std::make_unique<Thread>(
+            "downloader_lookahead",
+            [this] { run_lookahead(); },
+            ThreadRole::Network);
+    pkgi_set_power_handler([this](PowerEvent event) {
+        if (event == PowerEvent::Suspending)
+            _suspend_gate.suspend();
+        else
+            _suspend_gate.resume();
+    });
 }
 
 Downloader::~Downloader()
 {
     LOG("destroying downloader");
-    _dying = true;
-    _cond.notify_one();
-    _thread.join();
+    pkgi_set_power_handler(nullptr);
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+        for (auto& job : _jobs)
+            if (job.download)
+                job.download->abort();
+    }
+    _cond.notify_all();
+    for (auto& job : _jobs)
+        job.thread->join();
+    // the downloads left to install are resumed at the next start
+    _install_thread->join();
+    _lookahead_thread->join();
     LOG("downloader destroyed");
 }
 
+void Downloader::set_jobs(size_t jobs)
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        _max_jobs = std::clamp(
+                std::min(jobs, HTTP_SLOTS / std::max(connections, size_t(1))),
+                size_t(1),
+                MAX_JOBS);
+    }
+    _cond.notify_all();
+}
+
+void Downloader::set_speed_limits(uint64_t total, uint64_t per_job)
+{
+    LOGF("download speed limits: {}B/s, {}B/s per job", total, per_job);
+    _limit.set_rate(total);
+    for (auto& job : _jobs)
+        job.limit.set_rate(per_job);
+}
+
+void Downloader::set_paused(bool paused)
+{
+    LOGF("downloads {}", paused ? "paused" : "resumed");
+    {
+        ScopeLock _(_cond.get_mutex());
+        _paused = paused;
+    }
+    _cond.notify_all();
+}
+
 void Downloader::add(const DownloadItem& d)
 {
     LOG("adding download %s", d.name.c_str());
     {
         ScopeLock _(_cond.get_mutex());
         _queue.push_back(d);
+        _queued.emplace(d.content, d.type);
+        update_queued_bytes();
+    }
+    _cond.notify_all();
+    save_queue();
+}
+
+void Downloader::restore_queue(const std::string& path)
+{
+    std::vector<DownloadItem> items;
+    try
+    {
+        const auto data = pkgi_load(path);
+        QueueReader reader(data);
+        if (reader.get32() != QUEUE_MAGIC)
+            throw std::runtime_error("bad header");
+        reader.version = reader.get32();
+        if (reader.version < 1 || reader.version > QUEUE_VERSION)
+            throw std::runtime_error("bad version");
+        const auto count = reader.get32();
+        for (uint32_t i = 0; i < count; ++i)
+            items.push_back(reader.get_item());
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("no saved download queue in {}: {}", path, e.what());
+        items.clear();
+    }
+
+    LOGF("restoring {} downloads", items.size());
+    {
+        ScopeLock _(_cond.get_mutex());
+        _queue_path = path;
+        // the downloads that were running start again from their journal
+        for (auto& item : items)
+        {
+            _queued.emplace(item.content, item.type);
+            _queue.push_back(std::move(item));
+        }
+        update_queued_bytes();
     }
-    _cond.notify_one();
+    _cond.notify_all();
+    save_queue();
+}
+
+void Downloader::save_queue()
+{
+    std::vector<uint8_t> data(12);
+    std::string path;
+    uint64_t serial;
+    {
+        ScopeLock _(_cond.get_mutex());
+        // the downloads stopped by the destruction are still to be done
+        if (_queue_path.empty() || _dying)
+            return;
+        path = _queue_path;
+        serial = ++_save_serial;
+
+        uint32_t count = 0;
+        const auto put = [&](const DownloadItem& item) {
+            if (item.content.empty())
+                return;
+            put_item(data, item);
+            ++count;
+        };
+        // in the order they'll be added back
+        put(_installing);
+        for (const auto& item : _installs)
+            put(item);
+        for (const auto& job : _jobs)
+            put(job.item);
+        for (const auto& item : _queue)
+            put(item);
+
+        set32le(data.data(), QUEUE_MAGIC);
+        set32le(data.data() + 4, QUEUE_VERSION);
+        set32le(data.data() + 8, count);
+    }
+
+    ScopeLock _(_save_mutex);
+    if (serial < _saved_serial)
+        return;
+    _saved_serial = serial;
+    try
+    {
+        const auto tmp = path + ".tmp";
+        pkgi_save(tmp, data.data(), data.size());
+        pkgi_rename(tmp, path);
+    }
+    catch (const std::exception& e)
+    {
+        // only lost if the app dies before the next change
+        LOGF("failed to save download queue: {}", e.what());
+    }
+}
+
+bool Downloader::is_busy(Type type, const std::string& contentid) const
+{
+    const auto matches = [&](const DownloadItem& item) {
+        return type == item.type && contentid == item.content;
+    };
+    return std::any_of(
+                   _jobs.begin(),
+                   _jobs.end(),
+                   [&](const Job& job) { return matches(job.item); }) ||
+           matches(_installing) ||
+           std::any_of(_installs.begin(), _installs.end(), matches);
 }
 
 bool Downloader::is_in_queue(Type type, const std::string& contentid)
 {
     ScopeLock _(_cond.get_mutex());
-    if (type == _current_download.type &&
-        contentid == _current_download.content)
+    if (is_busy(type, contentid))
         return true;
 
-    for (const auto& item : _queue)
-        if (item.type == type && item.content == contentid)
-            return true;
-    return false;
+    const auto range = _queued.equal_range(contentid);
+    return std::any_of(range.first, range.second, [&](const auto& queued) {
+        return queued.second == type;
+    });
 }
 
-std::optional<DownloadItem> Downloader::get_current_download()
+void Downloader::fill_status(DownloadStatus& status, const DownloadItem& item)
 {
-    ScopeLock _(_cond.get_mutex());
-    if (_current_download.content.empty())
-        return std::nullopt;
-    return _current_download;
+    status = {};
+    status.stage = DownloadStage::Downloading;
+    status.type = item.type;
+    status.content_hash = std::hash<std::string>()(item.content);
+
+    auto len = std::min(item.name.size(), sizeof(status.name) - 1);
+    // don't leave half of an utf-8 character
+    if (len < item.name.size())
+        while (len > 0 && (static_cast<uint8_t>(item.name[len]) & 0xc0) == 0x80)
+            --len;
+    std::copy(item.name.begin(), item.name.begin() + len, status.name);
+    status.name[len] = 0;
 }
 
-std::tuple<uint64_t, uint64_t> Downloader::get_current_download_progress()
+void Downloader::start_status(Job& job)
 {
-    return {_download_offset.load(), _download_size.load()};
+    fill_status(job.status, job.item);
+    job.speed = {};
+    job.speed.seed(host_speed(job.item));
+    job.status.speed = job.speed.speed();
+    job.status.eta = 0;
+    job.speed_time = pkgi_time_msec();
+    job.speed_offset = 0;
+    job.start_time = job.speed_time;
+    job.start_offset = 0;
+    job.speed_samples.clear();
+    job.signal_sum = 0;
+    job.signal_samples = 0;
+    job.status.signal_dbm = 0;
+    job.reconnects = 0;
+    job.stats.reset();
+    job.status.stages = {};
+    job.published_status.write(job.status);
+}
+
+void Downloader::update_progress(
+        Job& job, uint64_t download_offset, uint64_t download_size)
+{
+    // the files grow about as fast as the package is downloaded
+    if (job.footprint && download_size)
+        job.reserved = static_cast<uint64_t>(
+                job.footprint *
+                (1.0 - std::min(1.0, double(download_offset) / download_size)));
+
+    auto& status = job.status;
+    // a resumed download starts past 0
+    if (status.size == 0)
+    {
+        job.speed_offset = download_offset;
+        job.start_offset = download_offset;
+    }
+
+    const auto now = pkgi_time_msec();
+    if (now - job.speed_time >= 1000)
+    {
+        const auto bytes = download_offset > job.speed_offset
+                                   ? download_offset - job.speed_offset
+                                   : 0;
+        job.speed_samples.push_back(
+                static_cast<uint32_t>(bytes * 1000 / (now - job.speed_time)));
+        job.speed.add(bytes, now - job.speed_time);
+        status.speed = job.speed.speed();
+        // to tell a slow server from a bad link afterwards
+        int dbm, percent;
+        if (pkgi_wifi_signal(dbm, percent))
+        {
+            status.signal_dbm = dbm;
+            job.signal_sum += dbm;
+            ++job.signal_samples;
+        }
+        job.speed_offset = download_offset;
+        job.speed_time = now;
+    }
+    status.offset = download_offset;
+    status.size = download_size;
+    status.eta = job.speed.eta(
+            download_size > download_offset ? download_size - download_offset
+                                            : 0);
+    status.stages = job.stats.totals();
+    job.published_status.write(status);
+}
+
+void Downloader::set_stage(Job& job, DownloadStage stage)
+{
+    job.status.stage = stage;
+    job.published_status.write(job.status);
+}
+
+void Downloader::add_to_history(const Job& job, DownloadResult result)
+{
+    if (!history)
+        return;
+
+    DownloadRecord record;
+    record.time = std::time(nullptr);
+    record.content = job.item.content;
+    record.host = pkgi_url_host(job.item.url);
+    record.result = result;
+    record.bytes = job.status.offset > job.start_offset
+                           ? job.status.offset - job.start_offset
+                           : 0;
+    record.msec = pkgi_time_msec() - job.start_time;
+    record.average = record.msec ? record.bytes * 1000 / record.msec : 0;
+    record.p5 = pkgi_percentile(job.speed_samples, 5);
+    record.p95 = pkgi_percentile(job.speed_samples, 95);
+    record.reconnects = job.reconnects;
+    record.signal_dbm = job.signal_samples
+                                ? static_cast<int32_t>(
+                                          job.signal_sum / job.signal_samples)
+                                : 0;
+    const auto stages = job.stats.totals();
+    for (size_t i = 0; i < STAGE_COUNT; ++i)
+        record.stage_msec[i] = stages.usec[i] / 1000;
+    history->add(record);
 }
 
 void Downloader::remove_from_queue(Type type, const std::string& contentid)
 {
-    ScopeLock _(_cond.get_mutex());
-    if (type == _current_download.type &&
-        contentid == _current_download.content)
-        _cancel_current = true;
-    else
+    {
+        ScopeLock _(_cond.get_mutex());
+        // the job saves the queue once it stopped
+        for (auto& job : _jobs)
+            if (type == job.item.type && contentid == job.item.content)
+            {
+                job.cancel = true;
+                if (job.download)
+                    job.download->abort();
+                return;
+            }
+        // an install can't be stopped
+        if (is_busy(type, contentid))
+            return;
+
         _queue.erase(
                 std::remove_if(
                         _queue.begin(),
@@ -103,140 +601,896 @@ void Downloader::remove_from_queue(Type type, const std::string& contentid)
                                    item.content == contentid;
                         }),
                 _queue.end());
+        unqueue(type, contentid, true);
+        update_queued_bytes();
+    }
+    save_queue();
+}
+
+void Downloader::unqueue(Type type, const std::string& contentid, bool all)
+{
+    auto range = _queued.equal_range(contentid);
+    for (auto it = range.first; it != range.second;)
+    {
+        if (it->second != type)
+        {
+            ++it;
+            continue;
+        }
+        it = _queued.erase(it);
+        if (!all)
+            return;
+    }
+}
+
+void Downloader::update_queued_bytes()
+{
+    uint64_t bytes = 0;
+    for (const auto& item : _queue)
+        bytes += item.size;
+    _queued_bytes.store(bytes, std::memory_order_relaxed);
 }
 
-void Downloader::run()
+uint64_t Downloader::host_speed(const DownloadItem& item)
+{
+    return history ? history->host_speed(pkgi_url_host(item.url)) : 0;
+}
+
+std::deque<DownloadItem>::iterator Downloader::next_item()
+{
+    std::unordered_set<std::string> busy;
+    for (const auto& job : _jobs)
+        if (!job.item.content.empty())
+            busy.insert(title_of(job.item));
+    if (!_installing.content.empty())
+        busy.insert(title_of(_installing));
+    for (const auto& item : _installs)
+        busy.insert(title_of(item));
+
+    // the items of a title run in the order they were added, the first one
+    // goes with the highest priority of them all
+    struct Head
+    {
+        std::deque<DownloadItem>::iterator it;
+        int priority;
+    };
+    std::unordered_map<std::string, Head> heads;
+    for (auto it = _queue.begin(); it != _queue.end(); ++it)
+    {
+        auto title = title_of(*it);
+        if (busy.count(title))
+            continue;
+        auto& head =
+                heads.emplace(std::move(title), Head{it, it->priority})
+                        .first->second;
+        head.priority = std::max(head.priority, it->priority);
+    }
+
+    // the hosts never seen are taken as average ones, their items then go
+    // by size like before there was a history
+    std::unordered_map<std::string, uint64_t> speeds;
+    const auto duration = [&](const DownloadItem& item) {
+        auto host = pkgi_url_host(item.url);
+        auto speed = speeds.find(host);
+        if (speed == speeds.end())
+        {
+            const auto bytes_per_second = host_speed(item);
+            speed = speeds.emplace(
+                                  std::move(host),
+                                  bytes_per_second ? bytes_per_second
+                                                   : UNKNOWN_HOST_SPEED)
+                            .first;
+        }
+        return item.size * 1000 / speed->second;
+    };
+
+    // queried once per partition
+    std::unordered_map<std::string, uint64_t> free_space;
+
+    auto best = _queue.end();
+    int best_priority = 0;
+    uint64_t best_duration = 0;
+    for (const auto& entry : heads)
+    {
+        const auto& head = entry.second;
+        if (!fits(*head.it, free_space))
+            continue;
+        const auto head_duration = duration(*head.it);
+        if (best == _queue.end() || head.priority > best_priority ||
+            (head.priority == best_priority &&
+             (head_duration < best_duration ||
+              (head_duration == best_duration && head.it < best))))
+        {
+            best = head.it;
+            best_priority = head.priority;
+            best_duration = head_duration;
+        }
+    }
+    return best;
+}
+
+void Downloader::prioritize(Type type, const std::string& contentid)
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        int top = 0;
+        for (const auto& item : _queue)
+            top = std::max(top, item.priority);
+        for (auto& item : _queue)
+            if (item.type == type && item.content == contentid)
+                item.priority = top + 1;
+    }
+    save_queue();
+}
+
+bool Downloader::toggle_pause(Type type, const std::string& contentid)
+{
+    ScopeLock _(_cond.get_mutex());
+    for (auto& job : _jobs)
+        if (type == job.item.type && contentid == job.item.content)
+        {
+            job.pause = !job.pause;
+            LOGF("{} {}", job.item.name, job.pause ? "paused" : "unpaused");
+            if (job.pause && job.download)
+                job.download->abort();
+            return true;
+        }
+    return false;
+}
+
+void Downloader::release(Job& job)
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        job.item = {};
+        job.footprint = 0;
+        job.reserved = 0;
+        --_running;
+    }
+    // a download of the same title may be waiting for this one
+    _cond.notify_all();
+    save_queue();
+}
+
+void Downloader::run(Job& job)
 {
     while (true)
     {
-        DownloadItem item;
+        if (!job.item.content.empty())
+            release(job);
+
         {
             ScopeLock _(_cond.get_mutex());
+            job.cancel = false;
+            job.pause = false;
+
+            while (true)
+            {
+                if (_dying)
+                    return;
+                if (_running < _max_jobs && !_paused)
+                {
+                    const auto it = next_item();
+                    if (it != _queue.end())
+                    {
+                        job.item = std::move(*it);
+                        _queue.erase(it);
+                        unqueue(job.item.type, job.item.content, false);
+                        const auto inspected =
+                                _inspected.find(job.item.content);
+                        if (inspected != _inspected.end())
+                        {
+                            job.footprint =
+                                    reservation(job.item, inspected->second);
+                            job.reserved = job.footprint;
+                            _inspected.erase(inspected);
+                        }
+                        update_queued_bytes();
+                        ++_running;
+                        break;
+                    }
+                }
+                if (job.status.stage != DownloadStage::Idle)
+                    set_stage(job, DownloadStage::Idle);
+                _cond.wait();
+            }
+        }
+        // the lookahead inspects the rest of the queue while this one runs
+        _cond.notify_all();
+
+        // the item is only written by this thread, with the mutex locked
+        start_status(job);
+
+        bool done = false;
+        if (hold_wifi)
+            pkgi_hold_wifi();
+        try
+        {
+            done = do_download(job);
+        }
+        catch (const std::exception& e)
+        {
+            LOG("download error: %s", e.what());
+            error(e.what());
+        }
+        if (hold_wifi)
+            pkgi_release_wifi();
+        add_to_history(
+                job,
+                done ? DownloadResult::Done
+                     : job.cancel || _dying ? DownloadResult::Canceled
+                                            : DownloadResult::Failed);
+
+        if (!done)
+        {
+            if (events)
+                events->post(ui_event(UiEventType::Ended, job.item));
+            continue;
+        }
 
-            _current_download = {};
-            _cancel_current = false;
-            _download_offset = 0;
-            _download_size = 0;
+        ScopeLock _(_cond.get_mutex());
+        // the slot is freed at the top of the loop, the title stays busy
+        _installs.push_back(job.item);
+        _cond.notify_all();
+    }
+}
 
+void Downloader::run_lookahead()
+{
+    // the queue had more packages to inspect than a pass takes
+    bool more = false;
+    while (true)
+    {
+        // the urls of the items that come next, one per server
+        std::vector<std::string> urls;
+        std::vector<DownloadItem> uninspected;
+        {
+            ScopeLock _(_cond.get_mutex());
+            if (!more)
+                _cond.wait();
+            more = false;
             if (_dying)
                 return;
-            else if (!_queue.empty())
+            // with nothing running, the next item starts right away anyway
+            if (_running == 0 || _paused)
+                continue;
+
+            std::unordered_set<std::string> hosts;
+            const auto take = [&](const DownloadItem& item) {
+                if (urls.size() < PREWARM_HOSTS && !item.url.empty() &&
+                    hosts.insert(pkgi_url_host(item.url)).second)
+                    urls.push_back(item.url);
+            };
+            const auto next = next_item();
+            if (next != _queue.end())
+                take(*next);
+            for (const auto& item : _queue)
+                take(item);
+
+            for (const auto& item : _queue)
+                if (item.type != CompPackBase && item.type != CompPackPatch &&
+                    !item.url.empty() && !_inspected.count(item.content))
+                {
+                    if (uninspected.size() == INSPECTED_ITEMS)
+                        break;
+                    uninspected.push_back(item);
+                }
+        }
+
+        for (const auto& url : urls)
+        {
+            try
             {
-                item = _current_download = _queue.front();
-                _queue.pop_front();
+                VitaHttp::prewarm(url);
             }
-            else
+            catch (const std::exception& e)
+            {
+                LOGF("failed to warm up {}: {}", url, e.what());
+            }
+        }
+
+        for (const auto& item : uninspected)
+            inspect(item);
+        more = uninspected.size() == INSPECTED_ITEMS;
+    }
+}
+
+void Downloader::inspect(const DownloadItem& item)
+{
+    try
+    {
+        const auto card_url = card_package_url(item);
+        const auto info = pkgi_inspect_package(
+                [&card_url]() -> std::unique_ptr<Http> {
+                    if (!card_url.empty())
+                        return std::make_unique<CardHttp>();
+                    return std::make_unique<VitaHttp>();
+                },
+                card_url.empty() ? item.url : card_url,
+                item.rif.empty() ? nullptr : item.rif.data());
+        LOGF("inspected {}: content type {}, {} bytes, {} installed",
+             item.name,
+             info.content_type,
+             info.total_size,
+             info.footprint);
+
+        // a package that doesn't fit even once the others give their
+        // reservations back is rejected, the others wait for them, see
+        // fits(). A repair mostly finds the files already there
+        const auto free_space = pkgi_get_free_space(item.partition.c_str());
+        if (!item.repair && info.footprint > free_space)
+            throw formatEx<DownloadError>(
+                    "{} 存储空间不足, 需要 {} MB, 可用 {} MB",
+                    item.partition,
+                    info.footprint / (1024 * 1024) + 1,
+                    free_space / (1024 * 1024));
+
+        {
+            ScopeLock _(_cond.get_mutex());
+            if (!_queued.count(item.content))
+                return;
+            _inspected[item.content] = info;
+        }
+        // the jobs waiting for it
+        _cond.notify_all();
+    }
+    catch (const DownloadError& e)
+    {
+        LOGF("{} can't be installed: {}", item.name, e.what());
+        fail_queued(item, e.what());
+    }
+    catch (const std::exception& e)
+    {
+        // the download tells what's wrong when its turn comes
+        LOGF("failed to inspect {}: {}", item.name, e.what());
+        {
+            ScopeLock _(_cond.get_mutex());
+            if (!_queued.count(item.content))
+                return;
+            _inspected[item.content] = PackageInfo{};
+        }
+        _cond.notify_all();
+    }
+}
+
+void Downloader::fail_queued(
+        const DownloadItem& item, const std::string& message)
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        const auto it = std::find_if(
+                _queue.begin(), _queue.end(), [&](const auto& queued) {
+                    return queued.type == item.type &&
+                           queued.content == item.content;
+                });
+        if (it == _queue.end())
+            return;
+        _queue.erase(it);
+        unqueue(item.type, item.content, false);
+        _inspected.erase(item.content);
+        update_queued_bytes();
+    }
+    save_queue();
+    if (error)
+        error(fmt::format("{}: {}", item.name, message));
+}
+
+uint64_t Downloader::reservation(
+        const DownloadItem& item, const PackageInfo& info)
+{
+    if (item.repair)
+        return 0;
+    // a PSP or PSX package is at most as big once extracted, less when its
+    // ISO is compressed
+    return info.footprint ? info.footprint : info.total_size;
+}
+
+bool Downloader::fits(
+        const DownloadItem& item,
+        std::unordered_map<std::string, uint64_t>& free_space)
+{
+    if (item.type == CompPackBase || item.type == CompPackPatch ||
+        item.repair)
+        return true;
+
+    const auto reserved = reserved_space(item.partition, nullptr);
+    // alone on its partition it goes, the download checks the space itself
+    if (reserved == 0)
+        return true;
+
+    // the lookahead tells its footprint shortly
+    const auto inspected = _inspected.find(item.content);
+    if (inspected == _inspected.end())
+        return false;
+
+    auto available = free_space.find(item.partition);
+    if (available == free_space.end())
+        available = free_space
+                            .emplace(
+                                    item.partition,
+                                    pkgi_get_free_space(item.partition.c_str()))
+                            .first;
+    return reservation(item, inspected->second) + reserved <=
+           available->second;
+}
+
+uint64_t Downloader::reserved_space(
+        const std::string& partition, const Job* except)
+{
+    uint64_t reserved = 0;
+    for (const auto& job : _jobs)
+        if (&job != except && job.item.partition == partition)
+            reserved += job.reserved;
+    return reserved;
+}
+
+void Downloader::run_installs()
+{
+    while (true)
+    {
+        if (!_installing.content.empty())
+        {
+            {
+                ScopeLock _(_cond.get_mutex());
+                _installing = {};
+            }
+            // the next download of the title may go
+            _cond.notify_all();
+            save_queue();
+        }
+
+        {
+            ScopeLock _(_cond.get_mutex());
+            while (true)
+            {
+                if (_dying)
+                    return;
+                if (!_installs.empty())
+                    break;
+                if (_install_status.stage != DownloadStage::Idle)
+                {
+                    _install_status.stage = DownloadStage::Idle;
+                    _published_install_status.write(_install_status);
+                }
                 _cond.wait();
+            }
+            _installing = std::move(_installs.front());
+            _installs.pop_front();
         }
 
+        fill_status(_install_status, _installing);
+        _install_status.stage = DownloadStage::Installing;
+        _published_install_status.write(_install_status);
+
+        auto result = UiEventType::Installed;
         try
         {
-            if (!item.content.empty())
-                do_download(item);
+            ScopeProcessLock _;
+            install(_installing);
         }
         catch (const std::exception& e)
         {
-            LOG("download error: %s", e.what());
+            LOG("install error: %s", e.what());
             error(e.what());
+            result = UiEventType::Ended;
         }
+        if (events)
+            events->post(ui_event(result, _installing));
     }
 }
 
-void Downloader::do_download_package(const DownloadItem& item)
+uint32_t Downloader::buffer_size_for(const DownloadItem& item)
 {
-    BOOST_SCOPE_EXIT_ALL(&)
+    if (!storage)
+        return write_buffer_size;
+    const auto size = storage->profile(item.partition).buffer_size();
+    return size ? size : write_buffer_size;
+}
+
+size_t Downloader::download_memory(
+        const DownloadItem& item, const std::string& url, uint32_t buffer_size)
+{
+    const auto options = pkgi_http_options(url);
+    size_t size = AsyncWriter::BUFFER_COUNT * size_t(buffer_size) +
+                  options.read_ahead_kb * size_t(1024) *
+                          options.read_ahead_blocks;
+    // the blocks in the window, decoded and compressed
+    if (item.save_as_iso)
+        size += 3 * IsoBlockDecoder::WINDOW_SIZE *
+                IsoBlockDecoder::MAX_BLOCK_SIZE;
+    return size;
+}
+
+std::string Downloader::keep_partition(const DownloadItem& item)
+{
+    if (!storage)
+        return item.partition;
+
+    // another card takes the writes of the copy off the one installed to,
+    // it must have room for it
+    std::string best = item.partition;
+    uint64_t best_speed = storage->profile(item.partition).write_speed();
+    for (const auto partition : {"ux0:", "uma0:"})
+    {
+        if (partition == item.partition ||
+            pkgi_get_free_space(partition) < item.size)
+            continue;
+        const auto speed = storage->profile(partition).write_speed();
+        if (speed > best_speed)
+        {
+            best = partition;
+            best_speed = speed;
+        }
+    }
+    return best;
+}
+
+size_t Downloader::connections_for(const DownloadItem& item)
+{
+    if (connections > 1 && item.size)
     {
-        refresh(item.content);
+        const auto speed = host_speed(item);
+        if (speed && item.size / speed < SHORT_DOWNLOAD_SECONDS)
+            return 1;
+    }
+    return connections;
+}
+
+std::unique_ptr<Http> Downloader::limit(
+        Job& job, std::unique_ptr<Http> http)
+{
+    return std::make_unique<RateLimitedHttp>(
+            std::move(http), std::vector<TokenBucket*>{&_limit, &job.limit});
+}
+
+std::unique_ptr<Http> Downloader::make_http(
+        Job& job, size_t connections, const std::string& url)
+{
+    // neither limited nor split, the card is no shared link
+    if (pkgi_is_card_url(url))
+        return std::make_unique<CardHttp>();
+    const auto make_connection = [this]() -> std::unique_ptr<Http> {
+        if (http_trace)
+            return std::make_unique<RecordingHttp>(
+                    std::make_unique<VitaHttp>(), http_trace);
+        return std::make_unique<VitaHttp>();
     };
+    if (connections > 1)
+        return limit(
+                job,
+                std::make_unique<SegmentedHttp>(make_connection, connections));
+    else
+        return limit(job, make_connection());
+}
+
+bool Downloader::do_download_package(Job& job)
+{
+    const auto& item = job.item;
+
+    const auto card_url = card_package_url(item);
+    if (!card_url.empty())
+    {
+        LOGF("installing {} from {}", item.name, card_url);
+        return do_download_package_from(job, card_url);
+    }
+
+    // the package is downloaded here when the PC can't prepare it
+    if (!offload_url.empty() && !item.repair)
+    {
+        try
+        {
+            return do_offload_package(job);
+        }
+        catch (const std::exception& e)
+        {
+            if (job.cancel || _dying)
+                throw;
+            LOGF("offload of {} failed, downloading it: {}",
+                 item.name,
+                 e.what());
+        }
+    }
+
+    // the fastest mirror first, the download resumes from the next one when
+    // it fails
+    std::vector<std::string> urls{item.url};
+    urls.insert(urls.end(), item.mirrors.begin(), item.mirrors.end());
+    if (urls.size() > 1)
+        urls = MirrorRace::rank(
+                urls, [] { return std::make_unique<VitaHttp>(); });
+    // a peer is closer than any mirror, the digest check at the end of the
+    // download guards against a bad one
+    if (peers && !item.digest.empty())
+    {
+        const auto peer_url = peers->find(item.content, item.digest);
+        if (!peer_url.empty())
+        {
+            LOGF("{} is on the LAN at {}", item.name, peer_url);
+            urls.insert(urls.begin(), peer_url);
+        }
+    }
+
+    for (size_t i = 0;; ++i)
+    {
+        try
+        {
+            return do_download_package_from(job, urls[i]);
+        }
+        catch (const HttpError& e)
+        {
+            if (i + 1 == urls.size() || job.cancel || _dying)
+                throw;
+            LOGF("download from {} failed, going on with {}: {}",
+                 urls[i],
+                 urls[i + 1],
+                 e.what());
+        }
+    }
+}
+
+bool Downloader::do_download_package_from(Job& job, const std::string& url)
+{
+    const auto& item = job.item;
 
     ScopeProcessLock _;
     LOG("downloading %s", item.name.c_str());
-    auto download = std::make_unique<Download>(std::make_unique<VitaHttp>());
+    const auto low_memory = memory && memory->low_memory();
+    const auto connections = pkgi_is_card_url(url) || low_memory
+                                     ? size_t(1)
+                                     : connections_for(item);
+    LOGF("{} connections for {}", connections, item.name);
+    const auto buffer_size =
+            low_memory ? LOW_MEMORY_BUFFER_SIZE : buffer_size_for(item);
+    // the caches make room before the buffers are allocated
+    MemoryBudget::Reservation reservation;
+    if (memory)
+        reservation =
+                memory->reserve(download_memory(item, url, buffer_size));
+    auto download =
+            std::make_unique<Download>(make_http(job, connections, url));
+    download->http_factory = [this, &job, connections, url] {
+        return make_http(job, connections, url);
+    };
     download->save_as_iso = item.save_as_iso;
-    download->update_progress_cb = [this](uint64_t download_offset,
-                                          uint64_t download_size) {
-        _download_offset = download_offset;
-        _download_size = download_size;
+    download->iso_format = item.iso_format;
+    download->repair = item.repair;
+    download->chunk_hashes = chunk_hashes_for(job);
+    if (peers && !item.repair && !item.digest.empty() &&
+        !pkgi_is_card_url(url))
+        download->keep_path =
+                PeerCache::keep_path(keep_partition(item), item.content);
+    download->stats = &job.stats;
+    download->suspend_gate = &_suspend_gate;
+    {
+        ScopeLock _(_cond.get_mutex());
+        download->reserved_space = reserved_space(item.partition, &job);
+        job.download = download.get();
+    }
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        ScopeLock _(_cond.get_mutex());
+        job.download = nullptr;
+    };
+    // a package admitted before its footprint was known reserves it once its
+    // head is in
+    download->on_footprint = [&job](uint64_t footprint) {
+        if (job.footprint == 0)
+        {
+            job.footprint = footprint;
+            job.reserved = footprint;
+        }
     };
-    download->update_status = [](auto&&) {};
-    download->is_canceled = [this] { return _cancel_current || _dying; };
+    // failed and canceled downloads too, they are the ones worth a look
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        job.reconnects = download->reconnects;
+        LOGF("stages of {}:\n{}",
+             item.name,
+             pkgi_format_stage_totals(job.stats.totals()));
+        pkgi_poll_memory_pools();
+        LOGF("memory after {}:\n{}",
+             item.name,
+             pkgi_format_mem_totals(pkgi_mem_totals()));
+    };
+    // a game can't go in place, it would look installed while it downloads,
+    // unless it is installed already
+    if (item.type == PspDlc || is_repaired_in_place(item))
+        download->content_root = pkgi_installed_folder(item);
+    download->writer.set_buffer_size(buffer_size);
+    download->update_progress_cb =
+            [this, &job](uint64_t download_offset, uint64_t download_size) {
+                update_progress(job, download_offset, download_size);
+            };
+    download->update_status = [this, &job](const std::string& status) {
+        if (status == "Paused")
+        {
+            job.status.speed = 0;
+            job.status.eta = 0;
+            set_stage(job, DownloadStage::Paused);
+        }
+        else if (job.status.stage == DownloadStage::Paused)
+        {
+            // the pause isn't a slow second
+            job.speed_time = pkgi_time_msec();
+            set_stage(job, DownloadStage::Downloading);
+        }
+    };
+    download->is_canceled = [this, &job] { return job.cancel || _dying; };
+    download->is_paused = [&job] { return job.pause.load(); };
     if (!download->pkgi_download(
                 item.partition.c_str(),
                 item.content.c_str(),
-                item.url.c_str(),
+                url.c_str(),
                 item.rif.empty() ? nullptr : item.rif.data(),
                 item.digest.empty() ? nullptr : item.digest.data()))
-        return;
+        return false;
+    if (download->kept)
+        peers->add(download->keep_path, item.content, item.digest);
     LOG("download of %s completed!", item.name.c_str());
-    switch (item.type)
+    return true;
+}
+
+bool Downloader::do_offload_package(Job& job)
+{
+    const auto& item = job.item;
+
+    ScopeProcessLock _;
+    LOGF("offloading {} to {}", item.name, offload_url);
+    OffloadDownload offload;
+    offload.http_factory = [this, &job] {
+        return limit(job, std::make_unique<VitaHttp>());
+    };
+    offload.workers = connections;
+    offload.update_progress_cb =
+            [this, &job](uint64_t download_offset, uint64_t download_size) {
+                update_progress(job, download_offset, download_size);
+            };
+    offload.is_canceled = [this, &job] { return job.cancel || _dying; };
+
+    // where Download would have written the files
+    const auto root =
+            item.type == PspDlc
+                    ? pkgi_installed_folder(item)
+                    : fmt::format("{}pkgj/{}", item.partition, item.content);
+    if (!offload.mirror(
+                offload_url,
+                item.content,
+                item.save_as_iso ? pkgi_iso_format_name(item.iso_format)
+                                 : "pkg",
+                item.digest,
+                item.rif,
+                root))
+        return false;
+    LOG("offload of %s completed!", item.name.c_str());
+    return true;
+}
+
+std::optional<ChunkHashes> Downloader::chunk_hashes_for(Job& job)
+{
+    const auto& item = job.item;
+    if (auto hashes = pkgi_load_chunk_hashes(
+                pkgi_chunk_hashes_path(item.partition, item.content)))
+        return hashes;
+
+    auto url = chunks_url;
+    const auto pos = url.find("{content}");
+    if (pos == std::string::npos)
+        return std::nullopt;
+    url.replace(pos, sizeof("{content}") - 1, item.content);
+
+    // they only make the download quicker to check, it goes on without them
+    try
     {
-    case Game:
-    case Dlc:
-        pkgi_install(item.content.c_str());
-        break;
-    case Patch:
-        pkgi_install_update(item.content.c_str());
-        break;
-    case PspGame:
-        if (item.save_as_iso)
-            pkgi_install_pspgame_as_iso(
-                    item.partition.c_str(), item.content.c_str());
-        else
-            pkgi_install_pspgame(item.partition.c_str(), item.content.c_str());
-        break;
-    case PspDlc:
-        pkgi_install_pspdlc(item.partition.c_str(), item.content.c_str());
-        break;
-    case PsmGame:
-        pkgi_install_psmgame(item.content.c_str());
-        break;
-    case PsxGame:
-        pkgi_install_pspgame(item.partition.c_str(), item.content.c_str());
-        break;
-    case CompPackBase:
-    case CompPackPatch:
-        throw std::runtime_error(
-                "声明错误: 无法处理兼容包的压缩文件");
+        return pkgi_fetch_chunk_hashes(
+                *limit(job, std::make_unique<VitaHttp>()), url);
+    }
+    catch (const HttpError& e)
+    {
+        LOGF("no chunk hashes for {}: {}", item.content, e.what());
+        return std::nullopt;
     }
-    pkgi_rm(fmt::format("{}pkgj/{}.resume", item.partition, item.content)
-                    .c_str());
-    pkgi_delete_dir(fmt::format("{}pkgj/{}", item.partition, item.content));
-    LOG("install of %s completed!", item.name.c_str());
 }
 
-void Downloader::do_download_comppack(const DownloadItem& item)
+bool Downloader::do_download_comppack(Job& job)
 {
-    BOOST_SCOPE_EXIT_ALL(&)
-    {
-        refresh("");
-    };
+    const auto& item = job.item;
 
     ScopeProcessLock _;
     LOGF("downloading comppack {}", item.url);
-    auto download =
-            std::make_unique<FileDownload>(std::make_unique<VitaHttp>());
-
-    download->update_progress_cb = [this](uint64_t download_offset,
-                                          uint64_t download_size) {
-        _download_offset = download_offset;
-        _download_size = download_size;
+    auto download = std::make_unique<FileDownload>(
+            limit(job, std::make_unique<VitaHttp>()));
+    download->http_factory = [this, &job] {
+        return limit(job, std::make_unique<VitaHttp>());
+    };
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        job.reconnects = download->reconnects;
     };
-    download->is_canceled = [this] { return _cancel_current || _dying; };
+    // extracted as it comes, the install only writes its version
+    ZipStreamExtractor extractor(pkgi_begin_comppack_install(
+            item.content, item.type == CompPackPatch));
 
-    download->download(
-            item.partition.c_str(), item.content.c_str(), item.url.c_str());
+    download->update_progress_cb =
+            [this, &job](uint64_t download_offset, uint64_t download_size) {
+                update_progress(job, download_offset, download_size);
+            };
+    download->is_canceled = [this, &job] { return job.cancel || _dying; };
+
+    download->stream(item.url, [&](const uint8_t* data, uint32_t size) {
+        extractor.write(data, size);
+    });
+    extractor.finish();
     LOGF("download of comppack {} completed!", item.url);
-    pkgi_install_comppack(
+    return true;
+}
+
+bool Downloader::do_download(Job& job)
+{
+    if (job.item.type == CompPackBase || job.item.type == CompPackPatch)
+        return do_download_comppack(job);
+    else
+        return do_download_package(job);
+}
+
+void Downloader::install_package(const DownloadItem& item)
+{
+    // the files were written where they belong, only the temporary folder
+    // is left to drop
+    if (is_repaired_in_place(item))
+        LOG("%s repaired in place", item.name.c_str());
+    else
+    {
+        switch (item.type)
+        {
+        case Game:
+        case Dlc:
+            pkgi_install(item.content.c_str());
+            break;
+        case Patch:
+            pkgi_install_update(item.content.c_str());
+            break;
+        case PspGame:
+            if (item.save_as_iso)
+                pkgi_install_pspgame_as_iso(
+                        item.partition.c_str(),
+                        item.content.c_str(),
+                        item.iso_format);
+            else
+                pkgi_install_pspgame(
+                        item.partition.c_str(), item.content.c_str());
+            break;
+        case PspDlc:
+            pkgi_install_pspdlc(item.partition.c_str(), item.content.c_str());
+            break;
+        case PsmGame:
+            pkgi_install_psmgame(item.content.c_str());
+            break;
+        case PsxGame:
+            pkgi_install_pspgame(item.partition.c_str(), item.content.c_str());
+            break;
+        case CompPackBase:
+        case CompPackPatch:
+            throw std::runtime_error(
+                    "声明错误: 无法处理兼容包的压缩文件");
+        }
+    }
+    ResumeJournal::remove(
+            fmt::format("{}pkgj/{}.resume", item.partition, item.content));
+    pkgi_trash_dir(fmt::format("{}pkgj/{}", item.partition, item.content));
+    LOG("install of %s completed!", item.name.c_str());
+}
+
+void Downloader::install_comppack(const DownloadItem& item)
+{
+    pkgi_end_comppack_install(
             item.content, item.type == CompPackPatch, item.version);
-    pkgi_rm(fmt::format("{}pkgj/{}-comp.ppk", item.partition, item.content)
-                    .c_str());
     LOG("install of %s completed!", item.name.c_str());
 }
 
-void Downloader::do_download(const DownloadItem& item)
+void Downloader::install(const DownloadItem& item)
 {
     if (item.type == CompPackBase || item.type == CompPackPatch)
-        do_download_comppack(item);
+        install_comppack(item);
     else
-        do_download_package(item);
+        install_package(item);
 }
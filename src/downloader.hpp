@@ -1,13 +1,31 @@
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <optional>
-#include <tuple>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "download.hpp"
+#include "downloadhistory.hpp"
+#include "http.hpp"
+#include "httptrace.hpp"
+#include "isocompressor.hpp"
+#include "memorybudget.hpp"
+#include "peercache.hpp"
+#include "ratelimiter.hpp"
+#include "speedestimator.hpp"
+#include "stagestats.hpp"
+#include "storageprobe.hpp"
+#include "suspendgate.hpp"
 #include "thread.hpp"
+#include "triplebuffer.hpp"
+#include "uievents.hpp"
 
 enum Type
 {
@@ -34,13 +52,82 @@ struct DownloadItem
     std::string partition;
     // only used by compatibility packs
     std::string version;
+    // of the package, 0 when unknown, the quicker ones are downloaded first
+    uint64_t size = 0;
+    // raised by Downloader::prioritize(), the higher ones are downloaded first
+    int priority = 0;
+    // only the missing or damaged files are downloaded, in the folder of the
+    // installed item when there is one, see Download::repair
+    bool repair = false;
+    // of a PSP game saved as an ISO
+    IsoFormat iso_format = IsoFormat::Iso;
+    // other urls of the package, from the other repositories, raced against
+    // url when the download starts, see MirrorRace
+    std::vector<std::string> mirrors;
 };
 
-std::string type_to_string(Type type);
+const char* type_to_string(Type type);
+// the folder item is installed to, empty for the ones whose files aren't kept
+// as downloaded, a PSP game saved as an ISO doesn't keep its EBOOT.PBP
+std::string pkgi_installed_folder(const DownloadItem& item);
 
+enum class DownloadStage : uint8_t
+{
+    Idle,
+    Downloading,
+    // see Downloader::toggle_pause()
+    Paused,
+    Installing,
+};
+
+// What the tail shows about the current download, a plain struct so that
+// reading it allocates nothing
+struct DownloadStatus
+{
+    DownloadStage stage;
+    Type type;
+    // hash of the content id
+    size_t content_hash;
+    // cut at a character boundary if too long
+    char name[192];
+    uint64_t offset;
+    uint64_t size;
+    // bytes per second, averaged over the last seconds
+    uint64_t speed;
+    // seconds left at that speed, 0 when unknown
+    uint64_t eta;
+    // Wi-Fi signal at the last speed sample, 0 when unknown
+    int32_t signal_dbm;
+    // where the time of a package download went so far
+    StageTotals stages;
+};
+
+// Runs up to jobs downloads at once, each on a thread of its own. The queue
+// is served by priority, then shortest first, then in the order the items
+// were added, so that a big game doesn't hold back the patches and
+// compatibility packs queued after it. How long an item takes is guessed
+// from its size and the past speed of its host. A finished download is
+// handed to the install thread, which the promoter needs anyway as it
+// installs one package at a time, and the job goes on with the next download
+// meanwhile. The items of a same title wait for each other, so that a patch
+// is never installed before its game.
 class Downloader
 {
 public:
+    // threads created up front, jobs can't be more
+    static constexpr size_t MAX_JOBS = 4;
+    // http slots the downloads may use at once, the refresh and the update
+    // checks need the rest
+    static constexpr size_t HTTP_SLOTS = 4;
+    // servers of the next queued items that get a connection warmed up while
+    // a download runs, so that the next one starts right away
+    static constexpr size_t PREWARM_HOSTS = 2;
+    // queued packages whose head is checked at a time while a download runs,
+    // see pkgi_inspect_package
+    static constexpr size_t INSPECTED_ITEMS = 4;
+    // of the write-behind buffers of the downloads started in low memory
+    static constexpr uint32_t LOW_MEMORY_BUFFER_SIZE = 64 * 1024;
+
     Downloader(const Downloader&) = delete;
     Downloader(Downloader&&) = delete;
     Downloader& operator=(const Downloader&) = delete;
@@ -52,29 +139,242 @@ public:
     void add(const DownloadItem& d);
     void remove_from_queue(Type type, const std::string& contentid);
     bool is_in_queue(Type type, const std::string& titleid);
-    std::optional<DownloadItem> get_current_download();
-    std::tuple<uint64_t, uint64_t> get_current_download_progress();
+    // moves a queued item before all the others, with the items of its title
+    // it must wait for
+    void prioritize(Type type, const std::string& contentid);
+    // pauses or unpauses a running download. A paused one keeps its state in
+    // memory and gives its connections and bandwidth up to the others, it
+    // goes on where it stopped once unpaused and keeps its job meanwhile.
+    // False when the item isn't downloading
+    bool toggle_pause(Type type, const std::string& contentid);
+    // loads the queue saved in path by the last run, if any, and saves it
+    // there from now on each time it changes
+    void restore_queue(const std::string& path);
+    // the last status published by the thread of slot, must only be called
+    // from the main thread, it never waits for the download threads
+    const DownloadStatus& get_status(size_t slot)
+    {
+        return _jobs[slot].published_status.read();
+    }
+    // same for the install thread
+    const DownloadStatus& get_install_status()
+    {
+        return _published_install_status.read();
+    }
+    // the size of the items waiting in the queue, the ones of unknown size
+    // aren't counted, so that the main thread can tell when they'll all be
+    // downloaded
+    uint64_t get_queued_bytes() const
+    {
+        return _queued_bytes.load(std::memory_order_relaxed);
+    }
+
+    // downloads run at once, clamped to [1, MAX_JOBS] and so that their
+    // connections fit in HTTP_SLOTS
+    void set_jobs(size_t jobs);
+    // in bytes per second, of all the downloads together and of each of
+    // them, 0 is unlimited. The list refreshes and the update checks don't
+    // count, they get what the downloads leave
+    void set_speed_limits(uint64_t total, uint64_t per_job);
+    // while paused no download starts, the running ones go on to their end
+    void set_paused(bool paused);
 
-    std::function<void(const std::string& content)> refresh;
     std::function<void(const std::string& error)> error;
+    // when set, told of each download that ends, it must outlive the
+    // downloader
+    UiEvents* events = nullptr;
+
+    // number of Range connections used for package downloads
+    size_t connections = 1;
+    // where the chunk hashes of the packages are fetched from, {content} is
+    // replaced, empty to only use the ones built by earlier downloads. See
+    // ChunkHashes
+    std::string chunks_url;
+    // http://host:port of a PC running pkgj_cli serve, which prepares the
+    // packages for the downloads to only mirror them, empty to download them
+    // here. See OffloadDownload
+    std::string offload_url;
+    // when set, the packages with a digest are fetched from the other PKGj
+    // on the LAN that have them, and kept on the card to be shared in turn
+    PeerCache* peers = nullptr;
+    // size of the write-behind buffers of package downloads
+    uint32_t write_buffer_size = 1024 * 1024;
+    // when set, the write-behind buffer of each download is sized from the
+    // probe of its partition instead, and the copy kept for the peers goes to
+    // the card that writes the fastest. It must outlive the downloader
+    StorageProbe* storage = nullptr;
+    // when set, each package download reserves its buffers in it for as
+    // long as it runs, and starts with a single connection and small
+    // buffers in low memory. It must outlive the downloader
+    MemoryBudget* memory = nullptr;
+    // when set, the connections of the package downloads are recorded in
+    // it, it must outlive the downloader
+    HttpTraceWriter* http_trace = nullptr;
+    // keeps the Wi-Fi out of its power save while a download runs, it slows
+    // down the transfers between its bursts
+    bool hold_wifi = false;
+    // when set, every download that ends is added to it, it must outlive the
+    // downloader. The speeds of the past downloads of a host are the first
+    // guess of the next ones
+    DownloadHistory* history = nullptr;
+    // a package expected to take less than this is downloaded with a single
+    // connection, the others aren't worth their requests
+    static constexpr uint64_t SHORT_DOWNLOAD_SECONDS = 10;
 
 private:
     using ScopeLock = std::lock_guard<Mutex>;
 
+    struct Job
+    {
+        // empty content when the slot is idle, guarded by the mutex
+        DownloadItem item;
+        std::atomic<bool> cancel{false};
+        std::atomic<bool> pause{false};
+        // the package download running, guarded by the mutex, so that a
+        // cancel or a pause can cut its transfer short
+        Download* download = nullptr;
+        // bytes the package takes once installed, from its inspection or its
+        // head, 0 when unknown, and the part of it not written yet. The
+        // footprint is only touched by the thread of the job
+        uint64_t footprint = 0;
+        std::atomic<uint64_t> reserved{0};
+
+        // only touched by the thread of the job
+        DownloadStatus status{};
+        uint32_t speed_time = 0;
+        uint64_t speed_offset = 0;
+        StageStats stats;
+        TripleBuffer<DownloadStatus> published_status;
+        SpeedEstimator speed;
+        TokenBucket limit{"download_job_limit"};
+        // for the history
+        uint32_t start_time = 0;
+        uint64_t start_offset = 0;
+        std::vector<uint32_t> speed_samples;
+        int64_t signal_sum = 0;
+        uint32_t signal_samples = 0;
+        uint32_t reconnects = 0;
+
+        std::unique_ptr<Thread> thread;
+    };
+
     Cond _cond;
     std::deque<DownloadItem> _queue;
+    // content ids of _queue, with the type they're queued as
+    std::unordered_multimap<std::string, Type> _queued;
+    // the size of the items of _queue, for the main thread
+    std::atomic<uint64_t> _queued_bytes{0};
 
-    DownloadItem _current_download;
-    bool _cancel_current = false;
-    std::atomic<uint64_t> _download_offset = 0;
-    std::atomic<uint64_t> _download_size = 0;
+    // where the queue is saved, empty until restore_queue()
+    std::string _queue_path;
+    // the saves are numbered under the mutex, so that a save that got
+    // behind another one doesn't overwrite it
+    Mutex _save_mutex;
+    uint64_t _save_serial = 0;
+    uint64_t _saved_serial = 0;
 
-    Thread _thread;
+    // raised by the power handler, so that the package downloads save their
+    // state before the system sleeps and go on after it instead of failing
+    // on their dead connections. Before the jobs, whose downloads use it
+    SuspendGate _suspend_gate;
+    std::array<Job, MAX_JOBS> _jobs;
+    size_t _max_jobs = 1;
+    size_t _running = 0;
+    bool _paused = false;
     bool _dying = false;
+    // shared by the connections of all the jobs
+    TokenBucket _limit{"download_limit"};
+
+    // downloaded items waiting for the install thread, and the one it
+    // installs, guarded by the mutex
+    std::deque<DownloadItem> _installs;
+    DownloadItem _installing;
+    // only touched by the install thread
+    DownloadStatus _install_status{};
+    TripleBuffer<DownloadStatus> _published_install_status;
+    std::unique_ptr<Thread> _install_thread;
+    // what the heads of the queued packages told, by content id, guarded by
+    // the mutex
+    std::unordered_map<std::string, PackageInfo> _inspected;
+    std::unique_ptr<Thread> _lookahead_thread;
 
-    void run();
-    void do_download(const DownloadItem& item);
+    void run(Job& job);
+    void run_installs();
+    // warms up the connections of the next items and inspects the queued
+    // packages while the downloads run
+    void run_lookahead();
+    void inspect(const DownloadItem& item);
+    // takes item out of the queue as failed, unless it started meanwhile
+    void fail_queued(const DownloadItem& item, const std::string& message);
+    // The jobs keep a ledger of the space they are still to take: each
+    // reserves the footprint of its package when it starts and gives it back
+    // as it writes. A package starts only when it fits in the free space its
+    // partition has left once the reservations are taken out. A package that
+    // would only fit without them waits in the queue, in case a running one
+    // fails and gives its reservation back. One that doesn't fit at all is
+    // rejected when inspected.
+    //
+    // the bytes item reserves, from what its head told
+    static uint64_t reservation(
+            const DownloadItem& item, const PackageInfo& info);
+    // must be called with the mutex locked, false when item has to wait for
+    // its inspection or for space. free_space caches the free space of each
+    // partition
+    bool fits(
+            const DownloadItem& item,
+            std::unordered_map<std::string, uint64_t>& free_space);
+    // must be called with the mutex locked, the bytes the jobs other than
+    // except are still to write to partition
+    uint64_t reserved_space(const std::string& partition, const Job* except);
+    // must be called with the mutex locked, the queued item to run next among
+    // the first ones of the titles that have nothing running, or _queue.end()
+    std::deque<DownloadItem>::iterator next_item();
+    // must be called with the mutex locked
+    void unqueue(Type type, const std::string& contentid, bool all);
+    // must be called with the mutex locked, after _queue changed
+    void update_queued_bytes();
+    // bytes per second of the past downloads of the host of item, 0 when
+    // unknown
+    uint64_t host_speed(const DownloadItem& item);
+    // must be called with the mutex locked
+    bool is_busy(Type type, const std::string& contentid) const;
+    // writes all the items not installed yet to _queue_path, must be called
+    // without the mutex locked
+    void save_queue();
+    // must be called from the thread of job
+    void release(Job& job);
+    static void fill_status(DownloadStatus& status, const DownloadItem& item);
+    void start_status(Job& job);
+    void update_progress(
+            Job& job, uint64_t download_offset, uint64_t download_size);
+    void set_stage(Job& job, DownloadStage stage);
+    void add_to_history(const Job& job, DownloadResult result);
+    // the number of connections is lowered for the short downloads
+    size_t connections_for(const DownloadItem& item);
+    // see storage
+    uint32_t buffer_size_for(const DownloadItem& item);
+    std::string keep_partition(const DownloadItem& item);
+    // a guess of what the buffers of a package download take
+    static size_t download_memory(
+            const DownloadItem& item,
+            const std::string& url,
+            uint32_t buffer_size);
+    // url is the one the Http will start, see card_package_url()
+    std::unique_ptr<Http> make_http(
+            Job& job, size_t connections, const std::string& url);
+    // wraps http so that it keeps to the limits of job and of all the jobs
+    std::unique_ptr<Http> limit(Job& job, std::unique_ptr<Http> http);
+    // false if the download didn't finish
+    bool do_download(Job& job);
 
-    void do_download_package(const DownloadItem& item);
-    void do_download_comppack(const DownloadItem& item);
+    bool do_download_package(Job& job);
+    bool do_download_package_from(Job& job, const std::string& url);
+    bool do_offload_package(Job& job);
+    // the ones saved by an earlier download of the package, else the ones of
+    // chunks_url, nullopt when there are none
+    std::optional<ChunkHashes> chunk_hashes_for(Job& job);
+    bool do_download_comppack(Job& job);
+    void install(const DownloadItem& item);
+    void install_package(const DownloadItem& item);
+    void install_comppack(const DownloadItem& item);
 };
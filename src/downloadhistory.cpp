@@ -0,0 +1,241 @@
+#include "downloadhistory.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace
+{
+// the fields of a record before the stages
+constexpr size_t FIXED_FIELDS = 10;
+
+uint64_t to_uint(const std::string& field)
+{
+    return std::strtoull(field.c_str(), nullptr, 10);
+}
+
+// the fields added after the stages are written as name=value, so that they
+// aren't taken for a stage by the versions that have more of them
+constexpr char SIGNAL_FIELD[] = "signal_dbm=";
+
+// the fixed fields and the stages, the stages go last so that a new one only
+// makes the lines longer
+std::string format_fields(const DownloadRecord& record)
+{
+    std::string line = fmt::format(
+            "{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}",
+            record.time,
+            record.content,
+            record.host,
+            download_result_name(record.result),
+            record.bytes,
+            record.msec,
+            record.average,
+            record.p5,
+            record.p95,
+            record.reconnects);
+    for (const auto msec : record.stage_msec)
+        line += fmt::format("\t{}", msec);
+    return line;
+}
+
+// one line of the file
+std::string format_record(const DownloadRecord& record)
+{
+    return fmt::format(
+            "{}\t{}{}", format_fields(record), SIGNAL_FIELD, record.signal_dbm);
+}
+
+bool parse_record(const std::string& line, DownloadRecord& record)
+{
+    const auto fields = pkgi_split(line, '\t');
+    if (fields.size() < FIXED_FIELDS)
+        return false;
+
+    record.time = std::strtoll(fields[0].c_str(), nullptr, 10);
+    record.content = fields[1];
+    record.host = fields[2];
+    if (fields[3] == download_result_name(DownloadResult::Done))
+        record.result = DownloadResult::Done;
+    else if (fields[3] == download_result_name(DownloadResult::Canceled))
+        record.result = DownloadResult::Canceled;
+    else
+        record.result = DownloadResult::Failed;
+    record.bytes = to_uint(fields[4]);
+    record.msec = to_uint(fields[5]);
+    record.average = to_uint(fields[6]);
+    record.p5 = to_uint(fields[7]);
+    record.p95 = to_uint(fields[8]);
+    record.reconnects = to_uint(fields[9]);
+    // written by a version with other stages, they line up as far as they go
+    size_t i = FIXED_FIELDS;
+    for (; i < fields.size() && fields[i].find('=') == std::string::npos; ++i)
+        if (i - FIXED_FIELDS < STAGE_COUNT)
+            record.stage_msec[i - FIXED_FIELDS] = to_uint(fields[i]);
+    for (; i < fields.size(); ++i)
+        if (fields[i].compare(0, sizeof(SIGNAL_FIELD) - 1, SIGNAL_FIELD) == 0)
+            record.signal_dbm = std::strtol(
+                    fields[i].c_str() + sizeof(SIGNAL_FIELD) - 1, nullptr, 10);
+    return true;
+}
+}
+
+const char* download_result_name(DownloadResult result)
+{
+    switch (result)
+    {
+    case DownloadResult::Done:
+        return "done";
+    case DownloadResult::Failed:
+        return "failed";
+    case DownloadResult::Canceled:
+        return "canceled";
+    }
+    return "failed";
+}
+
+uint64_t pkgi_percentile(std::vector<uint32_t> samples, uint32_t percent)
+{
+    if (samples.empty())
+        return 0;
+    const auto nth = samples.begin() + (samples.size() - 1) * percent / 100;
+    std::nth_element(samples.begin(), nth, samples.end());
+    return *nth;
+}
+
+std::string pkgi_url_host(const std::string& url)
+{
+    const auto scheme = url.find("://");
+    if (scheme == std::string::npos)
+        return {};
+    const auto start = scheme + 3;
+    const auto end = url.find_first_of(":/?", start);
+    return url.substr(start, end == std::string::npos ? end : end - start);
+}
+
+DownloadHistory::DownloadHistory(std::string path)
+    : _path(std::move(path)), _mutex("download_history_mutex")
+{
+}
+
+void DownloadHistory::load()
+{
+    if (_loaded)
+        return;
+    _loaded = true;
+
+    if (!pkgi_file_exists(_path))
+        return;
+
+    try
+    {
+        const auto data = pkgi_load(_path);
+        const auto lines =
+                pkgi_split(std::string(data.begin(), data.end()), '\n');
+        for (const auto& line : lines)
+        {
+            if (line.empty())
+                continue;
+            ++_lines;
+            DownloadRecord record;
+            if (parse_record(line, record))
+                _records.push_back(std::move(record));
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOGF_ERROR("can't read download history: {}", e.what());
+    }
+
+    if (_records.size() > MAX_RECORDS)
+        _records.erase(
+                _records.begin(), _records.end() - MAX_RECORDS);
+}
+
+void DownloadHistory::add(const DownloadRecord& record)
+{
+    ScopeLock _(_mutex);
+    load();
+
+    _records.push_back(record);
+    if (_records.size() > MAX_RECORDS)
+        _records.erase(_records.begin());
+
+    try
+    {
+        if (_lines + 1 < 2 * MAX_RECORDS)
+        {
+            const auto line = format_record(record) + '\n';
+            const auto file = pkgi_append(_path.c_str());
+            if (!file)
+                throw formatEx<std::runtime_error>("can't open {}", _path);
+            const auto written = pkgi_write(file, line.data(), line.size());
+            pkgi_close(file);
+            if (written != static_cast<int>(line.size()))
+                throw formatEx<std::runtime_error>("can't write {}", _path);
+            ++_lines;
+        }
+        else
+        {
+            std::string text;
+            for (const auto& r : _records)
+                text += format_record(r) + '\n';
+            pkgi_save(_path, text.data(), text.size());
+            _lines = _records.size();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOGF_ERROR("can't save download history: {}", e.what());
+    }
+}
+
+std::vector<DownloadRecord> DownloadHistory::records()
+{
+    ScopeLock _(_mutex);
+    load();
+    return _records;
+}
+
+uint64_t DownloadHistory::host_speed(const std::string& host)
+{
+    ScopeLock _(_mutex);
+    load();
+
+    uint64_t bytes = 0;
+    uint64_t msec = 0;
+    for (const auto& record : _records)
+        if (record.result == DownloadResult::Done && record.host == host)
+        {
+            bytes += record.bytes;
+            msec += record.msec;
+        }
+    return msec ? bytes * 1000 / msec : 0;
+}
+
+void DownloadHistory::export_to(
+        const std::string& path, const std::string& system)
+{
+    const auto records = this->records();
+
+    std::string text =
+            "system\ttime\tcontent\thost\tresult\tbytes\tmsec\t"
+            "average_bps\tp5_bps\tp95_bps\treconnects";
+    for (size_t i = 0; i < STAGE_COUNT; ++i)
+        text += fmt::format("\t{}_msec", stage_id(static_cast<Stage>(i)));
+    text += "\tsignal_dbm\n";
+
+    for (const auto& record : records)
+        text += fmt::format(
+                "{}\t{}\t{}\n",
+                system,
+                format_fields(record),
+                record.signal_dbm);
+
+    pkgi_save(path, text.data(), text.size());
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "stagestats.hpp"
+#include "thread.hpp"
+
+#include <array>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+enum class DownloadResult : uint8_t
+{
+    Done,
+    Failed,
+    Canceled,
+};
+
+const char* download_result_name(DownloadResult result);
+
+// what is left of a download once it ended
+struct DownloadRecord
+{
+    // seconds since the epoch, at the end
+    int64_t time = 0;
+    std::string content;
+    // of the url, to tell the CDNs apart
+    std::string host;
+    DownloadResult result = DownloadResult::Done;
+    // received during this run, a resumed download doesn't count the bytes
+    // of the runs before
+    uint64_t bytes = 0;
+    uint32_t msec = 0;
+    // bytes per second, the percentiles are over the one second samples
+    uint64_t average = 0;
+    uint64_t p5 = 0;
+    uint64_t p95 = 0;
+    uint32_t reconnects = 0;
+    // time spent in each stage, in milliseconds
+    std::array<uint32_t, STAGE_COUNT> stage_msec{};
+    // average Wi-Fi signal, 0 when unknown
+    int32_t signal_dbm = 0;
+};
+
+// bytes per second of samples at percent, 0 when there is none
+uint64_t pkgi_percentile(std::vector<uint32_t> samples, uint32_t percent);
+// the host of url, empty if it has none
+std::string pkgi_url_host(const std::string& url);
+
+// The last records, kept in a tab separated file of which only the
+// MAX_RECORDS last lines are kept. Records are appended as downloads end and
+// the file is rewritten once it's twice as long. The jobs add to it from
+// their threads.
+class DownloadHistory
+{
+public:
+    static constexpr size_t MAX_RECORDS = 200;
+
+    DownloadHistory(const DownloadHistory&) = delete;
+    DownloadHistory& operator=(const DownloadHistory&) = delete;
+
+    explicit DownloadHistory(std::string path);
+
+    // failures are only logged, the history is not worth failing a download
+    void add(const DownloadRecord& record);
+    // oldest first
+    std::vector<DownloadRecord> records();
+    // bytes per second of the downloads of host that went through, 0 when
+    // there is none
+    uint64_t host_speed(const std::string& host);
+    // writes the records to path with a header line, for the spreadsheets.
+    // system is written on each line, so that the exports of several
+    // consoles can be put together
+    void export_to(const std::string& path, const std::string& system);
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    std::string _path;
+
+    Mutex _mutex;
+    bool _loaded = false;
+    // lines in the file, may be more than _records
+    size_t _lines = 0;
+    std::vector<DownloadRecord> _records;
+
+    // must be called with the mutex locked
+    void load();
+};
@@ -0,0 +1,58 @@
+#include "downloadschedule.hpp"
+
+#include "log.hpp"
+
+#include <cstdlib>
+
+namespace
+{
+int parse_hour(const std::string& text)
+{
+    char* end;
+    const auto hour = std::strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != 0 || hour < 0 || hour > 24)
+        throw formatEx<std::runtime_error>("bad hour \"{}\"", text);
+    return hour;
+}
+}
+
+DownloadSchedule pkgi_parse_download_schedule(
+        const std::string& hours, bool when_charging)
+{
+    DownloadSchedule schedule;
+    schedule.when_charging = when_charging;
+
+    size_t pos = 0;
+    while (pos < hours.size())
+    {
+        auto end = hours.find(',', pos);
+        if (end == std::string::npos)
+            end = hours.size();
+        std::string range = hours.substr(pos, end - pos);
+        pos = end + 1;
+
+        range.erase(0, range.find_first_not_of(' '));
+        range.erase(range.find_last_not_of(' ') + 1);
+        if (range.empty())
+            continue;
+
+        const auto dash = range.find('-');
+        if (dash == std::string::npos)
+        {
+            schedule.hours.set(parse_hour(range) % 24);
+            continue;
+        }
+        const auto first = parse_hour(range.substr(0, dash));
+        const auto last = parse_hour(range.substr(dash + 1));
+        if (first == last)
+            throw formatEx<std::runtime_error>("empty range \"{}\"", range);
+        // "0-24" is the whole day
+        int hour = first % 24;
+        do
+        {
+            schedule.hours.set(hour);
+            hour = (hour + 1) % 24;
+        } while (hour != last % 24);
+    }
+    return schedule;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <bitset>
+#include <string>
+
+// When the download queue may run: during the hours of the day listed, and
+// while charging if when_charging is set. With no hours and when_charging
+// unset it always runs.
+struct DownloadSchedule
+{
+    // local hours, hours[h] allows from h:00 to h:59
+    std::bitset<24> hours;
+    bool when_charging = false;
+
+    bool allows(int hour, bool charging) const
+    {
+        if (hours.none() && !when_charging)
+            return true;
+        return hours[hour] || (when_charging && charging);
+    }
+};
+
+// hours is a comma separated list of ranges such as "23-7,12-13", each one
+// from its first hour to before its last and wrapping at midnight, a single
+// hour such as "3" is that hour only. Throws on a malformed list
+DownloadSchedule pkgi_parse_download_schedule(
+        const std::string& hours, bool when_charging);
@@ -38,13 +38,13 @@ void pkgi_extract_zip(const std::string& zip_file, const std::string& dest)
         std::string path = stat.name;
         if (path[path.size() - 1] == '/')
         {
-            LOGF("creating directory {}", path);
+            LOGF_DEBUG("creating directory {}", path);
             path.substr(0, path.size() - 1);
             pkgi_mkdirs((dest + '/' + path).c_str());
         }
         else
         {
-            LOGF("uncompressing file {}", path);
+            LOGF_DEBUG("uncompressing file {}", path);
             const auto comp_fd = zip_fopen_index(zip_fd, i, 0);
             if (!comp_fd)
                 throw formatEx<std::runtime_error>(
@@ -6,9 +6,14 @@
 #include <cstdint>
 
 void pkgi_mkdirs(const char* path);
+// makes path, whose parent must exist, doesn't fail if it's already there
+void pkgi_mkdir(const char* path);
 void pkgi_rm(const char* file);
 void pkgi_delete_dir(const std::string& path);
 int64_t pkgi_get_size(const char* path);
+// modification time of path as a number that grows with time, 0 if path
+// can't be stat'ed
+uint64_t pkgi_get_mtime(const std::string& path);
 
 enum class InodeType
 {
@@ -23,6 +28,8 @@ void pkgi_rename(const std::string& from, const std::string& to);
 
 // creates file (if it exists, truncates size to 0)
 void* pkgi_create(const std::string& path);
+// open existing file for reading, fails if file does not exist
+void* pkgi_open(const char* path);
 // open existing file in read/write, fails if file does not exist
 void* pkgi_openrw(const char* path);
 // open file for writing, next write will append data to end of it
@@ -33,6 +40,9 @@ void pkgi_close(void* f);
 int64_t pkgi_seek(void* f, uint64_t offset);
 int pkgi_read(void* f, void* buffer, uint32_t size);
 int pkgi_write(void* f, const void* buffer, uint32_t size);
+// grows f to size before it gets written so that the file system can allocate
+// it contiguously, failures are only logged
+void pkgi_preallocate(void* f, uint64_t size);
 
 std::vector<uint8_t> pkgi_load(const std::string& path);
 void pkgi_save(const std::string& path, const void* data, uint32_t size);
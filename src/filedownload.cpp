@@ -9,13 +9,22 @@
 
 #include <boost/scope_exit.hpp>
 
-#include <cereal/archives/binary.hpp>
-
-#include <fstream>
+#include <algorithm>
 
 #include <cstddef>
 
-FileDownload::FileDownload(std::unique_ptr<Http> http) : _http(std::move(http))
+static constexpr uint32_t MIN_CHUNK_SIZE = 64 * 1024;
+static constexpr uint32_t MAX_CHUNK_SIZE = 1024 * 1024;
+// a chunk read faster than this doubles the next ones, slower than
+// SLOW_CHUNK_TIME halves them
+static constexpr uint32_t FAST_CHUNK_TIME = 250;
+static constexpr uint32_t SLOW_CHUNK_TIME = 1000;
+
+FileDownload::FileDownload(std::unique_ptr<Http> http)
+    : _http(std::move(http))
+    , _buffer(MAX_CHUNK_SIZE)
+    , _chunk_size(MIN_CHUNK_SIZE)
+    , item_file(nullptr)
 {
 }
 
@@ -26,18 +35,47 @@ void FileDownload::update_progress()
 
 void FileDownload::start_download()
 {
-    LOGF("requesting {}", download_url);
-    _http->start(download_url, 0);
+    LOGF_DEBUG("requesting {} @ {}", download_url, download_offset);
+    _http->start(download_url, download_offset);
 
     const auto http_length = _http->get_length();
     if (http_length < 0)
         throw DownloadError("HTTP响应的长度未知");
 
-    download_size = http_length;
-    LOGF("http response length = {}", download_size);
+    if (download_offset != 0 && _http->get_status() != 206)
+    {
+        // a reconnection can't start over, the bytes before went out
+        if (http_started)
+            throw DownloadError("服务器不支持断点续传");
+        LOGF("range ignored, restarting {} from 0", download_url);
+        download_offset = 0;
+    }
+
+    // a file replaced in the meantime would be silently corrupted
+    if (http_started && http_length + download_offset != download_size)
+        throw formatEx<DownloadError>(
+                "服务器上的文件已改变 ({} != {})",
+                http_length + download_offset,
+                download_size);
+
+    download_size = http_length + download_offset;
+    http_started = true;
+    LOGF_DEBUG("http response length = {}, total size = {}",
+               http_length,
+               download_size);
+}
+
+void FileDownload::adapt_chunk_size(uint32_t size, uint32_t elapsed)
+{
+    if (size < _chunk_size)
+        return;
+    if (elapsed < FAST_CHUNK_TIME)
+        _chunk_size = std::min(_chunk_size * 2, MAX_CHUNK_SIZE);
+    else if (elapsed > SLOW_CHUNK_TIME)
+        _chunk_size = std::max(_chunk_size / 2, MIN_CHUNK_SIZE);
 }
 
-void FileDownload::download_data(uint32_t size)
+void FileDownload::download_data(uint32_t size, const WriteFunction& write)
 {
     if (is_canceled())
         throw std::runtime_error("下载已被取消");
@@ -47,29 +85,91 @@ void FileDownload::download_data(uint32_t size)
 
     update_progress();
 
-    std::vector<uint8_t> buffer(size);
+    const auto start = pkgi_time_msec();
+    size_t pos = 0;
+    uint32_t attempt = 0;
+    bool reconnect = false;
+    while (pos < size)
     {
-        size_t pos = 0;
-        while (pos < size)
+        try
         {
-            const int read = _http->read(buffer.data() + pos, size - pos);
+            if (reconnect)
+            {
+                start_download();
+                reconnect = false;
+            }
+
+            const int read = _http->read(_buffer.data() + pos, size - pos);
             if (read == 0)
-                throw DownloadError("HTTP连接已断开");
+                throw HttpError("HTTP连接已断开");
             pos += read;
+            attempt = 0;
+        }
+        catch (const HttpError& e)
+        {
+            // errors on the very first request (bad url, 404...) are not
+            // going to go away by retrying
+            if (!http_factory || !http_started || is_canceled() ||
+                ++attempt > RECONNECT_ATTEMPTS)
+                throw;
+
+            LOGF("http failed at {}, reconnecting ({}/{}): {}",
+                 download_offset + pos,
+                 attempt,
+                 RECONNECT_ATTEMPTS,
+                 e.what());
+            // the bytes read so far are handed out, the new request starts
+            // after them
+            download_offset += pos;
+            write(_buffer.data(), pos);
+            size -= pos;
+            pos = 0;
+            _http = http_factory();
+            ++reconnects;
+            reconnect = true;
+            pkgi_wait_reconnect(attempt, is_canceled);
         }
     }
 
     download_offset += size;
+    adapt_chunk_size(size, pkgi_time_msec() - start);
+
+    write(_buffer.data(), size);
+}
+
+void FileDownload::download_body(const WriteFunction& write)
+{
+    http_started = false;
+    start_download();
 
-    pkgi_write(item_file, buffer.data(), buffer.size());
+    while (download_offset < download_size)
+    {
+        // chunks end on a multiple of the smallest one, so that the writes
+        // to the card stay aligned after a resume
+        const auto end =
+                (download_offset + _chunk_size) & ~uint64_t(MIN_CHUNK_SIZE - 1);
+        const uint32_t read = (uint32_t)min64(
+                end - download_offset, download_size - download_offset);
+        download_data(read, write);
+    }
 }
 
 void FileDownload::download_file()
 {
     LOG("downloading encrypted files");
 
-    LOGF("creating {} file", root);
-    item_file = pkgi_create(root.c_str());
+    const auto partial = pkgi_get_size(root.c_str());
+    if (partial > 0)
+    {
+        LOGF("resuming {} at {}", root, partial);
+        item_file = pkgi_openrw(root.c_str());
+        download_offset = partial;
+    }
+    else
+    {
+        LOGF("creating {} file", root);
+        item_file = pkgi_create(root.c_str());
+    }
     if (!item_file)
         throw formatEx<DownloadError>("无法创建文件 {}", root);
 
@@ -78,16 +178,24 @@ void FileDownload::download_file()
         pkgi_close(item_file);
     };
 
-    start_download();
-
-    static constexpr auto SAVE_PERIOD = 64 * 1024;
-
-    while (download_offset < download_size)
-    {
-        const uint32_t read =
-                (uint32_t)min64(SAVE_PERIOD, download_size - download_offset);
-        download_data(read);
-    }
+    bool positioned = false;
+    download_body([&](const uint8_t* data, uint32_t size) {
+        // the offset is only known once the server said if it takes ranges,
+        // download_offset is already past data
+        if (!positioned)
+        {
+            if (partial > 0 && download_offset == size)
+            {
+                pkgi_close(item_file);
+                item_file = pkgi_create(root.c_str());
+            }
+            else if (pkgi_seek(item_file, download_offset - size) < 0)
+                throw formatEx<DownloadError>("无法恢复下载 {}", root);
+            positioned = true;
+        }
+        if (pkgi_write(item_file, data, size) < 0)
+            throw formatEx<DownloadError>("无法写入文件 {}", root);
+    });
 }
 
 void FileDownload::download(
@@ -95,12 +203,26 @@ void FileDownload::download(
         const std::string& titleid,
         const std::string& url)
 {
-    root = fmt::format("{}pkgj/{}-comp.ppk", partition, titleid);
-    LOGF("temp installation folder: {}", root);
+    const auto path = fmt::format("{}pkgj/{}-comp.ppk", partition, titleid);
+    LOGF("temp installation folder: {}", path);
+    save(path, url);
+}
 
+void FileDownload::save(const std::string& path, const std::string& url)
+{
+    root = path;
     download_size = 0;
     download_offset = 0;
     download_url = url;
 
     download_file();
 }
+
+void FileDownload::stream(const std::string& url, const WriteFunction& write)
+{
+    download_size = 0;
+    download_offset = 0;
+    download_url = url;
+
+    download_body(write);
+}
@@ -4,6 +4,7 @@
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <cstdint>
 
@@ -15,27 +16,49 @@ public:
     std::function<void(uint64_t download_offset, uint64_t download_size)>
             update_progress_cb;
     std::function<bool()> is_canceled;
+    // when set, a stalled or dropped connection is reopened where it stopped
+    std::function<std::unique_ptr<Http>()> http_factory;
+    // the connections that were lost and opened again
+    uint32_t reconnects = 0;
+
+    using WriteFunction = std::function<void(const uint8_t*, uint32_t)>;
 
     FileDownload(std::unique_ptr<Http> http);
 
+    // saves url as <partition>pkgj/<titleid>-comp.ppk, a partial file left by
+    // a previous try is completed with a Range request
     void download(
             const std::string& partition,
             const std::string& titleid,
             const std::string& url);
+    // saves url as path, completing a partial file like download does
+    void save(const std::string& path, const std::string& url);
+    // hands out the body of url to write as it comes, nothing is saved
+    void stream(const std::string& url, const WriteFunction& write);
 
 private:
     std::string root;
 
     std::unique_ptr<Http> _http;
+    // set once a request went through, after that failures are retried
+    bool http_started;
     uint64_t download_size;
     uint64_t download_offset;
     std::string download_url;
 
+    // allocated once, sized for the largest chunk
+    std::vector<uint8_t> _buffer;
+    uint32_t _chunk_size;
+
     void* item_file;
 
     void update_progress();
 
     void start_download();
-    void download_data(uint32_t size);
+    // the chunks grow while the connection keeps up and shrink when it's
+    // slow, so that the progress and the cancel stay responsive
+    void adapt_chunk_size(uint32_t size, uint32_t elapsed);
+    void download_data(uint32_t size, const WriteFunction& write);
+    void download_body(const WriteFunction& write);
     void download_file();
 };
@@ -11,6 +11,7 @@ void FileHttp::start(const std::string& url, uint64_t offset)
     LOGF("Fake downloading {}", url);
     f.open(override_path.empty() ? url : override_path);
     f.seekg(offset, std::ios::beg);
+    _offset = offset;
 }
 
 int64_t FileHttp::read(uint8_t* buffer, uint64_t size)
@@ -25,7 +26,7 @@ void FileHttp::abort()
 
 int FileHttp::get_status()
 {
-    return 200;
+    return _offset ? 206 : 200;
 }
 
 int64_t FileHttp::get_length()
@@ -34,7 +35,8 @@ int64_t FileHttp::get_length()
     f.seekg(0, std::ios::end);
     const uint64_t size = f.tellg();
     f.seekg(pos, std::ios::beg);
-    return size;
+    // like a Range response, the length is what's left from the offset
+    return size - pos;
 }
 
 FileHttp::operator bool() const
@@ -22,4 +22,5 @@ public:
 private:
     std::string override_path;
     std::ifstream f;
+    uint64_t _offset = 0;
 };
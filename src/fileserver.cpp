@@ -0,0 +1,260 @@
+#include "fileserver.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "netsocket.hpp"
+#include "utils.hpp"
+
+#include <fmt/format.h>
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+namespace
+{
+constexpr uint32_t READ_SIZE = 256 * 1024;
+constexpr size_t MAX_REQUEST = 4096;
+// a client that says nothing for this long is dropped
+constexpr uint32_t CLIENT_TIMEOUT_MS = 15 * 1000;
+
+// the value of a header of request, empty when it's missing
+std::string header_value(const std::string& request, const char* name)
+{
+    std::istringstream lines(request);
+    std::string line;
+    const auto size = strlen(name);
+    while (std::getline(lines, line))
+    {
+        if (line.size() > size && line[size] == ':' &&
+            strncasecmp(line.c_str(), name, size) == 0)
+        {
+            auto value = line.substr(size + 1);
+            value.erase(0, value.find_first_not_of(' '));
+            value.erase(value.find_last_not_of("\r ") + 1);
+            return value;
+        }
+    }
+    return {};
+}
+
+// the range of "bytes=start-" and "bytes=start-end", false for the other
+// forms, which are answered with the whole file
+bool parse_range(
+        const std::string& range, uint64_t size, uint64_t& start, uint64_t& end)
+{
+    unsigned long long first = 0;
+    unsigned long long last = 0;
+    if (sscanf(range.c_str(), "bytes=%llu-%llu", &first, &last) == 2)
+        end = std::min<uint64_t>(last + 1, size);
+    else if (sscanf(range.c_str(), "bytes=%llu-", &first) == 1)
+        end = size;
+    else
+        return false;
+    start = first;
+    return true;
+}
+
+const char* status_text(int status)
+{
+    switch (status)
+    {
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Internal Server Error";
+    }
+}
+}
+
+FileServer::FileServer(const char* name, uint16_t port, Handler handler)
+    : _name(name), _handler(std::move(handler)), _cond("file_server_cond")
+{
+    _socket = pkgi_tcp_listen(port);
+    if (_socket < 0)
+    {
+        LOGF("{} can't listen on {}", _name, port);
+        return;
+    }
+    LOGF("{} serving on {}", _name, port);
+    _thread = std::make_unique<Thread>(
+            _name, [this] { run(); }, ThreadRole::Network);
+}
+
+FileServer::~FileServer()
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+    }
+    if (_thread)
+        _thread->join();
+    if (_socket >= 0)
+        pkgi_socket_close(_socket);
+}
+
+bool FileServer::is_dying()
+{
+    ScopeLock _(_cond.get_mutex());
+    return _dying;
+}
+
+void FileServer::run()
+{
+    while (!is_dying())
+    {
+        // the connections that are over are joined, the others may wait
+        // for a free one
+        for (auto it = _connections.begin(); it != _connections.end();)
+        {
+            bool done;
+            {
+                ScopeLock _(_cond.get_mutex());
+                done = it->done;
+            }
+            if (done)
+            {
+                it->thread->join();
+                it = _connections.erase(it);
+            }
+            else
+                ++it;
+        }
+        if (_connections.size() >= MAX_CONNECTIONS)
+        {
+            pkgi_sleep(100);
+            continue;
+        }
+
+        const auto socket = pkgi_tcp_accept(_socket, 500, CLIENT_TIMEOUT_MS);
+        if (socket < 0)
+            continue;
+        auto& connection = _connections.emplace_back();
+        connection.socket = socket;
+        connection.thread = std::make_unique<Thread>(
+                _name + "_connection",
+                [this, &connection] {
+                    serve(connection.socket);
+                    pkgi_socket_close(connection.socket);
+                    ScopeLock _(_cond.get_mutex());
+                    connection.done = true;
+                },
+                ThreadRole::Network);
+    }
+
+    for (auto& connection : _connections)
+        connection.thread->join();
+    _connections.clear();
+}
+
+void FileServer::serve(int socket)
+{
+    std::string request;
+    char buffer[512];
+    while (request.find("\r\n\r\n") == std::string::npos)
+    {
+        const auto size = pkgi_tcp_receive(socket, buffer, sizeof(buffer));
+        if (size <= 0 || request.size() + size > MAX_REQUEST)
+            return;
+        request.append(buffer, size);
+    }
+
+    const auto reply = [&](const std::string& status,
+                           const std::string& headers) {
+        const auto head = fmt::format(
+                "HTTP/1.1 {}\r\n{}Connection: close\r\n\r\n", status, headers);
+        return pkgi_tcp_send(socket, head.data(), head.size());
+    };
+    const auto reply_error = [&](int status, const std::string& message) {
+        const auto body = message + "\n";
+        if (reply(fmt::format("{} {}", status, status_text(status)),
+                  fmt::format(
+                          "Content-Length: {}\r\nX-Error: {}\r\n",
+                          body.size(),
+                          message)))
+            pkgi_tcp_send(socket, body.data(), body.size());
+    };
+
+    // the query of an offload carries a whole rif
+    char method[8];
+    char target[MAX_REQUEST];
+    if (sscanf(request.c_str(), "%7s %4095s", method, target) != 2 ||
+        (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) ||
+        target[0] != '/')
+    {
+        reply_error(400, "bad request");
+        return;
+    }
+
+    const auto answer = _handler(target);
+    if (answer.path.empty())
+    {
+        reply_error(answer.status, answer.message);
+        return;
+    }
+
+    const auto file_size = pkgi_get_size(answer.path.c_str());
+    const auto f =
+            file_size < 0 ? nullptr : pkgi_open(answer.path.c_str());
+    if (!f)
+    {
+        reply_error(404, "not found");
+        return;
+    }
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        pkgi_close(f);
+    };
+
+    const auto size = static_cast<uint64_t>(file_size);
+    uint64_t start = 0;
+    uint64_t end = size;
+    const bool ranged =
+            parse_range(header_value(request, "Range"), size, start, end);
+    if (start >= end && size != 0)
+    {
+        reply("416 Range Not Satisfiable",
+              fmt::format(
+                      "Content-Range: bytes */{}\r\nContent-Length: 0\r\n",
+                      size));
+        return;
+    }
+
+    LOGF("{} serving {} [{}, {})", _name, answer.path, start, end);
+    auto headers = fmt::format(
+            "Content-Length: {}\r\nAccept-Ranges: bytes\r\n", end - start);
+    if (ranged)
+        headers += fmt::format(
+                "Content-Range: bytes {}-{}/{}\r\n", start, end - 1, size);
+    if (!reply(ranged ? "206 Partial Content" : "200 OK", headers) ||
+        strcmp(method, "HEAD") == 0)
+        return;
+
+    try
+    {
+        pkgi_seek(f, start);
+        std::vector<uint8_t> data(READ_SIZE);
+        while (start < end && !is_dying())
+        {
+            const auto read = pkgi_read(
+                    f, data.data(), (uint32_t)min64(data.size(), end - start));
+            if (read <= 0 || !pkgi_tcp_send(socket, data.data(), read))
+                return;
+            start += read;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("{} serving {} failed: {}", _name, answer.path, e.what());
+    }
+}
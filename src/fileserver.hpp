@@ -0,0 +1,81 @@
+#pragma once
+
+#include "thread.hpp"
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <cstdint>
+
+// A small HTTP server for the files of the card, answering GET and HEAD with
+// Range support, a thread per connection. The handler tells which file a
+// request target is, or the status to answer instead. See PeerCache and the
+// serve command of pkgj_cli
+class FileServer
+{
+public:
+    // the ones after wait to be accepted
+    static constexpr size_t MAX_CONNECTIONS = 4;
+
+    struct Reply
+    {
+        Reply() = default;
+        Reply(std::string path) : path(std::move(path))
+        {
+        }
+        Reply(std::string path, int status, std::string message)
+            : path(std::move(path)), status(status), message(std::move(message))
+        {
+        }
+
+        // served whole or by range when set
+        std::string path;
+        // else answered with this status and message, which also goes in an
+        // X-Error header, the only part VitaHttp gives of an error
+        int status = 404;
+        std::string message;
+    };
+    // takes the request target, path and query, called on the connection
+    // threads
+    using Handler = std::function<Reply(const std::string& target)>;
+
+    FileServer(const FileServer&) = delete;
+    FileServer(FileServer&&) = delete;
+    FileServer& operator=(const FileServer&) = delete;
+    FileServer& operator=(FileServer&&) = delete;
+
+    // serves nothing when port can't be listened on, see listening()
+    FileServer(const char* name, uint16_t port, Handler handler);
+    ~FileServer();
+
+    bool listening() const
+    {
+        return _socket >= 0;
+    }
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    struct Connection
+    {
+        int socket;
+        std::unique_ptr<Thread> thread;
+        bool done = false;
+    };
+
+    std::string _name;
+    Handler _handler;
+    Cond _cond;
+    bool _dying = false;
+    std::list<Connection> _connections;
+
+    int _socket;
+    std::unique_ptr<Thread> _thread;
+
+    bool is_dying();
+    void run();
+    void serve(int socket);
+};
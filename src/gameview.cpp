@@ -14,34 +14,48 @@ namespace
 {
 constexpr unsigned GameViewWidth = VITA_WIDTH * 0.8;
 constexpr unsigned GameViewHeight = VITA_HEIGHT * 0.8;
+
+const auto Red = ImVec4(1.0f, 0.2f, 0.2f, 1.0f);
+const auto Yellow = ImVec4(1.0f, 1.0f, 0.0f, 1.0f);
+const auto Green = ImVec4(0.0f, 1.0f, 0.0f, 1.0f);
 }
 
 GameView::GameView(
         const Config* config,
         Downloader* downloader,
+        TitleMetadataCache* metadata,
+        PatchInfoCache* patch_info_cache,
+        TaskPool* task_pool,
+        IconCache* icons,
         DbItem* item,
         std::optional<CompPackDatabase::Item> base_comppack,
         std::optional<CompPackDatabase::Item> patch_comppack)
     : _config(config)
     , _downloader(downloader)
+    , _metadata(metadata)
+    , _icons(icons)
     , _item(item)
     , _base_comppack(base_comppack)
     , _patch_comppack(patch_comppack)
-    , _patch_info_fetcher(item->titleid)
+    , _related(pkgi_related_content(item->titleid))
+    , _patch_info_fetcher(item->titleid, patch_info_cache, task_pool)
+    , _package_peek_fetcher(item->url, task_pool)
 {
-    refresh();
+    update_metadata();
 }
 
 void GameView::render()
 {
+    update_metadata();
+    update_text();
+
     ImGui::SetNextWindowPos(
             ImVec2((VITA_WIDTH - GameViewWidth) / 2,
                    (VITA_HEIGHT - GameViewHeight) / 2));
     ImGui::SetNextWindowSize(ImVec2(GameViewWidth, GameViewHeight), 0);
 
     ImGui::Begin(
-            fmt::format("{}###gameview",  _item->titleid)
-                    .c_str(),
+            _window_title.c_str(),
             nullptr,
             ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoMove |
                     ImGuiWindowFlags_NoScrollbar |
@@ -50,76 +64,50 @@ void GameView::render()
                     ImGuiWindowFlags_NoSavedSettings |
                     ImGuiWindowFlags_NoInputs);
 
-    ImGui::PushTextWrapPos(0.f);
-    ImGui::Text(fmt::format("当前系统固件版本: {}", pkgi_get_system_version())
-                        .c_str());
-    ImGui::Text(
-            fmt::format(
-                    "运行所需固件版本: {}", get_min_system_version())
-                    .c_str());
-
-    ImGui::Text(" ");
-
-    ImGui::Text(fmt::format(
-                        "游戏安装及版本更新情况: {}",
-                        _game_version.empty() ? "未安装" : _game_version)
-                        .c_str());
-    if (_comppack_versions.present && _comppack_versions.base.empty() &&
-        _comppack_versions.patch.empty())
+    // the icon goes in the top right corner, the text wraps before it
+    float wrap_pos = 0.f;
+    if (const auto icon = _icons ? _icons->get(_item->titleid) : nullptr)
     {
-        ImGui::Text("已安装的游戏兼容包: 未知版本");
+        const float size = IconCache::THUMB_SIZE;
+        const auto cursor = ImGui::GetCursorPos();
+        const auto right = ImGui::GetWindowContentRegionMax().x;
+        ImGui::SetCursorPos(ImVec2(right - size, cursor.y));
+        ImGui::Image(icon, ImVec2(size, size));
+        ImGui::SetCursorPos(cursor);
+        wrap_pos = right - size - ImGui::GetStyle().ItemSpacing.x;
     }
-    else
-    {
-        ImGui::Text(fmt::format(
-                            "游戏本体兼容包安装情况: {}",
-                            _comppack_versions.base.empty() ? "未安装" : "已安装")
-                            .c_str());
-        ImGui::Text(fmt::format(
-                            "游戏更新兼容包及版本情况: {}",
-                            _comppack_versions.patch.empty()
-                                    ? "未安装"
-                                    : _comppack_versions.patch)
-                            .c_str());
-    }
-
-    ImGui::Text(" ");
 
-    printDiagnostic();
-
-    ImGui::Text(" ");
+    ImGui::PushTextWrapPos(wrap_pos);
+    for (const auto& lines : {&_info_text, &_diagnostic_text})
+        for (const auto& line : *lines)
+        {
+            if (line.color == TextColor::Normal)
+            {
+                ImGui::TextUnformatted(line.text.c_str());
+                continue;
+            }
+            ImGui::PushStyleColor(
+                    ImGuiCol_Text,
+                    line.color == TextColor::Red      ? Red
+                    : line.color == TextColor::Yellow ? Yellow
+                                                      : Green);
+            ImGui::TextUnformatted(line.text.c_str());
+            ImGui::PopStyleColor();
+        }
+    ImGui::TextUnformatted(" ");
 
     ImGui::PopTextWrapPos();
 
-    if (_patch_info_fetcher.get_status() == PatchInfoFetcher::Status::Found)
-    {
-        if (ImGui::Button("安装游戏本体及更新###installgame"))
-            start_download_package();
-    }
-    else
-    {
-        if (ImGui::Button("安装游戏###installgame"))
-            start_download_package();
-    }
+    if (ImGui::Button(_install_game_label.c_str()))
+        start_download_package();
 
     switch (_patch_info_fetcher.get_status())
     {
-    case PatchInfoFetcher::Status::Fetching:
-        ImGui::Button("正在查找游戏更新...###installpatch");
-        break;
-    case PatchInfoFetcher::Status::NoUpdate:
-        ImGui::Button("未找到游戏更新###installpatch");
-        break;
     case PatchInfoFetcher::Status::Found:
-    {
-        const auto patch_info = _patch_info_fetcher.get_patch_info();
         if (!_downloader->is_in_queue(Patch, _item->titleid))
         {
-            if (ImGui::Button(fmt::format(
-                                      "安装游戏更新 {}###installpatch",
-                                      patch_info->version)
-                                      .c_str()))
-                start_download_patch(*patch_info);
+            if (ImGui::Button(_install_patch_label.c_str()))
+                start_download_patch(*_patch_info_fetcher.get_patch_info());
         }
         else
         {
@@ -127,9 +115,8 @@ void GameView::render()
                 cancel_download_patch();
         }
         break;
-    }
-    case PatchInfoFetcher::Status::Error:
-        ImGui::Button("无法获取游戏更新信息###installpatch");
+    default:
+        ImGui::Button(_install_patch_label.c_str());
         break;
     }
 
@@ -152,11 +139,7 @@ void GameView::render()
     {
         if (!_downloader->is_in_queue(CompPackPatch, _item->titleid))
         {
-            if (ImGui::Button(fmt::format(
-                                      "安装游戏更新兼容包"
-                                      "{}###installpatchcommppack",
-                                      _patch_comppack->app_version)
-                                      .c_str()))
+            if (ImGui::Button(_install_patch_comppack_label.c_str()))
                 start_download_comppack(true);
         }
         else
@@ -167,28 +150,154 @@ void GameView::render()
         }
     }
 
+    if (_related.installed_dlcs + _related.installed_themes <
+        _related.dlcs + _related.themes)
+    {
+        if (ImGui::Button("安装全部DLC及主题###installrelated"))
+            start_download_related();
+    }
+
     if (ImGui::Button("关闭"))
         _closed = true;
 
     ImGui::End();
 }
 
-static const auto Red = ImVec4(1.0f, 0.2f, 0.2f, 1.0f);
-static const auto Yellow = ImVec4(1.0f, 1.0f, 0.0f, 1.0f);
-static const auto Green = ImVec4(0.0f, 1.0f, 0.0f, 1.0f);
+void GameView::update_text()
+{
+    TextInputs inputs{
+            _patch_info_fetcher.get_status(),
+            _package_peek_fetcher.get_status(),
+            _metadata_loaded,
+            _metadata_serial,
+            _item->presence};
+    if (_text_inputs == inputs)
+        return;
+    _text_inputs = inputs;
+
+    const auto patch_status = std::get<0>(inputs);
+    _window_title = fmt::format("{}###gameview", _item->titleid);
+    _info_text.clear();
+    _diagnostic_text.clear();
+
+    const auto add = [this](std::string text) {
+        _info_text.push_back({std::move(text), TextColor::Normal});
+    };
+    add(fmt::format("当前系统固件版本: {}", pkgi_get_system_version()));
+    add(fmt::format("运行所需固件版本: {}", get_min_system_version()));
+    addPackagePeekText();
+
+    add(" ");
+
+    if (!_metadata_loaded)
+        add("游戏安装及版本更新情况: 正在读取...");
+    else
+        add(fmt::format(
+                "游戏安装及版本更新情况: {}",
+                _game_version.empty() ? "未安装" : _game_version));
+    if (!_game_system_version.empty())
+        add(fmt::format("已安装版本所需固件版本: {}", _game_system_version));
+    if (_comppack_versions.present && _comppack_versions.base.empty() &&
+        _comppack_versions.patch.empty())
+    {
+        add("已安装的游戏兼容包: 未知版本");
+    }
+    else
+    {
+        add(fmt::format(
+                "游戏本体兼容包安装情况: {}",
+                _comppack_versions.base.empty() ? "未安装" : "已安装"));
+        add(fmt::format(
+                "游戏更新兼容包及版本情况: {}",
+                _comppack_versions.patch.empty() ? "未安装"
+                                                 : _comppack_versions.patch));
+    }
+    if (_related.dlcs || _related.themes)
+        add(fmt::format(
+                "DLC: {} 个, 已安装 {} 个; 主题: {} 个, 已安装 {} 个",
+                _related.dlcs,
+                _related.installed_dlcs,
+                _related.themes,
+                _related.installed_themes));
+
+    add(" ");
+
+    if (_metadata_loaded)
+        addDiagnosticText();
+
+    _install_game_label = patch_status == PatchInfoFetcher::Status::Found
+                                  ? "安装游戏本体及更新###installgame"
+                                  : "安装游戏###installgame";
+    switch (patch_status)
+    {
+    case PatchInfoFetcher::Status::Fetching:
+        _install_patch_label = "正在查找游戏更新...###installpatch";
+        break;
+    case PatchInfoFetcher::Status::NoUpdate:
+        _install_patch_label = "未找到游戏更新###installpatch";
+        break;
+    case PatchInfoFetcher::Status::Found:
+        _install_patch_label = fmt::format(
+                "安装游戏更新 {}###installpatch",
+                _patch_info_fetcher.get_patch_info()->version);
+        break;
+    case PatchInfoFetcher::Status::Error:
+        _install_patch_label = "无法获取游戏更新信息###installpatch";
+        break;
+    }
+    if (_patch_comppack)
+        _install_patch_comppack_label = fmt::format(
+                "安装游戏更新兼容包{}###installpatchcommppack",
+                _patch_comppack->app_version);
+}
+
+void GameView::addPackagePeekText()
+{
+    const auto add = [this](std::string text) {
+        _info_text.push_back({std::move(text), TextColor::Normal});
+    };
+    switch (_package_peek_fetcher.get_status())
+    {
+    case PackagePeekFetcher::Status::None:
+        break;
+    case PackagePeekFetcher::Status::Fetching:
+        add("PKG文件信息: 正在读取...");
+        break;
+    case PackagePeekFetcher::Status::Error:
+        add("PKG文件信息: 读取失败");
+        break;
+    case PackagePeekFetcher::Status::Found:
+    {
+        const auto info = _package_peek_fetcher.get_info();
+        add(fmt::format(
+                "PKG文件信息: 版本 {}, {} 个文件",
+                info->app_version.empty() ? "未知" : info->app_version,
+                info->files.size()));
+        // PSP and PSX packages don't tell
+        if (info->footprint)
+            add(fmt::format(
+                    "安装后占用空间: {} MB",
+                    info->footprint / (1024 * 1024) + 1));
+        break;
+    }
+    }
+}
 
-void GameView::printDiagnostic()
+void GameView::addDiagnosticText()
 {
     bool ok = true;
+    const auto add = [this](std::string text, TextColor color) {
+        _diagnostic_text.push_back({std::move(text), color});
+    };
     auto const printError = [&](auto const& str) {
         ok = false;
-        ImGui::TextColored(Red, str);
+        add(str, TextColor::Red);
     };
 
     auto const systemVersion = pkgi_get_system_version();
     auto const minSystemVersion = get_min_system_version();
 
-    ImGui::Text("运行诊断:");
+    add("运行诊断:", TextColor::Normal);
 
     if (systemVersion < minSystemVersion)
     {
@@ -199,26 +308,25 @@ void GameView::printDiagnostic()
                         "- 当前系统固件版本低于游戏运行所需固件版本, 必须"
                         "安装兼容包或安装reF00D插件");
             else
-                ImGui::Text(
-                        "- 游戏将通过reF00D插件引导运行, "
-                        "安装兼容包可有效缩短游戏启动所需时间");
+                add("- 游戏将通过reF00D插件引导运行, "
+                    "安装兼容包可有效缩短游戏启动所需时间",
+                    TextColor::Normal);
         }
     }
     else
     {
-        ImGui::Text(
-                "- 当前系统固件版本已高于游戏运行所需固件版本, 无需安装兼容"
-                "包");
+        add("- 当前系统固件版本已高于游戏运行所需固件版本, 无需安装兼容"
+            "包",
+            TextColor::Normal);
     }
 
     if (_comppack_versions.present && _comppack_versions.base.empty() &&
         _comppack_versions.patch.empty())
     {
-        ImGui::TextColored(
-                Yellow,
-                "- 游戏兼容包已安装, 但并非通过PKGj进行安装, 请"
-                "确保该兼容包与游戏版本相匹配，如出现运行异常, 请通过PKGj"
-                "重新安装");
+        add("- 游戏兼容包已安装, 但并非通过PKGj进行安装, 请"
+            "确保该兼容包与游戏版本相匹配，如出现运行异常, 请通过PKGj"
+            "重新安装",
+            TextColor::Yellow);
         ok = false;
     }
 
@@ -250,12 +358,12 @@ void GameView::printDiagnostic()
 
     if (_item->presence != PresenceInstalled)
     {
-        ImGui::Text("- 未安装游戏");
+        add("- 未安装游戏", TextColor::Normal);
         ok = false;
     }
 
     if (ok)
-        ImGui::TextColored(Green, "已满足运行条件");
+        add("已满足运行条件", TextColor::Green);
 }
 
 std::string GameView::get_min_system_version()
@@ -263,16 +371,38 @@ std::string GameView::get_min_system_version()
     auto const patchInfo = _patch_info_fetcher.get_patch_info();
     if (patchInfo)
         return patchInfo->fw_version;
-    else
-        return _item->fw_version;
+    // the param.sfo of the package wins over the list
+    auto const packageInfo = _package_peek_fetcher.get_info();
+    if (packageInfo && !packageInfo->system_version.empty())
+        return packageInfo->system_version;
+    return _item->fw_version;
 }
 
 void GameView::refresh()
 {
     LOGF("refreshing gameview");
-    _refood_present = pkgi_file_exists("ur0:tai/keys.bin");
-    _game_version = pkgi_get_game_version(_item->titleid);
-    _comppack_versions = pkgi_get_comppack_versions(_item->titleid);
+    // an install drops the title from the cache, it comes back once read
+    // again
+    _metadata_loaded = false;
+    _related = pkgi_related_content(_item->titleid);
+    _text_inputs.reset();
+    update_metadata();
+}
+
+void GameView::update_metadata()
+{
+    if (_metadata_loaded && _metadata->serial() == _metadata_serial)
+        return;
+    _metadata_serial = _metadata->serial();
+    _refood_present = _metadata->refood_present();
+
+    const auto metadata = _metadata->get(_item->titleid);
+    if (!metadata)
+        return;
+    _game_version = metadata->version.app;
+    _game_system_version = metadata->version.system;
+    _comppack_versions = metadata->comppack;
+    _metadata_loaded = true;
 }
 
 void GameView::start_download_package()
@@ -306,7 +436,8 @@ void GameView::start_download_patch(const PatchInfo& patch_info)
                                   std::vector<uint8_t>{},
                                   false,
                                   "ux0:",
-                                  ""});
+                                  "",
+                                  patch_info.size});
 }
 
 void GameView::cancel_download_patch()
@@ -329,6 +460,11 @@ void GameView::start_download_comppack(bool patch)
                                   entry->app_version});
 }
 
+void GameView::start_download_related()
+{
+    pkgi_start_bgdl_related(_item->titleid);
+}
+
 void GameView::cancel_download_comppacks(bool patch)
 {
     _downloader->remove_from_queue(
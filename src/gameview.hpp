@@ -4,10 +4,17 @@
 #include "config.hpp"
 #include "db.hpp"
 #include "downloader.hpp"
+#include "iconcache.hpp"
 #include "install.hpp"
+#include "packagepeekfetcher.hpp"
 #include "patchinfofetcher.hpp"
+#include "pkgi.hpp"
+#include "titlemetadata.hpp"
 
 #include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
 
 class GameView
 {
@@ -15,6 +22,10 @@ public:
     GameView(
             const Config* config,
             Downloader* downloader,
+            TitleMetadataCache* metadata,
+            PatchInfoCache* patch_info_cache,
+            TaskPool* task_pool,
+            IconCache* icons,
             DbItem* item,
             std::optional<CompPackDatabase::Item> base_comppack,
             std::optional<CompPackDatabase::Item> patch_comppack);
@@ -35,25 +46,70 @@ public:
 private:
     const Config* _config;
     Downloader* _downloader;
+    TitleMetadataCache* _metadata;
+    // null when the icons are off
+    IconCache* _icons;
 
     DbItem* _item;
     std::optional<CompPackDatabase::Item> _base_comppack;
     std::optional<CompPackDatabase::Item> _patch_comppack;
 
+    // false until the cache has checked the title
+    bool _metadata_loaded{false};
+    uint32_t _metadata_serial{0};
     bool _refood_present;
     std::string _game_version;
+    // firmware the installed version needs
+    std::string _game_system_version;
     CompPackVersion _comppack_versions;
+    // the DLCs and themes of the game, looked up again on refresh()
+    RelatedContent _related;
 
     bool _closed{false};
 
     PatchInfoFetcher _patch_info_fetcher;
+    // what the package itself says, before it is downloaded
+    PackagePeekFetcher _package_peek_fetcher;
 
+    enum class TextColor
+    {
+        Normal,
+        Red,
+        Yellow,
+        Green,
+    };
+    struct TextLine
+    {
+        std::string text;
+        TextColor color;
+    };
+    // what render() shows, formatted by update_text() only when something
+    // it depends on changed, a frame allocates nothing
+    using TextInputs = std::tuple<
+            PatchInfoFetcher::Status,
+            PackagePeekFetcher::Status,
+            bool,
+            uint32_t,
+            DbPresence>;
+    std::optional<TextInputs> _text_inputs;
+    std::string _window_title;
+    // before the diagnostic, and the diagnostic
+    std::vector<TextLine> _info_text;
+    std::vector<TextLine> _diagnostic_text;
+    std::string _install_game_label;
+    std::string _install_patch_label;
+    std::string _install_patch_comppack_label;
+
+    void update_metadata();
+    void update_text();
     std::string get_min_system_version();
-    void printDiagnostic();
+    void addPackagePeekText();
+    void addDiagnosticText();
     void start_download_package();
     void cancel_download_package();
     void start_download_patch(const PatchInfo& patch_info);
     void cancel_download_patch();
     void start_download_comppack(bool patch);
+    void start_download_related();
     void cancel_download_comppacks(bool patch);
 };
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 class HttpError : public std::exception
 {
@@ -20,19 +22,89 @@ private:
     std::string _msg;
 };
 
+// bytes of the stream lent by Http::borrow(), the caller may change them in
+// place, decrypting them for instance, until it gives them back
+struct HttpSlice
+{
+    uint8_t* data = nullptr;
+    uint32_t size = 0;
+};
+
 class Http
 {
 public:
+    // the most a borrow() gets from the implementations without buffers of
+    // their own
+    static constexpr uint32_t LEND_SIZE = 64 * 1024;
+
     virtual ~Http()
     {
     }
 
     virtual void start(const std::string& url, uint64_t offset) = 0;
+    // requests only the bytes in [offset, end), implementations that can't
+    // send a bounded range fall back to an open ended request and the caller
+    // stops reading at end
+    virtual void start_range(
+            const std::string& url, uint64_t offset, uint64_t end)
+    {
+        (void)end;
+        start(url, offset);
+    }
     virtual int64_t read(uint8_t* buffer, uint64_t size) = 0;
+    // lends the next bytes of the stream, at most size of them, an empty
+    // slice at the end of it. They stay valid until give_back(), which must
+    // come before the next borrow() or read(). The implementations that
+    // buffer the stream lend their buffers, the others read into one the Http
+    // keeps
+    virtual HttpSlice borrow(uint32_t size)
+    {
+        _lent.resize(std::min(size, LEND_SIZE));
+        return {_lent.data(), static_cast<uint32_t>(read(
+                                      _lent.data(), _lent.size()))};
+    }
+    virtual void give_back(const HttpSlice& slice)
+    {
+        (void)slice;
+    }
     virtual void abort() = 0;
 
     virtual int get_status() = 0;
     virtual int64_t get_length() = 0;
 
+    // adds a header to the requests sent by the next start() calls, and
+    // returns a header of the response, or an empty string when it's missing
+    // or the implementation doesn't give access to headers
+    virtual void add_request_header(
+            const std::string& name, const std::string& value)
+    {
+        (void)name;
+        (void)value;
+    }
+    virtual std::string get_response_header(const std::string& name)
+    {
+        (void)name;
+        return {};
+    }
+
     virtual explicit operator bool() const = 0;
+
+private:
+    std::vector<uint8_t> _lent;
 };
+
+// hands the rest of the stream to consume in the slices lent by http, which
+// consume may change in place. When consume throws, the stream is left where
+// it was and is not to be read any further
+template <typename Consume>
+void pkgi_http_consume(Http& http, Consume&& consume)
+{
+    while (true)
+    {
+        const auto slice = http.borrow(Http::LEND_SIZE);
+        if (slice.size == 0)
+            break;
+        consume(slice.data, slice.size);
+        http.give_back(slice);
+    }
+}
@@ -0,0 +1,75 @@
+#include "httpoptions.hpp"
+
+#include "cardhttp.hpp"
+
+#include <algorithm>
+
+#include <ctype.h>
+
+namespace
+{
+// set once at start, before any thread reads it
+HttpHostOptions g_options;
+
+// "host:port" of the url, lower case
+std::string authority_of(const std::string& url)
+{
+    auto start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    auto authority = url.substr(start, url.find('/', start) - start);
+    std::transform(
+            authority.begin(), authority.end(), authority.begin(), [](char c) {
+                return static_cast<char>(tolower(c));
+            });
+    return authority;
+}
+
+const HttpOptions* find(const std::string& host)
+{
+    for (const auto& option : g_options)
+        if (option.first == host)
+            return &option.second;
+    return nullptr;
+}
+}
+
+void pkgi_set_http_options(HttpHostOptions options)
+{
+    for (auto& option : options)
+    {
+        std::transform(
+                option.first.begin(),
+                option.first.end(),
+                option.first.begin(),
+                [](char c) { return static_cast<char>(tolower(c)); });
+        // a single block would stall the network while it's consumed
+        option.second.read_ahead_kb =
+                std::clamp<uint32_t>(option.second.read_ahead_kb, 16, 1024);
+        option.second.read_ahead_blocks =
+                std::clamp<uint32_t>(option.second.read_ahead_blocks, 2, 32);
+    }
+    g_options = std::move(options);
+}
+
+HttpOptions pkgi_http_options(const std::string& url)
+{
+    // the card has no round trips to hide, it wants few large reads
+    if (pkgi_is_card_url(url))
+    {
+        HttpOptions options;
+        options.read_ahead_kb = 1024;
+        options.read_ahead_blocks = 4;
+        return options;
+    }
+
+    const auto authority = authority_of(url);
+    if (const auto options = find(authority))
+        return *options;
+    const auto port = authority.rfind(':');
+    if (port != std::string::npos)
+        if (const auto options = find(authority.substr(0, port)))
+            return *options;
+    if (const auto options = find("*"))
+        return *options;
+    return {};
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+// how the connections to a host are tuned, the defaults suit most servers,
+// long round trips want a deeper read ahead
+struct HttpOptions
+{
+    uint32_t connect_timeout_ms = 30 * 1000;
+    // a stalled connection fails the read after this long and the download
+    // reconnects where it stopped
+    uint32_t recv_timeout_ms = 15 * 1000;
+    // size of the blocks the read ahead asks of the network at once, the
+    // reader is woken up once per block
+    uint32_t read_ahead_kb = 128;
+    // blocks received in advance, the received bytes not yet consumed are at
+    // most read_ahead_kb * read_ahead_blocks
+    uint32_t read_ahead_blocks = 8;
+};
+
+// the options of each host, as "host" or "host:port", "*" for the others
+using HttpHostOptions = std::vector<std::pair<std::string, HttpOptions>>;
+
+// to be called before the first connection
+void pkgi_set_http_options(HttpHostOptions options);
+// the options for the host of url, the defaults when none match
+HttpOptions pkgi_http_options(const std::string& url);
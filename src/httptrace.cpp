@@ -0,0 +1,159 @@
+#include "httptrace.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "pkgi.hpp"
+
+#include <fmt/format.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+
+namespace
+{
+static constexpr char TRACE_MAGIC[] = "PKGJHTTPTRACE 1";
+}
+
+HttpTrace::HttpTrace(const std::string& path)
+{
+    const auto data = pkgi_load(path);
+    const std::string text(data.begin(), data.end());
+    size_t pos = text.find('\n');
+    if (pos == std::string::npos || text.compare(0, pos, TRACE_MAGIC) != 0)
+        throw std::runtime_error(
+                fmt::format("{} isn't an http trace", path));
+    ++pos;
+
+    struct Open
+    {
+        size_t request;
+        uint64_t start_usec;
+    };
+    // the request of each connection that didn't end yet
+    std::map<uint32_t, Open> open;
+    while (pos < text.size())
+    {
+        auto end = text.find('\n', pos);
+        if (end == std::string::npos)
+            end = text.size();
+        const auto line = text.substr(pos, end - pos);
+        pos = end + 1;
+
+        char* next;
+        const auto connection = std::strtoul(line.c_str(), &next, 10);
+        const auto usec = std::strtoull(next, &next, 10);
+        while (*next == '\t')
+            ++next;
+        const std::string event(next, std::strcspn(next, "\t"));
+        next += event.size();
+
+        if (event == "start")
+        {
+            HttpTraceRequest request;
+            request.offset = std::strtoull(next, &next, 10);
+            request.end = std::strtoull(next, &next, 10);
+            open[connection] = {_requests.size(), usec};
+            _requests.push_back(std::move(request));
+            continue;
+        }
+
+        const auto it = open.find(connection);
+        if (it == open.end())
+            continue;
+        auto& request = _requests[it->second.request];
+        if (event == "read")
+        {
+            const auto received = request.arrivals.empty()
+                                          ? 0
+                                          : request.arrivals.back().bytes;
+            request.arrivals.push_back(
+                    {usec - it->second.start_usec,
+                     received + std::strtoull(next, &next, 10)});
+        }
+        else if (event == "error")
+        {
+            request.failed = true;
+            open.erase(it);
+        }
+        else if (event == "end")
+            open.erase(it);
+    }
+
+    if (_requests.empty())
+        throw std::runtime_error(fmt::format("{} has no request", path));
+    LOGF("http trace {}: {} requests", path, _requests.size());
+}
+
+const HttpTraceRequest& HttpTrace::next()
+{
+    return _requests[_next++ % _requests.size()];
+}
+
+HttpTraceWriter::HttpTraceWriter(const std::string& path)
+    : _mutex("http_trace_mutex")
+    , _file(pkgi_create(path))
+    , _start_usec(pkgi_time_usec())
+{
+    _buffer = TRACE_MAGIC;
+    _buffer += '\n';
+}
+
+HttpTraceWriter::~HttpTraceWriter()
+{
+    ScopeLock _(_mutex);
+    flush();
+    pkgi_close(_file);
+}
+
+uint32_t HttpTraceWriter::new_connection()
+{
+    return _connections++;
+}
+
+void HttpTraceWriter::start(uint32_t connection, uint64_t offset, uint64_t end)
+{
+    write(connection, fmt::format("start\t{}\t{}", offset, end));
+}
+
+void HttpTraceWriter::read(uint32_t connection, uint64_t bytes)
+{
+    write(connection, fmt::format("read\t{}", bytes));
+}
+
+void HttpTraceWriter::error(uint32_t connection)
+{
+    write(connection, "error", true);
+}
+
+void HttpTraceWriter::end(uint32_t connection)
+{
+    write(connection, "end", true);
+}
+
+void HttpTraceWriter::write(
+        uint32_t connection, const std::string& event, bool ends_request)
+{
+    ScopeLock _(_mutex);
+    _buffer += fmt::format(
+            "{}\t{}\t{}\n", connection, pkgi_time_usec() - _start_usec, event);
+    if (ends_request || _buffer.size() >= FLUSH_SIZE)
+        flush();
+}
+
+void HttpTraceWriter::flush()
+{
+    if (_buffer.empty())
+        return;
+    try
+    {
+        pkgi_write(_file, _buffer.data(), _buffer.size());
+    }
+    catch (const std::exception& e)
+    {
+        // the trace misses a part, the download goes on
+        LOGF("failed to write the http trace: {}", e.what());
+    }
+    _buffer.clear();
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "thread.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+// A trace of the requests of real downloads, what came in and when, without
+// the payload nor the urls. After a "PKGJHTTPTRACE 1" line, a tab separated
+// line per event:
+//   connection usec start offset end
+//   connection usec read bytes
+//   connection usec error
+//   connection usec end
+// usec counts from the opening of the trace, end is 0 for the requests
+// without a bound.
+
+// the timing of one request of a trace
+struct HttpTraceRequest
+{
+    struct Arrival
+    {
+        // since the request was sent
+        uint64_t usec;
+        // received by the request at that time
+        uint64_t bytes;
+    };
+
+    uint64_t offset = 0;
+    uint64_t end = 0;
+    std::vector<Arrival> arrivals;
+    // the connection broke after the last arrival
+    bool failed = false;
+};
+
+// the requests of a trace in the order they were sent, handed out again
+// from the first once they are all out
+class HttpTrace
+{
+public:
+    HttpTrace(const HttpTrace&) = delete;
+    HttpTrace& operator=(const HttpTrace&) = delete;
+
+    // throws when the file can't be read or isn't a trace
+    explicit HttpTrace(const std::string& path);
+
+    // from any thread
+    const HttpTraceRequest& next();
+
+    size_t size() const
+    {
+        return _requests.size();
+    }
+
+private:
+    std::vector<HttpTraceRequest> _requests;
+    std::atomic<size_t> _next{0};
+};
+
+// writes a trace for the connections of the RecordingHttp sharing it
+class HttpTraceWriter
+{
+public:
+    HttpTraceWriter(const HttpTraceWriter&) = delete;
+    HttpTraceWriter& operator=(const HttpTraceWriter&) = delete;
+
+    // throws when path can't be created
+    explicit HttpTraceWriter(const std::string& path);
+    ~HttpTraceWriter();
+
+    // from any thread, a number for each connection
+    uint32_t new_connection();
+    void start(uint32_t connection, uint64_t offset, uint64_t end);
+    void read(uint32_t connection, uint64_t bytes);
+    void error(uint32_t connection);
+    void end(uint32_t connection);
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    // the lines are written to the card by this much at a time, and at the
+    // end of each request, the process may exit without destroying it
+    static constexpr size_t FLUSH_SIZE = 64 * 1024;
+
+    Mutex _mutex;
+    void* _file;
+    uint64_t _start_usec;
+    std::string _buffer;
+    std::atomic<uint32_t> _connections{0};
+
+    void write(
+            uint32_t connection,
+            const std::string& event,
+            bool ends_request = false);
+    // must be called with the mutex locked
+    void flush();
+};
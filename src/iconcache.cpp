@@ -0,0 +1,425 @@
+#include "iconcache.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+
+#include <fmt/format.h>
+
+#include <boost/scope_exit.hpp>
+
+#include <png.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+// a thumbnail file is this header and the RGBA pixels, a row after the other
+struct ThumbnailHeader
+{
+    char magic[4];
+    uint16_t width;
+    uint16_t height;
+};
+
+constexpr char THUMBNAIL_MAGIC[4] = {'P', 'K', 'G', 'T'};
+
+// the icons of the store are 128x128, more is not an icon
+constexpr uint32_t MAX_ICON_SIDE = 1024;
+constexpr size_t MAX_ICON_BYTES = 1024 * 1024;
+
+// also keeps them out of the paths and urls built from them
+bool is_titleid(const std::string& titleid)
+{
+    return !titleid.empty() && titleid.size() <= 16 &&
+           std::all_of(titleid.begin(), titleid.end(), [](char c) {
+               return std::isalnum(static_cast<unsigned char>(c));
+           });
+}
+
+void decode_png(
+        const std::vector<uint8_t>& data,
+        uint32_t& width,
+        uint32_t& height,
+        std::vector<uint32_t>& pixels)
+{
+    // the simplified API of libpng reads within the buffer, what comes from
+    // the network can be cut or broken
+    png_image image{};
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&image, data.data(), data.size()))
+        throw std::runtime_error(fmt::format("PNG无效: {}", image.message));
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        png_image_free(&image);
+    };
+    if (image.width == 0 || image.height == 0 ||
+        image.width > MAX_ICON_SIDE || image.height > MAX_ICON_SIDE)
+        throw std::runtime_error(fmt::format(
+                "图标尺寸无效: {}x{}", image.width, image.height));
+
+    image.format = PNG_FORMAT_RGBA;
+    pixels.resize(image.width * image.height);
+    if (!png_image_finish_read(&image, nullptr, pixels.data(), 0, nullptr))
+        throw std::runtime_error(fmt::format("PNG无效: {}", image.message));
+    width = image.width;
+    height = image.height;
+}
+
+// averages the source pixels under each pixel of the thumbnail, the icons
+// are drawn small and a plain subsampling flickers
+void scale_down(
+        uint32_t& width,
+        uint32_t& height,
+        std::vector<uint32_t>& pixels,
+        uint32_t size)
+{
+    if (width <= size && height <= size)
+        return;
+
+    const auto longest = std::max(width, height);
+    const uint32_t to_width = std::max(1u, width * size / longest);
+    const uint32_t to_height = std::max(1u, height * size / longest);
+    std::vector<uint32_t> scaled(to_width * to_height);
+    for (uint32_t y = 0; y < to_height; ++y)
+    {
+        const uint32_t y0 = y * height / to_height;
+        const uint32_t y1 = std::max(y0 + 1, (y + 1) * height / to_height);
+        for (uint32_t x = 0; x < to_width; ++x)
+        {
+            const uint32_t x0 = x * width / to_width;
+            const uint32_t x1 = std::max(x0 + 1, (x + 1) * width / to_width);
+            uint32_t sum[4] = {};
+            for (uint32_t sy = y0; sy < y1; ++sy)
+                for (uint32_t sx = x0; sx < x1; ++sx)
+                {
+                    const auto pixel = pixels[sy * width + sx];
+                    for (int c = 0; c < 4; ++c)
+                        sum[c] += (pixel >> (c * 8)) & 0xff;
+                }
+            const auto count = (y1 - y0) * (x1 - x0);
+            uint32_t pixel = 0;
+            for (int c = 0; c < 4; ++c)
+                pixel |= (sum[c] / count) << (c * 8);
+            scaled[y * to_width + x] = pixel;
+        }
+    }
+    width = to_width;
+    height = to_height;
+    pixels = std::move(scaled);
+}
+}
+
+IconCache::IconCache(
+        TaskPool* pool,
+        HttpFactory make_http,
+        std::string cache_dir,
+        std::string url_template,
+        size_t budget)
+    : _pool(pool)
+    , _make_http(std::move(make_http))
+    , _cache_dir(std::move(cache_dir))
+    , _url_template(std::move(url_template))
+    , _mutex("icon_cache_mutex")
+    , _budget(budget)
+{
+    pkgi_mkdirs(_cache_dir.c_str());
+}
+
+IconCache::~IconCache()
+{
+    std::vector<std::shared_ptr<Task>> tasks;
+    {
+        ScopeLock _(_mutex);
+        _dying = true;
+        for (const auto http : _https)
+            http->abort();
+        // no task is submitted anymore
+        for (const auto& task : _tasks)
+            tasks.push_back(task.second);
+        if (_prefetch_task)
+            tasks.push_back(_prefetch_task);
+    }
+    for (const auto& task : tasks)
+    {
+        task->cancel();
+        task->wait();
+    }
+
+    // nothing is drawn anymore
+    for (const auto& dead : _dead)
+        pkgi_free_texture(dead.texture);
+    for (const auto& entry : _entries)
+        if (entry.second.texture)
+            pkgi_free_texture(entry.second.texture);
+}
+
+pkgi_texture IconCache::get(const std::string& titleid)
+{
+    ScopeLock _(_mutex);
+    auto it = _entries.find(titleid);
+    if (it != _entries.end())
+    {
+        auto& entry = it->second;
+        if (entry.state != State::Ready)
+            return nullptr;
+        entry.used_frame = _frame;
+        _lru.splice(_lru.begin(), _lru, entry.lru);
+        return entry.texture;
+    }
+
+    _entries.emplace(titleid, Entry{});
+    _tasks[titleid] = _pool->submit(
+            TaskPool::PriorityNormal,
+            [this, titleid](const Task&) { load(titleid); });
+    return nullptr;
+}
+
+void IconCache::prefetch(std::vector<std::string> titleids)
+{
+    ScopeLock _(_mutex);
+    _prefetch.assign(
+            std::make_move_iterator(titleids.begin()),
+            std::make_move_iterator(titleids.end()));
+    if (!_prefetching)
+        submit_prefetch();
+}
+
+void IconCache::submit_prefetch()
+{
+    _prefetching = true;
+    // a title per task, so that what get() asks for meanwhile doesn't wait
+    // for the whole list
+    _prefetch_task = _pool->submit(
+            TaskPool::PriorityLow,
+            [this](const Task& task) { run_prefetch(task); });
+}
+
+void IconCache::run_prefetch(const Task& task)
+{
+    std::string titleid;
+    {
+        ScopeLock _(_mutex);
+        while (!_prefetch.empty() && titleid.empty())
+        {
+            if (!_entries.count(_prefetch.front()))
+            {
+                titleid = std::move(_prefetch.front());
+                _entries.emplace(titleid, Entry{});
+            }
+            _prefetch.pop_front();
+        }
+        if (titleid.empty() || task.cancelled() || _dying)
+        {
+            if (!titleid.empty())
+                _entries.erase(titleid);
+            _prefetching = false;
+            return;
+        }
+    }
+
+    load(titleid);
+
+    ScopeLock _(_mutex);
+    if (_dying || _prefetch.empty())
+        _prefetching = false;
+    else
+        submit_prefetch();
+}
+
+void IconCache::load(const std::string& titleid)
+{
+    Thumbnail thumbnail;
+    try
+    {
+        thumbnail = read_thumbnail(titleid);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to load the icon of {}: {}", titleid, e.what());
+    }
+
+    const auto texture =
+            thumbnail.pixels.empty()
+                    ? nullptr
+                    : pkgi_create_texture(
+                              thumbnail.width,
+                              thumbnail.height,
+                              thumbnail.pixels.data());
+
+    ScopeLock _(_mutex);
+    _tasks.erase(titleid);
+    auto& entry = _entries[titleid];
+    if (!texture)
+    {
+        // not tried again before the next start
+        entry.state = State::Missing;
+        return;
+    }
+
+    entry.state = State::Ready;
+    entry.texture = texture;
+    entry.bytes = thumbnail.pixels.size() * sizeof(uint32_t);
+    entry.used_frame = _frame;
+    entry.lru = _lru.insert(_lru.begin(), titleid);
+    _used += entry.bytes;
+    evict();
+    _memory.set(_used);
+    ++_serial;
+}
+
+void IconCache::set_budget(size_t budget)
+{
+    ScopeLock _(_mutex);
+    _budget = budget;
+    evict();
+    _memory.set(_used);
+}
+
+void IconCache::evict()
+{
+    while (_used > _budget && !_lru.empty())
+    {
+        const auto it = _entries.find(_lru.back());
+        auto& entry = it->second;
+        // the icons on screen stay, the budget is only exceeded for them
+        if (entry.used_frame == _frame)
+            break;
+        _dead.push_back({entry.texture, _frame});
+        _used -= entry.bytes;
+        _lru.pop_back();
+        // asked again when it shows up again
+        _entries.erase(it);
+    }
+}
+
+void IconCache::end_frame()
+{
+    ScopeLock _(_mutex);
+    ++_frame;
+    const auto first_alive = std::partition(
+            _dead.begin(), _dead.end(), [this](const DeadTexture& dead) {
+                return _frame - dead.frame < FRAMES_IN_FLIGHT;
+            });
+    for (auto it = first_alive; it != _dead.end(); ++it)
+        pkgi_free_texture(it->texture);
+    _dead.erase(first_alive, _dead.end());
+}
+
+IconCache::Thumbnail IconCache::read_thumbnail(const std::string& titleid)
+{
+    Thumbnail thumbnail;
+    if (!is_titleid(titleid))
+        return thumbnail;
+
+    const auto path = fmt::format("{}/{}", _cache_dir, titleid);
+    if (pkgi_file_exists(path))
+    {
+        const auto data = pkgi_load(path);
+        ThumbnailHeader header;
+        if (data.size() >= sizeof(header))
+        {
+            std::memcpy(&header, data.data(), sizeof(header));
+            const size_t pixels = size_t(header.width) * header.height;
+            if (std::memcmp(header.magic,
+                            THUMBNAIL_MAGIC,
+                            sizeof(THUMBNAIL_MAGIC)) == 0 &&
+                pixels != 0 &&
+                data.size() == sizeof(header) + pixels * sizeof(uint32_t))
+            {
+                thumbnail.width = header.width;
+                thumbnail.height = header.height;
+                thumbnail.pixels.resize(pixels);
+                std::memcpy(
+                        thumbnail.pixels.data(),
+                        data.data() + sizeof(header),
+                        pixels * sizeof(uint32_t));
+                return thumbnail;
+            }
+        }
+        LOGF("ignoring the broken icon thumbnail of {}", titleid);
+    }
+
+    const auto png = fetch_png(titleid);
+    if (png.empty())
+        return thumbnail;
+    decode_png(png, thumbnail.width, thumbnail.height, thumbnail.pixels);
+    scale_down(
+            thumbnail.width, thumbnail.height, thumbnail.pixels, THUMB_SIZE);
+    save_thumbnail(titleid, thumbnail);
+    return thumbnail;
+}
+
+std::vector<uint8_t> IconCache::fetch_png(const std::string& titleid)
+{
+    // the livearea icon of the installed title
+    const auto installed = fmt::format("ur0:appmeta/{}/icon0.png", titleid);
+    if (pkgi_file_exists(installed))
+        return pkgi_load(installed);
+
+    if (_url_template.empty())
+        return {};
+    auto url = _url_template;
+    const auto pos = url.find("{titleid}");
+    if (pos == std::string::npos)
+        return {};
+    url.replace(pos, sizeof("{titleid}") - 1, titleid);
+
+    auto http = _make_http();
+    {
+        ScopeLock _(_mutex);
+        if (_dying)
+            throw std::runtime_error("中止");
+        _https.push_back(http.get());
+    }
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        ScopeLock _(_mutex);
+        _https.erase(std::find(_https.begin(), _https.end(), http.get()));
+    };
+
+    http->start(url, 0);
+    if (http->get_status() == 404)
+        return {};
+    std::vector<uint8_t> data;
+    pkgi_http_consume(*http, [&](const uint8_t* slice, uint32_t size) {
+        if (data.size() + size > MAX_ICON_BYTES)
+            throw std::runtime_error("图标过大");
+        data.insert(data.end(), slice, slice + size);
+    });
+    return data;
+}
+
+void IconCache::save_thumbnail(
+        const std::string& titleid, const Thumbnail& thumbnail)
+{
+    ThumbnailHeader header;
+    std::memcpy(header.magic, THUMBNAIL_MAGIC, sizeof(THUMBNAIL_MAGIC));
+    header.width = static_cast<uint16_t>(thumbnail.width);
+    header.height = static_cast<uint16_t>(thumbnail.height);
+
+    std::vector<uint8_t> data(
+            sizeof(header) + thumbnail.pixels.size() * sizeof(uint32_t));
+    std::memcpy(data.data(), &header, sizeof(header));
+    std::memcpy(
+            data.data() + sizeof(header),
+            thumbnail.pixels.data(),
+            thumbnail.pixels.size() * sizeof(uint32_t));
+
+    // a thumbnail cut by a crash would be read back as broken and fetched
+    // again, it's written aside and renamed in place
+    const auto path = fmt::format("{}/{}", _cache_dir, titleid);
+    try
+    {
+        pkgi_save(path + ".tmp", data.data(), data.size());
+        pkgi_rename(path + ".tmp", path);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to save the icon thumbnail of {}: {}",
+             titleid,
+             e.what());
+    }
+}
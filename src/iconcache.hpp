@@ -0,0 +1,142 @@
+#pragma once
+
+#include "http.hpp"
+#include "memstats.hpp"
+#include "pkgi.hpp"
+#include "taskpool.hpp"
+#include "thread.hpp"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+// The icons of the titles, drawn in the list and the game view. An icon is
+// loaded on the task pool from the thumbnails kept in cache_dir, or else from
+// the icon0.png of the installed title or url_template, where {titleid} is
+// replaced, decoded, scaled down to THUMB_SIZE and kept in cache_dir for the
+// next time. The textures of the icons used last are kept in memory within
+// budget bytes.
+class IconCache
+{
+public:
+    // enough for the game view, the list draws them smaller
+    static constexpr uint32_t THUMB_SIZE = 64;
+
+    using HttpFactory = std::function<std::unique_ptr<Http>()>;
+
+    IconCache(const IconCache&) = delete;
+    IconCache(IconCache&&) = delete;
+    IconCache& operator=(const IconCache&) = delete;
+    IconCache& operator=(IconCache&&) = delete;
+
+    IconCache(
+            TaskPool* pool,
+            HttpFactory make_http,
+            std::string cache_dir,
+            std::string url_template,
+            size_t budget);
+    ~IconCache();
+
+    // from any thread, the textures over it are evicted right away, but for
+    // the icons on screen
+    void set_budget(size_t budget);
+
+    // The calls below are for the render thread.
+
+    // null until the icon is loaded, or if titleid has none. Loading it
+    // goes before the prefetched ones
+    pkgi_texture get(const std::string& titleid);
+    // loads titleids one after the other in the background, in their order
+    // and behind what get() asks for. Replaces the titles of the last call
+    // that aren't loaded yet
+    void prefetch(std::vector<std::string> titleids);
+    // called once the frame is swapped, frees the textures evicted a few
+    // frames ago, that the GPU is done with
+    void end_frame();
+
+    // grows each time an icon is loaded
+    uint32_t serial() const
+    {
+        return _serial;
+    }
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    // the frames that may still be read by the GPU after the swap
+    static constexpr uint32_t FRAMES_IN_FLIGHT = 3;
+
+    enum class State
+    {
+        Loading,
+        Ready,
+        Missing,
+    };
+
+    struct Entry
+    {
+        State state = State::Loading;
+        pkgi_texture texture = nullptr;
+        size_t bytes = 0;
+        // frame of the last get(), the icons on screen aren't evicted
+        uint32_t used_frame = 0;
+        std::list<std::string>::iterator lru;
+    };
+
+    struct DeadTexture
+    {
+        pkgi_texture texture;
+        uint32_t frame;
+    };
+
+    TaskPool* _pool;
+    HttpFactory _make_http;
+    std::string _cache_dir;
+    std::string _url_template;
+
+    Mutex _mutex;
+    size_t _budget;
+    std::unordered_map<std::string, Entry> _entries;
+    // the titles of the ready entries, the last used first
+    std::list<std::string> _lru;
+    size_t _used = 0;
+    MemoryCharge _memory{MemPool::Icons};
+    std::vector<DeadTexture> _dead;
+    uint32_t _frame = 0;
+
+    std::unordered_map<std::string, std::shared_ptr<Task>> _tasks;
+    std::deque<std::string> _prefetch;
+    std::shared_ptr<Task> _prefetch_task;
+    bool _prefetching = false;
+    // the requests in flight, aborted on destruction
+    std::vector<Http*> _https;
+    bool _dying = false;
+
+    std::atomic<uint32_t> _serial{0};
+
+    // must be called with the mutex locked
+    void submit_prefetch();
+    void run_prefetch(const Task& task);
+    void load(const std::string& titleid);
+    // must be called with the mutex locked
+    void evict();
+
+    // RGBA pixels of the thumbnail, empty when titleid has no icon
+    struct Thumbnail
+    {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::vector<uint32_t> pixels;
+    };
+    Thumbnail read_thumbnail(const std::string& titleid);
+    std::vector<uint8_t> fetch_png(const std::string& titleid);
+    void save_thumbnail(const std::string& titleid, const Thumbnail& thumbnail);
+};
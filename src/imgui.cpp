@@ -4,10 +4,19 @@ extern "C"
 #include "style.h"
 }
 
+#include "file.hpp"
 #include "imgui.hpp"
+#include "memstats.hpp"
 
+#include <psp2/kernel/sysmem.h>
 #include <vita2d.h>
 
+#include <algorithm>
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
 extern SceGxmProgram _binary_assets_imgui_v_cg_gxp_start;
 extern SceGxmProgram _binary_assets_imgui_f_cg_gxp_start;
 
@@ -54,6 +63,286 @@ const SceGxmProgramParameter* _vita2d_imguiWvpParam;
 float ortho_proj_matrix[16];
 
 constexpr auto ImguiVertexSize = 20;
+
+// The draw lists are copied to GPU mapped blocks kept from frame to frame
+// instead of the vita2d pool, one per frame in flight so that a frame isn't
+// overwritten while the GPU still reads it. A block grows to the largest
+// frame it was given and is never shrunk
+constexpr size_t FRAMES_IN_FLIGHT = 3;
+// user memory blocks are allocated by pages
+constexpr size_t GPU_PAGE_SIZE = 4 * 1024;
+// enough for the dialogs, the game view takes a bit more
+constexpr size_t MIN_GPU_BUFFER_SIZE = 64 * 1024;
+
+struct GpuBuffer
+{
+    SceUID uid = -1;
+    uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+GpuBuffer gpu_buffers[FRAMES_IN_FLIGHT];
+size_t gpu_frame = 0;
+MemoryCharge gpu_memory{MemPool::ImGui};
+
+void gpu_free(GpuBuffer& buffer)
+{
+    sceGxmUnmapMemory(buffer.data);
+    sceKernelFreeMemBlock(buffer.uid);
+    buffer = {};
+}
+
+void gpu_alloc(GpuBuffer& buffer, size_t size)
+{
+    size = (size + GPU_PAGE_SIZE - 1) & ~(GPU_PAGE_SIZE - 1);
+    const auto uid = sceKernelAllocMemBlock(
+            "imgui_buffer",
+            SCE_KERNEL_MEMBLOCK_TYPE_USER_RW_UNCACHE,
+            size,
+            nullptr);
+    if (uid < 0)
+        throw formatEx<std::runtime_error>(
+                "sceKernelAllocMemBlock failed: {:#08x}",
+                static_cast<uint32_t>(uid));
+    void* data;
+    sceKernelGetMemBlockBase(uid, &data);
+    const auto err = sceGxmMapMemory(data, size, SCE_GXM_MEMORY_ATTRIB_READ);
+    if (err != 0)
+    {
+        sceKernelFreeMemBlock(uid);
+        throw formatEx<std::runtime_error>(
+                "sceGxmMapMemory failed: {:#08x}", static_cast<uint32_t>(err));
+    }
+    buffer.uid = uid;
+    buffer.data = static_cast<uint8_t*>(data);
+    buffer.size = size;
+}
+
+// the block for the next frame, at least size bytes
+GpuBuffer& next_gpu_buffer(size_t size)
+{
+    auto& buffer = gpu_buffers[gpu_frame];
+    gpu_frame = (gpu_frame + 1) % FRAMES_IN_FLIGHT;
+    if (buffer.size < size)
+    {
+        if (buffer.data)
+        {
+            // rare, only until the largest dialog was shown once
+            sceGxmFinish(vita2d_get_context());
+            gpu_free(buffer);
+        }
+        gpu_alloc(buffer, std::max(size, MIN_GPU_BUFFER_SIZE));
+        size_t total = 0;
+        for (const auto& b : gpu_buffers)
+            total += b.size;
+        gpu_memory.set(total);
+    }
+    return buffer;
+}
+
+// the font cache is FONT_CACHE_MAGIC, FONT_CACHE_VERSION, the mtime and size
+// of the font file and the size asked for, then the FontCacheHeader, the
+// glyphs and the alpha of the atlas, all native endian as it never leaves
+// the console
+constexpr uint32_t FONT_CACHE_MAGIC = 0x46474b50; // "PKGF"
+constexpr uint32_t FONT_CACHE_VERSION = 1;
+
+struct FontCacheKey
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t mtime;
+    int64_t file_size;
+    float size;
+};
+
+struct FontCacheHeader
+{
+    int32_t width;
+    int32_t height;
+    ImVec2 white_pixel;
+    float font_size;
+    float ascent;
+    float descent;
+    ImVec2 display_offset;
+    uint32_t glyph_count;
+};
+
+FontCacheKey font_cache_key(const std::string& path, float size)
+{
+    FontCacheKey key{};
+    key.magic = FONT_CACHE_MAGIC;
+    key.version = FONT_CACHE_VERSION;
+    key.mtime = pkgi_get_mtime(path);
+    key.file_size = pkgi_get_size(path.c_str());
+    key.size = size;
+    return key;
+}
+
+// white with the alpha of pixels, a quarter of the size of the RGBA atlas
+void upload_atlas(const uint8_t* pixels, int width, int height)
+{
+    const auto texture = vita2d_create_empty_texture_format(
+            width, height, SCE_GXM_TEXTURE_FORMAT_U8_R111);
+    if (!texture)
+        throw std::runtime_error("can't create the font texture");
+    const auto stride = vita2d_texture_get_stride(texture);
+    const auto data = static_cast<uint8_t*>(vita2d_texture_get_datap(texture));
+    for (int y = 0; y < height; ++y)
+        memcpy(data + y * stride, pixels + y * width, width);
+    ImGui::GetIO().Fonts->TexID = texture;
+}
+
+// false if cache_path doesn't hold the atlas of key
+bool load_font_cache(const std::string& cache_path, const FontCacheKey& key)
+{
+    if (!pkgi_file_exists(cache_path))
+        return false;
+    const auto data = pkgi_load(cache_path);
+
+    FontCacheHeader header;
+    if (data.size() < sizeof(key) + sizeof(header) ||
+        memcmp(data.data(), &key, sizeof(key)) != 0)
+        return false;
+    memcpy(&header, data.data() + sizeof(key), sizeof(header));
+    const auto glyphs = data.data() + sizeof(key) + sizeof(header);
+    const auto pixels = glyphs + header.glyph_count * sizeof(ImFontGlyph);
+    if (header.width <= 0 || header.height <= 0 ||
+        static_cast<size_t>(pixels - data.data()) +
+                        size_t(header.width) * header.height !=
+                data.size())
+        return false;
+
+    // what ImFontAtlas::Build() would have left
+    const auto atlas = ImGui::GetIO().Fonts;
+    const auto font = IM_NEW(ImFont);
+    atlas->Fonts.push_back(font);
+    font->FontSize = header.font_size;
+    font->Ascent = header.ascent;
+    font->Descent = header.descent;
+    font->DisplayOffset = header.display_offset;
+    font->ContainerAtlas = atlas;
+    font->Glyphs.resize(header.glyph_count);
+    memcpy(font->Glyphs.Data, glyphs, header.glyph_count * sizeof(ImFontGlyph));
+    font->BuildLookupTable();
+    atlas->TexWidth = header.width;
+    atlas->TexHeight = header.height;
+    atlas->TexUvScale = ImVec2(1.0f / header.width, 1.0f / header.height);
+    atlas->TexUvWhitePixel = header.white_pixel;
+
+    upload_atlas(pixels, header.width, header.height);
+    return true;
+}
+
+void save_font_cache(
+        const std::string& cache_path,
+        const FontCacheKey& key,
+        const uint8_t* pixels,
+        int width,
+        int height)
+{
+    const auto atlas = ImGui::GetIO().Fonts;
+    const auto font = atlas->Fonts[0];
+
+    FontCacheHeader header{};
+    header.width = width;
+    header.height = height;
+    header.white_pixel = atlas->TexUvWhitePixel;
+    header.font_size = font->FontSize;
+    header.ascent = font->Ascent;
+    header.descent = font->Descent;
+    header.display_offset = font->DisplayOffset;
+    header.glyph_count = font->Glyphs.Size;
+
+    std::vector<uint8_t> data(
+            sizeof(key) + sizeof(header) +
+            header.glyph_count * sizeof(ImFontGlyph) + size_t(width) * height);
+    auto out = data.data();
+    memcpy(out, &key, sizeof(key));
+    out += sizeof(key);
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    memcpy(out, font->Glyphs.Data, header.glyph_count * sizeof(ImFontGlyph));
+    out += header.glyph_count * sizeof(ImFontGlyph);
+    memcpy(out, pixels, size_t(width) * height);
+
+    const auto tmp = cache_path + ".tmp";
+    pkgi_save(tmp, data.data(), data.size());
+    pkgi_rename(tmp, cache_path);
+}
+
+// the size of each allocation is kept in front of it, to be given back to
+// the accounting when it's freed
+void* imgui_alloc(size_t size, void*)
+{
+    const auto block =
+            static_cast<max_align_t*>(malloc(sizeof(max_align_t) + size));
+    if (!block)
+        return nullptr;
+    *reinterpret_cast<size_t*>(block) = size;
+    pkgi_mem_add(MemPool::ImGui, size);
+    return block + 1;
+}
+
+void imgui_free(void* ptr, void*)
+{
+    if (!ptr)
+        return;
+    const auto block = static_cast<max_align_t*>(ptr) - 1;
+    pkgi_mem_add(
+            MemPool::ImGui,
+            -static_cast<int64_t>(*reinterpret_cast<size_t*>(block)));
+    free(block);
+}
+}
+
+void init_imgui_allocator()
+{
+    ImGui::SetAllocatorFunctions(&imgui_alloc, &imgui_free);
+}
+
+void pkgi_load_imgui_font(
+        const std::string& path, float size, const std::string& cache_path)
+{
+    const auto key = font_cache_key(path, size);
+    try
+    {
+        if (load_font_cache(cache_path, key))
+        {
+            LOGF("font loaded from {}", cache_path);
+            return;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("can't load font cache {}: {}", cache_path, e.what());
+    }
+
+    const auto atlas = ImGui::GetIO().Fonts;
+    atlas->Clear();
+    if (!atlas->AddFontFromFileTTF(
+                path.c_str(),
+                size,
+                0,
+                atlas->GetGlyphRangesChineseSimplifiedCommon()))
+        throw formatEx<std::runtime_error>("无法加载 {}", path);
+    uint8_t* pixels;
+    int width, height;
+    atlas->GetTexDataAsAlpha8(&pixels, &width, &height);
+    upload_atlas(pixels, width, height);
+
+    try
+    {
+        save_font_cache(cache_path, key, pixels, width, height);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("can't save font cache {}: {}", cache_path, e.what());
+    }
+
+    // the font file and the pixels are on the GPU now
+    atlas->ClearInputData();
+    atlas->ClearTexData();
 }
 
 void init_imgui()
@@ -180,8 +469,20 @@ void init_imgui()
 
 void pkgi_imgui_render(ImDrawData* draw_data)
 {
+    if (draw_data->CmdListsCount == 0)
+        return;
+
     auto _vita2d_context = vita2d_get_context();
 
+    // the vertices of all the lists, then their indices
+    static_assert(sizeof(ImDrawIdx) == 2);
+    const size_t vertices_size = draw_data->TotalVtxCount * ImguiVertexSize;
+    const size_t indices_offset = (vertices_size + 3) & ~size_t(3);
+    auto& buffer = next_gpu_buffer(
+            indices_offset + draw_data->TotalIdxCount * sizeof(ImDrawIdx));
+    auto vertices = buffer.data;
+    auto indices = reinterpret_cast<uint16_t*>(buffer.data + indices_offset);
+
     sceGxmSetVertexProgram(_vita2d_context, _vita2d_imguiVertexProgram);
     sceGxmSetFragmentProgram(_vita2d_context, _vita2d_imguiFragmentProgram);
 
@@ -199,20 +500,11 @@ void pkgi_imgui_render(ImDrawData* draw_data)
         const auto idx_buffer = cmd_list->IdxBuffer.Data;
         const auto idx_size = cmd_list->IdxBuffer.Size;
 
-        const auto vertices = vita2d_pool_memalign(
-                vtx_size * ImguiVertexSize, ImguiVertexSize);
-        if (vertices == nullptr)
-            throw std::runtime_error("video memory too low");
         memcpy(vertices, vtx_buffer, vtx_size * ImguiVertexSize);
-
-        static_assert(sizeof(ImDrawIdx) == 2);
-        auto indices = (uint16_t*)vita2d_pool_memalign(
-                idx_size * sizeof(ImDrawIdx), sizeof(void*));
-        if (vertices == nullptr)
-            throw std::runtime_error("video memory too low");
         memcpy(indices, idx_buffer, idx_size * sizeof(ImDrawIdx));
 
         auto err = sceGxmSetVertexStream(_vita2d_context, 0, vertices);
+        vertices += vtx_size * ImguiVertexSize;
         if (err != 0)
             throw formatEx<std::runtime_error>(
                     "sceGxmSetVertexStream failed: {:#08x}",
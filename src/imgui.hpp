@@ -1,4 +1,14 @@
 #include <imgui.h>
 
+#include <string>
+
+// to be called before the context is created
+void init_imgui_allocator();
+// adds the font at path with the common simplified Chinese glyphs to the
+// atlas and uploads it as an alpha only texture. The glyphs are rasterized
+// once, the atlas and its metrics are kept in cache_path and loaded from it
+// in a single read for as long as the font file doesn't change
+void pkgi_load_imgui_font(
+        const std::string& path, float size, const std::string& cache_path);
 void init_imgui();
 void pkgi_imgui_render(ImDrawData* draw_data);
\ No newline at end of file
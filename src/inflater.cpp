@@ -0,0 +1,53 @@
+#include "inflater.hpp"
+
+#include "log.hpp"
+
+#include <stdexcept>
+
+#include <zlib.h>
+
+static constexpr uint32_t OUTPUT_SIZE = 64 * 1024;
+
+Inflater::Inflater()
+    : _stream(std::make_unique<z_stream>()), _output(OUTPUT_SIZE)
+{
+    // 32 lets zlib detect the gzip or zlib header
+    const auto err = inflateInit2(_stream.get(), 32 + MAX_WBITS);
+    if (err != Z_OK)
+        throw formatEx<std::runtime_error>("无法初始化解压: {}", err);
+}
+
+Inflater::~Inflater()
+{
+    inflateEnd(_stream.get());
+}
+
+bool Inflater::handles(const std::string& encoding)
+{
+    return encoding == "gzip" || encoding == "deflate";
+}
+
+void Inflater::write(
+        const uint8_t* data, uint32_t size, const WriteFunction& write)
+{
+    _stream->next_in = const_cast<uint8_t*>(data);
+    _stream->avail_in = size;
+    while (_stream->avail_in != 0 && !_done)
+    {
+        _stream->next_out = _output.data();
+        _stream->avail_out = _output.size();
+        const auto err = inflate(_stream.get(), Z_NO_FLUSH);
+        if (err != Z_OK && err != Z_STREAM_END)
+            throw formatEx<std::runtime_error>(
+                    "解压失败: {}", _stream->msg ? _stream->msg : "");
+        _done = err == Z_STREAM_END;
+        write(_output.data(), _output.size() - _stream->avail_out);
+    }
+}
+
+void Inflater::finish()
+{
+    if (!_done)
+        throw std::runtime_error(
+                "压缩数据不完整, 请检查网络连接是否异常, 然后重试");
+}
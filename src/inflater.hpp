@@ -0,0 +1,39 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+typedef struct z_stream_s z_stream;
+
+// Streaming decoder for bodies sent with Content-Encoding gzip or deflate,
+// fed with the compressed bytes as they come from the network.
+class Inflater
+{
+public:
+    using WriteFunction = std::function<void(const uint8_t*, uint32_t)>;
+
+    Inflater(const Inflater&) = delete;
+    Inflater(Inflater&&) = delete;
+    Inflater& operator=(const Inflater&) = delete;
+    Inflater& operator=(Inflater&&) = delete;
+
+    Inflater();
+    ~Inflater();
+
+    // true when a response with this Content-Encoding must go through here
+    static bool handles(const std::string& encoding);
+
+    // decodes size bytes and hands out the result to write
+    void write(const uint8_t* data, uint32_t size, const WriteFunction& write);
+    // throws if the stream ended before its end marker
+    void finish();
+
+private:
+    std::unique_ptr<z_stream> _stream;
+    bool _done = false;
+    std::vector<uint8_t> _output;
+};
@@ -1,36 +1,30 @@
 #include "install.hpp"
 
-#include "extractzip.hpp"
 #include "file.hpp"
 #include "log.hpp"
+#include "presencescanner.hpp"
+#include "titlemetadata.hpp"
 #include "sfo.hpp"
 #include "sqlite.hpp"
+#include "trace.hpp"
+#include "trash.hpp"
 
 #include <boost/scope_exit.hpp>
 
 #include <psp2/io/fcntl.h>
 #include <psp2/promoterutil.h>
 
-std::vector<std::string> pkgi_get_installed_games()
-{
-    return pkgi_list_dir_contents("ux0:app");
-}
-
-std::vector<std::string> pkgi_get_installed_themes()
-{
-    return pkgi_list_dir_contents("ux0:theme");
-}
-
 namespace
 {
-std::string pkgi_extract_package_version(const std::string& package)
+GameVersion pkgi_extract_package_version(const std::string& package)
 {
     const auto sfo = pkgi_load(fmt::format("{}/sce_sys/param.sfo", package));
-    return pkgi_sfo_get_string(sfo.data(), sfo.size(), "APP_VER");
+    return {pkgi_sfo_get_string(sfo.data(), sfo.size(), "APP_VER"),
+            pkgi_sfo_get_string(sfo.data(), sfo.size(), "PSP2_DISP_VER")};
 }
 }
 
-std::string pkgi_get_game_version(const std::string& titleid)
+GameVersion pkgi_get_game_version(const std::string& titleid)
 {
     const auto patch_dir = fmt::format("ux0:patch/{}", titleid);
     if (pkgi_file_exists(patch_dir.c_str()))
@@ -40,7 +34,7 @@ std::string pkgi_get_game_version(const std::string& titleid)
     if (pkgi_file_exists(game_dir.c_str()))
         return pkgi_extract_package_version(game_dir);
 
-    return "";
+    return {};
 }
 
 bool pkgi_dlc_is_installed(const char* content)
@@ -57,14 +51,19 @@ bool pkgi_psm_is_installed(const char* titleid)
 
 bool pkgi_psp_is_installed(const char* psppartition, const char* content)
 {
-    return pkgi_file_exists(
-                   fmt::format(
-                           "{}pspemu/ISO/{:.9}.iso", psppartition, content + 7)
-                           .c_str()) ||
-           pkgi_file_exists(
-                   fmt::format(
-                           "{}pspemu/PSP/GAME/{:.9}/EBOOT.PBP", psppartition, content + 7)
-                           .c_str());
+    for (const auto format : {IsoFormat::Iso, IsoFormat::Cso, IsoFormat::Zso})
+        if (pkgi_file_exists(fmt::format(
+                                     "{}pspemu/ISO/{:.9}.{}",
+                                     psppartition,
+                                     content + 7,
+                                     pkgi_iso_format_name(format))
+                                     .c_str()))
+            return true;
+    return pkgi_file_exists(fmt::format(
+                                    "{}pspemu/PSP/GAME/{:.9}/EBOOT.PBP",
+                                    psppartition,
+                                    content + 7)
+                                    .c_str());
 }
 
 bool pkgi_psx_is_installed(const char* psppartition, const char* content)
@@ -76,6 +75,7 @@ bool pkgi_psx_is_installed(const char* psppartition, const char* content)
 
 void pkgi_install(const char* contentid)
 {
+    TRACE_SCOPE("install");
     char path[128];
     snprintf(path, sizeof(path), "ux0:pkgj/%s", contentid);
 
@@ -88,10 +88,18 @@ void pkgi_install(const char* contentid)
                 static_cast<uint32_t>(res) == 0x80870004
                         ? "请检查NoNpDrm插件安装是否正确"
                         : "");
+
+    // the promoter puts games, dlcs and themes in their place
+    pkgi_presence_changed("ux0:app");
+    pkgi_presence_changed("ux0:theme");
+    pkgi_presence_changed("ux0:addcont");
+    pkgi_presence_changed(fmt::format("ux0:addcont/{:.9}", contentid + 7));
+    pkgi_title_metadata_changed(fmt::format("{:.9}", contentid + 7));
 }
 
 void pkgi_install_update(const std::string& titleid)
 {
+    TRACE_SCOPE("install_update");
     pkgi_mkdirs("ux0:patch");
 
     const auto src = fmt::format("ux0:pkgj/{}", titleid);
@@ -102,27 +110,36 @@ void pkgi_install_update(const std::string& titleid)
         throw formatEx<std::runtime_error>(
                 "调用NoNpDrm函数错误: {:#08x}",
                 static_cast<uint32_t>(res));
+    pkgi_title_metadata_changed(titleid);
 }
 
-void pkgi_install_comppack(
-        const std::string& titleid, bool patch, const std::string& version)
+std::string pkgi_begin_comppack_install(const std::string& titleid, bool patch)
 {
-    const auto src = fmt::format("ux0:pkgj/{}-comp.ppk", titleid);
     const auto dest = fmt::format("ux0:rePatch/{}", titleid);
 
+    // the version of what gets replaced goes first, a base comppack
+    // replaces the patch one too
+    pkgi_rm((dest + "/patch_comppack_version").c_str());
     if (!patch)
-        pkgi_rm((dest + "/patch_comppack_version").c_str());
+        pkgi_rm((dest + "/base_comppack_version").c_str());
 
     pkgi_mkdirs(dest.c_str());
+    LOGF("installing comp pack to {}", dest);
+    return dest;
+}
 
-    LOGF("installing comp pack from {} to {}", src, dest);
-    pkgi_extract_zip(src, dest);
+void pkgi_end_comppack_install(
+        const std::string& titleid, bool patch, const std::string& version)
+{
+    TRACE_SCOPE("install_comppack");
+    const auto dest = fmt::format("ux0:rePatch/{}", titleid);
 
     pkgi_save(
             fmt::format(
                     "{}/{}_comppack_version", dest, patch ? "patch" : "base"),
             version.data(),
             version.size());
+    pkgi_title_metadata_changed(titleid);
 }
 
 CompPackVersion pkgi_get_comppack_versions(const std::string& titleid)
@@ -163,6 +180,7 @@ CompPackVersion pkgi_get_comppack_versions(const std::string& titleid)
 
 void pkgi_install_psmgame(const char* contentid)
 {
+    TRACE_SCOPE("install_psm");
     pkgi_mkdirs("ux0:psm");
     const auto titleid = fmt::format("{:.9}", contentid + 7);
     const auto src = fmt::format("ux0:pkgj/{}", contentid);
@@ -173,10 +191,12 @@ void pkgi_install_psmgame(const char* contentid)
     if (res < 0)
         throw formatEx<std::runtime_error>(
                 "无法重命名: {:#08x}", static_cast<uint32_t>(res));
+    pkgi_presence_changed("ux0:psm");
 }
 
 void pkgi_install_pspgame(const char* partition, const char* contentid)
 {
+    TRACE_SCOPE("install_psp");
     LOG("Installing a PSP/PSX game");
     const auto path = fmt::format("{}pkgj/{}", partition, contentid);
     const auto dest =
@@ -189,6 +209,7 @@ void pkgi_install_pspgame(const char* partition, const char* contentid)
     if (res < 0)
         throw std::runtime_error(fmt::format(
                 "无法重命名: {:#08x}", static_cast<uint32_t>(res)));
+    pkgi_presence_changed(fmt::format("{}pspemu/PSP/GAME", partition));
 }
 
 static void pkgi_move_merge(const std::string& from, const std::string& to)
@@ -220,8 +241,10 @@ static void pkgi_move_merge(const std::string& from, const std::string& to)
                 (int)toType);
 }
 
-void pkgi_install_pspgame_as_iso(const char* partition, const char* contentid)
+void pkgi_install_pspgame_as_iso(
+        const char* partition, const char* contentid, IsoFormat format)
 {
+    TRACE_SCOPE("install_psp_iso");
     const auto path = fmt::format("{}pkgj/{}", partition, contentid);
     const auto dest =
             fmt::format("{}pspemu/PSP/GAME/{:.9}", partition, contentid + 7);
@@ -230,8 +253,11 @@ void pkgi_install_pspgame_as_iso(const char* partition, const char* contentid)
     const auto eboot = fmt::format("{}/EBOOT.PBP", path);
     const auto content = fmt::format("{}/CONTENT.DAT", path);
     const auto pspkey = fmt::format("{}/PSP-KEY.EDAT", path);
-    const auto isodest =
-            fmt::format("{}pspemu/ISO/{:.9}.iso", partition, contentid + 7);
+    const auto isodest = fmt::format(
+            "{}pspemu/ISO/{:.9}.{}",
+            partition,
+            contentid + 7,
+            pkgi_iso_format_name(format));
 
     pkgi_mkdirs(fmt::format("{}pspemu/ISO", partition).c_str());
 
@@ -250,11 +276,14 @@ void pkgi_install_pspgame_as_iso(const char* partition, const char* contentid)
         pkgi_rename(
                 pspkey.c_str(), fmt::format("{}/PSP-KEY.EDAT", dest).c_str());
 
-    pkgi_delete_dir(path);
+    pkgi_trash_dir(path);
+    pkgi_presence_changed(fmt::format("{}pspemu/ISO", partition));
+    pkgi_presence_changed(fmt::format("{}pspemu/PSP/GAME", partition));
 }
 
 void pkgi_install_pspdlc(const char* partition, const char* contentid)
 {
+    TRACE_SCOPE("install_psp_dlc");
     LOG("Installing a PSP DLC");
     const auto path = fmt::format("{}pkgj/{}", partition, contentid);
     const auto dest =
@@ -263,6 +292,10 @@ void pkgi_install_pspdlc(const char* partition, const char* contentid)
     pkgi_mkdirs(fmt::format("{}pspemu/PSP/GAME", partition).c_str());
 
     LOG("installing psp dlc at %s to %s", path.c_str(), dest.c_str());
-    pkgi_move_merge(path, dest);
-    pkgi_delete_dir(path);
+    // the download writes the files of the DLC in dest already, only what is
+    // left of path is merged
+    if (pkgi_get_inode_type(path) != InodeType::NotExist)
+        pkgi_move_merge(path, dest);
+    pkgi_trash_dir(path);
+    pkgi_presence_changed(fmt::format("{}pspemu/PSP/GAME", partition));
 }
\ No newline at end of file
@@ -1,7 +1,8 @@
 #pragma once
 
+#include "isocompressor.hpp"
+
 #include <string>
-#include <vector>
 
 struct CompPackVersion
 {
@@ -10,9 +11,16 @@ struct CompPackVersion
     std::string patch;
 };
 
-std::vector<std::string> pkgi_get_installed_games();
-std::vector<std::string> pkgi_get_installed_themes();
-std::string pkgi_get_game_version(const std::string& titleid);
+struct GameVersion
+{
+    // APP_VER, of the patch when there is one
+    std::string app;
+    // PSP2_DISP_VER, the firmware the installed version needs
+    std::string system;
+};
+
+// empty when the game isn't installed
+GameVersion pkgi_get_game_version(const std::string& titleid);
 CompPackVersion pkgi_get_comppack_versions(const std::string& titleid);
 bool pkgi_dlc_is_installed(const char* content);
 bool pkgi_psm_is_installed(const char* titleid);
@@ -20,9 +28,15 @@ bool pkgi_psp_is_installed(const char* psppartition, const char* content);
 bool pkgi_psx_is_installed(const char* psppartition, const char* content);
 void pkgi_install(const char* contentid);
 void pkgi_install_update(const std::string& titleid);
-void pkgi_install_comppack(
+// the comppack is extracted in the returned folder while it downloads, its
+// version is only written by pkgi_end_comppack_install(), so that one cut
+// in the middle is offered again
+std::string pkgi_begin_comppack_install(const std::string& titleid, bool patch);
+void pkgi_end_comppack_install(
         const std::string& titleid, bool patch, const std::string& version);
 void pkgi_install_psmgame(const char* contentid);
 void pkgi_install_pspgame(const char* partition, const char* contentid);
-void pkgi_install_pspgame_as_iso(const char* partition, const char* contentid);
+// the game is in the format it was downloaded with, see IsoFormat
+void pkgi_install_pspgame_as_iso(
+        const char* partition, const char* contentid, IsoFormat format);
 void pkgi_install_pspdlc(const char* partition, const char* contentid);
\ No newline at end of file
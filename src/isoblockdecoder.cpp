@@ -0,0 +1,210 @@
+#include "isoblockdecoder.hpp"
+
+#include "log.hpp"
+#include "lzrc.hpp"
+
+#include <fmt/format.h>
+
+#include <stdexcept>
+
+IsoBlockDecoder::IsoBlockDecoder(
+        const aes128_ctx* key,
+        const uint8_t* iv,
+        uint32_t block_size,
+        StageStats* stats,
+        IsoCompressor* compressor)
+    : _key(key)
+    , _iv(iv)
+    , _block_size(block_size)
+    , _stats(stats)
+    , _compressor(compressor)
+    , _cond("iso_block_cond")
+    , _blocks(WINDOW_SIZE)
+{
+    for (auto& block : _blocks)
+    {
+        block.input.resize(MAX_BLOCK_SIZE);
+        block.output.resize(MAX_BLOCK_SIZE);
+        if (_compressor)
+            block.compressed.reserve(MAX_BLOCK_SIZE);
+    }
+    _memory.set(WINDOW_SIZE * (_compressor ? 3 : 2) * MAX_BLOCK_SIZE);
+
+    for (size_t i = 0; i < WORKER_COUNT; ++i)
+        _workers.push_back(std::make_unique<Thread>(
+                fmt::format("iso_block_{}", i),
+                [this] { run(); },
+                ThreadRole::Worker));
+}
+
+IsoBlockDecoder::~IsoBlockDecoder()
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+    }
+    _cond.notify_all();
+    for (auto& worker : _workers)
+        worker->join();
+}
+
+void IsoBlockDecoder::write_done(const WriteFunction& write, bool all)
+{
+    while (true)
+    {
+        size_t index;
+        {
+            ScopeLock _(_cond.get_mutex());
+            if (_used == 0)
+                return;
+            while (all && _blocks[_head].state != State::Done)
+                _cond.wait();
+            if (_blocks[_head].state != State::Done)
+                return;
+            index = _head;
+        }
+
+        // done blocks aren't touched by the workers
+        auto& block = _blocks[index];
+        if (block.error)
+            std::rethrow_exception(block.error);
+        if (_compressor)
+            _compressor->add(block.sector_sizes);
+        write(block.result, block.result_size);
+
+        {
+            ScopeLock _(_cond.get_mutex());
+            block.state = State::Free;
+            _head = (_head + 1) % _blocks.size();
+            --_used;
+        }
+    }
+}
+
+uint8_t* IsoBlockDecoder::next_input(const WriteFunction& write)
+{
+    while (true)
+    {
+        write_done(write, false);
+
+        ScopeLock _(_cond.get_mutex());
+        if (_used < _blocks.size())
+        {
+            auto& block = _blocks[(_head + _used) % _blocks.size()];
+            block.state = State::Filling;
+            block.error = nullptr;
+            ++_used;
+            return block.input.data();
+        }
+
+        // the window is full, wait for the oldest block to be written out
+        while (_blocks[_head].state != State::Done)
+            _cond.wait();
+    }
+}
+
+void IsoBlockDecoder::submit(uint32_t size, uint32_t offset, uint32_t flags)
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        auto& block = _blocks[(_head + _used - 1) % _blocks.size()];
+        block.size = size;
+        block.offset = offset;
+        block.flags = flags;
+        block.state = State::Queued;
+    }
+    _cond.notify_all();
+}
+
+void IsoBlockDecoder::finish(const WriteFunction& write)
+{
+    write_done(write, true);
+}
+
+void IsoBlockDecoder::decode(Block& block)
+{
+    try
+    {
+        if ((block.flags & 4) == 0)
+        {
+            StageTimer timer(_stats, Stage::PspDecrypt, block.size);
+            aes128_psp_decrypt(
+                    _key,
+                    _iv,
+                    block.offset / 16,
+                    block.input.data(),
+                    block.size);
+        }
+
+        if (block.size == _block_size)
+            block.result = block.input.data();
+        else
+        {
+            StageTimer timer(_stats, Stage::Lzrc, _block_size);
+            const auto out_size = lzrc_decompress(
+                    block.output.data(),
+                    block.output.size(),
+                    block.input.data(),
+                    block.size);
+            if (out_size != static_cast<int>(_block_size))
+                throw std::runtime_error(
+                        "内部错误 - PKG文件可能已损坏! "
+                        "请重新下载");
+            block.result = block.output.data();
+        }
+        block.result_size = _block_size;
+
+        if (_compressor)
+        {
+            StageTimer timer(_stats, Stage::IsoCompress, _block_size);
+            _compressor->compress(
+                    block.result,
+                    _block_size,
+                    block.compressed,
+                    block.sector_sizes);
+            block.result = block.compressed.data();
+            block.result_size = block.compressed.size();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to decode iso block @ {}: {}", block.offset, e.what());
+        block.error = std::current_exception();
+    }
+}
+
+void IsoBlockDecoder::run()
+{
+    while (true)
+    {
+        Block* block = nullptr;
+        {
+            ScopeLock _(_cond.get_mutex());
+            while (true)
+            {
+                if (_dying)
+                    return;
+                // take the oldest queued block so that the writer gets its
+                // blocks as soon as possible
+                for (size_t i = 0; i < _used && !block; ++i)
+                {
+                    auto& candidate = _blocks[(_head + i) % _blocks.size()];
+                    if (candidate.state == State::Queued)
+                        block = &candidate;
+                }
+                if (block)
+                    break;
+                _cond.wait();
+            }
+            block->state = State::Decoding;
+        }
+
+        decode(*block);
+
+        {
+            ScopeLock _(_cond.get_mutex());
+            block->state = State::Done;
+        }
+        _cond.notify_all();
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "aes128.hpp"
+#include "isocompressor.hpp"
+#include "memstats.hpp"
+#include "stagestats.hpp"
+#include "thread.hpp"
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+
+// Decrypts and decompresses the blocks of a PSP NPUMDIMG image on worker
+// threads. Blocks are independent, so several of them are decoded at once in
+// a bounded window and handed back in the order they were submitted. With a
+// compressor, the workers compress the decoded blocks as well and the blocks
+// handed back are the compressed ones.
+class IsoBlockDecoder
+{
+public:
+    using WriteFunction = std::function<void(const uint8_t*, uint32_t)>;
+
+    static constexpr uint32_t MAX_BLOCK_SIZE = 16 * 2048;
+    static constexpr size_t WINDOW_SIZE = 8;
+    static constexpr size_t WORKER_COUNT = 3;
+
+    IsoBlockDecoder(const IsoBlockDecoder&) = delete;
+    IsoBlockDecoder(IsoBlockDecoder&&) = delete;
+    IsoBlockDecoder& operator=(const IsoBlockDecoder&) = delete;
+    IsoBlockDecoder& operator=(IsoBlockDecoder&&) = delete;
+
+    // block_size is the size of a decoded block, key, iv, stats and
+    // compressor must outlive the decoder. The decoding is timed into stats
+    // when set. The sectors are added to compressor as the blocks are handed
+    // out
+    IsoBlockDecoder(
+            const aes128_ctx* key,
+            const uint8_t* iv,
+            uint32_t block_size,
+            StageStats* stats = nullptr,
+            IsoCompressor* compressor = nullptr);
+    ~IsoBlockDecoder();
+
+    // hands out decoded blocks to write and returns a MAX_BLOCK_SIZE buffer
+    // to put the next block in, waits while the window is full
+    uint8_t* next_input(const WriteFunction& write);
+    // queues the block put in the buffer returned by next_input(), size
+    // can't be more than MAX_BLOCK_SIZE
+    void submit(uint32_t size, uint32_t offset, uint32_t flags);
+    // waits for all queued blocks and hands them out to write
+    void finish(const WriteFunction& write);
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    enum class State
+    {
+        Free,
+        Filling,
+        Queued,
+        Decoding,
+        Done,
+    };
+
+    struct Block
+    {
+        State state = State::Free;
+        std::vector<uint8_t> input;
+        std::vector<uint8_t> output;
+        // the compressed block and the size of each of its sectors
+        std::vector<uint8_t> compressed;
+        std::vector<uint32_t> sector_sizes;
+        uint32_t size = 0;
+        uint32_t offset = 0;
+        uint32_t flags = 0;
+        // points to input, output or compressed
+        const uint8_t* result = nullptr;
+        uint32_t result_size = 0;
+        std::exception_ptr error;
+    };
+
+    const aes128_ctx* _key;
+    const uint8_t* _iv;
+    uint32_t _block_size;
+    StageStats* _stats;
+    IsoCompressor* _compressor;
+
+    Cond _cond;
+    std::vector<Block> _blocks;
+    MemoryCharge _memory{MemPool::Download};
+    // oldest block still to be written, and number of blocks after it which
+    // are in use
+    size_t _head = 0;
+    size_t _used = 0;
+    bool _dying = false;
+
+    std::vector<std::unique_ptr<Thread>> _workers;
+
+    void write_done(const WriteFunction& write, bool all);
+    void decode(Block& block);
+    void run();
+};
@@ -0,0 +1,288 @@
+#include "isocompressor.hpp"
+
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <boost/scope_exit.hpp>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <string.h>
+
+#include <zlib.h>
+
+namespace
+{
+constexpr uint32_t HEADER_SIZE = 0x18;
+constexpr uint32_t STORED = 0x80000000;
+
+// the sectors are independent, a window of one sector is all it takes
+constexpr int DEFLATE_WINDOW_BITS = 11;
+constexpr int DEFLATE_MEM_LEVEL = 5;
+
+// the LZ4 block format: a sequence is a token with the literal length in its
+// high nibble and the match length minus MIN_MATCH in its low one, both
+// going on in bytes of 255 when they don't fit, then the literals and the
+// offset of the match. The last sequence only has literals
+constexpr uint32_t MIN_MATCH = 4;
+constexpr uint32_t LAST_LITERALS = 5;
+constexpr uint32_t MATCH_LIMIT = 12;
+constexpr uint32_t HASH_BITS = 12;
+
+uint32_t read32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) |
+           (static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint32_t hash32(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+class Lz4Output
+{
+public:
+    Lz4Output(uint8_t* out, uint32_t capacity) : _out(out), _capacity(capacity)
+    {
+    }
+
+    // false when the sequence doesn't fit
+    bool sequence(
+            const uint8_t* literals,
+            uint32_t literal_count,
+            uint32_t offset,
+            uint32_t match_length)
+    {
+        const uint32_t match_code =
+                match_length ? match_length - MIN_MATCH : 0;
+        if (!put((std::min<uint32_t>(literal_count, 15) << 4) |
+                 std::min<uint32_t>(match_code, 15)))
+            return false;
+        if (literal_count >= 15 && !put_length(literal_count - 15))
+            return false;
+        if (_size + literal_count > _capacity)
+            return false;
+        std::copy(literals, literals + literal_count, _out + _size);
+        _size += literal_count;
+        if (!match_length)
+            return true;
+        if (!put(offset & 0xff) || !put(offset >> 8))
+            return false;
+        return match_code < 15 || put_length(match_code - 15);
+    }
+
+    uint32_t size() const
+    {
+        return _size;
+    }
+
+private:
+    uint8_t* _out;
+    uint32_t _capacity;
+    uint32_t _size = 0;
+
+    bool put(uint32_t byte)
+    {
+        if (_size == _capacity)
+            return false;
+        _out[_size++] = byte;
+        return true;
+    }
+
+    bool put_length(uint32_t length)
+    {
+        for (; length >= 255; length -= 255)
+            if (!put(255))
+                return false;
+        return put(length);
+    }
+};
+
+// greedy LZ4 compression of a sector, 0 when it doesn't fit in capacity
+uint32_t lz4_compress(
+        const uint8_t* in, uint32_t size, uint8_t* out, uint32_t capacity)
+{
+    Lz4Output output(out, capacity);
+    uint32_t anchor = 0;
+    if (size > MATCH_LIMIT)
+    {
+        // positions plus one, 0 is no position
+        uint16_t table[1 << HASH_BITS] = {};
+        uint32_t pos = 0;
+        while (pos + MATCH_LIMIT <= size)
+        {
+            const uint32_t value = read32(in + pos);
+            auto& entry = table[hash32(value)];
+            const uint32_t candidate = entry;
+            entry = pos + 1;
+            if (candidate == 0 || read32(in + candidate - 1) != value)
+            {
+                ++pos;
+                continue;
+            }
+
+            const uint32_t match = candidate - 1;
+            uint32_t length = MIN_MATCH;
+            while (pos + length < size - LAST_LITERALS &&
+                   in[match + length] == in[pos + length])
+                ++length;
+            if (!output.sequence(
+                        in + anchor, pos - anchor, pos - match, length))
+                return 0;
+            pos += length;
+            anchor = pos;
+        }
+    }
+    if (!output.sequence(in + anchor, size - anchor, 0, 0))
+        return 0;
+    return output.size();
+}
+
+// raw deflate of a sector with stream, 0 when it doesn't fit in capacity
+uint32_t deflate_sector(
+        z_stream& stream,
+        const uint8_t* in,
+        uint32_t size,
+        uint8_t* out,
+        uint32_t capacity)
+{
+    if (deflateReset(&stream) != Z_OK)
+        throw std::runtime_error("deflateReset failed");
+    stream.next_in = const_cast<Bytef*>(in);
+    stream.avail_in = size;
+    stream.next_out = out;
+    stream.avail_out = capacity;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+        return 0;
+    return capacity - stream.avail_out;
+}
+}
+
+IsoFormat pkgi_parse_iso_format(const std::string& name)
+{
+    if (name == "cso")
+        return IsoFormat::Cso;
+    if (name == "zso")
+        return IsoFormat::Zso;
+    return IsoFormat::Iso;
+}
+
+const char* pkgi_iso_format_name(IsoFormat format)
+{
+    switch (format)
+    {
+    case IsoFormat::Iso:
+        return "iso";
+    case IsoFormat::Cso:
+        return "cso";
+    case IsoFormat::Zso:
+        return "zso";
+    }
+    return "iso";
+}
+
+IsoCompressor::IsoCompressor(IsoFormat format, uint64_t iso_size)
+    : _format(format), _iso_size(iso_size)
+{
+    const uint64_t sectors = (iso_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    const uint64_t header_size = HEADER_SIZE + (sectors + 1) * 4;
+    // the worst case is every sector stored
+    if (header_size + iso_size >= STORED)
+        throw formatEx<std::runtime_error>(
+                "ISO文件过大, 无法压缩: {}", iso_size);
+    _header_size = static_cast<uint32_t>(header_size);
+    _index.reserve(sectors + 1);
+    _position = _header_size;
+}
+
+void IsoCompressor::compress(
+        const uint8_t* data,
+        uint32_t size,
+        std::vector<uint8_t>& out,
+        std::vector<uint32_t>& sizes) const
+{
+    if (size % SECTOR_SIZE != 0)
+        throw formatEx<std::runtime_error>("ISO数据块大小错误: {}", size);
+
+    out.resize(size);
+    sizes.clear();
+
+    z_stream stream{};
+    if (_format == IsoFormat::Cso &&
+        deflateInit2(
+                &stream,
+                Z_DEFAULT_COMPRESSION,
+                Z_DEFLATED,
+                -DEFLATE_WINDOW_BITS,
+                DEFLATE_MEM_LEVEL,
+                Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("deflateInit2 failed");
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        if (_format == IsoFormat::Cso)
+            deflateEnd(&stream);
+    };
+
+    uint32_t written = 0;
+    for (uint32_t offset = 0; offset < size; offset += SECTOR_SIZE)
+    {
+        const auto sector = data + offset;
+        // a compressed sector is only kept when it is smaller, so it never
+        // takes more than SECTOR_SIZE - 1 bytes of out
+        const auto capacity = SECTOR_SIZE - 1;
+        uint32_t compressed = 0;
+        if (_format == IsoFormat::Cso)
+            compressed = deflate_sector(
+                    stream,
+                    sector,
+                    SECTOR_SIZE,
+                    out.data() + written,
+                    capacity);
+        else if (_format == IsoFormat::Zso)
+            compressed = lz4_compress(
+                    sector, SECTOR_SIZE, out.data() + written, capacity);
+
+        if (compressed == 0)
+        {
+            std::copy(sector, sector + SECTOR_SIZE, out.data() + written);
+            compressed = SECTOR_SIZE;
+        }
+        written += compressed;
+        sizes.push_back(compressed);
+    }
+    out.resize(written);
+}
+
+void IsoCompressor::add(const std::vector<uint32_t>& sizes)
+{
+    for (const auto size : sizes)
+    {
+        _index.push_back(_position | (size == SECTOR_SIZE ? STORED : 0));
+        _position += size;
+    }
+}
+
+std::vector<uint8_t> IsoCompressor::header() const
+{
+    std::vector<uint8_t> header(_header_size);
+    memcpy(header.data(), _format == IsoFormat::Zso ? "ZISO" : "CISO", 4);
+    set32le(header.data() + 4, HEADER_SIZE);
+    set64le(header.data() + 8, _iso_size);
+    set32le(header.data() + 16, SECTOR_SIZE);
+    // version 1, no alignment of the sectors
+    header[20] = 1;
+    header[21] = 0;
+
+    auto entry = header.data() + HEADER_SIZE;
+    for (const auto offset : _index)
+    {
+        set32le(entry, offset);
+        entry += 4;
+    }
+    set32le(entry, _position);
+    return header;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+// how a PSP game saved as an ISO is written, CSO and ZSO are read by the PSP
+// emulator's ISO drivers like a plain image
+enum class IsoFormat : uint8_t
+{
+    Iso,
+    // sectors compressed with raw deflate
+    Cso,
+    // sectors compressed as LZ4 blocks, quicker to read back
+    Zso,
+};
+
+// "iso", "cso" or "zso", unknown names are taken for "iso"
+IsoFormat pkgi_parse_iso_format(const std::string& name);
+const char* pkgi_iso_format_name(IsoFormat format);
+
+// Compresses an ISO image sector by sector into a CSO or ZSO file. The file
+// starts with the header and the index of the sectors, whose size is known
+// upfront, followed by the sectors in order. The sectors are compressed on
+// any thread, the index is filled and written once they are all out.
+class IsoCompressor
+{
+public:
+    static constexpr uint32_t SECTOR_SIZE = 2048;
+
+    IsoCompressor(const IsoCompressor&) = delete;
+    IsoCompressor(IsoCompressor&&) = delete;
+    IsoCompressor& operator=(const IsoCompressor&) = delete;
+    IsoCompressor& operator=(IsoCompressor&&) = delete;
+
+    // throws when iso_size doesn't fit the 31 bit offsets of the index
+    IsoCompressor(IsoFormat format, uint64_t iso_size);
+
+    // bytes of the header and the index, the first sector goes right after
+    uint32_t header_size() const
+    {
+        return _header_size;
+    }
+
+    // compresses the sectors of data into out and the size each one got
+    // into sizes, a sector that doesn't shrink is stored as it is. size is a
+    // multiple of SECTOR_SIZE. Can be called from several threads at once
+    void compress(
+            const uint8_t* data,
+            uint32_t size,
+            std::vector<uint8_t>& out,
+            std::vector<uint32_t>& sizes) const;
+    // adds the sectors of a compressed block to the index, in the order they
+    // are written to the file
+    void add(const std::vector<uint32_t>& sizes);
+    // the header and the index, to write at the start of the file once all
+    // the sectors were added
+    std::vector<uint8_t> header() const;
+
+private:
+    IsoFormat _format;
+    uint64_t _iso_size;
+    uint32_t _header_size;
+    // file offset of each sector, with the top bit set for the stored ones,
+    // and the end of the last one
+    std::vector<uint32_t> _index;
+    uint32_t _position;
+};
@@ -0,0 +1,252 @@
+#include "log.hpp"
+
+#include "file.hpp"
+#include "pkgi.hpp"
+#include "thread.hpp"
+
+#include <array>
+#include <atomic>
+#include <memory>
+
+#include <stdarg.h>
+#include <stdio.h>
+
+namespace
+{
+// Bounded queue with many producers and one consumer, after Dmitry Vyukov's.
+// The sequence of a cell says whose turn it is: pos when the producer of pos
+// may fill it, pos + 1 once it's filled for the consumer.
+struct Cell
+{
+    // first, pkgi_log_commit gets the cell back from the record
+    LogRecord record;
+    std::atomic<size_t> sequence;
+    size_t pos;
+};
+
+// 128KiB, the lines of a second or so of a busy download
+constexpr size_t QUEUE_SIZE = 256;
+
+struct Queue
+{
+    Queue()
+    {
+        for (size_t i = 0; i < QUEUE_SIZE; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    std::array<Cell, QUEUE_SIZE> cells;
+    std::atomic<size_t> enqueue_pos{0};
+    // only touched by the flusher
+    size_t dequeue_pos{0};
+    // lines lost to a full queue since the last report
+    std::atomic<uint32_t> dropped{0};
+};
+
+Queue& queue()
+{
+    // built on first use, lines can be logged during static initialization
+    static Queue queue;
+    return queue;
+}
+
+std::unique_ptr<Thread> flusher;
+std::atomic<bool> stopping{false};
+void* log_file = nullptr;
+
+char level_letter(LogLevel level)
+{
+    switch (level)
+    {
+    case LogLevel::Debug:
+        return 'D';
+    case LogLevel::Info:
+        return 'I';
+    case LogLevel::Error:
+        return 'E';
+    }
+    return '?';
+}
+
+void write_line(const std::string& line)
+{
+    pkgi_log_write(line.data(), line.size());
+    if (log_file)
+        pkgi_write(log_file, line.data(), line.size());
+}
+
+void write_record(const LogRecord& record)
+{
+    std::string text;
+    if (record.formatter)
+    {
+        try
+        {
+            text = record.formatter(record.format, record.payload);
+        }
+        catch (const std::exception& e)
+        {
+            text = fmt::format("{} ({})", record.format, e.what());
+        }
+    }
+    else
+        text.assign(reinterpret_cast<const char*>(record.payload), record.size);
+
+    write_line(fmt::format(
+            "{}.{:03} {} {}\n",
+            record.time / 1000000,
+            record.time / 1000 % 1000,
+            level_letter(record.level),
+            text));
+}
+
+// returns false when the queue is empty
+bool flush_one()
+{
+    auto& q = queue();
+    auto& cell = q.cells[q.dequeue_pos % QUEUE_SIZE];
+    if (cell.sequence.load(std::memory_order_acquire) != q.dequeue_pos + 1)
+        return false;
+
+    write_record(cell.record);
+    cell.sequence.store(q.dequeue_pos + QUEUE_SIZE, std::memory_order_release);
+    ++q.dequeue_pos;
+    return true;
+}
+
+void run_flusher()
+{
+    for (;;)
+    {
+        // what was logged before the stop is still sent
+        const auto stop = stopping.load(std::memory_order_acquire);
+
+        while (flush_one())
+            ;
+
+        const auto dropped =
+                queue().dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped)
+            write_line(fmt::format(
+                    "{} lines dropped, the log is full\n", dropped));
+
+        if (stop)
+            return;
+
+        // the producers don't lock anything, so they can't wake us up
+        pkgi_sleep(20);
+    }
+}
+
+void vlog(LogLevel level, const char* msg, va_list args)
+{
+    const auto record = pkgi_log_claim(level);
+    if (!record)
+        return;
+
+    const auto len = vsnprintf(
+            reinterpret_cast<char*>(record->payload),
+            LogRecord::PAYLOAD_SIZE,
+            msg,
+            args);
+    record->size = len < 0 ? 0
+                           : std::min<size_t>(len, LogRecord::PAYLOAD_SIZE - 1);
+    pkgi_log_commit(record);
+}
+}
+
+LogRecord* pkgi_log_claim(LogLevel level)
+{
+    auto& q = queue();
+    auto pos = q.enqueue_pos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        auto& cell = q.cells[pos % QUEUE_SIZE];
+        const auto sequence = cell.sequence.load(std::memory_order_acquire);
+        const auto diff =
+                static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0)
+        {
+            if (q.enqueue_pos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed))
+            {
+                cell.pos = pos;
+                auto& record = cell.record;
+                record.time = pkgi_time_usec();
+                record.level = level;
+                record.formatter = nullptr;
+                record.format = nullptr;
+                record.size = 0;
+                return &record;
+            }
+        }
+        else if (diff < 0)
+        {
+            // the flusher is a lap behind, waiting would be worse than
+            // losing the line
+            q.dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        else
+            pos = q.enqueue_pos.load(std::memory_order_relaxed);
+    }
+}
+
+void pkgi_log_commit(LogRecord* record)
+{
+    const auto cell = reinterpret_cast<Cell*>(record);
+    cell->sequence.store(cell->pos + 1, std::memory_order_release);
+}
+
+void pkgi_log_start()
+{
+    if (flusher)
+        return;
+
+#ifdef PKGI_LOG_FILE
+    try
+    {
+        log_file = pkgi_create(PKGI_LOG_FILE);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF_ERROR("can't create log file: {}", e.what());
+    }
+#endif
+
+    stopping = false;
+    flusher = std::make_unique<Thread>(
+            "log_flusher", &run_flusher, ThreadRole::Background);
+}
+
+void pkgi_log_stop()
+{
+    if (!flusher)
+        return;
+
+    stopping.store(true, std::memory_order_release);
+    flusher->join();
+    flusher.reset();
+
+    if (log_file)
+    {
+        pkgi_close(log_file);
+        log_file = nullptr;
+    }
+}
+
+void pkgi_log(const char* msg, ...)
+{
+    va_list args;
+    va_start(args, msg);
+    vlog(LogLevel::Info, msg, args);
+    va_end(args);
+}
+
+void pkgi_log_level(LogLevel level, const char* msg, ...)
+{
+    va_list args;
+    va_start(args, msg);
+    vlog(level, msg, args);
+    va_end(args);
+}
@@ -3,26 +3,85 @@
 #include <fmt/format.h>
 #include <stdexcept>
 
-#ifdef PKGI_ENABLE_LOGGING
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+#include <stdint.h>
+
+#define PKGI_LOG_LEVEL_DEBUG 0
+#define PKGI_LOG_LEVEL_INFO 1
+#define PKGI_LOG_LEVEL_ERROR 2
+
+// the lines below this level are compiled out
+#ifndef PKGI_LOG_LEVEL
+#define PKGI_LOG_LEVEL PKGI_LOG_LEVEL_INFO
+#endif
+
+enum class LogLevel : uint8_t
+{
+    Debug = PKGI_LOG_LEVEL_DEBUG,
+    Info = PKGI_LOG_LEVEL_INFO,
+    Error = PKGI_LOG_LEVEL_ERROR,
+};
+
+// LOG takes a printf format, LOGF a fmt one. The lines go through a queue
+// and are sent by a thread of their own, a thread that logs doesn't wait on
+// the network or the card. The LOGF arguments that are numbers or strings
+// are copied as they are and formatted by that thread too.
+#define PKGI_LOG_NOTHING(...) \
+    do                        \
+    {                         \
+    } while (0)
+
+#if defined(PKGI_ENABLE_LOGGING) && PKGI_LOG_LEVEL <= PKGI_LOG_LEVEL_DEBUG
+#define LOG_DEBUG(msg, ...)                                  \
+    do                                                       \
+    {                                                        \
+        pkgi_log_level(LogLevel::Debug, msg, ##__VA_ARGS__); \
+    } while (0)
+#define LOGF_DEBUG(msg, ...)                            \
+    do                                                  \
+    {                                                   \
+        pkgi_logf(LogLevel::Debug, msg, ##__VA_ARGS__); \
+    } while (0)
+#else
+#define LOG_DEBUG PKGI_LOG_NOTHING
+#define LOGF_DEBUG PKGI_LOG_NOTHING
+#endif
+
+#if defined(PKGI_ENABLE_LOGGING) && PKGI_LOG_LEVEL <= PKGI_LOG_LEVEL_INFO
 #define LOG(msg, ...)                 \
     do                                \
     {                                 \
         pkgi_log(msg, ##__VA_ARGS__); \
     } while (0)
-#define LOGF(msg, ...)                                     \
-    do                                                     \
-    {                                                      \
-        pkgi_log(fmt::format(msg, ##__VA_ARGS__).c_str()); \
+#define LOGF(msg, ...)                                 \
+    do                                                 \
+    {                                                  \
+        pkgi_logf(LogLevel::Info, msg, ##__VA_ARGS__); \
     } while (0)
 #else
-#define LOG(...) \
-    do           \
-    {            \
+#define LOG PKGI_LOG_NOTHING
+#define LOGF PKGI_LOG_NOTHING
+#endif
+
+#if defined(PKGI_ENABLE_LOGGING) && PKGI_LOG_LEVEL <= PKGI_LOG_LEVEL_ERROR
+#define LOG_ERROR(msg, ...)                                  \
+    do                                                       \
+    {                                                        \
+        pkgi_log_level(LogLevel::Error, msg, ##__VA_ARGS__); \
     } while (0)
-#define LOGF(...) \
-    do            \
-    {             \
+#define LOGF_ERROR(msg, ...)                            \
+    do                                                  \
+    {                                                   \
+        pkgi_logf(LogLevel::Error, msg, ##__VA_ARGS__); \
     } while (0)
+#else
+#define LOG_ERROR PKGI_LOG_NOTHING
+#define LOGF_ERROR PKGI_LOG_NOTHING
 #endif
 
 template <typename E = std::runtime_error, typename... Args>
@@ -30,4 +89,201 @@ template <typename E = std::runtime_error, typename... Args>
     return E(fmt::format(std::forward<Args>(args)...));
 }
 
+// a line waiting in the queue
+struct LogRecord
+{
+    // turns the payload back into the arguments and formats them
+    using Formatter =
+            std::string (*)(const char* format, const uint8_t* payload);
+
+    static constexpr size_t PAYLOAD_SIZE = 480;
+
+    uint64_t time;
+    LogLevel level;
+    // null when the payload is the text of the line already
+    Formatter formatter;
+    const char* format;
+    uint16_t size;
+    uint8_t payload[PAYLOAD_SIZE];
+};
+
+// a record to fill and commit, null when the queue is full and the line is
+// dropped
+LogRecord* pkgi_log_claim(LogLevel level);
+void pkgi_log_commit(LogRecord* record);
+
+// starts the thread that sends the lines, those logged before wait for it
+void pkgi_log_start();
+// sends what is left and stops the thread
+void pkgi_log_stop();
+// where the lines go, called by the thread of the log only
+void pkgi_log_write(const char* text, uint32_t size);
+
 void pkgi_log(const char* msg, ...);
+void pkgi_log_level(LogLevel level, const char* msg, ...);
+
+namespace log_detail
+{
+template <typename T>
+using IsString = std::integral_constant<
+        bool,
+        std::is_same<T, std::string>::value ||
+                std::is_same<T, const char*>::value ||
+                std::is_same<T, char*>::value>;
+
+// the arguments that can be copied in the payload
+template <typename T>
+using IsLazy = std::integral_constant<
+        bool,
+        std::is_arithmetic<T>::value || IsString<T>::value>;
+
+template <typename T>
+using Stored = typename std::
+        conditional<IsString<T>::value, std::string, T>::type;
+
+class Writer
+{
+public:
+    // reserved is the fixed size of the arguments to come
+    Writer(LogRecord* record, size_t reserved)
+        : _record(record), _reserved(reserved)
+    {
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value>::type put(
+            const T& value)
+    {
+        _reserved -= sizeof(value);
+        write(&value, sizeof(value));
+    }
+
+    // strings are cut to leave room for the arguments after them
+    void put(const std::string& value)
+    {
+        put_string(value.data(), value.size());
+    }
+
+    void put(const char* value)
+    {
+        if (value)
+            put_string(value, std::strlen(value));
+        else
+            put_string("(null)", 6);
+    }
+
+private:
+    LogRecord* _record;
+    size_t _reserved;
+
+    void put_string(const char* data, size_t size)
+    {
+        _reserved -= sizeof(uint16_t);
+        const uint16_t length = std::min<size_t>(
+                size,
+                LogRecord::PAYLOAD_SIZE - _record->size - sizeof(uint16_t) -
+                        _reserved);
+        write(&length, sizeof(length));
+        write(data, length);
+    }
+
+    void write(const void* data, size_t size)
+    {
+        std::memcpy(_record->payload + _record->size, data, size);
+        _record->size += size;
+    }
+};
+
+class Reader
+{
+public:
+    explicit Reader(const uint8_t* payload) : _payload(payload)
+    {
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value, T>::type get()
+    {
+        T value;
+        std::memcpy(&value, _payload, sizeof(value));
+        _payload += sizeof(value);
+        return value;
+    }
+
+    template <typename T>
+    typename std::enable_if<IsString<T>::value, std::string>::type get()
+    {
+        uint16_t length;
+        std::memcpy(&length, _payload, sizeof(length));
+        _payload += sizeof(length);
+        std::string value(reinterpret_cast<const char*>(_payload), length);
+        _payload += length;
+        return value;
+    }
+
+private:
+    const uint8_t* _payload;
+};
+
+template <typename... Args>
+std::string format_payload(const char* format, const uint8_t* payload)
+{
+    Reader reader(payload);
+    // braces read the arguments in order
+    const std::tuple<Stored<Args>...> args{reader.get<Args>()...};
+    return std::apply(
+            [format](const auto&... args) {
+                return fmt::format(format, args...);
+            },
+            args);
+}
+
+// the arguments must fit in the payload, strings aside
+template <typename... Args>
+constexpr size_t fixed_size()
+{
+    return (size_t{0} + ... +
+            (IsString<Args>::value ? sizeof(uint16_t) : sizeof(Args)));
+}
+}
+
+template <typename... Args>
+void pkgi_logf(LogLevel level, const char* format, const Args&... args)
+{
+    const auto record = pkgi_log_claim(level);
+    if (!record)
+        return;
+
+    if constexpr (
+            (log_detail::IsLazy<typename std::decay<Args>::type>::value &&
+             ...) &&
+            log_detail::fixed_size<typename std::decay<Args>::type...>() <=
+                    LogRecord::PAYLOAD_SIZE)
+    {
+        log_detail::Writer writer(
+                record,
+                log_detail::fixed_size<typename std::decay<Args>::type...>());
+        (writer.put(args), ...);
+        record->formatter =
+                &log_detail::format_payload<typename std::decay<Args>::type...>;
+        record->format = format;
+    }
+    else
+    {
+        // the record must be committed whatever happens, the queue would
+        // stop there otherwise
+        std::string text;
+        try
+        {
+            text = fmt::format(format, args...);
+        }
+        catch (const std::exception& e)
+        {
+            text = e.what();
+        }
+        record->size = std::min(text.size(), LogRecord::PAYLOAD_SIZE);
+        std::memcpy(record->payload, text.data(), record->size);
+    }
+
+    pkgi_log_commit(record);
+}
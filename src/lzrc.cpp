@@ -0,0 +1,493 @@
+#include "lzrc.hpp"
+
+#include "utils.hpp"
+
+#include <stdexcept>
+
+#include <cstring>
+
+// lzrc decompression code from libkirk by tpu, kept as is to check and
+// measure lzrc_decompress against it
+typedef struct
+{
+    // input stream
+    const uint8_t* input;
+    uint32_t in_ptr;
+    uint32_t in_len;
+
+    // output stream
+    uint8_t* output;
+    uint32_t out_ptr;
+    uint32_t out_len;
+
+    // range decode
+    uint32_t range;
+    uint32_t code;
+    uint32_t out_code;
+    uint8_t lc;
+
+    uint8_t bm_literal[8][256];
+    uint8_t bm_dist_bits[8][39];
+    uint8_t bm_dist[18][8];
+    uint8_t bm_match[8][8];
+    uint8_t bm_len[8][31];
+} lzrc_decode;
+
+static void rc_init(
+        lzrc_decode* rc, void* out, int out_len, const void* in, int in_len)
+{
+    if (in_len < 5)
+    {
+        throw std::runtime_error(
+                "internal error - lzrc input underflow! pkg may be corrupted");
+    }
+
+    rc->input = static_cast<const uint8_t*>(in);
+    rc->in_len = in_len;
+    rc->in_ptr = 5;
+
+    rc->output = static_cast<uint8_t*>(out);
+    rc->out_len = out_len;
+    rc->out_ptr = 0;
+
+    rc->range = 0xffffffff;
+    rc->lc = rc->input[0];
+    rc->code = get32be(rc->input + 1);
+    rc->out_code = 0xffffffff;
+
+    memset(rc->bm_literal, 0x80, sizeof(rc->bm_literal));
+    memset(rc->bm_dist_bits, 0x80, sizeof(rc->bm_dist_bits));
+    memset(rc->bm_dist, 0x80, sizeof(rc->bm_dist));
+    memset(rc->bm_match, 0x80, sizeof(rc->bm_match));
+    memset(rc->bm_len, 0x80, sizeof(rc->bm_len));
+}
+
+static void normalize(lzrc_decode* rc)
+{
+    if (rc->range < 0x01000000)
+    {
+        rc->range <<= 8;
+        rc->code = (rc->code << 8) + rc->input[rc->in_ptr];
+        rc->in_ptr++;
+    }
+}
+
+static int rc_bit(lzrc_decode* rc, uint8_t* prob)
+{
+    uint32_t bound;
+
+    normalize(rc);
+
+    bound = (rc->range >> 8) * (*prob);
+    *prob -= *prob >> 3;
+
+    if (rc->code < bound)
+    {
+        rc->range = bound;
+        *prob += 31;
+        return 1;
+    }
+    else
+    {
+        rc->code -= bound;
+        rc->range -= bound;
+        return 0;
+    }
+}
+
+static int rc_bittree(lzrc_decode* rc, uint8_t* probs, int limit)
+{
+    int number = 1;
+
+    do
+    {
+        number = (number << 1) + rc_bit(rc, probs + number);
+    } while (number < limit);
+
+    return number;
+}
+
+static int rc_number(lzrc_decode* rc, uint8_t* prob, uint32_t n)
+{
+    int number = 1;
+
+    if (n > 3)
+    {
+        number = (number << 1) + rc_bit(rc, prob + 3);
+        if (n > 4)
+        {
+            number = (number << 1) + rc_bit(rc, prob + 3);
+            if (n > 5)
+            {
+                // direct bits
+                normalize(rc);
+
+                for (uint32_t i = 0; i < n - 5; i++)
+                {
+                    rc->range >>= 1;
+                    number <<= 1;
+                    if (rc->code < rc->range)
+                    {
+                        number += 1;
+                    }
+                    else
+                    {
+                        rc->code -= rc->range;
+                    }
+                }
+            }
+        }
+    }
+
+    if (n > 0)
+    {
+        number = (number << 1) + rc_bit(rc, prob);
+        if (n > 1)
+        {
+            number = (number << 1) + rc_bit(rc, prob + 1);
+            if (n > 2)
+            {
+                number = (number << 1) + rc_bit(rc, prob + 2);
+            }
+        }
+    }
+
+    return number;
+}
+
+int lzrc_decompress_reference(
+        void* out, int out_len, const void* in, int in_len)
+{
+    lzrc_decode rc;
+    rc_init(&rc, out, out_len, in, in_len);
+
+    if (rc.lc & 0x80)
+    {
+        // plain text
+        memcpy(rc.output, rc.input + 5, rc.code);
+        return rc.code;
+    }
+
+    int rc_state = 0;
+    uint8_t last_byte = 0;
+
+    for (;;)
+    {
+        uint32_t match_step = 0;
+
+        int bit = rc_bit(&rc, &rc.bm_match[rc_state][match_step]);
+        if (bit == 0) // literal
+        {
+            if (rc_state > 0)
+            {
+                rc_state -= 1;
+            }
+
+            int byte = rc_bittree(
+                    &rc,
+                    &rc.bm_literal[((last_byte >> rc.lc) & 0x07)][0],
+                    0x100);
+            byte -= 0x100;
+
+            if (rc.out_ptr == rc.out_len)
+            {
+                throw std::runtime_error(
+                        "内部错误 - PKG文件不完整或已损坏 ! 请重新"
+                        "下载");
+            }
+            rc.output[rc.out_ptr++] = (uint8_t)byte;
+            last_byte = (uint8_t)byte;
+        }
+        else // match
+        {
+            // find bits of match length
+            uint32_t len_bits = 0;
+            for (int i = 0; i < 7; i++)
+            {
+                match_step += 1;
+                bit = rc_bit(&rc, &rc.bm_match[rc_state][match_step]);
+                if (bit == 0)
+                {
+                    break;
+                }
+                len_bits += 1;
+            }
+
+            // find match length
+            uint32_t match_len;
+            if (len_bits == 0)
+            {
+                match_len = 1;
+            }
+            else
+            {
+                uint32_t len_state = ((len_bits - 1) << 2) +
+                                     ((rc.out_ptr << (len_bits - 1)) & 0x03);
+                match_len = rc_number(
+                        &rc, &rc.bm_len[rc_state][len_state], len_bits);
+                if (match_len == 0xFF)
+                {
+                    // end of stream
+                    return rc.out_ptr;
+                }
+            }
+
+            // find number of bits of match distance
+            uint32_t dist_state = 0;
+            uint32_t limit = 8;
+            if (match_len > 2)
+            {
+                dist_state += 7;
+                limit = 44;
+            }
+            int dist_bits = rc_bittree(
+                    &rc, &rc.bm_dist_bits[len_bits][dist_state], limit);
+            dist_bits -= limit;
+
+            // find match distance
+            uint32_t match_dist;
+            if (dist_bits > 0)
+            {
+                match_dist =
+                        rc_number(&rc, &rc.bm_dist[dist_bits][0], dist_bits);
+            }
+            else
+            {
+                match_dist = 1;
+            }
+
+            // copy match bytes
+            if (match_dist > rc.out_ptr)
+            {
+                throw std::runtime_error(
+                        "内部错误 - PKG文件不完整或已损坏! "
+                        "请重新下载");
+            }
+
+            if (rc.out_ptr + match_len + 1 > rc.out_len)
+            {
+                throw std::runtime_error(
+                        "内部错误 - PKG文件不完整或已损坏! 请重新"
+                        "下载");
+            }
+
+            const uint8_t* match_src = rc.output + rc.out_ptr - match_dist;
+            for (uint32_t i = 0; i <= match_len; i++)
+            {
+                rc.output[rc.out_ptr++] = *match_src++;
+            }
+            last_byte = match_src[-1];
+
+            rc_state = 6 + ((rc.out_ptr + 1) & 1);
+        }
+    }
+}
+
+namespace
+{
+[[noreturn]] void throw_corrupted()
+{
+    throw std::runtime_error(
+            "内部错误 - PKG文件不完整或已损坏! 请重新"
+            "下载");
+}
+
+// same decoder as above, with the range coder in a local object that the
+// compiler can keep in registers, branchless bit updates and bounds checks on
+// the input
+struct RangeDecoder
+{
+    const uint8_t* in;
+    const uint8_t* in_end;
+    uint32_t range;
+    uint32_t code;
+
+    void normalize()
+    {
+        if (range < 0x01000000)
+        {
+            // the only input bounds check, done once per refill
+            if (in == in_end)
+                throw std::runtime_error(
+                        "internal error - lzrc input underflow! pkg may be "
+                        "corrupted");
+            range <<= 8;
+            code = (code << 8) | *in++;
+        }
+    }
+
+    uint32_t bit(uint8_t* prob)
+    {
+        normalize();
+
+        const uint32_t p = *prob;
+        const uint32_t bound = (range >> 8) * p;
+        // all ones when the bit is 1
+        const uint32_t mask = 0 - static_cast<uint32_t>(code < bound);
+
+        range = (bound & mask) | ((range - bound) & ~mask);
+        code -= bound & ~mask;
+        *prob = p - (p >> 3) + (31 & mask);
+        return mask & 1;
+    }
+
+    uint32_t bittree(uint8_t* probs, uint32_t limit)
+    {
+        uint32_t number = 1;
+        do
+            number = (number << 1) + bit(probs + number);
+        while (number < limit);
+        return number;
+    }
+
+    uint32_t number(uint8_t* prob, uint32_t n)
+    {
+        uint32_t number = 1;
+
+        if (n > 3)
+        {
+            number = (number << 1) + bit(prob + 3);
+            if (n > 4)
+            {
+                number = (number << 1) + bit(prob + 3);
+                if (n > 5)
+                {
+                    // direct bits
+                    normalize();
+                    for (uint32_t i = 0; i < n - 5; i++)
+                    {
+                        range >>= 1;
+                        const uint32_t mask =
+                                0 - static_cast<uint32_t>(code >= range);
+                        code -= range & mask;
+                        number = (number << 1) + 1 + mask;
+                    }
+                }
+            }
+        }
+
+        if (n > 0)
+        {
+            number = (number << 1) + bit(prob);
+            if (n > 1)
+            {
+                number = (number << 1) + bit(prob + 1);
+                if (n > 2)
+                    number = (number << 1) + bit(prob + 2);
+            }
+        }
+
+        return number;
+    }
+};
+
+// same layout as in lzrc_decode, some indices run past the end of their row
+// into the next table like they do in the original code
+struct Probabilities
+{
+    uint8_t literal[8][256];
+    uint8_t dist_bits[8][39];
+    uint8_t dist[18][8];
+    uint8_t match[8][8];
+    uint8_t len[8][31];
+};
+}
+
+int lzrc_decompress(void* out, int out_len, const void* in, int in_len)
+{
+    if (in_len < 5)
+        throw std::runtime_error(
+                "internal error - lzrc input underflow! pkg may be corrupted");
+
+    const auto input = static_cast<const uint8_t*>(in);
+    const auto output = static_cast<uint8_t*>(out);
+    const uint32_t output_size = out_len;
+    const uint8_t lc = input[0];
+
+    RangeDecoder rc{input + 5, input + in_len, 0xffffffff, get32be(input + 1)};
+
+    if (lc & 0x80)
+    {
+        // plain text
+        if (rc.code > output_size || rc.code > uint32_t(in_len - 5))
+            throw_corrupted();
+        memcpy(output, input + 5, rc.code);
+        return rc.code;
+    }
+
+    Probabilities probs;
+    memset(&probs, 0x80, sizeof(probs));
+
+    uint32_t out_ptr = 0;
+    uint32_t state = 0;
+    uint8_t last_byte = 0;
+
+    for (;;)
+    {
+        if (!rc.bit(&probs.match[state][0]))
+        {
+            // literal
+            if (state > 0)
+                state -= 1;
+
+            const uint32_t byte =
+                    rc.bittree(&probs.literal[(last_byte >> lc) & 0x07][0],
+                               0x100) -
+                    0x100;
+
+            if (out_ptr == output_size)
+                throw_corrupted();
+            output[out_ptr++] = byte;
+            last_byte = byte;
+            continue;
+        }
+
+        // find bits of match length
+        uint32_t len_bits = 0;
+        while (len_bits < 7 && rc.bit(&probs.match[state][len_bits + 1]))
+            len_bits += 1;
+
+        // find match length
+        uint32_t match_len = 1;
+        if (len_bits != 0)
+        {
+            const uint32_t len_state = ((len_bits - 1) << 2) +
+                                       ((out_ptr << (len_bits - 1)) & 0x03);
+            match_len =
+                    rc.number(&probs.len[state][len_state], len_bits);
+            if (match_len == 0xFF)
+                // end of stream
+                return out_ptr;
+        }
+
+        // find number of bits of match distance
+        const uint32_t dist_state = match_len > 2 ? 7 : 0;
+        const uint32_t limit = match_len > 2 ? 44 : 8;
+        const uint32_t dist_bits =
+                rc.bittree(&probs.dist_bits[len_bits][dist_state], limit) -
+                limit;
+
+        // find match distance
+        const uint32_t match_dist =
+                dist_bits > 0 ? rc.number(&probs.dist[dist_bits][0], dist_bits)
+                              : 1;
+
+        // copy match bytes
+        if (match_dist > out_ptr || out_ptr + match_len + 1 > output_size)
+            throw_corrupted();
+
+        uint8_t* dst = output + out_ptr;
+        const uint8_t* src = dst - match_dist;
+        const uint32_t count = match_len + 1;
+        if (match_dist >= count)
+            memcpy(dst, src, count);
+        else
+            // overlapping copies repeat the last match_dist bytes
+            for (uint32_t i = 0; i < count; i++)
+                dst[i] = src[i];
+        out_ptr += count;
+        last_byte = output[out_ptr - 1];
+
+        state = 6 + ((out_ptr + 1) & 1);
+    }
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// decompresses an LZRC stream as found in PSP NPUMDIMG blocks, returns the
+// size of the output, throws if the stream is corrupted
+int lzrc_decompress(void* out, int out_len, const void* in, int in_len);
+// original libkirk decoder, slower and without input bounds checks, only used
+// by the benchmark to check lzrc_decompress
+int lzrc_decompress_reference(
+        void* out, int out_len, const void* in, int in_len);
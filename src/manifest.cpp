@@ -0,0 +1,143 @@
+#include "manifest.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <zlib.h>
+
+namespace
+{
+// the manifest is MANIFEST_MAGIC, MANIFEST_VERSION and the url it was made
+// from, then a record per file written with its item index, crc32, size and
+// path, all little endian. A file written again gets a new record, the last
+// one counts
+constexpr uint32_t MANIFEST_MAGIC = 0x4d474b50; // "PKGM"
+constexpr uint32_t MANIFEST_VERSION = 2;
+constexpr size_t MANIFEST_HEADER_SIZE = 12;
+constexpr size_t MANIFEST_RECORD_SIZE = 20;
+
+constexpr uint32_t CRC_CHUNK_SIZE = 64 * 1024;
+}
+
+std::string pkgi_manifest_path(
+        const std::string& partition, const std::string& content)
+{
+    return fmt::format("{}pkgj/.manifest/{}", partition, content);
+}
+
+std::optional<Manifest> pkgi_load_manifest(
+        const std::string& path, const std::string& url)
+{
+    if (!pkgi_file_exists(path))
+        return std::nullopt;
+
+    try
+    {
+        const auto data = pkgi_load(path);
+        if (data.size() < MANIFEST_HEADER_SIZE ||
+            get32le(data.data()) != MANIFEST_MAGIC ||
+            get32le(data.data() + 4) != MANIFEST_VERSION)
+            throw std::runtime_error("bad header");
+
+        const auto url_size = get32le(data.data() + 8);
+        if (data.size() - MANIFEST_HEADER_SIZE < url_size)
+            throw std::runtime_error("truncated url");
+        const auto chars = reinterpret_cast<const char*>(data.data());
+        // a patch keeps its content id from version to version
+        if (!url.empty() &&
+            url != std::string(chars + MANIFEST_HEADER_SIZE, url_size))
+            throw std::runtime_error("made for another package");
+
+        // a record cut by a crash is left out
+        Manifest manifest;
+        size_t pos = MANIFEST_HEADER_SIZE + url_size;
+        while (data.size() - pos >= MANIFEST_RECORD_SIZE)
+        {
+            const auto record = data.data() + pos;
+            const auto path_size = get32le(record + 16);
+            if (data.size() - pos - MANIFEST_RECORD_SIZE < path_size)
+                break;
+            manifest[get32le(record)] = ManifestEntry{
+                    std::string(chars + pos + MANIFEST_RECORD_SIZE, path_size),
+                    get64le(record + 8),
+                    get32le(record + 4)};
+            pos += MANIFEST_RECORD_SIZE + path_size;
+        }
+        LOGF("loaded manifest {} with {} files", path, manifest.size());
+        return manifest;
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("ignoring manifest {}: {}", path, e.what());
+        return std::nullopt;
+    }
+}
+
+void pkgi_create_manifest(const std::string& path, const std::string& url)
+{
+    std::vector<uint8_t> header(MANIFEST_HEADER_SIZE + url.size());
+    set32le(header.data(), MANIFEST_MAGIC);
+    set32le(header.data() + 4, MANIFEST_VERSION);
+    set32le(header.data() + 8, url.size());
+    std::copy(url.begin(), url.end(), header.begin() + MANIFEST_HEADER_SIZE);
+
+    pkgi_mkdirs(path.substr(0, path.rfind('/')).c_str());
+    pkgi_save(path, header.data(), header.size());
+}
+
+void pkgi_append_manifest(const std::string& path, const Manifest& entries)
+{
+    if (entries.empty())
+        return;
+
+    std::vector<uint8_t> records;
+    for (const auto& [index, entry] : entries)
+    {
+        const auto offset = records.size();
+        records.resize(offset + MANIFEST_RECORD_SIZE + entry.path.size());
+        const auto record = records.data() + offset;
+        set32le(record, index);
+        set32le(record + 4, entry.crc);
+        set64le(record + 8, entry.size);
+        set32le(record + 16, entry.path.size());
+        std::copy(
+                entry.path.begin(),
+                entry.path.end(),
+                record + MANIFEST_RECORD_SIZE);
+    }
+
+    const auto f = pkgi_append(path.c_str());
+    if (!f || pkgi_write(f, records.data(), records.size()) < 0)
+        LOGF("failed to add {} files to the manifest", entries.size());
+    if (f)
+        pkgi_close(f);
+}
+
+bool pkgi_crc_file(
+        void* f,
+        uint64_t size,
+        uint32_t& crc,
+        const std::function<bool()>& is_canceled)
+{
+    std::vector<uint8_t> data(CRC_CHUNK_SIZE);
+    while (size > 0)
+    {
+        if (is_canceled())
+            throw std::runtime_error("已取消");
+
+        const int read =
+                pkgi_read(f, data.data(), (uint32_t)min64(data.size(), size));
+        if (read <= 0)
+            return false;
+        crc = crc32(crc, data.data(), read);
+        size -= read;
+    }
+    return true;
+}
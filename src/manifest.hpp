@@ -0,0 +1,44 @@
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <cstdint>
+
+// The size and crc32 of every file a package download wrote, kept in
+// <partition>pkgj/.manifest/<content> after the install so that the files
+// can be checked again later, by a repair or a verification.
+struct ManifestEntry
+{
+    // from the folder the package is installed or downloaded to
+    std::string path;
+    uint64_t size;
+    uint32_t crc;
+};
+
+// by item index
+using Manifest = std::unordered_map<uint32_t, ManifestEntry>;
+
+std::string pkgi_manifest_path(
+        const std::string& partition, const std::string& content);
+
+// nullopt when there is none or it was made from another url than url, any
+// url goes when it's empty
+std::optional<Manifest> pkgi_load_manifest(
+        const std::string& path, const std::string& url = {});
+// replaces the manifest at path with an empty one made from url
+void pkgi_create_manifest(const std::string& path, const std::string& url);
+// adds entries in one write, it must be called once their files are
+// complete on the card. A failure is only logged, it costs the chance to
+// check those files later
+void pkgi_append_manifest(const std::string& path, const Manifest& entries);
+
+// crc32 of the first size bytes of f, which goes on from crc, false if f is
+// shorter. Throws as soon as is_canceled
+bool pkgi_crc_file(
+        void* f,
+        uint64_t size,
+        uint32_t& crc,
+        const std::function<bool()>& is_canceled);
@@ -0,0 +1,102 @@
+#include "memorybudget.hpp"
+
+#include "log.hpp"
+
+#include <algorithm>
+
+MemoryBudget::Reservation::Reservation(MemoryBudget* budget, size_t bytes)
+    : _budget(budget), _bytes(bytes)
+{
+}
+
+MemoryBudget::Reservation::Reservation(Reservation&& other) noexcept
+    : _budget(other._budget), _bytes(other._bytes)
+{
+    other._budget = nullptr;
+}
+
+MemoryBudget::Reservation& MemoryBudget::Reservation::operator=(
+        Reservation&& other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        _budget = other._budget;
+        _bytes = other._bytes;
+        other._budget = nullptr;
+    }
+    return *this;
+}
+
+MemoryBudget::Reservation::~Reservation()
+{
+    release();
+}
+
+void MemoryBudget::Reservation::release()
+{
+    if (_budget)
+        _budget->release(_bytes);
+    _budget = nullptr;
+}
+
+MemoryBudget::MemoryBudget(size_t total)
+    : _total(total), _mutex("memory_budget_mutex")
+{
+}
+
+void MemoryBudget::add_cache(
+        MemPool pool, uint32_t priority, size_t quota, SetQuota set_quota)
+{
+    ScopeLock _(_mutex);
+    const auto it = std::find_if(
+            _caches.begin(), _caches.end(), [&](const Cache& cache) {
+                return cache.priority < priority;
+            });
+    // the quota it was built with isn't known, it's told in any case
+    _caches.insert(
+            it, Cache{pool, priority, quota, std::move(set_quota), SIZE_MAX});
+    rebalance();
+}
+
+MemoryBudget::Reservation MemoryBudget::reserve(size_t bytes)
+{
+    ScopeLock _(_mutex);
+    _reserved += bytes;
+    rebalance();
+    return Reservation(this, bytes);
+}
+
+void MemoryBudget::release(size_t bytes)
+{
+    ScopeLock _(_mutex);
+    _reserved -= bytes;
+    rebalance();
+}
+
+void MemoryBudget::rebalance()
+{
+    auto left = _total - std::min(_reserved, _total);
+    [[maybe_unused]] const auto totals = pkgi_mem_totals();
+    for (auto& cache : _caches)
+    {
+        const auto allowed = std::min(cache.quota, left);
+        left -= allowed;
+        if (allowed == cache.allowed)
+            continue;
+        if (allowed < cache.allowed && cache.allowed != SIZE_MAX)
+            LOGF("{} may keep {} KB of its {} KB, {} KB reserved",
+                 mem_pool_name(cache.pool),
+                 allowed / 1024,
+                 totals.current[static_cast<size_t>(cache.pool)] / 1024,
+                 _reserved / 1024);
+        cache.allowed = allowed;
+        cache.set_quota(allowed);
+    }
+
+    const auto low_memory =
+            !_caches.empty() && _caches.front().allowed < _caches.front().quota;
+    if (low_memory != _low_memory.load(std::memory_order_relaxed))
+        LOGF("low memory mode {}", low_memory ? "on" : "off");
+    _low_memory.store(low_memory, std::memory_order_relaxed);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "memstats.hpp"
+#include "thread.hpp"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+// Shares total bytes between the caches and the buffers of the downloads
+// running. Each cache has a quota it keeps while the downloads leave room
+// for it. A download reserves what its buffers take for as long as it runs,
+// and the caches of the lowest priority give their memory back first, down
+// to nothing if need be, before the next ones. Once even the cache of the
+// highest priority can't keep its quota, the budget is in low memory mode
+// and the downloads starting use smaller buffers rather than fail on an
+// allocation.
+class MemoryBudget
+{
+public:
+    // the bytes the cache may keep from now on, it evicts down to them on
+    // the thread using it if it can't right away. Called from the thread that
+    // reserved or released, with the budget's lock held, it must not wait on
+    // the cache's own locks
+    using SetQuota = std::function<void(size_t quota)>;
+
+    // the bytes are given back to the caches on destruction
+    class Reservation
+    {
+    public:
+        Reservation(const Reservation&) = delete;
+        Reservation& operator=(const Reservation&) = delete;
+
+        Reservation() = default;
+        Reservation(Reservation&& other) noexcept;
+        Reservation& operator=(Reservation&& other) noexcept;
+        ~Reservation();
+
+    private:
+        friend class MemoryBudget;
+
+        MemoryBudget* _budget = nullptr;
+        size_t _bytes = 0;
+
+        Reservation(MemoryBudget* budget, size_t bytes);
+        void release();
+    };
+
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    explicit MemoryBudget(size_t total);
+
+    // before the first reservation, set_quota is called right away
+    void add_cache(
+            MemPool pool, uint32_t priority, size_t quota, SetQuota set_quota);
+
+    // from any thread, a reservation may go over the budget, the caches are
+    // then emptied and low_memory() is true until it's released
+    Reservation reserve(size_t bytes);
+
+    bool low_memory() const
+    {
+        return _low_memory.load(std::memory_order_relaxed);
+    }
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    struct Cache
+    {
+        MemPool pool;
+        uint32_t priority;
+        size_t quota;
+        SetQuota set_quota;
+        // what it was last told it may keep
+        size_t allowed;
+    };
+
+    size_t _total;
+
+    // held through the calls to the caches, so that they get their quotas in
+    // order
+    Mutex _mutex;
+    // by descending priority
+    std::vector<Cache> _caches;
+    size_t _reserved = 0;
+    std::atomic<bool> _low_memory{false};
+
+    void release(size_t bytes);
+    // must be called with the mutex locked, shares what the reservations
+    // leave out and tells the caches whose share changed
+    void rebalance();
+};
@@ -0,0 +1,130 @@
+#include "memstats.hpp"
+
+#include <fmt/format.h>
+
+#include <atomic>
+
+namespace
+{
+struct Pool
+{
+    std::atomic<int64_t> current{0};
+    std::atomic<int64_t> peak{0};
+    std::atomic<uint64_t> limit{0};
+};
+
+std::array<Pool, MEM_POOL_COUNT> pools;
+}
+
+const char* mem_pool_name(MemPool pool)
+{
+    switch (pool)
+    {
+    case MemPool::TitleDb:
+        return "列表";
+    case MemPool::Download:
+        return "下载";
+    case MemPool::CompPack:
+        return "兼容包";
+    case MemPool::Icons:
+        return "图标";
+    case MemPool::TextWidths:
+        return "文字宽度";
+    case MemPool::Vita2d:
+        return "vita2d";
+    case MemPool::ImGui:
+        return "ImGui";
+    case MemPool::Net:
+        return "Net";
+    case MemPool::Ssl:
+        return "SSL";
+    case MemPool::Http:
+        return "HTTP";
+    case MemPool::Count:
+        break;
+    }
+    return "?";
+}
+
+const char* mem_pool_id(MemPool pool)
+{
+    switch (pool)
+    {
+    case MemPool::TitleDb:
+        return "title_db";
+    case MemPool::Download:
+        return "download";
+    case MemPool::CompPack:
+        return "comppack";
+    case MemPool::Icons:
+        return "icons";
+    case MemPool::TextWidths:
+        return "text_widths";
+    case MemPool::Vita2d:
+        return "vita2d";
+    case MemPool::ImGui:
+        return "imgui";
+    case MemPool::Net:
+        return "net";
+    case MemPool::Ssl:
+        return "ssl";
+    case MemPool::Http:
+        return "http";
+    case MemPool::Count:
+        break;
+    }
+    return "unknown";
+}
+
+void pkgi_mem_add(MemPool pool, int64_t delta)
+{
+    auto& p = pools[static_cast<size_t>(pool)];
+    const auto current =
+            p.current.fetch_add(delta, std::memory_order_relaxed) + delta;
+    auto peak = p.peak.load(std::memory_order_relaxed);
+    while (current > peak && !p.peak.compare_exchange_weak(
+                                     peak, current, std::memory_order_relaxed))
+        ;
+}
+
+void pkgi_mem_set(MemPool pool, uint64_t current, uint64_t peak)
+{
+    auto& p = pools[static_cast<size_t>(pool)];
+    p.current.store(current, std::memory_order_relaxed);
+    p.peak.store(peak, std::memory_order_relaxed);
+}
+
+void pkgi_mem_set_limit(MemPool pool, uint64_t limit)
+{
+    pools[static_cast<size_t>(pool)].limit.store(
+            limit, std::memory_order_relaxed);
+}
+
+MemTotals pkgi_mem_totals()
+{
+    MemTotals totals;
+    for (size_t i = 0; i < MEM_POOL_COUNT; ++i)
+    {
+        totals.current[i] = pools[i].current.load(std::memory_order_relaxed);
+        totals.peak[i] = pools[i].peak.load(std::memory_order_relaxed);
+        totals.limit[i] = pools[i].limit.load(std::memory_order_relaxed);
+    }
+    return totals;
+}
+
+std::string pkgi_format_mem_totals(const MemTotals& totals)
+{
+    std::string text;
+    for (size_t i = 0; i < MEM_POOL_COUNT; ++i)
+    {
+        text += fmt::format(
+                "{:>8}: {} KB, peak {} KB",
+                mem_pool_name(static_cast<MemPool>(i)),
+                totals.current[i] / 1024,
+                totals.peak[i] / 1024);
+        if (totals.limit[i])
+            text += fmt::format(" of {} KB", totals.limit[i] / 1024);
+        text += '\n';
+    }
+    return text;
+}
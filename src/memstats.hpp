@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+// where the memory goes, to tell which one grew when an allocation fails
+enum class MemPool : uint8_t
+{
+    // the lists kept in the cache of TitleDatabase
+    TitleDb,
+    // head, ISO tables and the buffers of the readers, writers and decoders
+    Download,
+    // the compatibility pack list while it's parsed
+    CompPack,
+    // the textures of IconCache
+    Icons,
+    // the texts measured by TextWidthCache
+    TextWidths,
+    // the pools of the system libraries, read back from them by
+    // pkgi_poll_memory_pools()
+    Vita2d,
+    ImGui,
+    Net,
+    Ssl,
+    Http,
+    Count,
+};
+
+static constexpr size_t MEM_POOL_COUNT = static_cast<size_t>(MemPool::Count);
+
+const char* mem_pool_name(MemPool pool);
+// stays the same across versions, for the tools that read the benchmarks
+const char* mem_pool_id(MemPool pool);
+
+struct MemTotals
+{
+    std::array<uint64_t, MEM_POOL_COUNT> current{};
+    std::array<uint64_t, MEM_POOL_COUNT> peak{};
+    // size of the pools that can't grow, 0 for the others
+    std::array<uint64_t, MEM_POOL_COUNT> limit{};
+};
+
+// thread safe, delta is negative when memory is given back
+void pkgi_mem_add(MemPool pool, int64_t delta);
+// for the pools that keep their own high-water mark
+void pkgi_mem_set(MemPool pool, uint64_t current, uint64_t peak);
+// for the pools of a fixed size
+void pkgi_mem_set_limit(MemPool pool, uint64_t limit);
+MemTotals pkgi_mem_totals();
+
+// reads the state of the pools of the system libraries, does nothing where
+// there are none
+void pkgi_poll_memory_pools();
+
+// a line per pool with its current and peak size, for the log
+std::string pkgi_format_mem_totals(const MemTotals& totals);
+
+// the bytes held by one owner, given back when it's destroyed
+class MemoryCharge
+{
+public:
+    MemoryCharge(const MemoryCharge&) = delete;
+    MemoryCharge& operator=(const MemoryCharge&) = delete;
+
+    explicit MemoryCharge(MemPool pool) : _pool(pool)
+    {
+    }
+    ~MemoryCharge()
+    {
+        set(0);
+    }
+
+    void set(size_t bytes)
+    {
+        pkgi_mem_add(
+                _pool,
+                static_cast<int64_t>(bytes) - static_cast<int64_t>(_bytes));
+        _bytes = bytes;
+    }
+
+private:
+    MemPool _pool;
+    size_t _bytes = 0;
+};
@@ -12,6 +12,7 @@ static int menu_search_clear;
 static Config menu_config;
 static uint32_t menu_selected;
 static int menu_allow_refresh;
+static int menu_allow_download_all;
 
 static MenuResult menu_result;
 
@@ -22,10 +23,12 @@ typedef enum
 {
     MenuSearch,
     MenuSearchClear,
+    MenuSearchAll,
     MenuText,
     MenuSort,
     MenuFilter,
     MenuRefresh,
+    MenuDownloadAll,
     MenuShow,
 } MenuType;
 
@@ -39,6 +42,7 @@ typedef struct
 static const MenuEntry menu_entries[] = {
         {MenuSearch, "搜索...", 0},
         {MenuSearchClear, PKGI_UTF8_CLEAR " 取消搜索", 0},
+        {MenuSearchAll, "全局搜索...", 0},
 
         {MenuText, "排序顺序:", 0},
         {MenuSort, "游戏编号", SortByTitle},
@@ -53,8 +57,10 @@ static const MenuEntry menu_entries[] = {
         {MenuFilter, "日本", DbFilterRegionJPN},
         {MenuFilter, "美国", DbFilterRegionUSA},
         {MenuFilter, "已安装的游戏", DbFilterInstalled},
+        {MenuFilter, "有更新的游戏", DbFilterUpdates},
 
         {MenuRefresh, "刷新列表", 0},
+        {MenuDownloadAll, "全部添加至LiveArea下载", 0},
 
         {MenuShow, "显示PSV游戏", 1},
         {MenuShow, "显示PSV追加下载内容", 2},
@@ -81,13 +87,22 @@ void pkgi_menu_get(Config* config)
     *config = menu_config;
 }
 
-void pkgi_menu_start(int search_clear, const Config* config, int allow_refresh)
+void pkgi_menu_start(
+        int search_clear,
+        const Config* config,
+        int allow_refresh,
+        int allow_download_all)
 {
     menu_search_clear = search_clear;
     menu_width = 1;
     menu_delta = 1;
     menu_config = *config;
     menu_allow_refresh = allow_refresh;
+    menu_allow_download_all = allow_download_all;
+    // left on it in a mode that shows it, MenuRefresh comes right before
+    if (menu_entries[menu_selected].type == MenuDownloadAll &&
+        !allow_download_all)
+        menu_selected--;
 }
 
 int pkgi_do_menu(pkgi_input* input)
@@ -137,7 +152,9 @@ int pkgi_do_menu(pkgi_input* input)
                  (menu_entries[menu_selected].type == MenuSearchClear &&
                   !menu_search_clear) ||
                  (menu_entries[menu_selected].type == MenuShow &&
-                  !(menu_entries[menu_selected].value & menu_allow_refresh)));
+                  !(menu_entries[menu_selected].value & menu_allow_refresh)) ||
+                 (menu_entries[menu_selected].type == MenuDownloadAll &&
+                  !menu_allow_download_all));
     }
 
     if (input->active & PKGI_BUTTON_DOWN)
@@ -156,7 +173,9 @@ int pkgi_do_menu(pkgi_input* input)
                  (menu_entries[menu_selected].type == MenuSearchClear &&
                   !menu_search_clear) ||
                  (menu_entries[menu_selected].type == MenuShow &&
-                  !(menu_entries[menu_selected].value & menu_allow_refresh)));
+                  !(menu_entries[menu_selected].value & menu_allow_refresh)) ||
+                 (menu_entries[menu_selected].type == MenuDownloadAll &&
+                  !menu_allow_download_all));
     }
 
     if (input->pressed & pkgi_cancel_button())
@@ -187,12 +206,24 @@ int pkgi_do_menu(pkgi_input* input)
             menu_delta = -1;
             return 1;
         }
+        else if (type == MenuSearchAll)
+        {
+            menu_result = MenuResultSearchAll;
+            menu_delta = -1;
+            return 1;
+        }
         else if (type == MenuRefresh)
         {
             menu_result = MenuResultRefresh;
             menu_delta = -1;
             return 1;
         }
+        else if (type == MenuDownloadAll)
+        {
+            menu_result = MenuResultDownloadAll;
+            menu_delta = -1;
+            return 1;
+        }
         else if (type == MenuShow)
         {
             switch (menu_entries[menu_selected].value)
@@ -290,14 +321,19 @@ int pkgi_do_menu(pkgi_input* input)
                 continue;
             }
         }
+        if (type == MenuDownloadAll && !menu_allow_download_all)
+        {
+            continue;
+        }
         uint32_t color = menu_selected == i ? PKGI_COLOR_TEXT_MENU_SELECTED
                                             : PKGI_COLOR_TEXT_MENU;
 
         int x = VITA_WIDTH - PKGI_MENU_WIDTH + PKGI_MENU_LEFT_PADDING;
 
         char text[64];
-        if (type == MenuSearch || type == MenuSearchClear || type == MenuText ||
-            type == MenuRefresh || type == MenuShow)
+        if (type == MenuSearch || type == MenuSearchClear ||
+            type == MenuSearchAll || type == MenuText || type == MenuRefresh ||
+            type == MenuDownloadAll || type == MenuShow)
         {
             pkgi_strncpy(text, sizeof(text), entry->text);
         }
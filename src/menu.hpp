@@ -8,9 +8,11 @@ typedef enum
 {
     MenuResultSearch,
     MenuResultSearchClear,
+    MenuResultSearchAll,
     MenuResultAccept,
     MenuResultCancel,
     MenuResultRefresh,
+    MenuResultDownloadAll,
     MenuResultShowGames,
     MenuResultShowDlcs,
     MenuResultShowDemos,
@@ -27,6 +29,12 @@ int pkgi_menu_is_open(void);
 void pkgi_menu_get(Config* config);
 MenuResult pkgi_menu_result(void);
 
-void pkgi_menu_start(int search_clear, const Config* config, int allow_update);
+// allow_download_all shows the entry that hands every row of the list to
+// LiveArea
+void pkgi_menu_start(
+        int search_clear,
+        const Config* config,
+        int allow_update,
+        int allow_download_all);
 
 int pkgi_do_menu(pkgi_input* input);
@@ -0,0 +1,127 @@
+#include "mirrorrace.hpp"
+
+#include "log.hpp"
+#include "pkgi.hpp"
+#include "thread.hpp"
+
+#include <fmt/format.h>
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+
+namespace
+{
+enum class ProbeResult
+{
+    Pending,
+    Done,
+    Failed,
+};
+
+struct Probe
+{
+    ProbeResult result = ProbeResult::Pending;
+    // set while the probe can be aborted
+    Http* http = nullptr;
+};
+}
+
+std::vector<std::string> MirrorRace::rank(
+        const std::vector<std::string>& urls, const HttpFactory& make_http)
+{
+    if (urls.size() < 2)
+        return urls;
+
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    const size_t count = std::min(urls.size(), MAX_PROBES);
+    Mutex mutex("mirror_race_mutex");
+    std::vector<Probe> probes(count);
+    // index of the first probe done, count while there is none
+    size_t winner = count;
+
+    [[maybe_unused]] const auto start = pkgi_time_msec();
+    const auto run = [&](size_t index) {
+        auto& probe = probes[index];
+        auto result = ProbeResult::Done;
+        try
+        {
+            auto http = make_http();
+            {
+                ScopeLock _(mutex);
+                if (winner != count)
+                    return;
+                probe.http = http.get();
+            }
+            BOOST_SCOPE_EXIT_ALL(&)
+            {
+                ScopeLock _(mutex);
+                probe.http = nullptr;
+            };
+
+            http->start_range(urls[index], 0, PROBE_SIZE);
+            const auto status = http->get_status();
+            if (status != 200 && status != 206)
+                throw formatEx<HttpError>("HTTP状态: {}", status);
+            uint32_t received = 0;
+            while (received < PROBE_SIZE)
+            {
+                const auto slice = http->borrow(PROBE_SIZE - received);
+                if (slice.size == 0)
+                    break;
+                received += slice.size;
+                http->give_back(slice);
+            }
+            if (received == 0)
+                throw HttpError("空响应");
+        }
+        catch (const std::exception& e)
+        {
+            result = ProbeResult::Failed;
+            LOGF("mirror {} failed: {}", urls[index], e.what());
+        }
+
+        {
+            ScopeLock _(mutex);
+            // the ones aborted by the winner failed through no fault of
+            // their own
+            if (winner == count || result == ProbeResult::Done)
+                probe.result = result;
+            if (winner == count && result == ProbeResult::Done)
+            {
+                winner = index;
+                LOGF("mirror {} answered first, in {}ms",
+                     urls[index],
+                     pkgi_time_msec() - start);
+                for (const auto& other : probes)
+                    if (other.http)
+                        other.http->abort();
+            }
+        }
+    };
+
+    {
+        std::vector<std::unique_ptr<Thread>> threads;
+        for (size_t i = 0; i < count; ++i)
+            threads.push_back(std::make_unique<Thread>(
+                    fmt::format("mirror_probe_{}", i),
+                    [&run, i] { run(i); },
+                    ThreadRole::Network));
+        for (auto& thread : threads)
+            thread->join();
+    }
+
+    std::vector<std::string> ranked;
+    if (winner != count)
+        ranked.push_back(urls[winner]);
+    for (const auto wanted : {ProbeResult::Done, ProbeResult::Pending})
+        for (size_t i = 0; i < count; ++i)
+            if (i != winner && probes[i].result == wanted)
+                ranked.push_back(urls[i]);
+    ranked.insert(ranked.end(), urls.begin() + count, urls.end());
+    for (size_t i = 0; i < count; ++i)
+        if (probes[i].result == ProbeResult::Failed)
+            ranked.push_back(urls[i]);
+    return ranked;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "http.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Races a small Range request against each of urls, the mirrors of a same
+// package, and returns them in the order the download should try them: the
+// first one to send PROBE_SIZE bytes, then the ones cut short when it did, in
+// the order of urls, then the ones that failed, as a last resort. The
+// connection of the winner goes back to the pool for the download to reuse.
+class MirrorRace
+{
+public:
+    using HttpFactory = std::function<std::unique_ptr<Http>()>;
+
+    static constexpr uint32_t PROBE_SIZE = 64 * 1024;
+    // mirrors raced at once, the ones past it are kept as fallbacks
+    static constexpr size_t MAX_PROBES = 4;
+
+    static std::vector<std::string> rank(
+            const std::vector<std::string>& urls,
+            const HttpFactory& make_http);
+};
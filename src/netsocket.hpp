@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+
+#include <cstdint>
+
+// Thin wrappers of the sockets of the platform, for PeerCache and FileServer.
+// The sockets are ints, negative when they couldn't be opened. Opening one
+// waits for the network to be up, see pkgi_wait_network().
+
+// bound to port on every interface and joined to the multicast group, the
+// datagrams sent to the group come back on it, ours included
+int pkgi_udp_open_multicast(const char* group, uint16_t port);
+// false when the datagram couldn't be sent
+bool pkgi_udp_send(
+        int socket,
+        const char* ip,
+        uint16_t port,
+        const void* data,
+        uint32_t size);
+// waits at most timeout_ms for a datagram, returns its size and sets from to
+// the ip of its sender, 0 when none came
+int pkgi_udp_receive(
+        int socket,
+        void* data,
+        uint32_t size,
+        uint32_t timeout_ms,
+        std::string& from);
+
+int pkgi_tcp_listen(uint16_t port);
+// the socket of the next connection, negative when none came within
+// timeout_ms. The connection is blocking, its receives fail after
+// receive_timeout_ms without data
+int pkgi_tcp_accept(
+        int socket, uint32_t timeout_ms, uint32_t receive_timeout_ms);
+// false when the connection was lost
+bool pkgi_tcp_send(int socket, const void* data, uint32_t size);
+// the bytes received, 0 when the peer closed, negative on errors and
+// timeouts
+int pkgi_tcp_receive(int socket, void* data, uint32_t size);
+
+void pkgi_socket_close(int socket);
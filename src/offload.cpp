@@ -0,0 +1,310 @@
+#include "offload.hpp"
+
+#include "download.hpp"
+#include "file.hpp"
+#include "log.hpp"
+#include "pkgi.hpp"
+#include "utils.hpp"
+
+#include <fmt/format.h>
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+#include <sstream>
+
+namespace
+{
+// a game of a few thousand files has an index of a few hundred KiB
+constexpr size_t MAX_INDEX = 4 * 1024 * 1024;
+
+void list_tree(
+        const std::string& root,
+        const std::string& prefix,
+        std::vector<OffloadEntry>& entries)
+{
+    auto names = pkgi_list_dir_contents(
+            prefix.empty() ? root : fmt::format("{}/{}", root, prefix));
+    std::sort(names.begin(), names.end());
+    for (const auto& name : names)
+    {
+        if (name == "." || name == "..")
+            continue;
+        const auto path = prefix.empty() ? name : prefix + "/" + name;
+        const auto full = fmt::format("{}/{}", root, path);
+        if (pkgi_get_inode_type(full) == InodeType::Directory)
+        {
+            entries.push_back({path, true, 0});
+            list_tree(root, path, entries);
+        }
+        else
+            entries.push_back(
+                    {path,
+                     false,
+                     static_cast<uint64_t>(pkgi_get_size(full.c_str()))});
+    }
+}
+}
+
+std::string pkgi_format_offload_index(const std::vector<OffloadEntry>& entries)
+{
+    std::string index;
+    for (const auto& entry : entries)
+        index += entry.directory
+                         ? fmt::format("d {}\n", entry.path)
+                         : fmt::format("f {} {}\n", entry.size, entry.path);
+    return index;
+}
+
+std::vector<OffloadEntry> pkgi_parse_offload_index(const std::string& index)
+{
+    std::vector<OffloadEntry> entries;
+    std::istringstream lines(index);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        if (line.empty())
+            continue;
+        OffloadEntry entry;
+        std::istringstream fields(line);
+        char kind = 0;
+        fields >> kind;
+        entry.directory = kind == 'd';
+        if (!entry.directory && !(kind == 'f' && fields >> entry.size))
+            throw formatEx<DownloadError>("PC文件列表损坏: {}", line);
+        fields >> std::ws;
+        std::getline(fields, entry.path);
+        if (!pkgi_is_offload_path(entry.path))
+            throw formatEx<DownloadError>("PC文件列表损坏: {}", line);
+        entries.push_back(std::move(entry));
+    }
+    return entries;
+}
+
+std::vector<OffloadEntry> pkgi_list_offload_tree(const std::string& root)
+{
+    std::vector<OffloadEntry> entries;
+    list_tree(root, {}, entries);
+    return entries;
+}
+
+bool pkgi_is_offload_path(const std::string& path)
+{
+    if (path.empty() || path[0] == '/' || path.find(':') != std::string::npos)
+        return false;
+    std::istringstream parts(path);
+    std::string part;
+    while (std::getline(parts, part, '/'))
+        if (part.empty() || part == "..")
+            return false;
+    return true;
+}
+
+OffloadDownload::OffloadDownload() : _cond("offload_cond")
+{
+}
+
+bool OffloadDownload::mirror(
+        const std::string& base,
+        const std::string& content,
+        const std::string& variant,
+        const std::vector<uint8_t>& digest,
+        const std::vector<uint8_t>& rif,
+        const std::string& root)
+{
+    const auto prefix = fmt::format("{}/{}/{}/", base, content, variant);
+    auto query = fmt::format("sha256={}", pkgi_tohex(digest));
+    if (!rif.empty())
+        query += fmt::format("&rif={}", pkgi_tohex(rif));
+
+    std::string index;
+    if (!fetch_index(fmt::format("{}index?{}", prefix, query), index))
+        return false;
+
+    _entries = pkgi_parse_offload_index(index);
+    _files_url = prefix + "files/";
+    _root = root;
+    _next_entry = 0;
+    _downloaded = 0;
+    _canceled = false;
+    _error = nullptr;
+
+    uint64_t total = 0;
+    for (const auto& entry : _entries)
+        total += entry.size;
+    LOGF("mirroring {} entries, {} bytes, from {}",
+         _entries.size(),
+         total,
+         prefix);
+
+    // the folders come before their files in the index
+    pkgi_mkdirs(root.c_str());
+    for (const auto& entry : _entries)
+        if (entry.directory)
+            pkgi_mkdirs(fmt::format("{}/{}", root, entry.path).c_str());
+
+    const auto count = std::clamp<size_t>(workers, 1, MAX_WORKERS);
+    _running = count;
+    std::vector<std::unique_ptr<Thread>> threads;
+    for (size_t i = 0; i < count; ++i)
+        threads.push_back(std::make_unique<Thread>(
+                fmt::format("offload_{}", i),
+                [this] { run(); },
+                ThreadRole::Network));
+
+    while (true)
+    {
+        const auto canceled = is_canceled();
+        uint64_t downloaded;
+        {
+            ScopeLock _(_cond.get_mutex());
+            if (_running == 0)
+                break;
+            _canceled = _canceled || canceled;
+            downloaded = _downloaded;
+        }
+        update_progress_cb(downloaded, total);
+        pkgi_sleep(100);
+    }
+    for (auto& thread : threads)
+        thread->join();
+
+    if (_error)
+        std::rethrow_exception(_error);
+    if (_canceled)
+        return false;
+    update_progress_cb(total, total);
+    return true;
+}
+
+bool OffloadDownload::fetch_index(const std::string& url, std::string& index)
+{
+    bool preparing_logged = false;
+    while (true)
+    {
+        if (is_canceled())
+            return false;
+
+        const auto http = http_factory();
+        http->start(url, 0);
+        const auto status = http->get_status();
+        if (status == 200)
+        {
+            pkgi_http_consume(*http, [&](const uint8_t* data, uint32_t size) {
+                if (index.size() + size > MAX_INDEX)
+                    throw DownloadError("PC文件列表过大");
+                index.append(reinterpret_cast<const char*>(data), size);
+            });
+            return true;
+        }
+        if (status != 503)
+        {
+            auto message = http->get_response_header("X-Error");
+            if (message.empty())
+                message = fmt::format("HTTP状态 {}", status);
+            throw formatEx<DownloadError>("PC处理失败: {}", message);
+        }
+
+        if (!preparing_logged)
+        {
+            LOGF("waiting for the PC to prepare {}", url);
+            preparing_logged = true;
+        }
+        http->abort();
+        const uint32_t until = pkgi_time_msec() + POLL_MS;
+        while (static_cast<int32_t>(until - pkgi_time_msec()) > 0)
+        {
+            if (is_canceled())
+                return false;
+            pkgi_sleep(100);
+        }
+    }
+}
+
+bool OffloadDownload::should_stop()
+{
+    ScopeLock _(_cond.get_mutex());
+    return _canceled || _error;
+}
+
+void OffloadDownload::run()
+{
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        ScopeLock _(_cond.get_mutex());
+        --_running;
+    };
+
+    while (true)
+    {
+        size_t next;
+        {
+            ScopeLock _(_cond.get_mutex());
+            while (_next_entry < _entries.size() &&
+                   _entries[_next_entry].directory)
+                ++_next_entry;
+            if (_canceled || _error || _next_entry == _entries.size())
+                return;
+            next = _next_entry++;
+        }
+
+        const auto& entry = _entries[next];
+        try
+        {
+            download_file(entry);
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("mirroring {} failed: {}", entry.path, e.what());
+            ScopeLock _(_cond.get_mutex());
+            // a cancel stops the transfers with an error of its own
+            if (!_error && !_canceled)
+                _error = std::current_exception();
+            return;
+        }
+    }
+}
+
+void OffloadDownload::download_file(const OffloadEntry& entry)
+{
+    const auto path = fmt::format("{}/{}", _root, entry.path);
+    // kept by a mirror that was interrupted
+    if (pkgi_get_size(path.c_str()) == static_cast<int64_t>(entry.size))
+    {
+        ScopeLock _(_cond.get_mutex());
+        _downloaded += entry.size;
+        return;
+    }
+
+    const auto http = http_factory();
+    http->start(_files_url + entry.path, 0);
+
+    const auto f = pkgi_create(path);
+    if (!f)
+        throw formatEx<DownloadError>("无法创建文件 {}", path);
+    bool complete = false;
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        pkgi_close(f);
+        // the next mirror keeps the files at their size, which is why they
+        // aren't preallocated and a partial one isn't left
+        if (!complete)
+            pkgi_rm(path.c_str());
+    };
+
+    uint64_t written = 0;
+    pkgi_http_consume(*http, [&](const uint8_t* data, uint32_t size) {
+        if (should_stop())
+            throw DownloadError("下载已取消");
+        if (written + size > entry.size ||
+            pkgi_write(f, data, size) != static_cast<int>(size))
+            throw formatEx<DownloadError>("写入 {} 失败", path);
+        written += size;
+        ScopeLock _(_cond.get_mutex());
+        _downloaded += size;
+    });
+    if (written != entry.size)
+        throw formatEx<HttpError>(
+                "{} 不完整, {}/{} 字节", entry.path, written, entry.size);
+    complete = true;
+}
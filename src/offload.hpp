@@ -0,0 +1,98 @@
+#pragma once
+
+#include "http.hpp"
+#include "thread.hpp"
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+// PC offload: the serve command of pkgj_cli downloads, decrypts, checks and
+// converts a package on a PC, and OffloadDownload mirrors the tree of files
+// it turned into to where Download would have written it, with plain GETs in
+// parallel. The Vita does none of the crypto nor the ISO compression.
+//
+// The Vita asks the PC for /<content>/<variant>/index?sha256=<hex>&rif=<hex>,
+// where variant is "pkg", or the IsoFormat name of a PSP game saved as ISO.
+// The PC answers 503 while it prepares the package, an error with an X-Error
+// header when it failed, and the index of the tree once it's done. Each file
+// of the tree is then at /<content>/<variant>/files/<path>.
+
+static constexpr uint16_t OFFLOAD_PORT = 30003;
+
+struct OffloadEntry
+{
+    // relative to the root of the tree, '/' separated
+    std::string path;
+    bool directory = false;
+    uint64_t size = 0;
+};
+
+// a line per entry, "d <path>" or "f <size> <path>", the folders before
+// what's in them
+std::string pkgi_format_offload_index(const std::vector<OffloadEntry>& entries);
+// throws DownloadError when index is damaged or leaves its root
+std::vector<OffloadEntry> pkgi_parse_offload_index(const std::string& index);
+// every folder and file under root
+std::vector<OffloadEntry> pkgi_list_offload_tree(const std::string& root);
+// false for the empty and absolute paths and those with a ".." in them
+bool pkgi_is_offload_path(const std::string& path);
+
+class OffloadDownload
+{
+public:
+    static constexpr size_t MAX_WORKERS = 4;
+    // between two asks for the index while the PC prepares the package
+    static constexpr uint32_t POLL_MS = 2000;
+
+    OffloadDownload(const OffloadDownload&) = delete;
+    OffloadDownload(OffloadDownload&&) = delete;
+    OffloadDownload& operator=(const OffloadDownload&) = delete;
+    OffloadDownload& operator=(OffloadDownload&&) = delete;
+
+    OffloadDownload();
+
+    std::function<std::unique_ptr<Http>()> http_factory;
+    std::function<void(uint64_t download_offset, uint64_t download_size)>
+            update_progress_cb;
+    std::function<bool()> is_canceled;
+    // files fetched at once, up to MAX_WORKERS
+    size_t workers = 1;
+
+    // mirrors the tree the PC at base, http://host:port, made of the package
+    // to root. The files already there at their size are kept, an
+    // interrupted mirror goes on where it stopped. False when canceled,
+    // throws HttpError when the PC can't be reached and DownloadError when it
+    // couldn't prepare the package
+    bool mirror(
+            const std::string& base,
+            const std::string& content,
+            const std::string& variant,
+            const std::vector<uint8_t>& digest,
+            const std::vector<uint8_t>& rif,
+            const std::string& root);
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    Cond _cond;
+    std::string _files_url;
+    std::string _root;
+    std::vector<OffloadEntry> _entries;
+    size_t _next_entry = 0;
+    size_t _running = 0;
+    uint64_t _downloaded = 0;
+    bool _canceled = false;
+    std::exception_ptr _error;
+
+    // false when canceled
+    bool fetch_index(const std::string& url, std::string& index);
+    void run();
+    void download_file(const OffloadEntry& entry);
+    bool should_stop();
+};
@@ -0,0 +1,88 @@
+#include "pacedhttp.hpp"
+
+#include "pkgi.hpp"
+
+#include <algorithm>
+
+namespace
+{
+// sleeps are cut in slices this long so that abort() is seen quickly
+constexpr uint32_t SLEEP_SLICE_MS = 10;
+}
+
+PacedHttp::PacedHttp(std::unique_ptr<Http> http) : _http(std::move(http))
+{
+}
+
+void PacedHttp::start(const std::string& url, uint64_t offset)
+{
+    _aborted = false;
+    connect();
+    _http->start(url, offset);
+}
+
+void PacedHttp::start_range(
+        const std::string& url, uint64_t offset, uint64_t end)
+{
+    _aborted = false;
+    connect();
+    _http->start_range(url, offset, end);
+}
+
+uint64_t PacedHttp::paced_size(uint64_t size, uint64_t rate)
+{
+    if (rate == 0)
+        return size;
+    return std::min(size, std::max<uint64_t>(rate / READS_PER_SECOND, 1));
+}
+
+void PacedHttp::sleep_usec(uint64_t usec)
+{
+    const auto end = pkgi_time_usec() + usec;
+    while (!_aborted)
+    {
+        const auto now = pkgi_time_usec();
+        if (now >= end)
+            return;
+        pkgi_sleep(std::min<uint64_t>(
+                SLEEP_SLICE_MS, (end - now + 999) / 1000));
+    }
+}
+
+void PacedHttp::check_aborted() const
+{
+    if (_aborted)
+        throw HttpError("connection aborted");
+}
+
+void PacedHttp::abort()
+{
+    _aborted = true;
+    _http->abort();
+}
+
+int PacedHttp::get_status()
+{
+    return _http->get_status();
+}
+
+int64_t PacedHttp::get_length()
+{
+    return _http->get_length();
+}
+
+void PacedHttp::add_request_header(
+        const std::string& name, const std::string& value)
+{
+    _http->add_request_header(name, value);
+}
+
+std::string PacedHttp::get_response_header(const std::string& name)
+{
+    return _http->get_response_header(name);
+}
+
+PacedHttp::operator bool() const
+{
+    return static_cast<bool>(*_http);
+}
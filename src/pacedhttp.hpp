@@ -0,0 +1,54 @@
+#pragma once
+
+#include "http.hpp"
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <cstdint>
+
+// Base of the Http decorators that hold the reads of the wrapped stream
+// back, ThrottledHttp and RateLimitedHttp. It forwards everything but read()
+// and gives them a sleep that abort() cuts short.
+class PacedHttp : public Http
+{
+public:
+    explicit PacedHttp(std::unique_ptr<Http> http);
+
+    void start(const std::string& url, uint64_t offset) override;
+    void start_range(
+            const std::string& url, uint64_t offset, uint64_t end) override;
+    void abort() override;
+
+    int get_status() override;
+    int64_t get_length() override;
+
+    void add_request_header(
+            const std::string& name, const std::string& value) override;
+    std::string get_response_header(const std::string& name) override;
+
+    explicit operator bool() const override;
+
+protected:
+    // the reads are cut to this much of a second at rate bytes per second,
+    // a big read would otherwise come in one burst after a long wait
+    static constexpr uint64_t READS_PER_SECOND = 20;
+
+    std::unique_ptr<Http> _http;
+
+    // called by start() and start_range() before the request is sent, abort()
+    // is forgotten by then
+    virtual void connect()
+    {
+    }
+
+    static uint64_t paced_size(uint64_t size, uint64_t rate);
+    // returns early on abort()
+    void sleep_usec(uint64_t usec);
+    // throws HttpError after abort()
+    void check_aborted() const;
+
+private:
+    std::atomic<bool> _aborted{false};
+};
@@ -0,0 +1,144 @@
+#include "packagemanifest.hpp"
+
+#include "utils.hpp"
+
+#include <algorithm>
+
+#include <cstring>
+
+namespace
+{
+bool is_psp(uint32_t content_type)
+{
+    return content_type == CONTENT_TYPE_PSP_GAME ||
+           content_type == CONTENT_TYPE_PSP_GAME_ALT ||
+           content_type == CONTENT_TYPE_PSP_MINI_GAME;
+}
+
+PackageAction decide(
+        const std::string& name,
+        uint8_t type,
+        uint32_t content_type,
+        bool save_as_iso)
+{
+    if (type == 4)
+        return PackageAction::Folder;
+    if (type == 18)
+        return PackageAction::Ignore;
+    if (!is_psp(content_type))
+        return PackageAction::File;
+
+    if (save_as_iso)
+        return name == "USRDIR/CONTENT/EBOOT.PBP" ? PackageAction::Iso
+                                                  : PackageAction::Empty;
+    if (name != "USRDIR/CONTENT/DOCUMENT.DAT" &&
+        name != "USRDIR/CONTENT/DOCINFO.EDAT" &&
+        (ends_with(name, ".EDAT") || ends_with(name, ".edat")))
+        return PackageAction::Edat;
+    return PackageAction::File;
+}
+}
+
+void PackageManifest::decode_items(
+        const aes128_ctx* aes,
+        const uint8_t* iv,
+        uint8_t* table,
+        uint32_t count)
+{
+    aes128_ctr(aes, iv, 0, table, count * 32);
+
+    items.clear();
+    items.reserve(count);
+    for (uint32_t index = 0; index < count; ++index)
+    {
+        const auto entry = table + index * 32;
+        PackageItem item;
+        item.name_offset = get32be(entry + 0);
+        item.name_size = get32be(entry + 4);
+        item.offset = get64be(entry + 8);
+        item.size = get64be(entry + 16);
+        item.type = entry[27];
+        items.push_back(item);
+    }
+}
+
+uint64_t PackageManifest::names_begin() const
+{
+    if (items.empty())
+        return 0;
+    uint64_t begin = UINT64_MAX;
+    for (const auto& item : items)
+        begin = std::min<uint64_t>(begin, item.name_offset);
+    return begin;
+}
+
+uint64_t PackageManifest::names_end() const
+{
+    uint64_t end = 0;
+    for (const auto& item : items)
+        end = std::max(end, uint64_t(item.name_offset) + item.name_size);
+    return end;
+}
+
+void PackageManifest::decode_names(
+        const aes128_ctx* aes,
+        const uint8_t* iv,
+        uint8_t* names,
+        uint32_t content_type,
+        bool save_as_iso)
+{
+    const auto begin = names_begin();
+    aes128_ctr(aes, iv, begin, names, names_end() - begin);
+
+    const bool partial =
+            is_psp(content_type) || content_type == CONTENT_TYPE_PSX_GAME;
+    const bool psm = content_type == CONTENT_TYPE_PSM_GAME ||
+                     content_type == CONTENT_TYPE_PSM_GAME_ALT;
+    const std::string prefix = "USRDIR/CONTENT/";
+
+    strings.clear();
+    std::string name;
+    for (auto& item : items)
+    {
+        const auto data = reinterpret_cast<const char*>(
+                names + (item.name_offset - begin));
+        // the names are padded with zeros
+        name.assign(data, strnlen(data, item.name_size));
+
+        item.name = strings.size();
+        strings.append(name).push_back('\0');
+
+        // PSP and PSX packages only give the files under USRDIR/CONTENT,
+        // PSM ones are installed without their "content/" prefix
+        std::string path;
+        if (partial)
+        {
+            if (name.compare(0, prefix.size(), prefix) != 0 ||
+                name.size() == prefix.size())
+            {
+                item.action = PackageAction::Skip;
+                item.path = item.name;
+                continue;
+            }
+            path = name.substr(prefix.size());
+        }
+        else if (psm)
+            path = "RO/" + name.substr(std::min<size_t>(8, name.size()));
+        else
+            path = name;
+
+        item.action = decide(name, item.type, content_type, save_as_iso);
+        item.path = strings.size();
+        strings.append(path).push_back('\0');
+    }
+    strings.shrink_to_fit();
+}
+
+uint64_t PackageManifest::footprint() const
+{
+    uint64_t footprint = 0;
+    for (const auto& item : items)
+        if (item.type != 4 && item.type != 18)
+            footprint += item.size;
+    return footprint;
+}
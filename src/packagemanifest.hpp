@@ -0,0 +1,111 @@
+#pragma once
+
+#include "aes128.hpp"
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+enum ContentType
+{
+    CONTENT_TYPE_PSX_GAME = 6,
+    CONTENT_TYPE_PSP_GAME = 7,
+    CONTENT_TYPE_PSP_GAME_ALT = 14,
+    CONTENT_TYPE_PSP_MINI_GAME = 15,
+    CONTENT_TYPE_PSV_GAME = 21, // or update
+    CONTENT_TYPE_PSV_DLC = 22,
+    CONTENT_TYPE_PSM_GAME = 24,
+    CONTENT_TYPE_PSM_GAME_ALT = 29, // also sometimes 29
+};
+
+// what an item of the package becomes on the card
+enum class PackageAction : uint8_t
+{
+    // left out, its data is skipped
+    Skip,
+    Folder,
+    // type 18, nothing to write and no data
+    Ignore,
+    File,
+    // created empty and its data skipped, the files next to the EBOOT.PBP of
+    // a PSP game saved as ISO
+    Empty,
+    // the EBOOT.PBP of a PSP game saved as ISO
+    Iso,
+    // a PSP EDAT
+    Edat,
+};
+
+struct PackageItem
+{
+    // from the start of the encrypted area
+    uint64_t offset;
+    uint64_t size;
+    uint32_t name_offset;
+    uint32_t name_size;
+    // into PackageManifest::strings, set by decode_names
+    uint32_t name = 0;
+    uint32_t path = 0;
+    uint8_t type;
+    PackageAction action = PackageAction::Skip;
+
+    uint64_t encrypted_size() const
+    {
+        return (size + AES_BLOCK_SIZE - 1) & ~uint64_t(AES_BLOCK_SIZE - 1);
+    }
+};
+
+// The item table of a package decoded once, with the name, the path and the
+// handling of each item decided up front, so that the download, its repair,
+// the free space check and the peek from the game view don't each decrypt
+// and compare names item by item. Not to be confused with Manifest, the
+// record of what an install wrote.
+class PackageManifest
+{
+public:
+    std::vector<PackageItem> items;
+    // the names and paths, each ends with a '\0'
+    std::string strings;
+
+    // decrypts the item table of count entries in place and reads the
+    // offsets, sizes and types of the items
+    void decode_items(
+            const aes128_ctx* aes,
+            const uint8_t* iv,
+            uint8_t* table,
+            uint32_t count);
+
+    // the range of the encrypted area that holds all the names, valid after
+    // decode_items
+    uint64_t names_begin() const;
+    uint64_t names_end() const;
+
+    // decrypts names, the bytes from names_begin() to names_end(), in place
+    // and decides what becomes of each item. The paths are relative to the
+    // folder the package is extracted to
+    void decode_names(
+            const aes128_ctx* aes,
+            const uint8_t* iv,
+            uint8_t* names,
+            uint32_t content_type,
+            bool save_as_iso);
+
+    const char* name(const PackageItem& item) const
+    {
+        return strings.c_str() + item.name;
+    }
+    const char* path(const PackageItem& item) const
+    {
+        return strings.c_str() + item.path;
+    }
+
+    // bytes the items take once installed, folders take none. Meaningless
+    // for the PSP and PSX packages, which are only partially extracted
+    uint64_t footprint() const;
+
+    size_t memory_size() const
+    {
+        return items.capacity() * sizeof(PackageItem) + strings.capacity();
+    }
+};
@@ -0,0 +1,76 @@
+#include "packagepeekfetcher.hpp"
+
+#include "log.hpp"
+#include "vitahttp.hpp"
+
+#include <mutex>
+
+PackagePeekFetcher::PackagePeekFetcher(std::string url, TaskPool* pool)
+    : _mutex("package_peek_fetcher_mutex"), _url(std::move(url))
+{
+    if (_url.empty())
+        return;
+
+    // the game view shows it as soon as it opens
+    _status = Status::Fetching;
+    _task = pool->submit(
+            TaskPool::PriorityHigh, [this](const Task&) { do_request(); });
+}
+
+PackagePeekFetcher::~PackagePeekFetcher()
+{
+    // the request in flight is a few KB, it's let finish, the next ones
+    // aren't made
+    {
+        std::lock_guard<Mutex> lock(_mutex);
+        _abort = true;
+    }
+    if (_task)
+    {
+        _task->cancel();
+        _task->wait();
+    }
+}
+
+PackagePeekFetcher::Status PackagePeekFetcher::get_status()
+{
+    std::lock_guard<Mutex> lock(_mutex);
+    return _status;
+}
+
+std::optional<PackageInfo> PackagePeekFetcher::get_info()
+{
+    std::lock_guard<Mutex> lock(_mutex);
+    return _info;
+}
+
+void PackagePeekFetcher::do_request()
+{
+    try
+    {
+        auto info = pkgi_peek_package(
+                [this]() -> std::unique_ptr<Http> {
+                    std::lock_guard<Mutex> lock(_mutex);
+                    if (_abort)
+                        throw HttpError("aborted");
+                    return std::make_unique<VitaHttp>();
+                },
+                _url);
+        LOGF("peeked at {}: content type {}, {} files, {} installed, "
+             "firmware {}",
+             _url,
+             info.content_type,
+             info.files.size(),
+             info.footprint,
+             info.system_version);
+        std::lock_guard<Mutex> lock(_mutex);
+        _info = std::move(info);
+        _status = Status::Found;
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("Failed to peek at {}: {}", _url, e.what());
+        std::lock_guard<Mutex> lock(_mutex);
+        _status = Status::Error;
+    }
+}
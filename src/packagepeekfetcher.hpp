@@ -0,0 +1,41 @@
+#pragma once
+
+#include "download.hpp"
+#include "taskpool.hpp"
+#include "thread.hpp"
+
+#include <memory>
+#include <optional>
+
+// peeks at the package of a game in the background, see pkgi_peek_package
+class PackagePeekFetcher
+{
+public:
+    enum class Status
+    {
+        // the item has no url
+        None,
+        Fetching,
+        Found,
+        Error,
+    };
+
+    PackagePeekFetcher(std::string url, TaskPool* pool);
+    ~PackagePeekFetcher();
+
+    Status get_status();
+    std::optional<PackageInfo> get_info();
+
+private:
+    Mutex _mutex;
+
+    std::string _url;
+
+    bool _abort{false};
+    Status _status{Status::None};
+    std::optional<PackageInfo> _info;
+
+    std::shared_ptr<Task> _task;
+
+    void do_request();
+};
@@ -0,0 +1,155 @@
+#include "packageverifier.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+
+#include <fmt/format.h>
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+
+PackageVerifier::PackageVerifier(
+        TaskPool* pool, std::string manifest_path, std::string folder)
+    : _pool(pool)
+    , _manifest_path(std::move(manifest_path))
+    , _folder(std::move(folder))
+    , _mutex("package_verifier_mutex")
+    , _tasks(CONCURRENCY)
+{
+    ScopeLock _(_mutex);
+    _load_task = _pool->submit(
+            TaskPool::PriorityNormal, [this](const Task& task) { load(task); });
+}
+
+PackageVerifier::~PackageVerifier()
+{
+    std::vector<std::shared_ptr<Task>> tasks;
+    {
+        ScopeLock _(_mutex);
+        // no task is submitted anymore
+        _dying = true;
+        _pending.clear();
+        tasks = _tasks;
+        tasks.push_back(_load_task);
+    }
+    for (const auto& task : tasks)
+        if (task)
+        {
+            task->cancel();
+            task->wait();
+        }
+}
+
+PackageVerifier::Progress PackageVerifier::progress()
+{
+    ScopeLock _(_mutex);
+    return {_done, _total, _loaded && _running == 0};
+}
+
+std::vector<std::string> PackageVerifier::damaged()
+{
+    ScopeLock _(_mutex);
+    return _damaged;
+}
+
+std::string PackageVerifier::error()
+{
+    ScopeLock _(_mutex);
+    return _error;
+}
+
+void PackageVerifier::load(const Task& task)
+{
+    LOGF("verifying {} with {}", _folder, _manifest_path);
+    auto manifest = pkgi_load_manifest(_manifest_path);
+
+    ScopeLock _(_mutex);
+    _loaded = true;
+    if (!manifest)
+    {
+        _error = "没有该游戏的校验数据, 只有使用此版本下载的游戏才能校验";
+        return;
+    }
+    if (_dying || task.cancelled())
+        return;
+
+    _pending.reserve(manifest->size());
+    for (auto& entry : *manifest)
+        _pending.push_back(std::move(entry.second));
+    // checked in the order of the paths, the files of a folder together
+    std::sort(_pending.begin(), _pending.end(), [](auto& a, auto& b) {
+        return a.path > b.path;
+    });
+    _total = _pending.size();
+
+    for (size_t slot = 0; slot < CONCURRENCY && _running < _pending.size();
+         ++slot)
+        submit(slot);
+}
+
+void PackageVerifier::submit(size_t slot)
+{
+    ++_running;
+    _tasks[slot] = _pool->submit(
+            TaskPool::PriorityNormal,
+            [this, slot](const Task& task) { run(slot, task); });
+}
+
+bool PackageVerifier::check(const ManifestEntry& entry, const Task& task)
+{
+    const auto path = fmt::format("{}/{}", _folder, entry.path);
+    const auto size = pkgi_get_size(path.c_str());
+    if (size < 0 || static_cast<uint64_t>(size) != entry.size)
+        return false;
+
+    const auto f = pkgi_open(path.c_str());
+    if (!f)
+        return false;
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        pkgi_close(f);
+    };
+
+    uint32_t crc = 0;
+    return pkgi_crc_file(
+                   f, entry.size, crc, [&] { return task.cancelled(); }) &&
+           crc == entry.crc;
+}
+
+void PackageVerifier::run(size_t slot, const Task& task)
+{
+    ManifestEntry entry;
+    {
+        ScopeLock _(_mutex);
+        if (_pending.empty() || task.cancelled())
+        {
+            --_running;
+            return;
+        }
+        entry = std::move(_pending.back());
+        _pending.pop_back();
+    }
+
+    bool intact = false;
+    try
+    {
+        intact = check(entry, task);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to check {}: {}", entry.path, e.what());
+    }
+    if (!intact)
+        LOGF("{} is missing or damaged", entry.path);
+
+    ScopeLock _(_mutex);
+    ++_done;
+    if (!intact && !task.cancelled())
+        _damaged.push_back(entry.path);
+
+    // a file per task, so that the other tasks of the pool get their turn
+    --_running;
+    if (!_pending.empty() && !_dying)
+        submit(slot);
+}
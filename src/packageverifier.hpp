@@ -0,0 +1,76 @@
+#pragma once
+
+#include "manifest.hpp"
+#include "taskpool.hpp"
+#include "thread.hpp"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Checks the files of an installed or partly downloaded package against the
+// manifest its download left, a few files at a time on the task pool, to
+// audit a card after a power failure. Nothing is downloaded, a damaged
+// package is fixed by a repair.
+class PackageVerifier
+{
+public:
+    // files checked at once, the card is the bottleneck and a worker is left
+    // to the other tasks
+    static constexpr size_t CONCURRENCY = 2;
+
+    struct Progress
+    {
+        size_t done;
+        size_t total;
+        bool finished;
+    };
+
+    PackageVerifier(const PackageVerifier&) = delete;
+    PackageVerifier(PackageVerifier&&) = delete;
+    PackageVerifier& operator=(const PackageVerifier&) = delete;
+    PackageVerifier& operator=(PackageVerifier&&) = delete;
+
+    // starts checking the files of the manifest at manifest_path in folder
+    PackageVerifier(
+            TaskPool* pool, std::string manifest_path, std::string folder);
+    ~PackageVerifier();
+
+    Progress progress();
+    // the paths of the files missing or not matching, all of them once
+    // finished
+    std::vector<std::string> damaged();
+    // not empty when the manifest couldn't be read, nothing was checked then
+    std::string error();
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    TaskPool* _pool;
+    std::string _manifest_path;
+    std::string _folder;
+
+    Mutex _mutex;
+    // set by the destructor, no task is submitted after it
+    bool _dying = false;
+    std::shared_ptr<Task> _load_task;
+    bool _loaded = false;
+    std::string _error;
+    // popped from the back
+    std::vector<ManifestEntry> _pending;
+    size_t _done = 0;
+    size_t _total = 0;
+    std::vector<std::string> _damaged;
+
+    // a slot per file checked at once, its task checks a file and submits
+    // the next one until there are none left
+    std::vector<std::shared_ptr<Task>> _tasks;
+    size_t _running = 0;
+
+    void load(const Task& task);
+    // must be called with the mutex locked
+    void submit(size_t slot);
+    void run(size_t slot, const Task& task);
+    bool check(const ManifestEntry& entry, const Task& task);
+};
@@ -2,6 +2,8 @@
 
 #include "sha256.hpp"
 
+#include <cstdlib>
+
 namespace
 {
 constexpr uint8_t HMAC_KEY[32] = {
@@ -39,17 +41,9 @@ std::optional<std::vector<uint8_t>> download_data(
     http->start(url, 0);
     if (http->get_status() == 404)
         return std::nullopt;
-    size_t pos = 0;
-    while (true)
-    {
-        if (pos == data.size())
-            data.resize(pos + 4096);
-        const auto read = http->read(data.data() + pos, data.size() - pos);
-        if (read == 0)
-            break;
-        pos += read;
-    }
-    data.resize(pos);
+    pkgi_http_consume(*http, [&](const uint8_t* slice, uint32_t size) {
+        data.insert(data.end(), slice, slice + size);
+    });
     return data;
 }
 
@@ -59,6 +53,7 @@ PatchInfo get_last_patch(const std::string& xml)
     static constexpr char HybridPackageStr[] = "<hybrid_package";
     static constexpr char VersionStr[] = "version=\"";
     static constexpr char UrlStr[] = "url=\"";
+    static constexpr char SizeStr[] = " size=\"";
     static constexpr char Psp2SystemVerStr[] = "psp2_system_ver=\"";
 
     const auto last_package = xml.rfind(PackageStr);
@@ -74,6 +69,9 @@ PatchInfo get_last_patch(const std::string& xml)
                                              : last_hybrid_package;
     const auto url = xml.find(UrlStr, package_of_interest) + sizeof(UrlStr) - 1;
     const auto url_end = xml.find('"', url);
+    // only looked for in the element of the package
+    const auto package_end = xml.find('>', package_of_interest);
+    const auto size = xml.find(SizeStr, package_of_interest);
 
     const auto fw_version_int =
             std::stoi(xml.substr(fw_version, fw_version_end - fw_version));
@@ -85,6 +83,12 @@ PatchInfo get_last_patch(const std::string& xml)
                     fw_version_int >> 24,
                     (fw_version_int >> 16) & 0xff),
             xml.substr(url, url_end - url),
+            size < package_end
+                    ? std::strtoull(
+                              xml.c_str() + size + sizeof(SizeStr) - 1,
+                              nullptr,
+                              10)
+                    : 0,
     };
 }
 }
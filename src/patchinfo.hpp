@@ -5,11 +5,15 @@
 #include <optional>
 #include <string>
 
+#include <cstdint>
+
 struct PatchInfo
 {
     std::string version;
     std::string fw_version;
     std::string url;
+    // of the package, 0 when unknown
+    uint64_t size = 0;
 };
 
 std::optional<PatchInfo> pkgi_download_patch_info(
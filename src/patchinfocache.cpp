@@ -0,0 +1,143 @@
+#include "patchinfocache.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <fmt/format.h>
+
+#include <cstdlib>
+#include <ctime>
+#include <stdexcept>
+#include <vector>
+
+PatchInfoCache::PatchInfoCache(std::string dir, int64_t ttl_seconds)
+    : _dir(std::move(dir))
+    , _ttl_seconds(ttl_seconds)
+    , _mutex("patch_info_cache_mutex")
+{
+}
+
+std::string PatchInfoCache::path(const std::string& titleid) const
+{
+    return fmt::format("{}/{}", _dir, titleid);
+}
+
+bool PatchInfoCache::get(
+        const std::string& titleid, std::optional<PatchInfo>& patch_info)
+{
+    if (_ttl_seconds <= 0)
+        return false;
+
+    const int64_t now = std::time(nullptr);
+
+    ScopeLock _(_mutex);
+    auto it = _entries.find(titleid);
+    if (it == _entries.end())
+    {
+        // a small file, read once per title and session at most. It's the
+        // fetch time, then "1" and the version, firmware, url and size of the
+        // patch, or "0" when there is no update, one per line. The files
+        // written before the size was kept have no size line
+        try
+        {
+            const auto data = pkgi_load(path(titleid));
+            const auto lines =
+                    pkgi_split(std::string(data.begin(), data.end()), '\n');
+            if (lines.size() == 2 && lines[1] == "0")
+                insert(titleid,
+                       std::nullopt,
+                       std::strtoll(lines[0].c_str(), nullptr, 10));
+            else if ((lines.size() == 5 || lines.size() == 6) &&
+                     lines[1] == "1")
+                insert(titleid,
+                       PatchInfo{
+                               lines[2],
+                               lines[3],
+                               lines[4],
+                               lines.size() == 6 ? std::strtoull(
+                                                           lines[5].c_str(),
+                                                           nullptr,
+                                                           10)
+                                                 : 0},
+                       std::strtoll(lines[0].c_str(), nullptr, 10));
+            else
+                LOGF("ignoring bad patch info cache of {}", titleid);
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("no cached patch info for {}: {}", titleid, e.what());
+        }
+        it = _entries.find(titleid);
+        if (it == _entries.end())
+            return false;
+    }
+
+    if (now < it->second.fetched_at ||
+        now - it->second.fetched_at >= _ttl_seconds)
+        return false;
+
+    _lru.splice(_lru.begin(), _lru, it->second.lru);
+    patch_info = it->second.patch_info;
+    return true;
+}
+
+void PatchInfoCache::put(
+        const std::string& titleid, const std::optional<PatchInfo>& info)
+{
+    if (_ttl_seconds <= 0)
+        return;
+
+    const int64_t now = std::time(nullptr);
+
+    std::string text = fmt::format("{}\n", now);
+    if (info)
+        text += fmt::format(
+                "1\n{}\n{}\n{}\n{}\n",
+                info->version,
+                info->fw_version,
+                info->url,
+                info->size);
+    else
+        text += "0\n";
+
+    {
+        ScopeLock _(_mutex);
+        insert(titleid, info, now);
+    }
+
+    // called on the fetcher thread, a failed save only costs a fetch
+    try
+    {
+        pkgi_mkdirs(_dir.c_str());
+        pkgi_save(path(titleid), text.data(), text.size());
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to save patch info of {}: {}", titleid, e.what());
+    }
+}
+
+void PatchInfoCache::insert(
+        const std::string& titleid,
+        const std::optional<PatchInfo>& patch_info,
+        int64_t fetched_at)
+{
+    auto it = _entries.find(titleid);
+    if (it != _entries.end())
+    {
+        it->second.patch_info = patch_info;
+        it->second.fetched_at = fetched_at;
+        _lru.splice(_lru.begin(), _lru, it->second.lru);
+        return;
+    }
+
+    _lru.push_front(titleid);
+    _entries.emplace(titleid, Entry{patch_info, fetched_at, _lru.begin()});
+
+    while (_entries.size() > MAX_ENTRIES)
+    {
+        _entries.erase(_lru.back());
+        _lru.pop_back();
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "patchinfo.hpp"
+#include "thread.hpp"
+
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <cstdint>
+
+// Results of the update server per title id, "no update" included, so that a
+// game view opened again shows them right away. The last titles are kept in
+// memory, every result is also saved in a small file of dir and used until
+// it is older than ttl_seconds.
+class PatchInfoCache
+{
+public:
+    static constexpr size_t MAX_ENTRIES = 64;
+
+    PatchInfoCache(const PatchInfoCache&) = delete;
+    PatchInfoCache(PatchInfoCache&&) = delete;
+    PatchInfoCache& operator=(const PatchInfoCache&) = delete;
+    PatchInfoCache& operator=(PatchInfoCache&&) = delete;
+
+    PatchInfoCache(std::string dir, int64_t ttl_seconds);
+
+    // false if there is no fresh result for titleid, patch_info is left
+    // alone then
+    bool get(const std::string& titleid, std::optional<PatchInfo>& patch_info);
+    void put(const std::string& titleid, const std::optional<PatchInfo>& info);
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    struct Entry
+    {
+        std::optional<PatchInfo> patch_info;
+        // seconds since the epoch
+        int64_t fetched_at;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::string _dir;
+    int64_t _ttl_seconds;
+
+    Mutex _mutex;
+    // most recent first
+    std::list<std::string> _lru;
+    std::unordered_map<std::string, Entry> _entries;
+
+    std::string path(const std::string& titleid) const;
+    // must be called with the mutex locked
+    void insert(
+            const std::string& titleid,
+            const std::optional<PatchInfo>& patch_info,
+            int64_t fetched_at);
+};
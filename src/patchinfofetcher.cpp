@@ -4,11 +4,21 @@
 
 #include <mutex>
 
-PatchInfoFetcher::PatchInfoFetcher(std::string title_id)
+PatchInfoFetcher::PatchInfoFetcher(
+        std::string title_id, PatchInfoCache* cache, TaskPool* pool)
     : _mutex("patch_info_fetcher_mutex")
     , _title_id(std::move(title_id))
-    , _thread("patch_info_fetcher", [this] { do_request(); })
+    , _cache(cache)
 {
+    if (_cache->get(_title_id, _patch_info))
+    {
+        _status = _patch_info ? Status::Found : Status::NoUpdate;
+        return;
+    }
+
+    // the game view shows it as soon as it opens
+    _task = pool->submit(
+            TaskPool::PriorityHigh, [this](const Task&) { do_request(); });
 }
 
 PatchInfoFetcher::~PatchInfoFetcher()
@@ -21,7 +31,11 @@ PatchInfoFetcher::~PatchInfoFetcher()
     }
     if (http)
         http->abort();
-    _thread.join();
+    if (_task)
+    {
+        _task->cancel();
+        _task->wait();
+    }
 }
 
 PatchInfoFetcher::Status PatchInfoFetcher::get_status()
@@ -48,6 +62,8 @@ void PatchInfoFetcher::do_request()
         }
         const auto patch_info =
                 pkgi_download_patch_info(_http.get(), _title_id);
+        // a 404 is cached too, errors aren't
+        _cache->put(_title_id, patch_info);
         {
             std::lock_guard<Mutex> lock(_mutex);
             if (!patch_info)
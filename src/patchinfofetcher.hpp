@@ -2,8 +2,11 @@
 
 #include "http.hpp"
 #include "patchinfo.hpp"
+#include "patchinfocache.hpp"
+#include "taskpool.hpp"
 #include "thread.hpp"
 
+#include <memory>
 #include <optional>
 
 class PatchInfoFetcher
@@ -17,7 +20,9 @@ public:
         Error,
     };
 
-    PatchInfoFetcher(std::string title_id);
+    // a result cached in cache is used right away, there is no fetch then
+    PatchInfoFetcher(
+            std::string title_id, PatchInfoCache* cache, TaskPool* pool);
     ~PatchInfoFetcher();
 
     Status get_status();
@@ -27,13 +32,15 @@ private:
     Mutex _mutex;
 
     std::string _title_id;
+    PatchInfoCache* _cache;
 
     bool _abort{false};
     Status _status{Status::Fetching};
     std::unique_ptr<Http> _http;
     std::optional<PatchInfo> _patch_info;
 
-    Thread _thread;
+    // only submitted on a cache miss
+    std::shared_ptr<Task> _task;
 
     void do_request();
 };
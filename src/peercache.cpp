@@ -0,0 +1,332 @@
+#include "peercache.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "netsocket.hpp"
+#include "pkgi.hpp"
+#include "sha256.hpp"
+#include "utils.hpp"
+
+#include <fmt/format.h>
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+#include <sstream>
+
+#include <string.h>
+
+namespace
+{
+constexpr char ANNOUNCE_MAGIC[] = "PKGJ-PEER";
+constexpr uint32_t ANNOUNCE_VERSION = 1;
+// under the usual MTU, the packages that don't fit go in more datagrams
+constexpr size_t MAX_DATAGRAM = 1200;
+
+// the folders of the packages kept on the card, see card_package_url
+const char* const FOLDERS[] = {"ux0:pkgj/pkg", "uma0:pkgj/pkg"};
+constexpr char PACKAGE_EXTENSION[] = ".pkg";
+constexpr char DIGEST_EXTENSION[] = ".sha256";
+
+constexpr uint32_t READ_SIZE = 256 * 1024;
+}
+
+PeerCache::PeerCache() : _cond("peer_cache_cond")
+{
+    _id = fmt::format("{:x}", pkgi_time_usec());
+    LOGF("peer cache {} started", _id);
+
+    _scan_thread = std::make_unique<Thread>(
+            "peer_scan", [this] { run_scan(); }, ThreadRole::Background);
+    _announce_thread = std::make_unique<Thread>(
+            "peer_announce",
+            [this] { run_announce(); },
+            ThreadRole::Background);
+}
+
+PeerCache::~PeerCache()
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+    }
+    _cond.notify_all();
+    _scan_thread->join();
+    _announce_thread->join();
+    _server.reset();
+    if (_udp >= 0)
+        pkgi_socket_close(_udp);
+}
+
+std::string PeerCache::keep_path(
+        const std::string& partition, const std::string& content)
+{
+    return fmt::format(
+            "{}pkgj/pkg/{}{}", partition, content, PACKAGE_EXTENSION);
+}
+
+bool PeerCache::is_dying()
+{
+    ScopeLock _(_cond.get_mutex());
+    return _dying;
+}
+
+bool PeerCache::sleep(uint32_t ms)
+{
+    const uint32_t until = pkgi_time_msec() + ms;
+    while (static_cast<int32_t>(until - pkgi_time_msec()) > 0)
+    {
+        if (is_dying())
+            return false;
+        pkgi_sleep(100);
+    }
+    return !is_dying();
+}
+
+std::string PeerCache::find(
+        const std::string& content, const std::vector<uint8_t>& digest)
+{
+    const auto hex = pkgi_tohex(digest);
+    const auto now = pkgi_time_msec();
+
+    ScopeLock _(_cond.get_mutex());
+    const auto peers = _peers.find(content);
+    if (peers == _peers.end())
+        return {};
+    for (const auto& peer : peers->second)
+        if (peer.digest == hex && now - peer.seen < PEER_TIMEOUT_MS)
+            return fmt::format(
+                    "http://{}:{}/{}{}",
+                    peer.ip,
+                    peer.port,
+                    content,
+                    PACKAGE_EXTENSION);
+    return {};
+}
+
+void PeerCache::add(
+        const std::string& path,
+        const std::string& content,
+        const std::vector<uint8_t>& digest)
+{
+    const auto size = pkgi_get_size(path.c_str());
+    if (size < 0)
+        return;
+    const auto hex = pkgi_tohex(digest);
+    pkgi_save(path + DIGEST_EXTENSION, hex.data(), hex.size());
+    {
+        ScopeLock _(_cond.get_mutex());
+        _packages[content] = Package{path, static_cast<uint64_t>(size), hex};
+    }
+    LOGF("sharing {} with the peers", content);
+}
+
+void PeerCache::run_announce()
+{
+    // both wait for the network
+    _server = std::make_unique<FileServer>(
+            "peer_serve", HTTP_PORT, [this](const std::string& target) {
+                return resolve(target);
+            });
+    _udp = pkgi_udp_open_multicast(GROUP, ANNOUNCE_PORT);
+    if (_udp < 0)
+    {
+        LOG("can't open the peer socket, the packages aren't announced");
+        return;
+    }
+    LOGF("announcing on {}:{}, serving on {}", GROUP, ANNOUNCE_PORT, HTTP_PORT);
+
+    uint32_t next_announce = pkgi_time_msec();
+    std::vector<char> datagram(MAX_DATAGRAM);
+    while (!is_dying())
+    {
+        if (static_cast<int32_t>(pkgi_time_msec() - next_announce) >= 0)
+        {
+            announce();
+            next_announce = pkgi_time_msec() + ANNOUNCE_INTERVAL_MS;
+        }
+
+        // short, so that the cache doesn't take long to stop
+        std::string from;
+        const auto size = pkgi_udp_receive(
+                _udp, datagram.data(), datagram.size(), 500, from);
+        if (size > 0)
+            receive(from, std::string(datagram.data(), size));
+    }
+}
+
+void PeerCache::announce()
+{
+    const auto header = fmt::format(
+            "{} {} {} {}\n", ANNOUNCE_MAGIC, ANNOUNCE_VERSION, _id, HTTP_PORT);
+    std::vector<std::string> datagrams;
+    {
+        ScopeLock _(_cond.get_mutex());
+        std::string datagram = header;
+        for (const auto& package : _packages)
+        {
+            const auto line = fmt::format(
+                    "{} {} {}\n",
+                    package.first,
+                    package.second.size,
+                    package.second.digest);
+            if (datagram.size() + line.size() > MAX_DATAGRAM)
+            {
+                datagrams.push_back(std::move(datagram));
+                datagram = header;
+            }
+            datagram += line;
+        }
+        if (datagram.size() > header.size())
+            datagrams.push_back(std::move(datagram));
+    }
+
+    for (const auto& datagram : datagrams)
+        if (!pkgi_udp_send(
+                    _udp,
+                    GROUP,
+                    ANNOUNCE_PORT,
+                    datagram.data(),
+                    datagram.size()))
+            LOG("failed to announce the shared packages");
+}
+
+void PeerCache::receive(const std::string& from, const std::string& datagram)
+{
+    std::istringstream lines(datagram);
+    std::string magic;
+    uint32_t version = 0;
+    std::string id;
+    uint32_t port = 0;
+    lines >> magic >> version >> id >> port;
+    if (!lines || magic != ANNOUNCE_MAGIC || version != ANNOUNCE_VERSION ||
+        id == _id || port == 0 || port > 0xffff)
+        return;
+
+    const auto now = pkgi_time_msec();
+    std::string content;
+    uint64_t size;
+    std::string digest;
+    ScopeLock _(_cond.get_mutex());
+    while (lines >> content >> size >> digest)
+    {
+        auto& peers = _peers[content];
+        auto peer = std::find_if(peers.begin(), peers.end(), [&](auto& peer) {
+            return peer.ip == from;
+        });
+        if (peer == peers.end())
+        {
+            LOGF("peer {} has {}", from, content);
+            peer = peers.insert(peers.end(), Peer{from, 0, {}, 0});
+        }
+        peer->port = static_cast<uint16_t>(port);
+        peer->digest = digest;
+        peer->seen = now;
+    }
+}
+
+FileServer::Reply PeerCache::resolve(const std::string& target)
+{
+    auto content = target.substr(1);
+    if (!ends_with(content, PACKAGE_EXTENSION))
+        return {};
+    content.erase(content.size() - strlen(PACKAGE_EXTENSION));
+
+    ScopeLock _(_cond.get_mutex());
+    const auto it = _packages.find(content);
+    if (it == _packages.end())
+        return {};
+    return {it->second.path};
+}
+
+void PeerCache::run_scan()
+{
+    do
+    {
+        for (const auto folder : FOLDERS)
+            scan(folder);
+    } while (sleep(ANNOUNCE_INTERVAL_MS));
+}
+
+void PeerCache::scan(const std::string& folder)
+{
+    if (!pkgi_file_exists(folder))
+        return;
+
+    for (const auto& name : pkgi_list_dir_contents(folder))
+    {
+        if (!ends_with(name, PACKAGE_EXTENSION) || is_dying())
+            continue;
+        const auto content =
+                name.substr(0, name.size() - strlen(PACKAGE_EXTENSION));
+        const auto path = fmt::format("{}/{}", folder, name);
+        const auto size = pkgi_get_size(path.c_str());
+        if (size < 0)
+            continue;
+        {
+            ScopeLock _(_cond.get_mutex());
+            const auto it = _packages.find(content);
+            if (it != _packages.end() && it->second.path == path &&
+                it->second.size == static_cast<uint64_t>(size))
+                continue;
+        }
+
+        // the digest is known when it was saved after this size, else the
+        // package is hashed once
+        std::string digest;
+        const auto digest_path = path + DIGEST_EXTENSION;
+        if (pkgi_file_exists(digest_path) &&
+            pkgi_get_mtime(digest_path) >= pkgi_get_mtime(path))
+        {
+            const auto saved = pkgi_load(digest_path);
+            digest.assign(saved.begin(), saved.end());
+        }
+        if (digest.size() != SHA256_DIGEST_SIZE * 2)
+        {
+            LOGF("hashing {} to share it", path);
+            digest = hash(path);
+            if (digest.empty())
+                continue;
+            pkgi_save(digest_path, digest.data(), digest.size());
+        }
+
+        ScopeLock _(_cond.get_mutex());
+        _packages[content] =
+                Package{path, static_cast<uint64_t>(size), std::move(digest)};
+    }
+}
+
+std::string PeerCache::hash(const std::string& path)
+{
+    const auto f = pkgi_open(path.c_str());
+    if (!f)
+        return {};
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        pkgi_close(f);
+    };
+
+    try
+    {
+        sha256_ctx sha;
+        sha256_init(&sha);
+        std::vector<uint8_t> data(READ_SIZE);
+        while (true)
+        {
+            if (is_dying())
+                return {};
+            const auto read = pkgi_read(f, data.data(), data.size());
+            if (read <= 0)
+                break;
+            sha256_update(&sha, data.data(), read);
+        }
+        std::vector<uint8_t> digest(SHA256_DIGEST_SIZE);
+        sha256_finish(&sha, digest.data());
+        return pkgi_tohex(digest);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to hash {}: {}", path, e.what());
+        return {};
+    }
+}
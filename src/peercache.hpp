@@ -0,0 +1,103 @@
+#pragma once
+
+#include "fileserver.hpp"
+#include "thread.hpp"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+// Shares the packages kept on the card with the other PKGj on the LAN, so
+// that a package crosses the internet once per network. The packages of
+// pkgj/pkg on ux0: and uma0: are hashed once, their digest is kept next to
+// them in <package>.sha256, and announced by multicast on the group of the
+// debug log with their content id and digest. A FileServer serves them, and
+// find() gives the url of a peer that announced a
+// package with the digest a download expects. The download checks the
+// digest at its end anyway, a peer can't get a damaged package installed.
+class PeerCache
+{
+public:
+    static constexpr const char* GROUP = "239.255.0.100";
+    static constexpr uint16_t ANNOUNCE_PORT = 30001;
+    static constexpr uint16_t HTTP_PORT = 30002;
+    static constexpr uint32_t ANNOUNCE_INTERVAL_MS = 10 * 1000;
+    // a peer that wasn't heard of for this long is forgotten
+    static constexpr uint32_t PEER_TIMEOUT_MS = 35 * 1000;
+
+    PeerCache(const PeerCache&) = delete;
+    PeerCache(PeerCache&&) = delete;
+    PeerCache& operator=(const PeerCache&) = delete;
+    PeerCache& operator=(PeerCache&&) = delete;
+
+    PeerCache();
+    ~PeerCache();
+
+    // where a download keeps its package to share it
+    static std::string keep_path(
+            const std::string& partition, const std::string& content);
+
+    // the url of a peer that has the package with this digest, empty when
+    // none has it
+    std::string find(
+            const std::string& content, const std::vector<uint8_t>& digest);
+    // the package at path was checked against digest, it's shared from now
+    // on without being hashed again
+    void add(
+            const std::string& path,
+            const std::string& content,
+            const std::vector<uint8_t>& digest);
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    struct Package
+    {
+        std::string path;
+        uint64_t size;
+        // hex
+        std::string digest;
+    };
+
+    struct Peer
+    {
+        std::string ip;
+        uint16_t port;
+        std::string digest;
+        uint32_t seen;
+    };
+
+    Cond _cond;
+    bool _dying = false;
+    // tells our announcements from the others'
+    std::string _id;
+    // by content id
+    std::unordered_map<std::string, Package> _packages;
+    std::unordered_map<std::string, std::vector<Peer>> _peers;
+
+    // opened by the announce thread, the network may not be up yet when
+    // the cache starts
+    int _udp = -1;
+    std::unique_ptr<FileServer> _server;
+    std::unique_ptr<Thread> _announce_thread;
+    std::unique_ptr<Thread> _scan_thread;
+
+    bool is_dying();
+    // false when the cache is dying
+    bool sleep(uint32_t ms);
+
+    void run_announce();
+    void announce();
+    void receive(const std::string& from, const std::string& datagram);
+
+    FileServer::Reply resolve(const std::string& target);
+
+    void run_scan();
+    void scan(const std::string& folder);
+    // empty when canceled or the file couldn't be read
+    std::string hash(const std::string& path);
+};
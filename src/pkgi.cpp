@@ -11,11 +11,32 @@ extern "C"
 #include "dialog.hpp"
 #include "download.hpp"
 #include "downloader.hpp"
+#include "downloadhistory.hpp"
+#include "downloadschedule.hpp"
+#include "file.hpp"
 #include "gameview.hpp"
+#include "httptrace.hpp"
+#include "iconcache.hpp"
 #include "imgui.hpp"
 #include "install.hpp"
+#include "manifest.hpp"
+#include "memorybudget.hpp"
+#include "memstats.hpp"
 #include "menu.hpp"
+#include "packageverifier.hpp"
+#include "patchinfocache.hpp"
+#include "peercache.hpp"
+#include "presencescanner.hpp"
+#include "storageprobe.hpp"
+#include "taskpool.hpp"
+#include "textwidths.hpp"
+#include "titlemetadata.hpp"
+#include "thread.hpp"
+#include "trace.hpp"
+#include "trash.hpp"
+#include "uievents.hpp"
 #include "update.hpp"
+#include "updatechecker.hpp"
 #include "utils.hpp"
 #include "vitahttp.hpp"
 #include "zrif.hpp"
@@ -26,11 +47,24 @@ extern "C"
 
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
 #include <memory>
+#include <optional>
 #include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <cstddef>
 #include <cstring>
+#include <ctime>
 
 #define PKGI_UPDATE_URL \
     "https://api.github.com/repos/guch8017/pkgj/releases/latest"
@@ -51,6 +85,8 @@ uint32_t first_item;
 uint32_t selected_item;
 
 int search_active;
+// the text input is for a search in all the lists
+bool search_all_active;
 
 Config config;
 Config config_temp;
@@ -64,17 +100,135 @@ char error_state[256];
 
 // used for multiple things actually
 Mutex refresh_mutex("refresh_mutex");
+// held by the refresh while it runs, the one from the menu and the one in
+// the background don't update the lists at the same time
+Mutex refresh_running_mutex("refresh_running_mutex");
+// of the background refresh, started by pkgi_check_background_refresh
+std::atomic<bool> background_refreshing{false};
+uint32_t background_refresh_time = 0;
+bool background_refresh_done = false;
 std::string current_action;
 std::unique_ptr<TitleDatabase> db;
+// opened on first use, by the refresh or the game view, which most starts
+// never reach
+Mutex comppack_db_mutex("comppack_db_mutex");
 std::unique_ptr<CompPackDatabase> comppack_db_games;
 std::unique_ptr<CompPackDatabase> comppack_db_updates;
 
 std::set<std::string> installed_games;
-std::set<std::string> installed_themes;
+
+CompPackDatabase& pkgi_comppack_db(bool updates)
+{
+    std::lock_guard<Mutex> lock(comppack_db_mutex);
+    auto& comppack_db = updates ? comppack_db_updates : comppack_db_games;
+    if (!comppack_db)
+        comppack_db = std::make_unique<CompPackDatabase>(fmt::format(
+                "{}/{}",
+                pkgi_get_config_folder(),
+                updates ? "comppack_updates.db" : "comppack.db"));
+    return *comppack_db;
+}
+
+// runs the short jobs below, declared first so that it outlives them
+std::unique_ptr<TaskPool> task_pool;
+
+std::atomic<pkgi_texture> background_texture{nullptr};
+
+// null when config.icon_cache_kb is 0
+std::unique_ptr<IconCache> icons;
+// serial of the icons drawn in the last frame
+uint32_t icon_serial;
+
+// the presence of the rows is looked up in the last snapshot of the scanner,
+// rows stay unknown until the first one is there
+std::unique_ptr<PresenceScanner> presence_scanner;
+std::shared_ptr<const PresenceSnapshot> presence;
+// contents whose row is looked up again once the snapshot with serial
+// refresh_serial is there
+std::vector<std::string> contents_to_refresh;
+uint32_t refresh_serial = 0;
+// walked again with the installed games of each snapshot
+std::unique_ptr<TitleMetadataCache> title_metadata;
+std::unique_ptr<PatchInfoCache> patch_info_cache;
+// the downloads that ended, also in previous runs
+std::unique_ptr<DownloadHistory> download_history;
+// the queue is paused outside of the schedule, checked once a second
+DownloadSchedule download_schedule;
+bool downloads_paused = false;
+uint32_t schedule_check_time = 0;
+// checks the installed games while the updates filter is on, the games whose
+// patch is newer than the installed version are kept in updatable_games
+std::unique_ptr<UpdateChecker> update_checker;
+std::set<std::string> updatable_games;
+uint32_t updates_serial = 0;
+uint32_t updates_metadata_serial = 0;
+// hands the LiveArea downloads over without stalling the UI
+std::unique_ptr<BgdlQueue> bgdl_queue;
+// shares the downloaded packages with the other PKGj on the LAN
+std::unique_ptr<PeerCache> peer_cache;
+// the requests of the downloads when record_http is set
+std::unique_ptr<HttpTraceWriter> http_trace;
+// shares memory_budget_kb between the caches and the downloads
+std::unique_ptr<MemoryBudget> memory_budget;
+// sizes the write-behind buffers after the cards when write_buffer_kb is 0
+std::unique_ptr<StorageProbe> storage_probe;
+// a package is verified at a time, its result is shown once it's over
+std::unique_ptr<PackageVerifier> verifier;
+std::string verified_name;
+
+// reloads are prepared by reload_thread while the current list stays shown,
+// a newer request makes the one in flight stale
+struct ReloadRequest
+{
+    Mode mode;
+    uint32_t filter;
+    DbSort sort;
+    DbSortOrder order;
+    std::string search;
+    std::set<std::string> installed_games;
+    std::set<std::string> updatable_games;
+};
+
+Cond reload_cond("reload_cond");
+std::optional<ReloadRequest> reload_request;
+std::shared_ptr<TitleDatabase::View> reload_result;
+// serial of the last request, and of the last view shown
+std::atomic<uint32_t> reload_serial{0};
+uint32_t shown_serial = 0;
+uint32_t result_serial = 0;
 
 std::unique_ptr<GameView> gameview;
-bool need_refresh = true;
-std::string content_to_refresh;
+// posted to by the downloader and the reload thread
+UiEvents ui_events;
+
+// frames drawn at full rate after the last input, for the scrolling and the
+// key repeat to settle
+constexpr uint32_t ACTIVE_FRAMES_AFTER_INPUT = 30;
+// when nothing else asks for a frame, the progress of a download is redrawn
+// this often, and the screen at all this often, which also shows what the
+// background threads finished
+constexpr uint32_t PROGRESS_FRAME_MSEC = 250;
+constexpr uint32_t IDLE_FRAME_MSEC = 1000;
+uint32_t active_frames = 0;
+uint32_t last_frame_time = 0;
+
+// the ARM clock follows the work, see pkgi_govern_clock. In MHz, 0 until the
+// first decision
+constexpr uint32_t CLOCK_IDLE_MHZ = 222;
+constexpr uint32_t CLOCK_NORMAL_MHZ = 333;
+constexpr uint32_t CLOCK_HIGH_MHZ = 444;
+constexpr uint32_t GOVERNOR_INTERVAL_MSEC = 1000;
+// the UI stays smooth this long after the last input
+constexpr uint32_t GOVERNOR_INTERACTIVE_MSEC = 3000;
+// a lower clock is only taken after this many intervals in a row asking for
+// it, so that the pauses between two files don't make it go up and down
+constexpr uint32_t GOVERNOR_LOWER_AFTER = 3;
+uint32_t clock_mhz = 0;
+uint32_t governor_time = 0;
+uint32_t governor_input_time = 0;
+uint32_t governor_lower_count = 0;
+// the CPU stages time of each job at the last decision
+std::array<uint64_t, Downloader::MAX_JOBS> governor_cpu_usec{};
 
 void pkgi_reload();
 
@@ -130,29 +284,104 @@ BgdlType mode_to_bgdl_type(Mode mode)
     }
 }
 
-void configure_db(TitleDatabase* db, const char* search, const Config* config)
+// the rows of these modes go to the LiveArea downloads, not to the downloader
+bool mode_uses_bgdl(Mode mode)
+{
+    return mode == ModeGames || mode == ModeDlcs || mode == ModeDemos ||
+           mode == ModeThemes;
+}
+
+void configure_db(const char* search, const Config* config)
 {
-    try
     {
-        db->reload(
+        std::lock_guard<Mutex> lock(reload_cond.get_mutex());
+        reload_request = ReloadRequest{
                 mode,
                 mode == ModeGames || mode == ModeDlcs
                         ? config->filter
-                        : config->filter & ~DbFilterInstalled,
+                        : config->filter &
+                                  ~(DbFilterInstalled | DbFilterUpdates),
                 config->sort,
                 config->order,
                 search ? search : "",
-                installed_games);
+                installed_games,
+                updatable_games,
+        };
+        ++reload_serial;
     }
-    catch (const std::exception& e)
+    reload_cond.notify_all();
+}
+
+void pkgi_reload_thread()
+{
+    while (true)
     {
-        snprintf(
-                error_state,
-                sizeof(error_state),
-                "无法重新加载列表: %s",
-                e.what());
-        pkgi_dialog_error(error_state);
+        ReloadRequest request;
+        uint32_t serial;
+        {
+            std::lock_guard<Mutex> lock(reload_cond.get_mutex());
+            while (!reload_request)
+                reload_cond.wait();
+            request = std::move(*reload_request);
+            reload_request = std::nullopt;
+            serial = reload_serial;
+        }
+
+        try
+        {
+            auto view = db->prepare(
+                    request.mode,
+                    request.filter,
+                    request.sort,
+                    request.order,
+                    request.search,
+                    request.installed_games,
+                    request.updatable_games,
+                    [serial] { return reload_serial != serial; });
+
+            std::lock_guard<Mutex> lock(reload_cond.get_mutex());
+            if (view && reload_serial == serial)
+            {
+                reload_result = std::move(view);
+                result_serial = serial;
+                ui_events.post(UiEvent{UiEventType::CatalogReady});
+            }
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("error during reload: {}", e.what());
+            pkgi_dialog_error(
+                    fmt::format("无法重新加载列表: {}", e.what()).c_str());
+
+            // the request is over, the previous list stays shown
+            std::lock_guard<Mutex> lock(reload_cond.get_mutex());
+            if (reload_serial == serial)
+                shown_serial = serial;
+        }
+    }
+}
+
+bool pkgi_reload_pending()
+{
+    std::lock_guard<Mutex> lock(reload_cond.get_mutex());
+    return shown_serial != reload_serial;
+}
+
+void reposition(void);
+
+// called by the main loop, swaps in the last prepared list
+void pkgi_show_reload()
+{
+    std::shared_ptr<TitleDatabase::View> view;
+    {
+        std::lock_guard<Mutex> lock(reload_cond.get_mutex());
+        if (!reload_result)
+            return;
+        view = std::move(reload_result);
+        shown_serial = result_serial;
     }
+    db->show(std::move(view));
+    reposition();
 }
 
 std::string const& pkgi_get_url_from_mode(Mode mode)
@@ -180,59 +409,199 @@ std::string const& pkgi_get_url_from_mode(Mode mode)
             fmt::format("未知模式: {}", static_cast<int>(mode)));
 }
 
-void pkgi_refresh_thread(void)
+namespace
 {
-    LOG("starting update");
-    try
+// the lists are small and their fetch is mostly latency, so they are fetched
+// side by side, leaving the other http slots to the downloader
+static constexpr size_t REFRESH_CONNECTIONS = 4;
+
+struct RefreshJob
+{
+    std::string name;
+    std::function<void()> run;
+    // the list of one of several repositories, the refresh goes on with its
+    // last copy when it fails
+    bool may_fail = false;
+    bool running = false;
+};
+}
+
+// fetches every list and the compatibility packs, connections of them at
+// once, and returns the modes whose list changed. Throws on the first
+// failure, must be called with refresh_running_mutex locked
+std::array<bool, ModeCount> pkgi_refresh_lists(size_t connections)
+{
+    std::vector<RefreshJob> jobs;
+    // each job only writes the flag of its own mode
+    std::array<bool, ModeCount> changed{};
+    // with several repositories, each list is fetched from all of them
+    // and they are merged once fetched
+    const int repos = config.multi_repo ? config.repo_list.size() : 0;
+    std::vector<std::array<bool, ModeCount>> repo_changed(repos);
+    for (int i = 0; i < ModeCount; ++i)
     {
-        ScopeProcessLock lock;
-        for (int i = 0; i < ModeCount; ++i)
+        const auto mode = static_cast<Mode>(i);
+        auto const url = pkgi_get_url_from_mode(mode);
+        if (url.empty())
+            continue;
+        if (repos > 1)
         {
-            const auto mode = static_cast<Mode>(i);
-            auto const url = pkgi_get_url_from_mode(mode);
-            if (url.empty())
-                continue;
-            {
-                std::lock_guard<Mutex> lock(refresh_mutex);
-                current_action = fmt::format(
-                        "正在刷新 {} [{}/{}]",
-                        pkgi_mode_to_string(mode),
-                        i + 1,
-                        ModeCount + 2);
-            }
-            auto const http = std::make_unique<VitaHttp>();
-            db->update(mode, http.get(), url);
+            for (int repo = 0; repo < repos; ++repo)
+                jobs.push_back(
+                        {fmt::format(
+                                 "{} ({})",
+                                 pkgi_mode_to_string(mode),
+                                 repo + 1),
+                         [mode,
+                          repo,
+                          url = pkgi_repo_list_url(
+                                  config.repo_list[repo], mode),
+                          &repo_changed] {
+                             repo_changed[repo][mode] = db->update(
+                                     mode,
+                                     [] {
+                                         return std::make_unique<
+                                                 VitaHttp>();
+                                     },
+                                     url,
+                                     repo);
+                         },
+                         true});
+            continue;
         }
-        if (!config.comppack_url.empty())
+        jobs.push_back(
+                {pkgi_mode_to_string(mode), [mode, url, &changed] {
+                     changed[mode] = db->update(
+                             mode,
+                             [] { return std::make_unique<VitaHttp>(); },
+                             url);
+                 }});
+    }
+    if (!config.comppack_url.empty())
+    {
+        jobs.push_back({"游戏本体兼容包", [] {
+                            VitaHttp http;
+                            pkgi_comppack_db(false).update(
+                                    &http,
+                                    config.comppack_url + "entries.txt");
+                        }});
+        jobs.push_back({"游戏更新兼容包", [] {
+                            VitaHttp http;
+                            pkgi_comppack_db(true).update(
+                                    &http,
+                                    config.comppack_url +
+                                            "entries_patch.txt");
+                        }});
+    }
+
+    db->reset_update_status();
+
+    size_t next = 0;
+    size_t done = 0;
+    std::exception_ptr error;
+
+    // must be called with refresh_mutex locked
+    const auto update_action = [&] {
+        std::string names;
+        for (const auto& job : jobs)
+            if (job.running)
+                names += (names.empty() ? "" : ", ") + job.name;
+        current_action = fmt::format(
+                "正在刷新 {} [{}/{}]", names, done, jobs.size());
+    };
+
+    const auto worker = [&] {
+        while (true)
         {
+            RefreshJob* job;
             {
                 std::lock_guard<Mutex> lock(refresh_mutex);
-                current_action = fmt::format(
-                        "正在刷新 游戏本体兼容包 [{}/{}]",
-                        ModeCount + 2 - 1,
-                        ModeCount + 2);
-            }
-            {
-                auto const http = std::make_unique<VitaHttp>();
-                comppack_db_games->update(
-                        http.get(), config.comppack_url + "entries.txt");
+                // the first failure stops the refresh
+                if (next == jobs.size() || error)
+                    return;
+                job = &jobs[next++];
+                job->running = true;
+                update_action();
             }
+
+            std::exception_ptr job_error;
+            try
             {
-                std::lock_guard<Mutex> lock(refresh_mutex);
-                current_action = fmt::format(
-                        "正在刷新 游戏更新兼容包 [{}/{}]",
-                        ModeCount + 2,
-                        ModeCount + 2);
+                job->run();
             }
+            catch (const std::exception& e)
             {
-                auto const http = std::make_unique<VitaHttp>();
-                comppack_db_updates->update(
-                        http.get(), config.comppack_url + "entries_patch.txt");
+                LOGF("failed to refresh {}: {}", job->name, e.what());
+                job_error = std::current_exception();
             }
+
+            std::lock_guard<Mutex> lock(refresh_mutex);
+            job->running = false;
+            ++done;
+            if (job_error && !error && !job->may_fail)
+                error = job_error;
+            update_action();
+        }
+    };
+
+    {
+        std::vector<std::unique_ptr<Thread>> workers;
+        for (size_t i = 0; i < std::min(connections, jobs.size());
+             ++i)
+            workers.push_back(std::make_unique<Thread>(
+                    fmt::format("refresh_{}", i),
+                    worker,
+                    ThreadRole::Network));
+        for (auto& worker : workers)
+            worker->join();
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+
+    if (repos > 1)
+    {
+        {
+            std::lock_guard<Mutex> lock(refresh_mutex);
+            current_action = "正在合并列表";
+        }
+        for (int i = 0; i < ModeCount; ++i)
+        {
+            const auto mode = static_cast<Mode>(i);
+            if (pkgi_get_url_from_mode(mode).empty())
+                continue;
+            changed[mode] = db->merge(
+                    mode,
+                    repos,
+                    std::any_of(
+                            repo_changed.begin(),
+                            repo_changed.end(),
+                            [&](const auto& flags) {
+                                return flags[mode];
+                            }));
+        }
+    }
+
+    return changed;
+}
+
+void pkgi_refresh_thread(void)
+{
+    LOG("starting update");
+    try
+    {
+        ScopeProcessLock lock;
+        // a background refresh is let to end first
+        std::lock_guard<Mutex> running(refresh_running_mutex);
+        const auto changed = pkgi_refresh_lists(REFRESH_CONNECTIONS);
+
+        // an unchanged list doesn't need to be parsed again
+        if (changed[mode])
+        {
+            first_item = 0;
+            selected_item = 0;
+            configure_db(NULL, &config);
         }
-        first_item = 0;
-        selected_item = 0;
-        configure_db(db.get(), NULL, &config);
     }
     catch (const std::exception& e)
     {
@@ -246,6 +615,54 @@ void pkgi_refresh_thread(void)
     state = StateMain;
 }
 
+// the lists are fetched one at a time on the lowest priority thread, while
+// the current ones stay shown, and only swapped in by the main loop
+void pkgi_background_refresh_thread(void)
+{
+    LOG("starting background update");
+    try
+    {
+        std::lock_guard<Mutex> running(refresh_running_mutex);
+        const auto changed = pkgi_refresh_lists(1);
+
+        UiEvent event{UiEventType::CatalogChanged};
+        for (int i = 0; i < ModeCount; ++i)
+            if (changed[i])
+                event.modes |= 1 << i;
+        ui_events.post(std::move(event));
+    }
+    catch (const std::exception& e)
+    {
+        // the next one may do better, the lists in use are still there
+        LOGF("background update failed: {}", e.what());
+    }
+    background_refreshing = false;
+}
+
+// called by the main loop, starts a background refresh at launch or once
+// refresh_interval_minutes passed, when nothing else uses the network
+void pkgi_check_background_refresh(Downloader& downloader)
+{
+    const bool due =
+            (config.refresh_on_launch && !background_refresh_done) ||
+            (config.refresh_interval_minutes > 0 &&
+             pkgi_time_msec() - background_refresh_time >=
+                     uint32_t(config.refresh_interval_minutes) * 60 * 1000);
+    if (!due || state != StateMain || background_refreshing)
+        return;
+
+    bool busy = downloader.get_install_status().stage != DownloadStage::Idle;
+    for (size_t i = 0; i < Downloader::MAX_JOBS && !busy; ++i)
+        busy = downloader.get_status(i).stage != DownloadStage::Idle;
+    if (busy)
+        return;
+
+    background_refresh_done = true;
+    background_refresh_time = pkgi_time_msec();
+    background_refreshing = true;
+    pkgi_start_thread("background_refresh", &pkgi_background_refresh_thread);
+}
+
 const char* pkgi_get_mode_partition()
 {
     return mode == ModePspGames || mode == ModePsxGames
@@ -253,34 +670,178 @@ const char* pkgi_get_mode_partition()
                    : "ux0:";
 }
 
-void pkgi_refresh_installed_packages()
+// the installed games are only sent to the update server once the updates
+// filter is asked for
+void pkgi_check_updates(uint32_t filter)
 {
-    auto games = pkgi_get_installed_games();
-    installed_games.clear();
-    installed_games.insert(
-            std::make_move_iterator(games.begin()),
-            std::make_move_iterator(games.end()));
+    if (!(filter & DbFilterUpdates) || !presence)
+        return;
+    update_checker->check(std::vector<std::string>(
+            presence->games.begin(), presence->games.end()));
+}
 
-    auto themes = pkgi_get_installed_themes();
-    installed_themes.clear();
-    installed_themes.insert(
-            std::make_move_iterator(themes.begin()),
-            std::make_move_iterator(themes.end()));
+// called by the main loop, swaps in the last scan of the memory card
+void pkgi_show_presence()
+{
+    if (presence_scanner->serial() == (presence ? presence->serial : 0))
+        return;
+
+    presence = presence_scanner->snapshot();
+    installed_games = std::set<std::string>(
+            presence->games.begin(), presence->games.end());
+    title_metadata->walk(std::vector<std::string>(
+            presence->games.begin(), presence->games.end()));
+    pkgi_check_updates(config.filter);
+
+    if (presence->serial < refresh_serial)
+        return;
+    for (const auto& content : contents_to_refresh)
+    {
+        const auto item = db->get_by_content(content.c_str());
+        if (item)
+            item->presence = PresenceUnknown;
+        else
+            LOGF("couldn't find {} for refresh", content);
+    }
+    contents_to_refresh.clear();
 }
 
-bool pkgi_is_installed(const char* titleid)
+// called by the main loop, only the rows and the game view the events are
+// about are updated
+void pkgi_handle_events()
 {
-    return installed_games.find(titleid) != installed_games.end();
+    for (auto& event : ui_events.drain())
+    {
+        if (event.type == UiEventType::CatalogReady)
+        {
+            pkgi_show_reload();
+            continue;
+        }
+        if (event.type == UiEventType::CatalogChanged)
+        {
+            // the rows are looked up again in the new list, the position is
+            // kept
+            if (state == StateMain && event.modes & (1 << mode))
+                configure_db(search_active ? search_text : NULL, &config);
+            continue;
+        }
+        if (event.type == UiEventType::Error)
+        {
+            pkgi_dialog_error(event.message.c_str());
+            continue;
+        }
+
+        if (gameview && gameview->get_item()->titleid == event.titleid)
+            gameview->refresh();
+        if (!event.changes_presence)
+            continue;
+        // only the directories the install reported are read again, the
+        // row is looked up again once the scan sees the change
+        refresh_serial =
+                presence_scanner->update(config.install_psp_psx_location);
+        contents_to_refresh.push_back(std::move(event.content));
+    }
 }
 
-bool pkgi_theme_is_installed(std::string contentid)
+// called by the main loop, compares the checked patches with the installed
+// versions
+void pkgi_show_updates()
 {
-    if (contentid.size() < 19)
-        return false;
+    if (update_checker->serial() == updates_serial &&
+        title_metadata->serial() == updates_metadata_serial)
+        return;
+    updates_serial = update_checker->serial();
+    updates_metadata_serial = title_metadata->serial();
+
+    std::set<std::string> updatable;
+    for (const auto& patch : update_checker->patch_versions())
+    {
+        if (!presence || !presence->is_installed(patch.first))
+            continue;
+        // the version of a game that isn't read yet is compared once it is
+        const auto metadata = title_metadata->get(patch.first);
+        if (metadata && !metadata->version.app.empty() &&
+            patch.second > metadata->version.app)
+            updatable.insert(patch.first);
+    }
+    if (updatable == updatable_games)
+        return;
+
+    updatable_games = std::move(updatable);
+    const auto& shown_config = pkgi_menu_is_open() ? config_temp : config;
+    if (shown_config.filter & DbFilterUpdates)
+        configure_db(search_active ? search_text : NULL, &shown_config);
+}
+
+void pkgi_verify_package(const DbItem& item)
+{
+    if (verifier)
+    {
+        pkgi_dialog_error(
+                fmt::format("正在校验 {}, 请稍后再试", verified_name).c_str());
+        return;
+    }
+
+    const std::string partition = pkgi_get_mode_partition();
+    const DownloadItem download{mode_to_type(mode),
+                                item.name,
+                                item.content,
+                                "",
+                                {},
+                                {},
+                                !config.install_psp_as_pbp,
+                                partition};
+    // a package not installed yet is checked in its temporary folder
+    auto folder = pkgi_installed_folder(download);
+    if (folder.empty() || !pkgi_file_exists(folder))
+        folder = fmt::format("{}pkgj/{}", partition, item.content);
+
+    LOGF("[{}] {} - verifying {}", item.content, item.name, folder);
+    verified_name = item.name;
+    verifier = std::make_unique<PackageVerifier>(
+            task_pool.get(),
+            pkgi_manifest_path(partition, item.content),
+            folder);
+}
+
+// called by the main loop, reports the verification once it's over
+void pkgi_show_verification()
+{
+    // the result waits for the dialog in the way
+    if (!verifier || pkgi_dialog_is_open() || !verifier->progress().finished)
+        return;
+
+    static constexpr size_t MAX_SHOWN = 8;
+
+    const auto total = verifier->progress().total;
+    const auto error = verifier->error();
+    const auto damaged = verifier->damaged();
+    verifier.reset();
+
+    if (!error.empty())
+    {
+        pkgi_dialog_error(error.c_str());
+        return;
+    }
+    if (damaged.empty())
+    {
+        pkgi_dialog_message(
+                fmt::format("{}\n{} 个文件校验通过", verified_name, total)
+                        .c_str());
+        return;
+    }
 
-    contentid.erase(16, 3);
-    contentid.erase(0, 7);
-    return installed_themes.find(contentid) != installed_themes.end();
+    auto text = fmt::format(
+            "{}\n{} 个文件中有 {} 个缺失或已损坏:\n",
+            verified_name,
+            total,
+            damaged.size());
+    for (size_t i = 0; i < std::min(damaged.size(), MAX_SHOWN); ++i)
+        text += damaged[i] + "\n";
+    if (damaged.size() > MAX_SHOWN)
+        text += "...\n";
+    text += "可使用修复功能重新下载这些文件";
+    pkgi_dialog_error(text.c_str());
 }
 
 void pkgi_install_package(Downloader& downloader, DbItem* item)
@@ -288,13 +849,135 @@ void pkgi_install_package(Downloader& downloader, DbItem* item)
     if (item->presence == PresenceInstalled)
     {
         LOGF("[{}] {} - already installed", item->content, item->name);
-        pkgi_dialog_error("Already installed");
+        // the LiveArea downloads can't skip what's there
+        if (mode_uses_bgdl(mode))
+        {
+            pkgi_dialog_error("Already installed");
+            return;
+        }
+        pkgi_dialog_question(
+                "已安装, 是否检查文件并重新下载缺失或损坏的文件?\n"
+                "校验只检查文件, 不会下载",
+                {{"修复",
+                  [&downloader, item = *item] {
+                      pkgi_start_download(downloader, item, true);
+                  }},
+                 {"校验", [item = *item] { pkgi_verify_package(item); }},
+                 {"取消", [] {}}});
         return;
     }
 
     pkgi_start_download(downloader, *item);
     item->presence = PresenceUnknown;
 }
+
+// adds item of mode to items, unless its zRIF can't be decoded
+void pkgi_add_bgdl_item(
+        std::vector<BgdlItem>& items, Mode mode, const DbItem& item)
+{
+    BgdlItem bgdl{mode_to_bgdl_type(mode), item.name, item.url, {}};
+    if (!item.zrif.empty())
+    {
+        uint8_t rif[PKGI_PSM_RIF_SIZE];
+        char message[256];
+        if (!pkgi_zrif_decode(item.zrif.c_str(), rif, message, sizeof(message)))
+        {
+            LOGF("[{}] skipped: {}", item.content, message);
+            return;
+        }
+        bgdl.rif.assign(rif, rif + PKGI_PSM_RIF_SIZE);
+    }
+    items.push_back(std::move(bgdl));
+}
+
+// every row of the list that isn't installed goes to LiveArea in one go, a
+// search by title id makes it all the DLCs of a game
+void pkgi_start_bgdl_all()
+{
+    std::vector<BgdlItem> items;
+    for (uint32_t i = 0; i < db->count(); ++i)
+    {
+        const auto item = db->get(i);
+        if (item->presence == PresenceInstalled || item->url.empty())
+            continue;
+        pkgi_add_bgdl_item(items, mode, *item);
+    }
+
+    if (items.empty())
+    {
+        pkgi_dialog_error("列表中没有可下载的内容");
+        return;
+    }
+    const auto count = items.size();
+    bgdl_queue->add(std::move(items));
+    pkgi_dialog_message(
+            fmt::format("已将 {} 项添加至LiveArea下载队列", count).c_str());
+}
+
+namespace
+{
+// from the title tables of the indexes, the other lists aren't loaded
+std::vector<TitleDatabase::SearchHit> pkgi_related_items(
+        const std::string& titleid)
+{
+    try
+    {
+        return db->related(titleid, {ModeDlcs, ModeThemes});
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to find the content of {}: {}", titleid, e.what());
+        return {};
+    }
+}
+
+bool pkgi_related_installed(const TitleDatabase::SearchHit& hit)
+{
+    if (!presence)
+        return false;
+    const auto& content = hit.item.content;
+    return hit.mode == ModeDlcs ? presence->dlc_is_installed(content)
+                                : presence->theme_is_installed(content);
+}
+}
+
+RelatedContent pkgi_related_content(const std::string& titleid)
+{
+    RelatedContent related;
+    for (const auto& hit : pkgi_related_items(titleid))
+    {
+        const bool installed = pkgi_related_installed(hit);
+        if (hit.mode == ModeDlcs)
+        {
+            ++related.dlcs;
+            related.installed_dlcs += installed;
+        }
+        else
+        {
+            ++related.themes;
+            related.installed_themes += installed;
+        }
+    }
+    return related;
+}
+
+void pkgi_start_bgdl_related(const std::string& titleid)
+{
+    std::vector<BgdlItem> items;
+    for (const auto& hit : pkgi_related_items(titleid))
+        if (!pkgi_related_installed(hit) && !hit.item.url.empty())
+            pkgi_add_bgdl_item(items, hit.mode, hit.item);
+
+    if (items.empty())
+    {
+        pkgi_dialog_error("没有可下载的DLC或主题");
+        return;
+    }
+    const auto count = items.size();
+    bgdl_queue->add(std::move(items));
+    pkgi_dialog_message(
+            fmt::format("已将 {} 项添加至LiveArea下载队列", count).c_str());
+}
 void pkgi_psm_enable(Config * configNode)
 {
     if (configNode->psm_readme_disclaimer)
@@ -328,33 +1011,93 @@ void pkgi_reset_all(void)
                         {"确认",[] {pkgi_delete_dir(pkgi_get_config_folder());pkgi_end();exit(0);}},
                     });
 }
-void pkgi_friendly_size(char* text, uint32_t textlen, int64_t size)
+// the last downloads and the average speed of each host, the whole history
+// can be exported for the spreadsheets
+void pkgi_show_history()
 {
-    if (size <= 0)
+    static constexpr size_t SHOWN_RECORDS = 8;
+
+    const auto records = download_history->records();
+    if (records.empty())
     {
-        text[0] = 0;
+        pkgi_dialog_message("暂无下载记录");
+        return;
     }
-    else if (size < 1000LL)
+
+    const auto mbps = [](uint64_t bps) { return bps / (1024.0 * 1024.0); };
+
+    std::string text;
+    for (size_t i = 0; i < std::min(records.size(), SHOWN_RECORDS); ++i)
     {
-        pkgi_snprintf(text, textlen, "%u " PKGI_UTF8_B, (uint32_t)size);
+        const auto& record = records[records.size() - 1 - i];
+        const std::time_t time = record.time;
+        char when[32];
+        std::strftime(when, sizeof(when), "%m-%d %H:%M", std::localtime(&time));
+        text += fmt::format(
+                "{} {} {}\n  {} {:.2f} MB/s (P5 {:.2f}, P95 {:.2f}) 重连{}次\n",
+                when,
+                record.content,
+                record.result == DownloadResult::Done
+                        ? "完成"
+                        : record.result == DownloadResult::Canceled ? "取消"
+                                                                     : "失败",
+                record.host,
+                mbps(record.average),
+                mbps(record.p5),
+                mbps(record.p95),
+                record.reconnects);
     }
-    else if (size < 1000LL * 1000)
+
+    struct HostTotals
     {
-        pkgi_snprintf(text, textlen, "%.2f " PKGI_UTF8_KB, size / 1024.f);
-    }
-    else if (size < 1000LL * 1000 * 1000)
+        uint64_t bytes = 0;
+        uint64_t msec = 0;
+        uint32_t failures = 0;
+    };
+    std::map<std::string, HostTotals> hosts;
+    for (const auto& record : records)
     {
-        pkgi_snprintf(
-                text, textlen, "%.2f " PKGI_UTF8_MB, size / 1024.f / 1024.f);
-    }
-    else
-    {
-        pkgi_snprintf(
-                text,
-                textlen,
-                "%.2f " PKGI_UTF8_GB,
-                size / 1024.f / 1024.f / 1024.f);
+        auto& host = hosts[record.host];
+        host.bytes += record.bytes;
+        host.msec += record.msec;
+        if (record.result == DownloadResult::Failed)
+            ++host.failures;
     }
+    text += "\n";
+    for (const auto& host : hosts)
+        text += fmt::format(
+                "{}: {:.2f} MB/s, 失败{}次\n",
+                host.first,
+                mbps(host.second.msec
+                             ? host.second.bytes * 1000 / host.second.msec
+                             : 0),
+                host.second.failures);
+
+    pkgi_dialog_question(
+            text,
+            {{"导出",
+              [] {
+                  const auto path = fmt::format(
+                          "{}/history_export.tsv", pkgi_get_config_folder());
+                  try
+                  {
+                      download_history->export_to(
+                              path, pkgi_get_system_version());
+                      pkgi_dialog_message(
+                              fmt::format("已导出到 {}", path).c_str());
+                  }
+                  catch (const std::exception& e)
+                  {
+                      pkgi_dialog_error(
+                              fmt::format("导出失败: {}", e.what()).c_str());
+                  }
+              }},
+             {"关闭", [] {}}});
+}
+
+namespace
+{
+TextWidthCache text_widths;
 }
 
 void pkgi_set_mode(Mode set_mode)
@@ -365,21 +1108,288 @@ void pkgi_set_mode(Mode set_mode)
     selected_item = 0;
 }
 
+void pkgi_search_all(const std::string& search)
+{
+    static constexpr size_t MAX_SEARCH_ALL_HITS = 8;
+
+    try
+    {
+        const auto hits = db->search_all(search, MAX_SEARCH_ALL_HITS + 1);
+        const auto base_comppacks = pkgi_comppack_db(false).search(
+                search, MAX_SEARCH_ALL_HITS + 1);
+        const auto patch_comppacks = pkgi_comppack_db(true).search(
+                search, MAX_SEARCH_ALL_HITS + 1);
+
+        // picking a title shows it in its list, the compatibility packs are
+        // only listed
+        std::vector<Response> responses;
+        for (const auto& hit : hits)
+        {
+            if (responses.size() == MAX_SEARCH_ALL_HITS)
+                break;
+            const auto hit_mode = hit.mode;
+            const auto titleid = hit.item.titleid;
+            responses.push_back(Response{
+                    fmt::format("{} {}", titleid, hit.item.name),
+                    [hit_mode, titleid] {
+                        mode = hit_mode;
+                        search_active = 1;
+                        pkgi_strncpy(
+                                search_text,
+                                sizeof(search_text),
+                                titleid.c_str());
+                        configure_db(search_text, &config);
+                        first_item = 0;
+                        selected_item = 0;
+                    }});
+        }
+
+        // the dialog doesn't scroll, so the text only sums up the hits
+        std::array<size_t, ModeCount> mode_hits{};
+        for (size_t i = 0; i < hits.size() && i < MAX_SEARCH_ALL_HITS; ++i)
+            ++mode_hits[hits[i].mode];
+        std::string text = fmt::format(
+                "\"{}\": {}{} 个项目",
+                search,
+                std::min(hits.size(), MAX_SEARCH_ALL_HITS),
+                hits.size() > MAX_SEARCH_ALL_HITS ? "+" : "");
+        for (int i = 0; i < ModeCount; ++i)
+            if (mode_hits[i])
+                text += fmt::format(
+                        "\n{}: {}",
+                        pkgi_mode_to_string(static_cast<Mode>(i)),
+                        mode_hits[i]);
+        if (!base_comppacks.empty() || !patch_comppacks.empty())
+            text += fmt::format(
+                    "\n兼容包: 基础 {}{}, 更新 {}{}",
+                    std::min(base_comppacks.size(), MAX_SEARCH_ALL_HITS),
+                    base_comppacks.size() > MAX_SEARCH_ALL_HITS ? "+" : "",
+                    std::min(patch_comppacks.size(), MAX_SEARCH_ALL_HITS),
+                    patch_comppacks.size() > MAX_SEARCH_ALL_HITS ? "+" : "");
+
+        responses.push_back(Response{"关闭", [] {}});
+        pkgi_dialog_question(text, responses);
+    }
+    catch (const std::exception& e)
+    {
+        pkgi_dialog_error(
+                fmt::format("全局搜索失败: {}", e.what()).c_str());
+    }
+}
+
 void pkgi_refresh_list()
 {
+    // no need for a background one soon after
+    background_refresh_time = pkgi_time_msec();
     state = StateRefreshing;
     pkgi_start_thread("refresh_thread", &pkgi_refresh_thread);
 }
 
+// the icons of the pages above and below the one shown, the nearest rows
+// first, so that they are there when the list scrolls
+// looks the presence of a row up in the last snapshot of the scanner, once
+void pkgi_update_presence(Downloader& downloader, DbItem* item)
+{
+    if (item->presence != PresenceUnknown || !presence)
+        return;
+
+    const std::string partition = pkgi_get_mode_partition();
+    switch (mode)
+    {
+    case ModeGames:
+    case ModeDemos:
+        if (presence->is_installed(item->titleid))
+            item->presence = PresenceInstalled;
+        else if (downloader.is_in_queue(Game, item->content))
+            item->presence = PresenceInstalling;
+        break;
+    case ModePsmGames:
+        if (presence->psm_is_installed(item->titleid))
+            item->presence = PresenceInstalled;
+        else if (downloader.is_in_queue(PsmGame, item->content))
+            item->presence = PresenceInstalling;
+        break;
+    case ModePspDlcs:
+        if (presence->psp_is_installed(partition, item->content))
+            item->presence = PresenceGamePresent;
+        else if (downloader.is_in_queue(PspGame, item->content))
+            item->presence = PresenceInstalling;
+        break;
+    case ModePspGames:
+        if (presence->psp_is_installed(partition, item->content))
+            item->presence = PresenceInstalled;
+        else if (downloader.is_in_queue(PspGame, item->content))
+            item->presence = PresenceInstalling;
+        break;
+    case ModePsxGames:
+        if (presence->psx_is_installed(partition, item->content))
+            item->presence = PresenceInstalled;
+        else if (downloader.is_in_queue(PsxGame, item->content))
+            item->presence = PresenceInstalling;
+        break;
+    case ModeDlcs:
+        if (downloader.is_in_queue(Dlc, item->content))
+            item->presence = PresenceInstalling;
+        else if (presence->dlc_is_installed(item->content))
+            item->presence = PresenceInstalled;
+        else if (presence->is_installed(item->titleid))
+            item->presence = PresenceGamePresent;
+        break;
+    case ModeThemes:
+        if (presence->theme_is_installed(item->content))
+            item->presence = PresenceInstalled;
+        else if (presence->is_installed(item->titleid))
+            item->presence = PresenceGamePresent;
+        break;
+    }
+
+    if (item->presence == PresenceUnknown)
+    {
+        if (presence->is_incomplete(partition, item->content))
+            item->presence = PresenceIncomplete;
+        else
+            item->presence = PresenceMissing;
+    }
+}
+
+// the width left to the name of a row, after its size
+int pkgi_name_width(int col_name, int size_width)
+{
+    return VITA_WIDTH - PKGI_MAIN_SCROLL_WIDTH - PKGI_MAIN_SCROLL_PADDING -
+           PKGI_MAIN_COLUMN_PADDING - size_width - col_name;
+}
+
+namespace
+{
+// Warms the rows the list scrolls towards, so that a page jump finds them
+// ready. The speed of first_item over the last frames tells how many pages
+// the next frames may go through: the icons of those rows are asked of the
+// task pool, and a few of the rows are materialized, looked up and measured
+// after each frame, which can only be done on the thread drawing them. In
+// low memory, a single page is warmed
+class RowPrefetcher
+{
+public:
+    // the most pages warmed in the direction of the scroll, one is always
+    // warmed behind
+    static constexpr uint32_t MAX_PAGES_AHEAD = 4;
+    // frames of scrolling at the current speed warmed ahead
+    static constexpr uint32_t LOOKAHEAD_FRAMES = 30;
+    static constexpr uint32_t ROWS_PER_FRAME = 8;
+
+    // after the rows of the frame are drawn
+    void frame(
+            Downloader& downloader,
+            uint32_t db_count,
+            int col_name,
+            bool show_icons)
+    {
+        const uint32_t page =
+                avail_height / (font_height + PKGI_MAIN_ROW_PADDING);
+        // another list, its rows are new
+        if (shown_serial != _serial)
+        {
+            _serial = shown_serial;
+            _first = UINT32_MAX;
+            _velocity = 0;
+            _pages = 0;
+            _rows.clear();
+        }
+
+        // rows per frame, smoothed over a few frames, a held page key moves
+        // a page every few of them
+        const auto moved = _first == UINT32_MAX
+                                   ? 0.f
+                                   : float(first_item) - float(_first);
+        _velocity = _velocity * 0.75f + moved * 0.25f;
+        if (moved != 0)
+            _forward = moved > 0;
+
+        uint32_t pages = 1;
+        if (!memory_budget || !memory_budget->low_memory())
+            pages = std::clamp<uint32_t>(
+                    1 + std::abs(_velocity) * LOOKAHEAD_FRAMES / page,
+                    1,
+                    MAX_PAGES_AHEAD);
+        if (first_item != _first || pages != _pages)
+        {
+            _first = first_item;
+            _pages = pages;
+            plan(db_count, page, show_icons);
+        }
+
+        for (uint32_t i = 0; i < ROWS_PER_FRAME && !_rows.empty(); ++i)
+        {
+            const auto row = _rows.front();
+            _rows.pop_front();
+            if (row >= db->count())
+                continue;
+            const auto item = db->get(row);
+            pkgi_update_presence(downloader, item);
+            const auto& size = text_widths.size(item->size);
+            text_widths.fit(item->name, pkgi_name_width(col_name, size.width));
+        }
+    }
+
+private:
+    uint32_t _serial = UINT32_MAX;
+    uint32_t _first = UINT32_MAX;
+    float _velocity = 0;
+    bool _forward = true;
+    uint32_t _pages = 0;
+    // left to warm, the nearest first
+    std::deque<uint32_t> _rows;
+
+    void plan(uint32_t db_count, uint32_t page, bool show_icons)
+    {
+        // the pages ahead from the nearest, then the one behind
+        _rows.clear();
+        const auto ahead = _pages * page;
+        for (uint32_t i = 0; i < ahead; ++i)
+        {
+            if (_forward && _first + page + i < db_count)
+                _rows.push_back(_first + page + i);
+            else if (!_forward && i < _first)
+                _rows.push_back(_first - 1 - i);
+        }
+        for (uint32_t i = 0; i < page; ++i)
+        {
+            if (!_forward && _first + page + i < db_count)
+                _rows.push_back(_first + page + i);
+            else if (_forward && i < _first)
+                _rows.push_back(_first - 1 - i);
+        }
+
+        if (!show_icons)
+            return;
+        std::vector<std::string> titleids;
+        titleids.reserve(_rows.size());
+        for (const auto row : _rows)
+            titleids.push_back(db->get(row)->titleid);
+        icons->prefetch(std::move(titleids));
+    }
+};
+
+RowPrefetcher row_prefetcher;
+}
+
 void pkgi_do_main(Downloader& downloader, pkgi_input* input,Config *configNode)
 {
+    TRACE_SCOPE("pkgi_do_main");
     int col_titleid = 0;
-    int col_region = col_titleid + pkgi_text_width("PCSE00000") +
+    int col_region = col_titleid + text_widths.width("PCSE00000") +
                      PKGI_MAIN_COLUMN_PADDING;
     int col_installed =
-            col_region + pkgi_text_width("USA") + PKGI_MAIN_COLUMN_PADDING;
-    int col_name = col_installed + pkgi_text_width(PKGI_UTF8_INSTALLED) +
+            col_region + text_widths.width("USA") + PKGI_MAIN_COLUMN_PADDING;
+    int col_name = col_installed + text_widths.width(PKGI_UTF8_INSTALLED) +
                    PKGI_MAIN_COLUMN_PADDING;
+    // the icons are those of the vita titles, a square of the row height
+    // before the name
+    const bool show_icons =
+            icons && (mode == ModeGames || mode == ModeDemos);
+    const int col_icon = col_name;
+    if (show_icons)
+        col_name += font_height + PKGI_MAIN_COLUMN_PADDING;
 
     uint32_t db_count = db->count();
 
@@ -474,6 +1484,7 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input,Config *configNode)
                             {fmt::format("{}自动更新",configNode->no_version_check?"启用":"禁用").c_str(),[configNode] {configNode->no_version_check=!configNode->no_version_check;pkgi_save_config(*configNode);}},
                             {"启用PSM功能", [configNode] {pkgi_psm_enable(configNode);}},
                             {"清除PKGj缓存",[]{pkgi_reset_all();}},
+                            {"下载记录", [] { pkgi_show_history(); }},
                         });
             return;
         }
@@ -481,6 +1492,11 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input,Config *configNode)
 
     int y = font_height + PKGI_MAIN_HLINE_EXTRA;
     int line_height = font_height + PKGI_MAIN_ROW_PADDING;
+    // a single clip for all the rows, for the last one that is cut, the
+    // names are cut to their column instead of being clipped to it
+    const int list_bottom =
+            VITA_HEIGHT - (2 * font_height + PKGI_MAIN_HLINE_EXTRA);
+    pkgi_clip_set(0, y, VITA_WIDTH, list_bottom - 1 - y);
     for (uint32_t i = first_item; i < db_count; i++)
     {
         DbItem* item = db->get(i);
@@ -489,75 +1505,11 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input,Config *configNode)
 
         const auto titleid = item->titleid.c_str();
 
-        if (item->presence == PresenceUnknown)
-        {
-            switch (mode)
-            {
-            case ModeGames:
-            case ModeDemos:
-                if (pkgi_is_installed(titleid))
-                    item->presence = PresenceInstalled;
-                else if (downloader.is_in_queue(Game, item->content))
-                    item->presence = PresenceInstalling;
-                break;
-            case ModePsmGames:
-                if (pkgi_psm_is_installed(titleid))
-                    item->presence = PresenceInstalled;
-                else if (downloader.is_in_queue(PsmGame, item->content))
-                    item->presence = PresenceInstalling;
-                break;
-            case ModePspDlcs:
-                if (pkgi_psp_is_installed(
-                            pkgi_get_mode_partition(), item->content.c_str()))
-                    item->presence = PresenceGamePresent;
-                else if (downloader.is_in_queue(PspGame, item->content))
-                    item->presence = PresenceInstalling;
-                break;
-            case ModePspGames:
-                if (pkgi_psp_is_installed(
-                            pkgi_get_mode_partition(), item->content.c_str()))
-                    item->presence = PresenceInstalled;
-                else if (downloader.is_in_queue(PspGame, item->content))
-                    item->presence = PresenceInstalling;
-                break;
-            case ModePsxGames:
-                if (pkgi_psx_is_installed(
-                            pkgi_get_mode_partition(), item->content.c_str()))
-                    item->presence = PresenceInstalled;
-                else if (downloader.is_in_queue(PsxGame, item->content))
-                    item->presence = PresenceInstalling;
-                break;
-            case ModeDlcs:
-                if (downloader.is_in_queue(Dlc, item->content))
-                    item->presence = PresenceInstalling;
-                else if (pkgi_dlc_is_installed(item->content.c_str()))
-                    item->presence = PresenceInstalled;
-                else if (pkgi_is_installed(titleid))
-                    item->presence = PresenceGamePresent;
-                break;
-            case ModeThemes:
-                if (pkgi_theme_is_installed(item->content))
-                    item->presence = PresenceInstalled;
-                else if (pkgi_is_installed(titleid))
-                    item->presence = PresenceGamePresent;
-                break;
-            }
-
-            if (item->presence == PresenceUnknown)
-            {
-                if (pkgi_is_incomplete(
-                            pkgi_get_mode_partition(), item->content.c_str()))
-                    item->presence = PresenceIncomplete;
-                else
-                    item->presence = PresenceMissing;
-            }
-        }
+        pkgi_update_presence(downloader, item);
 
-        char size_str[64];
-        pkgi_friendly_size(size_str, sizeof(size_str), item->size);
-        int sizew = pkgi_text_width(size_str);
-
-        pkgi_clip_set(0, y, VITA_WIDTH, line_height);
+        const auto& size_text = text_widths.size(item->size);
+        const char* size_str = size_text.text;
+        int sizew = size_text.width;
 
         if (i == selected_item)
         {
@@ -590,6 +1542,10 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input,Config *configNode)
             break;
         }
         pkgi_draw_text(col_region, y, color, region);
+        if (show_icons)
+            if (const auto icon = icons->get(item->titleid))
+                pkgi_draw_texture_scaled(
+                        icon, col_icon, y, font_height, font_height);
         if (item->presence == PresenceIncomplete)
         {
             pkgi_draw_text(col_installed, y, color, PKGI_UTF8_PARTIAL);
@@ -616,16 +1572,10 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input,Config *configNode)
                 y,
                 color,
                 size_str);
-        pkgi_clip_remove();
 
-        pkgi_clip_set(
-                col_name,
-                y,
-                VITA_WIDTH - PKGI_MAIN_SCROLL_WIDTH - PKGI_MAIN_SCROLL_PADDING -
-                        PKGI_MAIN_COLUMN_PADDING - sizew - col_name,
-                line_height);
-        pkgi_draw_text(col_name, y, color, item->name.c_str());
-        pkgi_clip_remove();
+        const auto& name =
+                text_widths.fit(item->name, pkgi_name_width(col_name, sizew));
+        pkgi_draw_text(col_name, y, color, name.c_str());
 
         y += font_height + PKGI_MAIN_ROW_PADDING;
         if (y > VITA_HEIGHT - (2 * font_height + PKGI_MAIN_HLINE_EXTRA))
@@ -646,6 +1596,10 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input,Config *configNode)
         }
     }
 
+    pkgi_clip_remove();
+
+    row_prefetcher.frame(downloader, db_count, col_name, show_icons);
+
     if (db_count == 0)
     {
         const char* text = "无数据! 请尝试刷新";
@@ -692,9 +1646,13 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input,Config *configNode)
             gameview = std::make_unique<GameView>(
                     &config,
                     &downloader,
+                    title_metadata.get(),
+                    patch_info_cache.get(),
+                    task_pool.get(),
+                    icons.get(),
                     item,
-                    comppack_db_games->get(item->titleid),
-                    comppack_db_updates->get(item->titleid));
+                    pkgi_comppack_db(false).get(item->titleid),
+                    pkgi_comppack_db(true).get(item->titleid));
         else if (mode == ModeThemes || mode == ModeDemos)
         {
             pkgi_start_download(downloader, *item);
@@ -710,6 +1668,22 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input,Config *configNode)
                 pkgi_install_package(downloader, item);
         }
     }
+    else if (input && (input->pressed & PKGI_BUTTON_S))
+    {
+        input->pressed &= ~PKGI_BUTTON_S;
+
+        if (selected_item >= db->count() || mode == ModeGames)
+            return;
+        DbItem* item = db->get(selected_item);
+        // a running download is paused or unpaused, a queued one goes first
+        if (item->presence == PresenceInstalling)
+        {
+            if (!downloader.toggle_pause(mode_to_type(mode), item->content))
+                downloader.prioritize(mode_to_type(mode), item->content);
+        }
+        else if (item->presence == PresenceIncomplete)
+            pkgi_verify_package(*item);
+    }
     else if (input && (input->pressed & PKGI_BUTTON_T))
     {
         input->pressed &= ~PKGI_BUTTON_T;
@@ -724,7 +1698,11 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input,Config *configNode)
                 !config.psp_dlcs_url.empty() << 7 |
                 (!config.psm_games_url.empty() && config.psm_readme_disclaimer)
                         << 4;
-        pkgi_menu_start(search_active, &config, allow_refresh);
+        pkgi_menu_start(
+                search_active,
+                &config,
+                allow_refresh,
+                mode_uses_bgdl(mode) && mode != ModeGames);
     }
 }
 
@@ -732,14 +1710,21 @@ void pkgi_do_refresh(void)
 {
     std::string text;
 
+    std::string action;
+    {
+        // written by the refresh workers
+        std::lock_guard<Mutex> lock(refresh_mutex);
+        action = current_action;
+    }
+
     uint32_t updated;
     uint32_t total;
     db->get_update_status(&updated, &total);
 
     if (total == 0)
-        text = fmt::format("{}...", current_action);
+        text = fmt::format("{}...", action);
     else
-        text = fmt::format("{}... {}%", current_action, updated * 100 / total);
+        text = fmt::format("{}... {}%", action, updated * 100 / total);
 
     int w = pkgi_text_width(text.c_str());
     pkgi_draw_text(
@@ -812,6 +1797,18 @@ void pkgi_do_head(void)
         pkgi_snprintf(
                 text, sizeof(text), "%s", pkgi_mode_to_string(mode).c_str());
 
+    // the old list is shown until the new one is ready
+    if (pkgi_reload_pending())
+    {
+        static const char spinner[] = "|/-\\";
+        const auto len = strlen(text);
+        pkgi_snprintf(
+                text + len,
+                sizeof(text) - len,
+                " %c",
+                spinner[pkgi_time_msec() / 150 % 4]);
+    }
+
     pkgi_clip_set(
             left,
             0,
@@ -825,41 +1822,268 @@ void pkgi_do_head(void)
     pkgi_clip_remove();
 }
 
-uint64_t last_progress_time;
-uint64_t last_progress_offset;
-uint64_t last_progress_speed;
+// a box in the bottom right of the list with a line per stage of the shown
+// download, to tell what holds it back
+void pkgi_do_stage_stats(const DownloadStatus& status)
+{
+    static constexpr int width = 320;
+    const auto line_height = font_height + PKGI_MAIN_ROW_PADDING;
+    const int height = STAGE_COUNT * line_height + PKGI_MAIN_ROW_PADDING;
+    const int x = VITA_WIDTH - width - PKGI_MAIN_SCROLL_WIDTH -
+                  PKGI_MAIN_SCROLL_PADDING;
+    const int y = bottom_y - height;
+
+    pkgi_draw_rect(x, y, width, height, PKGI_COLOR_MENU_BACKGROUND);
+
+    char text[64];
+    for (size_t i = 0; i < STAGE_COUNT; ++i)
+    {
+        const auto usec = status.stages.usec[i];
+        const auto bytes = status.stages.bytes[i];
+        const int line_y = y + PKGI_MAIN_ROW_PADDING + i * line_height;
+        pkgi_draw_text(
+                x + PKGI_MAIN_TEXT_PADDING,
+                line_y,
+                PKGI_COLOR_TEXT,
+                stage_name(static_cast<Stage>(i)));
+        pkgi_snprintf(
+                text,
+                sizeof(text),
+                "%.1fs %.2f MB/s",
+                usec / 1e6,
+                usec ? bytes / (usec / 1e6) / (1024 * 1024) : 0.0);
+        pkgi_draw_text(
+                x + width - PKGI_MAIN_TEXT_PADDING - pkgi_text_width(text),
+                line_y,
+                PKGI_COLOR_TEXT,
+                text);
+    }
+}
+
+// a box in the bottom left of the list with the current and peak memory of
+// each subsystem
+void pkgi_do_memory_stats()
+{
+    pkgi_poll_memory_pools();
+    const auto totals = pkgi_mem_totals();
+
+    static constexpr int width = 400;
+    const auto line_height = font_height + PKGI_MAIN_ROW_PADDING;
+    const int height = MEM_POOL_COUNT * line_height + PKGI_MAIN_ROW_PADDING;
+    const int x = 0;
+    const int y = bottom_y - height;
+
+    pkgi_draw_rect(x, y, width, height, PKGI_COLOR_MENU_BACKGROUND);
+
+    char text[64];
+    for (size_t i = 0; i < MEM_POOL_COUNT; ++i)
+    {
+        const int line_y = y + PKGI_MAIN_ROW_PADDING + i * line_height;
+        pkgi_draw_text(
+                x + PKGI_MAIN_TEXT_PADDING,
+                line_y,
+                PKGI_COLOR_TEXT,
+                mem_pool_name(static_cast<MemPool>(i)));
+        // the pools of a fixed size show it after their peak
+        if (totals.limit[i])
+            pkgi_snprintf(
+                    text,
+                    sizeof(text),
+                    "%u KB / %u KB / %u KB",
+                    static_cast<uint32_t>(totals.current[i] / 1024),
+                    static_cast<uint32_t>(totals.peak[i] / 1024),
+                    static_cast<uint32_t>(totals.limit[i] / 1024));
+        else
+            pkgi_snprintf(
+                    text,
+                    sizeof(text),
+                    "%u KB / %u KB",
+                    static_cast<uint32_t>(totals.current[i] / 1024),
+                    static_cast<uint32_t>(totals.peak[i] / 1024));
+        pkgi_draw_text(
+                x + width - PKGI_MAIN_TEXT_PADDING - pkgi_text_width(text),
+                line_y,
+                PKGI_COLOR_TEXT,
+                text);
+    }
+}
+
+// false when the frame would look like the last one drawn
+bool pkgi_frame_needed(const pkgi_input& input, Downloader& downloader)
+{
+    if (input.down || input.pressed)
+        active_frames = ACTIVE_FRAMES_AFTER_INPUT;
+    if (active_frames)
+    {
+        --active_frames;
+        return true;
+    }
+    if (icons && icons->serial() != icon_serial)
+    {
+        icon_serial = icons->serial();
+        return true;
+    }
+    if (state != StateMain || ui_events.pending() || gameview ||
+        pkgi_reload_pending() ||
+        pkgi_dialog_is_open() || pkgi_menu_is_open() ||
+        pkgi_dialog_input_is_open())
+        return true;
+
+    bool busy = downloader.get_install_status().stage != DownloadStage::Idle;
+    for (size_t i = 0; i < Downloader::MAX_JOBS && !busy; ++i)
+        busy = downloader.get_status(i).stage != DownloadStage::Idle;
+    return pkgi_time_msec() - last_frame_time >=
+           (busy ? PROGRESS_FRAME_MSEC : IDLE_FRAME_MSEC);
+}
+
+void pkgi_apply_download_schedule(Downloader& downloader)
+{
+    const auto time = std::time(nullptr);
+    const auto paused = !download_schedule.allows(
+            std::localtime(&time)->tm_hour, pkgi_battery_is_charging());
+    if (paused != downloads_paused)
+    {
+        downloads_paused = paused;
+        downloader.set_paused(paused);
+    }
+}
+
+void pkgi_check_download_schedule(Downloader& downloader)
+{
+    const auto now = pkgi_time_msec();
+    if (now - schedule_check_time < 1000)
+        return;
+    schedule_check_time = now;
+    pkgi_apply_download_schedule(downloader);
+}
 
-uint64_t get_speed(const uint64_t download_offset)
+// The decryption, hashing and decompression of the downloads get the highest
+// clock when they take most of the time of a job, the clock is lowered when
+// the downloads only wait on the network, and lowered again when the list is
+// left alone with nothing running
+void pkgi_govern_clock(const pkgi_input& input, Downloader& downloader)
 {
-    const uint64_t now = pkgi_time_msec();
-    const uint64_t progress_time = now - last_progress_time;
-    if (progress_time < 1000)
-        return last_progress_speed;
+    const auto now = pkgi_time_msec();
+    if (input.down || input.pressed)
+        governor_input_time = now;
+    const bool interactive =
+            now - governor_input_time < GOVERNOR_INTERACTIVE_MSEC ||
+            state != StateMain || gameview || pkgi_dialog_is_open() ||
+            pkgi_menu_is_open() || pkgi_dialog_input_is_open();
+
+    // an input doesn't wait for the next decision
+    if (interactive && clock_mhz && clock_mhz < CLOCK_NORMAL_MHZ)
+    {
+        clock_mhz = CLOCK_NORMAL_MHZ;
+        governor_lower_count = 0;
+        pkgi_set_cpu_clock(clock_mhz);
+    }
+
+    const auto elapsed = now - governor_time;
+    if (clock_mhz && elapsed < GOVERNOR_INTERVAL_MSEC)
+        return;
+    governor_time = now;
+
+    bool busy = downloader.get_install_status().stage != DownloadStage::Idle;
+    uint64_t cpu_usec = 0;
+    for (size_t i = 0; i < Downloader::MAX_JOBS; ++i)
+    {
+        const auto& status = downloader.get_status(i);
+        busy = busy || status.stage != DownloadStage::Idle;
+        uint64_t usec = 0;
+        for (const auto stage :
+             {Stage::Sha256,
+              Stage::AesCtr,
+              Stage::PspDecrypt,
+              Stage::Lzrc,
+              Stage::IsoCompress})
+            usec += status.stages.usec[static_cast<size_t>(stage)];
+        // the totals start again with each download
+        cpu_usec += usec >= governor_cpu_usec[i] ? usec - governor_cpu_usec[i]
+                                                 : usec;
+        governor_cpu_usec[i] = usec;
+    }
 
-    const uint64_t progress_data = download_offset - last_progress_offset;
-    last_progress_speed = progress_data * 1000 / progress_time;
-    last_progress_offset = download_offset;
-    last_progress_time = now;
+    uint32_t wanted = CLOCK_IDLE_MHZ;
+    if (cpu_usec * 2 >= uint64_t(elapsed) * 1000)
+        wanted = CLOCK_HIGH_MHZ;
+    else if (busy || interactive)
+        wanted = CLOCK_NORMAL_MHZ;
 
-    return last_progress_speed;
+    if (wanted < clock_mhz && ++governor_lower_count < GOVERNOR_LOWER_AFTER)
+        return;
+    governor_lower_count = 0;
+    if (wanted != clock_mhz)
+    {
+        LOGF("cpu clock {} MHz", wanted);
+        clock_mhz = wanted;
+        pkgi_set_cpu_clock(clock_mhz);
+    }
+}
+
+// seconds as m:ss, or h:mm:ss past an hour
+void pkgi_format_eta(char* text, uint32_t size, uint64_t seconds)
+{
+    if (seconds >= 3600)
+        pkgi_snprintf(
+                text,
+                size,
+                "%u:%02u:%02u",
+                static_cast<uint32_t>(seconds / 3600),
+                static_cast<uint32_t>(seconds / 60 % 60),
+                static_cast<uint32_t>(seconds % 60));
+    else
+        pkgi_snprintf(
+                text,
+                size,
+                "%u:%02u",
+                static_cast<uint32_t>(seconds / 60),
+                static_cast<uint32_t>(seconds % 60));
 }
 
 void pkgi_do_tail(Downloader& downloader)
 {
+    TRACE_SCOPE("pkgi_do_tail");
     char text[256];
 
     pkgi_draw_rect(
             0, bottom_y, VITA_WIDTH, PKGI_MAIN_HLINE_HEIGHT, PKGI_COLOR_HLINE);
 
-    const auto current_download = downloader.get_current_download();
+    // no lock and no allocation, this runs every frame. The first running
+    // download is shown, or the install if there is none, the speed is the
+    // one of all of them
+    const DownloadStatus* shown = nullptr;
+    size_t running = 0;
+    uint64_t total_speed = 0;
+    // what is left of the running downloads and of the queue
+    uint64_t remaining = downloader.get_queued_bytes();
+    for (size_t i = 0; i < Downloader::MAX_JOBS; ++i)
+    {
+        const auto& job_status = downloader.get_status(i);
+        if (job_status.stage == DownloadStage::Idle)
+            continue;
+        if (!shown)
+            shown = &job_status;
+        ++running;
+        total_speed += job_status.speed;
+        if ((job_status.stage == DownloadStage::Downloading ||
+             job_status.stage == DownloadStage::Paused) &&
+            job_status.size > job_status.offset)
+            remaining += job_status.size - job_status.offset;
+    }
+    const auto& install_status = downloader.get_install_status();
+    if (install_status.stage != DownloadStage::Idle)
+    {
+        if (!shown)
+            shown = &install_status;
+        ++running;
+    }
+    static const DownloadStatus idle{};
+    const auto& status = shown ? *shown : idle;
 
-    uint64_t download_offset;
-    uint64_t download_size;
-    std::tie(download_offset, download_size) =
-            downloader.get_current_download_progress();
     // avoid divide by 0
-    if (download_size == 0)
-        download_size = 1;
+    const uint64_t download_size = status.size == 0 ? 1 : status.size;
+    const uint64_t download_offset = std::min(status.offset, download_size);
 
     pkgi_draw_rect(
             0,
@@ -868,32 +2092,101 @@ void pkgi_do_tail(Downloader& downloader)
             font_height + PKGI_MAIN_ROW_PADDING - 1,
             PKGI_COLOR_PROGRESS_BACKGROUND);
 
-    if (current_download)
+    if (status.stage == DownloadStage::Installing)
+        pkgi_snprintf(
+                text,
+                sizeof(text),
+                "正在安装 %s: %s",
+                type_to_string(status.type),
+                status.name);
+    else if (status.stage == DownloadStage::Downloading)
     {
-        const auto speed = get_speed(download_offset);
-        std::string sspeed;
-
-        if (speed > 1000 * 1024)
-            sspeed = fmt::format("{:.3g} MB/s", speed / 1024.f / 1024.f);
-        else if (speed > 1000)
-            sspeed = fmt::format("{:.3g} KB/s", speed / 1024.f);
+        char sspeed[32];
+        if (total_speed > 1000 * 1024)
+            pkgi_snprintf(
+                    sspeed,
+                    sizeof(sspeed),
+                    "%.3g MB/s",
+                    total_speed / 1024.f / 1024.f);
+        else if (total_speed > 1000)
+            pkgi_snprintf(
+                    sspeed, sizeof(sspeed), "%.3g KB/s", total_speed / 1024.f);
         else
-            sspeed = fmt::format("{} B/s", speed);
+            pkgi_snprintf(
+                    sspeed,
+                    sizeof(sspeed),
+                    "%u B/s",
+                    static_cast<uint32_t>(total_speed));
 
         pkgi_snprintf(
                 text,
                 sizeof(text),
-                "正在下载 %s: %s (%s, %d%%)",
-                type_to_string(current_download->type).c_str(),
-                current_download->name.c_str(),
-                sspeed.c_str(),
+                "正在下载 %s: %s (%s, %d%%",
+                type_to_string(status.type),
+                status.name,
+                sspeed,
                 static_cast<int>(download_offset * 100 / download_size));
+        auto len = strlen(text);
+        // a slow download on a weak signal isn't the server's fault
+        if (status.signal_dbm)
+        {
+            pkgi_snprintf(
+                    text + len,
+                    sizeof(text) - len,
+                    ", 信号 %d dBm",
+                    static_cast<int>(status.signal_dbm));
+            len = strlen(text);
+        }
+        if (status.eta)
+        {
+            char seta[16];
+            pkgi_format_eta(seta, sizeof(seta), status.eta);
+            pkgi_snprintf(text + len, sizeof(text) - len, ", 剩余 %s", seta);
+            len = strlen(text);
+        }
+        pkgi_snprintf(text + len, sizeof(text) - len, ")");
     }
+    else if (status.stage == DownloadStage::Paused)
+        pkgi_snprintf(
+                text,
+                sizeof(text),
+                "已暂停 %s: %s (%d%%)",
+                type_to_string(status.type),
+                status.name,
+                static_cast<int>(download_offset * 100 / download_size));
+    else if (downloads_paused && downloader.get_queued_bytes())
+        pkgi_snprintf(text, sizeof(text), "不在下载时段, 队列已暂停");
     else
         pkgi_snprintf(text, sizeof(text), "暂无下载");
 
+    if (running > 1)
+    {
+        const auto len = strlen(text);
+        pkgi_snprintf(
+                text + len,
+                sizeof(text) - len,
+                " 等%u项",
+                static_cast<uint32_t>(running));
+    }
+    if (status.stage == DownloadStage::Downloading && total_speed &&
+        remaining > download_size - download_offset)
+    {
+        char seta[16];
+        pkgi_format_eta(
+                seta,
+                sizeof(seta),
+                (remaining + total_speed - 1) / total_speed);
+        const auto len = strlen(text);
+        pkgi_snprintf(text + len, sizeof(text) - len, ", 全部剩余 %s", seta);
+    }
+
     pkgi_draw_text(0, bottom_y, PKGI_COLOR_TEXT_TAIL, text);
 
+    if (config.show_stage_stats && status.stage == DownloadStage::Downloading)
+        pkgi_do_stage_stats(status);
+    if (config.show_memory_stats)
+        pkgi_do_memory_stats();
+
     const auto second_line = bottom_y + font_height + PKGI_MAIN_ROW_PADDING;
 
     uint32_t count = db->count();
@@ -907,6 +2200,29 @@ void pkgi_do_tail(Downloader& downloader)
     {
         pkgi_snprintf(text, sizeof(text), "计数: %u (%u)", count, total);
     }
+
+    const auto updates = update_checker->progress();
+    if (updates.done < updates.total)
+    {
+        const auto len = strlen(text);
+        pkgi_snprintf(
+                text + len,
+                sizeof(text) - len,
+                " 正在检查更新 %u/%u",
+                static_cast<uint32_t>(updates.done),
+                static_cast<uint32_t>(updates.total));
+    }
+    if (verifier)
+    {
+        const auto verified = verifier->progress();
+        const auto len = strlen(text);
+        pkgi_snprintf(
+                text + len,
+                sizeof(text) - len,
+                " 正在校验 %u/%u",
+                static_cast<uint32_t>(verified.done),
+                static_cast<uint32_t>(verified.total));
+    }
     pkgi_draw_text(0, second_line, PKGI_COLOR_TEXT_TAIL, text);
 
     // get free space of partition only if looking at psx or psp games else show
@@ -953,9 +2269,15 @@ void pkgi_do_tail(Downloader& downloader)
         {
             DbItem* item = db->get(selected_item);
             if (item && item->presence == PresenceInstalling)
-                bottom_text += fmt::format("{} 取消 ", pkgi_get_ok_str());
+                bottom_text += fmt::format(
+                        "{} 取消 " PKGI_UTF8_S " 优先 ", pkgi_get_ok_str());
+            else if (item && item->presence == PresenceIncomplete)
+                bottom_text += fmt::format(
+                        "{} 安装 " PKGI_UTF8_S " 校验 ", pkgi_get_ok_str());
             else if (item && item->presence != PresenceInstalled)
                 bottom_text += fmt::format("{} 安装 ", pkgi_get_ok_str());
+            else if (item && !mode_uses_bgdl(mode))
+                bottom_text += fmt::format("{} 修复/校验 ", pkgi_get_ok_str());
         }
         bottom_text += PKGI_UTF8_T " 菜单 START关于";
     }
@@ -1008,18 +2330,7 @@ void reposition(void)
 
 void pkgi_reload()
 {
-    try
-    {
-        configure_db(db.get(), NULL, &config);
-    }
-    catch (const std::exception& e)
-    {
-        LOGF("error during reload: {}", e.what());
-        pkgi_dialog_error(
-                fmt::format(
-                        "数据库重新加载失败: {}, 请尝试刷新?", e.what())
-                        .c_str());
-    }
+    configure_db(NULL, &config);
 }
 
 void pkgi_open_db()
@@ -1029,11 +2340,7 @@ void pkgi_open_db()
         first_item = 0;
         selected_item = 0;
         db = std::make_unique<TitleDatabase>(pkgi_get_config_folder());
-
-        comppack_db_games = std::make_unique<CompPackDatabase>(
-                std::string(pkgi_get_config_folder()) + "/comppack.db");
-        comppack_db_updates = std::make_unique<CompPackDatabase>(
-                std::string(pkgi_get_config_folder()) + "/comppack_updates.db");
+        db->set_cache_budget(std::max(config.list_cache_kb, 0) * size_t(1024));
     }
     catch (const std::exception& e)
     {
@@ -1042,11 +2349,60 @@ void pkgi_open_db()
                 "数据库初始化失败: %s\n是否要清除数据库缓存?");
     }
 
+    pkgi_start_thread("reload_thread", &pkgi_reload_thread);
+    task_pool = std::make_unique<TaskPool>();
+    pkgi_set_trash_pool(
+            task_pool.get(), {"ux0:", config.install_psp_psx_location});
+    presence_scanner = std::make_unique<PresenceScanner>(
+            std::string(pkgi_get_config_folder()) + "/presence.cache",
+            task_pool.get());
+    // the rows stay unknown until it's there
+    presence_scanner->rescan(config.install_psp_psx_location);
+    title_metadata = std::make_unique<TitleMetadataCache>(
+            std::string(pkgi_get_config_folder()) + "/titles.cache");
+    patch_info_cache = std::make_unique<PatchInfoCache>(
+            std::string(pkgi_get_config_folder()) + "/patchinfo",
+            std::max(config.patch_info_ttl_hours, 0) * int64_t(3600));
+    update_checker = std::make_unique<UpdateChecker>(
+            patch_info_cache.get(), task_pool.get(), [] {
+                return std::make_unique<VitaHttp>();
+            });
+    if (config.icon_cache_kb > 0)
+        icons = std::make_unique<IconCache>(
+                task_pool.get(),
+                [] { return std::make_unique<VitaHttp>(); },
+                std::string(pkgi_get_config_folder()) + "/icons",
+                config.icon_url,
+                config.icon_cache_kb * size_t(1024));
+    if (memory_budget)
+    {
+        // the icons go first, they're read back from their thumbnails while
+        // a list is parsed again
+        memory_budget->add_cache(
+                MemPool::TitleDb,
+                2,
+                std::max(config.list_cache_kb, 0) * size_t(1024),
+                [](size_t quota) { db->set_cache_budget(quota); });
+        if (icons)
+            memory_budget->add_cache(
+                    MemPool::Icons,
+                    0,
+                    config.icon_cache_kb * size_t(1024),
+                    [](size_t quota) { icons->set_budget(quota); });
+        // the widths are measured again every frame without it, but it's
+        // small next to the lists
+        memory_budget->add_cache(
+                MemPool::TextWidths,
+                1,
+                TextWidthCache::DEFAULT_BUDGET,
+                [](size_t quota) { text_widths.set_budget(quota); });
+    }
     pkgi_reload();
 }
 }
 
-void pkgi_start_download(Downloader& downloader, const DbItem& item)
+void pkgi_start_download(
+        Downloader& downloader, const DbItem& item, bool repair)
 {
     LOGF("[{}] {} - starting to install", item.content, item.name);
 
@@ -1058,17 +2414,18 @@ void pkgi_start_download(Downloader& downloader, const DbItem& item)
         if (item.zrif.empty() ||
             pkgi_zrif_decode(item.zrif.c_str(), rif, message, sizeof(message)))
         {
-            if (mode == ModeGames || mode == ModeDlcs || mode == ModeDemos ||
-                mode == ModeThemes)
+            if (mode_uses_bgdl(mode))
             {
-                pkgi_start_bgdl(
+                std::vector<BgdlItem> items;
+                items.push_back(BgdlItem{
                         mode_to_bgdl_type(mode),
                         item.name,
                         item.url,
                         item.zrif.empty()
                                 ? std::vector<uint8_t>{}
                                 : std::vector<uint8_t>(
-                                          rif, rif + PKGI_PSM_RIF_SIZE));
+                                          rif, rif + PKGI_PSM_RIF_SIZE)});
+                bgdl_queue->add(std::move(items));
                 pkgi_dialog_message(
                         fmt::format(
                                 "已将 {} 添加至LiveArea下载队列",
@@ -1091,7 +2448,12 @@ void pkgi_start_download(Downloader& downloader, const DbItem& item)
                                         : std::vector<uint8_t>{},
                         !config.install_psp_as_pbp,
                         pkgi_get_mode_partition(),
-                        ""});
+                        "",
+                        item.size > 0 ? static_cast<uint64_t>(item.size) : 0,
+                        0,
+                        repair,
+                        config.psp_iso_format,
+                        item.mirrors});
         }
         else
         {
@@ -1106,31 +2468,169 @@ void pkgi_start_download(Downloader& downloader, const DbItem& item)
     }
 }
 
+namespace
+{
+// The pools of the network libraries hold the buffers of each connection, they
+// grow with the connections of the downloads, plus those of the update checks,
+// the icons and the list refreshes. The sizes of the config win when they are
+// set
+pkgi_pool_sizes pkgi_pool_sizes_for(const Config& config)
+{
+    static constexpr uint32_t NETWORK_POOL_BASE = 512 * 1024;
+    static constexpr uint32_t NETWORK_POOL_PER_CONNECTION = 128 * 1024;
+    static constexpr uint32_t OTHER_CONNECTIONS =
+            UpdateChecker::CONNECTIONS + 1;
+    static constexpr uint32_t VITA2D_POOL_SIZE = 4 * 1024 * 1024;
+
+    const uint32_t connections =
+            std::min<uint32_t>(
+                    std::max(config.download_connections, 1) *
+                            std::max(config.download_jobs, 1),
+                    Downloader::HTTP_SLOTS) +
+            OTHER_CONNECTIONS;
+    const uint32_t network_pool =
+            NETWORK_POOL_BASE + connections * NETWORK_POOL_PER_CONNECTION;
+    const auto size = [](int kb, uint32_t automatic) {
+        return kb > 0 ? static_cast<uint32_t>(kb) * 1024 : automatic;
+    };
+
+    pkgi_pool_sizes pools;
+    pools.net = size(config.net_pool_kb, network_pool);
+    pools.ssl = size(config.ssl_pool_kb, network_pool);
+    pools.http = size(config.http_pool_kb, network_pool);
+    pools.vita2d = size(config.vita2d_pool_kb, VITA2D_POOL_SIZE);
+    return pools;
+}
+}
+
 int main()
 {
-    pkgi_start();
+    // before the start, the pools of the system libraries are sized from it.
+    // An error is shown once there is a screen
+    std::exception_ptr config_error;
+    try
+    {
+        config = pkgi_load_config(0);
+    }
+    catch (const std::exception&)
+    {
+        config_error = std::current_exception();
+    }
+    pkgi_startup_step("config");
+
+    pkgi_set_http_options(config.http_hosts);
+    pkgi_start(pkgi_pool_sizes_for(config));
 
     try
     {
         if (!pkgi_is_unsafe_mode())
             throw std::runtime_error(
                     "PKGj需要在Henkaku设置中启用不安全自制软件!");
+        if (config_error)
+            std::rethrow_exception(config_error);
+
+        // the threads are placed when they are created, the downloader's
+        // included
+        pkgi_set_thread_cpus(
+                config.cpu_ui, config.cpu_network, config.cpu_worker);
+        pkgi_place_current_thread(ThreadRole::Ui);
+        LOGF("thread cores: ui {} network {} worker {}",
+             pkgi_thread_placement(ThreadRole::Ui).cpu,
+             pkgi_thread_placement(ThreadRole::Network).cpu,
+             pkgi_thread_placement(ThreadRole::Worker).cpu);
 
         Downloader downloader;
 
-        downloader.refresh = [](const std::string& content) {
-            std::lock_guard<Mutex> lock(refresh_mutex);
-            content_to_refresh = content;
-            need_refresh = true;
-        };
+        downloader.events = &ui_events;
+        // both run on their threads, the dialog is opened by the main loop
         downloader.error = [](const std::string& error) {
-            // FIXME this runs on the wrong thread
-            pkgi_dialog_error(("下载失败: " + error).c_str());
+            UiEvent event{UiEventType::Error};
+            event.message = "下载失败: " + error;
+            ui_events.post(std::move(event));
+        };
+        bgdl_queue = std::make_unique<BgdlQueue>();
+        bgdl_queue->error = [](const std::string& title,
+                               const std::string& error) {
+            UiEvent event{UiEventType::Error};
+            event.message = fmt::format(
+                    "{} 添加至LiveArea下载队列失败: {}", title, error);
+            ui_events.post(std::move(event));
         };
 
         LOG("started");
 
-        config = pkgi_load_config(0);
+        downloader.connections = std::max(config.download_connections, 1);
+        if (config.write_buffer_kb > 0)
+            downloader.write_buffer_size =
+                    std::clamp(config.write_buffer_kb, 64, 8192) * 1024;
+        else
+        {
+            // the default size stays for the cards that can't be probed
+            storage_probe = std::make_unique<StorageProbe>(
+                    std::string(pkgi_get_config_folder()) + "/storage.cache");
+            downloader.storage = storage_probe.get();
+        }
+        downloader.hold_wifi = config.wifi_keep_awake;
+        downloader.chunks_url = config.chunks_url;
+        // the requests append /<content>/...
+        downloader.offload_url = config.offload_url;
+        while (!downloader.offload_url.empty() &&
+               downloader.offload_url.back() == '/')
+            downloader.offload_url.pop_back();
+        if (config.memory_budget_kb > 0)
+        {
+            // the caches join it once they're there
+            memory_budget = std::make_unique<MemoryBudget>(
+                    config.memory_budget_kb * size_t(1024));
+            downloader.memory = memory_budget.get();
+        }
+        if (config.record_http)
+        {
+            try
+            {
+                http_trace = std::make_unique<HttpTraceWriter>(
+                        std::string(pkgi_get_config_folder()) +
+                        "/http_trace.tsv");
+                downloader.http_trace = http_trace.get();
+            }
+            catch (const std::exception& e)
+            {
+                LOGF("can't record the http requests: {}", e.what());
+            }
+        }
+        if (config.lan_peers)
+        {
+            peer_cache = std::make_unique<PeerCache>();
+            downloader.peers = peer_cache.get();
+        }
+        download_history = std::make_unique<DownloadHistory>(
+                std::string(pkgi_get_config_folder()) + "/history.tsv");
+        // before anything is queued
+        downloader.history = download_history.get();
+        downloader.set_jobs(std::max(config.download_jobs, 1));
+        downloader.set_speed_limits(
+                std::max(config.download_limit_kb, 0) * uint64_t(1024),
+                std::max(config.job_limit_kb, 0) * uint64_t(1024));
+        try
+        {
+            download_schedule = pkgi_parse_download_schedule(
+                    config.download_hours, config.download_when_charging);
+        }
+        catch (const std::exception& e)
+        {
+            // better downloading all day than never
+            LOGF("ignoring download_hours \"{}\": {}",
+                 config.download_hours,
+                 e.what());
+            download_schedule = pkgi_parse_download_schedule(
+                    "", config.download_when_charging);
+        }
+        // before the restored queue starts
+        pkgi_apply_download_schedule(downloader);
+        // what the last run didn't get to install
+        downloader.restore_queue(
+                std::string(pkgi_get_config_folder()) + "/queue.bin");
+        pkgi_startup_step("downloader");
         pkgi_dialog_init();
 
         font_height = pkgi_text_height("M");
@@ -1138,48 +2638,64 @@ int main()
         bottom_y = VITA_HEIGHT - 2 * font_height - PKGI_MAIN_ROW_PADDING;
 
         pkgi_open_db();
+        pkgi_startup_step("databases");
 
-        pkgi_texture background = pkgi_load_png(background);
+        // decoded while the first frames show, drawn once it's there
+        task_pool->submit(TaskPool::PriorityHigh, [](const Task&) {
+            background_texture = pkgi_load_png(background);
+        });
 
         if (!config.no_version_check)
-            start_update_thread();
+            start_update_check(task_pool.get());
 
+        init_imgui_allocator();
         const auto imgui_context = ImGui::CreateContext();
         // Force enabling of navigation
         imgui_context->NavDisableHighlight = false;
-        ImGuiIO& io = ImGui::GetIO();
-
-        // Build and load the texture atlas into a texture
-        uint32_t* pixels = NULL;
-        int width, height;
-        if (!io.Fonts->AddFontFromFileTTF(
-                    "sa0:/data/font/pvf/cn0.pvf",
-                    20.0f,
-                    0,
-                    io.Fonts->GetGlyphRangesChineseSimplifiedCommon()))
-            throw std::runtime_error("无法加载 cn0.pvf");
-        io.Fonts->GetTexDataAsRGBA32((uint8_t**)&pixels, &width, &height);
-        vita2d_texture* font_texture =
-                vita2d_create_empty_texture(width, height);
-        const auto stride = vita2d_texture_get_stride(font_texture) / 4;
-        auto texture_data = (uint32_t*)vita2d_texture_get_datap(font_texture);
-
-        for (auto y = 0; y < height; ++y)
-            for (auto x = 0; x < width; ++x)
-                texture_data[y * stride + x] = pixels[y * width + x];
 
-        io.Fonts->TexID = font_texture;
+        pkgi_load_imgui_font(
+                "sa0:/data/font/pvf/cn0.pvf",
+                20.0f,
+                fmt::format("{}/font_cache.bin", pkgi_get_config_folder()));
 
         init_imgui();
+        pkgi_startup_step("imgui");
 
-        pkgi_input input;
+        pkgi_input input{};
         while (pkgi_update(&input))
         {
+            pkgi_check_download_schedule(downloader);
+            pkgi_check_background_refresh(downloader);
+            if (config.cpu_governor)
+                pkgi_govern_clock(input, downloader);
+            if (config.skip_idle_frames &&
+                !pkgi_frame_needed(input, downloader))
+            {
+                pkgi_skip_frame();
+                continue;
+            }
+            last_frame_time = pkgi_time_msec();
+            pkgi_start_frame();
+
+            TRACE_SCOPE("frame");
             ImGuiIO& io = ImGui::GetIO();
             io.DeltaTime = 1.0f / 60.0f;
             io.DisplaySize.x = VITA_WIDTH;
             io.DisplaySize.y = VITA_HEIGHT;
 
+#ifdef PKGI_ENABLE_TRACING
+            if (!gameview && !pkgi_dialog_is_open() &&
+                (input.pressed & PKGI_BUTTON_SELECT))
+            {
+                const auto path = fmt::format(
+                        "{}/trace.json", pkgi_get_config_folder());
+                const auto count = pkgi_trace_dump(path);
+                pkgi_dialog_message(
+                        fmt::format("已将 {} 个事件写入 {}", count, path)
+                                .c_str());
+            }
+#endif
+
             if (gameview || pkgi_dialog_is_open())
             {
                 if (input.pressed & PKGI_BUTTON_UP)
@@ -1196,29 +2712,15 @@ int main()
                 input.pressed = 0;
             }
 
-            if (need_refresh)
-            {
-                std::lock_guard<Mutex> lock(refresh_mutex);
-                pkgi_refresh_installed_packages();
-                if (!content_to_refresh.empty())
-                {
-                    const auto item =
-                            db->get_by_content(content_to_refresh.c_str());
-                    if (item)
-                        item->presence = PresenceUnknown;
-                    else
-                        LOGF("couldn't find {} for refresh",
-                             content_to_refresh);
-                    content_to_refresh.clear();
-                }
-                if (gameview)
-                    gameview->refresh();
-                need_refresh = false;
-            }
+            pkgi_handle_events();
+            pkgi_show_presence();
+            pkgi_show_updates();
+            pkgi_show_verification();
 
             ImGui::NewFrame();
 
-            pkgi_draw_texture(background, 0, 0);
+            if (const auto texture = background_texture.load())
+                pkgi_draw_texture(texture, 0, 0);
 
             pkgi_do_head();
             switch (state)
@@ -1254,10 +2756,20 @@ int main()
 
             if (pkgi_dialog_input_update())
             {
-                search_active = 1;
-                pkgi_dialog_input_get_text(search_text, sizeof(search_text));
-                configure_db(db.get(), search_text, &config);
-                reposition();
+                if (search_all_active)
+                {
+                    char text[256];
+                    pkgi_dialog_input_get_text(text, sizeof(text));
+                    if (text[0])
+                        pkgi_search_all(text);
+                }
+                else
+                {
+                    search_active = 1;
+                    pkgi_dialog_input_get_text(
+                            search_text, sizeof(search_text));
+                    configure_db(search_text, &config);
+                }
             }
 
             if (pkgi_menu_is_open())
@@ -1270,12 +2782,12 @@ int main()
                         config_temp.order != new_config.order ||
                         config_temp.filter != new_config.filter)
                     {
+                        if (!(config_temp.filter & DbFilterUpdates))
+                            pkgi_check_updates(new_config.filter);
                         config_temp = new_config;
                         configure_db(
-                                db.get(),
                                 search_active ? search_text : NULL,
                                 &config_temp);
-                        reposition();
                     }
                 }
                 else
@@ -1284,12 +2796,17 @@ int main()
                     switch (mres)
                     {
                     case MenuResultSearch:
+                        search_all_active = false;
                         pkgi_dialog_input_text("搜索", search_text);
                         break;
+                    case MenuResultSearchAll:
+                        search_all_active = true;
+                        pkgi_dialog_input_text("全局搜索", "");
+                        break;
                     case MenuResultSearchClear:
                         search_active = 0;
                         search_text[0] = 0;
-                        configure_db(db.get(), NULL, &config);
+                        configure_db(NULL, &config);
                         break;
                     case MenuResultCancel:
                         if (config_temp.sort != config.sort ||
@@ -1297,10 +2814,8 @@ int main()
                             config_temp.filter != config.filter)
                         {
                             configure_db(
-                                    db.get(),
                                     search_active ? search_text : NULL,
                                     &config);
-                            reposition();
                         }
                         break;
                     case MenuResultAccept:
@@ -1310,6 +2825,9 @@ int main()
                     case MenuResultRefresh:
                         pkgi_refresh_list();
                         break;
+                    case MenuResultDownloadAll:
+                        pkgi_start_bgdl_all();
+                        break;
                     case MenuResultShowGames:
                         pkgi_set_mode(ModeGames);
                         break;
@@ -1345,6 +2863,9 @@ int main()
             pkgi_imgui_render(ImGui::GetDrawData());
 
             pkgi_swap();
+            if (icons)
+                icons->end_frame();
+            pkgi_startup_done();
         }
     }
     catch (const std::exception& e)
@@ -1357,6 +2878,7 @@ int main()
         pkgi_input input;
         while (pkgi_update(&input))
         {
+            pkgi_start_frame();
             pkgi_draw_rect(0, 0, VITA_WIDTH, VITA_HEIGHT, 0);
             pkgi_do_error();
             pkgi_swap();
@@ -2,6 +2,7 @@
 
 #include "log.hpp"
 
+#include <functional>
 #include <string>
 
 #include <stdarg.h>
@@ -54,21 +55,44 @@ int pkgi_is_unsafe_mode(void);
 int pkgi_ok_button(void);
 int pkgi_cancel_button(void);
 
-void pkgi_start(void);
+// bytes given to the system libraries at start, they can't grow afterwards
+typedef struct pkgi_pool_sizes
+{
+    uint32_t net;
+    uint32_t ssl;
+    uint32_t http;
+    uint32_t vita2d;
+} pkgi_pool_sizes;
+
+// the network comes up in the background, what uses it waits for it with
+// pkgi_wait_network()
+void pkgi_start(const pkgi_pool_sizes& pools);
+void pkgi_wait_network(void);
+// polls the input, a frame drawn after it goes between pkgi_start_frame()
+// and pkgi_swap(), pkgi_skip_frame() leaves the last one on screen instead
 int pkgi_update(pkgi_input* input);
+void pkgi_start_frame(void);
 void pkgi_swap(void);
+void pkgi_skip_frame(void);
 void pkgi_end(void);
 
+// ARM clock in MHz, the bus and GPU clocks follow it
+void pkgi_set_cpu_clock(uint32_t mhz);
+
 int pkgi_battery_present();
 int pkgi_bettery_get_level();
 int pkgi_battery_is_low();
 int pkgi_battery_is_charging();
 
 uint64_t pkgi_get_free_space(const char*);
+// size of the storage behind the partition, 0 when it isn't mounted
+uint64_t pkgi_get_total_space(const char*);
 const char* pkgi_get_config_folder(void);
 int pkgi_is_incomplete(const char* partition, const char* titleid);
 
 uint32_t pkgi_time_msec();
+// for measuring, wraps after hundreds of thousands of years
+uint64_t pkgi_time_usec();
 
 typedef void pkgi_thread_entry(void);
 void pkgi_start_thread(const char* name, pkgi_thread_entry* start);
@@ -77,11 +101,30 @@ void pkgi_sleep(uint32_t msec);
 void pkgi_lock_process(void);
 void pkgi_unlock_process(void);
 
+enum class PowerEvent
+{
+    Suspending,
+    Resumed,
+};
+// called on the power thread as the system goes to sleep and once it woke
+// up, nullptr removes it
+void pkgi_set_power_handler(std::function<void(PowerEvent)> handler);
+
+// keeps the Wi-Fi out of its power save while held, counted like
+// pkgi_lock_process
+void pkgi_hold_wifi(void);
+void pkgi_release_wifi(void);
+// signal of the access point, false when it can't be read, on a cable for
+// instance
+bool pkgi_wifi_signal(int& dbm, int& percent);
+
 void pkgi_dialog_lock(void);
 void pkgi_dialog_unlock(void);
 
 void pkgi_dialog_input_text(const char* title, const char* text);
 int pkgi_dialog_input_update(void);
+// the system keyboard is up, it needs a frame drawn each vblank
+int pkgi_dialog_input_is_open(void);
 void pkgi_dialog_input_get_text(char* text, uint32_t size);
 
 int pkgi_check_free_space(uint64_t http_length);
@@ -106,7 +149,14 @@ typedef void* pkgi_texture;
 #endif
 
 pkgi_texture pkgi_load_png_raw(const void* data, uint32_t size);
+// pixels are RGBA, a row after the other
+pkgi_texture pkgi_create_texture(
+        uint32_t width, uint32_t height, const uint32_t* pixels);
+// the GPU may still read a texture drawn in the last frames, it must be done
+// with it
+void pkgi_free_texture(pkgi_texture texture);
 void pkgi_draw_texture(pkgi_texture texture, int x, int y);
+void pkgi_draw_texture_scaled(pkgi_texture texture, int x, int y, int w, int h);
 
 void pkgi_clip_set(int x, int y, int w, int h);
 void pkgi_clip_remove(void);
@@ -114,7 +164,34 @@ void pkgi_draw_rect(int x, int y, int w, int h, uint32_t color);
 void pkgi_draw_text(int x, int y, uint32_t color, const char* text);
 int pkgi_text_width(const char* text);
 int pkgi_text_height(const char* text);
+// changes each time a font is loaded, the widths measured before are wrong
+uint32_t pkgi_font_serial(void);
+
+// what the calls above were asked since the last take, only the host
+// stand-ins count them, for pkgj_bench
+struct DrawCounters
+{
+    uint64_t draws = 0;
+    uint64_t text_measures = 0;
+};
+DrawCounters pkgi_take_draw_counters();
 
 class Downloader;
 struct DbItem;
-void pkgi_start_download(Downloader& downloader, const DbItem& item);
+// a repair downloads again only the missing or damaged files of an installed
+// item
+void pkgi_start_download(
+        Downloader& downloader, const DbItem& item, bool repair = false);
+
+// the DLCs and themes of the game titleid in their lists, and how many of
+// each are installed
+struct RelatedContent
+{
+    uint32_t dlcs = 0;
+    uint32_t installed_dlcs = 0;
+    uint32_t themes = 0;
+    uint32_t installed_themes = 0;
+};
+RelatedContent pkgi_related_content(const std::string& titleid);
+// the ones that aren't installed go to LiveArea in one go
+void pkgi_start_bgdl_related(const std::string& titleid);
@@ -0,0 +1,191 @@
+#include "netsocket.hpp"
+
+#include "log.hpp"
+
+#include <boost/scope_exit.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace
+{
+bool set_option(int socket, int level, int option, int value)
+{
+    if (setsockopt(socket, level, option, &value, sizeof(value)) < 0)
+    {
+        LOGF("setsockopt {} of {} failed: {}",
+             option,
+             socket,
+             strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+sockaddr_in any_address(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    return addr;
+}
+
+// false when nothing came within timeout_ms
+bool wait_readable(int socket, uint32_t timeout_ms)
+{
+    pollfd fd{socket, POLLIN, 0};
+    return poll(&fd, 1, static_cast<int>(timeout_ms)) > 0;
+}
+}
+
+int pkgi_udp_open_multicast(const char* group, uint16_t port)
+{
+    const auto socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (socket < 0)
+        return socket;
+    bool ok = false;
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        if (!ok)
+            close(socket);
+    };
+
+    set_option(socket, SOL_SOCKET, SO_REUSEADDR, 1);
+    auto addr = any_address(port);
+    if (bind(socket, (sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        LOGF("bind of port {} failed: {}", port, strerror(errno));
+        return -1;
+    }
+
+    ip_mreq membership{};
+    inet_pton(AF_INET, group, &membership.imr_multiaddr);
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(
+                socket,
+                IPPROTO_IP,
+                IP_ADD_MEMBERSHIP,
+                &membership,
+                sizeof(membership)) < 0)
+    {
+        LOGF("joining {} failed: {}", group, strerror(errno));
+        return -1;
+    }
+
+    ok = true;
+    return socket;
+}
+
+bool pkgi_udp_send(
+        int socket,
+        const char* ip,
+        uint16_t port,
+        const void* data,
+        uint32_t size)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    return sendto(socket, data, size, 0, (sockaddr*)&addr, sizeof(addr)) ==
+           static_cast<ssize_t>(size);
+}
+
+int pkgi_udp_receive(
+        int socket,
+        void* data,
+        uint32_t size,
+        uint32_t timeout_ms,
+        std::string& from)
+{
+    if (!wait_readable(socket, timeout_ms))
+        return 0;
+    sockaddr_in addr{};
+    socklen_t addr_size = sizeof(addr);
+    const auto res =
+            recvfrom(socket, data, size, 0, (sockaddr*)&addr, &addr_size);
+    if (res <= 0)
+        return 0;
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    from = ip;
+    return static_cast<int>(res);
+}
+
+int pkgi_tcp_listen(uint16_t port)
+{
+    const auto socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (socket < 0)
+        return socket;
+    bool ok = false;
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        if (!ok)
+            close(socket);
+    };
+
+    set_option(socket, SOL_SOCKET, SO_REUSEADDR, 1);
+    auto addr = any_address(port);
+    if (bind(socket, (sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        LOGF("bind of port {} failed: {}", port, strerror(errno));
+        return -1;
+    }
+    if (listen(socket, 8) < 0)
+    {
+        LOGF("listen on port {} failed: {}", port, strerror(errno));
+        return -1;
+    }
+
+    ok = true;
+    return socket;
+}
+
+int pkgi_tcp_accept(
+        int socket, uint32_t timeout_ms, uint32_t receive_timeout_ms)
+{
+    if (!wait_readable(socket, timeout_ms))
+        return -1;
+    const auto client = accept(socket, nullptr, nullptr);
+    if (client < 0)
+        return client;
+
+    timeval timeout{};
+    timeout.tv_sec = receive_timeout_ms / 1000;
+    timeout.tv_usec = receive_timeout_ms % 1000 * 1000;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return client;
+}
+
+bool pkgi_tcp_send(int socket, const void* data, uint32_t size)
+{
+    auto bytes = static_cast<const uint8_t*>(data);
+    while (size != 0)
+    {
+        // a client that went away is an error, not a SIGPIPE
+        const auto sent = send(socket, bytes, size, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+int pkgi_tcp_receive(int socket, void* data, uint32_t size)
+{
+    return static_cast<int>(recv(socket, data, size, 0));
+}
+
+void pkgi_socket_close(int socket)
+{
+    close(socket);
+}
@@ -0,0 +1,506 @@
+#include "presencescanner.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "pkgi.hpp"
+#include "utils.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+std::string upper(std::string str)
+{
+    std::transform(str.begin(), str.end(), str.begin(), [](char c) {
+        return static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    });
+    return str;
+}
+
+// a directory that can't be read is logged and looked at as empty, the rest
+// of the snapshot is still useful
+std::vector<std::string> read_dir(const std::string& path)
+{
+    try
+    {
+        auto names = pkgi_list_dir_contents(path);
+        for (auto& name : names)
+            name = upper(std::move(name));
+        return names;
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to list {}: {}", path, e.what());
+        return {};
+    }
+}
+
+void insert_all(
+        std::unordered_set<std::string>& set, std::vector<std::string> names)
+{
+    set.insert(
+            std::make_move_iterator(names.begin()),
+            std::make_move_iterator(names.end()));
+}
+
+// inserts the names with suffix, without it
+void insert_stripped(
+        std::unordered_set<std::string>& set,
+        std::vector<std::string> names,
+        const std::string& suffix)
+{
+    for (auto& name : names)
+        if (ends_with(name, suffix))
+        {
+            name.resize(name.size() - suffix.size());
+            set.insert(std::move(name));
+        }
+}
+
+static constexpr char CACHE_MAGIC[] = "PKGJPRESENCE 1";
+
+// written by the installs, read by the scanner
+Mutex changed_mutex("presence_changed_mutex");
+std::unordered_set<std::string> changed_dirs;
+}
+
+void pkgi_presence_changed(const std::string& dir)
+{
+    std::lock_guard<Mutex> lock(changed_mutex);
+    changed_dirs.insert(dir);
+}
+
+bool PresenceSnapshot::is_installed(const std::string& titleid) const
+{
+    return games.find(titleid) != games.end();
+}
+
+bool PresenceSnapshot::psm_is_installed(const std::string& titleid) const
+{
+    return psm_games.find(titleid) != psm_games.end();
+}
+
+bool PresenceSnapshot::dlc_is_installed(const std::string& content) const
+{
+    if (content.size() < 20)
+        return false;
+    return dlcs.find(
+                   content.substr(7, 9) + '/' + content.substr(20, 16)) !=
+           dlcs.end();
+}
+
+bool PresenceSnapshot::theme_is_installed(const std::string& content) const
+{
+    if (content.size() < 19)
+        return false;
+    return themes.find(content.substr(7, 9) + content.substr(19)) !=
+           themes.end();
+}
+
+bool PresenceSnapshot::psp_is_installed(
+        const std::string& partition, const std::string& content) const
+{
+    const auto part = get_partition(partition);
+    return part && content.size() >= 7 &&
+           part->psp_games.find(content.substr(7, 9)) !=
+                   part->psp_games.end();
+}
+
+bool PresenceSnapshot::psx_is_installed(
+        const std::string& partition, const std::string& content) const
+{
+    const auto part = get_partition(partition);
+    return part && content.size() >= 7 &&
+           part->psx_games.find(content.substr(7, 9)) !=
+                   part->psx_games.end();
+}
+
+bool PresenceSnapshot::is_incomplete(
+        const std::string& partition, const std::string& content) const
+{
+    const auto part = get_partition(partition);
+    return part && part->incomplete.find(content) != part->incomplete.end();
+}
+
+const PresenceSnapshot::Partition* PresenceSnapshot::get_partition(
+        const std::string& partition) const
+{
+    if (partition == "ux0:")
+        return &ux0;
+    if (partition == psp_partition)
+        return &psp;
+    return nullptr;
+}
+
+std::vector<std::string> PresenceScanner::list(
+        const std::string& path, bool cached)
+{
+    if (!cached)
+        return read_dir(path);
+
+    _seen.insert(path);
+    const auto mtime = pkgi_get_mtime(path);
+    auto it = _listings.find(path);
+    if (it != _listings.end() && it->second.mtime == mtime &&
+        _changed.find(path) == _changed.end())
+        return it->second.names;
+
+    if (it != _listings.end())
+        _listings.erase(it);
+    _listings_dirty = true;
+    // a missing directory is not kept, it gets stat'ed again anyway
+    if (mtime == 0)
+        return {};
+
+    auto names = read_dir(path);
+    _listings.emplace(path, Listing{mtime, names});
+    return names;
+}
+
+void PresenceScanner::scan_partition(
+        PresenceSnapshot::Partition& out, const std::string& partition)
+{
+    const auto isos = list(fmt::format("{}pspemu/ISO", partition));
+    for (const auto suffix : {".ISO", ".CSO", ".ZSO"})
+        insert_stripped(out.psp_games, isos, suffix);
+    for (auto& titleid : list(fmt::format("{}pspemu/PSP/GAME", partition)))
+    {
+        if (pkgi_file_exists(fmt::format(
+                    "{}pspemu/PSP/GAME/{}/EBOOT.PBP", partition, titleid)))
+            out.psp_games.insert(titleid);
+        out.psx_games.insert(std::move(titleid));
+    }
+    scan_incomplete(out, partition);
+}
+
+void PresenceScanner::scan_incomplete(
+        PresenceSnapshot::Partition& out, const std::string& partition)
+{
+    // the downloads come and go in there all the time
+    out.incomplete.clear();
+    insert_stripped(
+            out.incomplete,
+            list(fmt::format("{}pkgj", partition), false),
+            ".RESUME");
+}
+
+void PresenceScanner::take_changed()
+{
+    std::lock_guard<Mutex> lock(changed_mutex);
+    _changed = std::move(changed_dirs);
+    changed_dirs.clear();
+}
+
+std::shared_ptr<PresenceSnapshot> PresenceScanner::scan(
+        const std::string& psp_partition)
+{
+    [[maybe_unused]] const auto start = pkgi_time_msec();
+
+    take_changed();
+    _seen.clear();
+
+    auto snapshot = std::make_shared<PresenceSnapshot>();
+    snapshot->psp_partition = psp_partition;
+
+    insert_all(snapshot->games, list("ux0:app"));
+    insert_all(snapshot->psm_games, list("ux0:psm"));
+    insert_all(snapshot->themes, list("ux0:theme"));
+    for (const auto& titleid : list("ux0:addcont"))
+        for (const auto& entitlement :
+             list(fmt::format("ux0:addcont/{}", titleid)))
+            snapshot->dlcs.insert(titleid + '/' + entitlement);
+
+    scan_partition(snapshot->ux0, "ux0:");
+    if (psp_partition != "ux0:")
+        scan_partition(snapshot->psp, psp_partition);
+
+    // forget the directories that are gone, like the addcont of a deleted
+    // game
+    for (auto it = _listings.begin(); it != _listings.end();)
+        if (_seen.find(it->first) == _seen.end())
+        {
+            it = _listings.erase(it);
+            _listings_dirty = true;
+        }
+        else
+            ++it;
+
+    if (_listings_dirty)
+        save_listings();
+
+    LOGF("scanned presence in {}ms: {} games, {} dlcs",
+         pkgi_time_msec() - start,
+         snapshot->games.size(),
+         snapshot->dlcs.size());
+    return snapshot;
+}
+
+std::shared_ptr<PresenceSnapshot> PresenceScanner::scan_changed(
+        const PresenceSnapshot& last)
+{
+    [[maybe_unused]] const auto start = pkgi_time_msec();
+
+    take_changed();
+    const auto changed = [this](const std::string& dir) {
+        return _changed.find(dir) != _changed.end();
+    };
+
+    auto snapshot = std::make_shared<PresenceSnapshot>(last);
+    const auto relist = [&](std::unordered_set<std::string>& set,
+                            const std::string& dir) {
+        if (!changed(dir))
+            return;
+        set.clear();
+        insert_all(set, list(dir));
+    };
+    relist(snapshot->games, "ux0:app");
+    relist(snapshot->psm_games, "ux0:psm");
+    relist(snapshot->themes, "ux0:theme");
+
+    const std::string addcont = "ux0:addcont/";
+    if (changed("ux0:addcont"))
+    {
+        snapshot->dlcs.clear();
+        for (const auto& titleid : list("ux0:addcont"))
+            for (const auto& entitlement : list(addcont + titleid))
+                snapshot->dlcs.insert(titleid + '/' + entitlement);
+    }
+    else
+        for (const auto& dir : _changed)
+        {
+            if (dir.compare(0, addcont.size(), addcont) != 0)
+                continue;
+            const auto prefix = dir.substr(addcont.size()) + '/';
+            for (auto it = snapshot->dlcs.begin(); it != snapshot->dlcs.end();)
+                if (it->compare(0, prefix.size(), prefix) == 0)
+                    it = snapshot->dlcs.erase(it);
+                else
+                    ++it;
+            for (const auto& entitlement : list(dir))
+                snapshot->dlcs.insert(prefix + entitlement);
+        }
+
+    const auto update_partition = [&](PresenceSnapshot::Partition& out,
+                                      const std::string& partition) {
+        if (changed(fmt::format("{}pspemu/ISO", partition)) ||
+            changed(fmt::format("{}pspemu/PSP/GAME", partition)))
+        {
+            out = PresenceSnapshot::Partition{};
+            scan_partition(out, partition);
+        }
+        else
+            scan_incomplete(out, partition);
+    };
+    update_partition(snapshot->ux0, "ux0:");
+    if (snapshot->psp_partition != "ux0:")
+        update_partition(snapshot->psp, snapshot->psp_partition);
+
+    if (_listings_dirty)
+        save_listings();
+
+    LOGF("updated presence in {}ms, {} directories changed",
+         pkgi_time_msec() - start,
+         _changed.size());
+    return snapshot;
+}
+
+// the cache is a line with CACHE_MAGIC, then for each directory a
+// "path\tmtime\tcount" line followed by count lines of names
+void PresenceScanner::load_listings()
+{
+    std::vector<uint8_t> data;
+    try
+    {
+        data = pkgi_load(_cache_path);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("no presence cache: {}", e.what());
+        return;
+    }
+
+    const std::string text(data.begin(), data.end());
+    size_t pos = 0;
+    const auto next_line = [&](std::string& line) {
+        const auto end = text.find('\n', pos);
+        if (end == std::string::npos)
+            return false;
+        line = text.substr(pos, end - pos);
+        pos = end + 1;
+        return true;
+    };
+
+    std::string line;
+    if (!next_line(line) || line != CACHE_MAGIC)
+    {
+        LOGF("ignoring presence cache {}, bad header", _cache_path);
+        return;
+    }
+
+    std::unordered_map<std::string, Listing> listings;
+    while (next_line(line))
+    {
+        const auto tab1 = line.find('\t');
+        const auto tab2 = line.find('\t', tab1 + 1);
+        if (tab1 == std::string::npos || tab2 == std::string::npos)
+        {
+            LOGF("ignoring presence cache {}, bad entry", _cache_path);
+            return;
+        }
+
+        Listing listing;
+        listing.mtime =
+                std::strtoull(line.c_str() + tab1 + 1, nullptr, 10);
+        const auto count = std::strtoul(line.c_str() + tab2 + 1, nullptr, 10);
+        for (size_t i = 0; i < count; ++i)
+        {
+            std::string name;
+            if (!next_line(name))
+            {
+                LOGF("ignoring presence cache {}, truncated", _cache_path);
+                return;
+            }
+            listing.names.push_back(std::move(name));
+        }
+        listings.emplace(line.substr(0, tab1), std::move(listing));
+    }
+
+    LOGF("loaded {} cached listings", listings.size());
+    _listings = std::move(listings);
+}
+
+void PresenceScanner::save_listings()
+{
+    std::string text = CACHE_MAGIC;
+    text += '\n';
+    for (const auto& entry : _listings)
+    {
+        text += fmt::format(
+                "{}\t{}\t{}\n",
+                entry.first,
+                entry.second.mtime,
+                entry.second.names.size());
+        for (const auto& name : entry.second.names)
+        {
+            text += name;
+            text += '\n';
+        }
+    }
+
+    try
+    {
+        const auto tmp = _cache_path + ".tmp";
+        pkgi_save(tmp, text.data(), text.size());
+        pkgi_rename(tmp, _cache_path);
+        _listings_dirty = false;
+    }
+    catch (const std::exception& e)
+    {
+        // the next scan just reads everything again
+        LOGF("failed to save presence cache: {}", e.what());
+    }
+}
+
+PresenceScanner::PresenceScanner(std::string cache_path, TaskPool* pool)
+    : _cache_path(std::move(cache_path))
+    , _pool(pool)
+    , _mutex("presence_mutex")
+{
+}
+
+PresenceScanner::~PresenceScanner()
+{
+    std::shared_ptr<Task> task;
+    {
+        ScopeLock _(_mutex);
+        task = _task;
+    }
+    if (task)
+    {
+        task->cancel();
+        task->wait();
+    }
+}
+
+uint32_t PresenceScanner::rescan(const std::string& psp_partition)
+{
+    {
+        ScopeLock _(_mutex);
+        _full = true;
+    }
+    return update(psp_partition);
+}
+
+uint32_t PresenceScanner::update(const std::string& psp_partition)
+{
+    ScopeLock _(_mutex);
+    _request = psp_partition;
+    const auto serial = ++_requested;
+    // a running scan picks up the request when it's over
+    if (!_scanning)
+    {
+        _scanning = true;
+        _task = _pool->submit(
+                TaskPool::PriorityNormal,
+                [this](const Task& task) { run(task); });
+    }
+    return serial;
+}
+
+std::shared_ptr<const PresenceSnapshot> PresenceScanner::snapshot()
+{
+    ScopeLock _(_mutex);
+    return _snapshot;
+}
+
+void PresenceScanner::run(const Task& task)
+{
+    if (!_listings_loaded)
+    {
+        load_listings();
+        _listings_loaded = true;
+    }
+
+    while (true)
+    {
+        std::string psp_partition;
+        uint32_t serial;
+        bool full;
+        std::shared_ptr<const PresenceSnapshot> last;
+        {
+            ScopeLock _(_mutex);
+            if (!_request || task.cancelled())
+            {
+                _scanning = false;
+                return;
+            }
+            psp_partition = std::move(*_request);
+            _request = std::nullopt;
+            full = _full;
+            _full = false;
+            last = _snapshot;
+            // requests made during the scan get another one
+            serial = _requested;
+        }
+
+        // the first scan, and the one after the psp partition moved, read
+        // everything
+        auto snapshot =
+                !full && last && last->psp_partition == psp_partition
+                        ? scan_changed(*last)
+                        : scan(psp_partition);
+        snapshot->serial = serial;
+
+        {
+            ScopeLock _(_mutex);
+            _snapshot = std::move(snapshot);
+            _published = serial;
+        }
+    }
+}
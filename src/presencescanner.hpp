@@ -0,0 +1,148 @@
+#pragma once
+
+#include "taskpool.hpp"
+#include "thread.hpp"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <stdint.h>
+
+// What is on the memory card, listed once by PresenceScanner so that the
+// presence of a row is a few hash lookups instead of file system probes.
+// Names are upper cased like the content ids of the lists, the file system
+// doesn't care about case.
+struct PresenceSnapshot
+{
+    // what can be installed on both ux0: and the psp partition
+    struct Partition
+    {
+        // title ids with an iso in pspemu/ISO or an EBOOT.PBP in
+        // pspemu/PSP/GAME
+        std::unordered_set<std::string> psp_games;
+        // title ids with a directory in pspemu/PSP/GAME
+        std::unordered_set<std::string> psx_games;
+        // content ids with a .resume file in pkgj
+        std::unordered_set<std::string> incomplete;
+    };
+
+    // serial of the last PresenceScanner::rescan() this snapshot covers
+    uint32_t serial = 0;
+    std::string psp_partition;
+
+    // title ids in ux0:app and ux0:psm
+    std::unordered_set<std::string> games;
+    std::unordered_set<std::string> psm_games;
+    // titleid-themeid directories of ux0:theme
+    std::unordered_set<std::string> themes;
+    // titleid/entitlement directories of ux0:addcont
+    std::unordered_set<std::string> dlcs;
+
+    Partition ux0;
+    // empty when the psp partition is ux0:
+    Partition psp;
+
+    bool is_installed(const std::string& titleid) const;
+    bool psm_is_installed(const std::string& titleid) const;
+    bool dlc_is_installed(const std::string& content) const;
+    bool theme_is_installed(const std::string& content) const;
+    bool psp_is_installed(
+            const std::string& partition, const std::string& content) const;
+    bool psx_is_installed(
+            const std::string& partition, const std::string& content) const;
+    bool is_incomplete(
+            const std::string& partition, const std::string& content) const;
+
+private:
+    // null for a partition that wasn't scanned
+    const Partition* get_partition(const std::string& partition) const;
+};
+
+// Lists the installed and partially downloaded content on the task pool. The
+// snapshots are immutable, the main loop polls serial() every frame and
+// only takes the lock when a new one is published.
+//
+// Listings are kept in cache_path with the mtime of their directory, a scan
+// only reads again the directories whose mtime changed or which were passed
+// to pkgi_presence_changed().
+class PresenceScanner
+{
+public:
+    PresenceScanner(const PresenceScanner&) = delete;
+    PresenceScanner(PresenceScanner&&) = delete;
+    PresenceScanner& operator=(const PresenceScanner&) = delete;
+    PresenceScanner& operator=(PresenceScanner&&) = delete;
+
+    PresenceScanner(std::string cache_path, TaskPool* pool);
+    ~PresenceScanner();
+
+    // asks for a new scan, returns the serial of the first snapshot which
+    // will see the changes made until now
+    uint32_t rescan(const std::string& psp_partition);
+    // same but only the directories passed to pkgi_presence_changed() since
+    // the last scan are read again, the rest is taken from the last snapshot.
+    // For the installs of the downloader, which report all they touch
+    uint32_t update(const std::string& psp_partition);
+
+    // serial of the last published snapshot, 0 before the first one
+    uint32_t serial() const
+    {
+        return _published;
+    }
+    // last published snapshot, null before the first one
+    std::shared_ptr<const PresenceSnapshot> snapshot();
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    struct Listing
+    {
+        uint64_t mtime;
+        std::vector<std::string> names;
+    };
+
+    std::string _cache_path;
+    TaskPool* _pool;
+    // only used by the scanning task
+    std::unordered_map<std::string, Listing> _listings;
+    std::unordered_set<std::string> _changed;
+    std::unordered_set<std::string> _seen;
+    bool _listings_dirty = false;
+    bool _listings_loaded = false;
+
+    Mutex _mutex;
+    // psp partition of the pending scan
+    std::optional<std::string> _request;
+    // the pending scan was asked by rescan()
+    bool _full = false;
+    uint32_t _requested = 0;
+    std::atomic<uint32_t> _published{0};
+    std::shared_ptr<const PresenceSnapshot> _snapshot;
+    // scans until there is no request left, there is one at most
+    std::shared_ptr<Task> _task;
+    bool _scanning = false;
+
+    void run(const Task& task);
+    std::shared_ptr<PresenceSnapshot> scan(const std::string& psp_partition);
+    std::shared_ptr<PresenceSnapshot> scan_changed(
+            const PresenceSnapshot& last);
+    void take_changed();
+    void scan_partition(
+            PresenceSnapshot::Partition& out, const std::string& partition);
+    void scan_incomplete(
+            PresenceSnapshot::Partition& out, const std::string& partition);
+    // uses the cached listing of path if it is still valid
+    std::vector<std::string> list(const std::string& path, bool cached = true);
+    void load_listings();
+    void save_listings();
+};
+
+// tells the scanner that an install added to or removed from dir, its cached
+// listing is read again on the next scan even if its mtime didn't change
+void pkgi_presence_changed(const std::string& dir);
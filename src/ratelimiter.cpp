@@ -0,0 +1,60 @@
+#include "ratelimiter.hpp"
+
+#include "pkgi.hpp"
+
+#include <algorithm>
+
+TokenBucket::TokenBucket(const std::string& name, uint64_t rate)
+    : _mutex(name), _rate(rate)
+{
+}
+
+void TokenBucket::set_rate(uint64_t rate)
+{
+    ScopeLock _(_mutex);
+    _rate = rate;
+    // a debt taken at the old rate would hold the new one back
+    _tokens = std::max(_tokens, 0.0);
+}
+
+uint64_t TokenBucket::take(uint64_t bytes)
+{
+    ScopeLock _(_mutex);
+    const auto rate = _rate.load(std::memory_order_relaxed);
+    const auto now = pkgi_time_usec();
+    if (rate == 0)
+    {
+        _refill_usec = now;
+        return 0;
+    }
+
+    _tokens = std::min(
+            _tokens + (now - _refill_usec) * rate / 1e6,
+            static_cast<double>(rate) / 4);
+    _refill_usec = now;
+    _tokens -= bytes;
+    return _tokens < 0 ? static_cast<uint64_t>(-_tokens * 1e6 / rate) : 0;
+}
+
+RateLimitedHttp::RateLimitedHttp(
+        std::unique_ptr<Http> http, std::vector<TokenBucket*> buckets)
+    : PacedHttp(std::move(http)), _buckets(std::move(buckets))
+{
+}
+
+int64_t RateLimitedHttp::read(uint8_t* buffer, uint64_t size)
+{
+    for (const auto bucket : _buckets)
+        size = paced_size(size, bucket->rate());
+
+    const auto read = _http->read(buffer, size);
+    if (read <= 0)
+        return read;
+
+    uint64_t wait = 0;
+    for (const auto bucket : _buckets)
+        wait = std::max(wait, bucket->take(read));
+    sleep_usec(wait);
+    check_aborted();
+    return read;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "pacedhttp.hpp"
+#include "thread.hpp"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+// Token bucket shared by the connections it limits: each byte received takes
+// a token and the tokens come back at rate bytes per second, up to a quarter
+// of a second of them so that an idle connection can't burst for long
+class TokenBucket
+{
+public:
+    TokenBucket(const TokenBucket&) = delete;
+    TokenBucket& operator=(const TokenBucket&) = delete;
+
+    // 0 is unlimited
+    explicit TokenBucket(const std::string& name, uint64_t rate = 0);
+
+    void set_rate(uint64_t rate);
+    uint64_t rate() const
+    {
+        return _rate.load(std::memory_order_relaxed);
+    }
+
+    // takes bytes tokens, going into debt when there aren't enough, and
+    // returns the microseconds the caller must wait for the debt to be paid
+    uint64_t take(uint64_t bytes);
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    Mutex _mutex;
+    std::atomic<uint64_t> _rate;
+    // negative when in debt
+    double _tokens = 0;
+    uint64_t _refill_usec = 0;
+};
+
+// Http decorator that holds the reads back so that each of the buckets stays
+// under its rate, a download passes its own bucket and the one of all the
+// downloads
+class RateLimitedHttp : public PacedHttp
+{
+public:
+    RateLimitedHttp(
+            std::unique_ptr<Http> http, std::vector<TokenBucket*> buckets);
+
+    int64_t read(uint8_t* buffer, uint64_t size) override;
+
+private:
+    std::vector<TokenBucket*> _buckets;
+};
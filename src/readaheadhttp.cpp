@@ -0,0 +1,180 @@
+#include "readaheadhttp.hpp"
+
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+ReadAheadHttp::ReadAheadHttp(std::unique_ptr<Http> http)
+    : _http(std::move(http)), _cond("read_ahead_cond")
+{
+}
+
+ReadAheadHttp::~ReadAheadHttp()
+{
+    if (!_thread)
+        return;
+
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+    }
+    _cond.notify_all();
+    // unblock the reader if it's waiting for the network
+    _http->abort();
+    _thread->join();
+}
+
+void ReadAheadHttp::start(const std::string& url, uint64_t offset)
+{
+    _http->start(url, offset);
+
+    // query these before the reader thread owns the connection, this is also
+    // where a bad status code gets reported
+    _length = _http->get_length();
+    _status = _http->get_status();
+
+    const auto options = pkgi_http_options(url);
+    const auto chunk_size =
+            std::min(options.read_ahead_kb * 1024, MAX_CHUNK_SIZE);
+    _chunks.assign(
+            options.read_ahead_blocks, std::vector<uint8_t>(chunk_size));
+    _chunk_sizes.assign(options.read_ahead_blocks, 0);
+    _memory.set(options.read_ahead_blocks * chunk_size);
+
+    _thread = std::make_unique<Thread>(
+            "http_read_ahead", [this] { run(); }, ThreadRole::Network);
+}
+
+void ReadAheadHttp::run()
+{
+    try
+    {
+        while (true)
+        {
+            size_t index;
+            {
+                ScopeLock _(_cond.get_mutex());
+                while (_filled == _chunks.size() && !_dying)
+                    _cond.wait();
+                if (_dying)
+                    return;
+                index = _write_chunk;
+            }
+
+            // fill the whole chunk so that the consumer gets woken up once
+            // per chunk and not once per network packet
+            auto& chunk = _chunks[index];
+            uint32_t pos = 0;
+            bool eof = false;
+            while (pos < chunk.size())
+            {
+                const auto read =
+                        _http->read(chunk.data() + pos, chunk.size() - pos);
+                if (read == 0)
+                {
+                    eof = true;
+                    break;
+                }
+                pos += read;
+            }
+
+            {
+                ScopeLock _(_cond.get_mutex());
+                if (pos != 0)
+                {
+                    _chunk_sizes[index] = pos;
+                    _write_chunk = (_write_chunk + 1) % _chunks.size();
+                    ++_filled;
+                }
+                _eof = eof;
+            }
+            _cond.notify_all();
+
+            if (eof)
+                return;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("read ahead stopped: {}", e.what());
+        {
+            ScopeLock _(_cond.get_mutex());
+            _error = std::current_exception();
+        }
+        _cond.notify_all();
+    }
+}
+
+int64_t ReadAheadHttp::read(uint8_t* buffer, uint64_t size)
+{
+    const auto slice =
+            borrow(static_cast<uint32_t>(min64(size, MAX_CHUNK_SIZE)));
+    memcpy(buffer, slice.data, slice.size);
+    give_back(slice);
+    return slice.size;
+}
+
+HttpSlice ReadAheadHttp::borrow(uint32_t size)
+{
+    size_t index;
+    {
+        ScopeLock _(_cond.get_mutex());
+        while (_filled == 0 && !_eof && !_error)
+            _cond.wait();
+
+        if (_filled == 0)
+        {
+            if (_error)
+                std::rethrow_exception(_error);
+            return {};
+        }
+
+        index = _read_chunk;
+    }
+
+    // the reader doesn't touch filled chunks, the caller can have it without
+    // holding the lock
+    return {_chunks[index].data() + _read_pos,
+            std::min(_chunk_sizes[index] - _read_pos, size)};
+}
+
+void ReadAheadHttp::give_back(const HttpSlice& slice)
+{
+    // the end of the stream
+    if (slice.size == 0)
+        return;
+
+    _read_pos += slice.size;
+    if (_read_pos != _chunk_sizes[_read_chunk])
+        return;
+
+    {
+        ScopeLock _(_cond.get_mutex());
+        _read_pos = 0;
+        _read_chunk = (_read_chunk + 1) % _chunks.size();
+        --_filled;
+    }
+    _cond.notify_all();
+}
+
+void ReadAheadHttp::abort()
+{
+    _http->abort();
+}
+
+int ReadAheadHttp::get_status()
+{
+    return _status;
+}
+
+int64_t ReadAheadHttp::get_length()
+{
+    return _length;
+}
+
+ReadAheadHttp::operator bool() const
+{
+    return static_cast<bool>(*_http);
+}
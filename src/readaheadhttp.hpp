@@ -0,0 +1,60 @@
+#pragma once
+
+#include "http.hpp"
+#include "httpoptions.hpp"
+#include "memstats.hpp"
+#include "thread.hpp"
+
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Http decorator that reads the wrapped stream on its own thread into a
+// bounded ring of buffers, so that the network keeps receiving while the
+// caller hashes, decrypts and writes the previous chunks. borrow() lends the
+// chunks themselves, so the caller can work on them without a copy. The
+// size and the number of chunks are the HttpOptions of the host
+class ReadAheadHttp : public Http
+{
+public:
+    // the most a chunk can be, see HttpOptions::read_ahead_kb
+    static constexpr uint32_t MAX_CHUNK_SIZE = 1024 * 1024;
+
+    ReadAheadHttp(std::unique_ptr<Http> http);
+    ~ReadAheadHttp();
+
+    void start(const std::string& url, uint64_t offset) override;
+    int64_t read(uint8_t* buffer, uint64_t size) override;
+    HttpSlice borrow(uint32_t size) override;
+    void give_back(const HttpSlice& slice) override;
+    void abort() override;
+
+    int get_status() override;
+    int64_t get_length() override;
+
+    explicit operator bool() const override;
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    std::unique_ptr<Http> _http;
+    int _status = 0;
+    int64_t _length = 0;
+
+    Cond _cond;
+    std::vector<std::vector<uint8_t>> _chunks;
+    std::vector<uint32_t> _chunk_sizes;
+    MemoryCharge _memory{MemPool::Download};
+    size_t _read_chunk = 0;
+    uint32_t _read_pos = 0;
+    size_t _write_chunk = 0;
+    size_t _filled = 0;
+    bool _eof = false;
+    bool _dying = false;
+    std::exception_ptr _error;
+
+    std::unique_ptr<Thread> _thread;
+
+    void run();
+};
@@ -0,0 +1,88 @@
+#include "recordinghttp.hpp"
+
+RecordingHttp::RecordingHttp(
+        std::unique_ptr<Http> http, HttpTraceWriter* trace)
+    : _http(std::move(http))
+    , _trace(trace)
+    , _connection(trace->new_connection())
+{
+}
+
+void RecordingHttp::start(const std::string& url, uint64_t offset)
+{
+    _trace->start(_connection, offset, 0);
+    try
+    {
+        _http->start(url, offset);
+    }
+    catch (const std::exception&)
+    {
+        _trace->error(_connection);
+        throw;
+    }
+}
+
+void RecordingHttp::start_range(
+        const std::string& url, uint64_t offset, uint64_t end)
+{
+    _trace->start(_connection, offset, end);
+    try
+    {
+        _http->start_range(url, offset, end);
+    }
+    catch (const std::exception&)
+    {
+        _trace->error(_connection);
+        throw;
+    }
+}
+
+int64_t RecordingHttp::read(uint8_t* buffer, uint64_t size)
+{
+    int64_t read;
+    try
+    {
+        read = _http->read(buffer, size);
+    }
+    catch (const std::exception&)
+    {
+        _trace->error(_connection);
+        throw;
+    }
+    if (read > 0)
+        _trace->read(_connection, read);
+    else
+        _trace->end(_connection);
+    return read;
+}
+
+void RecordingHttp::abort()
+{
+    _http->abort();
+}
+
+int RecordingHttp::get_status()
+{
+    return _http->get_status();
+}
+
+int64_t RecordingHttp::get_length()
+{
+    return _http->get_length();
+}
+
+void RecordingHttp::add_request_header(
+        const std::string& name, const std::string& value)
+{
+    _http->add_request_header(name, value);
+}
+
+std::string RecordingHttp::get_response_header(const std::string& name)
+{
+    return _http->get_response_header(name);
+}
+
+RecordingHttp::operator bool() const
+{
+    return static_cast<bool>(*_http);
+}
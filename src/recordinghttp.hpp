@@ -0,0 +1,36 @@
+#pragma once
+
+#include "http.hpp"
+#include "httptrace.hpp"
+
+#include <memory>
+
+// Http decorator that writes the requests of the wrapped stream to a trace,
+// the size and time of each read and where the connection broke, to replay
+// a real download on the host through the "trace" of a NetworkProfile
+class RecordingHttp : public Http
+{
+public:
+    // trace must outlive the decorator
+    RecordingHttp(std::unique_ptr<Http> http, HttpTraceWriter* trace);
+
+    void start(const std::string& url, uint64_t offset) override;
+    void start_range(
+            const std::string& url, uint64_t offset, uint64_t end) override;
+    int64_t read(uint8_t* buffer, uint64_t size) override;
+    void abort() override;
+
+    int get_status() override;
+    int64_t get_length() override;
+
+    void add_request_header(
+            const std::string& name, const std::string& value) override;
+    std::string get_response_header(const std::string& name) override;
+
+    explicit operator bool() const override;
+
+private:
+    std::unique_ptr<Http> _http;
+    HttpTraceWriter* _trace;
+    uint32_t _connection;
+};
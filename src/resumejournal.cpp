@@ -0,0 +1,146 @@
+#include "resumejournal.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "sha256.hpp"
+#include "utils.hpp"
+
+#include <cstring>
+
+static std::string tmp_path(const std::string& path)
+{
+    return path + ".tmp";
+}
+
+static void checksum(const uint8_t* data, uint32_t size, uint8_t* out)
+{
+    sha256_ctx sha;
+    sha256_init(&sha);
+    sha256_update(&sha, data, size);
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256_finish(&sha, digest);
+    memcpy(out, digest, ResumeJournal::CHECKSUM_SIZE);
+}
+
+ResumeJournal::~ResumeJournal()
+{
+    close();
+}
+
+void ResumeJournal::open(const std::string& path)
+{
+    close();
+    _path = path;
+    _records = 0;
+    _last.clear();
+}
+
+void ResumeJournal::append(const std::vector<uint8_t>& payload)
+{
+    std::vector<uint8_t> record(4 + payload.size() + CHECKSUM_SIZE);
+    set32le(record.data(), MAGIC);
+    memcpy(record.data() + 4, payload.data(), payload.size());
+    checksum(record.data(),
+             4 + payload.size(),
+             record.data() + 4 + payload.size());
+
+    _last = std::move(record);
+    if (!_file || _records >= MAX_RECORDS)
+        compact();
+    else
+        write(_last);
+}
+
+void ResumeJournal::compact()
+{
+    if (_last.empty() || (_file && _records == 1))
+        return;
+
+    if (_file)
+        pkgi_close(_file);
+    _file = nullptr;
+    _records = 0;
+
+    // the old journal stays whole until the new one is written, see load()
+    const auto tmp = tmp_path(_path);
+    _file = pkgi_create(tmp);
+    if (!_file)
+        throw formatEx<std::runtime_error>("无法创建 {}", tmp);
+    write(_last);
+    pkgi_close(_file);
+    _file = nullptr;
+    pkgi_rename(tmp, _path);
+
+    _file = pkgi_append(_path.c_str());
+    if (!_file)
+        throw formatEx<std::runtime_error>("无法打开 {}", _path);
+}
+
+void ResumeJournal::write(const std::vector<uint8_t>& record)
+{
+    if (pkgi_write(_file, record.data(), record.size()) !=
+        static_cast<int>(record.size()))
+        throw formatEx<std::runtime_error>("写入 {} 失败", _path);
+    ++_records;
+}
+
+void ResumeJournal::close()
+{
+    if (_file)
+    {
+        pkgi_close(_file);
+        _file = nullptr;
+    }
+}
+
+std::optional<std::vector<uint8_t>> ResumeJournal::load(
+        const std::string& path, uint32_t payload_size)
+{
+    std::optional<std::vector<uint8_t>> payload;
+    if (pkgi_file_exists(path))
+        payload = load_file(path, payload_size);
+    const auto tmp = tmp_path(path);
+    if (!payload && pkgi_file_exists(tmp))
+        payload = load_file(tmp, payload_size);
+    return payload;
+}
+
+bool ResumeJournal::exists(const std::string& path)
+{
+    return pkgi_file_exists(path) || pkgi_file_exists(tmp_path(path));
+}
+
+void ResumeJournal::remove(const std::string& path)
+{
+    pkgi_rm(path.c_str());
+    const auto tmp = tmp_path(path);
+    if (pkgi_file_exists(tmp))
+        pkgi_rm(tmp.c_str());
+}
+
+std::optional<std::vector<uint8_t>> ResumeJournal::load_file(
+        const std::string& path, uint32_t payload_size)
+{
+    const auto data = pkgi_load(path);
+    const uint32_t record_size = 4 + payload_size + CHECKSUM_SIZE;
+
+    const uint8_t* last = nullptr;
+    size_t count = 0;
+    for (size_t pos = 0; pos + record_size <= data.size(); pos += record_size)
+    {
+        const auto record = data.data() + pos;
+        uint8_t sum[CHECKSUM_SIZE];
+        checksum(record, 4 + payload_size, sum);
+        // a torn or foreign record ends the journal
+        if (get32le(record) != MAGIC ||
+            memcmp(sum, record + 4 + payload_size, CHECKSUM_SIZE) != 0)
+            break;
+        last = record;
+        ++count;
+    }
+
+    LOGF("{} valid records in {}", count, path);
+    if (!last)
+        return std::nullopt;
+    return std::vector<uint8_t>(last + 4, last + 4 + payload_size);
+}
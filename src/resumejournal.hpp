@@ -0,0 +1,53 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+// Append-only log of fixed size checkpoint records. Each record is a magic
+// number, the payload and a truncated SHA-256 of both, so a record torn by a
+// crash is detected and the previous one is used instead. The file is
+// rewritten with only the last record when it gets long and when the
+// download is done.
+class ResumeJournal
+{
+public:
+    static constexpr uint32_t MAGIC = 0x524a4b50; // "PKJR"
+    static constexpr uint32_t CHECKSUM_SIZE = 8;
+    static constexpr uint32_t MAX_RECORDS = 256;
+
+    ResumeJournal(const ResumeJournal&) = delete;
+    ResumeJournal& operator=(const ResumeJournal&) = delete;
+
+    ResumeJournal() = default;
+    ~ResumeJournal();
+
+    // the first append after open() compacts the file
+    void open(const std::string& path);
+    void append(const std::vector<uint8_t>& payload);
+    void compact();
+    void close();
+
+    // returns the payload of the last valid record, payloads must be
+    // payload_size long. Falls back to the file compact() writes first when
+    // path is missing or has no valid record, pkgi_rename removes the target
+    // before renaming on the Vita and a crash in between leaves only that one
+    static std::optional<std::vector<uint8_t>> load(
+            const std::string& path, uint32_t payload_size);
+    // whether load() has a file to read
+    static bool exists(const std::string& path);
+    // removes the journal at path and what compact() may have left of it
+    static void remove(const std::string& path);
+
+private:
+    std::string _path;
+    void* _file = nullptr;
+    uint32_t _records = 0;
+    std::vector<uint8_t> _last;
+
+    void write(const std::vector<uint8_t>& record);
+    static std::optional<std::vector<uint8_t>> load_file(
+            const std::string& path, uint32_t payload_size);
+};
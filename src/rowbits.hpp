@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+// A set of rows of a list, a bit per row, so that the filters combine and
+// count a word of 64 rows at a time.
+class RowBits
+{
+public:
+    RowBits() = default;
+
+    explicit RowBits(size_t size, bool value = false)
+        : _words((size + 63) / 64, value ? ~uint64_t(0) : 0), _size(size)
+    {
+        // the bits past the last row stay clear for count()
+        if (value && size % 64)
+            _words.back() = (uint64_t(1) << (size % 64)) - 1;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool test(size_t row) const
+    {
+        return _words[row / 64] >> (row % 64) & 1;
+    }
+
+    void set(size_t row)
+    {
+        _words[row / 64] |= uint64_t(1) << (row % 64);
+    }
+
+    // both must have the same size
+    RowBits& operator&=(const RowBits& other)
+    {
+        for (size_t i = 0; i < _words.size(); ++i)
+            _words[i] &= other._words[i];
+        return *this;
+    }
+
+    RowBits& operator|=(const RowBits& other)
+    {
+        for (size_t i = 0; i < _words.size(); ++i)
+            _words[i] |= other._words[i];
+        return *this;
+    }
+
+    size_t count() const
+    {
+        size_t count = 0;
+        for (const auto word : _words)
+            count += __builtin_popcountll(word);
+        return count;
+    }
+
+    size_t memory_size() const
+    {
+        return _words.capacity() * sizeof(uint64_t);
+    }
+
+private:
+    std::vector<uint64_t> _words;
+    size_t _size = 0;
+};
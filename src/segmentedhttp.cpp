@@ -0,0 +1,232 @@
+#include "segmentedhttp.hpp"
+
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <fmt/format.h>
+
+#include <boost/scope_exit.hpp>
+
+#include <cstring>
+
+SegmentedHttp::SegmentedHttp(HttpFactory factory, size_t connections)
+    : _factory(std::move(factory))
+    , _connection_count(std::min(connections, MAX_CONNECTIONS))
+    , _cond("segmented_http_cond")
+{
+}
+
+SegmentedHttp::~SegmentedHttp()
+{
+    abort();
+    for (auto& worker : _workers)
+        worker->join();
+}
+
+void SegmentedHttp::start(const std::string& url, uint64_t offset)
+{
+    if (_started)
+        throw HttpError("HTTP连接已启动");
+
+    // the first request tells us the length, and it will serve the first
+    // segment since it is already open
+    _first = _factory();
+    _first->start(url, offset);
+    _length = _first->get_length();
+    _status = _first->get_status();
+    _started = true;
+
+    _url = url;
+    _base = offset;
+    _end = offset + _length;
+    _segment_count = (_length + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+
+    if (_connection_count < 2 || _segment_count < 2)
+    {
+        LOG("body too small to be segmented, using a single connection");
+        return;
+    }
+
+    LOGF("segmented download of {} bytes in {} segments over {} connections",
+         _length,
+         _segment_count,
+         _connection_count);
+
+    _segments.resize(WINDOW_SIZE);
+    for (auto& segment : _segments)
+        segment.data.resize(SEGMENT_SIZE);
+    _connections.resize(_connection_count);
+
+    for (size_t i = 0; i < _connection_count; ++i)
+        _workers.push_back(std::make_unique<Thread>(
+                fmt::format("http_segment_{}", i),
+                [this, i] { run(i); },
+                ThreadRole::Network));
+}
+
+uint32_t SegmentedHttp::segment_size(size_t segment) const
+{
+    return min64(SEGMENT_SIZE, _end - (_base + segment * SEGMENT_SIZE));
+}
+
+void SegmentedHttp::run(size_t worker)
+{
+    while (true)
+    {
+        size_t segment;
+        {
+            ScopeLock _(_cond.get_mutex());
+            while (!_aborted && _next_segment < _segment_count &&
+                   _next_segment >= _read_segment + WINDOW_SIZE)
+                _cond.wait();
+            if (_aborted || _next_segment == _segment_count)
+                return;
+            segment = _next_segment++;
+        }
+
+        download_segment(worker, segment);
+    }
+}
+
+void SegmentedHttp::download_segment(size_t worker, size_t index)
+{
+    // the slot is free, the segment that used it before was consumed
+    auto& segment = _segments[index % WINDOW_SIZE];
+    const auto begin = _base + index * SEGMENT_SIZE;
+    const auto size = segment_size(index);
+
+    try
+    {
+        std::unique_ptr<Http> http =
+                index == 0 ? std::move(_first) : _factory();
+
+        {
+            ScopeLock _(_cond.get_mutex());
+            if (_aborted)
+                return;
+            _connections[worker] = http.get();
+        }
+        BOOST_SCOPE_EXIT_ALL(&)
+        {
+            ScopeLock _(_cond.get_mutex());
+            _connections[worker] = nullptr;
+        };
+
+        if (index != 0)
+        {
+            http->start_range(_url, begin, begin + size);
+            if (http->get_status() != 206)
+                throw formatEx<HttpError>(
+                        "服务器不支持分段下载, HTTP状态: {}",
+                        http->get_status());
+        }
+
+        uint32_t received = 0;
+        while (received < size)
+        {
+            const auto read = http->read(
+                    segment.data.data() + received,
+                    min32(size - received, 64 * 1024));
+            if (read == 0)
+                throw HttpError("分段下载连接意外断开");
+            received += read;
+
+            {
+                ScopeLock _(_cond.get_mutex());
+                segment.received = received;
+            }
+            _cond.notify_all();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("segment {} @ {} failed: {}", index, begin, e.what());
+        {
+            ScopeLock _(_cond.get_mutex());
+            segment.error = std::current_exception();
+        }
+        _cond.notify_all();
+    }
+}
+
+int64_t SegmentedHttp::read(uint8_t* buffer, uint64_t size)
+{
+    if (_workers.empty())
+        return _first->read(buffer, size);
+
+    size_t index;
+    uint32_t available;
+    {
+        ScopeLock _(_cond.get_mutex());
+        if (_read_segment == _segment_count)
+            return 0;
+
+        auto& segment = _segments[_read_segment % WINDOW_SIZE];
+        while (segment.received == _read_pos && !segment.error && !_aborted)
+            _cond.wait();
+
+        if (segment.received == _read_pos)
+        {
+            if (segment.error)
+                std::rethrow_exception(segment.error);
+            throw HttpError("下载已中止");
+        }
+
+        index = _read_segment % WINDOW_SIZE;
+        available = segment.received - _read_pos;
+    }
+
+    // workers only append past received, what's before it is stable
+    auto& segment = _segments[index];
+    const auto read = static_cast<uint32_t>(min64(available, size));
+    memcpy(buffer, segment.data.data() + _read_pos, read);
+    _read_pos += read;
+
+    if (_read_pos == segment_size(_read_segment))
+    {
+        {
+            ScopeLock _(_cond.get_mutex());
+            segment.received = 0;
+            segment.error = nullptr;
+            _read_pos = 0;
+            ++_read_segment;
+        }
+        _cond.notify_all();
+    }
+
+    return read;
+}
+
+void SegmentedHttp::abort()
+{
+    if (_workers.empty())
+    {
+        if (_first)
+            _first->abort();
+        return;
+    }
+
+    {
+        ScopeLock _(_cond.get_mutex());
+        _aborted = true;
+        for (const auto http : _connections)
+            if (http)
+                http->abort();
+    }
+    _cond.notify_all();
+}
+
+int SegmentedHttp::get_status()
+{
+    return _status;
+}
+
+int64_t SegmentedHttp::get_length()
+{
+    return _length;
+}
+
+SegmentedHttp::operator bool() const
+{
+    return _started;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "http.hpp"
+#include "thread.hpp"
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Http implementation that splits the body into fixed size segments fetched
+// over several connections with Range requests. Segments land in a bounded
+// reorder window and are handed out in order, so that callers still see one
+// sequential stream. This gets around CDNs throttling each connection.
+class SegmentedHttp : public Http
+{
+public:
+    using HttpFactory = std::function<std::unique_ptr<Http>()>;
+
+    static constexpr uint32_t SEGMENT_SIZE = 1024 * 1024;
+    static constexpr size_t WINDOW_SIZE = 8;
+    static constexpr size_t MAX_CONNECTIONS = 4;
+
+    SegmentedHttp(HttpFactory factory, size_t connections);
+    ~SegmentedHttp();
+
+    void start(const std::string& url, uint64_t offset) override;
+    int64_t read(uint8_t* buffer, uint64_t size) override;
+    void abort() override;
+
+    int get_status() override;
+    int64_t get_length() override;
+
+    explicit operator bool() const override;
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    struct Segment
+    {
+        std::vector<uint8_t> data;
+        uint32_t received = 0;
+        std::exception_ptr error;
+    };
+
+    HttpFactory _factory;
+    size_t _connection_count;
+
+    std::string _url;
+    bool _started = false;
+    int _status = 0;
+    int64_t _length = 0;
+    uint64_t _base = 0;
+    uint64_t _end = 0;
+
+    Cond _cond;
+    // used for the first segment, and for everything when the body is too
+    // small to be worth splitting
+    std::unique_ptr<Http> _first;
+    std::vector<Http*> _connections;
+    std::vector<Segment> _segments;
+    size_t _segment_count = 0;
+    size_t _next_segment = 0;
+    size_t _read_segment = 0;
+    uint32_t _read_pos = 0;
+    bool _aborted = false;
+
+    std::vector<std::unique_ptr<Thread>> _workers;
+
+    uint32_t segment_size(size_t segment) const;
+    void run(size_t worker);
+    void download_segment(size_t worker, size_t segment);
+};
@@ -25,7 +25,10 @@ struct SfoEntry
     uint32_t dataofs;
 } __attribute__((packed));
 
-std::string pkgi_sfo_get_string(
+namespace
+{
+// the value of the entry name, null when there is none
+const uint8_t* find_value(
         const uint8_t* buffer, size_t size, const std::string& name)
 {
     if (size < sizeof(SfoHeader))
@@ -44,8 +47,29 @@ std::string pkgi_sfo_get_string(
     for (uint32_t i = 0; i < header->count; i++)
         if (std::string(reinterpret_cast<const char*>(
                     buffer + header->keyofs + entries[i].nameofs)) == name)
-            return std::string(reinterpret_cast<const char*>(
-                    buffer + header->valofs + entries[i].dataofs));
+            return buffer + header->valofs + entries[i].dataofs;
 
-    return {};
+    return nullptr;
+}
+}
+
+std::string pkgi_sfo_get_string(
+        const uint8_t* buffer, size_t size, const std::string& name)
+{
+    const auto value = find_value(buffer, size, name);
+    if (!value)
+        return {};
+    return std::string(reinterpret_cast<const char*>(value));
+}
+
+uint32_t pkgi_sfo_get_int(
+        const uint8_t* buffer, size_t size, const std::string& name)
+{
+    const auto value = find_value(buffer, size, name);
+    if (!value)
+        return 0;
+    if (value + 4 > buffer + size)
+        throw std::runtime_error("param.sfo不完整");
+    return value[0] | (value[1] << 8) | (value[2] << 16) |
+           (uint32_t(value[3]) << 24);
 }
@@ -5,3 +5,6 @@
 
 std::string pkgi_sfo_get_string(
         const uint8_t* buffer, size_t size, const std::string& name);
+// the value of an integer entry, 0 when there is none
+uint32_t pkgi_sfo_get_int(
+        const uint8_t* buffer, size_t size, const std::string& name);
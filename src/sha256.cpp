@@ -148,7 +148,7 @@ static inline uint32_t Gamma1(uint32_t x)
         x3 = q0;                               \
     } while (0)
 
-static void sha256_process(
+static void sha256_process_neon(
         uint32_t* state, const uint8_t* buffer, uint32_t blocks)
 {
     for (uint32_t i = 0; i < blocks; i++)
@@ -205,9 +205,11 @@ static void sha256_process(
     }
 }
 
-#else
+#endif
 
-static void sha256_process(
+// always built so that sha256_update_scalar() can be benchmarked against the
+// NEON version
+static void sha256_process_scalar(
         uint32_t* state, const uint8_t* buffer, uint32_t blocks)
 {
     for (uint32_t i = 0; i < blocks; i++)
@@ -248,7 +250,15 @@ static void sha256_process(
     }
 }
 
+static void sha256_process(
+        uint32_t* state, const uint8_t* buffer, uint32_t blocks)
+{
+#if __ARM_NEON__
+    sha256_process_neon(state, buffer, blocks);
+#else
+    sha256_process_scalar(state, buffer, blocks);
 #endif
+}
 
 void sha256_init(sha256_ctx* ctx)
 {
@@ -263,7 +273,11 @@ void sha256_init(sha256_ctx* ctx)
     ctx->state[7] = 0x5be0cd19;
 }
 
-void sha256_update(sha256_ctx* ctx, const uint8_t* buffer, uint32_t size)
+static inline void sha256_update_with(
+        sha256_ctx* ctx,
+        const uint8_t* buffer,
+        uint32_t size,
+        void (*process)(uint32_t*, const uint8_t*, uint32_t))
 {
     if (size == 0)
     {
@@ -277,7 +291,7 @@ void sha256_update(sha256_ctx* ctx, const uint8_t* buffer, uint32_t size)
     if (left && size >= fill)
     {
         memcpy(ctx->buffer + left, buffer, fill);
-        sha256_process(ctx->state, ctx->buffer, 1);
+        process(ctx->state, ctx->buffer, 1);
         buffer += fill;
         size -= fill;
         left = 0;
@@ -286,7 +300,7 @@ void sha256_update(sha256_ctx* ctx, const uint8_t* buffer, uint32_t size)
     uint32_t full = size / SHA256_BLOCK_SIZE;
     if (full != 0)
     {
-        sha256_process(ctx->state, buffer, full);
+        process(ctx->state, buffer, full);
         uint32_t used = full * SHA256_BLOCK_SIZE;
         buffer += used;
         size -= used;
@@ -295,6 +309,17 @@ void sha256_update(sha256_ctx* ctx, const uint8_t* buffer, uint32_t size)
     memcpy(ctx->buffer + left, buffer, size);
 }
 
+void sha256_update(sha256_ctx* ctx, const uint8_t* buffer, uint32_t size)
+{
+    sha256_update_with(ctx, buffer, size, sha256_process);
+}
+
+void sha256_update_scalar(
+        sha256_ctx* ctx, const uint8_t* buffer, uint32_t size)
+{
+    sha256_update_with(ctx, buffer, size, sha256_process_scalar);
+}
+
 void sha256_finish(sha256_ctx* ctx, uint8_t* digest)
 {
     static const uint8_t padding[SHA256_BLOCK_SIZE] = {0x80};
@@ -16,6 +16,10 @@ typedef struct
 
 void sha256_init(sha256_ctx* ctx);
 void sha256_update(sha256_ctx* ctx, const uint8_t* buffer, uint32_t size);
+// portable implementation, sha256_update uses the NEON message schedule when
+// built with __ARM_NEON__
+void sha256_update_scalar(
+        sha256_ctx* ctx, const uint8_t* buffer, uint32_t size);
 void sha256_finish(sha256_ctx* ctx, uint8_t* digest);
 void sha256_vector(
         size_t num_elem,
@@ -1,4 +1,6 @@
 #include "pkgi.hpp"
+#include "file.hpp"
+#include "memstats.hpp"
 extern "C"
 {
 #include "style.h"
@@ -18,6 +20,7 @@ extern "C"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -25,13 +28,9 @@ extern "C"
 #define PKGI_FOLDER "pkgi"
 #define PKGI_APP_FOLDER "app"
 
-void pkgi_log(const char* msg, ...)
+void pkgi_log_write(const char* text, uint32_t size)
 {
-    va_list args;
-    va_start(args, msg);
-    vprintf(msg, args);
-    printf("\n");
-    va_end(args);
+    fwrite(text, 1, size, stdout);
 }
 
 int pkgi_snprintf(char* buffer, uint32_t size, const char* msg, ...)
@@ -101,6 +100,48 @@ int pkgi_file_exists(const std::string& path)
     return stat(path.c_str(), &s) == 0;
 }
 
+InodeType pkgi_get_inode_type(const std::string& path)
+{
+    struct stat s;
+    if (stat(path.c_str(), &s) < 0)
+    {
+        if (errno == ENOENT)
+            return InodeType::NotExist;
+        throw formatEx<std::runtime_error>(
+                "failed to stat {}: {}", path, strerror(errno));
+    }
+    if (S_ISDIR(s.st_mode))
+        return InodeType::Directory;
+    if (S_ISREG(s.st_mode))
+        return InodeType::File;
+    throw formatEx<std::runtime_error>("unknown inode type {}", path);
+}
+
+int64_t pkgi_get_size(const char* path)
+{
+    struct stat s;
+    if (stat(path, &s) < 0)
+        return -1;
+    return s.st_size;
+}
+
+uint64_t pkgi_get_free_space(const char*)
+{
+    // the host build writes relative to the current directory
+    struct statvfs s;
+    if (statvfs(".", &s) < 0)
+        return UINT64_MAX;
+    return static_cast<uint64_t>(s.f_bavail) * s.f_frsize;
+}
+
+uint64_t pkgi_get_total_space(const char*)
+{
+    struct statvfs s;
+    if (statvfs(".", &s) < 0)
+        return 0;
+    return static_cast<uint64_t>(s.f_blocks) * s.f_frsize;
+}
+
 void pkgi_rename(const std::string& from, const std::string& to)
 {
     int res = rename(from.c_str(), to.c_str());
@@ -112,6 +153,25 @@ void pkgi_rename(const std::string& from, const std::string& to)
                 strerror(errno)));
 }
 
+std::vector<std::string> pkgi_list_dir_contents(const std::string& path)
+{
+    DIR* dfd = opendir(path.c_str());
+    if (!dfd && errno == ENOENT)
+        return {};
+    if (!dfd)
+        throw formatEx<std::runtime_error>(
+                "无法打开 ({}): {}", path, strerror(errno));
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        closedir(dfd);
+    };
+
+    std::vector<std::string> out;
+    while (struct dirent* dir = readdir(dfd))
+        out.push_back(dir->d_name);
+    return out;
+}
+
 void pkgi_mkdirs(const char* ppath)
 {
     std::string path = ppath;
@@ -137,6 +197,16 @@ void pkgi_mkdirs(const char* ppath)
     }
 }
 
+void pkgi_mkdir(const char* path)
+{
+    int err = mkdir(path, 0777);
+    if (err < 0 && errno != EEXIST)
+        throw std::runtime_error(fmt::format(
+                "新建文件夹 ({}) 失败: {:#08x}",
+                path,
+                static_cast<uint32_t>(err)));
+}
+
 void pkgi_rm(const char* file)
 {
     unlink(file);
@@ -309,6 +379,15 @@ void* pkgi_create(const std::string& path)
     return (void*)(intptr_t)fd;
 }
 
+void* pkgi_open(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    return (void*)(intptr_t)fd;
+}
+
 void* pkgi_openrw(const char* path)
 {
     int fd = open(path, O_RDWR, 0777);
@@ -318,6 +397,15 @@ void* pkgi_openrw(const char* path)
     return (void*)(intptr_t)fd;
 }
 
+void* pkgi_append(const char* path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0)
+        return NULL;
+
+    return (void*)(intptr_t)fd;
+}
+
 int64_t pkgi_seek(void* f, uint64_t offset)
 {
     return lseek((intptr_t)f, offset, SEEK_SET);
@@ -337,6 +425,13 @@ int pkgi_write(void* f, const void* buffer, uint32_t size)
     return wrote;
 }
 
+void pkgi_preallocate(void* f, uint64_t size)
+{
+    const int err = posix_fallocate((intptr_t)f, 0, size);
+    if (err != 0)
+        LOGF("cannot preallocate {} bytes: {}", size, strerror(err));
+}
+
 void pkgi_close(void* f)
 {
     close((intptr_t)f);
@@ -346,3 +441,88 @@ uint32_t pkgi_time_msec()
 {
     return time(NULL) * 1000;
 }
+
+uint64_t pkgi_time_usec()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+void pkgi_sleep(uint32_t msec)
+{
+    usleep(msec * 1000);
+}
+
+void pkgi_poll_memory_pools()
+{
+    // the host has no fixed pools
+}
+
+namespace
+{
+DrawCounters draw_counters;
+
+// a font of fixed advances, the CJK characters twice as wide
+int measure(const char* text)
+{
+    ++draw_counters.text_measures;
+    int width = 0;
+    for (; *text; ++text)
+        if ((*text & 0xc0) != 0x80)
+            width += static_cast<uint8_t>(*text) < 0x80 ? 10 : 20;
+    return width;
+}
+}
+
+// nothing is drawn on the host, the calls are counted
+
+void pkgi_draw_texture(pkgi_texture, int, int)
+{
+    ++draw_counters.draws;
+}
+
+void pkgi_draw_texture_scaled(pkgi_texture, int, int, int, int)
+{
+    ++draw_counters.draws;
+}
+
+void pkgi_clip_set(int, int, int, int)
+{
+}
+
+void pkgi_clip_remove(void)
+{
+}
+
+void pkgi_draw_rect(int, int, int, int, uint32_t)
+{
+    ++draw_counters.draws;
+}
+
+void pkgi_draw_text(int, int, uint32_t, const char*)
+{
+    ++draw_counters.draws;
+}
+
+int pkgi_text_width(const char* text)
+{
+    return measure(text);
+}
+
+int pkgi_text_height(const char*)
+{
+    return 20;
+}
+
+uint32_t pkgi_font_serial(void)
+{
+    return 1;
+}
+
+DrawCounters pkgi_take_draw_counters()
+{
+    const auto counters = draw_counters;
+    draw_counters = {};
+    return counters;
+}
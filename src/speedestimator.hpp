@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+// Exponentially weighted average of a transfer rate, so that the speed shown
+// and the ETAs don't follow each burst and stall of the network. A sample
+// weighs by the time it covers, a sample of TAU_MSEC counts for 63%.
+class SpeedEstimator
+{
+public:
+    static constexpr uint32_t TAU_MSEC = 5000;
+
+    // a first guess, from the history of the host, the samples take over
+    // from it in a few seconds
+    void seed(uint64_t bytes_per_second)
+    {
+        _speed = bytes_per_second;
+        _valid = bytes_per_second != 0;
+    }
+
+    // bytes were transferred over msec
+    void add(uint64_t bytes, uint32_t msec)
+    {
+        if (msec == 0)
+            return;
+        const double sample = bytes * 1000.0 / msec;
+        if (!_valid)
+        {
+            _speed = sample;
+            _valid = true;
+            return;
+        }
+        const auto alpha = 1 - std::exp(-static_cast<double>(msec) / TAU_MSEC);
+        _speed += alpha * (sample - _speed);
+    }
+
+    // bytes per second, 0 when unknown
+    uint64_t speed() const
+    {
+        return _valid ? static_cast<uint64_t>(_speed) : 0;
+    }
+
+    // seconds left to transfer bytes, 0 when unknown
+    uint64_t eta(uint64_t bytes) const
+    {
+        const auto s = speed();
+        return s ? (bytes + s - 1) / s : 0;
+    }
+
+private:
+    double _speed = 0;
+    bool _valid = false;
+};
@@ -0,0 +1,121 @@
+#include "stagestats.hpp"
+
+#include "pkgi.hpp"
+#include "trace.hpp"
+
+#include <fmt/format.h>
+
+const char* stage_name(Stage stage)
+{
+    switch (stage)
+    {
+    case Stage::Http:
+        return "HTTP";
+    case Stage::Sha256:
+        return "SHA-256";
+    case Stage::AesCtr:
+        return "AES-CTR";
+    case Stage::PspDecrypt:
+        return "PSP解密";
+    case Stage::Lzrc:
+        return "LZRC";
+    case Stage::Write:
+        return "写入";
+    case Stage::Checkpoint:
+        return "存档";
+    case Stage::IsoCompress:
+        return "ISO压缩";
+    case Stage::Count:
+        break;
+    }
+    return "?";
+}
+
+const char* stage_id(Stage stage)
+{
+    switch (stage)
+    {
+    case Stage::Http:
+        return "http";
+    case Stage::Sha256:
+        return "sha256";
+    case Stage::AesCtr:
+        return "aes_ctr";
+    case Stage::PspDecrypt:
+        return "psp_decrypt";
+    case Stage::Lzrc:
+        return "lzrc";
+    case Stage::Write:
+        return "write";
+    case Stage::Checkpoint:
+        return "checkpoint";
+    case Stage::IsoCompress:
+        return "iso_compress";
+    case Stage::Count:
+        break;
+    }
+    return "unknown";
+}
+
+StageTotals StageStats::totals() const
+{
+    StageTotals totals;
+    for (size_t i = 0; i < STAGE_COUNT; ++i)
+    {
+        totals.usec[i] = _usec[i].load(std::memory_order_relaxed);
+        totals.bytes[i] = _bytes[i].load(std::memory_order_relaxed);
+    }
+    return totals;
+}
+
+void StageStats::reset()
+{
+    for (size_t i = 0; i < STAGE_COUNT; ++i)
+    {
+        _usec[i] = 0;
+        _bytes[i] = 0;
+    }
+}
+
+std::string pkgi_format_stage_totals(const StageTotals& totals)
+{
+    std::string text;
+    for (size_t i = 0; i < STAGE_COUNT; ++i)
+    {
+        const auto usec = totals.usec[i];
+        const auto bytes = totals.bytes[i];
+        text += fmt::format(
+                "{:>8}: {:.3f}s {} bytes {:.2f} MB/s\n",
+                stage_name(static_cast<Stage>(i)),
+                usec / 1e6,
+                bytes,
+                usec ? bytes / (usec / 1e6) / (1024 * 1024) : 0.0);
+    }
+    return text;
+}
+
+StageTimer::StageTimer(StageStats* stats, Stage stage, uint64_t bytes)
+    : _stats(stats)
+    , _stage(stage)
+    , _bytes(bytes)
+#ifdef PKGI_ENABLE_TRACING
+    , _start(pkgi_time_usec())
+#else
+    , _start(stats ? pkgi_time_usec() : 0)
+#endif
+{
+}
+
+StageTimer::~StageTimer()
+{
+#ifdef PKGI_ENABLE_TRACING
+    const auto end = pkgi_time_usec();
+    // the stages show on the timeline too
+    pkgi_trace_add(stage_name(_stage), _start, end);
+    if (_stats)
+        _stats->add(_stage, end - _start, _bytes);
+#else
+    if (_stats)
+        _stats->add(_stage, pkgi_time_usec() - _start, _bytes);
+#endif
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <string>
+
+#include <cstdint>
+
+// the steps of a package download, timed separately to tell whether a slow
+// one waits on the network, the CPU or the card
+enum class Stage : uint8_t
+{
+    // the read calls, waiting for the network included
+    Http,
+    // the hashing of the bytes that aren't decrypted, the head and the tail
+    Sha256,
+    // decryption of the package, hashed in the same pass
+    AesCtr,
+    // the PGD layer of the EDAT files and the ISO blocks
+    PspDecrypt,
+    Lzrc,
+    // the writes to the card, on the thread of the writer
+    Write,
+    // flushes and journal records
+    Checkpoint,
+    // the ISO blocks compressed to CSO or ZSO, on the threads of the ISO
+    // decoder. Last so that the stages of the older history records line up
+    IsoCompress,
+    Count,
+};
+
+static constexpr size_t STAGE_COUNT = static_cast<size_t>(Stage::Count);
+
+const char* stage_name(Stage stage);
+// stays the same across versions, for the tools that read the benchmarks
+const char* stage_id(Stage stage);
+
+// a copy of StageStats, plain so that it can be published with a status
+struct StageTotals
+{
+    std::array<uint64_t, STAGE_COUNT> usec{};
+    std::array<uint64_t, STAGE_COUNT> bytes{};
+};
+
+// Cumulative time and bytes of each stage of a download. Some stages run on
+// the threads of the ISO decoder and of the writer, the counters are atomic.
+class StageStats
+{
+public:
+    void add(Stage stage, uint64_t usec, uint64_t bytes)
+    {
+        const auto i = static_cast<size_t>(stage);
+        _usec[i].fetch_add(usec, std::memory_order_relaxed);
+        _bytes[i].fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    StageTotals totals() const;
+    void reset();
+
+private:
+    std::array<std::atomic<uint64_t>, STAGE_COUNT> _usec{};
+    std::array<std::atomic<uint64_t>, STAGE_COUNT> _bytes{};
+};
+
+// a line per stage with its time, bytes and throughput, for the log
+std::string pkgi_format_stage_totals(const StageTotals& totals);
+
+// adds the time from its creation to its destruction to stats, does nothing
+// when stats is null. With tracing, it's recorded as an event as well
+class StageTimer
+{
+public:
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    StageTimer(StageStats* stats, Stage stage, uint64_t bytes = 0);
+    ~StageTimer();
+
+    // when they are only known once the stage is over
+    void set_bytes(uint64_t bytes)
+    {
+        _bytes = bytes;
+    }
+
+private:
+    StageStats* _stats;
+    Stage _stage;
+    uint64_t _bytes;
+    uint64_t _start;
+};
@@ -0,0 +1,203 @@
+#include "storageprobe.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "pkgi.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+
+namespace
+{
+// a tab separated line per speed: partition, capacity, block size, write
+// and read speeds
+static constexpr char CACHE_MAGIC[] = "PKGJSTORAGE 1";
+
+uint64_t bytes_per_second(uint64_t bytes, uint64_t usec)
+{
+    return bytes * 1000000 / std::max<uint64_t>(usec, 1);
+}
+}
+
+uint64_t StorageProfile::write_speed() const
+{
+    uint64_t best = 0;
+    for (const auto& speed : speeds)
+        best = std::max(best, speed.write);
+    return best;
+}
+
+uint32_t StorageProfile::buffer_size() const
+{
+    const auto best = write_speed();
+    for (const auto& speed : speeds)
+        if (speed.write * 100 >= best * StorageProbe::BUFFER_SPEED_PERCENT)
+            return speed.block_size;
+    return 0;
+}
+
+StorageProbe::StorageProbe(std::string cache_path)
+    : _cache_path(std::move(cache_path)), _mutex("storage_probe_mutex")
+{
+}
+
+StorageProfile StorageProbe::profile(const std::string& partition)
+{
+    ScopeLock _(_mutex);
+    if (!_loaded)
+    {
+        load();
+        _loaded = true;
+    }
+
+    const auto capacity = pkgi_get_total_space(partition.c_str());
+    if (capacity == 0)
+        return {};
+
+    // a card that couldn't be probed isn't tried again before a restart
+    auto& profile = _profiles[partition];
+    if (profile.capacity == capacity)
+        return profile;
+
+    profile = probe(partition, capacity);
+    if (!profile.speeds.empty())
+        save();
+    return profile;
+}
+
+StorageProfile StorageProbe::probe(
+        const std::string& partition, uint64_t capacity)
+{
+    StorageProfile profile;
+    profile.capacity = capacity;
+
+    const auto folder = partition + "pkgj";
+    const auto path = folder + "/storage_probe.tmp";
+    const auto max_block =
+            *std::max_element(std::begin(BLOCK_SIZES), std::end(BLOCK_SIZES));
+    const auto data = std::make_unique<uint8_t[]>(max_block);
+    std::fill(data.get(), data.get() + max_block, 0x5a);
+    try
+    {
+        pkgi_mkdirs(folder.c_str());
+        for (const auto block_size : BLOCK_SIZES)
+        {
+            StorageSpeed speed;
+            speed.block_size = block_size;
+
+            // the close is counted, it's when the last blocks reach the card
+            auto start = pkgi_time_usec();
+            auto file = pkgi_create(path);
+            for (uint32_t done = 0; done < PROBE_SIZE; done += block_size)
+                pkgi_write(file, data.get(), block_size);
+            pkgi_close(file);
+            speed.write =
+                    bytes_per_second(PROBE_SIZE, pkgi_time_usec() - start);
+
+            start = pkgi_time_usec();
+            file = pkgi_open(path.c_str());
+            if (!file)
+                throw std::runtime_error("can't open the probe file");
+            uint64_t read = 0;
+            int size;
+            while ((size = pkgi_read(file, data.get(), block_size)) > 0)
+                read += size;
+            pkgi_close(file);
+            speed.read = bytes_per_second(read, pkgi_time_usec() - start);
+
+            LOGF("{} with blocks of {} KiB: write {} KiB/s, read {} KiB/s",
+                 partition,
+                 block_size / 1024,
+                 speed.write / 1024,
+                 speed.read / 1024);
+            profile.speeds.push_back(speed);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to probe {}: {}", partition, e.what());
+        profile.speeds.clear();
+    }
+    pkgi_rm(path.c_str());
+    return profile;
+}
+
+void StorageProbe::load()
+{
+    std::vector<uint8_t> data;
+    try
+    {
+        data = pkgi_load(_cache_path);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("no storage probe cache: {}", e.what());
+        return;
+    }
+
+    const std::string text(data.begin(), data.end());
+    size_t pos = text.find('\n');
+    if (pos == std::string::npos || text.compare(0, pos, CACHE_MAGIC) != 0)
+    {
+        LOGF("ignoring storage probe cache {}, bad header", _cache_path);
+        return;
+    }
+    ++pos;
+
+    while (pos < text.size())
+    {
+        auto end = text.find('\n', pos);
+        if (end == std::string::npos)
+            end = text.size();
+        const auto line = text.substr(pos, end - pos);
+        pos = end + 1;
+
+        const auto tab = line.find('\t');
+        if (tab == std::string::npos)
+            continue;
+        const char* field = line.c_str() + tab + 1;
+        char* next;
+        const auto capacity = std::strtoull(field, &next, 10);
+        StorageSpeed speed;
+        speed.block_size = std::strtoul(next, &next, 10);
+        speed.write = std::strtoull(next, &next, 10);
+        speed.read = std::strtoull(next, &next, 10);
+
+        auto& profile = _profiles[line.substr(0, tab)];
+        if (profile.capacity != capacity)
+            profile = StorageProfile{capacity, {}};
+        profile.speeds.push_back(speed);
+    }
+    LOGF("loaded the storage probes of {} partitions", _profiles.size());
+}
+
+void StorageProbe::save()
+{
+    std::string text = CACHE_MAGIC;
+    text += '\n';
+    for (const auto& entry : _profiles)
+        for (const auto& speed : entry.second.speeds)
+            text += fmt::format(
+                    "{}\t{}\t{}\t{}\t{}\n",
+                    entry.first,
+                    entry.second.capacity,
+                    speed.block_size,
+                    speed.write,
+                    speed.read);
+
+    try
+    {
+        const auto tmp = _cache_path + ".tmp";
+        pkgi_save(tmp, text.data(), text.size());
+        pkgi_rename(tmp, _cache_path);
+    }
+    catch (const std::exception& e)
+    {
+        // the cards are probed again at the next start
+        LOGF("failed to save the storage probes: {}", e.what());
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "thread.hpp"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+// how fast a partition writes and reads sequentially with blocks of a size
+struct StorageSpeed
+{
+    uint32_t block_size = 0;
+    // bytes per second
+    uint64_t write = 0;
+    uint64_t read = 0;
+};
+
+struct StorageProfile
+{
+    // tells the cards apart, another card in the slot is probed again
+    uint64_t capacity = 0;
+    // by ascending block size
+    std::vector<StorageSpeed> speeds;
+
+    // the fastest sequential write, 0 when nothing was measured
+    uint64_t write_speed() const;
+    // the smallest block that writes nearly as fast as the biggest ones,
+    // larger write-behind buffers only take memory from the downloads
+    uint32_t buffer_size() const;
+};
+
+// Measures the memory card, the SD2Vita or the USB storage behind a
+// partition by writing and reading back a file in pkgj with each of
+// BLOCK_SIZES. A partition is probed the first time a download asks for it,
+// which takes a few seconds, and the results are kept in cache_path so that
+// a card is only probed once.
+class StorageProbe
+{
+public:
+    static constexpr uint32_t BLOCK_SIZES[] = {
+            64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+    // written at each block size
+    static constexpr uint32_t PROBE_SIZE = 8 * 1024 * 1024;
+    // a block at least this many percent as fast as the fastest is enough
+    static constexpr uint32_t BUFFER_SPEED_PERCENT = 90;
+
+    StorageProbe(const StorageProbe&) = delete;
+    StorageProbe& operator=(const StorageProbe&) = delete;
+
+    explicit StorageProbe(std::string cache_path);
+
+    // from any thread, probes partition unless its card is in the cache. A
+    // profile without speeds when the partition isn't mounted or the probe
+    // failed
+    StorageProfile profile(const std::string& partition);
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    std::string _cache_path;
+    // held through a probe, two downloads starting at once don't measure
+    // each other
+    Mutex _mutex;
+    bool _loaded = false;
+    std::map<std::string, StorageProfile> _profiles;
+
+    StorageProfile probe(const std::string& partition, uint64_t capacity);
+    void load();
+    void save();
+};
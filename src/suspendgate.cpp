@@ -0,0 +1,77 @@
+#include "suspendgate.hpp"
+
+#include "log.hpp"
+#include "pkgi.hpp"
+
+SuspendGate::SuspendGate() : _mutex("suspend_gate_mutex")
+{
+}
+
+void SuspendGate::suspend()
+{
+    [[maybe_unused]] uint32_t entered;
+    {
+        ScopeLock _(_mutex);
+        _raised = true;
+        entered = _entered;
+    }
+    LOGF("system suspending, {} downloads to park", entered);
+
+    // the downloads park within a chunk, or not at all when they are stuck
+    // on a read
+    const uint32_t until = pkgi_time_msec() + PARK_TIMEOUT_MS;
+    while (static_cast<int32_t>(until - pkgi_time_msec()) > 0)
+    {
+        {
+            ScopeLock _(_mutex);
+            if (_parked >= _entered)
+                return;
+        }
+        pkgi_sleep(20);
+    }
+    LOG("some downloads didn't park before the suspend");
+}
+
+void SuspendGate::resume()
+{
+    LOG("system resumed");
+    ScopeLock _(_mutex);
+    _raised = false;
+    ++_resumes;
+}
+
+void SuspendGate::enter()
+{
+    ScopeLock _(_mutex);
+    ++_entered;
+}
+
+void SuspendGate::leave()
+{
+    ScopeLock _(_mutex);
+    --_entered;
+}
+
+bool SuspendGate::raised()
+{
+    ScopeLock _(_mutex);
+    return _raised;
+}
+
+void SuspendGate::park(const std::function<bool()>& is_canceled)
+{
+    {
+        ScopeLock _(_mutex);
+        ++_parked;
+    }
+    while (raised() && !is_canceled())
+        pkgi_sleep(100);
+    ScopeLock _(_mutex);
+    --_parked;
+}
+
+uint32_t SuspendGate::resumes()
+{
+    ScopeLock _(_mutex);
+    return _resumes;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "thread.hpp"
+
+#include <functional>
+#include <mutex>
+
+#include <cstdint>
+
+// Lets the downloads get through a sleep of the system. The power thread
+// raises the gate when the system is suspending, the downloads that entered
+// it save their state at their next chunk and park until the gate is lowered
+// on resume, then reopen their connection where they stopped. A connection
+// the suspend killed before its download could park doesn't count as a
+// failed attempt either, see resumes().
+class SuspendGate
+{
+public:
+    // the longest the power thread holds the suspend back for the downloads
+    // to park
+    static constexpr uint32_t PARK_TIMEOUT_MS = 2000;
+
+    SuspendGate(const SuspendGate&) = delete;
+    SuspendGate& operator=(const SuspendGate&) = delete;
+
+    SuspendGate();
+
+    // on the power thread
+    void suspend();
+    void resume();
+
+    // a download is counted from enter() to leave(), suspend() only waits for
+    // those
+    void enter();
+    void leave();
+    bool raised();
+    // the download's state must be saved, waits until the gate is lowered or
+    // is_canceled
+    void park(const std::function<bool()>& is_canceled);
+    // bumped by each resume()
+    uint32_t resumes();
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    Mutex _mutex;
+    bool _raised = false;
+    uint32_t _entered = 0;
+    uint32_t _parked = 0;
+    uint32_t _resumes = 0;
+};
@@ -0,0 +1,106 @@
+#include "taskpool.hpp"
+
+#include "log.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+void Task::wait()
+{
+    std::lock_guard<Mutex> lock(_cond->get_mutex());
+    while (!_done)
+        _cond->wait();
+}
+
+TaskPool::TaskPool() : _cond("task_pool_cond")
+{
+    for (size_t i = 0; i < WORKER_COUNT; ++i)
+        _workers.push_back(std::make_unique<Thread>(
+                fmt::format("task_pool_{}", i),
+                [this] { run(); },
+                ThreadRole::Background));
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+        for (auto& queue : _queues)
+        {
+            for (auto& queued : queue)
+                queued.task->_done = true;
+            queue.clear();
+        }
+    }
+    _cond.notify_all();
+    for (auto& worker : _workers)
+        worker->join();
+}
+
+std::shared_ptr<Task> TaskPool::submit(Priority priority, Function function)
+{
+    auto task = std::make_shared<Task>(&_cond);
+    {
+        ScopeLock _(_cond.get_mutex());
+        if (_dying)
+            throw std::runtime_error("任务池已关闭");
+        _queues[priority].push_back({task, std::move(function)});
+    }
+    _cond.notify_all();
+    return task;
+}
+
+void TaskPool::finish(Task& task)
+{
+    task._done = true;
+    // the waiters and the workers share the condition
+    _cond.notify_all();
+}
+
+void TaskPool::run()
+{
+    while (true)
+    {
+        Queued queued;
+        {
+            ScopeLock _(_cond.get_mutex());
+            while (true)
+            {
+                if (_dying)
+                    return;
+                auto queue = std::find_if(
+                        std::begin(_queues),
+                        std::end(_queues),
+                        [](const std::deque<Queued>& queue) {
+                            return !queue.empty();
+                        });
+                if (queue != std::end(_queues))
+                {
+                    queued = std::move(queue->front());
+                    queue->pop_front();
+                    if (!queued.task->cancelled())
+                        break;
+                    finish(*queued.task);
+                    continue;
+                }
+                _cond.wait();
+            }
+        }
+
+        try
+        {
+            queued.function(*queued.task);
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("task failed: {}", e.what());
+        }
+
+        ScopeLock _(_cond.get_mutex());
+        finish(*queued.task);
+    }
+}
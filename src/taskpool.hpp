@@ -0,0 +1,100 @@
+#pragma once
+
+#include "thread.hpp"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// What submit() gives back, to cancel the task or wait for it. A task
+// cancelled before it starts is dropped, a running one only sees cancelled()
+// return true and is expected to give up soon.
+class Task
+{
+public:
+    Task(const Task&) = delete;
+    Task(Task&&) = delete;
+    Task& operator=(const Task&) = delete;
+    Task& operator=(Task&&) = delete;
+
+    Task(Cond* cond) : _cond(cond)
+    {
+    }
+
+    void cancel()
+    {
+        _cancelled = true;
+    }
+    bool cancelled() const
+    {
+        return _cancelled;
+    }
+
+    // returns once the task ran or was dropped
+    void wait();
+
+private:
+    Cond* _cond;
+    std::atomic<bool> _cancelled{false};
+    // guarded by the mutex of _cond
+    bool _done = false;
+
+    friend class TaskPool;
+};
+
+// A few threads created once and shared by the short jobs of the app, like
+// the requests to the update server and the scans of the memory card,
+// instead of a kernel thread and its stack per job. The tasks of a higher
+// priority are started first, those of a same priority in order.
+class TaskPool
+{
+public:
+    enum Priority
+    {
+        // the user is waiting for it
+        PriorityHigh,
+        PriorityNormal,
+        // batch jobs the user didn't ask for right now
+        PriorityLow,
+        PriorityCount,
+    };
+
+    static constexpr size_t WORKER_COUNT = 3;
+
+    using Function = std::function<void(const Task& task)>;
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool(TaskPool&&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+    TaskPool& operator=(TaskPool&&) = delete;
+
+    TaskPool();
+    // drops the queued tasks and waits for the running ones
+    ~TaskPool();
+
+    // an exception thrown by function is logged and ignored
+    std::shared_ptr<Task> submit(Priority priority, Function function);
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    struct Queued
+    {
+        std::shared_ptr<Task> task;
+        Function function;
+    };
+
+    Cond _cond;
+    std::deque<Queued> _queues[PriorityCount];
+    bool _dying = false;
+
+    std::vector<std::unique_ptr<Thread>> _workers;
+
+    void run();
+    // must be called with the mutex locked
+    void finish(Task& task);
+};
@@ -0,0 +1,150 @@
+#include "textwidths.hpp"
+
+#include "pkgi.hpp"
+#include "style.h"
+
+#include <vector>
+
+#include <string.h>
+
+namespace
+{
+// the node and the bucket of an entry of an unordered_map, next to its value
+constexpr size_t NODE_OVERHEAD = 3 * sizeof(void*);
+}
+
+void pkgi_friendly_size(char* text, uint32_t textlen, int64_t size)
+{
+    if (size <= 0)
+    {
+        text[0] = 0;
+    }
+    else if (size < 1000LL)
+    {
+        pkgi_snprintf(text, textlen, "%u " PKGI_UTF8_B, (uint32_t)size);
+    }
+    else if (size < 1000LL * 1000)
+    {
+        pkgi_snprintf(text, textlen, "%.2f " PKGI_UTF8_KB, size / 1024.f);
+    }
+    else if (size < 1000LL * 1000 * 1000)
+    {
+        pkgi_snprintf(
+                text, textlen, "%.2f " PKGI_UTF8_MB, size / 1024.f / 1024.f);
+    }
+    else
+    {
+        pkgi_snprintf(
+                text,
+                textlen,
+                "%.2f " PKGI_UTF8_GB,
+                size / 1024.f / 1024.f / 1024.f);
+    }
+}
+
+void TextWidthCache::set_budget(size_t budget)
+{
+    _budget = budget;
+}
+
+int TextWidthCache::width(const char* text)
+{
+    check_font();
+    auto it = _widths.find(text);
+    if (it == _widths.end())
+    {
+        const auto bytes = sizeof(*it) + strlen(text) + NODE_OVERHEAD;
+        make_room(_widths.size(), bytes);
+        it = _widths.emplace(text, pkgi_text_width(text)).first;
+        _used += bytes;
+        _memory.set(_used);
+    }
+    return it->second;
+}
+
+const TextWidthCache::SizeText& TextWidthCache::size(int64_t size)
+{
+    check_font();
+    auto it = _sizes.find(size);
+    if (it == _sizes.end())
+    {
+        const auto bytes = sizeof(*it) + NODE_OVERHEAD;
+        make_room(_sizes.size(), bytes);
+        SizeText entry;
+        pkgi_friendly_size(entry.text, sizeof(entry.text), size);
+        entry.width = pkgi_text_width(entry.text);
+        it = _sizes.emplace(size, entry).first;
+        _used += bytes;
+        _memory.set(_used);
+    }
+    return it->second;
+}
+
+const std::string& TextWidthCache::fit(const std::string& text, int width)
+{
+    check_font();
+    auto it = _fitted.find(text);
+    if (it == _fitted.end() || it->second.width != width)
+    {
+        // an entry cut again to another width is counted again, it goes
+        // away with the others
+        auto fitted = cut(text, width);
+        const auto bytes =
+                sizeof(*it) + text.size() + fitted.size() + NODE_OVERHEAD;
+        make_room(_fitted.size(), bytes);
+        it = _fitted.insert_or_assign(text, Fitted{width, std::move(fitted)})
+                     .first;
+        _used += bytes;
+        _memory.set(_used);
+    }
+    return it->second.text;
+}
+
+std::string TextWidthCache::cut(const std::string& text, int width)
+{
+    if (pkgi_text_width(text.c_str()) <= width)
+        return text;
+
+    // the ends of the characters, the widths grow with them so the longest
+    // one that fits is found by bisection
+    std::vector<size_t> ends;
+    for (size_t i = 1; i <= text.size(); ++i)
+        if (i == text.size() || (text[i] & 0xc0) != 0x80)
+            ends.push_back(i);
+    size_t low = 0;
+    size_t high = ends.size();
+    while (low < high)
+    {
+        const auto mid = (low + high) / 2;
+        if (pkgi_text_width(text.substr(0, ends[mid]).c_str()) <= width)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low ? text.substr(0, ends[low - 1]) : std::string();
+}
+
+void TextWidthCache::check_font()
+{
+    const auto serial = pkgi_font_serial();
+    if (serial == _font_serial)
+        return;
+    _font_serial = serial;
+    clear();
+}
+
+void TextWidthCache::make_room(size_t count, size_t bytes)
+{
+    // the kinds are emptied together, the rows need all of them anyway
+    if (count >= MAX_ENTRIES || _used + bytes > _budget)
+        clear();
+}
+
+void TextWidthCache::clear()
+{
+    _widths.clear();
+    _sizes.clear();
+    _fitted.clear();
+    _used = 0;
+    _memory.set(_used);
+}
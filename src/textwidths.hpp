@@ -0,0 +1,63 @@
+#pragma once
+
+#include "memstats.hpp"
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+
+#include <cstdint>
+
+// size with its unit as the list shows it, empty when size isn't known
+void pkgi_friendly_size(char* text, uint32_t textlen, int64_t size);
+
+// Widths of the texts drawn on each row, the sizes already formatted and the
+// names cut to their column, as measuring a string walks its glyphs in the
+// font. Filled as the rows scroll in and emptied when the font changes, once
+// it holds MAX_ENTRIES of a kind or would go over its budget, the visible rows
+// are back in it after a frame
+class TextWidthCache
+{
+public:
+    static constexpr size_t MAX_ENTRIES = 512;
+    // the budget it starts with, about what MAX_ENTRIES of each kind take
+    static constexpr size_t DEFAULT_BUDGET = 128 * 1024;
+
+    // from any thread, the cache is only emptied by the thread using it, on
+    // its next call
+    void set_budget(size_t budget);
+
+    struct SizeText
+    {
+        char text[32];
+        int width;
+    };
+
+    int width(const char* text);
+    // as written by pkgi_friendly_size
+    const SizeText& size(int64_t size);
+    // the longest start of text that fits in width, cut at a character
+    const std::string& fit(const std::string& text, int width);
+
+private:
+    struct Fitted
+    {
+        int width;
+        std::string text;
+    };
+
+    uint32_t _font_serial = 0;
+    std::unordered_map<std::string, int> _widths;
+    std::unordered_map<int64_t, SizeText> _sizes;
+    std::unordered_map<std::string, Fitted> _fitted;
+    std::atomic<size_t> _budget{DEFAULT_BUDGET};
+    // an estimate of what the entries take, with their nodes
+    size_t _used = 0;
+    MemoryCharge _memory{MemPool::TextWidths};
+
+    static std::string cut(const std::string& text, int width);
+    void check_font();
+    // makes room for an entry of bytes in a map holding count entries
+    void make_room(size_t count, size_t bytes);
+    void clear();
+};
@@ -1,8 +1,15 @@
 #pragma once
 
 #include "pkgi.hpp"
+#include "trace.hpp"
 
+#ifdef __vita__
 #include <psp2/kernel/threadmgr.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
 
 #include <functional>
 #include <memory>
@@ -27,6 +34,78 @@ public:
     }
 };
 
+// what a thread is used for, the core it's pinned to and its priority come
+// from the placement of its role
+enum class ThreadRole
+{
+    // the render loop, the main thread
+    Ui,
+    // the downloader and the http reads
+    Network,
+    // decryption, decompression and writes to the card
+    Worker,
+    // scans, list reloads and the task pool
+    Background,
+    Count,
+};
+
+struct ThreadPlacement
+{
+    // index of the user core, -1 lets the scheduler pick
+    int cpu;
+    // from 0x40 to 0xbf for user threads, the lowest runs first
+    int priority;
+};
+
+// set by pkgi_set_thread_cpus() at startup, before the threads are created.
+// The render loop and the downloads get a core each so that a download
+// doesn't drop frames and scrolling doesn't slow down a download.
+inline ThreadPlacement
+        g_thread_placements[static_cast<int>(ThreadRole::Count)] = {
+                {0, 0xa0},
+                {1, 0xa0},
+                {2, 0xb0},
+                {-1, 0xbc},
+};
+
+inline ThreadPlacement pkgi_thread_placement(ThreadRole role)
+{
+    return g_thread_placements[static_cast<int>(role)];
+}
+
+// cpus out of [0, 2] are taken as -1
+inline void pkgi_set_thread_cpus(int ui, int network, int worker)
+{
+    const auto valid = [](int cpu) { return cpu >= 0 && cpu <= 2 ? cpu : -1; };
+    g_thread_placements[static_cast<int>(ThreadRole::Ui)].cpu = valid(ui);
+    g_thread_placements[static_cast<int>(ThreadRole::Network)].cpu =
+            valid(network);
+    g_thread_placements[static_cast<int>(ThreadRole::Worker)].cpu =
+            valid(worker);
+}
+
+#ifdef __vita__
+
+inline int pkgi_thread_cpu_mask(const ThreadPlacement& placement)
+{
+    return placement.cpu < 0 ? 0 : SCE_KERNEL_CPU_MASK_USER_0 << placement.cpu;
+}
+
+// applies the placement of role to the calling thread, for the main thread
+// which isn't created by Thread
+inline void pkgi_place_current_thread(ThreadRole role)
+{
+    const auto placement = pkgi_thread_placement(role);
+    // 0 is the calling thread
+    auto res = sceKernelChangeThreadCpuAffinityMask(
+            0, pkgi_thread_cpu_mask(placement));
+    if (res < 0)
+        LOG("change thread affinity failed error=0x%08x", res);
+    res = sceKernelChangeThreadPriority(0, placement.priority);
+    if (res < 0)
+        LOG("change thread priority failed error=0x%08x", res);
+}
+
 class Mutex
 {
 public:
@@ -134,6 +213,16 @@ public:
         }
     }
 
+    void notify_all()
+    {
+        const auto res = sceKernelSignalLwCondAll(&_cond);
+        if (res < 0)
+        {
+            // TODO throw
+            LOG("cond signal all failed error=0x%08x", res);
+        }
+    }
+
     void wait()
     {
         const auto res = sceKernelWaitLwCond(&_cond, nullptr);
@@ -164,10 +253,18 @@ public:
     Thread& operator=(const Thread&) = delete;
     Thread& operator=(Thread&&) = delete;
 
-    Thread(const std::string& name, EntryPoint entry)
+    // the core and priority of the thread are the placement of role
+    Thread(const std::string& name, EntryPoint entry, ThreadRole role)
     {
+        const auto placement = pkgi_thread_placement(role);
         _tid = sceKernelCreateThread(
-                name.c_str(), &entry_point, 0xb0, 0x8000, 0, 0, nullptr);
+                name.c_str(),
+                &entry_point,
+                placement.priority,
+                0x8000,
+                0,
+                pkgi_thread_cpu_mask(placement),
+                nullptr);
         if (_tid < 0)
         {
             // TODO throw
@@ -224,6 +321,134 @@ private:
         {
             LOG("got unknown exception from thread");
         }
+        pkgi_trace_release_thread();
         return 0;
     }
 };
+
+#else
+
+// host build (pkgj_cli), same interface on top of the standard library
+
+inline void pkgi_place_current_thread(ThreadRole)
+{
+}
+
+class Mutex
+{
+public:
+    Mutex(const Mutex&) = delete;
+    Mutex(Mutex&&) = delete;
+    Mutex& operator=(const Mutex&) = delete;
+    Mutex& operator=(Mutex&&) = delete;
+
+    Mutex(const std::string&)
+    {
+    }
+
+    void lock()
+    {
+        _mutex.lock();
+    }
+
+    bool try_lock()
+    {
+        return _mutex.try_lock();
+    }
+
+    void unlock()
+    {
+        _mutex.unlock();
+    }
+
+private:
+    std::mutex _mutex;
+};
+
+class Cond
+{
+public:
+    Cond(const Cond&) = delete;
+    Cond(Cond&&) = delete;
+    Cond& operator=(const Cond&) = delete;
+    Cond& operator=(Cond&&) = delete;
+
+    Cond(const std::string& name) : _mutex(name + "_mutex")
+    {
+    }
+
+    void notify_one()
+    {
+        _cond.notify_one();
+    }
+
+    void notify_all()
+    {
+        _cond.notify_all();
+    }
+
+    // must be called with get_mutex() locked, like sceKernelWaitLwCond
+    void wait()
+    {
+        _cond.wait(_mutex);
+    }
+
+    Mutex& get_mutex()
+    {
+        return _mutex;
+    }
+
+private:
+    Mutex _mutex;
+    std::condition_variable_any _cond;
+};
+
+class Thread
+{
+public:
+    using EntryPoint = std::function<void()>;
+
+    Thread(const Thread&) = delete;
+    Thread(Thread&&) = delete;
+    Thread& operator=(const Thread&) = delete;
+    Thread& operator=(Thread&&) = delete;
+
+    Thread(const std::string&, EntryPoint entry, ThreadRole)
+        : _thread(&entry_point, std::move(entry))
+    {
+    }
+
+    ~Thread()
+    {
+        if (_thread.joinable())
+            _thread.detach();
+    }
+
+    void join()
+    {
+        _thread.join();
+    }
+
+private:
+    std::thread _thread;
+
+    static void entry_point(EntryPoint entry)
+    {
+        try
+        {
+            entry();
+            LOG("thread successfully terminated");
+        }
+        catch (const std::exception& e)
+        {
+            LOG("got exception from thread: %s", e.what());
+        }
+        catch (...)
+        {
+            LOG("got unknown exception from thread");
+        }
+        pkgi_trace_release_thread();
+    }
+};
+
+#endif
@@ -0,0 +1,198 @@
+#include "throttledhttp.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "pkgi.hpp"
+
+#include "rapidjson/document.h"
+
+#include <algorithm>
+
+namespace
+{
+// a connection that drops never drops twice in the same way, each one gets
+// its own draws
+std::atomic<uint32_t> connection_count{0};
+
+uint64_t get_uint(const rapidjson::Document& json, const char* name)
+{
+    if (!json.HasMember(name))
+        return 0;
+    const auto& value = json[name];
+    if (!value.IsNumber() || value.GetDouble() < 0)
+        throw formatEx<std::runtime_error>(
+                "{} must be a positive number", name);
+    return value.GetDouble();
+}
+}
+
+NetworkProfile pkgi_load_network_profile(const std::string& path)
+{
+    auto data = pkgi_load(path);
+    data.push_back('\0');
+
+    rapidjson::Document json;
+    json.Parse(reinterpret_cast<const char*>(data.data()));
+    if (!json.IsObject())
+        throw formatEx<std::runtime_error>(
+                "can't parse network profile {}", path);
+
+    NetworkProfile profile;
+    profile.rtt_ms = get_uint(json, "rtt_ms");
+    profile.jitter_ms = get_uint(json, "jitter_ms");
+    profile.bandwidth = get_uint(json, "bandwidth_kbps") * 1000 / 8;
+    profile.stall_ms = get_uint(json, "stall_ms");
+    profile.disconnect_mean =
+            get_uint(json, "disconnect_mean_mb") * 1024 * 1024;
+    profile.seed = get_uint(json, "seed");
+    if (json.HasMember("trace"))
+    {
+        const auto& value = json["trace"];
+        if (!value.IsString())
+            throw formatEx<std::runtime_error>("trace must be a path");
+        std::string trace = value.GetString();
+        const auto slash = path.rfind('/');
+        if (!trace.empty() && trace[0] != '/' && slash != std::string::npos)
+            trace = path.substr(0, slash + 1) + trace;
+        profile.trace = std::make_shared<HttpTrace>(trace);
+    }
+    if (json.HasMember("stall_probability"))
+    {
+        const auto& value = json["stall_probability"];
+        if (!value.IsNumber() || value.GetDouble() < 0 ||
+            value.GetDouble() > 1)
+            throw formatEx<std::runtime_error>(
+                    "stall_probability must be between 0 and 1");
+        profile.stall_probability = value.GetDouble();
+    }
+
+    LOGF("network profile {}: rtt {}ms+{}ms, {}B/s, stall {}@{}ms, "
+         "disconnect every {}B",
+         path,
+         profile.rtt_ms,
+         profile.jitter_ms,
+         profile.bandwidth,
+         profile.stall_probability,
+         profile.stall_ms,
+         profile.disconnect_mean);
+    return profile;
+}
+
+ThrottledHttp::ThrottledHttp(
+        std::unique_ptr<Http> http, const NetworkProfile& profile)
+    : PacedHttp(std::move(http))
+    , _profile(profile)
+    , _random(profile.seed + connection_count++)
+{
+}
+
+void ThrottledHttp::connect()
+{
+    if (_profile.trace)
+    {
+        // the first arrival has the time to the first byte in it
+        _request = &_profile.trace->next();
+        _arrival = 0;
+        _start_usec = pkgi_time_usec();
+        _received = 0;
+        return;
+    }
+
+    uint64_t delay = _profile.rtt_ms;
+    if (_profile.jitter_ms)
+        delay += std::uniform_int_distribution<uint32_t>(
+                0, _profile.jitter_ms)(_random);
+    sleep_usec(delay * 1000);
+    check_aborted();
+
+    _start_usec = pkgi_time_usec();
+    _received = 0;
+    _disconnect_at =
+            _profile.disconnect_mean
+                    ? std::max<uint64_t>(
+                              1,
+                              std::exponential_distribution<double>(
+                                      1.0 / _profile.disconnect_mean)(_random))
+                    : 0;
+}
+
+int64_t ThrottledHttp::read(uint8_t* buffer, uint64_t size)
+{
+    if (_request)
+        return read_traced(buffer, size);
+
+    if (_profile.stall_probability > 0 &&
+        std::bernoulli_distribution(_profile.stall_probability)(_random))
+    {
+        LOGF_DEBUG("simulated stall of {}ms", _profile.stall_ms);
+        sleep_usec(_profile.stall_ms * 1000ull);
+    }
+
+    if (_disconnect_at)
+        size = std::min(size, _disconnect_at - _received);
+    size = paced_size(size, _profile.bandwidth);
+
+    check_aborted();
+
+    const auto read = _http->read(buffer, size);
+    _received += read;
+
+    if (_profile.bandwidth)
+    {
+        const auto due = _start_usec + _received * 1000000 / _profile.bandwidth;
+        const auto now = pkgi_time_usec();
+        if (due > now)
+            sleep_usec(due - now);
+    }
+
+    check_aborted();
+    if (_disconnect_at && _received >= _disconnect_at)
+    {
+        LOGF_DEBUG("simulated disconnect after {} bytes", _received);
+        throw HttpError(fmt::format(
+                "simulated disconnect after {} bytes", _received));
+    }
+
+    return read;
+}
+
+int64_t ThrottledHttp::read_traced(uint8_t* buffer, uint64_t size)
+{
+    const auto& arrivals = _request->arrivals;
+    while (_arrival < arrivals.size() && arrivals[_arrival].bytes <= _received)
+        ++_arrival;
+
+    // a request past the end of the recorded one goes on at its mean speed
+    uint64_t bandwidth = 0;
+    if (_arrival < arrivals.size())
+    {
+        const auto& arrival = arrivals[_arrival];
+        const auto due = _start_usec + arrival.usec;
+        const auto now = pkgi_time_usec();
+        if (due > now)
+            sleep_usec(due - now);
+        size = std::min(size, arrival.bytes - _received);
+    }
+    else if (_request->failed)
+    {
+        LOGF_DEBUG("replayed reset after {} bytes", _received);
+        throw HttpError(
+                fmt::format("replayed reset after {} bytes", _received));
+    }
+    else if (!arrivals.empty())
+    {
+        const auto& last = arrivals.back();
+        bandwidth = last.bytes * 1000000 / std::max<uint64_t>(last.usec, 1);
+        size = paced_size(size, bandwidth);
+    }
+
+    check_aborted();
+
+    const auto read = _http->read(buffer, size);
+    _received += read;
+    if (bandwidth)
+        sleep_usec(read * 1000000 / bandwidth);
+
+    check_aborted();
+    return read;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "httptrace.hpp"
+#include "pacedhttp.hpp"
+
+#include <memory>
+#include <random>
+#include <string>
+
+// the conditions of a network, loaded from a JSON file such as
+//   {"rtt_ms": 80, "jitter_ms": 20, "bandwidth_kbps": 4000,
+//    "stall_probability": 0.001, "stall_ms": 3000,
+//    "disconnect_mean_mb": 50, "seed": 1}
+// the missing keys are taken as a perfect network. With a "trace", the path
+// of an HttpTrace relative to the profile, the requests follow the timing
+// and the resets of the recorded ones instead
+struct NetworkProfile
+{
+    // waited before the first byte of each request
+    uint32_t rtt_ms = 0;
+    // added to rtt_ms, drawn in [0, jitter_ms]
+    uint32_t jitter_ms = 0;
+    // 0 is unlimited
+    uint64_t bandwidth = 0;
+    // chance of each read to stop for stall_ms first
+    double stall_probability = 0;
+    uint32_t stall_ms = 0;
+    // mean number of bytes a connection gets before it drops, 0 never drops
+    uint64_t disconnect_mean = 0;
+    uint32_t seed = 0;
+    // shared by the connections, each request takes the next one of it
+    std::shared_ptr<HttpTrace> trace;
+};
+
+// throws when the file can't be read or isn't a JSON object
+NetworkProfile pkgi_load_network_profile(const std::string& path);
+
+// Http decorator that delays and breaks the wrapped stream like profile says,
+// to reproduce slow or flaky networks on the host. The draws only depend on
+// the seed and the order of the connections, runs can be compared
+class ThrottledHttp : public PacedHttp
+{
+public:
+    ThrottledHttp(std::unique_ptr<Http> http, const NetworkProfile& profile);
+
+    int64_t read(uint8_t* buffer, uint64_t size) override;
+
+protected:
+    void connect() override;
+
+private:
+    NetworkProfile _profile;
+    std::mt19937 _random;
+
+    // of the current request
+    uint64_t _start_usec = 0;
+    uint64_t _received = 0;
+    uint64_t _disconnect_at = 0;
+    // from the trace, the arrivals before _arrival are past
+    const HttpTraceRequest* _request = nullptr;
+    size_t _arrival = 0;
+
+    int64_t read_traced(uint8_t* buffer, uint64_t size);
+};
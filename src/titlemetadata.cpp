@@ -0,0 +1,293 @@
+#include "titlemetadata.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace
+{
+static constexpr char CACHE_MAGIC[] = "PKGJTITLES 1";
+static constexpr size_t CACHE_FIELDS = 7;
+
+// written by the installs, read by the cache
+Mutex changed_mutex("title_metadata_changed_mutex");
+std::unordered_set<std::string> changed_titles;
+
+uint64_t get_stamp(const std::string& titleid)
+{
+    const std::string paths[] = {
+            fmt::format("ux0:patch/{}/sce_sys/param.sfo", titleid),
+            fmt::format("ux0:app/{}/sce_sys/param.sfo", titleid),
+            fmt::format("ux0:rePatch/{}", titleid),
+            fmt::format("ux0:rePatch/{}/base_comppack_version", titleid),
+            fmt::format("ux0:rePatch/{}/patch_comppack_version", titleid),
+    };
+    uint64_t stamp = 0;
+    for (const auto& path : paths)
+        stamp = stamp * 1000003 + pkgi_get_mtime(path);
+    return stamp;
+}
+
+TitleMetadata read_metadata(const std::string& titleid)
+{
+    TitleMetadata metadata;
+    try
+    {
+        metadata.version = pkgi_get_game_version(titleid);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to read version of {}: {}", titleid, e.what());
+    }
+    metadata.comppack = pkgi_get_comppack_versions(titleid);
+    return metadata;
+}
+
+std::vector<std::string> split_tabs(const std::string& line)
+{
+    std::vector<std::string> fields;
+    size_t pos = 0;
+    while (true)
+    {
+        const auto tab = line.find('\t', pos);
+        fields.push_back(line.substr(pos, tab - pos));
+        if (tab == std::string::npos)
+            return fields;
+        pos = tab + 1;
+    }
+}
+}
+
+void pkgi_title_metadata_changed(const std::string& titleid)
+{
+    std::lock_guard<Mutex> lock(changed_mutex);
+    changed_titles.insert(titleid);
+}
+
+TitleMetadataCache::TitleMetadataCache(std::string cache_path)
+    : _cache_path(std::move(cache_path)), _cond("title_metadata_cond")
+{
+    _thread = std::make_unique<Thread>(
+            "title_metadata", [this] { run(); }, ThreadRole::Background);
+}
+
+TitleMetadataCache::~TitleMetadataCache()
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+    }
+    _cond.notify_all();
+    _thread->join();
+}
+
+void TitleMetadataCache::walk(std::vector<std::string> titleids)
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        // popped from the back, keep the order of the list
+        _walk.assign(titleids.rbegin(), titleids.rend());
+        _check_refood = true;
+    }
+    _cond.notify_all();
+}
+
+std::optional<TitleMetadata> TitleMetadataCache::get(const std::string& titleid)
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        drop_changed();
+        const auto it = _entries.find(titleid);
+        if (it != _entries.end() && it->second.checked)
+            return it->second.metadata;
+        if (std::find(_urgent.begin(), _urgent.end(), titleid) != _urgent.end())
+            return std::nullopt;
+        _urgent.push_back(titleid);
+    }
+    _cond.notify_all();
+    return std::nullopt;
+}
+
+void TitleMetadataCache::drop_changed()
+{
+    std::unordered_set<std::string> changed;
+    {
+        std::lock_guard<Mutex> lock(changed_mutex);
+        changed = std::move(changed_titles);
+        changed_titles.clear();
+    }
+    for (const auto& titleid : changed)
+        if (_entries.erase(titleid))
+            _dirty = true;
+}
+
+void TitleMetadataCache::run()
+{
+    load();
+
+    while (true)
+    {
+        std::string titleid;
+        std::optional<uint64_t> cached_stamp;
+        std::string to_save;
+        bool check_refood;
+        {
+            ScopeLock _(_cond.get_mutex());
+            while (_urgent.empty() && _walk.empty() && !_check_refood &&
+                   !_dirty && !_dying)
+                _cond.wait();
+            if (_dying)
+                return;
+
+            drop_changed();
+            check_refood = _check_refood;
+            _check_refood = false;
+            if (!_urgent.empty())
+            {
+                titleid = std::move(_urgent.front());
+                _urgent.pop_front();
+            }
+            else if (!_walk.empty())
+            {
+                titleid = std::move(_walk.back());
+                _walk.pop_back();
+            }
+            else if (_dirty)
+            {
+                // the walk is over
+                to_save = serialize();
+                _dirty = false;
+            }
+
+            const auto it = _entries.find(titleid);
+            if (it != _entries.end())
+            {
+                if (it->second.checked)
+                    titleid.clear();
+                else
+                    cached_stamp = it->second.stamp;
+            }
+        }
+
+        if (check_refood)
+            _refood_present = pkgi_file_exists("ur0:tai/keys.bin");
+
+        if (!to_save.empty())
+            save(to_save);
+
+        if (titleid.empty())
+            continue;
+
+        const auto stamp = get_stamp(titleid);
+        if (cached_stamp && *cached_stamp == stamp)
+        {
+            ScopeLock _(_cond.get_mutex());
+            const auto it = _entries.find(titleid);
+            if (it != _entries.end() && it->second.stamp == stamp)
+                it->second.checked = true;
+            ++_serial;
+            continue;
+        }
+
+        auto metadata = read_metadata(titleid);
+
+        ScopeLock _(_cond.get_mutex());
+        _entries[titleid] = Entry{stamp, true, std::move(metadata)};
+        _dirty = true;
+        ++_serial;
+    }
+}
+
+// the cache is a line with CACHE_MAGIC, then a line per title with its id,
+// stamp, versions and comppack versions separated by tabs
+void TitleMetadataCache::load()
+{
+    std::vector<uint8_t> data;
+    try
+    {
+        data = pkgi_load(_cache_path);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("no title metadata cache: {}", e.what());
+        return;
+    }
+
+    const std::string text(data.begin(), data.end());
+    const auto header_end = text.find('\n');
+    if (header_end == std::string::npos ||
+        text.compare(0, header_end, CACHE_MAGIC) != 0)
+    {
+        LOGF("ignoring title metadata cache {}, bad header", _cache_path);
+        return;
+    }
+
+    std::unordered_map<std::string, Entry> entries;
+    size_t pos = header_end + 1;
+    while (pos < text.size())
+    {
+        auto end = text.find('\n', pos);
+        if (end == std::string::npos)
+            end = text.size();
+        const auto fields = split_tabs(text.substr(pos, end - pos));
+        pos = end + 1;
+
+        if (fields.size() != CACHE_FIELDS)
+        {
+            LOGF("ignoring title metadata cache {}, bad entry", _cache_path);
+            return;
+        }
+        Entry entry;
+        entry.stamp = std::strtoull(fields[1].c_str(), nullptr, 10);
+        entry.checked = false;
+        entry.metadata.version = {fields[2], fields[3]};
+        entry.metadata.comppack = {fields[4] == "1", fields[5], fields[6]};
+        entries.emplace(fields[0], std::move(entry));
+    }
+
+    LOGF("loaded metadata of {} titles", entries.size());
+    ScopeLock _(_cond.get_mutex());
+    // an install may have happened already
+    for (auto& entry : entries)
+        _entries.emplace(entry.first, std::move(entry.second));
+}
+
+std::string TitleMetadataCache::serialize() const
+{
+    std::string text = CACHE_MAGIC;
+    text += '\n';
+    for (const auto& entry : _entries)
+    {
+        const auto& metadata = entry.second.metadata;
+        text += fmt::format(
+                "{}\t{}\t{}\t{}\t{}\t{}\t{}\n",
+                entry.first,
+                entry.second.stamp,
+                metadata.version.app,
+                metadata.version.system,
+                metadata.comppack.present ? 1 : 0,
+                metadata.comppack.base,
+                metadata.comppack.patch);
+    }
+    return text;
+}
+
+void TitleMetadataCache::save(const std::string& text)
+{
+    try
+    {
+        const auto tmp = _cache_path + ".tmp";
+        pkgi_save(tmp, text.data(), text.size());
+        pkgi_rename(tmp, _cache_path);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to save title metadata cache: {}", e.what());
+    }
+}
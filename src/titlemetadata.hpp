@@ -0,0 +1,95 @@
+#pragma once
+
+#include "install.hpp"
+#include "thread.hpp"
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+struct TitleMetadata
+{
+    GameVersion version;
+    CompPackVersion comppack;
+};
+
+// What the game view shows about an installed title, read from its param.sfo
+// and rePatch directory on a thread and kept in cache_path. An entry loaded
+// from the cache is used again once the mtimes of the files it was read from
+// are found unchanged, so opening a game view doesn't touch the memory card.
+class TitleMetadataCache
+{
+public:
+    TitleMetadataCache(const TitleMetadataCache&) = delete;
+    TitleMetadataCache(TitleMetadataCache&&) = delete;
+    TitleMetadataCache& operator=(const TitleMetadataCache&) = delete;
+    TitleMetadataCache& operator=(TitleMetadataCache&&) = delete;
+
+    TitleMetadataCache(std::string cache_path);
+    ~TitleMetadataCache();
+
+    // checks the metadata of titleids in the background, replaces the
+    // previous walk if it isn't over
+    void walk(std::vector<std::string> titleids);
+    // nullopt if titleid wasn't checked yet, it is then checked before the
+    // rest of the walk
+    std::optional<TitleMetadata> get(const std::string& titleid);
+
+    // if ur0:tai/keys.bin was there at the start of the last walk
+    bool refood_present() const
+    {
+        return _refood_present;
+    }
+    // grows each time an entry is checked
+    uint32_t serial() const
+    {
+        return _serial;
+    }
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    struct Entry
+    {
+        // mtimes of the files the metadata was read from
+        uint64_t stamp;
+        // false for an entry loaded from the cache until its stamp is
+        // checked
+        bool checked;
+        TitleMetadata metadata;
+    };
+
+    std::string _cache_path;
+
+    Cond _cond;
+    std::unordered_map<std::string, Entry> _entries;
+    // titles asked for by get(), before the ones of the walk
+    std::deque<std::string> _urgent;
+    std::vector<std::string> _walk;
+    bool _check_refood = true;
+    bool _dirty = false;
+    bool _dying = false;
+
+    std::atomic<uint32_t> _serial{0};
+    std::atomic<bool> _refood_present{false};
+
+    std::unique_ptr<Thread> _thread;
+
+    // must be called with the mutex locked
+    void drop_changed();
+    void run();
+    void load();
+    // must be called with the mutex locked
+    std::string serialize() const;
+    void save(const std::string& text);
+};
+
+// tells the cache that an install changed the metadata of titleid
+void pkgi_title_metadata_changed(const std::string& titleid);
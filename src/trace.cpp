@@ -0,0 +1,227 @@
+#include "trace.hpp"
+
+#include "file.hpp"
+#include "pkgi.hpp"
+#include "thread.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifndef __vita__
+#include <functional>
+#include <thread>
+#endif
+
+namespace
+{
+struct TraceEvent
+{
+    const char* name;
+    uint64_t start;
+    uint32_t duration;
+    uint32_t tid;
+};
+
+// 96KiB per thread, a few seconds of a download
+constexpr size_t RING_SIZE = 4096;
+// the threads of the downloads come and go, their rings are reused
+constexpr size_t MAX_THREADS = 32;
+
+// Written by its owner only. The dump reads the ring while it's written and
+// drops what may have been overwritten meanwhile.
+struct Ring
+{
+    std::atomic<uint32_t> owner{0};
+    std::atomic<uint64_t> head{0};
+    std::atomic<TraceEvent*> events{nullptr};
+};
+
+std::array<Ring, MAX_THREADS> rings;
+
+// thread names for the metadata of the dump, only touched when a thread
+// takes a ring
+Mutex names_mutex("trace_names_mutex");
+std::vector<std::pair<uint32_t, std::string>> names;
+
+uint32_t current_thread_id()
+{
+#ifdef __vita__
+    return sceKernelGetThreadId();
+#else
+    // 0 marks a free ring
+    return std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+#endif
+}
+
+std::string current_thread_name(uint32_t tid)
+{
+#ifdef __vita__
+    SceKernelThreadInfo info{};
+    info.size = sizeof(info);
+    if (sceKernelGetThreadInfo(tid, &info) >= 0)
+        return info.name;
+#endif
+    return fmt::format("thread {:x}", tid);
+}
+
+Ring* ring_of(uint32_t tid)
+{
+    for (auto& ring : rings)
+        if (ring.owner.load(std::memory_order_relaxed) == tid)
+            return &ring;
+
+    for (auto& ring : rings)
+    {
+        uint32_t free = 0;
+        if (ring.owner.compare_exchange_strong(free, tid))
+        {
+            if (!ring.events.load(std::memory_order_relaxed))
+                ring.events.store(
+                        new TraceEvent[RING_SIZE], std::memory_order_release);
+            std::lock_guard<Mutex> lock(names_mutex);
+            names.emplace_back(tid, current_thread_name(tid));
+            return &ring;
+        }
+    }
+
+    // more threads than rings, their events are lost
+    return nullptr;
+}
+}
+
+void pkgi_trace_add(const char* name, uint64_t start_usec, uint64_t end_usec)
+{
+    const auto tid = current_thread_id();
+    const auto ring = ring_of(tid);
+    if (!ring)
+        return;
+
+    const auto head = ring->head.load(std::memory_order_relaxed);
+    auto& event =
+            ring->events.load(std::memory_order_relaxed)[head % RING_SIZE];
+    event.name = name;
+    event.start = start_usec;
+    event.duration = static_cast<uint32_t>(end_usec - start_usec);
+    event.tid = tid;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void pkgi_trace_release_thread()
+{
+    const auto tid = current_thread_id();
+    for (auto& ring : rings)
+    {
+        uint32_t owner = tid;
+        if (ring.owner.compare_exchange_strong(owner, 0))
+            return;
+    }
+}
+
+size_t pkgi_trace_dump(const std::string& path)
+{
+    std::string json = "{\"traceEvents\":[\n";
+    size_t count = 0;
+
+    std::vector<TraceEvent> copy;
+    for (auto& ring : rings)
+    {
+        const auto events = ring.events.load(std::memory_order_acquire);
+        if (!events)
+            continue;
+
+        const auto head = ring.head.load(std::memory_order_acquire);
+        const auto first = head > RING_SIZE ? head - RING_SIZE : 0;
+        copy.clear();
+        for (auto i = first; i < head; ++i)
+            copy.push_back(events[i % RING_SIZE]);
+
+        // the owner may have wrapped over the oldest ones while we copied,
+        // and may be writing the one after new_head
+        const auto new_head = ring.head.load(std::memory_order_acquire) + 1;
+        const auto valid = new_head > RING_SIZE ? new_head - RING_SIZE : 0;
+        for (auto i = std::max(first, valid); i < head; ++i)
+        {
+            const auto& event = copy[i - first];
+            json += fmt::format(
+                    "{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{},"
+                    "\"ts\":{},\"dur\":{}}},\n",
+                    event.name,
+                    event.tid,
+                    event.start,
+                    event.duration);
+            ++count;
+        }
+    }
+
+    {
+        std::lock_guard<Mutex> lock(names_mutex);
+        for (const auto& name : names)
+            json += fmt::format(
+                    "{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                    "\"tid\":{},\"args\":{{\"name\":\"{}\"}}}},\n",
+                    name.first,
+                    name.second);
+    }
+
+    // the last event can't be followed by a comma
+    json += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"PKGj\"}}\n]}\n";
+
+    pkgi_save(path, json.data(), json.size());
+    return count;
+}
+
+namespace
+{
+struct StartupStep
+{
+    const char* name;
+    uint64_t end;
+};
+
+std::vector<StartupStep> startup_steps;
+bool startup_done = false;
+}
+
+void pkgi_startup_step(const char* name)
+{
+    if (startup_done)
+        return;
+    const auto start = startup_steps.empty() ? 0 : startup_steps.back().end;
+    const auto end = pkgi_time_usec();
+    startup_steps.push_back({name, end});
+    pkgi_trace_add(name, start, end);
+}
+
+void pkgi_startup_done()
+{
+    if (startup_done)
+        return;
+    pkgi_startup_step("first frame");
+    startup_done = true;
+
+    [[maybe_unused]] uint64_t start = 0;
+    for (const auto& step : startup_steps)
+    {
+        LOGF("startup: {} {}ms", step.name, (step.end - start) / 1000);
+        start = step.end;
+    }
+    LOGF("startup: interactive after {}ms", start / 1000);
+    std::vector<StartupStep>().swap(startup_steps);
+}
+
+TraceScope::TraceScope(const char* name)
+    : _name(name), _start(pkgi_time_usec())
+{
+}
+
+TraceScope::~TraceScope()
+{
+    pkgi_trace_add(_name, _start, pkgi_time_usec());
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+// Timeline of what the threads spend their time on, to find frame drops and
+// stalls. Each thread records into a ring of its own without locking, the
+// rings are dumped on demand in the Chrome trace format, which
+// chrome://tracing and Perfetto open.
+//
+// Compiled out unless PKGI_ENABLE_TRACING is set, like the logs.
+#ifdef PKGI_ENABLE_TRACING
+#define PKGI_TRACE_CONCAT2(a, b) a##b
+#define PKGI_TRACE_CONCAT(a, b) PKGI_TRACE_CONCAT2(a, b)
+// times the rest of the enclosing block, name must be a string literal
+#define TRACE_SCOPE(name) \
+    TraceScope PKGI_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name) \
+    do                    \
+    {                     \
+    } while (0)
+#endif
+
+// records an event of the calling thread, name must outlive the dump
+void pkgi_trace_add(const char* name, uint64_t start_usec, uint64_t end_usec);
+
+// lets another thread take the ring of the calling thread, whose events stay
+// in it until they are overwritten. Called when the threads end
+void pkgi_trace_release_thread();
+
+// writes the events still in the rings to path, returns how many there were
+size_t pkgi_trace_dump(const std::string& path);
+
+// Profile of the startup, main thread only. Each step ends where the next one
+// starts, the first at the start of the process. The steps are recorded as
+// events and logged with their duration when the first frame is on screen.
+void pkgi_startup_step(const char* name);
+void pkgi_startup_done();
+
+class TraceScope
+{
+public:
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    explicit TraceScope(const char* name);
+    ~TraceScope();
+
+private:
+    const char* _name;
+    uint64_t _start;
+};
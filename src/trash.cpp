@@ -0,0 +1,116 @@
+#include "trash.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "taskpool.hpp"
+#include "thread.hpp"
+
+#include <fmt/format.h>
+
+#include <mutex>
+#include <stdexcept>
+#include <unordered_set>
+
+#include <ctime>
+
+namespace
+{
+Mutex trash_mutex("trash_mutex");
+TaskPool* trash_pool = nullptr;
+// partitions with an emptying queued
+std::unordered_set<std::string> emptying;
+uint32_t trashed = 0;
+
+std::string trash_of(const std::string& partition)
+{
+    return partition + "pkgj/.trash";
+}
+
+// must be called with trash_mutex locked
+void empty_later(const std::string& partition)
+{
+    if (!trash_pool || !emptying.insert(partition).second)
+        return;
+
+    try
+    {
+        trash_pool->submit(TaskPool::PriorityLow, [partition](const Task&) {
+            {
+                // what is trashed from now on needs another emptying
+                std::lock_guard<Mutex> lock(trash_mutex);
+                emptying.erase(partition);
+            }
+
+            const auto trash = trash_of(partition);
+            for (const auto& name : pkgi_list_dir_contents(trash))
+            {
+                if (name == "." || name == "..")
+                    continue;
+                try
+                {
+                    pkgi_delete_dir(fmt::format("{}/{}", trash, name));
+                }
+                catch (const std::exception& e)
+                {
+                    // tried again at the next start
+                    LOGF("failed to empty {}: {}", trash, e.what());
+                }
+            }
+        });
+    }
+    catch (const std::exception& e)
+    {
+        emptying.erase(partition);
+        LOGF("failed to empty the trash of {}: {}", partition, e.what());
+    }
+}
+}
+
+void pkgi_trash_dir(const std::string& path)
+{
+    const auto colon = path.find(':');
+    std::string partition;
+    std::string target;
+    {
+        std::lock_guard<Mutex> lock(trash_mutex);
+        if (trash_pool && colon != std::string::npos)
+        {
+            partition = path.substr(0, colon + 1);
+            // the time keeps apart the names of two runs
+            target = fmt::format(
+                    "{}/{:x}-{}",
+                    trash_of(partition),
+                    std::time(nullptr),
+                    trashed++);
+        }
+    }
+
+    if (!target.empty())
+    {
+        if (!pkgi_file_exists(path))
+            return;
+        try
+        {
+            pkgi_mkdirs(trash_of(partition).c_str());
+            pkgi_rename(path, target);
+            std::lock_guard<Mutex> lock(trash_mutex);
+            empty_later(partition);
+            return;
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("failed to trash {}, deleting it: {}", path, e.what());
+        }
+    }
+
+    pkgi_delete_dir(path);
+}
+
+void pkgi_set_trash_pool(
+        TaskPool* pool, const std::vector<std::string>& partitions)
+{
+    std::lock_guard<Mutex> lock(trash_mutex);
+    trash_pool = pool;
+    for (const auto& partition : partitions)
+        empty_later(partition);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+class TaskPool;
+
+// Removing a tree reads and deletes every file of it, tens of seconds for a
+// PSP game. pkgi_trash_dir() only moves the tree into the pkgj/.trash
+// directory of its partition, the trash is emptied later on the task pool.
+
+// moves path out of the way, the same as deleting it for the caller. Deletes
+// it right away when there is no pool or the move failed
+void pkgi_trash_dir(const std::string& path);
+
+// empties the trash of partitions, what a previous run left in it included,
+// and from now on of each partition trashed to
+void pkgi_set_trash_pool(
+        TaskPool* pool, const std::vector<std::string>& partitions = {});
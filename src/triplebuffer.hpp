@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+
+#include <cstdint>
+
+// Hands the last value written by one thread to one other thread without
+// locks. The writer fills a slot of its own and swaps it with the middle
+// one, the reader swaps the middle one with its own when it's newer, so
+// neither ever waits for the other and the reader sees no torn value.
+template <typename T>
+class TripleBuffer
+{
+public:
+    // writer side
+    void write(const T& value)
+    {
+        _slots[_back] = value;
+        _back = _middle.exchange(_back | DIRTY, std::memory_order_acq_rel) &
+                INDEX;
+    }
+
+    // reader side, the last written value or the one read before if nothing
+    // was written since
+    const T& read()
+    {
+        if (_middle.load(std::memory_order_relaxed) & DIRTY)
+            _front = _middle.exchange(_front, std::memory_order_acq_rel) &
+                     INDEX;
+        return _slots[_front];
+    }
+
+private:
+    static constexpr uint8_t INDEX = 0x3;
+    static constexpr uint8_t DIRTY = 0x4;
+
+    T _slots[3]{};
+    // only touched by the writer
+    uint8_t _back = 0;
+    std::atomic<uint8_t> _middle{1};
+    // only touched by the reader
+    uint8_t _front = 2;
+};
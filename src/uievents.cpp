@@ -0,0 +1,24 @@
+#include "uievents.hpp"
+
+UiEvents::UiEvents() : _mutex("ui_events_mutex")
+{
+}
+
+void UiEvents::post(UiEvent event)
+{
+    ScopeLock _(_mutex);
+    _events.push_back(std::move(event));
+    _pending.store(true, std::memory_order_release);
+}
+
+std::vector<UiEvent> UiEvents::drain()
+{
+    std::vector<UiEvent> events;
+    if (!pending())
+        return events;
+
+    ScopeLock _(_mutex);
+    events.swap(_events);
+    _pending.store(false, std::memory_order_relaxed);
+    return events;
+}
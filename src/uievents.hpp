@@ -0,0 +1,71 @@
+#pragma once
+
+#include "thread.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+enum class UiEventType : uint8_t
+{
+    // a download went through its install
+    Installed,
+    // a download or its install ended without installing, it failed or was
+    // canceled, a .resume may be left
+    Ended,
+    // the reload thread prepared a list to show
+    CatalogReady,
+    // a background refresh fetched the lists, some may have changed
+    CatalogChanged,
+    // a background thread failed, message is shown in a dialog
+    Error,
+};
+
+struct UiEvent
+{
+    UiEventType type;
+    // of the downloaded item, empty for the catalog events
+    std::string content;
+    std::string titleid;
+    // the compatibility packs only change what the game view shows, the
+    // presence of the rows stays the same
+    bool changes_presence = true;
+    // for CatalogChanged, a bit for each Mode whose list changed
+    uint32_t modes = 0;
+    // for Error
+    std::string message;
+};
+
+// What the background threads tell the UI, drained by the main loop once a
+// frame so that only the rows and the game view concerned are updated. The
+// progress of the downloads isn't in there, it changes with each chunk and
+// is read from Downloader's published status instead.
+class UiEvents
+{
+public:
+    UiEvents(const UiEvents&) = delete;
+    UiEvents& operator=(const UiEvents&) = delete;
+
+    UiEvents();
+
+    // from any thread
+    void post(UiEvent event);
+
+    bool pending() const
+    {
+        return _pending.load(std::memory_order_acquire);
+    }
+    // the events posted since the last call, in order. A frame without any
+    // doesn't take the lock
+    std::vector<UiEvent> drain();
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    Mutex _mutex;
+    std::vector<UiEvent> _events;
+    std::atomic<bool> _pending{false};
+};
@@ -1,10 +1,14 @@
+#include "update.hpp"
+
 #include "dialog.hpp"
 #include "file.hpp"
+#include "filedownload.hpp"
 #include "pkgi.hpp"
+#include "taskpool.hpp"
 #include "vitahttp.hpp"
 
-#include <boost/scope_exit.hpp>
-
+#include <ctime>
+#include <sstream>
 #include <vector>
 
 #define PKGJ_UPDATE_URL "https://raw.githubusercontent.com/guch8017/pkgj/last"
@@ -28,33 +32,17 @@ void start_download()
 
         pkgi_dialog_message("正在下载新版本安装文件...", 0);
 
-        try
-        {
-            const auto file = pkgi_create(filename.c_str());
-            BOOST_SCOPE_EXIT_ALL(&)
-            {
-                pkgi_close(file);
-            };
+        // a failed download leaves the partial file, the next one goes on
+        // from there
+        const auto partial = filename + ".part";
+        FileDownload download(std::make_unique<VitaHttp>());
+        download.http_factory = [] { return std::make_unique<VitaHttp>(); };
+        download.update_progress_cb = [](uint64_t, uint64_t) {};
+        download.is_canceled = [] { return false; };
+        download.save(partial, url);
+        pkgi_rename(partial, filename);
 
-            VitaHttp http;
-            http.start(url, 0);
-            std::vector<uint8_t> data(64 * 1024);
-            while (true)
-            {
-                const auto read = http.read(data.data(), data.size());
-                if (read == 0)
-                    break;
-                pkgi_write(file, data.data(), read);
-            }
-
-            LOGF("update download complete");
-        }
-        catch (...)
-        {
-            LOGF("download failed, removing partial file");
-            pkgi_rm(filename.c_str());
-            throw;
-        }
+        LOGF("update download complete");
 
         pkgi_dialog_message(
                 fmt::format(
@@ -69,18 +57,70 @@ void start_download()
     }
 }
 
-void update_thread()
+// "<time>\n<version>\n" of the last check, see UPDATE_CHECK_TTL_SECONDS
+std::string cache_path()
+{
+    return fmt::format("{}/update_check", pkgi_get_config_folder());
+}
+
+bool load_cached_version(std::string& last_version)
+{
+    try
+    {
+        const auto data = pkgi_load(cache_path());
+        std::istringstream lines(std::string(data.begin(), data.end()));
+        int64_t checked_at = 0;
+        if (!(lines >> checked_at >> last_version))
+            return false;
+        const int64_t now = std::time(nullptr);
+        return now >= checked_at &&
+               now - checked_at < UPDATE_CHECK_TTL_SECONDS;
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+void save_cached_version(const std::string& last_version)
 {
+    const auto text = fmt::format(
+            "{}\n{}\n", static_cast<int64_t>(std::time(nullptr)), last_version);
+    // a failed save only costs a check at the next launch
     try
     {
-        LOGF("checking latest pkgi version at {}", PKGJ_UPDATE_URL_VERSION);
+        pkgi_save(cache_path(), text.data(), text.size());
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to save the update check: {}", e.what());
+    }
+}
 
-        VitaHttp http;
-        http.start(PKGJ_UPDATE_URL_VERSION, 0);
-        std::vector<uint8_t> last_versionb(10);
-        last_versionb.resize(
-                http.read(last_versionb.data(), last_versionb.size()));
-        std::string last_version(last_versionb.begin(), last_versionb.end());
+void check_update()
+{
+    try
+    {
+        std::string last_version;
+        if (load_cached_version(last_version))
+            LOGF("last version checked recently: {}", last_version);
+        else
+        {
+            LOGF("checking latest pkgi version at {}",
+                 PKGJ_UPDATE_URL_VERSION);
+
+            VitaHttp http;
+            http.start(PKGJ_UPDATE_URL_VERSION, 0);
+            std::vector<uint8_t> last_versionb(10);
+            last_versionb.resize(
+                    http.read(last_versionb.data(), last_versionb.size()));
+            last_version.assign(last_versionb.begin(), last_versionb.end());
+            // the file ends with a newline
+            last_version.erase(last_version.find_last_not_of("\r\n ") + 1);
+            if (last_version.empty())
+                throw std::runtime_error("empty version file");
+            save_cached_version(last_version);
+        }
 
         LOGF("last version is {}", last_version);
 
@@ -106,12 +146,12 @@ void update_thread()
     }
     catch (const std::exception& e)
     {
-        LOGF("error in update thread: {}", e.what());
+        LOGF("error in update check: {}", e.what());
     }
 }
 }
 
-void start_update_thread()
+void start_update_check(TaskPool* pool)
 {
-    pkgi_start_thread("pkgj_update", &update_thread);
+    pool->submit(TaskPool::PriorityLow, [](const Task&) { check_update(); });
 }
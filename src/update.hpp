@@ -1,3 +1,13 @@
 #pragma once
 
-void start_update_thread();
\ No newline at end of file
+#include <cstdint>
+
+class TaskPool;
+
+// a launch within this of the last check takes its answer instead of asking
+// GitHub again
+static constexpr int64_t UPDATE_CHECK_TTL_SECONDS = 12 * 60 * 60;
+
+// checks the last version at the low priority of pool, after the tasks of
+// the first list load
+void start_update_check(TaskPool* pool);
@@ -0,0 +1,153 @@
+#include "updatechecker.hpp"
+
+#include "log.hpp"
+#include "patchinfo.hpp"
+
+#include <fmt/format.h>
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+UpdateChecker::UpdateChecker(
+        PatchInfoCache* cache, TaskPool* pool, HttpFactory make_http)
+    : _cache(cache)
+    , _pool(pool)
+    , _make_http(std::move(make_http))
+    , _mutex("update_checker_mutex")
+    , _tasks(CONNECTIONS)
+{
+}
+
+UpdateChecker::~UpdateChecker()
+{
+    std::vector<std::shared_ptr<Task>> tasks;
+    {
+        ScopeLock _(_mutex);
+        _dying = true;
+        for (const auto http : _https)
+            http->abort();
+        // no task is submitted anymore
+        tasks = _tasks;
+    }
+    for (const auto& task : tasks)
+        if (task)
+        {
+            task->cancel();
+            task->wait();
+        }
+}
+
+void UpdateChecker::check(std::vector<std::string> titleids)
+{
+    ScopeLock _(_mutex);
+    // the titles in flight are counted in the new check, their result is
+    // still useful
+    const auto in_flight = _total - _done - _pending.size();
+    _pending.assign(titleids.rbegin(), titleids.rend());
+    _total = _pending.size() + in_flight;
+    _done = 0;
+    for (size_t slot = 0; slot < CONNECTIONS && _running < _pending.size();
+         ++slot)
+        if (!_busy[slot])
+            submit(slot);
+}
+
+void UpdateChecker::submit(size_t slot)
+{
+    _busy[slot] = true;
+    ++_running;
+    // a title per task, so that a game view opened meanwhile doesn't wait
+    // for the whole check
+    _tasks[slot] = _pool->submit(
+            TaskPool::PriorityLow,
+            [this, slot](const Task& task) { run(slot, task); });
+}
+
+std::unordered_map<std::string, std::string> UpdateChecker::patch_versions()
+{
+    ScopeLock _(_mutex);
+    return _patch_versions;
+}
+
+UpdateChecker::Progress UpdateChecker::progress()
+{
+    ScopeLock _(_mutex);
+    return {_done, _total};
+}
+
+std::optional<PatchInfo> UpdateChecker::fetch(const std::string& titleid)
+{
+    std::optional<PatchInfo> patch_info;
+    if (_cache->get(titleid, patch_info))
+        return patch_info;
+
+    // the connection to the update server stays in the pool of the http
+    // implementation between the titles
+    auto http = _make_http();
+    {
+        ScopeLock _(_mutex);
+        if (_dying)
+            throw std::runtime_error("中止");
+        _https.push_back(http.get());
+    }
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        ScopeLock _(_mutex);
+        _https.erase(std::find(_https.begin(), _https.end(), http.get()));
+    };
+
+    patch_info = pkgi_download_patch_info(http.get(), titleid);
+
+    // a 404 is cached too, errors aren't
+    _cache->put(titleid, patch_info);
+    return patch_info;
+}
+
+void UpdateChecker::run(size_t slot, const Task& task)
+{
+    std::string titleid;
+    {
+        ScopeLock _(_mutex);
+        if (_pending.empty() || task.cancelled())
+        {
+            _busy[slot] = false;
+            --_running;
+            return;
+        }
+        titleid = std::move(_pending.back());
+        _pending.pop_back();
+    }
+
+    std::optional<PatchInfo> patch_info;
+    bool failed = false;
+    try
+    {
+        patch_info = fetch(titleid);
+    }
+    catch (const std::exception& e)
+    {
+        // the title keeps its previous result, if any
+        LOGF("failed to check updates of {}: {}", titleid, e.what());
+        failed = true;
+    }
+
+    ScopeLock _(_mutex);
+    if (!failed)
+    {
+        if (patch_info)
+            _patch_versions[titleid] = patch_info->version;
+        else
+            _patch_versions.erase(titleid);
+    }
+    _done = std::min(_done + 1, _total);
+    ++_serial;
+
+    // the slot goes on with the next title, behind the tasks queued
+    // meanwhile
+    _busy[slot] = false;
+    --_running;
+    if (!_pending.empty() && !_dying)
+        submit(slot);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "http.hpp"
+#include "patchinfocache.hpp"
+#include "taskpool.hpp"
+#include "thread.hpp"
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+// Asks the update server for the last patch of a list of titles, a few at a
+// time on the task pool. The results go through the patch info cache, so a
+// check done again within its ttl doesn't touch the network, and a game view
+// opened after a check shows its result right away.
+class UpdateChecker
+{
+public:
+    // the -ver.xml are tiny, the fetch is all latency, a few connections are
+    // enough and leave the other http slots to the downloader
+    static constexpr size_t CONNECTIONS = 3;
+
+    using HttpFactory = std::function<std::unique_ptr<Http>()>;
+
+    struct Progress
+    {
+        size_t done;
+        size_t total;
+    };
+
+    UpdateChecker(const UpdateChecker&) = delete;
+    UpdateChecker(UpdateChecker&&) = delete;
+    UpdateChecker& operator=(const UpdateChecker&) = delete;
+    UpdateChecker& operator=(UpdateChecker&&) = delete;
+
+    UpdateChecker(
+            PatchInfoCache* cache, TaskPool* pool, HttpFactory make_http);
+    ~UpdateChecker();
+
+    // checks titleids in the background, replaces the titles of a check that
+    // isn't over
+    void check(std::vector<std::string> titleids);
+
+    // version of the last patch of each checked title that has one
+    std::unordered_map<std::string, std::string> patch_versions();
+    Progress progress();
+    // grows each time a title is checked
+    uint32_t serial() const
+    {
+        return _serial;
+    }
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    PatchInfoCache* _cache;
+    TaskPool* _pool;
+    HttpFactory _make_http;
+
+    Mutex _mutex;
+    // popped from the back
+    std::vector<std::string> _pending;
+    size_t _done = 0;
+    size_t _total = 0;
+    std::unordered_map<std::string, std::string> _patch_versions;
+    // the requests in flight, aborted on destruction
+    std::vector<Http*> _https;
+    bool _dying = false;
+
+    std::atomic<uint32_t> _serial{0};
+
+    // a slot per connection, its task checks a title and submits the next
+    // one until there are none left
+    std::vector<std::shared_ptr<Task>> _tasks;
+    std::array<bool, CONNECTIONS> _busy{};
+    size_t _running = 0;
+
+    // must be called with the mutex locked
+    void submit(size_t slot);
+    void run(size_t slot, const Task& task);
+    // nullopt when there is no update, throws when the server can't be asked
+    std::optional<PatchInfo> fetch(const std::string& titleid);
+};
@@ -3,6 +3,9 @@
 #include <fmt/format.h>
 
 #include <array>
+#include <string>
+#include <vector>
+
 #include <cstdint>
 
 #ifdef _MSC_VER
@@ -179,4 +182,22 @@ inline bool ends_with(std::string const& value, std::string const& ending)
         return false;
     return value.compare(value.size() - ending.size(), ending.size(), ending) ==
            0;
-}
\ No newline at end of file
+}
+
+// the pieces of text between the separators, a separator at the very end
+// doesn't start an empty last piece
+inline std::vector<std::string> pkgi_split(
+        const std::string& text, char separator)
+{
+    std::vector<std::string> pieces;
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        auto end = text.find(separator, pos);
+        if (end == std::string::npos)
+            end = text.size();
+        pieces.push_back(text.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return pieces;
+}
@@ -9,11 +9,20 @@ extern "C"
 #include "file.hpp"
 #include "http.hpp"
 #include "log.hpp"
+#include "memstats.hpp"
+#include "resumejournal.hpp"
+#include "thread.hpp"
+#include "trace.hpp"
+#include "vitahttp.hpp"
 
 #include <fmt/format.h>
 
 #include <boost/scope_exit.hpp>
 
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <optional>
 #include <string>
 
 #include <vita2d.h>
@@ -43,6 +52,7 @@ extern "C"
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 extern "C"
@@ -51,9 +61,11 @@ extern "C"
 }
 
 static vita2d_pgf* g_font;
+static uint32_t g_font_serial;
 
 static SceKernelLwMutexWork g_dialog_lock;
 static volatile int g_power_lock;
+static volatile int g_wifi_hold;
 
 static int g_ok_button;
 static int g_cancel_button;
@@ -61,6 +73,15 @@ static uint32_t g_button_frame_count;
 
 static SceUInt64 g_time;
 
+// set once the network libraries are up, pkgi_wait_network() blocks until then
+static SceUID g_network_ready = -1;
+static constexpr SceUInt32 NETWORK_READY = 1;
+
+// the pools the system libraries are given at start, their use is read back
+// by pkgi_poll_memory_pools()
+static pkgi_pool_sizes g_pools;
+static void* g_net_memory;
+
 #ifdef PKGI_ENABLE_LOGGING
 static int g_log_socket;
 #endif
@@ -73,22 +94,15 @@ static int g_log_socket;
 
 #define PKGI_ERRNO_ENOENT (int)(0x80010000 + SCE_NET_ENOENT)
 
-#ifdef PKGI_ENABLE_LOGGING
-void pkgi_log(const char* msg, ...)
+void pkgi_log_write(const char* text, uint32_t size)
 {
-    char buffer[512];
-
-    va_list args;
-    va_start(args, msg);
-    // TODO: why sceClibVsnprintf doesn't work here?
-    int len = vsnprintf(buffer, sizeof(buffer) - 1, msg, args);
-    va_end(args);
-    buffer[len] = '\n';
-
-    sceNetSend(g_log_socket, buffer, len + 1, 0);
-    // sceKernelDelayThread(10);
-}
+#ifdef PKGI_ENABLE_LOGGING
+    sceNetSend(g_log_socket, text, size, 0);
+#else
+    PKGI_UNUSED(text);
+    PKGI_UNUSED(size);
 #endif
+}
 
 int pkgi_snprintf(char* buffer, uint32_t size, const char* msg, ...)
 {
@@ -163,6 +177,7 @@ static void pkgi_start_debug_log(void)
     sceNetInetPton(SCE_NET_AF_INET, "239.255.0.100", &addr.sin_addr);
 
     sceNetConnect(g_log_socket, (SceNetSockaddr*)&addr, sizeof(addr));
+    pkgi_log_start();
     LOG("debug logging socket initialized");
 #endif
 }
@@ -170,6 +185,7 @@ static void pkgi_start_debug_log(void)
 static void pkgi_stop_debug_log(void)
 {
 #ifdef PKGI_ENABLE_LOGGING
+    pkgi_log_stop();
     sceNetSocketClose(g_log_socket);
 #endif
 }
@@ -212,20 +228,67 @@ int pkgi_cancel_button(void)
     return g_cancel_button;
 }
 
+static Mutex g_power_handler_mutex("power_handler_mutex");
+static std::function<void(PowerEvent)> g_power_handler;
+
+void pkgi_set_power_handler(std::function<void(PowerEvent)> handler)
+{
+    std::lock_guard<Mutex> lock(g_power_handler_mutex);
+    g_power_handler = std::move(handler);
+}
+
+// runs on the power thread, which waits with callbacks enabled
+static int pkgi_power_callback(
+        int notify_id, int notify_count, int power_info, void* common)
+{
+    PKGI_UNUSED(notify_id);
+    PKGI_UNUSED(notify_count);
+    PKGI_UNUSED(common);
+
+    std::optional<PowerEvent> event;
+    if (power_info & SCE_POWER_CB_SUSPENDING)
+        event = PowerEvent::Suspending;
+    else if (power_info & SCE_POWER_CB_RESUME_COMPLETE)
+        event = PowerEvent::Resumed;
+    if (!event)
+        return 0;
+
+    std::lock_guard<Mutex> lock(g_power_handler_mutex);
+    if (g_power_handler)
+        g_power_handler(*event);
+    return 0;
+}
+
 static int pkgi_power_thread(SceSize args, void* argp)
 {
     PKGI_UNUSED(args);
     PKGI_UNUSED(argp);
-    for (;;)
+
+    const SceUID callback = sceKernelCreateCallback(
+            "power_callback", 0, &pkgi_power_callback, NULL);
+    if (callback < 0 || scePowerRegisterCallback(callback) < 0)
+        LOG("cannot register the power callback");
+
+    for (uint32_t second = 0;; ++second)
     {
         int lock;
         __atomic_load(&g_power_lock, &lock, __ATOMIC_SEQ_CST);
-        if (lock > 0)
+        if (lock > 0 && second % 10 == 0)
         {
             sceKernelPowerTick(SCE_KERNEL_POWER_TICK_DISABLE_AUTO_SUSPEND);
         }
 
-        sceKernelDelayThread(10 * 1000 * 1000);
+        // the radio goes to power save with the rest of the system once it's
+        // idle, the default tick tells it that the system is in use. It also
+        // resets the timers of the screen, which stays lit
+        int wifi;
+        __atomic_load(&g_wifi_hold, &wifi, __ATOMIC_SEQ_CST);
+        if (wifi > 0)
+        {
+            sceKernelPowerTick(SCE_KERNEL_POWER_TICK_DEFAULT);
+        }
+
+        sceKernelDelayThreadCB(1000 * 1000);
     }
     return 0;
 }
@@ -407,6 +470,11 @@ void pkgi_dialog_input_text(const char* title, const char* text)
     }
 }
 
+int pkgi_dialog_input_is_open(void)
+{
+    return g_ime_active;
+}
+
 int pkgi_dialog_input_update(void)
 {
     if (!g_ime_active)
@@ -438,19 +506,19 @@ void pkgi_dialog_input_get_text(char* text, uint32_t size)
     text[count] = 0;
 }
 
-void pkgi_start(void)
+// the network libraries take a good part of the startup and nothing needs them
+// before the first frame, they are brought up meanwhile
+static void pkgi_init_network(void)
 {
-    pkgi_load_sce_paf();
-    sceSysmoduleLoadModuleInternal(SCE_SYSMODULE_INTERNAL_PROMOTER_UTIL);
+    const auto start = pkgi_time_usec();
     sceSysmoduleLoadModule(SCE_SYSMODULE_NET);
     sceSysmoduleLoadModule(SCE_SYSMODULE_HTTP);
     sceSysmoduleLoadModule(SCE_SYSMODULE_SSL);
-    sceSysmoduleLoadModule(SCE_SYSMODULE_SQLITE);
 
-    static uint8_t netmem[1024 * 1024];
+    g_net_memory = malloc(g_pools.net);
     SceNetInitParam net = {
-            .memory = netmem,
-            .size = sizeof(netmem),
+            .memory = g_net_memory,
+            .size = static_cast<int>(g_pools.net),
             .flags = 0,
     };
 
@@ -460,16 +528,72 @@ void pkgi_start(void)
     pkgi_start_debug_log();
 
     LOG("initializing SSL");
-    sceSslInit(1024 * 1024);
+    sceSslInit(g_pools.ssl);
     LOG("initializing HTTP");
-    sceHttpInit(1024 * 1024);
-    LOG("network initialized");
+    sceHttpInit(g_pools.http);
 
     sceHttpsDisableOption(SCE_HTTPS_FLAG_SERVER_VERIFY);
+    pkgi_trace_add("network init", start, pkgi_time_usec());
+    LOGF("network initialized in {}ms", (pkgi_time_usec() - start) / 1000);
+
+    sceKernelSetEventFlag(g_network_ready, NETWORK_READY);
+}
+
+static int pkgi_network_thread(SceSize args, void* argp)
+{
+    PKGI_UNUSED(args);
+    PKGI_UNUSED(argp);
+
+    pkgi_init_network();
+    pkgi_trace_release_thread();
+    return sceKernelExitDeleteThread(0);
+}
+
+void pkgi_wait_network(void)
+{
+    sceKernelWaitEventFlag(
+            g_network_ready, NETWORK_READY, SCE_EVENT_WAITAND, NULL, NULL);
+}
+
+void pkgi_start(const pkgi_pool_sizes& pools)
+{
+    g_pools = pools;
+    pkgi_mem_set_limit(MemPool::Net, pools.net);
+    pkgi_mem_set_limit(MemPool::Ssl, pools.ssl);
+    pkgi_mem_set_limit(MemPool::Http, pools.http);
+    pkgi_mem_set_limit(MemPool::Vita2d, pools.vita2d);
+    LOGF("pools: net {} KB ssl {} KB http {} KB vita2d {} KB",
+         pools.net / 1024,
+         pools.ssl / 1024,
+         pools.http / 1024,
+         pools.vita2d / 1024);
+
+    pkgi_load_sce_paf();
+    sceSysmoduleLoadModuleInternal(SCE_SYSMODULE_INTERNAL_PROMOTER_UTIL);
+    sceSysmoduleLoadModule(SCE_SYSMODULE_SQLITE);
+    pkgi_startup_step("system modules");
+
+    g_network_ready =
+            sceKernelCreateEventFlag("network_ready", 0, 0, NULL);
+    SceUID network_thread = sceKernelCreateThread(
+            "network_init_thread",
+            &pkgi_network_thread,
+            0x10000100,
+            0x10000,
+            0,
+            0,
+            NULL);
+    if (network_thread < 0 ||
+        sceKernelStartThread(network_thread, 0, NULL) < 0)
+    {
+        LOG("cannot start the network thread, initializing inline");
+        pkgi_init_network();
+    }
 
     sceKernelCreateLwMutex(&g_dialog_lock, "dialog_lock", 2, 0, NULL);
 
-    scePowerSetArmClockFrequency(444);
+    // until the governor, if any, picks the clocks
+    pkgi_set_cpu_clock(444);
 
     sceShellUtilInitEvents(0);
     sceShellUtilLock(SCE_SHELL_UTIL_LOCK_TYPE_USB_CONNECTION);
@@ -518,8 +642,12 @@ void pkgi_start(void)
         sceKernelStartThread(power_thread, 0, NULL);
     }
 
-    vita2d_init_advanced(4 * 1024 * 1024);
+    pkgi_startup_step("system utilities");
+
+    vita2d_init_advanced(g_pools.vita2d);
     g_font = vita2d_load_custom_pgf("ux0:app/PKGJ00001/font.pgf");
+    ++g_font_serial;
+    pkgi_startup_step("vita2d and font");
 
     g_time = sceKernelGetProcessTimeWide();
 
@@ -560,8 +688,6 @@ int pkgi_update(pkgi_input* input)
         g_button_frame_count = 0;
     }
 
-    vita2d_start_drawing();
-
     uint64_t time = sceKernelGetProcessTimeWide();
     input->delta = time - g_time;
     g_time = time;
@@ -569,18 +695,51 @@ int pkgi_update(pkgi_input* input)
     return 1;
 }
 
-void pkgi_swap(void)
+void pkgi_start_frame(void)
 {
-    // LOG("vita2d pool free space = %u KB", vita2d_pool_free_space() / 1024);
+    vita2d_start_drawing();
+}
 
+void pkgi_poll_memory_pools()
+{
+    const uint64_t vita2d_used = g_pools.vita2d - vita2d_pool_free_space();
+    const auto vita2d_peak = std::max(
+            vita2d_used, pkgi_mem_totals().peak[size_t(MemPool::Vita2d)]);
+    pkgi_mem_set(MemPool::Vita2d, vita2d_used, vita2d_peak);
+
+    SceNetStatisticsInfo net{};
+    if (sceNetGetStatisticsInfo(&net, 0) >= 0)
+        pkgi_mem_set(
+                MemPool::Net,
+                g_pools.net - net.libnet_mem_free_size,
+                g_pools.net - net.libnet_mem_free_min);
+
+    SceSslMemoryPoolStats ssl{};
+    if (sceSslGetMemoryPoolStats(&ssl) >= 0)
+        pkgi_mem_set(MemPool::Ssl, ssl.currentInuseSize, ssl.maxInuseSize);
+
+    SceHttpMemoryPoolStats http{};
+    if (sceHttpGetMemoryPoolStats(&http) >= 0)
+        pkgi_mem_set(MemPool::Http, http.currentInuseSize, http.maxInuseSize);
+}
+
+void pkgi_swap(void)
+{
     vita2d_end_drawing();
     vita2d_common_dialog_update();
     vita2d_swap_buffers();
     sceDisplayWaitVblankStart();
 }
 
+void pkgi_skip_frame(void)
+{
+    sceDisplayWaitVblankStart();
+}
+
 void pkgi_end(void)
 {
+    // quitting before the network is up must not tear it down under its thread
+    pkgi_wait_network();
     pkgi_stop_debug_log();
 
     vita2d_fini();
@@ -592,10 +751,12 @@ void pkgi_end(void)
 
     sceKernelDeleteLwMutex(&g_dialog_lock);
 
+    VitaHttp::close_pool();
     sceHttpTerm();
     // sceSslTerm();
     sceNetCtlTerm();
     sceNetTerm();
+    free(g_net_memory);
 
     sceSysmoduleUnloadModule(SCE_SYSMODULE_SSL);
     sceSysmoduleUnloadModule(SCE_SYSMODULE_HTTP);
@@ -605,6 +766,15 @@ void pkgi_end(void)
     sceKernelExitProcess(0);
 }
 
+void pkgi_set_cpu_clock(uint32_t mhz)
+{
+    // the memory bound decryption needs the bus too, the GPU only draws the
+    // UI
+    scePowerSetArmClockFrequency(mhz);
+    scePowerSetBusClockFrequency(mhz >= 333 ? 222 : 166);
+    scePowerSetGpuClockFrequency(mhz >= 333 ? 166 : 111);
+}
+
 int pkgi_battery_present()
 {
     return sceKernelGetModel() == SCE_KERNEL_MODEL_VITA;
@@ -632,6 +802,14 @@ uint64_t pkgi_get_free_space(const char* requested_partition)
     return info.free_size;
 }
 
+uint64_t pkgi_get_total_space(const char* partition)
+{
+    SceIoDevInfo info{};
+    if (sceIoDevctl(partition, 0x3001, NULL, 0, &info, sizeof(info)) < 0)
+        return 0;
+    return info.max_size;
+}
+
 const char* pkgi_get_config_folder()
 {
     if (0)
@@ -652,8 +830,8 @@ const char* pkgi_get_config_folder()
 
 int pkgi_is_incomplete(const char* partition, const char* contentid)
 {
-    return pkgi_file_exists(
-            fmt::format("{}pkgj/{}.resume", partition, contentid).c_str());
+    return ResumeJournal::exists(
+            fmt::format("{}pkgj/{}.resume", partition, contentid));
 }
 
 void pkgi_delete_dir(const std::string& path)
@@ -716,6 +894,11 @@ uint32_t pkgi_time_msec()
     return sceKernelGetProcessTimeLow() / 1000;
 }
 
+uint64_t pkgi_time_usec()
+{
+    return sceKernelGetProcessTimeWide();
+}
+
 static int pkgi_vita_thread(SceSize args, void* argp)
 {
     PKGI_UNUSED(args);
@@ -726,8 +909,16 @@ static int pkgi_vita_thread(SceSize args, void* argp)
 
 void pkgi_start_thread(const char* name, pkgi_thread_entry* start)
 {
+    // the list reloads and refreshes, and the self update check
+    const auto placement = pkgi_thread_placement(ThreadRole::Background);
     SceUID id = sceKernelCreateThread(
-            name, &pkgi_vita_thread, 0x40, 1024 * 1024, 0, 0, NULL);
+            name,
+            &pkgi_vita_thread,
+            placement.priority,
+            1024 * 1024,
+            0,
+            pkgi_thread_cpu_mask(placement),
+            NULL);
     if (id < 0)
     {
         LOG("failed to start %s thread", name);
@@ -755,6 +946,31 @@ void pkgi_lock_process(void)
     }
 }
 
+void pkgi_hold_wifi(void)
+{
+    if (__atomic_fetch_add(&g_wifi_hold, 1, __ATOMIC_SEQ_CST) == 0)
+        LOG("holding wifi out of power save");
+}
+
+void pkgi_release_wifi(void)
+{
+    if (__atomic_sub_fetch(&g_wifi_hold, 1, __ATOMIC_SEQ_CST) == 0)
+        LOG("releasing wifi");
+}
+
+bool pkgi_wifi_signal(int& dbm, int& percent)
+{
+    SceNetCtlInfo info;
+    if (sceNetCtlInetGetInfo(SCE_NETCTL_INFO_GET_RSSI_DBM, &info) < 0)
+        return false;
+    // given as a magnitude
+    dbm = -abs(static_cast<int>(info.rssi_dbm));
+    if (sceNetCtlInetGetInfo(SCE_NETCTL_INFO_GET_RSSI_PERCENTAGE, &info) < 0)
+        return false;
+    percent = static_cast<int>(info.rssi_percentage);
+    return dbm != 0;
+}
+
 void pkgi_unlock_process(void)
 {
     if (__atomic_sub_fetch(&g_power_lock, 1, __ATOMIC_SEQ_CST) == 0)
@@ -778,12 +994,45 @@ pkgi_texture pkgi_load_png_raw(const void* data, uint32_t size)
     return tex;
 }
 
+pkgi_texture pkgi_create_texture(
+        uint32_t width, uint32_t height, const uint32_t* pixels)
+{
+    // the default format is A8B8G8R8, the bytes are in RGBA order
+    vita2d_texture* tex = vita2d_create_empty_texture(width, height);
+    if (!tex)
+    {
+        LOG("failed to create texture");
+        return NULL;
+    }
+    const auto stride = vita2d_texture_get_stride(tex);
+    auto data = static_cast<uint8_t*>(vita2d_texture_get_datap(tex));
+    for (uint32_t y = 0; y < height; ++y)
+        memcpy(data + y * stride, pixels + y * width, width * 4);
+    return tex;
+}
+
+void pkgi_free_texture(pkgi_texture texture)
+{
+    vita2d_free_texture(static_cast<vita2d_texture*>(texture));
+}
+
 void pkgi_draw_texture(pkgi_texture texture, int x, int y)
 {
     vita2d_texture* tex = static_cast<vita2d_texture*>(texture);
     vita2d_draw_texture(tex, (float)x, (float)y);
 }
 
+void pkgi_draw_texture_scaled(pkgi_texture texture, int x, int y, int w, int h)
+{
+    vita2d_texture* tex = static_cast<vita2d_texture*>(texture);
+    vita2d_draw_texture_scale(
+            tex,
+            (float)x,
+            (float)y,
+            (float)w / vita2d_texture_get_width(tex),
+            (float)h / vita2d_texture_get_height(tex));
+}
+
 void pkgi_clip_set(int x, int y, int w, int h)
 {
     vita2d_enable_clipping();
@@ -811,6 +1060,17 @@ int pkgi_text_width(const char* text)
     return vita2d_pgf_text_width(g_font, 1.f, text);
 }
 
+uint32_t pkgi_font_serial(void)
+{
+    return g_font_serial;
+}
+
+DrawCounters pkgi_take_draw_counters()
+{
+    // counting would cost the frames it measures
+    return {};
+}
+
 int pkgi_text_height(const char* text)
 {
     PKGI_UNUSED(text);
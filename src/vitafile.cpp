@@ -41,6 +41,16 @@ void pkgi_mkdirs(const char* ppath)
     }
 }
 
+void pkgi_mkdir(const char* path)
+{
+    int err = sceIoMkdir(path, 0777);
+    if (err < 0 && err != PKGI_ERRNO_EEXIST)
+        throw std::runtime_error(fmt::format(
+                "新建文件夹 ({}) 失败:\n{:#08x}",
+                path,
+                static_cast<uint32_t>(err)));
+}
+
 void pkgi_rm(const char* file)
 {
     int err = sceIoRemove(file);
@@ -62,6 +72,22 @@ int64_t pkgi_get_size(const char* path)
     return stat.st_size;
 }
 
+uint64_t pkgi_get_mtime(const std::string& path)
+{
+    SceIoStat stat;
+    if (sceIoGetstat(path.c_str(), &stat) < 0)
+        return 0;
+    const auto& t = stat.st_mtime;
+    // only compared for equality, any order preserving packing does
+    uint64_t time = t.year;
+    time = time * 12 + t.month;
+    time = time * 31 + t.day;
+    time = time * 24 + t.hour;
+    time = time * 60 + t.minute;
+    time = time * 60 + t.second;
+    return time * 1000000 + t.microsecond;
+}
+
 InodeType pkgi_get_inode_type(const std::string& path)
 {
     SceIoStat stat;
@@ -112,6 +138,20 @@ void* pkgi_create(const std::string& path)
     return reinterpret_cast<void*>(fd);
 }
 
+void* pkgi_open(const char* path)
+{
+    LOG("sceIoOpen open on %s", path);
+    SceUID fd = sceIoOpen(path, SCE_O_RDONLY, 0777);
+    if (fd < 0)
+    {
+        LOG("cannot open %s, err=0x%08x", path, fd);
+        return NULL;
+    }
+    LOG("sceIoOpen returned fd=%d", fd);
+
+    return (void*)(intptr_t)fd;
+}
+
 void* pkgi_openrw(const char* path)
 {
     LOG("sceIoOpen openrw on %s", path);
@@ -169,6 +209,15 @@ int pkgi_write(void* f, const void* buffer, uint32_t size)
     return write;
 }
 
+void pkgi_preallocate(void* f, uint64_t size)
+{
+    SceIoStat stat{};
+    stat.st_size = size;
+    const int err = sceIoChstatByFd((SceUID)(intptr_t)f, &stat, SCE_CST_SIZE);
+    if (err < 0)
+        LOG("cannot preallocate %llu bytes, err=0x%08x", size, err);
+}
+
 void pkgi_close(void* f)
 {
     SceUID fd = (SceUID)(intptr_t)f;
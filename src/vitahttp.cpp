@@ -1,5 +1,8 @@
 #include "vitahttp.hpp"
 
+#include "httpoptions.hpp"
+#include "thread.hpp"
+
 #include <psp2/io/fcntl.h>
 #include <psp2/net/http.h>
 #include <psp2/net/net.h>
@@ -9,83 +12,301 @@
 
 #include <boost/scope_exit.hpp>
 
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #define PKGI_USER_AGENT "libhttp/3.65 (PS Vita)"
 
 struct pkgi_http
 {
     int used;
 
-    int tmpl;
+    std::string key;
     int conn;
     int req;
 };
 
 namespace
 {
-static pkgi_http g_http[4];
+// segmented downloads use up to 4 of these on their own
+static pkgi_http g_http[8];
+// connections are started from several threads at once, this also protects
+// the pool below
+static Mutex g_http_mutex("http_slots_mutex");
+
+// connections kept alive after their request was read to the end, so that the
+// next request to the same server skips the TCP and TLS handshakes
+static constexpr size_t MAX_IDLE_CONNECTIONS = 4;
+
+struct IdleConnection
+{
+    std::string key;
+    int conn;
+    // pkgi_time_msec() when it was put in the pool
+    uint32_t since;
+};
+
+static int g_tmpl = -1;
+// least recently used first
+static std::vector<IdleConnection> g_idle;
+// when each server was last warmed up by VitaHttp::prewarm()
+static std::unordered_map<std::string, uint32_t> g_warmed;
+
+// scheme and host (with port) of the url
+std::string connection_key(const std::string& url)
+{
+    const auto host = url.find("://");
+    if (host == std::string::npos)
+        return url;
+    return url.substr(0, url.find('/', host + 3));
+}
+
+int get_template()
+{
+    if (g_tmpl >= 0)
+        return g_tmpl;
+
+    const int tmpl = sceHttpCreateTemplate(
+            PKGI_USER_AGENT, SCE_HTTP_VERSION_1_1, SCE_TRUE);
+    if (tmpl < 0)
+        throw HttpError(fmt::format(
+                "创建模板失败: {:#08x}", static_cast<uint32_t>(tmpl)));
+    // the timeouts of each host are set on its connections and requests
+
+    g_tmpl = tmpl;
+    return g_tmpl;
+}
+
+// returns an idle connection to the server of url or -1, in which case a new
+// one must be created with the returned template
+int take_connection(const std::string& key, int& tmpl)
+{
+    std::lock_guard<Mutex> lock(g_http_mutex);
+    tmpl = get_template();
+    const auto now = pkgi_time_msec();
+    for (auto it = g_idle.rbegin(); it != g_idle.rend(); ++it)
+    {
+        if (it->key == key)
+        {
+            const int conn = it->conn;
+            const bool stale = now - it->since > VitaHttp::MAX_IDLE_TIME;
+            g_idle.erase(std::next(it).base());
+            if (!stale)
+                return conn;
+            sceHttpDeleteConnection(conn);
+            return -1;
+        }
+    }
+    return -1;
+}
+
+void release_connection(const std::string& key, int conn)
+{
+    std::lock_guard<Mutex> lock(g_http_mutex);
+    g_idle.push_back({key, conn, pkgi_time_msec()});
+    if (g_idle.size() > MAX_IDLE_CONNECTIONS)
+    {
+        sceHttpDeleteConnection(g_idle.front().conn);
+        g_idle.erase(g_idle.begin());
+    }
+}
 }
 
 VitaHttp::~VitaHttp()
 {
     if (_http)
     {
-        LOG("http close");
+        LOG_DEBUG("http close");
         sceHttpDeleteRequest(_http->req);
-        sceHttpDeleteConnection(_http->conn);
-        sceHttpDeleteTemplate(_http->tmpl);
+        if (_reusable && !_aborted)
+            release_connection(_http->key, _http->conn);
+        else
+            sceHttpDeleteConnection(_http->conn);
+        std::lock_guard<Mutex> lock(g_http_mutex);
         _http->used = 0;
     }
 }
 
+void VitaHttp::close_pool()
+{
+    std::lock_guard<Mutex> lock(g_http_mutex);
+    for (const auto& idle : g_idle)
+        sceHttpDeleteConnection(idle.conn);
+    g_idle.clear();
+    g_warmed.clear();
+    if (g_tmpl >= 0)
+        sceHttpDeleteTemplate(g_tmpl);
+    g_tmpl = -1;
+}
+
+void VitaHttp::prewarm(const std::string& url)
+{
+    const auto key = connection_key(url);
+    int tmpl;
+    {
+        std::lock_guard<Mutex> lock(g_http_mutex);
+        const auto now = pkgi_time_msec();
+        for (const auto& idle : g_idle)
+            if (idle.key == key && now - idle.since < MAX_IDLE_TIME)
+                return;
+        const auto warmed = g_warmed.find(key);
+        if (warmed != g_warmed.end() && now - warmed->second < PREWARM_TTL)
+            return;
+        g_warmed[key] = now;
+        tmpl = get_template();
+    }
+
+    pkgi_wait_network();
+    LOGF("warming up a connection to {}", key);
+    const auto options = pkgi_http_options(url);
+
+    const int conn =
+            sceHttpCreateConnectionWithURL(tmpl, url.c_str(), SCE_TRUE);
+    if (conn < 0)
+        throw HttpError(fmt::format(
+                "创建与链接的连接失败: {:#08x}", static_cast<uint32_t>(conn)));
+    bool pooled = false;
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        if (!pooled)
+            sceHttpDeleteConnection(conn);
+    };
+    sceHttpSetConnectTimeOut(conn, options.connect_timeout_ms * 1000);
+
+    {
+        const int req = sceHttpCreateRequestWithURL(
+                conn, SCE_HTTP_METHOD_HEAD, url.c_str(), 0);
+        if (req < 0)
+            throw HttpError(fmt::format(
+                    "创建链接的请求失败: {:#08x}",
+                    static_cast<uint32_t>(req)));
+        // the request must be gone before the connection goes to the pool
+        BOOST_SCOPE_EXIT_ALL(&)
+        {
+            sceHttpDeleteRequest(req);
+        };
+        sceHttpSetRecvTimeOut(req, options.recv_timeout_ms * 1000);
+
+        int err;
+        if ((err = sceHttpSendRequest(req, NULL, 0)) < 0)
+            throw HttpError(fmt::format(
+                    "发送请求失败: {:#08x}", static_cast<uint32_t>(err)));
+        // a HEAD response has no body, the connection is ready for the next
+        // request once its headers are in
+        int status;
+        if ((err = sceHttpGetStatusCode(req, &status)) < 0)
+            throw HttpError(fmt::format(
+                    "获取状态代码失败: {:#08x}", static_cast<uint32_t>(err)));
+        LOGF_DEBUG("warmed up {}, status {}", key, status);
+    }
+
+    release_connection(key, conn);
+    pooled = true;
+}
+
 void VitaHttp::start(const std::string& url, uint64_t offset)
+{
+    start_range(url, offset, 0);
+}
+
+void VitaHttp::start_range(
+        const std::string& url, uint64_t offset, uint64_t end)
 {
     if (_http)
         throw HttpError("HTTP连接已启动");
 
-    LOG("http get");
+    LOG_DEBUG("http get");
+    pkgi_wait_network();
 
     pkgi_http* http = NULL;
-    for (size_t i = 0; i < 4; i++)
     {
-        if (g_http[i].used == 0)
+        std::lock_guard<Mutex> lock(g_http_mutex);
+        for (size_t i = 0; i < PKGI_COUNTOF(g_http); i++)
         {
-            http = g_http + i;
-            break;
+            if (g_http[i].used == 0)
+            {
+                http = g_http + i;
+                http->used = 1;
+                break;
+            }
         }
     }
 
     if (!http)
         throw HttpError("内部错误: 同时发起的连接过多");
-
-    int tmpl = -1;
-    int conn = -1;
-    int req = -1;
-
-    LOGF("starting http GET request for {}", url);
-
-    if ((tmpl = sceHttpCreateTemplate(
-                 PKGI_USER_AGENT, SCE_HTTP_VERSION_1_1, SCE_TRUE)) < 0)
-        throw HttpError(fmt::format(
-                "创建模板失败: {:#08x}",
-                static_cast<uint32_t>(tmpl)));
     BOOST_SCOPE_EXIT_ALL(&)
     {
-        if (tmpl > 0)
-            sceHttpDeleteTemplate(tmpl);
+        if (!_http)
+        {
+            std::lock_guard<Mutex> lock(g_http_mutex);
+            http->used = 0;
+        }
     };
-    // sceHttpSetRecvTimeOut(tmpl, 10 * 1000 * 1000);
 
-    if ((conn = sceHttpCreateConnectionWithURL(tmpl, url.c_str(), SCE_FALSE)) <
-        0)
-        throw HttpError(fmt::format(
-                "创建与链接的连接失败: {:#08x}",
-                static_cast<uint32_t>(conn)));
-    BOOST_SCOPE_EXIT_ALL(&)
+    LOGF_DEBUG("starting http GET request for {}", url);
+
+    const auto key = connection_key(url);
+
+    // a pooled connection may have been closed by the server in the meantime,
+    // so a failure on one is retried once on a fresh connection
+    const auto options = pkgi_http_options(url);
+    int tmpl;
+    int conn = take_connection(key, tmpl);
+    bool reused = conn >= 0;
+    while (true)
     {
-        if (conn > 0)
+        if (conn < 0 && (conn = sceHttpCreateConnectionWithURL(
+                                 tmpl, url.c_str(), SCE_TRUE)) < 0)
+            throw HttpError(fmt::format(
+                    "创建与链接的连接失败: {:#08x}",
+                    static_cast<uint32_t>(conn)));
+        // a pooled connection keeps the timeout it was created with, they
+        // are pooled per host
+        if (!reused)
+            sceHttpSetConnectTimeOut(
+                    conn, options.connect_timeout_ms * 1000);
+        BOOST_SCOPE_EXIT_ALL(&)
+        {
+            if (conn >= 0 && !_http)
+                sceHttpDeleteConnection(conn);
+        };
+
+        try
+        {
+            http->req = send_request(conn, url, offset, end, options);
+        }
+        catch (const HttpError& e)
+        {
+            if (!reused)
+                throw;
+            LOGF("pooled connection failed, retrying: {}", e.what());
             sceHttpDeleteConnection(conn);
-    };
+            conn = -1;
+            reused = false;
+            continue;
+        }
 
+        if (reused)
+            LOGF_DEBUG("reusing connection to {}", key);
+
+        http->key = key;
+        http->conn = conn;
+        _http = http;
+        return;
+    }
+}
+
+int VitaHttp::send_request(
+        int conn,
+        const std::string& url,
+        uint64_t offset,
+        uint64_t end,
+        const HttpOptions& options)
+{
+    int req = -1;
     if ((req = sceHttpCreateRequestWithURL(
                  conn, SCE_HTTP_METHOD_GET, url.c_str(), 0)) < 0)
         throw HttpError(fmt::format(
@@ -93,16 +314,27 @@ void VitaHttp::start(const std::string& url, uint64_t offset)
                 static_cast<uint32_t>(req)));
     BOOST_SCOPE_EXIT_ALL(&)
     {
-        if (req > 0)
+        if (req >= 0)
             sceHttpDeleteRequest(req);
     };
 
     int err;
 
-    if (offset != 0)
+    // a stalled connection fails the read instead of hanging forever, the
+    // download then reconnects where it stopped
+    if ((err = sceHttpSetRecvTimeOut(req, options.recv_timeout_ms * 1000)) <
+        0)
+        LOGF("failed to set the receive timeout: {:#08x}",
+             static_cast<uint32_t>(err));
+
+    if (offset != 0 || end != 0)
     {
         char range[64];
-        pkgi_snprintf(range, sizeof(range), "bytes=%llu-", offset);
+        if (end != 0)
+            pkgi_snprintf(
+                    range, sizeof(range), "bytes=%llu-%llu", offset, end - 1);
+        else
+            pkgi_snprintf(range, sizeof(range), "bytes=%llu-", offset);
         if ((err = sceHttpAddRequestHeader(
                      req, "Range", range, SCE_HTTP_HEADER_ADD)) < 0)
             throw HttpError(fmt::format(
@@ -110,6 +342,16 @@ void VitaHttp::start(const std::string& url, uint64_t offset)
                     static_cast<uint32_t>(err)));
     }
 
+    for (const auto& header : _request_headers)
+        if ((err = sceHttpAddRequestHeader(
+                     req,
+                     header.first.c_str(),
+                     header.second.c_str(),
+                     SCE_HTTP_HEADER_ADD)) < 0)
+            throw HttpError(fmt::format(
+                    "添加请求文件头失败: {:#08x}",
+                    static_cast<uint32_t>(err)));
+
     if ((err = sceHttpSendRequest(req, NULL, 0)) < 0)
         throw formatEx<HttpError>(
                 "发送请求失败: {:#08x}\n{}",
@@ -119,13 +361,9 @@ void VitaHttp::start(const std::string& url, uint64_t offset)
                           "\n请更换HTTP链接"
                         : "");
 
-    http->used = 1;
-    http->tmpl = tmpl;
-    http->conn = conn;
-    http->req = req;
-    tmpl = conn = req = -1;
-
-    _http = http;
+    const int result = req;
+    req = -1;
+    return result;
 }
 
 int64_t VitaHttp::read(uint8_t* buffer, uint64_t size)
@@ -133,6 +371,8 @@ int64_t VitaHttp::read(uint8_t* buffer, uint64_t size)
     check_status();
 
     int read = sceHttpReadData(_http->req, buffer, size);
+    // only a response read to the end leaves the connection usable
+    _reusable = read == 0 && !_aborted;
     if (read < 0)
         throw HttpError(fmt::format(
                 "下载错误 {:#08x}",
@@ -142,6 +382,8 @@ int64_t VitaHttp::read(uint8_t* buffer, uint64_t size)
 
 void VitaHttp::abort()
 {
+    _aborted = true;
+    _reusable = false;
     if (_http)
     {
         const auto err = sceHttpAbortRequest(_http->req);
@@ -169,10 +411,35 @@ int64_t VitaHttp::get_length()
         return 0;
     }
 
-    LOGF("http response length = {}", content_length);
+    LOGF_DEBUG("http response length = {}", content_length);
     return content_length;
 }
 
+void VitaHttp::add_request_header(
+        const std::string& name, const std::string& value)
+{
+    _request_headers.emplace_back(name, value);
+}
+
+std::string VitaHttp::get_response_header(const std::string& name)
+{
+    char* headers;
+    unsigned int headers_size;
+    int res;
+    if ((res = sceHttpGetAllResponseHeaders(
+                 _http->req, &headers, &headers_size)) < 0)
+        throw HttpError(fmt::format(
+                "获取响应文件头失败: {:#08x}",
+                static_cast<uint32_t>(res)));
+
+    const char* value;
+    unsigned int value_size;
+    if (sceHttpParseResponseHeader(
+                headers, headers_size, name.c_str(), &value, &value_size) < 0)
+        return {};
+    return std::string(value, value_size);
+}
+
 int VitaHttp::get_status()
 {
     int res;
@@ -182,6 +449,10 @@ int VitaHttp::get_status()
                 "获取状态代码失败: {:#08x}",
                 static_cast<uint32_t>(res)));
 
+    // there is no body to read to the end
+    if (status == 304 && !_aborted)
+        _reusable = true;
+
     return status;
 }
 
@@ -193,7 +464,7 @@ void VitaHttp::check_status()
 
     const auto status = get_status();
 
-    LOGF("http status code = {}", status);
+    LOGF_DEBUG("http status code = {}", status);
 
     if (status != 200 && status != 206)
         throw HttpError(fmt::format("HTTP状态异常: {}", status));
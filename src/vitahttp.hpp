@@ -3,25 +3,62 @@
 #include "http.hpp"
 #include "pkgi.hpp"
 
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
 struct pkgi_http;
+struct HttpOptions;
 
 class VitaHttp : public Http
 {
 public:
     ~VitaHttp();
 
+    // drops the idle keep-alive connections, must be called before
+    // sceHttpTerm()
+    static void close_pool();
+    // opens a connection to the server of url with a HEAD request and leaves
+    // it in the pool, so that the next request to it finds the name resolved
+    // and the TCP and TLS handshakes done. Does nothing when the pool has one
+    // already or when the server was warmed up in the last PREWARM_TTL
+    static void prewarm(const std::string& url);
+
+    // in milliseconds, an idle connection older than this is closed instead
+    // of reused, the servers drop them after a while anyway
+    static constexpr uint32_t MAX_IDLE_TIME = 60 * 1000;
+    static constexpr uint32_t PREWARM_TTL = MAX_IDLE_TIME;
+
     void start(const std::string& url, uint64_t offset) override;
+    void start_range(const std::string& url, uint64_t offset, uint64_t end)
+            override;
     int64_t read(uint8_t* buffer, uint64_t size) override;
     void abort() override;
 
     int get_status() override;
     int64_t get_length() override;
 
+    void add_request_header(
+            const std::string& name, const std::string& value) override;
+    std::string get_response_header(const std::string& name) override;
+
     explicit operator bool() const override;
 
 private:
     pkgi_http* _http = nullptr;
     bool _status_checked = false;
+    // abort() comes from another thread than the reads, once aborted the
+    // connection is never given back to the pool
+    std::atomic<bool> _reusable{false};
+    std::atomic<bool> _aborted{false};
+    std::vector<std::pair<std::string, std::string>> _request_headers;
 
     void check_status();
+    int send_request(
+            int conn,
+            const std::string& url,
+            uint64_t offset,
+            uint64_t end,
+            const HttpOptions& options);
 };
@@ -0,0 +1,224 @@
+#include "netsocket.hpp"
+
+#include "log.hpp"
+#include "pkgi.hpp"
+
+#include <psp2/net/net.h>
+
+#include <boost/scope_exit.hpp>
+
+namespace
+{
+// how often a non blocking accept is tried again
+constexpr uint32_t ACCEPT_POLL_MS = 50;
+
+bool set_option(int socket, int level, int option, int value)
+{
+    const auto res =
+            sceNetSetsockopt(socket, level, option, &value, sizeof(value));
+    if (res < 0)
+    {
+        LOGF("setsockopt {} of {} failed: {:#08x}",
+             option,
+             socket,
+             static_cast<uint32_t>(res));
+        return false;
+    }
+    return true;
+}
+
+SceNetSockaddrIn any_address(uint16_t port)
+{
+    SceNetSockaddrIn addr{};
+    addr.sin_family = SCE_NET_AF_INET;
+    addr.sin_port = sceNetHtons(port);
+    addr.sin_addr.s_addr = sceNetHtonl(SCE_NET_INADDR_ANY);
+    return addr;
+}
+}
+
+int pkgi_udp_open_multicast(const char* group, uint16_t port)
+{
+    // the network comes up on its own thread while the app starts
+    pkgi_wait_network();
+    const auto socket = sceNetSocket(
+            "peer_udp",
+            SCE_NET_AF_INET,
+            SCE_NET_SOCK_DGRAM,
+            SCE_NET_IPPROTO_UDP);
+    if (socket < 0)
+        return socket;
+    bool ok = false;
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        if (!ok)
+            sceNetSocketClose(socket);
+    };
+
+    // the log listeners of the other tools may have the port too
+    set_option(socket, SCE_NET_SOL_SOCKET, SCE_NET_SO_REUSEADDR, 1);
+    auto addr = any_address(port);
+    auto res = sceNetBind(socket, (SceNetSockaddr*)&addr, sizeof(addr));
+    if (res < 0)
+    {
+        LOGF("bind of port {} failed: {:#08x}",
+             port,
+             static_cast<uint32_t>(res));
+        return res;
+    }
+
+    SceNetIpMreq membership{};
+    sceNetInetPton(SCE_NET_AF_INET, group, &membership.imr_multiaddr);
+    membership.imr_interface.s_addr = sceNetHtonl(SCE_NET_INADDR_ANY);
+    res = sceNetSetsockopt(
+            socket,
+            SCE_NET_IPPROTO_IP,
+            SCE_NET_IP_ADD_MEMBERSHIP,
+            &membership,
+            sizeof(membership));
+    if (res < 0)
+    {
+        LOGF("joining {} failed: {:#08x}", group, static_cast<uint32_t>(res));
+        return res;
+    }
+
+    ok = true;
+    return socket;
+}
+
+bool pkgi_udp_send(
+        int socket,
+        const char* ip,
+        uint16_t port,
+        const void* data,
+        uint32_t size)
+{
+    SceNetSockaddrIn addr{};
+    addr.sin_family = SCE_NET_AF_INET;
+    addr.sin_port = sceNetHtons(port);
+    sceNetInetPton(SCE_NET_AF_INET, ip, &addr.sin_addr);
+    return sceNetSendto(
+                   socket,
+                   data,
+                   size,
+                   0,
+                   (SceNetSockaddr*)&addr,
+                   sizeof(addr)) == static_cast<int>(size);
+}
+
+int pkgi_udp_receive(
+        int socket,
+        void* data,
+        uint32_t size,
+        uint32_t timeout_ms,
+        std::string& from)
+{
+    // in microseconds
+    set_option(
+            socket, SCE_NET_SOL_SOCKET, SCE_NET_SO_RCVTIMEO, timeout_ms * 1000);
+    SceNetSockaddrIn addr{};
+    unsigned int addr_size = sizeof(addr);
+    const auto res = sceNetRecvfrom(
+            socket, data, size, 0, (SceNetSockaddr*)&addr, &addr_size);
+    if (res <= 0)
+        return 0;
+
+    char ip[16];
+    sceNetInetNtop(SCE_NET_AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    from = ip;
+    return res;
+}
+
+int pkgi_tcp_listen(uint16_t port)
+{
+    // the network comes up on its own thread while the app starts
+    pkgi_wait_network();
+    const auto socket = sceNetSocket(
+            "peer_http",
+            SCE_NET_AF_INET,
+            SCE_NET_SOCK_STREAM,
+            SCE_NET_IPPROTO_TCP);
+    if (socket < 0)
+        return socket;
+    bool ok = false;
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        if (!ok)
+            sceNetSocketClose(socket);
+    };
+
+    set_option(socket, SCE_NET_SOL_SOCKET, SCE_NET_SO_REUSEADDR, 1);
+    // so that accept can give up
+    set_option(socket, SCE_NET_SOL_SOCKET, SCE_NET_SO_NBIO, 1);
+    auto addr = any_address(port);
+    auto res = sceNetBind(socket, (SceNetSockaddr*)&addr, sizeof(addr));
+    if (res < 0)
+    {
+        LOGF("bind of port {} failed: {:#08x}",
+             port,
+             static_cast<uint32_t>(res));
+        return res;
+    }
+    res = sceNetListen(socket, 8);
+    if (res < 0)
+    {
+        LOGF("listen on port {} failed: {:#08x}",
+             port,
+             static_cast<uint32_t>(res));
+        return res;
+    }
+
+    ok = true;
+    return socket;
+}
+
+int pkgi_tcp_accept(
+        int socket, uint32_t timeout_ms, uint32_t receive_timeout_ms)
+{
+    const uint32_t until = pkgi_time_msec() + timeout_ms;
+    while (true)
+    {
+        SceNetSockaddrIn addr{};
+        unsigned int addr_size = sizeof(addr);
+        const auto client =
+                sceNetAccept(socket, (SceNetSockaddr*)&addr, &addr_size);
+        if (client >= 0)
+        {
+            // the non blocking mode of the listening socket is inherited
+            set_option(client, SCE_NET_SOL_SOCKET, SCE_NET_SO_NBIO, 0);
+            set_option(
+                    client,
+                    SCE_NET_SOL_SOCKET,
+                    SCE_NET_SO_RCVTIMEO,
+                    receive_timeout_ms * 1000);
+            return client;
+        }
+        if (static_cast<int32_t>(until - pkgi_time_msec()) <= 0)
+            return client;
+        pkgi_sleep(ACCEPT_POLL_MS);
+    }
+}
+
+bool pkgi_tcp_send(int socket, const void* data, uint32_t size)
+{
+    auto bytes = static_cast<const uint8_t*>(data);
+    while (size != 0)
+    {
+        const auto sent = sceNetSend(socket, bytes, size, 0);
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+int pkgi_tcp_receive(int socket, void* data, uint32_t size)
+{
+    return sceNetRecv(socket, data, size, 0);
+}
+
+void pkgi_socket_close(int socket)
+{
+    sceNetSocketClose(socket);
+}
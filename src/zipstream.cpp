@@ -0,0 +1,303 @@
+#include "zipstream.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <zlib.h>
+
+namespace
+{
+constexpr uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+constexpr uint32_t CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+constexpr uint32_t END_SIGNATURE = 0x06054b50;
+constexpr uint32_t DESCRIPTOR_SIGNATURE = 0x08074b50;
+
+constexpr size_t LOCAL_HEADER_SIZE = 30;
+constexpr uint16_t FLAG_DESCRIPTOR = 0x8;
+constexpr uint16_t ZIP64_EXTRA = 0x1;
+constexpr uint16_t METHOD_STORED = 0;
+constexpr uint16_t METHOD_DEFLATED = 8;
+
+constexpr uint32_t OUTPUT_SIZE = 64 * 1024;
+
+// the names come from the network, they must stay under dest
+bool is_safe(const std::string& name)
+{
+    if (name.empty() || name[0] == '/' ||
+        name.find('\\') != std::string::npos ||
+        name.find(':') != std::string::npos)
+        return false;
+    size_t pos = 0;
+    while (pos <= name.size())
+    {
+        auto end = name.find('/', pos);
+        if (end == std::string::npos)
+            end = name.size();
+        if (name.compare(pos, end - pos, "..") == 0)
+            return false;
+        pos = end + 1;
+    }
+    return true;
+}
+}
+
+ZipStreamExtractor::ZipStreamExtractor(std::string dest)
+    : _dest(std::move(dest))
+    , _wanted(4)
+    , _stream(std::make_unique<z_stream>())
+    , _output(OUTPUT_SIZE)
+{
+    // negative window bits, the entries are raw deflate streams
+    const auto err = inflateInit2(_stream.get(), -MAX_WBITS);
+    if (err != Z_OK)
+        throw formatEx<std::runtime_error>("无法初始化解压: {}", err);
+}
+
+ZipStreamExtractor::~ZipStreamExtractor()
+{
+    close_file();
+    inflateEnd(_stream.get());
+}
+
+size_t ZipStreamExtractor::take_header(const uint8_t* data, size_t size)
+{
+    const auto used = std::min(size, _wanted - _header.size());
+    _header.insert(_header.end(), data, data + used);
+    return used;
+}
+
+void ZipStreamExtractor::write(const uint8_t* data, uint32_t size)
+{
+    while (size > 0)
+    {
+        size_t used = 0;
+        switch (_state)
+        {
+        case State::Header:
+            used = take_header(data, size);
+            if (_header.size() < _wanted)
+                break;
+            if (_wanted == 4)
+            {
+                const auto signature = get32le(_header.data());
+                if (signature == LOCAL_HEADER_SIGNATURE)
+                    _wanted = LOCAL_HEADER_SIZE;
+                else if (
+                        signature == CENTRAL_HEADER_SIGNATURE ||
+                        signature == END_SIGNATURE)
+                    _state = State::Directory;
+                else
+                    throw formatEx<std::runtime_error>(
+                            "压缩文件已损坏: 未知的标记 {:#08x}", signature);
+                break;
+            }
+            _flags = get16le(_header.data() + 6);
+            _method = get16le(_header.data() + 8);
+            _crc = get32le(_header.data() + 14);
+            _compressed_size = get32le(_header.data() + 18);
+            _size = get32le(_header.data() + 22);
+            _wanted = LOCAL_HEADER_SIZE + get16le(_header.data() + 26) +
+                      get16le(_header.data() + 28);
+            _state = State::Name;
+            break;
+        case State::Name:
+            used = take_header(data, size);
+            if (_header.size() < _wanted)
+                break;
+            start_entry();
+            break;
+        case State::Stored:
+            used = std::min<uint64_t>(size, _left);
+            write_entry(data, used);
+            _left -= used;
+            if (_left == 0)
+                end_data();
+            break;
+        case State::Deflated:
+        {
+            _stream->next_in = const_cast<uint8_t*>(data);
+            _stream->avail_in = size;
+            while (true)
+            {
+                _stream->next_out = _output.data();
+                _stream->avail_out = _output.size();
+                const auto err = inflate(_stream.get(), Z_NO_FLUSH);
+                if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR)
+                    throw formatEx<std::runtime_error>(
+                            "{} 解压失败: {}",
+                            _name,
+                            _stream->msg ? _stream->msg : "");
+                write_entry(
+                        _output.data(), _output.size() - _stream->avail_out);
+                if (err == Z_STREAM_END)
+                {
+                    end_data();
+                    break;
+                }
+                if (err == Z_BUF_ERROR ||
+                    (_stream->avail_in == 0 && _stream->avail_out != 0))
+                    break;
+            }
+            used = size - _stream->avail_in;
+            break;
+        }
+        case State::Descriptor:
+        {
+            used = take_header(data, size);
+            if (_header.size() < _wanted)
+                break;
+            const size_t fields = _zip64 ? 20 : 12;
+            if (_wanted == 4)
+            {
+                // the signature is optional
+                _wanted = get32le(_header.data()) == DESCRIPTOR_SIGNATURE
+                                  ? 4 + fields
+                                  : fields;
+                if (_header.size() < _wanted)
+                    break;
+            }
+            const auto fields_data = _header.data() + _wanted - fields;
+            _crc = get32le(fields_data);
+            _size = _zip64 ? get64le(fields_data + 12)
+                           : get32le(fields_data + 8);
+            end_entry();
+            break;
+        }
+        case State::Directory:
+            // the central directory only repeats the local headers
+            used = size;
+            break;
+        }
+        data += used;
+        size -= used;
+    }
+}
+
+void ZipStreamExtractor::start_entry()
+{
+    const auto name_size = get16le(_header.data() + 26);
+    _name.assign(
+            reinterpret_cast<const char*>(_header.data()) + LOCAL_HEADER_SIZE,
+            name_size);
+    if (!is_safe(_name))
+        throw formatEx<std::runtime_error>("不支持的压缩文件: 文件名称 {}", _name);
+
+    // the real sizes of a zip64 entry are in its extra field
+    _zip64 = false;
+    const auto extra_end = _header.data() + _header.size();
+    auto extra = _header.data() + LOCAL_HEADER_SIZE + name_size;
+    while (extra_end - extra >= 4)
+    {
+        const auto id = get16le(extra);
+        const auto extra_size = get16le(extra + 2);
+        auto field = extra + 4;
+        if (id == ZIP64_EXTRA && extra_end - field >= extra_size)
+        {
+            _zip64 = true;
+            const auto field_end = field + extra_size;
+            if (_size == 0xffffffff && field_end - field >= 8)
+            {
+                _size = get64le(field);
+                field += 8;
+            }
+            if (_compressed_size == 0xffffffff && field_end - field >= 8)
+                _compressed_size = get64le(field);
+        }
+        extra += 4 + extra_size;
+    }
+
+    // some writers give directories a data part too (an empty deflate stream,
+    // a data descriptor), it is read and checked like a file's but not written
+    const auto directory = _name.back() == '/';
+    if (_method == METHOD_STORED && (_flags & FLAG_DESCRIPTOR) &&
+        !(directory && _compressed_size == 0))
+        throw formatEx<std::runtime_error>(
+                "不支持的压缩文件: {} 的大小未知", _name);
+    if (_method != METHOD_STORED && _method != METHOD_DEFLATED)
+        throw formatEx<std::runtime_error>(
+                "不支持的压缩方式 {}: {}", _method, _name);
+
+    const auto path = fmt::format("{}/{}", _dest, _name);
+    if (directory)
+    {
+        LOGF_DEBUG("creating directory {}", _name);
+        pkgi_mkdirs(path.c_str());
+    }
+    else
+    {
+        LOGF_DEBUG("uncompressing file {}", _name);
+        const auto slash = path.rfind('/');
+        pkgi_mkdirs(path.substr(0, slash).c_str());
+        _file = pkgi_create(path);
+        if (!_file)
+            throw formatEx<std::runtime_error>("无法打开文件 {}", _name);
+    }
+
+    _actual_crc = crc32(0, nullptr, 0);
+    _written = 0;
+    if (_method == METHOD_STORED)
+    {
+        _left = _compressed_size;
+        _state = State::Stored;
+        if (_left == 0)
+            end_data();
+    }
+    else
+    {
+        inflateReset(_stream.get());
+        _state = State::Deflated;
+    }
+}
+
+void ZipStreamExtractor::write_entry(const uint8_t* data, uint32_t size)
+{
+    if (size == 0)
+        return;
+    _actual_crc = crc32(_actual_crc, data, size);
+    _written += size;
+    if (_file && pkgi_write(_file, data, size) < 0)
+        throw formatEx<std::runtime_error>("无法写入文件 {}", _name);
+}
+
+void ZipStreamExtractor::end_data()
+{
+    if (_flags & FLAG_DESCRIPTOR)
+    {
+        _header.clear();
+        _wanted = 4;
+        _state = State::Descriptor;
+    }
+    else
+        end_entry();
+}
+
+void ZipStreamExtractor::end_entry()
+{
+    close_file();
+    if (_written != _size || _actual_crc != _crc)
+        throw formatEx<std::runtime_error>("压缩文件已损坏: {} 校验失败", _name);
+    _header.clear();
+    _wanted = 4;
+    _state = State::Header;
+}
+
+void ZipStreamExtractor::close_file()
+{
+    if (_file)
+        pkgi_close(_file);
+    _file = nullptr;
+}
+
+void ZipStreamExtractor::finish()
+{
+    if (_state != State::Directory &&
+        (_state != State::Header || !_header.empty()))
+        throw std::runtime_error(
+                "压缩数据不完整, 请检查网络连接是否异常, 然后重试");
+}
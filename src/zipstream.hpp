@@ -0,0 +1,73 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+typedef struct z_stream_s z_stream;
+
+// Extracts a zip file fed in order, as it comes from the network, without
+// the central directory at its end. The entries are read from their local
+// headers, stored or deflated, each one checked against its crc. An entry
+// stored with its sizes after its data can't be split from the next one and
+// is refused.
+class ZipStreamExtractor
+{
+public:
+    ZipStreamExtractor(const ZipStreamExtractor&) = delete;
+    ZipStreamExtractor(ZipStreamExtractor&&) = delete;
+    ZipStreamExtractor& operator=(const ZipStreamExtractor&) = delete;
+    ZipStreamExtractor& operator=(ZipStreamExtractor&&) = delete;
+
+    // the entries are written under dest, which must exist
+    ZipStreamExtractor(std::string dest);
+    ~ZipStreamExtractor();
+
+    void write(const uint8_t* data, uint32_t size);
+    // throws if the zip ended in the middle of an entry
+    void finish();
+
+private:
+    enum class State
+    {
+        Header,
+        Name,
+        Stored,
+        Deflated,
+        Descriptor,
+        Directory,
+    };
+
+    std::string _dest;
+    State _state = State::Header;
+    // bytes of a header read so far
+    std::vector<uint8_t> _header;
+    size_t _wanted = 0;
+
+    // current entry
+    std::string _name;
+    uint16_t _flags = 0;
+    uint16_t _method = 0;
+    uint32_t _crc = 0;
+    uint64_t _compressed_size = 0;
+    uint64_t _size = 0;
+    bool _zip64 = false;
+    uint64_t _left = 0;
+    uint32_t _actual_crc = 0;
+    uint64_t _written = 0;
+    void* _file = nullptr;
+
+    std::unique_ptr<z_stream> _stream;
+    std::vector<uint8_t> _output;
+
+    // how many bytes of data were used
+    size_t take_header(const uint8_t* data, size_t size);
+    void start_entry();
+    void write_entry(const uint8_t* data, uint32_t size);
+    // reads the data descriptor if there is one
+    void end_data();
+    void end_entry();
+    void close_file();
+};